@@ -481,6 +481,75 @@ void update_benchmark(const char *fmt, ...)
     }
 }
 
+int64_t stage_time_start(void)
+{
+    return do_benchmark ? av_gettime_relative() : 0;
+}
+
+void stage_time_add(atomic_uint_least64_t *total, int64_t start)
+{
+    if (do_benchmark)
+        atomic_fetch_add(total, av_gettime_relative() - start);
+}
+
+static void print_stage_times_script(AVBPrint *buf_script)
+{
+    for (int i = 0; i < nb_input_files; i++)
+        av_bprintf(buf_script, "input_%d_demux_time_us=%"PRIu64"\n",
+                   i, atomic_load(&input_files[i]->demux_time));
+    for (InputStream *ist = ist_iter(NULL); ist; ist = ist_iter(ist)) {
+        if (!ist->decoding_needed)
+            continue;
+        av_bprintf(buf_script, "input_stream_%d_%d_dec_time_us=%"PRIu64"\n",
+                   ist->file_index, ist->st->index, atomic_load(&ist->dec_time));
+    }
+    for (int i = 0; i < nb_filtergraphs; i++)
+        av_bprintf(buf_script, "filtergraph_%d_time_us=%"PRIu64"\n",
+                   i, atomic_load(&filtergraphs[i]->filter_time));
+    for (OutputStream *ost = ost_iter(NULL); ost; ost = ost_iter(ost)) {
+        if (ost->enc)
+            av_bprintf(buf_script, "stream_%d_%d_enc_time_us=%"PRIu64"\n",
+                       ost->file_index, ost->index, atomic_load(&ost->enc_time));
+        av_bprintf(buf_script, "stream_%d_%d_mux_time_us=%"PRIu64"\n",
+                   ost->file_index, ost->index, atomic_load(&ost->mux_time));
+    }
+}
+
+/* print the time spent in each stage, after all the threads have finished */
+static void print_stage_times(void)
+{
+    for (int i = 0; i < nb_input_files; i++)
+        av_log(NULL, AV_LOG_INFO, "bench: demux input #%d: %0.3fs\n",
+               i, atomic_load(&input_files[i]->demux_time) / 1000000.0);
+    for (InputStream *ist = ist_iter(NULL); ist; ist = ist_iter(ist)) {
+        double t = atomic_load(&ist->dec_time) / 1000000.0;
+
+        if (!ist->decoding_needed)
+            continue;
+        av_log(NULL, AV_LOG_INFO, "bench: decode stream #%d:%d: %0.3fs, "
+               "%"PRIu64" frames (%0.1f fps)\n", ist->file_index, ist->st->index,
+               t, ist->frames_decoded, t > 0 ? ist->frames_decoded / t : 0);
+    }
+    for (int i = 0; i < nb_filtergraphs; i++)
+        av_log(NULL, AV_LOG_INFO, "bench: filter graph #%d: %0.3fs\n",
+               i, atomic_load(&filtergraphs[i]->filter_time) / 1000000.0);
+    for (OutputStream *ost = ost_iter(NULL); ost; ost = ost_iter(ost)) {
+        uint64_t packets_written = atomic_load(&ost->packets_written);
+        double t;
+
+        if (ost->enc) {
+            t = atomic_load(&ost->enc_time) / 1000000.0;
+            av_log(NULL, AV_LOG_INFO, "bench: encode stream #%d:%d: %0.3fs, "
+                   "%"PRIu64" frames (%0.1f fps)\n", ost->file_index, ost->index,
+                   t, ost->frames_encoded, t > 0 ? ost->frames_encoded / t : 0);
+        }
+        t = atomic_load(&ost->mux_time) / 1000000.0;
+        av_log(NULL, AV_LOG_INFO, "bench: mux stream #%d:%d: %0.3fs, "
+               "%"PRIu64" packets\n", ost->file_index, ost->index,
+               t, packets_written);
+    }
+}
+
 void close_output_stream(OutputStream *ost)
 {
     OutputFile *of = output_files[ost->file_index];
@@ -620,6 +689,9 @@ static void print_report(int is_last_report, int64_t timer_start, int64_t cur_ti
         av_bprintf(&buf_script, "speed=%4.3gx\n", speed);
     }
 
+    if (do_benchmark)
+        print_stage_times_script(&buf_script);
+
     if (print_stats || is_last_report) {
         const char end = is_last_report ? '\n' : '\r';
         if (print_stats==1 && AV_LOG_INFO > av_log_get_level()) {
@@ -1341,6 +1413,7 @@ int main(int argc, char **argv)
         av_log(NULL, AV_LOG_INFO,
                "bench: utime=%0.3fs stime=%0.3fs rtime=%0.3fs\n",
                utime / 1000000.0, stime / 1000000.0, rtime / 1000000.0);
+        print_stage_times();
     }
 
     ret = received_nb_signals ? 255 :
@@ -318,6 +318,9 @@ typedef struct FilterGraph {
     // that do not modify the frame data
     int is_meta;
 
+    // wallclock time spent filtering, in microseconds (-benchmark only)
+    atomic_uint_least64_t filter_time;
+
     InputFilter   **inputs;
     int          nb_inputs;
     OutputFilter **outputs;
@@ -402,6 +405,8 @@ typedef struct InputStream {
     uint64_t frames_decoded;
     uint64_t samples_decoded;
     uint64_t decode_errors;
+    // wallclock time spent decoding, in microseconds (-benchmark only)
+    atomic_uint_least64_t dec_time;
 } InputStream;
 
 typedef struct LastFrameDuration {
@@ -443,6 +448,9 @@ typedef struct InputFile {
      * the last frame duration back to the demuxer thread */
     AVThreadMessageQueue *audio_duration_queue;
     int                   audio_duration_queue_size;
+
+    // wallclock time spent demuxing, in microseconds (-benchmark only)
+    atomic_uint_least64_t demux_time;
 } InputFile;
 
 enum forced_keyframes_const {
@@ -612,6 +620,10 @@ typedef struct OutputStream {
     // number of frames/samples sent to the encoder
     uint64_t frames_encoded;
     uint64_t samples_encoded;
+    // wallclock time spent encoding and muxing, in microseconds
+    // (-benchmark only)
+    atomic_uint_least64_t enc_time;
+    atomic_uint_least64_t mux_time;
 
     /* packet quality factor */
     int quality;
@@ -693,6 +705,8 @@ extern float max_error_rate;
 
 extern char *filter_nbthreads;
 extern int filter_complex_nbthreads;
+extern int threads_total;
+extern int threads_per_codec;
 extern int vstats_version;
 extern int auto_conversion_filters;
 
@@ -888,6 +902,14 @@ int trigger_fix_sub_duration_heartbeat(OutputStream *ost, const AVPacket *pkt);
 int process_subtitle(InputStream *ist, AVSubtitle *subtitle, int *got_output);
 void update_benchmark(const char *fmt, ...);
 
+/**
+ * Per-stage timing for -benchmark. stage_time_start() returns the start time
+ * of a stage, stage_time_add() adds the time elapsed since then to total.
+ * Both are no-ops when -benchmark is not given.
+ */
+int64_t stage_time_start(void);
+void stage_time_add(atomic_uint_least64_t *total, int64_t start);
+
 /**
  * Merge two return codes - return one of the error codes if at least one of
  * them was negative, 0 otherwise.
@@ -586,8 +586,10 @@ static void *input_thread(void *arg)
 
     while (1) {
         DemuxMsg msg = { NULL };
+        int64_t t = stage_time_start();
 
         ret = av_read_frame(f->ctx, pkt);
+        stage_time_add(&f->demux_time, t);
 
         if (ret == AVERROR(EAGAIN)) {
             av_usleep(10000);
@@ -864,7 +866,8 @@ static int ist_use(InputStream *ist, int decoding_needed)
     ist->decoding_needed |= decoding_needed;
     ds->streamcopy_needed |= !decoding_needed;
 
-    if (decoding_needed && !avcodec_is_open(ist->dec_ctx)) {
+    // with -threads_total the decoders are opened once all outputs are known
+    if (decoding_needed && !avcodec_is_open(ist->dec_ctx) && threads_total <= 0) {
         int ret = dec_open(ist);
         if (ret < 0)
             return ret;
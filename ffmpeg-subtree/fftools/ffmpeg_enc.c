@@ -20,6 +20,8 @@
 #include <stdint.h>
 
 #include "ffmpeg.h"
+#include "objpool.h"
+#include "thread_queue.h"
 
 #include "libavutil/avassert.h"
 #include "libavutil/avstring.h"
@@ -32,6 +34,7 @@
 #include "libavutil/log.h"
 #include "libavutil/pixdesc.h"
 #include "libavutil/rational.h"
+#include "libavutil/thread.h"
 #include "libavutil/timestamp.h"
 
 #include "libavfilter/buffersink.h"
@@ -67,10 +70,56 @@ struct Encoder {
     uint64_t packets_encoded;
 
     int opened;
+
+    pthread_t       thread;
+    /**
+     * Queue for sending frames from the main thread to the encoder thread.
+     * The encoder is flushed when the queue is finished.
+     */
+    ThreadQueue    *queue_in;
+    /**
+     * Queue for sending encoded packets from the encoder thread
+     * to the main thread.
+     *
+     * An empty packet is sent to signal that a single frame has been fully
+     * processed.
+     */
+    ThreadQueue    *queue_out;
+
+    // frame for sending to the encoder thread
+    AVFrame        *thread_frame;
+
+    // number of frames sent to the encoder thread that were not fully
+    // processed yet
+    int             frames_in_flight;
 };
 
+// data that is local to the encoder thread and not visible outside of it
+typedef struct EncThreadContext {
+    AVFrame         *frame;
+    AVPacket        *pkt;
+} EncThreadContext;
+
 static uint64_t dup_warning = 1000;
 
+static int enc_thread_stop(Encoder *e)
+{
+    void *ret;
+
+    if (!e->queue_in)
+        return 0;
+
+    tq_send_finish(e->queue_in, 0);
+    tq_receive_finish(e->queue_out, 0);
+
+    pthread_join(e->thread, &ret);
+
+    tq_free(&e->queue_in);
+    tq_free(&e->queue_out);
+
+    return (intptr_t)ret;
+}
+
 void enc_free(Encoder **penc)
 {
     Encoder *enc = *penc;
@@ -78,8 +127,11 @@ void enc_free(Encoder **penc)
     if (!enc)
         return;
 
+    enc_thread_stop(enc);
+
     av_frame_free(&enc->last_frame);
     av_frame_free(&enc->sq_frame);
+    av_frame_free(&enc->thread_frame);
 
     av_packet_free(&enc->pkt);
 
@@ -106,6 +158,12 @@ int enc_alloc(Encoder **penc, const AVCodec *codec)
     if (!enc->pkt)
         goto fail;
 
+    if (codec->type == AVMEDIA_TYPE_VIDEO || codec->type == AVMEDIA_TYPE_AUDIO) {
+        enc->thread_frame = av_frame_alloc();
+        if (!enc->thread_frame)
+            goto fail;
+    }
+
     *penc = enc;
 
     return 0;
@@ -188,6 +246,207 @@ static void set_encoder_id(OutputFile *of, OutputStream *ost)
                 AV_DICT_DONT_STRDUP_VAL | AV_DICT_DONT_OVERWRITE);
 }
 
+static int frame_encode(OutputStream *ost, AVFrame *frame, AVPacket *pkt)
+{
+    Encoder            *e = ost->enc;
+    AVCodecContext   *enc = ost->enc_ctx;
+    const char *type_desc = av_get_media_type_string(enc->codec_type);
+    const char    *action = frame ? "encode" : "flush";
+    int64_t t;
+    int ret;
+
+    if (frame && enc->codec_type == AVMEDIA_TYPE_VIDEO &&
+        frame->sample_aspect_ratio.num && !ost->frame_aspect_ratio.num)
+        enc->sample_aspect_ratio = frame->sample_aspect_ratio;
+
+    update_benchmark(NULL);
+
+    t   = stage_time_start();
+    ret = avcodec_send_frame(enc, frame);
+    stage_time_add(&ost->enc_time, t);
+    if (ret < 0 && !(ret == AVERROR_EOF && !frame)) {
+        av_log(ost, AV_LOG_ERROR, "Error submitting %s frame to the encoder\n",
+               type_desc);
+        return ret;
+    }
+
+    while (1) {
+        t   = stage_time_start();
+        ret = avcodec_receive_packet(enc, pkt);
+        stage_time_add(&ost->enc_time, t);
+        update_benchmark("%s_%s %d.%d", action, type_desc,
+                         ost->file_index, ost->index);
+
+        pkt->time_base = enc->time_base;
+
+        /* if two pass, output log on success and EOF */
+        if ((ret >= 0 || ret == AVERROR_EOF) && ost->logfile && enc->stats_out)
+            fprintf(ost->logfile, "%s", enc->stats_out);
+
+        if (ret == AVERROR(EAGAIN)) {
+            av_assert0(frame); // should never happen during flushing
+            return 0;
+        } else if (ret < 0) {
+            if (ret != AVERROR_EOF)
+                av_log(ost, AV_LOG_ERROR, "%s encoding failed\n", type_desc);
+            return ret;
+        }
+
+        // an empty packet marks the end of a frame for the main thread
+        if (!pkt->buf && !pkt->side_data_elems) {
+            av_packet_unref(pkt);
+            continue;
+        }
+
+        ret = tq_send(e->queue_out, 0, pkt);
+        if (ret < 0)
+            return ret;
+    }
+}
+
+static void enc_thread_set_name(const OutputStream *ost)
+{
+    char name[16];
+    snprintf(name, sizeof(name), "enc%d:%d:%s", ost->file_index, ost->index,
+             ost->enc_ctx->codec->name);
+    ff_thread_setname(name);
+}
+
+static void enc_thread_uninit(EncThreadContext *et)
+{
+    av_packet_free(&et->pkt);
+    av_frame_free(&et->frame);
+
+    memset(et, 0, sizeof(*et));
+}
+
+static int enc_thread_init(EncThreadContext *et)
+{
+    memset(et, 0, sizeof(*et));
+
+    et->frame = av_frame_alloc();
+    if (!et->frame)
+        goto fail;
+
+    et->pkt = av_packet_alloc();
+    if (!et->pkt)
+        goto fail;
+
+    return 0;
+
+fail:
+    enc_thread_uninit(et);
+    return AVERROR(ENOMEM);
+}
+
+static void *encoder_thread(void *arg)
+{
+    OutputStream *ost = arg;
+    Encoder        *e = ost->enc;
+    EncThreadContext et;
+    int ret = 0, input_status = 0;
+
+    ret = enc_thread_init(&et);
+    if (ret < 0)
+        goto finish;
+
+    enc_thread_set_name(ost);
+
+    while (!input_status) {
+        int dummy;
+
+        input_status = tq_receive(e->queue_in, &dummy, et.frame);
+        if (input_status < 0)
+            av_log(ost, AV_LOG_VERBOSE, "Encoder thread received EOF\n");
+
+        ret = frame_encode(ost, input_status >= 0 ? et.frame : NULL, et.pkt);
+
+        av_packet_unref(et.pkt);
+        av_frame_unref(et.frame);
+
+        if (ret < 0) {
+            if (ret != AVERROR_EOF)
+                av_log(ost, AV_LOG_ERROR, "Error encoding a frame: %s\n",
+                       av_err2str(ret));
+            break;
+        }
+
+        // signal to the main thread that the entire frame was processed
+        ret = tq_send(e->queue_out, 0, et.pkt);
+        if (ret < 0) {
+            if (ret != AVERROR_EOF)
+                av_log(ost, AV_LOG_ERROR, "Error communicating with the main thread\n");
+            break;
+        }
+    }
+
+    // EOF is normal thread termination
+    if (ret == AVERROR_EOF)
+        ret = 0;
+
+finish:
+    tq_receive_finish(e->queue_in,  0);
+    tq_send_finish   (e->queue_out, 0);
+
+    enc_thread_uninit(&et);
+
+    av_log(ost, AV_LOG_VERBOSE, "Terminating encoder thread\n");
+
+    return (void*)(intptr_t)ret;
+}
+
+static void pkt_move(void *dst, void *src)
+{
+    av_packet_move_ref(dst, src);
+}
+
+static void frame_move(void *dst, void *src)
+{
+    av_frame_move_ref(dst, src);
+}
+
+static int enc_thread_start(OutputStream *ost)
+{
+    Encoder *e = ost->enc;
+    ObjPool *op;
+    int ret = 0;
+
+    op = objpool_alloc_frames();
+    if (!op)
+        return AVERROR(ENOMEM);
+
+    e->queue_in = tq_alloc(1, 1, op, frame_move);
+    if (!e->queue_in) {
+        objpool_free(&op);
+        goto fail;
+    }
+
+    op = objpool_alloc_packets();
+    if (!op)
+        goto fail;
+
+    e->queue_out = tq_alloc(1, 8, op, pkt_move);
+    if (!e->queue_out) {
+        objpool_free(&op);
+        goto fail;
+    }
+
+    ret = pthread_create(&e->thread, NULL, encoder_thread, ost);
+    if (ret) {
+        ret = AVERROR(ret);
+        goto fail;
+    }
+
+    return 0;
+fail:
+    if (ret >= 0)
+        ret = AVERROR(ENOMEM);
+
+    tq_free(&e->queue_in);
+    tq_free(&e->queue_out);
+    return ret;
+}
+
 int enc_open(OutputStream *ost, AVFrame *frame)
 {
     InputStream *ist = ost->ist;
@@ -348,8 +607,12 @@ int enc_open(OutputStream *ost, AVFrame *frame)
     if (ost->bitexact)
         enc_ctx->flags |= AV_CODEC_FLAG_BITEXACT;
 
-    if (!av_dict_get(ost->encoder_opts, "threads", NULL, 0))
-        av_dict_set(&ost->encoder_opts, "threads", "auto", 0);
+    if (!av_dict_get(ost->encoder_opts, "threads", NULL, 0)) {
+        if (threads_per_codec && enc_ctx->codec_type == AVMEDIA_TYPE_VIDEO)
+            av_dict_set_int(&ost->encoder_opts, "threads", threads_per_codec, 0);
+        else
+            av_dict_set(&ost->encoder_opts, "threads", "auto", 0);
+    }
 
     if (enc->capabilities & AV_CODEC_CAP_ENCODER_REORDERED_OPAQUE) {
         ret = av_dict_set(&ost->encoder_opts, "flags", "+copy_opaque", AV_DICT_MULTIKEY);
@@ -375,6 +638,16 @@ int enc_open(OutputStream *ost, AVFrame *frame)
 
     e->opened = 1;
 
+    if (enc_ctx->codec_type == AVMEDIA_TYPE_VIDEO ||
+        enc_ctx->codec_type == AVMEDIA_TYPE_AUDIO) {
+        ret = enc_thread_start(ost);
+        if (ret < 0) {
+            av_log(ost, AV_LOG_ERROR, "Error starting encoder thread: %s\n",
+                   av_err2str(ret));
+            return ret;
+        }
+    }
+
     if (ost->sq_idx_encode >= 0) {
         e->sq_frame = av_frame_alloc();
         if (!e->sq_frame)
@@ -675,14 +948,61 @@ static void update_video_stats(OutputStream *ost, const AVPacket *pkt, int write
     fprintf(vstats_file, "type= %c\n", av_get_picture_type_char(pict_type));
 }
 
+static void packet_process(OutputFile *of, OutputStream *ost, AVPacket *pkt)
+{
+    Encoder            *e = ost->enc;
+    AVCodecContext   *enc = ost->enc_ctx;
+    const char *type_desc = av_get_media_type_string(enc->codec_type);
+    int ret;
+
+    if (enc->codec_type == AVMEDIA_TYPE_VIDEO)
+        update_video_stats(ost, pkt, !!vstats_filename);
+    if (ost->enc_stats_post.io)
+        enc_stats_write(ost, &ost->enc_stats_post, NULL, pkt,
+                        e->packets_encoded);
+
+    if (debug_ts) {
+        av_log(ost, AV_LOG_INFO, "encoder -> type:%s "
+               "pkt_pts:%s pkt_pts_time:%s pkt_dts:%s pkt_dts_time:%s "
+               "duration:%s duration_time:%s\n",
+               type_desc,
+               av_ts2str(pkt->pts), av_ts2timestr(pkt->pts, &enc->time_base),
+               av_ts2str(pkt->dts), av_ts2timestr(pkt->dts, &enc->time_base),
+               av_ts2str(pkt->duration), av_ts2timestr(pkt->duration, &enc->time_base));
+    }
+
+    if ((ret = trigger_fix_sub_duration_heartbeat(ost, pkt)) < 0) {
+        av_log(NULL, AV_LOG_ERROR,
+               "Subtitle heartbeat logic failed in %s! (%s)\n",
+               __func__, av_err2str(ret));
+        exit_program(1);
+    }
+
+    e->data_size += pkt->size;
+
+    e->packets_encoded++;
+
+    of_output_packet(of, ost, pkt);
+}
+
+/*
+ * Hand a frame over to the encoder thread and output the packets it returns.
+ *
+ * The packets of the last frame may still be encoding when this returns, so
+ * that the encoder runs concurrently with the rest of the main loop. A flush
+ * (frame == NULL) waits for the thread to output everything and finish.
+ */
 static int encode_frame(OutputFile *of, OutputStream *ost, AVFrame *frame)
 {
     Encoder            *e = ost->enc;
     AVCodecContext   *enc = ost->enc_ctx;
     AVPacket         *pkt = e->pkt;
     const char *type_desc = av_get_media_type_string(enc->codec_type);
-    const char    *action = frame ? "encode" : "flush";
-    int ret;
+    int ret, thread_ret;
+
+    // thread already joined
+    if (!e->queue_in)
+        return AVERROR_EOF;
 
     if (frame) {
         if (ost->enc_stats_pre.io)
@@ -700,72 +1020,51 @@ static int encode_frame(OutputFile *of, OutputStream *ost, AVFrame *frame)
                    enc->time_base.num, enc->time_base.den);
         }
 
-        if (frame->sample_aspect_ratio.num && !ost->frame_aspect_ratio.num)
-            enc->sample_aspect_ratio = frame->sample_aspect_ratio;
-    }
+        // the caller keeps using the frame, send the thread its own reference
+        ret = av_frame_ref(e->thread_frame, frame);
+        if (ret < 0)
+            return ret;
 
-    update_benchmark(NULL);
+        ret = tq_send(e->queue_in, 0, e->thread_frame);
+        if (ret < 0) {
+            av_frame_unref(e->thread_frame);
+            goto finish;
+        }
 
-    ret = avcodec_send_frame(enc, frame);
-    if (ret < 0 && !(ret == AVERROR_EOF && !frame)) {
-        av_log(ost, AV_LOG_ERROR, "Error submitting %s frame to the encoder\n",
-               type_desc);
-        return ret;
-    }
+        e->frames_in_flight++;
+    } else
+        tq_send_finish(e->queue_in, 0);
 
     while (1) {
-        ret = avcodec_receive_packet(enc, pkt);
-        update_benchmark("%s_%s %d.%d", action, type_desc,
-                         ost->file_index, ost->index);
+        int dummy;
 
-        pkt->time_base = enc->time_base;
-
-        /* if two pass, output log on success and EOF */
-        if ((ret >= 0 || ret == AVERROR_EOF) && ost->logfile && enc->stats_out)
-            fprintf(ost->logfile, "%s", enc->stats_out);
-
-        if (ret == AVERROR(EAGAIN)) {
-            av_assert0(frame); // should never happen during flushing
+        if (frame && e->frames_in_flight <= 1)
             return 0;
-        } else if (ret == AVERROR_EOF) {
-            of_output_packet(of, ost, NULL);
-            return ret;
-        } else if (ret < 0) {
-            av_log(ost, AV_LOG_ERROR, "%s encoding failed\n", type_desc);
-            return ret;
-        }
-
-        if (enc->codec_type == AVMEDIA_TYPE_VIDEO)
-            update_video_stats(ost, pkt, !!vstats_filename);
-        if (ost->enc_stats_post.io)
-            enc_stats_write(ost, &ost->enc_stats_post, NULL, pkt,
-                            e->packets_encoded);
 
-        if (debug_ts) {
-            av_log(ost, AV_LOG_INFO, "encoder -> type:%s "
-                   "pkt_pts:%s pkt_pts_time:%s pkt_dts:%s pkt_dts_time:%s "
-                   "duration:%s duration_time:%s\n",
-                   type_desc,
-                   av_ts2str(pkt->pts), av_ts2timestr(pkt->pts, &enc->time_base),
-                   av_ts2str(pkt->dts), av_ts2timestr(pkt->dts, &enc->time_base),
-                   av_ts2str(pkt->duration), av_ts2timestr(pkt->duration, &enc->time_base));
-        }
+        ret = tq_receive(e->queue_out, &dummy, pkt);
+        if (ret < 0)
+            goto finish;
 
-        if ((ret = trigger_fix_sub_duration_heartbeat(ost, pkt)) < 0) {
-            av_log(NULL, AV_LOG_ERROR,
-                   "Subtitle heartbeat logic failed in %s! (%s)\n",
-                   __func__, av_err2str(ret));
-            exit_program(1);
+        // frame fully processed
+        if (!pkt->buf && !pkt->side_data_elems) {
+            e->frames_in_flight--;
+            continue;
         }
 
-        e->data_size += pkt->size;
+        packet_process(of, ost, pkt);
+    }
 
-        e->packets_encoded++;
+finish:
+    thread_ret = enc_thread_stop(e);
+    if (thread_ret < 0)
+        return thread_ret;
 
-        of_output_packet(of, ost, pkt);
-    }
+    // the queue is finished when encoding ended, non-EOF errors are fatal
+    if (ret < 0 && ret != AVERROR_EOF)
+        return ret;
 
-    av_assert0(0);
+    of_output_packet(of, ost, NULL);
+    return AVERROR_EOF;
 }
 
 static int submit_encode_frame(OutputFile *of, OutputStream *ost,
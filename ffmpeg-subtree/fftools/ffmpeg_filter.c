@@ -1845,6 +1845,7 @@ int ifilter_send_frame(InputFilter *ifilter, AVFrame *frame, int keep_reference)
     FilterGraph *fg = ifilter->graph;
     AVFrameSideData *sd;
     int need_reinit, ret;
+    int64_t t;
 
     /* determine if the parameters for this input changed */
     need_reinit = ifp->format != frame->format;
@@ -1924,8 +1925,10 @@ int ifilter_send_frame(InputFilter *ifilter, AVFrame *frame, int keep_reference)
     )
 #endif
 
+    t   = stage_time_start();
     ret = av_buffersrc_add_frame_flags(ifp->filter, frame,
                                        AV_BUFFERSRC_FLAG_PUSH);
+    stage_time_add(&fg->filter_time, t);
     if (ret < 0) {
         av_frame_unref(frame);
         if (ret != AVERROR_EOF)
@@ -1941,6 +1944,7 @@ int fg_transcode_step(FilterGraph *graph, InputStream **best_ist)
     int i, ret;
     int nb_requests, nb_requests_max = 0;
     InputStream *ist;
+    int64_t t;
 
     if (!graph->graph) {
         for (int i = 0; i < graph->nb_inputs; i++) {
@@ -1960,7 +1964,9 @@ int fg_transcode_step(FilterGraph *graph, InputStream **best_ist)
     }
 
     *best_ist = NULL;
+    t   = stage_time_start();
     ret = avfilter_graph_request_oldest(graph->graph);
+    stage_time_add(&graph->filter_time, t);
     if (ret >= 0)
         return reap_filters(0);
 
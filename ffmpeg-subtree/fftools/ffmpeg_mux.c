@@ -62,7 +62,7 @@ static int write_packet(Muxer *mux, OutputStream *ost, AVPacket *pkt)
 {
     MuxStream *ms = ms_from_ost(ost);
     AVFormatContext *s = mux->fc;
-    int64_t fs;
+    int64_t fs, t;
     uint64_t frame_num;
     int ret;
 
@@ -137,7 +137,9 @@ static int write_packet(Muxer *mux, OutputStream *ost, AVPacket *pkt)
     if (ms->stats.io)
         enc_stats_write(ost, &ms->stats, NULL, pkt, frame_num);
 
+    t   = stage_time_start();
     ret = av_interleaved_write_frame(s, pkt);
+    stage_time_add(&ost->mux_time, t);
     if (ret < 0) {
         av_log(ost, AV_LOG_ERROR,
                "Error submitting a packet to the muxer: %s\n",
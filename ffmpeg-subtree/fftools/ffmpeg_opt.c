@@ -84,6 +84,8 @@ int stdin_interaction = 1;
 float max_error_rate  = 2.0/3;
 char *filter_nbthreads;
 int filter_complex_nbthreads = 0;
+int threads_total     = 0;
+int threads_per_codec = 0;
 int vstats_version = 2;
 int auto_conversion_filters = 1;
 int64_t stats_period = 500000;
@@ -1249,6 +1251,40 @@ static int open_files(OptionGroupList *l, const char *inout,
     return 0;
 }
 
+/*
+ * Split -threads_total evenly across the video decoders and encoders, now
+ * that all of them are known. The decoders were not opened while the
+ * outputs were parsed, so that they also get their share.
+ */
+static int apply_thread_budget(void)
+{
+    int nb_codecs = 0;
+
+    if (threads_total <= 0)
+        return 0;
+
+    for (InputStream *ist = ist_iter(NULL); ist; ist = ist_iter(ist))
+        if (ist->decoding_needed && ist->par->codec_type == AVMEDIA_TYPE_VIDEO)
+            nb_codecs++;
+    for (OutputStream *ost = ost_iter(NULL); ost; ost = ost_iter(ost))
+        if (ost->enc_ctx && ost->type == AVMEDIA_TYPE_VIDEO)
+            nb_codecs++;
+
+    threads_per_codec = FFMAX(threads_total / FFMAX(nb_codecs, 1), 1);
+    av_log(NULL, AV_LOG_VERBOSE, "Using %d threads for each of the %d video "
+           "decoders and encoders\n", threads_per_codec, nb_codecs);
+
+    for (InputStream *ist = ist_iter(NULL); ist; ist = ist_iter(ist)) {
+        if (ist->decoding_needed && !avcodec_is_open(ist->dec_ctx)) {
+            int ret = dec_open(ist);
+            if (ret < 0)
+                return ret;
+        }
+    }
+
+    return 0;
+}
+
 int ffmpeg_parse_options(int argc, char **argv)
 {
     OptionParseContext octx;
@@ -1295,6 +1331,12 @@ int ffmpeg_parse_options(int argc, char **argv)
         goto fail;
     }
 
+    ret = apply_thread_budget();
+    if (ret < 0) {
+        av_log(NULL, AV_LOG_FATAL, "Error opening decoders: ");
+        goto fail;
+    }
+
     correct_input_start_times();
 
     apply_sync_offsets();
@@ -1523,6 +1565,8 @@ const OptionDef options[] = {
         "create a complex filtergraph", "graph_description" },
     { "filter_complex_threads", HAS_ARG | OPT_INT,                   { &filter_complex_nbthreads },
         "number of threads for -filter_complex" },
+    { "threads_total",  HAS_ARG | OPT_INT | OPT_EXPERT,              { &threads_total },
+        "split a total number of threads across all video decoders and encoders", "count" },
     { "lavfi",          HAS_ARG | OPT_EXPERT,                        { .func_arg = opt_filter_complex },
         "create a complex filtergraph", "graph_description" },
     { "filter_complex_script", HAS_ARG | OPT_EXPERT,                 { .func_arg = opt_filter_complex_script },
@@ -85,6 +85,10 @@ const int program_birth_year = 2003;
 /* no AV correction is done if too big error */
 #define AV_NOSYNC_THRESHOLD 10.0
 
+/* early frame drops raising skip_frame one level, and frames kept in a row lowering it */
+#define AUTOSKIP_RAISE_DROPS 4
+#define AUTOSKIP_LOWER_FRAMES 100
+
 /* maximum audio speed change to get correct sync */
 #define SAMPLE_CORRECTION_PERCENT_MAX 10
 
@@ -255,6 +259,15 @@ typedef struct VideoState {
     struct SwrContext *swr_ctx;
     int frame_drops_early;
     int frame_drops_late;
+    int autoskip_drops;             /* early drops since skip_frame was last changed */
+    int autoskip_kept;              /* frames kept in a row */
+    enum AVDiscard autoskip_floor;  /* skip_frame requested for the decoder */
+    int scrubbing;                  /* the timeline is dragged, only keyframes are decoded */
+    int scrub_skip;                 /* skip_frame is set for scrubbing, video thread only */
+    enum AVDiscard scrub_saved_skip;
+    int scrub_final;                /* the drag ended, seek to scrub_pos with full decoding */
+    int64_t scrub_pos;
+    int scrub_by_bytes;
 
     enum ShowMode {
         SHOW_MODE_NONE = -1, SHOW_MODE_VIDEO = 0, SHOW_MODE_WAVES, SHOW_MODE_RDFT, SHOW_MODE_NB
@@ -334,6 +347,7 @@ static int exit_on_keydown;
 static int exit_on_mousedown;
 static int loop = 1;
 static int framedrop = -1;
+static int autoskip = 1;
 static int infinite_buffer = -1;
 static enum ShowMode show_mode = SHOW_MODE_NONE;
 static const char *audio_codec_name;
@@ -1742,10 +1756,59 @@ static int queue_picture(VideoState *is, AVFrame *src_frame, double pts, double
     return 0;
 }
 
+/* raise skip_frame while frames are dropped after decoding them, so that the decoder can
+ * skip the pictures nothing else references before decoding them, lower it once back in sync */
+static void update_skip_frame(VideoState *is, int dropped)
+{
+    static const enum AVDiscard levels[] = { AVDISCARD_DEFAULT, AVDISCARD_NONREF, AVDISCARD_BIDIR };
+    AVCodecContext *avctx = is->viddec.avctx;
+    enum AVDiscard skip = avctx->skip_frame;
+    int i;
+
+    if (dropped) {
+        is->autoskip_kept = 0;
+        if (++is->autoskip_drops < AUTOSKIP_RAISE_DROPS)
+            return;
+        for (i = 0; i < FF_ARRAY_ELEMS(levels) && levels[i] <= avctx->skip_frame; i++)
+            ;
+        if (i < FF_ARRAY_ELEMS(levels))
+            skip = levels[i];
+    } else {
+        if (++is->autoskip_kept < AUTOSKIP_LOWER_FRAMES)
+            return;
+        for (i = FF_ARRAY_ELEMS(levels) - 1; i >= 0 && levels[i] >= avctx->skip_frame; i--)
+            ;
+        if (i >= 0 && levels[i] >= is->autoskip_floor)
+            skip = levels[i];
+    }
+    is->autoskip_drops = 0;
+    is->autoskip_kept  = 0;
+
+    if (skip != avctx->skip_frame) {
+        av_log(NULL, AV_LOG_VERBOSE, "%s video skip_frame to %d\n",
+               skip > avctx->skip_frame ? "Raising" : "Lowering", skip);
+        avctx->skip_frame = skip;
+    }
+}
+
 static int get_video_frame(VideoState *is, AVFrame *frame)
 {
+    int scrubbing = is->scrubbing;
     int got_picture;
 
+    /* the codec context is only used by this thread, skip_frame is changed here */
+    if (scrubbing != is->scrub_skip) {
+        AVCodecContext *avctx = is->viddec.avctx;
+
+        if (scrubbing) {
+            is->scrub_saved_skip = avctx->skip_frame;
+            avctx->skip_frame = FFMAX(avctx->skip_frame, AVDISCARD_NONKEY);
+        } else {
+            avctx->skip_frame = is->scrub_saved_skip;
+        }
+        is->scrub_skip = scrubbing;
+    }
+
     if ((got_picture = decoder_decode_frame(&is->viddec, frame, NULL)) < 0)
         return -1;
 
@@ -1768,6 +1831,8 @@ static int get_video_frame(VideoState *is, AVFrame *frame)
                     av_frame_unref(frame);
                     got_picture = 0;
                 }
+                if (autoskip && !is->scrub_skip && is->viddec.pkt_serial == is->vidclk.serial)
+                    update_skip_frame(is, !got_picture);
             }
         }
     }
@@ -2650,6 +2715,7 @@ static int stream_component_open(VideoState *is, int stream_index)
     case AVMEDIA_TYPE_VIDEO:
         is->video_stream = stream_index;
         is->video_st = ic->streams[stream_index];
+        is->autoskip_floor = avctx->skip_frame;
 
         if ((ret = decoder_init(&is->viddec, avctx, &is->videoq, is->continue_read_thread)) < 0)
             goto fail;
@@ -3202,6 +3268,12 @@ static void refresh_loop_wait_event(VideoState *is, SDL_Event *event) {
         if (remaining_time > 0.0)
             av_usleep((int64_t)(remaining_time * 1000000.0));
         remaining_time = REFRESH_RATE;
+        /* decoding restarts from the keyframe shown last, a pending seek is not overridden */
+        if (is->scrub_final && !is->seek_req) {
+            is->scrub_final = 0;
+            is->scrubbing   = 0;
+            stream_seek(is, is->scrub_pos, 0, is->scrub_by_bytes);
+        }
         if (is->show_mode != SHOW_MODE_NONE && (!is->paused || is->force_refresh))
             video_refresh(is, &remaining_time);
         SDL_PumpEvents();
@@ -3382,9 +3454,13 @@ static void event_loop(VideoState *cur_stream)
                 if (!(event.motion.state & SDL_BUTTON_RMASK))
                     break;
                 x = event.motion.x;
+                /* keyframes only while dragging, see SDL_MOUSEBUTTONUP */
+                cur_stream->scrubbing = 1;
             }
                 if (seek_by_bytes || cur_stream->ic->duration <= 0) {
                     uint64_t size =  avio_size(cur_stream->ic->pb);
+                    cur_stream->scrub_pos      = size*x/cur_stream->width;
+                    cur_stream->scrub_by_bytes = 1;
                     stream_seek(cur_stream, size*x/cur_stream->width, 0, 1);
                 } else {
                     int64_t ts;
@@ -3405,9 +3481,15 @@ static void event_loop(VideoState *cur_stream)
                     ts = frac * cur_stream->ic->duration;
                     if (cur_stream->ic->start_time != AV_NOPTS_VALUE)
                         ts += cur_stream->ic->start_time;
+                    cur_stream->scrub_pos      = ts;
+                    cur_stream->scrub_by_bytes = 0;
                     stream_seek(cur_stream, ts, 0, 0);
                 }
             break;
+        case SDL_MOUSEBUTTONUP:
+            if (event.button.button == SDL_BUTTON_RIGHT && cur_stream->scrubbing)
+                cur_stream->scrub_final = 1;
+            break;
         case SDL_WINDOWEVENT:
             switch (event.window.event) {
                 case SDL_WINDOWEVENT_SIZE_CHANGED:
@@ -3557,6 +3639,7 @@ static const OptionDef options[] = {
     { "exitonmousedown", OPT_BOOL | OPT_EXPERT, { &exit_on_mousedown }, "exit on mouse down", "" },
     { "loop", OPT_INT | HAS_ARG | OPT_EXPERT, { &loop }, "set number of times the playback shall be looped", "loop count" },
     { "framedrop", OPT_BOOL | OPT_EXPERT, { &framedrop }, "drop frames when cpu is too slow", "" },
+    { "autoskip", OPT_BOOL | OPT_EXPERT, { &autoskip }, "skip decoding non-reference frames while frames are dropped", "" },
     { "infbuf", OPT_BOOL | OPT_EXPERT, { &infinite_buffer }, "don't limit the input buffer size (useful with realtime streams)", "" },
     { "window_title", OPT_STRING | HAS_ARG, { &window_title }, "set window title", "window title" },
     { "left", OPT_INT | HAS_ARG | OPT_EXPERT, { &screen_left }, "set the x position for the left of the window", "x pos" },
@@ -89,6 +89,10 @@ typedef struct InputStream {
     AVStream *st;
 
     AVCodecContext *dec_ctx;
+
+    /* parser used to describe packets without decoding them */
+    AVCodecParserContext *parser;
+    AVCodecContext       *parser_ctx;
 } InputStream;
 
 typedef struct InputFile {
@@ -115,6 +119,7 @@ static int do_show_programs = 0;
 static int do_show_streams = 0;
 static int do_show_stream_disposition = 0;
 static int do_show_data    = 0;
+static int do_parse_packets = 0;
 static int do_show_program_version  = 0;
 static int do_show_library_versions = 0;
 static int do_show_pixel_formats = 0;
@@ -2515,7 +2520,8 @@ static int show_log(WriterContext *w, int section_ids, int section_id, int log_l
 static void show_packet(WriterContext *w, InputFile *ifile, AVPacket *pkt, int packet_idx)
 {
     char val_str[128];
-    AVStream *st = ifile->streams[pkt->stream_index].st;
+    InputStream *ist = &ifile->streams[pkt->stream_index];
+    AVStream *st = ist->st;
     AVBPrint pbuf;
     const char *s;
 
@@ -2539,6 +2545,25 @@ static void show_packet(WriterContext *w, InputFile *ifile, AVPacket *pkt, int p
     print_fmt("flags", "%c%c%c",      pkt->flags & AV_PKT_FLAG_KEY ? 'K' : '_',
               pkt->flags & AV_PKT_FLAG_DISCARD ? 'D' : '_',
               pkt->flags & AV_PKT_FLAG_CORRUPT ? 'C' : '_');
+    if (ist->parser) {
+        AVCodecParserContext *parser = ist->parser;
+        uint8_t *out;
+        int out_size;
+
+        parser->pict_type = AV_PICTURE_TYPE_NONE;
+        parser->key_frame = -1;
+        parser->output_picture_number = -1;
+        av_parser_parse2(parser, ist->parser_ctx, &out, &out_size,
+                         pkt->data, pkt->size, pkt->pts, pkt->dts, pkt->pos);
+
+        print_fmt("pict_type", "%c", av_get_picture_type_char(parser->pict_type));
+        if (parser->key_frame >= 0) print_int    ("key_frame", parser->key_frame);
+        else                        print_str_opt("key_frame", "N/A");
+        if (parser->output_picture_number >= 0)
+            print_int    ("picture_number", parser->output_picture_number);
+        else
+            print_str_opt("picture_number", "N/A");
+    }
     if (do_show_data)
         writer_print_data(w, "data", pkt->data, pkt->size);
     writer_print_data_hash(w, "data_hash", pkt->data, pkt->size);
@@ -3409,6 +3434,18 @@ static int open_input_file(InputFile *ifile, const char *filename,
             continue;
         }
 
+        if (do_parse_packets && (ist->parser = av_parser_init(stream->codecpar->codec_id))) {
+            ist->parser_ctx = avcodec_alloc_context3(NULL);
+            if (!ist->parser_ctx)
+                exit(1);
+
+            err = avcodec_parameters_to_context(ist->parser_ctx, stream->codecpar);
+            if (err < 0)
+                exit(1);
+
+            ist->parser->flags |= PARSER_FLAG_COMPLETE_FRAMES;
+        }
+
         codec = avcodec_find_decoder(stream->codecpar->codec_id);
         if (!codec) {
             av_log(NULL, AV_LOG_WARNING,
@@ -3462,8 +3499,11 @@ static void close_input_file(InputFile *ifile)
     int i;
 
     /* close decoder for each stream */
-    for (i = 0; i < ifile->nb_streams; i++)
+    for (i = 0; i < ifile->nb_streams; i++) {
         avcodec_free_context(&ifile->streams[i].dec_ctx);
+        av_parser_close(ifile->streams[i].parser);
+        avcodec_free_context(&ifile->streams[i].parser_ctx);
+    }
 
     av_freep(&ifile->streams);
     ifile->nb_streams = 0;
@@ -4036,6 +4076,7 @@ static const OptionDef real_options[] = {
     { "sections", OPT_EXIT, {.func_arg = opt_sections}, "print sections structure and section information, and exit" },
     { "show_data",    OPT_BOOL, { &do_show_data }, "show packets data" },
     { "show_data_hash", OPT_STRING | HAS_ARG, { &show_data_hash }, "show packets data hash" },
+    { "parse_packets", OPT_BOOL, { &do_parse_packets }, "show picture information of packets using a parser, without decoding" },
     { "show_error",   0, { .func_arg = &opt_show_error },  "show probing error" },
     { "show_format",  0, { .func_arg = &opt_show_format }, "show format/container info" },
     { "show_frames",  0, { .func_arg = &opt_show_frames }, "show frames info" },
@@ -1225,6 +1225,20 @@ int opt_max_alloc(void *optctx, const char *opt, const char *arg)
     return 0;
 }
 
+int opt_hugepage_threshold(void *optctx, const char *opt, const char *arg)
+{
+    char *tail;
+    size_t threshold;
+
+    threshold = strtol(arg, &tail, 10);
+    if (*tail) {
+        av_log(NULL, AV_LOG_FATAL, "Invalid hugepage_threshold \"%s\".\n", arg);
+        exit_program(1);
+    }
+    av_hugepage_threshold(threshold);
+    return 0;
+}
+
 int opt_loglevel(void *optctx, const char *opt, const char *arg)
 {
     const struct { const char *name; int level; } log_levels[] = {
@@ -48,6 +48,11 @@ struct ThreadQueue {
     ObjPool *obj_pool;
     void   (*obj_move)(void *dst, void *src);
 
+    /*
+     * The producer only waits while the FIFO is full and the consumer only
+     * while it is empty, so the condition is only signalled on these
+     * transitions; other sends and receives do not wake up anybody.
+     */
     pthread_mutex_t lock;
     pthread_cond_t  cond;
 };
@@ -140,6 +145,7 @@ int tq_send(ThreadQueue *tq, unsigned int stream_idx, void *data)
         *finished |= FINISHED_SEND;
     } else {
         FifoElem elem = { .stream_idx = stream_idx };
+        int was_empty = !av_fifo_can_read(tq->fifo);
 
         ret = objpool_get(tq->obj_pool, &elem.obj);
         if (ret < 0)
@@ -149,7 +155,8 @@ int tq_send(ThreadQueue *tq, unsigned int stream_idx, void *data)
 
         ret = av_fifo_write(tq->fifo, &elem, 1);
         av_assert0(ret >= 0);
-        pthread_cond_broadcast(&tq->cond);
+        if (was_empty)
+            pthread_cond_broadcast(&tq->cond);
     }
 
 finish:
@@ -190,13 +197,14 @@ static int receive_locked(ThreadQueue *tq, int *stream_idx,
 
 int tq_receive(ThreadQueue *tq, int *stream_idx, void *data)
 {
-    int ret;
+    int ret, was_full;
 
     *stream_idx = -1;
 
     pthread_mutex_lock(&tq->lock);
 
     while (1) {
+        was_full = !av_fifo_can_write(tq->fifo);
         ret = receive_locked(tq, stream_idx, data);
         if (ret == AVERROR(EAGAIN)) {
             pthread_cond_wait(&tq->cond, &tq->lock);
@@ -206,7 +214,7 @@ int tq_receive(ThreadQueue *tq, int *stream_idx, void *data)
         break;
     }
 
-    if (ret == 0)
+    if (ret == 0 && was_full)
         pthread_cond_broadcast(&tq->cond);
 
     pthread_mutex_unlock(&tq->lock);
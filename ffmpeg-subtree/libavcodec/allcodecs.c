@@ -117,6 +117,7 @@ extern const FFCodec ff_eightsvx_exp_decoder;
 extern const FFCodec ff_eightsvx_fib_decoder;
 extern const FFCodec ff_escape124_decoder;
 extern const FFCodec ff_escape130_decoder;
+extern const FFCodec ff_evc_v4l2m2m_decoder;
 extern const FFCodec ff_exr_encoder;
 extern const FFCodec ff_exr_decoder;
 extern const FFCodec ff_ffv1_encoder;
@@ -834,6 +835,7 @@ extern const FFCodec ff_idf_decoder;
  * above is available */
 extern const FFCodec ff_aac_mf_encoder;
 extern const FFCodec ff_ac3_mf_encoder;
+extern const FFCodec ff_evc_v4l2m2m_encoder;
 extern const FFCodec ff_h263_v4l2m2m_encoder;
 extern const FFCodec ff_libaom_av1_decoder;
 /* hwaccel hooks only, so prefer external decoders */
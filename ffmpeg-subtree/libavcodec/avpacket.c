@@ -22,6 +22,7 @@
 #include <string.h>
 
 #include "libavutil/avassert.h"
+#include "libavutil/avutil.h"
 #include "libavutil/intreadwrite.h"
 #include "libavutil/mathematics.h"
 #include "libavutil/mem.h"
@@ -300,6 +301,7 @@ const char *av_packet_side_data_name(enum AVPacketSideDataType type)
     case AV_PKT_DATA_DOVI_CONF:                  return "DOVI configuration record";
     case AV_PKT_DATA_S12M_TIMECODE:              return "SMPTE ST 12-1:2014 timecode";
     case AV_PKT_DATA_DYNAMIC_HDR10_PLUS:         return "HDR10+ Dynamic Metadata (SMPTE 2094-40)";
+    case AV_PKT_DATA_ENCODER_STATS:              return "Encoder statistics";
     }
     return NULL;
 }
@@ -624,6 +626,26 @@ int ff_side_data_set_encoder_stats(AVPacket *pkt, int quality, int64_t *error, i
     return 0;
 }
 
+AVEncoderStats *ff_side_data_new_encoder_stats(AVPacket *pkt)
+{
+    AVEncoderStats *stats;
+
+    stats = (AVEncoderStats *)av_packet_new_side_data(pkt, AV_PKT_DATA_ENCODER_STATS, sizeof(*stats));
+    if (!stats)
+        return NULL;
+
+    stats->encode_time = -1;
+    stats->bits        = -1;
+    stats->qp_avg      = -1;
+    stats->qp_min      = -1;
+    stats->qp_max      = -1;
+    stats->temporal_id = -1;
+    stats->reference   = -1;
+    stats->pict_type   = AV_PICTURE_TYPE_NONE;
+
+    return stats;
+}
+
 int ff_side_data_set_prft(AVPacket *pkt, int64_t timestamp)
 {
     AVProducerReferenceTime *prft;
@@ -66,6 +66,12 @@ extern const FFBitStreamFilter ff_vp9_raw_reorder_bsf;
 extern const FFBitStreamFilter ff_vp9_superframe_bsf;
 extern const FFBitStreamFilter ff_vp9_superframe_split_bsf;
 extern const FFBitStreamFilter ff_evc_frame_merge_bsf;
+extern const FFBitStreamFilter ff_evc_frame_split_bsf;
+extern const FFBitStreamFilter ff_evc_metadata_bsf;
+extern const FFBitStreamFilter ff_evc_temporal_filter_bsf;
+extern const FFBitStreamFilter ff_evc_splice_bsf;
+extern const FFBitStreamFilter ff_evc_tile_extract_bsf;
+extern const FFBitStreamFilter ff_evc_mosaic_bsf;
 
 #include "libavcodec/bsf_list.c"
 
@@ -34,6 +34,9 @@ static const CodedBitstreamType *const cbs_type_table[] = {
 #if CONFIG_CBS_AV1
     &ff_cbs_type_av1,
 #endif
+#if CONFIG_CBS_EVC
+    &ff_cbs_type_evc,
+#endif
 #if CONFIG_CBS_H264
     &ff_cbs_type_h264,
 #endif
@@ -55,6 +58,9 @@ const enum AVCodecID ff_cbs_all_codec_ids[] = {
 #if CONFIG_CBS_AV1
     AV_CODEC_ID_AV1,
 #endif
+#if CONFIG_CBS_EVC
+    AV_CODEC_ID_EVC,
+#endif
 #if CONFIG_CBS_H264
     AV_CODEC_ID_H264,
 #endif
@@ -0,0 +1,1012 @@
+/*
+ * This file is part of FFmpeg.
+ *
+ * FFmpeg is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * FFmpeg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with FFmpeg; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include "libavutil/attributes.h"
+#include "libavutil/avassert.h"
+#include "libavutil/internal.h"
+#include "libavutil/intmath.h"
+
+#include "bytestream.h"
+#include "cbs.h"
+#include "cbs_internal.h"
+#include "cbs_evc.h"
+#include "evc.h"
+
+
+static int cbs_read_ue_golomb(CodedBitstreamContext *ctx, GetBitContext *gbc,
+                              const char *name, const int *subscripts,
+                              uint32_t *write_to,
+                              uint32_t range_min, uint32_t range_max)
+{
+    uint32_t value;
+    int position, i, j;
+    unsigned int k;
+    char bits[65];
+
+    position = get_bits_count(gbc);
+
+    for (i = 0; i < 32; i++) {
+        if (get_bits_left(gbc) < i + 1) {
+            av_log(ctx->log_ctx, AV_LOG_ERROR, "Invalid ue-golomb code at "
+                   "%s: bitstream ended.\n", name);
+            return AVERROR_INVALIDDATA;
+        }
+        k = get_bits1(gbc);
+        bits[i] = k ? '1' : '0';
+        if (k)
+            break;
+    }
+    if (i >= 32) {
+        av_log(ctx->log_ctx, AV_LOG_ERROR, "Invalid ue-golomb code at "
+               "%s: more than 31 zeroes.\n", name);
+        return AVERROR_INVALIDDATA;
+    }
+    value = 1;
+    for (j = 0; j < i; j++) {
+        k = get_bits1(gbc);
+        bits[i + j + 1] = k ? '1' : '0';
+        value = value << 1 | k;
+    }
+    bits[i + j + 1] = 0;
+    --value;
+
+    if (ctx->trace_enable)
+        ff_cbs_trace_syntax_element(ctx, position, name, subscripts,
+                                    bits, value);
+
+    if (value < range_min || value > range_max) {
+        av_log(ctx->log_ctx, AV_LOG_ERROR, "%s out of range: "
+               "%"PRIu32", but must be in [%"PRIu32",%"PRIu32"].\n",
+               name, value, range_min, range_max);
+        return AVERROR_INVALIDDATA;
+    }
+
+    *write_to = value;
+    return 0;
+}
+
+static int cbs_read_se_golomb(CodedBitstreamContext *ctx, GetBitContext *gbc,
+                              const char *name, const int *subscripts,
+                              int32_t *write_to,
+                              int32_t range_min, int32_t range_max)
+{
+    int32_t value;
+    int position, i, j;
+    unsigned int k;
+    uint32_t v;
+    char bits[65];
+
+    position = get_bits_count(gbc);
+
+    for (i = 0; i < 32; i++) {
+        if (get_bits_left(gbc) < i + 1) {
+            av_log(ctx->log_ctx, AV_LOG_ERROR, "Invalid se-golomb code at "
+                   "%s: bitstream ended.\n", name);
+            return AVERROR_INVALIDDATA;
+        }
+        k = get_bits1(gbc);
+        bits[i] = k ? '1' : '0';
+        if (k)
+            break;
+    }
+    if (i >= 32) {
+        av_log(ctx->log_ctx, AV_LOG_ERROR, "Invalid se-golomb code at "
+               "%s: more than 31 zeroes.\n", name);
+        return AVERROR_INVALIDDATA;
+    }
+    v = 1;
+    for (j = 0; j < i; j++) {
+        k = get_bits1(gbc);
+        bits[i + j + 1] = k ? '1' : '0';
+        v = v << 1 | k;
+    }
+    bits[i + j + 1] = 0;
+    if (v & 1)
+        value = -(int32_t)(v / 2);
+    else
+        value = v / 2;
+
+    if (ctx->trace_enable)
+        ff_cbs_trace_syntax_element(ctx, position, name, subscripts,
+                                    bits, value);
+
+    if (value < range_min || value > range_max) {
+        av_log(ctx->log_ctx, AV_LOG_ERROR, "%s out of range: "
+               "%"PRId32", but must be in [%"PRId32",%"PRId32"].\n",
+               name, value, range_min, range_max);
+        return AVERROR_INVALIDDATA;
+    }
+
+    *write_to = value;
+    return 0;
+}
+
+static int cbs_write_ue_golomb(CodedBitstreamContext *ctx, PutBitContext *pbc,
+                               const char *name, const int *subscripts,
+                               uint32_t value,
+                               uint32_t range_min, uint32_t range_max)
+{
+    int len;
+
+    if (value < range_min || value > range_max) {
+        av_log(ctx->log_ctx, AV_LOG_ERROR, "%s out of range: "
+               "%"PRIu32", but must be in [%"PRIu32",%"PRIu32"].\n",
+               name, value, range_min, range_max);
+        return AVERROR_INVALIDDATA;
+    }
+    av_assert0(value != UINT32_MAX);
+
+    len = av_log2(value + 1);
+    if (put_bits_left(pbc) < 2 * len + 1)
+        return AVERROR(ENOSPC);
+
+    if (ctx->trace_enable) {
+        char bits[65];
+        int i;
+
+        for (i = 0; i < len; i++)
+            bits[i] = '0';
+        bits[len] = '1';
+        for (i = 0; i < len; i++)
+            bits[len + i + 1] = (value + 1) >> (len - i - 1) & 1 ? '1' : '0';
+        bits[len + len + 1] = 0;
+
+        ff_cbs_trace_syntax_element(ctx, put_bits_count(pbc),
+                                    name, subscripts, bits, value);
+    }
+
+    put_bits(pbc, len, 0);
+    if (len + 1 < 32)
+        put_bits(pbc, len + 1, value + 1);
+    else
+        put_bits32(pbc, value + 1);
+
+    return 0;
+}
+
+static int cbs_write_se_golomb(CodedBitstreamContext *ctx, PutBitContext *pbc,
+                               const char *name, const int *subscripts,
+                               int32_t value,
+                               int32_t range_min, int32_t range_max)
+{
+    int len;
+    uint32_t uvalue;
+
+    if (value < range_min || value > range_max) {
+        av_log(ctx->log_ctx, AV_LOG_ERROR, "%s out of range: "
+               "%"PRId32", but must be in [%"PRId32",%"PRId32"].\n",
+               name, value, range_min, range_max);
+        return AVERROR_INVALIDDATA;
+    }
+    av_assert0(value != INT32_MIN);
+
+    if (value == 0)
+        uvalue = 0;
+    else if (value > 0)
+        uvalue = 2 * (uint32_t)value - 1;
+    else
+        uvalue = 2 * (uint32_t)-value;
+
+    len = av_log2(uvalue + 1);
+    if (put_bits_left(pbc) < 2 * len + 1)
+        return AVERROR(ENOSPC);
+
+    if (ctx->trace_enable) {
+        char bits[65];
+        int i;
+
+        for (i = 0; i < len; i++)
+            bits[i] = '0';
+        bits[len] = '1';
+        for (i = 0; i < len; i++)
+            bits[len + i + 1] = (uvalue + 1) >> (len - i - 1) & 1 ? '1' : '0';
+        bits[len + len + 1] = 0;
+
+        ff_cbs_trace_syntax_element(ctx, put_bits_count(pbc),
+                                    name, subscripts, bits, value);
+    }
+
+    put_bits(pbc, len, 0);
+    if (len + 1 < 32)
+        put_bits(pbc, len + 1, uvalue + 1);
+    else
+        put_bits32(pbc, uvalue + 1);
+
+    return 0;
+}
+
+#define HEADER(name) do { \
+        ff_cbs_trace_header(ctx, name); \
+    } while (0)
+
+#define CHECK(call) do { \
+        err = (call); \
+        if (err < 0) \
+            return err; \
+    } while (0)
+
+#define FUNC_NAME2(rw, codec, name) cbs_ ## codec ## _ ## rw ## _ ## name
+#define FUNC_NAME1(rw, codec, name) FUNC_NAME2(rw, codec, name)
+#define FUNC(name) FUNC_NAME1(READWRITE, evc, name)
+
+#define SUBSCRIPTS(subs, ...) (subs > 0 ? ((int[subs + 1]){ subs, __VA_ARGS__ }) : NULL)
+
+#define u(width, name, range_min, range_max) \
+        xu(width, name, current->name, range_min, range_max, 0, )
+#define ub(width, name) \
+        xu(width, name, current->name, 0, MAX_UINT_BITS(width), 0, )
+#define flag(name) ub(1, name)
+#define ue(name, range_min, range_max) \
+        xue(name, current->name, range_min, range_max, 0, )
+#define se(name, range_min, range_max) \
+        xse(name, current->name, range_min, range_max, 0, )
+
+#define ubs(width, name, subs, ...) \
+        xu(width, name, current->name, 0, MAX_UINT_BITS(width), subs, __VA_ARGS__)
+#define flags(name, subs, ...) \
+        xu(1, name, current->name, 0, 1, subs, __VA_ARGS__)
+#define ues(name, range_min, range_max, subs, ...) \
+        xue(name, current->name, range_min, range_max, subs, __VA_ARGS__)
+#define ses(name, range_min, range_max, subs, ...) \
+        xse(name, current->name, range_min, range_max, subs, __VA_ARGS__)
+
+#define fixed(width, name, value) do { \
+        av_unused uint32_t fixed_value = value; \
+        xu(width, name, fixed_value, value, value, 0, ); \
+    } while (0)
+
+
+#define READ
+#define READWRITE read
+#define RWContext GetBitContext
+
+#define xu(width, name, var, range_min, range_max, subs, ...) do { \
+        uint32_t value; \
+        CHECK(ff_cbs_read_unsigned(ctx, rw, width, #name, \
+                                   SUBSCRIPTS(subs, __VA_ARGS__), \
+                                   &value, range_min, range_max)); \
+        var = value; \
+    } while (0)
+#define xue(name, var, range_min, range_max, subs, ...) do { \
+        uint32_t value; \
+        CHECK(cbs_read_ue_golomb(ctx, rw, #name, \
+                                 SUBSCRIPTS(subs, __VA_ARGS__), \
+                                 &value, range_min, range_max)); \
+        var = value; \
+    } while (0)
+#define xse(name, var, range_min, range_max, subs, ...) do { \
+        int32_t value; \
+        CHECK(cbs_read_se_golomb(ctx, rw, #name, \
+                                 SUBSCRIPTS(subs, __VA_ARGS__), \
+                                 &value, range_min, range_max)); \
+        var = value; \
+    } while (0)
+
+
+#define infer(name, value) do { \
+        current->name = value; \
+    } while (0)
+
+static int cbs_evc_read_more_rbsp_data(GetBitContext *gbc)
+{
+    int bits_left = get_bits_left(gbc);
+    if (bits_left > 8)
+        return 1;
+    if (bits_left == 0)
+        return 0;
+    if (show_bits(gbc, bits_left) & MAX_UINT_BITS(bits_left - 1))
+        return 1;
+    return 0;
+}
+
+#define byte_alignment(rw) (get_bits_count(rw) % 8)
+
+#define allocate(name, size) do { \
+        name ## _ref = av_buffer_allocz(size + \
+                                        AV_INPUT_BUFFER_PADDING_SIZE); \
+        if (!name ## _ref) \
+            return AVERROR(ENOMEM); \
+        name = name ## _ref->data; \
+    } while (0)
+
+#include "cbs_evc_syntax_template.c"
+
+#undef READ
+#undef READWRITE
+#undef RWContext
+#undef xu
+#undef xue
+#undef xse
+#undef infer
+#undef byte_alignment
+#undef allocate
+
+
+#define WRITE
+#define READWRITE write
+#define RWContext PutBitContext
+
+#define xu(width, name, var, range_min, range_max, subs, ...) do { \
+        uint32_t value = var; \
+        CHECK(ff_cbs_write_unsigned(ctx, rw, width, #name, \
+                                    SUBSCRIPTS(subs, __VA_ARGS__), \
+                                    value, range_min, range_max)); \
+    } while (0)
+#define xue(name, var, range_min, range_max, subs, ...) do { \
+        uint32_t value = var; \
+        CHECK(cbs_write_ue_golomb(ctx, rw, #name, \
+                                  SUBSCRIPTS(subs, __VA_ARGS__), \
+                                  value, range_min, range_max)); \
+    } while (0)
+#define xse(name, var, range_min, range_max, subs, ...) do { \
+        int32_t value = var; \
+        CHECK(cbs_write_se_golomb(ctx, rw, #name, \
+                                  SUBSCRIPTS(subs, __VA_ARGS__), \
+                                  value, range_min, range_max)); \
+    } while (0)
+
+#define infer(name, value) do { \
+        if (current->name != (value)) { \
+            av_log(ctx->log_ctx, AV_LOG_ERROR, \
+                   "%s does not match inferred value: " \
+                   "%"PRId64", but should be %"PRId64".\n", \
+                   #name, (int64_t)current->name, (int64_t)(value)); \
+            return AVERROR_INVALIDDATA; \
+        } \
+    } while (0)
+
+#define byte_alignment(rw) (put_bits_count(rw) % 8)
+
+#define allocate(name, size) do { \
+        if (!name) { \
+            av_log(ctx->log_ctx, AV_LOG_ERROR, "%s must be set " \
+                   "for writing.\n", #name); \
+            return AVERROR_INVALIDDATA; \
+        } \
+    } while (0)
+
+#include "cbs_evc_syntax_template.c"
+
+#undef WRITE
+#undef READWRITE
+#undef RWContext
+#undef xu
+#undef xue
+#undef xse
+#undef u
+#undef ub
+#undef flag
+#undef ue
+#undef se
+#undef infer
+#undef byte_alignment
+#undef allocate
+
+
+static int cbs_evc_append_nal_unit(CodedBitstreamContext *ctx,
+                                   CodedBitstreamFragment *frag,
+                                   const uint8_t *data, size_t size)
+{
+    int nal_unit_type;
+
+    if (size < EVC_NALU_HEADER_SIZE) {
+        av_log(ctx->log_ctx, AV_LOG_ERROR, "Invalid NAL unit size: "
+               "%"SIZE_SPECIFIER".\n", size);
+        return AVERROR_INVALIDDATA;
+    }
+
+    // nal_unit_type_plus1 follows the forbidden_zero_bit.
+    nal_unit_type = (data[0] >> 1 & 0x3f) - 1;
+    if (nal_unit_type < 0) {
+        av_log(ctx->log_ctx, AV_LOG_ERROR, "Invalid NAL unit type.\n");
+        return AVERROR_INVALIDDATA;
+    }
+
+    return ff_cbs_append_unit_data(frag, nal_unit_type, (uint8_t*)data,
+                                   size, frag->data_ref);
+}
+
+static int cbs_evc_split_fragment(CodedBitstreamContext *ctx,
+                                  CodedBitstreamFragment *frag,
+                                  int header)
+{
+    CodedBitstreamEVCContext *priv = ctx->priv_data;
+    GetByteContext gbc;
+    int err;
+
+    av_assert0(frag->data && frag->nb_units == 0);
+    if (frag->data_size == 0)
+        return 0;
+
+    bytestream2_init(&gbc, frag->data, frag->data_size);
+
+    if (header && frag->data[0] == 1) {
+        // evcC header.
+        int i, j, nb_arrays, nb_nalus;
+
+        if (bytestream2_get_bytes_left(&gbc) < EVC_EVCC_HEADER_SIZE)
+            return AVERROR_INVALIDDATA;
+
+        bytestream2_get_buffer(&gbc, priv->evcc_header, EVC_EVCC_HEADER_SIZE);
+
+        priv->nal_length_size = (priv->evcc_header[16] & 3) + 1;
+        if (priv->nal_length_size == 3) {
+            av_log(ctx->log_ctx, AV_LOG_ERROR, "Invalid evcC header: "
+                   "NAL unit length field of 3 bytes.\n");
+            return AVERROR_INVALIDDATA;
+        }
+
+        nb_arrays = priv->evcc_header[17];
+        for (i = 0; i < nb_arrays; i++) {
+            if (bytestream2_get_bytes_left(&gbc) < 3)
+                return AVERROR_INVALIDDATA;
+            bytestream2_skip(&gbc, 1); // NAL_unit_type
+            nb_nalus = bytestream2_get_be16(&gbc);
+
+            for (j = 0; j < nb_nalus; j++) {
+                size_t size;
+
+                if (bytestream2_get_bytes_left(&gbc) < 2)
+                    return AVERROR_INVALIDDATA;
+                size = bytestream2_get_be16(&gbc);
+                if (bytestream2_get_bytes_left(&gbc) < size)
+                    return AVERROR_INVALIDDATA;
+
+                err = cbs_evc_append_nal_unit(ctx, frag, gbc.buffer, size);
+                if (err < 0)
+                    return err;
+                bytestream2_skip(&gbc, size);
+            }
+        }
+
+        if (bytestream2_get_bytes_left(&gbc) > 0) {
+            av_log(ctx->log_ctx, AV_LOG_WARNING, "%u bytes left at end of evcC "
+                   "header.\n", bytestream2_get_bytes_left(&gbc));
+        }
+
+        priv->evcc = 1;
+    } else {
+        // Length-prefixed NAL units, as carried in samples.
+        int nal_length_size = priv->nal_length_size ? priv->nal_length_size
+                                                    : EVC_NALU_LENGTH_PREFIX_SIZE;
+
+        priv->evcc = 0;
+
+        while (bytestream2_get_bytes_left(&gbc) > 0) {
+            size_t size = 0;
+            int i;
+
+            if (bytestream2_get_bytes_left(&gbc) < nal_length_size)
+                return AVERROR_INVALIDDATA;
+            for (i = 0; i < nal_length_size; i++)
+                size = size << 8 | bytestream2_get_byte(&gbc);
+            if (bytestream2_get_bytes_left(&gbc) < size) {
+                av_log(ctx->log_ctx, AV_LOG_ERROR, "Invalid NAL unit size: "
+                       "%"SIZE_SPECIFIER" bytes, %u left.\n",
+                       size, bytestream2_get_bytes_left(&gbc));
+                return AVERROR_INVALIDDATA;
+            }
+
+            err = cbs_evc_append_nal_unit(ctx, frag, gbc.buffer, size);
+            if (err < 0)
+                return err;
+            bytestream2_skip(&gbc, size);
+        }
+    }
+
+    return 0;
+}
+
+#define cbs_evc_replace_ps(ps_name, ps_var, id_element) \
+static int cbs_evc_replace_ ## ps_var(CodedBitstreamContext *ctx, \
+                                      CodedBitstreamUnit *unit)  \
+{ \
+    CodedBitstreamEVCContext *priv = ctx->priv_data; \
+    EVCRaw ## ps_name *ps_var = unit->content; \
+    unsigned int id = ps_var->id_element; \
+    int err = ff_cbs_make_unit_refcounted(ctx, unit); \
+    if (err < 0) \
+        return err; \
+    av_buffer_unref(&priv->ps_var ## _ref[id]); \
+    av_assert0(unit->content_ref); \
+    priv->ps_var ## _ref[id] = av_buffer_ref(unit->content_ref); \
+    if (!priv->ps_var ## _ref[id]) \
+        return AVERROR(ENOMEM); \
+    priv->ps_var[id] = (EVCRaw ## ps_name *)priv->ps_var ## _ref[id]->data; \
+    return 0; \
+}
+
+cbs_evc_replace_ps(SPS, sps, sps_seq_parameter_set_id)
+cbs_evc_replace_ps(PPS, pps, pps_pic_parameter_set_id)
+
+static int cbs_evc_read_nal_unit(CodedBitstreamContext *ctx,
+                                 CodedBitstreamUnit *unit)
+{
+    GetBitContext gbc;
+    int err;
+
+    err = init_get_bits(&gbc, unit->data, 8 * unit->data_size);
+    if (err < 0)
+        return err;
+
+    err = ff_cbs_alloc_unit_content(ctx, unit);
+    if (err < 0)
+        return err;
+
+    switch (unit->type) {
+    case EVC_SPS_NUT:
+        {
+            EVCRawSPS *sps = unit->content;
+
+            err = cbs_evc_read_sps(ctx, &gbc, sps);
+            if (err < 0)
+                return err;
+
+            err = cbs_evc_replace_sps(ctx, unit);
+            if (err < 0)
+                return err;
+        }
+        break;
+
+    case EVC_PPS_NUT:
+        {
+            EVCRawPPS *pps = unit->content;
+
+            err = cbs_evc_read_pps(ctx, &gbc, pps);
+            if (err < 0)
+                return err;
+
+            err = cbs_evc_replace_pps(ctx, unit);
+            if (err < 0)
+                return err;
+        }
+        break;
+
+    case EVC_APS_NUT:
+        {
+            EVCRawAPS *aps = unit->content;
+            int pos;
+
+            err = cbs_evc_read_aps(ctx, &gbc, aps);
+            if (err < 0)
+                return err;
+
+            if (!cbs_evc_read_more_rbsp_data(&gbc))
+                return AVERROR_INVALIDDATA;
+
+            pos = get_bits_count(&gbc);
+
+            aps->data_size = unit->data_size - pos / 8;
+            aps->data_ref  = av_buffer_ref(unit->data_ref);
+            if (!aps->data_ref)
+                return AVERROR(ENOMEM);
+            aps->data = unit->data + pos / 8;
+            aps->data_bit_start = pos % 8;
+        }
+        break;
+
+    case EVC_NOIDR_NUT:
+    case EVC_IDR_NUT:
+        {
+            EVCRawSlice *slice = unit->content;
+            int pos;
+
+            err = cbs_evc_read_slice_header(ctx, &gbc, &slice->header);
+            if (err < 0)
+                return err;
+
+            if (!cbs_evc_read_more_rbsp_data(&gbc))
+                return AVERROR_INVALIDDATA;
+
+            pos = get_bits_count(&gbc);
+
+            slice->data_size = unit->data_size - pos / 8;
+            slice->data_ref  = av_buffer_ref(unit->data_ref);
+            if (!slice->data_ref)
+                return AVERROR(ENOMEM);
+            slice->data = unit->data + pos / 8;
+            slice->data_bit_start = pos % 8;
+        }
+        break;
+
+    case EVC_SEI_NUT:
+        {
+            err = cbs_evc_read_sei(ctx, &gbc, unit->content);
+            if (err < 0)
+                return err;
+        }
+        break;
+
+    default:
+        return AVERROR(ENOSYS);
+    }
+
+    return 0;
+}
+
+// Copy the undecomposed remainder of a NAL unit (slice data or APS
+// payload), including its trailing bits.
+static int cbs_evc_write_remaining_data(CodedBitstreamContext *ctx,
+                                        PutBitContext *pbc, const uint8_t *data,
+                                        size_t data_size, int data_bit_start)
+{
+    size_t rest  = data_size - (data_bit_start + 7) / 8;
+    const uint8_t *pos = data + data_bit_start / 8;
+
+    av_assert0(data_bit_start >= 0 &&
+               data_size > data_bit_start / 8);
+
+    if (data_size * 8 + 8 > put_bits_left(pbc))
+        return AVERROR(ENOSPC);
+
+    if (!rest)
+        goto rbsp_stop_one_bit;
+
+    // First copy the remaining bits of the first byte
+    // The above check ensures that we do not accidentally
+    // copy beyond the rbsp_stop_one_bit.
+    if (data_bit_start % 8)
+        put_bits(pbc, 8 - data_bit_start % 8,
+                 *pos++ & MAX_UINT_BITS(8 - data_bit_start % 8));
+
+    if (put_bits_count(pbc) % 8 == 0) {
+        // If the writer is aligned at this point,
+        // memcpy can be used to improve performance.
+        flush_put_bits(pbc);
+        memcpy(put_bits_ptr(pbc), pos, rest);
+        skip_put_bytes(pbc, rest);
+    } else {
+        // If not, we have to copy manually.
+        // rbsp_stop_one_bit forces us to special-case
+        // the last byte.
+        uint8_t temp;
+        int i;
+
+        for (; rest > 4; rest -= 4, pos += 4)
+            put_bits32(pbc, AV_RB32(pos));
+
+        for (; rest > 1; rest--, pos++)
+            put_bits(pbc, 8, *pos);
+
+    rbsp_stop_one_bit:
+        temp = rest ? *pos : *pos & MAX_UINT_BITS(8 - data_bit_start % 8);
+
+        av_assert0(temp);
+        i = ff_ctz(*pos);
+        temp = temp >> i;
+        i = rest ? (8 - i) : (8 - i - data_bit_start % 8);
+        put_bits(pbc, i, temp);
+        if (put_bits_count(pbc) % 8)
+            put_bits(pbc, 8 - put_bits_count(pbc) % 8, 0);
+    }
+
+    return 0;
+}
+
+static int cbs_evc_write_nal_unit(CodedBitstreamContext *ctx,
+                                  CodedBitstreamUnit *unit,
+                                  PutBitContext *pbc)
+{
+    int err;
+
+    switch (unit->type) {
+    case EVC_SPS_NUT:
+        {
+            EVCRawSPS *sps = unit->content;
+
+            err = cbs_evc_write_sps(ctx, pbc, sps);
+            if (err < 0)
+                return err;
+
+            err = cbs_evc_replace_sps(ctx, unit);
+            if (err < 0)
+                return err;
+        }
+        break;
+
+    case EVC_PPS_NUT:
+        {
+            EVCRawPPS *pps = unit->content;
+
+            err = cbs_evc_write_pps(ctx, pbc, pps);
+            if (err < 0)
+                return err;
+
+            err = cbs_evc_replace_pps(ctx, unit);
+            if (err < 0)
+                return err;
+        }
+        break;
+
+    case EVC_APS_NUT:
+        {
+            EVCRawAPS *aps = unit->content;
+
+            err = cbs_evc_write_aps(ctx, pbc, aps);
+            if (err < 0)
+                return err;
+
+            if (!aps->data) {
+                av_log(ctx->log_ctx, AV_LOG_ERROR, "APS payload must be "
+                       "set for writing.\n");
+                return AVERROR_INVALIDDATA;
+            }
+            err = cbs_evc_write_remaining_data(ctx, pbc, aps->data,
+                                               aps->data_size,
+                                               aps->data_bit_start);
+            if (err < 0)
+                return err;
+        }
+        break;
+
+    case EVC_NOIDR_NUT:
+    case EVC_IDR_NUT:
+        {
+            EVCRawSlice *slice = unit->content;
+
+            err = cbs_evc_write_slice_header(ctx, pbc, &slice->header);
+            if (err < 0)
+                return err;
+
+            if (slice->data) {
+                err = cbs_evc_write_remaining_data(ctx, pbc, slice->data,
+                                                   slice->data_size,
+                                                   slice->data_bit_start);
+                if (err < 0)
+                    return err;
+            } else {
+                // No slice data - that was just the header.
+                // (Bitstream may be unaligned!)
+            }
+        }
+        break;
+
+    case EVC_SEI_NUT:
+        {
+            err = cbs_evc_write_sei(ctx, pbc, unit->content);
+            if (err < 0)
+                return err;
+        }
+        break;
+
+    default:
+        av_log(ctx->log_ctx, AV_LOG_ERROR, "Write unimplemented for "
+               "NAL unit type %"PRIu32".\n", unit->type);
+        return AVERROR_PATCHWELCOME;
+    }
+
+    return 0;
+}
+
+// Rebuild an EVCDecoderConfigurationRecord around the units of the
+// fragment, with one array per NAL unit type.
+static int cbs_evc_assemble_evcc(CodedBitstreamContext *ctx,
+                                 CodedBitstreamFragment *frag)
+{
+    CodedBitstreamEVCContext *priv = ctx->priv_data;
+    uint8_t header[EVC_EVCC_HEADER_SIZE];
+    int types[64], nb_types = 0;
+    PutByteContext pbc;
+    uint8_t *data;
+    size_t size;
+    int i, j;
+
+    memcpy(header, priv->evcc_header, sizeof(header));
+
+    size = EVC_EVCC_HEADER_SIZE;
+    for (i = 0; i < frag->nb_units; i++) {
+        const CodedBitstreamUnit *unit = &frag->units[i];
+
+        if (unit->data_size > UINT16_MAX) {
+            av_log(ctx->log_ctx, AV_LOG_ERROR, "NAL unit too large for "
+                   "evcC: %"SIZE_SPECIFIER" bytes.\n", unit->data_size);
+            return AVERROR(EINVAL);
+        }
+        size += 2 + unit->data_size;
+
+        for (j = 0; j < nb_types; j++) {
+            if (types[j] == unit->type)
+                break;
+        }
+        if (j == nb_types) {
+            types[nb_types++] = unit->type;
+            size += 3;
+        }
+
+        // Keep the sequence description in sync with a rewritten SPS.
+        if (unit->type == EVC_SPS_NUT && unit->content) {
+            const EVCRawSPS *sps = unit->content;
+
+            header[1] = sps->profile_idc;
+            header[2] = sps->level_idc;
+            AV_WB32(header + 3, sps->toolset_idc_h);
+            AV_WB32(header + 7, sps->toolset_idc_l);
+            header[11] = sps->chroma_format_idc << 6 |
+                         sps->bit_depth_luma_minus8 << 3 |
+                         sps->bit_depth_chroma_minus8;
+            AV_WB16(header + 12, sps->pic_width_in_luma_samples);
+            AV_WB16(header + 14, sps->pic_height_in_luma_samples);
+        }
+    }
+    header[17] = nb_types;
+
+    data = av_malloc(size + AV_INPUT_BUFFER_PADDING_SIZE);
+    if (!data)
+        return AVERROR(ENOMEM);
+
+    bytestream2_init_writer(&pbc, data, size);
+    bytestream2_put_buffer(&pbc, header, sizeof(header));
+    for (i = 0; i < nb_types; i++) {
+        int count = 0;
+
+        for (j = 0; j < frag->nb_units; j++)
+            count += frag->units[j].type == types[i];
+
+        // array_completeness, reserved, NAL_unit_type
+        bytestream2_put_byte(&pbc, 0x80 | types[i]);
+        bytestream2_put_be16(&pbc, count);
+        for (j = 0; j < frag->nb_units; j++) {
+            const CodedBitstreamUnit *unit = &frag->units[j];
+
+            if (unit->type != types[i])
+                continue;
+            bytestream2_put_be16(&pbc, unit->data_size);
+            bytestream2_put_buffer(&pbc, unit->data, unit->data_size);
+        }
+    }
+    av_assert0(bytestream2_tell_p(&pbc) == size);
+    memset(data + size, 0, AV_INPUT_BUFFER_PADDING_SIZE);
+
+    frag->data_ref = av_buffer_create(data, size + AV_INPUT_BUFFER_PADDING_SIZE,
+                                      NULL, NULL, 0);
+    if (!frag->data_ref) {
+        av_freep(&data);
+        return AVERROR(ENOMEM);
+    }
+
+    frag->data      = data;
+    frag->data_size = size;
+
+    return 0;
+}
+
+static int cbs_evc_assemble_fragment(CodedBitstreamContext *ctx,
+                                     CodedBitstreamFragment *frag)
+{
+    CodedBitstreamEVCContext *priv = ctx->priv_data;
+    int nal_length_size = priv->nal_length_size ? priv->nal_length_size
+                                                : EVC_NALU_LENGTH_PREFIX_SIZE;
+    uint8_t *data;
+    size_t size, dp;
+    int i, j;
+
+    for (i = 0; i < frag->nb_units; i++) {
+        // Data should already all have been written when we get here.
+        av_assert0(frag->units[i].data);
+    }
+
+    if (priv->evcc)
+        return cbs_evc_assemble_evcc(ctx, frag);
+
+    size = 0;
+    for (i = 0; i < frag->nb_units; i++) {
+        const CodedBitstreamUnit *unit = &frag->units[i];
+
+        if (nal_length_size < 4 &&
+            unit->data_size >> (8 * nal_length_size)) {
+            av_log(ctx->log_ctx, AV_LOG_ERROR, "NAL unit too large for a "
+                   "%d byte length field: %"SIZE_SPECIFIER" bytes.\n",
+                   nal_length_size, unit->data_size);
+            return AVERROR(EINVAL);
+        }
+        size += nal_length_size + unit->data_size;
+    }
+
+    data = av_malloc(size + AV_INPUT_BUFFER_PADDING_SIZE);
+    if (!data)
+        return AVERROR(ENOMEM);
+
+    dp = 0;
+    for (i = 0; i < frag->nb_units; i++) {
+        const CodedBitstreamUnit *unit = &frag->units[i];
+
+        for (j = nal_length_size - 1; j >= 0; j--)
+            data[dp++] = unit->data_size >> (8 * j);
+        memcpy(data + dp, unit->data, unit->data_size);
+        dp += unit->data_size;
+    }
+
+    av_assert0(dp == size);
+    memset(data + size, 0, AV_INPUT_BUFFER_PADDING_SIZE);
+
+    frag->data_ref = av_buffer_create(data, size + AV_INPUT_BUFFER_PADDING_SIZE,
+                                      NULL, NULL, 0);
+    if (!frag->data_ref) {
+        av_freep(&data);
+        return AVERROR(ENOMEM);
+    }
+
+    frag->data      = data;
+    frag->data_size = size;
+
+    return 0;
+}
+
+static void cbs_evc_flush(CodedBitstreamContext *ctx)
+{
+    CodedBitstreamEVCContext *evc = ctx->priv_data;
+
+    for (int i = 0; i < FF_ARRAY_ELEMS(evc->sps); i++) {
+        av_buffer_unref(&evc->sps_ref[i]);
+        evc->sps[i] = NULL;
+    }
+    for (int i = 0; i < FF_ARRAY_ELEMS(evc->pps); i++) {
+        av_buffer_unref(&evc->pps_ref[i]);
+        evc->pps[i] = NULL;
+    }
+}
+
+static void cbs_evc_close(CodedBitstreamContext *ctx)
+{
+    CodedBitstreamEVCContext *evc = ctx->priv_data;
+    int i;
+
+    for (i = 0; i < FF_ARRAY_ELEMS(evc->sps); i++)
+        av_buffer_unref(&evc->sps_ref[i]);
+    for (i = 0; i < FF_ARRAY_ELEMS(evc->pps); i++)
+        av_buffer_unref(&evc->pps_ref[i]);
+}
+
+static void cbs_evc_free_sei(void *opaque, uint8_t *content)
+{
+    EVCRawSEI *sei = (EVCRawSEI*)content;
+
+    for (int i = 0; i < sei->message_count; i++)
+        av_buffer_unref(&sei->message[i].payload_ref);
+    av_free(content);
+}
+
+static const CodedBitstreamUnitTypeDescriptor cbs_evc_unit_types[] = {
+    CBS_UNIT_TYPE_POD(EVC_SPS_NUT, EVCRawSPS),
+    CBS_UNIT_TYPE_POD(EVC_PPS_NUT, EVCRawPPS),
+
+    CBS_UNIT_TYPE_INTERNAL_REF(EVC_APS_NUT, EVCRawAPS, data),
+
+    CBS_UNIT_TYPES_INTERNAL_REF((EVC_NOIDR_NUT, EVC_IDR_NUT),
+                                EVCRawSlice, data),
+
+    CBS_UNIT_TYPE_COMPLEX(EVC_SEI_NUT, EVCRawSEI, &cbs_evc_free_sei),
+
+    CBS_UNIT_TYPE_END_OF_LIST
+};
+
+const CodedBitstreamType ff_cbs_type_evc = {
+    .codec_id          = AV_CODEC_ID_EVC,
+
+    .priv_data_size    = sizeof(CodedBitstreamEVCContext),
+
+    .unit_types        = cbs_evc_unit_types,
+
+    .split_fragment    = &cbs_evc_split_fragment,
+    .read_unit         = &cbs_evc_read_nal_unit,
+    .write_unit        = &cbs_evc_write_nal_unit,
+    .assemble_fragment = &cbs_evc_assemble_fragment,
+
+    .flush             = &cbs_evc_flush,
+    .close             = &cbs_evc_close,
+};
@@ -0,0 +1,305 @@
+/*
+ * This file is part of FFmpeg.
+ *
+ * FFmpeg is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * FFmpeg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with FFmpeg; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef AVCODEC_CBS_EVC_H
+#define AVCODEC_CBS_EVC_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "libavutil/buffer.h"
+
+#include "evc.h"
+
+enum {
+    // Maximum number of SEI messages stored in one SEI NAL unit.
+    EVC_MAX_SEI_PAYLOADS = 64,
+
+    // Size of the fixed part of an EVCDecoderConfigurationRecord,
+    // up to and including lengthSizeMinusOne and numOfArrays.
+    EVC_EVCC_HEADER_SIZE = 18,
+};
+
+typedef struct EVCRawNALUnitHeader {
+    uint8_t nal_unit_type_plus1;
+    uint8_t nuh_temporal_id;
+    uint8_t nuh_reserved_zero_5bits;
+    uint8_t nuh_extension_flag;
+} EVCRawNALUnitHeader;
+
+typedef struct EVCRawHRD {
+    uint8_t  cpb_cnt_minus1;
+    uint8_t  bit_rate_scale;
+    uint8_t  cpb_size_scale;
+    uint32_t bit_rate_value_minus1[EVC_MAX_CPB_CNT];
+    uint32_t cpb_size_value_minus1[EVC_MAX_CPB_CNT];
+    uint8_t  cbr_flag[EVC_MAX_CPB_CNT];
+
+    uint8_t  initial_cpb_removal_delay_length_minus1;
+    uint8_t  cpb_removal_delay_length_minus1;
+    uint8_t  dpb_output_delay_length_minus1;
+    uint8_t  time_offset_length;
+} EVCRawHRD;
+
+typedef struct EVCRawVUI {
+    uint8_t  aspect_ratio_info_present_flag;
+    uint8_t  aspect_ratio_idc;
+    uint16_t sar_width;
+    uint16_t sar_height;
+
+    uint8_t  overscan_info_present_flag;
+    uint8_t  overscan_appropriate_flag;
+
+    uint8_t  video_signal_type_present_flag;
+    uint8_t  video_format;
+    uint8_t  video_full_range_flag;
+    uint8_t  colour_description_present_flag;
+    uint8_t  colour_primaries;
+    uint8_t  transfer_characteristics;
+    uint8_t  matrix_coefficients;
+
+    uint8_t  chroma_loc_info_present_flag;
+    uint8_t  chroma_sample_loc_type_top_field;
+    uint8_t  chroma_sample_loc_type_bottom_field;
+
+    uint8_t  neutral_chroma_indication_flag;
+    uint8_t  field_seq_flag;
+
+    uint8_t  timing_info_present_flag;
+    uint32_t num_units_in_tick;
+    uint32_t time_scale;
+    uint8_t  fixed_pic_rate_flag;
+
+    uint8_t  nal_hrd_parameters_present_flag;
+    EVCRawHRD nal_hrd_parameters;
+    uint8_t  vcl_hrd_parameters_present_flag;
+    EVCRawHRD vcl_hrd_parameters;
+    uint8_t  low_delay_hrd_flag;
+
+    uint8_t  pic_struct_present_flag;
+
+    uint8_t  bitstream_restriction_flag;
+    uint8_t  motion_vectors_over_pic_boundaries_flag;
+    uint8_t  max_bytes_per_pic_denom;
+    uint8_t  max_bits_per_mb_denom;
+    uint8_t  log2_max_mv_length_horizontal;
+    uint8_t  log2_max_mv_length_vertical;
+    uint8_t  num_reorder_pics;
+    uint8_t  max_dec_pic_buffering;
+} EVCRawVUI;
+
+typedef struct EVCRawRefPicListStruct {
+    uint8_t  num_ref_entries;
+    uint8_t  st_ref_pic_flag[EVC_MAX_NUM_REF_PICS];
+    uint16_t abs_delta_poc_st[EVC_MAX_NUM_REF_PICS];
+    uint8_t  strp_entry_sign_flag[EVC_MAX_NUM_REF_PICS];
+    uint32_t poc_lsb_lt[EVC_MAX_NUM_REF_PICS];
+} EVCRawRefPicListStruct;
+
+typedef struct EVCRawSPS {
+    EVCRawNALUnitHeader nal_unit_header;
+
+    uint8_t  sps_seq_parameter_set_id;
+    uint8_t  profile_idc;
+    uint8_t  level_idc;
+    uint32_t toolset_idc_h;
+    uint32_t toolset_idc_l;
+    uint8_t  chroma_format_idc;
+    uint16_t pic_width_in_luma_samples;
+    uint16_t pic_height_in_luma_samples;
+    uint8_t  bit_depth_luma_minus8;
+    uint8_t  bit_depth_chroma_minus8;
+
+    uint8_t  sps_btt_flag;
+    uint8_t  log2_ctu_size_minus5;
+    uint8_t  log2_min_cb_size_minus2;
+    uint8_t  log2_diff_ctu_max_14_cb_size;
+    uint8_t  log2_diff_ctu_max_tt_cb_size;
+    uint8_t  log2_diff_min_cb_min_tt_cb_size_minus2;
+
+    uint8_t  sps_suco_flag;
+    uint8_t  log2_diff_ctu_size_max_suco_cb_size;
+    uint8_t  log2_diff_max_suco_min_suco_cb_size;
+
+    uint8_t  sps_admvp_flag;
+    uint8_t  sps_affine_flag;
+    uint8_t  sps_amvr_flag;
+    uint8_t  sps_dmvr_flag;
+    uint8_t  sps_mmvd_flag;
+    uint8_t  sps_hmvp_flag;
+
+    uint8_t  sps_eipd_flag;
+    uint8_t  sps_ibc_flag;
+    uint8_t  log2_max_ibc_cand_size_minus2;
+
+    uint8_t  sps_cm_init_flag;
+    uint8_t  sps_adcc_flag;
+
+    uint8_t  sps_iqt_flag;
+    uint8_t  sps_ats_flag;
+
+    uint8_t  sps_addb_flag;
+    uint8_t  sps_alf_flag;
+    uint8_t  sps_htdf_flag;
+    uint8_t  sps_rpl_flag;
+    uint8_t  sps_pocs_flag;
+    uint8_t  sps_dquant_flag;
+    uint8_t  sps_dra_flag;
+
+    uint8_t  log2_max_pic_order_cnt_lsb_minus4;
+    uint8_t  log2_sub_gop_length;
+    uint8_t  log2_ref_pic_gap_length;
+
+    uint8_t  max_num_tid0_ref_pics;
+
+    uint8_t  sps_max_dec_pic_buffering_minus1;
+    uint8_t  long_term_ref_pic_flag;
+    uint8_t  rpl1_same_as_rpl0_flag;
+    uint8_t  num_ref_pic_list_in_sps[2];
+    EVCRawRefPicListStruct rpls[2][EVC_MAX_NUM_RPLS];
+
+    uint8_t  picture_cropping_flag;
+    uint16_t picture_crop_left_offset;
+    uint16_t picture_crop_right_offset;
+    uint16_t picture_crop_top_offset;
+    uint16_t picture_crop_bottom_offset;
+
+    uint8_t  chroma_qp_table_present_flag;
+    uint8_t  same_qp_table_for_chroma;
+    uint8_t  global_offset_flag;
+    uint8_t  num_points_in_qp_table_minus1[2];
+    uint8_t  delta_qp_in_val_minus1[2][EVC_MAX_QP_TABLE_SIZE];
+    int8_t   delta_qp_out_val[2][EVC_MAX_QP_TABLE_SIZE];
+
+    uint8_t  vui_parameters_present_flag;
+    EVCRawVUI vui;
+} EVCRawSPS;
+
+typedef struct EVCRawPPS {
+    EVCRawNALUnitHeader nal_unit_header;
+
+    uint8_t  pps_pic_parameter_set_id;
+    uint8_t  pps_seq_parameter_set_id;
+    uint8_t  num_ref_idx_default_active_minus1[2];
+    uint8_t  additional_lt_poc_lsb_len;
+    uint8_t  rpl1_idx_present_flag;
+    uint8_t  single_tile_in_pic_flag;
+    uint8_t  num_tile_columns_minus1;
+    uint8_t  num_tile_rows_minus1;
+    uint8_t  uniform_tile_spacing_flag;
+    uint16_t tile_column_width_minus1[EVC_MAX_TILE_COLUMNS];
+    uint16_t tile_row_height_minus1[EVC_MAX_TILE_ROWS];
+    uint8_t  loop_filter_across_tiles_enabled_flag;
+    uint8_t  tile_offset_len_minus1;
+    uint8_t  tile_id_len_minus1;
+    uint8_t  explicit_tile_id_flag;
+    uint16_t tile_id_val[EVC_MAX_TILE_ROWS][EVC_MAX_TILE_COLUMNS];
+    uint8_t  pic_dra_enabled_flag;
+    uint8_t  pic_dra_aps_id;
+    uint8_t  arbitrary_slice_present_flag;
+    uint8_t  constrained_intra_pred_flag;
+    uint8_t  cu_qp_delta_enabled_flag;
+    uint8_t  log2_cu_qp_delta_area_minus6;
+} EVCRawPPS;
+
+// Only the leading parameter set identification is decomposed, the
+// ALF / DRA payload and the trailing bits are carried as data.
+typedef struct EVCRawAPS {
+    EVCRawNALUnitHeader nal_unit_header;
+
+    uint8_t  adaptation_parameter_set_id;
+    uint8_t  aps_params_type;
+
+    uint8_t     *data;
+    AVBufferRef *data_ref;
+    size_t       data_size;
+    int          data_bit_start;
+} EVCRawAPS;
+
+// The slice header is decomposed up to slice_pic_order_cnt_lsb, everything
+// after that is carried with the slice data.
+typedef struct EVCRawSliceHeader {
+    EVCRawNALUnitHeader nal_unit_header;
+
+    uint8_t  slice_pic_parameter_set_id;
+    uint8_t  single_tile_in_slice_flag;
+    uint16_t first_tile_id;
+    uint8_t  arbitrary_slice_flag;
+    uint16_t last_tile_id;
+    uint16_t num_remaining_tiles_in_slice_minus1;
+    uint16_t delta_tile_id_minus1[EVC_MAX_TILE_ROWS * EVC_MAX_TILE_COLUMNS];
+
+    uint8_t  slice_type;
+    uint8_t  no_output_of_prior_pics_flag;
+    uint8_t  mmvd_group_enable_flag;
+
+    uint8_t  slice_alf_enabled_flag;
+    uint8_t  slice_alf_luma_aps_id;
+    uint8_t  slice_alf_map_flag;
+    uint8_t  slice_alf_chroma_idc;
+    uint8_t  slice_alf_chroma_aps_id;
+    uint8_t  slice_alf_chroma_map_flag;
+    uint8_t  slice_alf_chroma2_aps_id;
+    uint8_t  slice_alf_chroma2_map_flag;
+
+    uint32_t slice_pic_order_cnt_lsb;
+} EVCRawSliceHeader;
+
+typedef struct EVCRawSlice {
+    EVCRawSliceHeader header;
+
+    uint8_t     *data;
+    AVBufferRef *data_ref;
+    size_t       data_size;
+    int          data_bit_start;
+} EVCRawSlice;
+
+// SEI payloads are kept as raw bytes, indexed by payload type.
+typedef struct EVCRawSEIMessage {
+    uint32_t     payload_type;
+    uint32_t     payload_size;
+    uint8_t     *payload;
+    AVBufferRef *payload_ref;
+} EVCRawSEIMessage;
+
+typedef struct EVCRawSEI {
+    EVCRawNALUnitHeader nal_unit_header;
+
+    EVCRawSEIMessage message[EVC_MAX_SEI_PAYLOADS];
+    uint8_t          message_count;
+} EVCRawSEI;
+
+typedef struct CodedBitstreamEVCContext {
+    // Length of the NAL unit size field, from the evcC header if
+    // there was one (EVC_NALU_LENGTH_PREFIX_SIZE otherwise).
+    int nal_length_size;
+
+    // Set when the last fragment read was an evcC header, so that
+    // writing it back creates an evcC header again.
+    int evcc;
+    uint8_t evcc_header[EVC_EVCC_HEADER_SIZE];
+
+    // All currently available parameter sets.  These are updated when
+    // any parameter set NAL unit is read/written with this context.
+    AVBufferRef *sps_ref[EVC_MAX_SPS_COUNT];
+    AVBufferRef *pps_ref[EVC_MAX_PPS_COUNT];
+    EVCRawSPS *sps[EVC_MAX_SPS_COUNT];
+    EVCRawPPS *pps[EVC_MAX_PPS_COUNT];
+} CodedBitstreamEVCContext;
+
+#endif /* AVCODEC_CBS_EVC_H */
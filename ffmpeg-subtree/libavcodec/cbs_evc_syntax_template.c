@@ -0,0 +1,580 @@
+/*
+ * This file is part of FFmpeg.
+ *
+ * FFmpeg is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * FFmpeg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with FFmpeg; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+static int FUNC(rbsp_trailing_bits)(CodedBitstreamContext *ctx, RWContext *rw)
+{
+    int err;
+
+    fixed(1, rbsp_stop_one_bit, 1);
+    while (byte_alignment(rw) != 0)
+        fixed(1, rbsp_alignment_zero_bit, 0);
+
+    return 0;
+}
+
+static int FUNC(nal_unit_header)(CodedBitstreamContext *ctx, RWContext *rw,
+                                 EVCRawNALUnitHeader *current,
+                                 int expected_nal_unit_type)
+{
+    int err;
+
+    fixed(1, forbidden_zero_bit, 0);
+
+    if (expected_nal_unit_type >= 0)
+        u(6, nal_unit_type_plus1, expected_nal_unit_type + 1,
+                                  expected_nal_unit_type + 1);
+    else
+        u(6, nal_unit_type_plus1, 1, 63);
+
+    ub(3, nuh_temporal_id);
+    ub(5, nuh_reserved_zero_5bits);
+    flag(nuh_extension_flag);
+
+    return 0;
+}
+
+static int FUNC(hrd_parameters)(CodedBitstreamContext *ctx, RWContext *rw,
+                                EVCRawHRD *current)
+{
+    int err, i;
+
+    ue(cpb_cnt_minus1, 0, EVC_MAX_CPB_CNT - 1);
+    ub(4, bit_rate_scale);
+    ub(4, cpb_size_scale);
+
+    for (i = 0; i <= current->cpb_cnt_minus1; i++) {
+        ues(bit_rate_value_minus1[i], 0, UINT32_MAX - 1, 1, i);
+        ues(cpb_size_value_minus1[i], 0, UINT32_MAX - 1, 1, i);
+        flags(cbr_flag[i], 1, i);
+    }
+
+    ub(5, initial_cpb_removal_delay_length_minus1);
+    ub(5, cpb_removal_delay_length_minus1);
+    ub(5, dpb_output_delay_length_minus1);
+    ub(5, time_offset_length);
+
+    return 0;
+}
+
+static int FUNC(vui_parameters)(CodedBitstreamContext *ctx, RWContext *rw,
+                                EVCRawVUI *current)
+{
+    int err;
+
+    flag(aspect_ratio_info_present_flag);
+    if (current->aspect_ratio_info_present_flag) {
+        ub(8, aspect_ratio_idc);
+        if (current->aspect_ratio_idc == 255) {
+            ub(16, sar_width);
+            ub(16, sar_height);
+        }
+    }
+
+    flag(overscan_info_present_flag);
+    if (current->overscan_info_present_flag)
+        flag(overscan_appropriate_flag);
+
+    flag(video_signal_type_present_flag);
+    if (current->video_signal_type_present_flag) {
+        ub(3, video_format);
+        flag(video_full_range_flag);
+        flag(colour_description_present_flag);
+        if (current->colour_description_present_flag) {
+            ub(8, colour_primaries);
+            ub(8, transfer_characteristics);
+            ub(8, matrix_coefficients);
+        }
+    }
+
+    flag(chroma_loc_info_present_flag);
+    if (current->chroma_loc_info_present_flag) {
+        ue(chroma_sample_loc_type_top_field,    0, 5);
+        ue(chroma_sample_loc_type_bottom_field, 0, 5);
+    }
+
+    flag(neutral_chroma_indication_flag);
+    flag(field_seq_flag);
+
+    flag(timing_info_present_flag);
+    if (current->timing_info_present_flag) {
+        u(32, num_units_in_tick, 1, UINT32_MAX);
+        u(32, time_scale,        1, UINT32_MAX);
+        flag(fixed_pic_rate_flag);
+    }
+
+    flag(nal_hrd_parameters_present_flag);
+    if (current->nal_hrd_parameters_present_flag)
+        CHECK(FUNC(hrd_parameters)(ctx, rw, &current->nal_hrd_parameters));
+    flag(vcl_hrd_parameters_present_flag);
+    if (current->vcl_hrd_parameters_present_flag)
+        CHECK(FUNC(hrd_parameters)(ctx, rw, &current->vcl_hrd_parameters));
+    if (current->nal_hrd_parameters_present_flag ||
+        current->vcl_hrd_parameters_present_flag)
+        flag(low_delay_hrd_flag);
+
+    flag(pic_struct_present_flag);
+
+    flag(bitstream_restriction_flag);
+    if (current->bitstream_restriction_flag) {
+        flag(motion_vectors_over_pic_boundaries_flag);
+        ue(max_bytes_per_pic_denom, 0, 16);
+        ue(max_bits_per_mb_denom,   0, 16);
+        ue(log2_max_mv_length_horizontal, 0, 16);
+        ue(log2_max_mv_length_vertical,   0, 16);
+        ue(num_reorder_pics,      0, EVC_MAX_NUM_REF_PICS);
+        ue(max_dec_pic_buffering, 0, EVC_MAX_NUM_REF_PICS);
+    }
+
+    return 0;
+}
+
+static int FUNC(ref_pic_list_struct)(CodedBitstreamContext *ctx, RWContext *rw,
+                                     EVCRawRefPicListStruct *current,
+                                     const EVCRawSPS *sps)
+{
+    int err, i;
+
+    ue(num_ref_entries, 0, EVC_MAX_NUM_REF_PICS);
+
+    for (i = 0; i < current->num_ref_entries; i++) {
+        if (sps->long_term_ref_pic_flag)
+            flags(st_ref_pic_flag[i], 1, i);
+        else
+            infer(st_ref_pic_flag[i], 1);
+
+        if (current->st_ref_pic_flag[i]) {
+            ues(abs_delta_poc_st[i], 0, INT16_MAX, 1, i);
+            if (current->abs_delta_poc_st[i])
+                flags(strp_entry_sign_flag[i], 1, i);
+        } else {
+            ubs(sps->log2_max_pic_order_cnt_lsb_minus4 + 4,
+                poc_lsb_lt[i], 1, i);
+        }
+    }
+
+    return 0;
+}
+
+static int FUNC(sps)(CodedBitstreamContext *ctx, RWContext *rw,
+                     EVCRawSPS *current)
+{
+    int err, i, j;
+
+    HEADER("Sequence Parameter Set");
+
+    CHECK(FUNC(nal_unit_header)(ctx, rw, &current->nal_unit_header,
+                                EVC_SPS_NUT));
+
+    ue(sps_seq_parameter_set_id, 0, EVC_MAX_SPS_COUNT - 1);
+
+    ub(8, profile_idc);
+    ub(8, level_idc);
+    ub(32, toolset_idc_h);
+    ub(32, toolset_idc_l);
+
+    ue(chroma_format_idc, 0, 3);
+
+    ue(pic_width_in_luma_samples,  1, EVC_MAX_WIDTH);
+    ue(pic_height_in_luma_samples, 1, EVC_MAX_HEIGHT);
+
+    ue(bit_depth_luma_minus8,   0, 8);
+    ue(bit_depth_chroma_minus8, 0, 8);
+
+    flag(sps_btt_flag);
+    if (current->sps_btt_flag) {
+        ue(log2_ctu_size_minus5,                   0, 2);
+        ue(log2_min_cb_size_minus2,                0, 5);
+        ue(log2_diff_ctu_max_14_cb_size,           0, 6);
+        ue(log2_diff_ctu_max_tt_cb_size,           0, 6);
+        ue(log2_diff_min_cb_min_tt_cb_size_minus2, 0, 6);
+    }
+
+    flag(sps_suco_flag);
+    if (current->sps_suco_flag) {
+        ue(log2_diff_ctu_size_max_suco_cb_size, 0, 6);
+        ue(log2_diff_max_suco_min_suco_cb_size, 0, 6);
+    }
+
+    flag(sps_admvp_flag);
+    if (current->sps_admvp_flag) {
+        flag(sps_affine_flag);
+        flag(sps_amvr_flag);
+        flag(sps_dmvr_flag);
+        flag(sps_mmvd_flag);
+        flag(sps_hmvp_flag);
+    }
+
+    flag(sps_eipd_flag);
+    if (current->sps_eipd_flag) {
+        flag(sps_ibc_flag);
+        if (current->sps_ibc_flag)
+            ue(log2_max_ibc_cand_size_minus2, 0, 5);
+    }
+
+    flag(sps_cm_init_flag);
+    if (current->sps_cm_init_flag)
+        flag(sps_adcc_flag);
+
+    flag(sps_iqt_flag);
+    if (current->sps_iqt_flag)
+        flag(sps_ats_flag);
+
+    flag(sps_addb_flag);
+    flag(sps_alf_flag);
+    flag(sps_htdf_flag);
+    flag(sps_rpl_flag);
+    flag(sps_pocs_flag);
+    flag(sps_dquant_flag);
+    flag(sps_dra_flag);
+
+    if (current->sps_pocs_flag)
+        ue(log2_max_pic_order_cnt_lsb_minus4, 0, 12);
+
+    if (!current->sps_pocs_flag || !current->sps_rpl_flag) {
+        ue(log2_sub_gop_length, 0, 7);
+        if (current->log2_sub_gop_length == 0)
+            ue(log2_ref_pic_gap_length, 0, 7);
+    }
+
+    if (!current->sps_rpl_flag) {
+        ue(max_num_tid0_ref_pics, 0, EVC_MAX_NUM_REF_PICS);
+    } else {
+        ue(sps_max_dec_pic_buffering_minus1, 0, EVC_MAX_NUM_REF_PICS - 1);
+        flag(long_term_ref_pic_flag);
+        flag(rpl1_same_as_rpl0_flag);
+
+        ues(num_ref_pic_list_in_sps[0], 0, EVC_MAX_NUM_RPLS, 1, 0);
+        for (i = 0; i < current->num_ref_pic_list_in_sps[0]; i++)
+            CHECK(FUNC(ref_pic_list_struct)(ctx, rw, &current->rpls[0][i],
+                                            current));
+
+        if (!current->rpl1_same_as_rpl0_flag) {
+            ues(num_ref_pic_list_in_sps[1], 0, EVC_MAX_NUM_RPLS, 1, 1);
+            for (i = 0; i < current->num_ref_pic_list_in_sps[1]; i++)
+                CHECK(FUNC(ref_pic_list_struct)(ctx, rw, &current->rpls[1][i],
+                                                current));
+        }
+    }
+
+    flag(picture_cropping_flag);
+    if (current->picture_cropping_flag) {
+        ue(picture_crop_left_offset,   0, current->pic_width_in_luma_samples);
+        ue(picture_crop_right_offset,  0, current->pic_width_in_luma_samples);
+        ue(picture_crop_top_offset,    0, current->pic_height_in_luma_samples);
+        ue(picture_crop_bottom_offset, 0, current->pic_height_in_luma_samples);
+    }
+
+    if (current->chroma_format_idc != 0) {
+        flag(chroma_qp_table_present_flag);
+        if (current->chroma_qp_table_present_flag) {
+            flag(same_qp_table_for_chroma);
+            flag(global_offset_flag);
+            for (i = 0; i < (current->same_qp_table_for_chroma ? 1 : 2); i++) {
+                ues(num_points_in_qp_table_minus1[i],
+                    0, EVC_MAX_QP_TABLE_SIZE - 1, 1, i);
+                for (j = 0; j <= current->num_points_in_qp_table_minus1[i]; j++) {
+                    ubs(6, delta_qp_in_val_minus1[i][j], 2, i, j);
+                    ses(delta_qp_out_val[i][j], -128, 127, 2, i, j);
+                }
+            }
+        }
+    }
+
+    flag(vui_parameters_present_flag);
+    if (current->vui_parameters_present_flag)
+        CHECK(FUNC(vui_parameters)(ctx, rw, &current->vui));
+
+    CHECK(FUNC(rbsp_trailing_bits)(ctx, rw));
+
+    return 0;
+}
+
+static int FUNC(pps)(CodedBitstreamContext *ctx, RWContext *rw,
+                     EVCRawPPS *current)
+{
+    int err, i, j;
+
+    HEADER("Picture Parameter Set");
+
+    CHECK(FUNC(nal_unit_header)(ctx, rw, &current->nal_unit_header,
+                                EVC_PPS_NUT));
+
+    ue(pps_pic_parameter_set_id, 0, EVC_MAX_PPS_COUNT - 1);
+    ue(pps_seq_parameter_set_id, 0, EVC_MAX_SPS_COUNT - 1);
+
+    for (i = 0; i < 2; i++)
+        ues(num_ref_idx_default_active_minus1[i], 0, 14, 1, i);
+    ue(additional_lt_poc_lsb_len, 0, 32);
+    flag(rpl1_idx_present_flag);
+
+    flag(single_tile_in_pic_flag);
+    if (!current->single_tile_in_pic_flag) {
+        ue(num_tile_columns_minus1, 0, EVC_MAX_TILE_COLUMNS - 1);
+        ue(num_tile_rows_minus1,    0, EVC_MAX_TILE_ROWS    - 1);
+        flag(uniform_tile_spacing_flag);
+        if (!current->uniform_tile_spacing_flag) {
+            for (i = 0; i < current->num_tile_columns_minus1; i++)
+                ues(tile_column_width_minus1[i], 0, EVC_MAX_WIDTH - 1, 1, i);
+            for (i = 0; i < current->num_tile_rows_minus1; i++)
+                ues(tile_row_height_minus1[i], 0, EVC_MAX_HEIGHT - 1, 1, i);
+        }
+        flag(loop_filter_across_tiles_enabled_flag);
+        ue(tile_offset_len_minus1, 0, 31);
+    }
+
+    ue(tile_id_len_minus1, 0, 15);
+    flag(explicit_tile_id_flag);
+    if (current->explicit_tile_id_flag) {
+        for (i = 0; i <= current->num_tile_rows_minus1; i++) {
+            for (j = 0; j <= current->num_tile_columns_minus1; j++)
+                ubs(current->tile_id_len_minus1 + 1, tile_id_val[i][j], 2, i, j);
+        }
+    }
+
+    flag(pic_dra_enabled_flag);
+    if (current->pic_dra_enabled_flag)
+        ub(5, pic_dra_aps_id);
+
+    flag(arbitrary_slice_present_flag);
+    flag(constrained_intra_pred_flag);
+
+    flag(cu_qp_delta_enabled_flag);
+    if (current->cu_qp_delta_enabled_flag)
+        ue(log2_cu_qp_delta_area_minus6, 0, 8);
+
+    CHECK(FUNC(rbsp_trailing_bits)(ctx, rw));
+
+    return 0;
+}
+
+static int FUNC(aps)(CodedBitstreamContext *ctx, RWContext *rw,
+                     EVCRawAPS *current)
+{
+    int err;
+
+    HEADER("Adaptation Parameter Set");
+
+    CHECK(FUNC(nal_unit_header)(ctx, rw, &current->nal_unit_header,
+                                EVC_APS_NUT));
+
+    ub(5, adaptation_parameter_set_id);
+    ub(3, aps_params_type);
+
+    return 0;
+}
+
+static int FUNC(slice_header)(CodedBitstreamContext *ctx, RWContext *rw,
+                              EVCRawSliceHeader *current)
+{
+    CodedBitstreamEVCContext *evc = ctx->priv_data;
+    const EVCRawSPS *sps;
+    const EVCRawPPS *pps;
+    int err, i, idr;
+
+    HEADER("Slice Header");
+
+    CHECK(FUNC(nal_unit_header)(ctx, rw, &current->nal_unit_header, -1));
+    idr = current->nal_unit_header.nal_unit_type_plus1 - 1 == EVC_IDR_NUT;
+
+    ue(slice_pic_parameter_set_id, 0, EVC_MAX_PPS_COUNT - 1);
+
+    pps = evc->pps[current->slice_pic_parameter_set_id];
+    if (!pps) {
+        av_log(ctx->log_ctx, AV_LOG_ERROR, "PPS id %d not available.\n",
+               current->slice_pic_parameter_set_id);
+        return AVERROR_INVALIDDATA;
+    }
+    sps = evc->sps[pps->pps_seq_parameter_set_id];
+    if (!sps) {
+        av_log(ctx->log_ctx, AV_LOG_ERROR, "SPS id %d not available.\n",
+               pps->pps_seq_parameter_set_id);
+        return AVERROR_INVALIDDATA;
+    }
+
+    if (!pps->single_tile_in_pic_flag) {
+        flag(single_tile_in_slice_flag);
+        ub(pps->tile_id_len_minus1 + 1, first_tile_id);
+    } else {
+        infer(single_tile_in_slice_flag, 1);
+    }
+
+    if (!current->single_tile_in_slice_flag) {
+        if (pps->arbitrary_slice_present_flag)
+            flag(arbitrary_slice_flag);
+        else
+            infer(arbitrary_slice_flag, 0);
+
+        if (!current->arbitrary_slice_flag) {
+            ub(pps->tile_id_len_minus1 + 1, last_tile_id);
+        } else {
+            ue(num_remaining_tiles_in_slice_minus1,
+               0, EVC_MAX_TILE_ROWS * EVC_MAX_TILE_COLUMNS - 2);
+            for (i = 0; i <= current->num_remaining_tiles_in_slice_minus1; i++)
+                ues(delta_tile_id_minus1[i],
+                    0, EVC_MAX_TILE_ROWS * EVC_MAX_TILE_COLUMNS - 1, 1, i);
+        }
+    }
+
+    ue(slice_type, 0, 2);
+
+    if (idr)
+        flag(no_output_of_prior_pics_flag);
+
+    if (sps->sps_mmvd_flag && (current->slice_type == EVC_SLICE_TYPE_B ||
+                               current->slice_type == EVC_SLICE_TYPE_P))
+        flag(mmvd_group_enable_flag);
+    else
+        infer(mmvd_group_enable_flag, 0);
+
+    if (sps->sps_alf_flag) {
+        int chroma_array_type = sps->chroma_format_idc;
+
+        flag(slice_alf_enabled_flag);
+        if (current->slice_alf_enabled_flag) {
+            ub(5, slice_alf_luma_aps_id);
+            flag(slice_alf_map_flag);
+            ub(2, slice_alf_chroma_idc);
+            if ((chroma_array_type == 1 || chroma_array_type == 2) &&
+                current->slice_alf_chroma_idc > 0)
+                ub(5, slice_alf_chroma_aps_id);
+        }
+
+        if (chroma_array_type == 3) {
+            int chroma_alf_enabled = 0, chroma2_alf_enabled = 0;
+
+            // For 4:4:4 the two chroma components are signalled separately,
+            // as selected by slice_alf_chroma_idc.
+            if (current->slice_alf_enabled_flag) {
+                chroma_alf_enabled  = current->slice_alf_chroma_idc & 1;
+                chroma2_alf_enabled = current->slice_alf_chroma_idc >> 1;
+            } else {
+                ub(2, slice_alf_chroma_idc);
+            }
+
+            if (chroma_alf_enabled) {
+                ub(5, slice_alf_chroma_aps_id);
+                flag(slice_alf_chroma_map_flag);
+            }
+            if (chroma2_alf_enabled) {
+                ub(5, slice_alf_chroma2_aps_id);
+                flag(slice_alf_chroma2_map_flag);
+            }
+        }
+    }
+
+    if (!idr && sps->sps_pocs_flag)
+        ub(sps->log2_max_pic_order_cnt_lsb_minus4 + 4, slice_pic_order_cnt_lsb);
+
+    return 0;
+}
+
+static int FUNC(sei_payload)(CodedBitstreamContext *ctx, RWContext *rw,
+                             EVCRawSEIMessage *current)
+{
+    int err, i;
+
+    if (current->payload_size)
+        allocate(current->payload, current->payload_size);
+
+    for (i = 0; i < current->payload_size; i++)
+        xu(8, payload_byte[i], current->payload[i], 0, 255, 1, i);
+
+    return 0;
+}
+
+static int FUNC(sei)(CodedBitstreamContext *ctx, RWContext *rw,
+                     EVCRawSEI *current)
+{
+    EVCRawSEIMessage *message;
+    uint32_t tmp;
+    int err, k;
+
+    HEADER("Supplemental Enhancement Information");
+
+    CHECK(FUNC(nal_unit_header)(ctx, rw, &current->nal_unit_header,
+                                EVC_SEI_NUT));
+
+#ifdef READ
+    for (k = 0; k < EVC_MAX_SEI_PAYLOADS; k++) {
+        uint32_t payload_type = 0;
+        uint32_t payload_size = 0;
+
+        while (show_bits(rw, 8) == 0xff) {
+            fixed(8, ff_byte, 0xff);
+            payload_type += 255;
+        }
+        xu(8, last_payload_type_byte, tmp, 0, 254, 0);
+        payload_type += tmp;
+
+        while (show_bits(rw, 8) == 0xff) {
+            fixed(8, ff_byte, 0xff);
+            payload_size += 255;
+        }
+        xu(8, last_payload_size_byte, tmp, 0, 254, 0);
+        payload_size += tmp;
+
+        // There must be space remaining for both the payload and
+        // the trailing bits on the SEI NAL unit.
+        if (payload_size + 1 > get_bits_left(rw) / 8) {
+            av_log(ctx->log_ctx, AV_LOG_ERROR,
+                   "Invalid SEI message: payload_size too large "
+                   "(%"PRIu32" bytes).\n", payload_size);
+            return AVERROR_INVALIDDATA;
+        }
+
+        message = &current->message[k];
+        message->payload_type = payload_type;
+        message->payload_size = payload_size;
+        current->message_count = k + 1;
+
+        CHECK(FUNC(sei_payload)(ctx, rw, message));
+
+        if (!cbs_evc_read_more_rbsp_data(rw))
+            break;
+    }
+    if (k >= EVC_MAX_SEI_PAYLOADS) {
+        av_log(ctx->log_ctx, AV_LOG_ERROR, "Too many payloads in "
+               "SEI message: found %d.\n", k);
+        return AVERROR_INVALIDDATA;
+    }
+#else
+    for (k = 0; k < current->message_count; k++) {
+        message = &current->message[k];
+
+        tmp = message->payload_type;
+        while (tmp >= 255) {
+            fixed(8, ff_byte, 0xff);
+            tmp -= 255;
+        }
+        xu(8, last_payload_type_byte, tmp, 0, 254, 0);
+
+        tmp = message->payload_size;
+        while (tmp >= 255) {
+            fixed(8, ff_byte, 0xff);
+            tmp -= 255;
+        }
+        xu(8, last_payload_size_byte, tmp, 0, 254, 0);
+
+        CHECK(FUNC(sei_payload)(ctx, rw, message));
+    }
+#endif
+
+    CHECK(FUNC(rbsp_trailing_bits)(ctx, rw));
+
+    return 0;
+}
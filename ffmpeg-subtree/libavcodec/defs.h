@@ -180,6 +180,43 @@ typedef struct AVProducerReferenceTime {
     int flags;
 } AVProducerReferenceTime;
 
+/**
+ * Statistics of the coding of a frame, exported by encoders as
+ * AV_PKT_DATA_ENCODER_STATS packet side data.
+ *
+ * New fields may be appended to the end of the structure, the size of the side
+ * data tells which ones are present. The fields the encoder does not know are -1.
+ */
+typedef struct AVEncoderStats {
+    /**
+     * Time spent coding the frame, in microseconds of wall clock time.
+     */
+    int64_t encode_time;
+    /**
+     * Size of the coded frame, in bits.
+     */
+    int64_t bits;
+    /**
+     * Average, lowest and highest quantization parameter of the frame,
+     * in the scale of the codec.
+     */
+    float qp_avg;
+    int qp_min;
+    int qp_max;
+    /**
+     * Temporal layer of the frame, 0 for the base layer.
+     */
+    int temporal_id;
+    /**
+     * 1 if other frames are predicted from this frame, 0 if not.
+     */
+    int reference;
+    /**
+     * Picture type of the frame, an enum AVPictureType value.
+     */
+    int pict_type;
+} AVEncoderStats;
+
 /**
  * Encode extradata length to a buffer. Used by xiph codecs.
  *
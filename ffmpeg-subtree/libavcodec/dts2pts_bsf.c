@@ -30,7 +30,10 @@
 #include "bsf.h"
 #include "bsf_internal.h"
 #include "cbs.h"
+#include "cbs_evc.h"
 #include "cbs_h264.h"
+#include "evc.h"
+#include "evc_parse.h"
 #include "h264_parse.h"
 #include "h264_ps.h"
 
@@ -57,6 +60,14 @@ typedef struct DTS2PTSH264Context {
     int picture_structure;
 } DTS2PTSH264Context;
 
+typedef struct DTS2PTSEVCContext {
+    EVCParserPoc poc;
+    EVCParserSPS sps;
+    int last_poc;
+    int highest_poc;
+    int got_delay;
+} DTS2PTSEVCContext;
+
 typedef struct DTS2PTSContext {
     struct AVTreeNode *root;
     AVFifo *fifo;
@@ -72,6 +83,7 @@ typedef struct DTS2PTSContext {
 
     union {
         DTS2PTSH264Context h264;
+        DTS2PTSEVCContext evc;
     } u;
 
     int nb_frame;
@@ -359,6 +371,159 @@ static void h264_flush(AVBSFContext *ctx)
     h264->last_poc = h264->highest_poc = INT_MIN;
 }
 
+// EVC
+static const CodedBitstreamUnitType evc_decompose_unit_types[] = {
+    EVC_SPS_NUT,
+    EVC_PPS_NUT,
+    EVC_IDR_NUT,
+    EVC_NOIDR_NUT,
+};
+
+static int evc_init(AVBSFContext *ctx)
+{
+    DTS2PTSContext *s = ctx->priv_data;
+    DTS2PTSEVCContext *evc = &s->u.evc;
+
+    s->cbc->decompose_unit_types    = evc_decompose_unit_types;
+    s->cbc->nb_decompose_unit_types = FF_ARRAY_ELEMS(evc_decompose_unit_types);
+
+    s->nb_frame = -ctx->par_in->video_delay;
+    evc->last_poc = evc->highest_poc = INT_MIN;
+
+    return 0;
+}
+
+// Same reordering delay as the one the EVC parser reports in has_b_frames
+static int evc_get_delay(const EVCRawSPS *sps)
+{
+    if (sps->vui_parameters_present_flag && sps->vui.bitstream_restriction_flag)
+        return sps->vui.num_reorder_pics;
+    if (sps->sps_max_dec_pic_buffering_minus1)
+        return sps->sps_max_dec_pic_buffering_minus1 - 1;
+    return (1 << sps->log2_sub_gop_length) + sps->max_num_tid0_ref_pics - 1;
+}
+
+static int evc_queue_frame(AVBSFContext *ctx, AVPacket *pkt, int poc, int *queued)
+{
+    DTS2PTSContext *s = ctx->priv_data;
+    DTS2PTSEVCContext *evc = &s->u.evc;
+    DTS2PTSFrame frame;
+    int ret;
+
+    // Check if there was a POC reset (Like an IDR picture)
+    if (s->nb_frame > evc->highest_poc) {
+        s->nb_frame = 0;
+        s->gop = (s->gop + 1) % s->fifo_size;
+        evc->highest_poc = evc->last_poc;
+    }
+
+    ret = alloc_and_insert_node(ctx, pkt->dts, pkt->duration, s->nb_frame, 1, s->gop);
+    if (ret < 0)
+        return ret;
+    av_log(ctx, AV_LOG_DEBUG, "Queueing frame with POC %d, GOP %d, dts %"PRId64"\n",
+           poc, s->gop, pkt->dts);
+    s->nb_frame++;
+
+    frame = (DTS2PTSFrame) { pkt, poc, 1, s->gop };
+    ret = av_fifo_write(s->fifo, &frame, 1);
+    av_assert2(ret >= 0);
+    *queued = 1;
+
+    return 0;
+}
+
+static int evc_filter(AVBSFContext *ctx)
+{
+    DTS2PTSContext *s = ctx->priv_data;
+    DTS2PTSEVCContext *evc = &s->u.evc;
+    CodedBitstreamFragment *au = &s->au;
+    AVPacket *in;
+    int queued = 0, ret;
+
+    ret = ff_bsf_get_packet(ctx, &in);
+    if (ret < 0)
+        return ret;
+
+    ret = ff_cbs_read_packet(s->cbc, au, in);
+    if (ret < 0) {
+        av_log(ctx, AV_LOG_WARNING, "Failed to parse access unit.\n");
+        goto fail;
+    }
+
+    // All slices of an access unit belong to the same picture, so the first one is enough
+    for (int i = 0; i < au->nb_units && !queued; i++) {
+        const CodedBitstreamUnit *unit = &au->units[i];
+        const CodedBitstreamEVCContext *cbs_evc = s->cbc->priv_data;
+        const EVCRawSliceHeader *header;
+        const EVCRawPPS *pps;
+        const EVCRawSPS *sps;
+
+        if (unit->type != EVC_IDR_NUT && unit->type != EVC_NOIDR_NUT)
+            continue;
+
+        header = &((const EVCRawSlice *)unit->content)->header;
+        pps = cbs_evc->pps[header->slice_pic_parameter_set_id];
+        sps = pps ? cbs_evc->sps[pps->pps_seq_parameter_set_id] : NULL;
+        if (!sps) {
+            av_log(ctx, AV_LOG_ERROR, "No active SPS for a slice\n");
+            ret = AVERROR_INVALIDDATA;
+            goto fail;
+        }
+        // Initialize the SPS struct with the fields ff_evc_derive_poc() cares about
+        evc->sps.sps_pocs_flag       = sps->sps_pocs_flag;
+        evc->sps.log2_sub_gop_length = sps->log2_sub_gop_length;
+        evc->sps.MaxPicOrderCntLsb   = 1 << (sps->log2_max_pic_order_cnt_lsb_minus4 + 4);
+        evc->sps.SubGopLength        = 1 << sps->log2_sub_gop_length;
+
+        // The reordering delay is only known once the first SPS is available
+        if (!evc->got_delay) {
+            s->nb_frame = -FFMIN(FFMAX(ctx->par_in->video_delay, evc_get_delay(sps)),
+                                 (int)s->fifo_size - 1);
+            evc->got_delay = 1;
+        }
+
+        ret = ff_evc_derive_poc(&evc->poc, &evc->sps, header->slice_pic_order_cnt_lsb,
+                                unit->type, header->nal_unit_header.nuh_temporal_id, ctx);
+        if (ret < 0) {
+            av_log(ctx, AV_LOG_ERROR, "ff_evc_derive_poc() failure\n");
+            goto fail;
+        }
+
+        evc->last_poc = evc->poc.PicOrderCntVal;
+        evc->highest_poc = FFMAX(evc->highest_poc, evc->last_poc);
+
+        ret = evc_queue_frame(ctx, in, evc->last_poc, &queued);
+        if (ret < 0)
+            goto fail;
+    }
+
+    if (!queued) {
+        av_log(ctx, AV_LOG_ERROR, "No slices in access unit\n");
+        ret = AVERROR_INVALIDDATA;
+        goto fail;
+    }
+
+    ret = 0;
+fail:
+    ff_cbs_fragment_reset(au);
+    if (!queued)
+        av_packet_free(&in);
+
+    return ret;
+}
+
+static void evc_flush(AVBSFContext *ctx)
+{
+    DTS2PTSContext *s = ctx->priv_data;
+    DTS2PTSEVCContext *evc = &s->u.evc;
+
+    memset(&evc->sps, 0, sizeof(evc->sps));
+    memset(&evc->poc, 0, sizeof(evc->poc));
+    s->nb_frame = -ctx->par_in->video_delay;
+    evc->last_poc = evc->highest_poc = INT_MIN;
+    evc->got_delay = 0;
+}
+
 // Core functions
 static const struct {
     enum AVCodecID id;
@@ -368,6 +533,7 @@ static const struct {
     size_t fifo_size;
 } func_tab[] = {
     { AV_CODEC_ID_H264, h264_init, h264_filter, h264_flush, H264_MAX_DPB_FRAMES * 2 * 2 },
+    { AV_CODEC_ID_EVC,  evc_init,  evc_filter,  evc_flush,  EVC_MAX_NUM_REF_PICS * 2 * 2 },
 };
 
 static int dts2pts_init(AVBSFContext *ctx)
@@ -526,6 +692,7 @@ static void dts2pts_close(AVBSFContext *ctx)
 
 static const enum AVCodecID dts2pts_codec_ids[] = {
     AV_CODEC_ID_H264,
+    AV_CODEC_ID_EVC,
     AV_CODEC_ID_NONE,
 };
 
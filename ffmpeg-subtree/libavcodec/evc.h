@@ -22,6 +22,11 @@
 #ifndef AVCODEC_EVC_H
 #define AVCODEC_EVC_H
 
+#include <stdint.h>
+
+#include "libavutil/error.h"
+#include "libavutil/intreadwrite.h"
+
 // The length field that indicates the length in bytes of the following NAL unit is configured to be of 4 bytes
 #define EVC_NALU_LENGTH_PREFIX_SIZE     (4)  /* byte */
 #define EVC_NALU_HEADER_SIZE            (2)  /* byte */
@@ -105,8 +110,17 @@ enum EVCSliceType {
     EVC_SLICE_TYPE_I = 2
 };
 
+// APS parameters type, each one with identifiers of its own
+// @see ISO_IEC_23094-1_2020 7.4.3.3 Adaptation parameter set semantics
+//
+enum EVCAPSType {
+    EVC_ALF_APS = 0,
+    EVC_DRA_APS = 1,
+    EVC_NB_APS_TYPES
+};
+
 enum {
-    // 7.4.3.2: aps_video_parameter_set_id is u(4).
+    // 7.3.2.3: aps_adaptation_parameter_set_id is u(5).
     EVC_MAX_APS_COUNT = 32,
 
     // 7.4.3.1: sps_seq_parameter_set_id is in [0, 15].
@@ -128,6 +142,9 @@ enum {
 
     EVC_MAX_NUM_RPLS = 32,
 
+    // Maximum number of points in a chroma QP mapping table in the SPS.
+    EVC_MAX_QP_TABLE_SIZE = 58,
+
     // A.4.1: pic_width_in_luma_samples and pic_height_in_luma_samples are
     // constrained to be not greater than sqrt(MaxLumaPs * 8).  Hence height/
     // width are bounded above by sqrt(8 * 35651584) = 16888.2 samples.
@@ -149,7 +166,72 @@ enum {
     // Only a stream with very high resolution and perverse parameters could
     // get near that, though, so set a lower limit here with the maximum
     // possible value for 4K video (at most 135 16x16 Ctb rows).
-    HEVC_MAX_ENTRY_POINT_OFFSETS = EVC_MAX_TILE_COLUMNS * 135,
+    EVC_MAX_ENTRY_POINT_OFFSETS = EVC_MAX_TILE_COLUMNS * 135,
 };
 
+/**
+ * Read the length prefix of a NAL unit in length-prefixed EVC data
+ *
+ * @return the NAL unit size, 0 if fewer than EVC_NALU_LENGTH_PREFIX_SIZE bytes are available
+ */
+static inline uint32_t ff_evc_nal_unit_length(const uint8_t *buf, int size)
+{
+    if (size < EVC_NALU_LENGTH_PREFIX_SIZE)
+        return 0;
+    return AV_RB32(buf);
+}
+
+/**
+ * Read a length prefix of the given size, as set by the lengthSizeMinusOne field of an evcC
+ *
+ * @return the NAL unit size, 0 if fewer than length_size bytes are available
+ */
+static inline uint32_t ff_evc_nal_unit_length_n(const uint8_t *buf, int size, int length_size)
+{
+    if (size < length_size)
+        return 0;
+    switch (length_size) {
+    case 1:  return buf[0];
+    case 2:  return AV_RB16(buf);
+    default: return AV_RB32(buf);
+    }
+}
+
+/**
+ * @return the size in bytes of the NAL unit length prefixes of the samples the extradata
+ *         applies to: lengthSizeMinusOne + 1 for an evcC, EVC_NALU_LENGTH_PREFIX_SIZE for
+ *         length prefixed NAL units or no extradata, AVERROR_INVALIDDATA for a 3 byte size
+ */
+static inline int ff_evc_nal_length_size(const uint8_t *extradata, int size)
+{
+    int length_size;
+
+    if (!extradata || size <= 16 || extradata[0] != 1)
+        return EVC_NALU_LENGTH_PREFIX_SIZE;
+    length_size = (extradata[16] & 3) + 1;
+    return length_size == 3 ? AVERROR_INVALIDDATA : length_size;
+}
+
+/**
+ * @return the nal_unit_type of the NAL unit starting with the given header,
+ *         -1 if the header is truncated or forbidden_zero_bit is set
+ */
+static inline int ff_evc_nal_unit_type(const uint8_t *buf, int size)
+{
+    if (size < EVC_NALU_HEADER_SIZE || buf[0] & 0x80)
+        return -1;
+    return ((buf[0] >> 1) & 0x3F) - 1;
+}
+
+/**
+ * @return the nuh_temporal_id of the NAL unit starting with the given header,
+ *         -1 if the header is truncated or forbidden_zero_bit is set
+ */
+static inline int ff_evc_nal_unit_temporal_id(const uint8_t *buf, int size)
+{
+    if (size < EVC_NALU_HEADER_SIZE || buf[0] & 0x80)
+        return -1;
+    return (AV_RB16(buf) >> 6) & 0x07;
+}
+
 #endif // AVCODEC_EVC_H
@@ -17,6 +17,9 @@
  * License along with FFmpeg; if not, write to the Free Software
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
  */
+#include "libavutil/opt.h"
+#include "libavutil/trace.h"
+
 #include "get_bits.h"
 #include "golomb.h"
 #include "bsf.h"
@@ -26,19 +29,31 @@
 #include "evc.h"
 #include "evc_parse.h"
 
-#define INIT_AU_BUF_CAPACITY 1024
-
-// Access unit data
-typedef struct AccessUnitBuffer {
-    uint8_t *data;      // the data buffer
-    size_t data_size;   // size of data in bytes
-    size_t capacity;    // buffer capacity
-} AccessUnitBuffer;
-
 typedef struct EVCFMergeContext {
+    const AVClass *class;
     AVPacket *in;
     EVCParserContext parser_ctx;
-    AccessUnitBuffer au_buffer;
+    int nalu_length_size;   // size of the length prefixes, set by the evcC of the input
+
+    // Data of the access unit being assembled, padded with AV_INPUT_BUFFER_PADDING_SIZE bytes.
+    // It is handed over to the output packet, so every byte is copied at most once.
+    AVBufferRef *au_buf;
+    size_t au_size;
+    size_t au_alloc_hint;   // allocation size of the previous access unit
+    AVPacket *au_props;     // properties of the first NAL unit of the access unit
+    int64_t au_buffer_size; // allocation size of au_buf, exported
+    int64_t au_buffer_peak; // largest allocation size of au_buf so far, exported
+
+    // Timestamps generated for input without any, counted in frame durations
+    int64_t nb_aus;         // number of access units output since the last flush
+    int64_t poc_base;       // presentation index of the last IDR picture
+    int64_t max_pts;        // highest presentation index output so far, -1 if none
+    int dts_delay;          // reordering delay the dts are computed with, -1 if none yet
+    int max_delay;          // highest reordering delay of the SPS seen so far
+
+    // SPS and PPS NAL units of the last access unit carrying an SPS, with their length prefix
+    uint8_t *ps;
+    int ps_size;
 } EVCFMergeContext;
 
 static int end_of_access_unit_found(EVCParserContext *parser_ctx)
@@ -56,21 +71,264 @@ static int end_of_access_unit_found(EVCParserContext *parser_ctx)
     return 0;
 }
 
+/**
+ * Tell whether a packet holding several NAL units is already a complete access unit
+ *
+ * Only the NAL unit headers are looked at: the packet must end with its last NAL unit,
+ * contain a slice and no non-VCL NAL unit after a slice, which would start the next
+ * access unit.
+ */
+static int is_access_unit(const AVPacket *pkt, int length_size)
+{
+    const uint8_t *data = pkt->data;
+    int size = pkt->size;
+    int nb_nalus = 0, has_vcl = 0;
+
+    while (size > 0) {
+        uint32_t nalu_size = ff_evc_nal_unit_length_n(data, size, length_size);
+        int nalu_type;
+
+        data += length_size;
+        size -= length_size;
+        if (nalu_size < EVC_NALU_HEADER_SIZE || nalu_size > size)
+            return 0;
+
+        nalu_type = ff_evc_nal_unit_type(data, nalu_size);
+        if (nalu_type == EVC_NOIDR_NUT || nalu_type == EVC_IDR_NUT)
+            has_vcl = 1;
+        else if (nalu_type < 0 || has_vcl)
+            return 0;
+
+        data += nalu_size;
+        size -= nalu_size;
+        nb_nalus++;
+    }
+
+    return nb_nalus > 1 && has_vcl;
+}
+
+// Keep the parser state up to date with the NAL units of an access unit that is forwarded
+static int parse_access_unit(AVBSFContext *bsf, EVCParserContext *parser_ctx, const AVPacket *pkt,
+                             int length_size)
+{
+    const uint8_t *data = pkt->data;
+    int size = pkt->size;
+
+    while (size > 0) {
+        uint32_t nalu_size = ff_evc_nal_unit_length_n(data, size, length_size);
+        int err;
+
+        data += length_size;
+        size -= length_size;
+
+        err = ff_evc_parse_nal_unit_au(parser_ctx, data, nalu_size, bsf);
+        if (err < 0)
+            return err;
+
+        data += nalu_size;
+        size -= nalu_size;
+    }
+
+    return 0;
+}
+
 static void evc_frame_merge_flush(AVBSFContext *bsf)
 {
     EVCFMergeContext *ctx = bsf->priv_data;
 
     av_packet_unref(ctx->in);
+    av_buffer_unref(&ctx->au_buf);
+    ctx->au_size = 0;
+    ctx->au_buffer_size = 0;
+    ff_evc_sei_reset(&ctx->parser_ctx.sei);
+
+    ctx->nb_aus    = 0;
+    ctx->max_pts   = -1;
+    ctx->dts_delay = -1;
 }
 
-static int evc_frame_merge_filter(AVBSFContext *bsf, AVPacket *out)
+/*
+ * Give timestamps to access units from input without any, such as raw streams: the pts
+ * follows the POC, restarting after the last picture output before each IDR picture, the
+ * dts follows decoding order, delayed by the reordering depth of the first SPS. A later SPS
+ * reordering deeper shifts the pts by the increase instead, so that the dts keep growing
+ * across spliced streams. The framerate
+ * signalled in the VUI takes precedence over the one of the input.
+ */
+static void set_timestamps(AVBSFContext *bsf, AVPacket *out)
+{
+    EVCFMergeContext *ctx = bsf->priv_data;
+    const EVCParserContext *parser_ctx = &ctx->parser_ctx;
+    AVRational framerate = parser_ctx->framerate.num > 0 && parser_ctx->framerate.den > 0 ?
+                           parser_ctx->framerate : bsf->par_in->framerate;
+    int64_t duration, pts;
+
+    if (out->pts != AV_NOPTS_VALUE || out->dts != AV_NOPTS_VALUE ||
+        framerate.num <= 0 || framerate.den <= 0 ||
+        bsf->time_base_in.num <= 0 || bsf->time_base_in.den <= 0)
+        return;
+
+    duration = av_rescale_q(1, av_inv_q(framerate), bsf->time_base_in);
+    if (duration <= 0)
+        return;
+
+    if (ctx->dts_delay < 0)
+        ctx->dts_delay = ctx->max_delay = FFMAX(parser_ctx->delay, 0);
+
+    if (parser_ctx->nalu_type == EVC_IDR_NUT)
+        ctx->poc_base = ctx->max_pts + 1;
+    // the shift is kept by the next IDR pictures through max_pts
+    if (parser_ctx->delay > ctx->max_delay) {
+        ctx->poc_base += parser_ctx->delay - ctx->max_delay;
+        ctx->max_delay = parser_ctx->delay;
+    }
+    pts = ctx->poc_base + parser_ctx->poc.PicOrderCntVal;
+    ctx->max_pts = FFMAX(ctx->max_pts, pts);
+
+    out->pts      = pts * duration;
+    out->dts      = (ctx->nb_aus - ctx->dts_delay) * duration;
+    out->duration = duration;
+    ctx->nb_aus++;
+}
+
+// The SEI messages of the access unit travel with it as packet side data
+static int export_sei(EVCParserSEI *sei, AVPacket *out)
+{
+    uint8_t *data;
+    int err = 0;
+
+    if (sei->has_mastering_display) {
+        data = av_packet_new_side_data(out, AV_PKT_DATA_MASTERING_DISPLAY_METADATA,
+                                       sizeof(sei->mastering_display));
+        if (!data)
+            goto fail;
+        memcpy(data, &sei->mastering_display, sizeof(sei->mastering_display));
+    }
+    if (sei->has_content_light) {
+        data = av_packet_new_side_data(out, AV_PKT_DATA_CONTENT_LIGHT_LEVEL,
+                                       sizeof(sei->content_light));
+        if (!data)
+            goto fail;
+        memcpy(data, &sei->content_light, sizeof(sei->content_light));
+    }
+    if (sei->a53_caption) {
+        data = av_packet_new_side_data(out, AV_PKT_DATA_A53_CC, sei->a53_caption->size);
+        if (!data)
+            goto fail;
+        memcpy(data, sei->a53_caption->data, sei->a53_caption->size);
+    }
+
+end:
+    ff_evc_sei_reset(sei);
+    return err;
+fail:
+    err = AVERROR(ENOMEM);
+    goto end;
+}
+
+/*
+ * Announce parameter sets differing from the previous ones as new extradata, so that muxers
+ * can describe the pictures following a mid-stream change. The SPS and PPS of an access unit
+ * carrying an SPS replace the previous ones, the first ones are not announced. The new extradata
+ * is made of NAL units with 4 byte length prefixes, whatever the length size of the input.
+ */
+static int export_param_sets(EVCFMergeContext *ctx, AVPacket *out)
+{
+    const uint8_t *ptr, *end = out->data + out->size;
+    const int length_size = ctx->nalu_length_size;
+    uint8_t *ps, *side;
+    int ps_size = 0, has_sps = 0;
+
+    for (ptr = out->data; end - ptr > length_size;) {
+        uint32_t nalu_size = ff_evc_nal_unit_length_n(ptr, end - ptr, length_size);
+        int nalu_type;
+
+        if (nalu_size > end - ptr - length_size)
+            break;
+        nalu_type = ff_evc_nal_unit_type(ptr + length_size, nalu_size);
+        if (nalu_type == EVC_SPS_NUT || nalu_type == EVC_PPS_NUT) {
+            ps_size += EVC_NALU_LENGTH_PREFIX_SIZE + nalu_size;
+            has_sps |= nalu_type == EVC_SPS_NUT;
+        }
+        ptr += length_size + nalu_size;
+    }
+
+    if (!has_sps)
+        return 0;
+
+    ps = av_malloc(ps_size);
+    if (!ps)
+        return AVERROR(ENOMEM);
+
+    ps_size = 0;
+    for (ptr = out->data; end - ptr > length_size;) {
+        uint32_t nalu_size = ff_evc_nal_unit_length_n(ptr, end - ptr, length_size);
+        int nalu_type;
+
+        if (nalu_size > end - ptr - length_size)
+            break;
+        nalu_type = ff_evc_nal_unit_type(ptr + length_size, nalu_size);
+        if (nalu_type == EVC_SPS_NUT || nalu_type == EVC_PPS_NUT) {
+            AV_WB32(ps + ps_size, nalu_size);
+            memcpy(ps + ps_size + EVC_NALU_LENGTH_PREFIX_SIZE, ptr + length_size, nalu_size);
+            ps_size += EVC_NALU_LENGTH_PREFIX_SIZE + nalu_size;
+        }
+        ptr += length_size + nalu_size;
+    }
+
+    if (ps_size == ctx->ps_size && !memcmp(ps, ctx->ps, ps_size)) {
+        av_free(ps);
+        return 0;
+    }
+
+    if (ctx->ps) {
+        side = av_packet_new_side_data(out, AV_PKT_DATA_NEW_EXTRADATA, ps_size);
+        if (!side) {
+            av_free(ps);
+            return AVERROR(ENOMEM);
+        }
+        memcpy(side, ps, ps_size);
+    }
+
+    av_free(ctx->ps);
+    ctx->ps      = ps;
+    ctx->ps_size = ps_size;
+
+    return 0;
+}
+
+static int append_nal_unit(EVCFMergeContext *ctx, const AVPacket *in)
+{
+    size_t needed = ctx->au_size + in->size + AV_INPUT_BUFFER_PADDING_SIZE;
+
+    if (!ctx->au_size) {
+        int err = av_packet_copy_props(ctx->au_props, in);
+        if (err < 0)
+            return err;
+    }
+
+    if (!ctx->au_buf || ctx->au_buf->size < needed) {
+        size_t size = ctx->au_buf ? FFMAX(needed, 2 * ctx->au_buf->size) : FFMAX(needed, ctx->au_alloc_hint);
+        int err = av_buffer_realloc(&ctx->au_buf, size);
+        if (err < 0)
+            return err;
+        ctx->au_buffer_size = ctx->au_buf->size;
+        ctx->au_buffer_peak = FFMAX(ctx->au_buffer_peak, ctx->au_buffer_size);
+    }
+
+    memcpy(ctx->au_buf->data + ctx->au_size, in->data, in->size);
+    ctx->au_size += in->size;
+
+    return 0;
+}
+
+static int evc_frame_merge_au(AVBSFContext *bsf, AVPacket *out)
 {
     EVCFMergeContext *ctx = bsf->priv_data;
     EVCParserContext *parser_ctx = &ctx->parser_ctx;
 
     AVPacket *in = ctx->in;
 
-    int free_space = 0;
     size_t  nalu_size = 0;
     uint8_t *nalu = NULL;
     int au_end_found = 0;
@@ -80,17 +338,30 @@ static int evc_frame_merge_filter(AVBSFContext *bsf, AVPacket *out)
     if (err < 0)
         return err;
 
-    nalu_size = av_evc_read_nal_unit_length(in->data, EVC_NALU_LENGTH_PREFIX_SIZE, bsf);
+    // packets from containers like mp4 are already access units and are forwarded as they are
+    if (!ctx->au_size && is_access_unit(in, ctx->nalu_length_size)) {
+        err = parse_access_unit(bsf, parser_ctx, in, ctx->nalu_length_size);
+        if (err < 0) {
+            av_log(bsf, AV_LOG_ERROR, "NAL Unit parsing error\n");
+            av_packet_unref(in);
+            return err;
+        }
+        av_packet_move_ref(out, in);
+        goto set_flags;
+    }
+
+    nalu_size = ff_evc_nal_unit_length_n(in->data, in->size, ctx->nalu_length_size);
     if (nalu_size <= 0) {
+        av_log(bsf, AV_LOG_ERROR, "Can't read NAL unit length\n");
         av_packet_unref(in);
         return AVERROR_INVALIDDATA;
     }
 
-    nalu = in->data + EVC_NALU_LENGTH_PREFIX_SIZE;
-    nalu_size = in->size - EVC_NALU_LENGTH_PREFIX_SIZE;
+    nalu = in->data + ctx->nalu_length_size;
+    nalu_size = in->size - ctx->nalu_length_size;
 
     // NAL unit parsing needed to determine if end of AU was found
-    err = ff_evc_parse_nal_unit(parser_ctx, nalu, nalu_size, bsf);
+    err = ff_evc_parse_nal_unit_au(parser_ctx, nalu, nalu_size, bsf);
     if (err < 0) {
         av_log(bsf, AV_LOG_ERROR, "NAL Unit parsing error\n");
         av_packet_unref(in);
@@ -100,46 +371,90 @@ static int evc_frame_merge_filter(AVBSFContext *bsf, AVPacket *out)
 
     au_end_found = end_of_access_unit_found(parser_ctx);
 
-    free_space = ctx->au_buffer.capacity - ctx->au_buffer.data_size;
-    while (free_space < in->size) {
-        ctx->au_buffer.capacity *= 2;
-        free_space = ctx->au_buffer.capacity - ctx->au_buffer.data_size;
-
-        if (free_space >= in->size)
-            ctx->au_buffer.data = av_realloc(ctx->au_buffer.data, ctx->au_buffer.capacity);
+    if (au_end_found && !ctx->au_size) {
+        // an access unit made of a single NAL unit is passed through without copying it
+        av_packet_move_ref(out, in);
+    } else {
+        err = append_nal_unit(ctx, in);
+        if (err < 0) {
+            av_packet_unref(in);
+            evc_frame_merge_flush(bsf);
+            return err;
+        }
+
+        if (!au_end_found) {
+            av_packet_unref(in);
+            return AVERROR(EAGAIN);
+        }
+
+        err = av_packet_copy_props(out, ctx->au_props);
+        av_packet_unref(in);
+        if (err < 0) {
+            evc_frame_merge_flush(bsf);
+            return err;
+        }
+
+        memset(ctx->au_buf->data + ctx->au_size, 0, AV_INPUT_BUFFER_PADDING_SIZE);
+        ctx->au_alloc_hint = ctx->au_buf->size;
+
+        out->buf  = ctx->au_buf;
+        out->data = ctx->au_buf->data;
+        out->size = ctx->au_size;
+        ctx->au_buf  = NULL;
+        ctx->au_size = 0;
+        ctx->au_buffer_size = 0;
     }
 
-    memcpy(ctx->au_buffer.data + ctx->au_buffer.data_size, in->data, in->size);
-
-    ctx->au_buffer.data_size += in->size;
-
-    av_packet_unref(in);
+set_flags:
+    out->flags &= ~(AV_PKT_FLAG_KEY | AV_PKT_FLAG_DISPOSABLE);
+    if (parser_ctx->key_frame)
+        out->flags |= AV_PKT_FLAG_KEY;
+    if (parser_ctx->discardable)
+        out->flags |= AV_PKT_FLAG_DISPOSABLE;
+    set_timestamps(bsf, out);
+
+    err = export_sei(&parser_ctx->sei, out);
+    if (err >= 0)
+        err = export_param_sets(ctx, out);
+    if (err < 0)
+        av_packet_unref(out);
 
-    if (au_end_found) {
-        uint8_t *data = av_memdup(ctx->au_buffer.data, ctx->au_buffer.data_size);
-        err = av_packet_from_data(out, data, ctx->au_buffer.data_size);
+    return err;
+}
 
-        ctx->au_buffer.data_size = 0;
-    } else
-        err = AVERROR(EAGAIN);
+static int evc_frame_merge_filter(AVBSFContext *bsf, AVPacket *out)
+{
+    EVCFMergeContext *ctx = bsf->priv_data;
+    const EVCParserContext *parser_ctx = &ctx->parser_ctx;
+    int ret;
 
-    if (err < 0 && err != AVERROR(EAGAIN))
-        evc_frame_merge_flush(bsf);
+    FF_TRACE_BEGIN("evc_frame_merge_filter", -1, -1, -1);
+    ret = evc_frame_merge_au(bsf, out);
+    // the tags of the output access unit are those of its last NAL unit
+    FF_TRACE_END("evc_frame_merge_filter", ret < 0 ? -1 : parser_ctx->poc.PicOrderCntVal,
+                 ret < 0 ? -1 : parser_ctx->nalu_type, ret < 0 ? -1 : out->size);
 
-    return err;
+    return ret;
 }
 
 static int evc_frame_merge_init(AVBSFContext *bsf)
 {
     EVCFMergeContext *ctx = bsf->priv_data;
 
-    ctx->in  = av_packet_alloc();
-    if (!ctx->in)
+    ctx->in       = av_packet_alloc();
+    ctx->au_props = av_packet_alloc();
+    if (!ctx->in || !ctx->au_props)
         return AVERROR(ENOMEM);
 
-    ctx->au_buffer.capacity = INIT_AU_BUF_CAPACITY;
-    ctx->au_buffer.data = av_malloc(INIT_AU_BUF_CAPACITY);
-    ctx->au_buffer.data_size = 0;
+    ctx->max_pts   = -1;
+    ctx->dts_delay = -1;
+
+    // raw streams come without extradata, their length prefixes are 4 bytes
+    ctx->nalu_length_size = ff_evc_nal_length_size(bsf->par_in->extradata, bsf->par_in->extradata_size);
+    if (ctx->nalu_length_size < 0) {
+        av_log(bsf, AV_LOG_ERROR, "Unsupported NAL unit length size in extradata\n");
+        return ctx->nalu_length_size;
+    }
 
     return 0;
 }
@@ -149,12 +464,30 @@ static void evc_frame_merge_close(AVBSFContext *bsf)
     EVCFMergeContext *ctx = bsf->priv_data;
 
     av_packet_free(&ctx->in);
-
-    ctx->au_buffer.capacity = 0;
-    av_freep(&ctx->au_buffer.data);
-    ctx->au_buffer.data_size = 0;
+    av_packet_free(&ctx->au_props);
+    ff_evc_ps_uninit(&ctx->parser_ctx);
+    ff_evc_sei_reset(&ctx->parser_ctx.sei);
+    av_buffer_unref(&ctx->au_buf);
+    av_freep(&ctx->ps);
 }
 
+#define OFFSET(x) offsetof(EVCFMergeContext, x)
+#define FLAGS (AV_OPT_FLAG_VIDEO_PARAM | AV_OPT_FLAG_BSF_PARAM | AV_OPT_FLAG_EXPORT | AV_OPT_FLAG_READONLY)
+static const AVOption evc_frame_merge_options[] = {
+    { "au_buffer_size", "Allocation size of the buffer of the access unit being assembled",
+        OFFSET(au_buffer_size), AV_OPT_TYPE_INT64, { .i64 = 0 }, 0, INT64_MAX, FLAGS },
+    { "au_buffer_peak", "Largest allocation size of the access unit buffer so far",
+        OFFSET(au_buffer_peak), AV_OPT_TYPE_INT64, { .i64 = 0 }, 0, INT64_MAX, FLAGS },
+    { NULL }
+};
+
+static const AVClass evc_frame_merge_class = {
+    .class_name = "evc_frame_merge_bsf",
+    .item_name  = av_default_item_name,
+    .option     = evc_frame_merge_options,
+    .version    = LIBAVUTIL_VERSION_INT,
+};
+
 static const enum AVCodecID evc_frame_merge_codec_ids[] = {
     AV_CODEC_ID_EVC, AV_CODEC_ID_NONE,
 };
@@ -162,6 +495,7 @@ static const enum AVCodecID evc_frame_merge_codec_ids[] = {
 const FFBitStreamFilter ff_evc_frame_merge_bsf = {
     .p.name         = "evc_frame_merge",
     .p.codec_ids    = evc_frame_merge_codec_ids,
+    .p.priv_class   = &evc_frame_merge_class,
     .priv_data_size = sizeof(EVCFMergeContext),
     .init           = evc_frame_merge_init,
     .flush          = evc_frame_merge_flush,
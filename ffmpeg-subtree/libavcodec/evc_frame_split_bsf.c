@@ -0,0 +1,134 @@
+/*
+ * This file is part of FFmpeg.
+ *
+ * FFmpeg is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * FFmpeg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with FFmpeg; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/**
+ * @file
+ * This bitstream filter splits EVC access units into packets containing
+ * one NAL unit each, keeping its length prefix. It is the inverse of
+ * evc_frame_merge.
+ *
+ * The output packets reference the data of the input packet, nothing is
+ * copied. Only the first packet of an access unit carries its timestamps.
+ * Access units made of a single NAL unit are passed through unchanged.
+ */
+
+#include "bsf.h"
+#include "bsf_internal.h"
+#include "evc.h"
+
+typedef struct EVCFSplitContext {
+    AVPacket *buffer_pkt;
+    int offset;             // offset of the next NAL unit in buffer_pkt
+    int nalu_length_size;   // size of the length prefixes, set by the evcC of the input
+} EVCFSplitContext;
+
+static int evc_frame_split_filter(AVBSFContext *bsf, AVPacket *out)
+{
+    EVCFSplitContext *s = bsf->priv_data;
+    AVPacket *in = s->buffer_pkt;
+    uint32_t nalu_size;
+    int left, ret;
+
+    if (!in->data) {
+        ret = ff_bsf_get_packet_ref(bsf, in);
+        if (ret < 0)
+            return ret;
+        s->offset = 0;
+    }
+
+    left      = in->size - s->offset;
+    nalu_size = ff_evc_nal_unit_length_n(in->data + s->offset, left, s->nalu_length_size);
+    if (nalu_size < EVC_NALU_HEADER_SIZE ||
+        nalu_size > left - s->nalu_length_size) {
+        av_log(bsf, AV_LOG_ERROR, "Invalid NAL unit size: (%"PRIu32")\n", nalu_size);
+        av_packet_unref(in);
+        return AVERROR_INVALIDDATA;
+    }
+    nalu_size += s->nalu_length_size;
+
+    if (!s->offset && nalu_size == in->size) {
+        av_packet_move_ref(out, in);
+        return 0;
+    }
+
+    ret = av_packet_ref(out, in);
+    if (ret < 0) {
+        av_packet_unref(in);
+        return ret;
+    }
+
+    out->data += s->offset;
+    out->size  = nalu_size;
+    if (s->offset) {
+        out->pts      = AV_NOPTS_VALUE;
+        out->dts      = AV_NOPTS_VALUE;
+        out->duration = 0;
+    }
+
+    s->offset += nalu_size;
+    if (s->offset >= in->size)
+        av_packet_unref(in);
+
+    return 0;
+}
+
+static int evc_frame_split_init(AVBSFContext *bsf)
+{
+    EVCFSplitContext *s = bsf->priv_data;
+
+    s->buffer_pkt = av_packet_alloc();
+    if (!s->buffer_pkt)
+        return AVERROR(ENOMEM);
+
+    // raw streams come without extradata, their length prefixes are 4 bytes
+    s->nalu_length_size = ff_evc_nal_length_size(bsf->par_in->extradata, bsf->par_in->extradata_size);
+    if (s->nalu_length_size < 0) {
+        av_log(bsf, AV_LOG_ERROR, "Unsupported NAL unit length size in extradata\n");
+        return s->nalu_length_size;
+    }
+
+    return 0;
+}
+
+static void evc_frame_split_flush(AVBSFContext *bsf)
+{
+    EVCFSplitContext *s = bsf->priv_data;
+
+    av_packet_unref(s->buffer_pkt);
+}
+
+static void evc_frame_split_close(AVBSFContext *bsf)
+{
+    EVCFSplitContext *s = bsf->priv_data;
+
+    av_packet_free(&s->buffer_pkt);
+}
+
+static const enum AVCodecID evc_frame_split_codec_ids[] = {
+    AV_CODEC_ID_EVC, AV_CODEC_ID_NONE,
+};
+
+const FFBitStreamFilter ff_evc_frame_split_bsf = {
+    .p.name         = "evc_frame_split",
+    .p.codec_ids    = evc_frame_split_codec_ids,
+    .priv_data_size = sizeof(EVCFSplitContext),
+    .init           = evc_frame_split_init,
+    .flush          = evc_frame_split_flush,
+    .close          = evc_frame_split_close,
+    .filter         = evc_frame_split_filter,
+};
@@ -0,0 +1,395 @@
+/*
+ * This file is part of FFmpeg.
+ *
+ * FFmpeg is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * FFmpeg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with FFmpeg; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include "libavutil/avstring.h"
+#include "libavutil/common.h"
+#include "libavutil/opt.h"
+
+#include "bsf.h"
+#include "bsf_internal.h"
+#include "cbs.h"
+#include "cbs_bsf.h"
+#include "cbs_evc.h"
+#include "evc.h"
+#include "h2645data.h"
+#include "sei.h"
+
+enum {
+    LEVEL_UNSET = -1,
+};
+
+typedef struct EVCMetadataContext {
+    CBSBSFContext common;
+
+    int done_first_au;
+
+    AVRational sample_aspect_ratio;
+
+    int video_format;
+    int video_full_range_flag;
+    int colour_primaries;
+    int transfer_characteristics;
+    int matrix_coefficients;
+
+    int chroma_sample_loc_type;
+
+    AVRational tick_rate;
+    int fixed_pic_rate_flag;
+
+    int level;
+
+    const char *sei_user_data;
+    uint8_t *sei_user_data_payload;
+    EVCRawSEI sei_nal;
+
+    int delete_sei;
+} EVCMetadataContext;
+
+
+static int evc_metadata_update_sps(AVBSFContext *bsf,
+                                   EVCRawSPS *sps)
+{
+    EVCMetadataContext *ctx = bsf->priv_data;
+    int need_vui = 0;
+
+    if (ctx->sample_aspect_ratio.num && ctx->sample_aspect_ratio.den) {
+        int num, den, i;
+
+        av_reduce(&num, &den, ctx->sample_aspect_ratio.num,
+                  ctx->sample_aspect_ratio.den, 65535);
+
+        for (i = 1; i < FF_ARRAY_ELEMS(ff_h2645_pixel_aspect); i++) {
+            if (num == ff_h2645_pixel_aspect[i].num &&
+                den == ff_h2645_pixel_aspect[i].den)
+                break;
+        }
+        if (i == FF_ARRAY_ELEMS(ff_h2645_pixel_aspect)) {
+            sps->vui.aspect_ratio_idc = 255;
+            sps->vui.sar_width  = num;
+            sps->vui.sar_height = den;
+        } else {
+            sps->vui.aspect_ratio_idc = i;
+        }
+        sps->vui.aspect_ratio_info_present_flag = 1;
+        need_vui = 1;
+    }
+
+#define SET_OR_INFER(field, value, present_flag, infer) do { \
+        if (value >= 0) { \
+            field = value; \
+            need_vui = 1; \
+        } else if (!present_flag) \
+            field = infer; \
+    } while (0)
+
+    if (ctx->video_format             >= 0 ||
+        ctx->video_full_range_flag    >= 0 ||
+        ctx->colour_primaries         >= 0 ||
+        ctx->transfer_characteristics >= 0 ||
+        ctx->matrix_coefficients      >= 0) {
+
+        SET_OR_INFER(sps->vui.video_format, ctx->video_format,
+                     sps->vui.video_signal_type_present_flag, 5);
+
+        SET_OR_INFER(sps->vui.video_full_range_flag,
+                     ctx->video_full_range_flag,
+                     sps->vui.video_signal_type_present_flag, 0);
+
+        if (ctx->colour_primaries         >= 0 ||
+            ctx->transfer_characteristics >= 0 ||
+            ctx->matrix_coefficients      >= 0) {
+
+            SET_OR_INFER(sps->vui.colour_primaries,
+                         ctx->colour_primaries,
+                         sps->vui.colour_description_present_flag, 2);
+
+            SET_OR_INFER(sps->vui.transfer_characteristics,
+                         ctx->transfer_characteristics,
+                         sps->vui.colour_description_present_flag, 2);
+
+            SET_OR_INFER(sps->vui.matrix_coefficients,
+                         ctx->matrix_coefficients,
+                         sps->vui.colour_description_present_flag, 2);
+
+            sps->vui.colour_description_present_flag = 1;
+        }
+        sps->vui.video_signal_type_present_flag = 1;
+        need_vui = 1;
+    }
+
+    if (ctx->chroma_sample_loc_type >= 0) {
+        sps->vui.chroma_sample_loc_type_top_field =
+            ctx->chroma_sample_loc_type;
+        sps->vui.chroma_sample_loc_type_bottom_field =
+            ctx->chroma_sample_loc_type;
+        sps->vui.chroma_loc_info_present_flag = 1;
+        need_vui = 1;
+    }
+
+    if (ctx->tick_rate.num && ctx->tick_rate.den) {
+        int num, den;
+
+        av_reduce(&num, &den, ctx->tick_rate.num, ctx->tick_rate.den,
+                  UINT32_MAX > INT_MAX ? UINT32_MAX : INT_MAX);
+
+        sps->vui.time_scale        = num;
+        sps->vui.num_units_in_tick = den;
+
+        sps->vui.timing_info_present_flag = 1;
+        need_vui = 1;
+    }
+    SET_OR_INFER(sps->vui.fixed_pic_rate_flag,
+                 ctx->fixed_pic_rate_flag,
+                 sps->vui.timing_info_present_flag, 0);
+
+    if (need_vui)
+        sps->vui_parameters_present_flag = 1;
+
+    if (ctx->level != LEVEL_UNSET)
+        sps->level_idc = ctx->level;
+
+    return 0;
+}
+
+static int evc_metadata_insert_sei(AVBSFContext *bsf,
+                                   CodedBitstreamFragment *au)
+{
+    EVCMetadataContext *ctx = bsf->priv_data;
+    int i, err;
+
+    // The SEI goes in front of the first slice of the access unit.
+    for (i = 0; i < au->nb_units; i++) {
+        if (au->units[i].type == EVC_NOIDR_NUT ||
+            au->units[i].type == EVC_IDR_NUT)
+            break;
+    }
+
+    err = ff_cbs_insert_unit_content(au, i, EVC_SEI_NUT,
+                                     &ctx->sei_nal, NULL);
+    if (err < 0) {
+        av_log(bsf, AV_LOG_ERROR, "Failed to add user data SEI "
+               "message to access unit.\n");
+        return err;
+    }
+
+    return 0;
+}
+
+static int evc_metadata_update_fragment(AVBSFContext *bsf, AVPacket *pkt,
+                                        CodedBitstreamFragment *au)
+{
+    EVCMetadataContext *ctx = bsf->priv_data;
+    int err, i, has_sps, seek_point;
+
+    if (ctx->delete_sei) {
+        for (i = au->nb_units - 1; i >= 0; i--) {
+            if (au->units[i].type == EVC_SEI_NUT)
+                ff_cbs_delete_unit(au, i);
+        }
+    }
+
+    has_sps = 0;
+    for (i = 0; i < au->nb_units; i++) {
+        if (au->units[i].type == EVC_SPS_NUT) {
+            err = evc_metadata_update_sps(bsf, au->units[i].content);
+            if (err < 0)
+                return err;
+            has_sps = 1;
+        }
+    }
+
+    if (pkt) {
+        // The current packet should be treated as a seek point for metadata
+        // insertion if any of:
+        // - It is the first packet in the stream.
+        // - It contains an SPS, indicating that a sequence might start here.
+        // - It is marked as containing a key frame.
+        seek_point = !ctx->done_first_au || has_sps ||
+            (pkt->flags & AV_PKT_FLAG_KEY);
+    } else {
+        seek_point = 0;
+    }
+
+    if (ctx->sei_user_data && seek_point) {
+        err = evc_metadata_insert_sei(bsf, au);
+        if (err < 0)
+            return err;
+    }
+
+    if (pkt)
+        ctx->done_first_au = 1;
+
+    return 0;
+}
+
+static const CBSBSFType evc_metadata_type = {
+    .codec_id        = AV_CODEC_ID_EVC,
+    .fragment_name   = "access unit",
+    .unit_name       = "NAL unit",
+    .update_fragment = &evc_metadata_update_fragment,
+};
+
+static int evc_metadata_init(AVBSFContext *bsf)
+{
+    EVCMetadataContext *ctx = bsf->priv_data;
+
+    if (ctx->sei_user_data) {
+        EVCRawSEIMessage *message = &ctx->sei_nal.message[0];
+        uint8_t uuid[16];
+        size_t length;
+        int i, j;
+
+        // Parse UUID.  It must be a hex string of length 32, possibly
+        // containing '-'s between hex digits (which we ignore).
+        for (i = j = 0; j < 32 && i < 64 && ctx->sei_user_data[i]; i++) {
+            int c, v;
+            c = ctx->sei_user_data[i];
+            if (c == '-') {
+                continue;
+            } else if (av_isxdigit(c)) {
+                c = av_tolower(c);
+                v = (c <= '9' ? c - '0' : c - 'a' + 10);
+            } else {
+                break;
+            }
+            if (j & 1)
+                uuid[j / 2] |= v;
+            else
+                uuid[j / 2] = v << 4;
+            ++j;
+        }
+        if (j != 32 || ctx->sei_user_data[i] != '+') {
+            av_log(bsf, AV_LOG_ERROR, "Invalid user data: "
+                   "must be \"UUID+string\".\n");
+            return AVERROR(EINVAL);
+        }
+
+        // uuid_iso_iec_11578 followed by the string and its terminator.
+        length = sizeof(uuid) + strlen(ctx->sei_user_data + i + 1) + 1;
+        ctx->sei_user_data_payload = av_malloc(length);
+        if (!ctx->sei_user_data_payload)
+            return AVERROR(ENOMEM);
+        memcpy(ctx->sei_user_data_payload, uuid, sizeof(uuid));
+        memcpy(ctx->sei_user_data_payload + sizeof(uuid),
+               ctx->sei_user_data + i + 1, length - sizeof(uuid));
+
+        ctx->sei_nal.nal_unit_header = (EVCRawNALUnitHeader) {
+            .nal_unit_type_plus1 = EVC_SEI_NUT + 1,
+        };
+        message->payload_type  = SEI_TYPE_USER_DATA_UNREGISTERED;
+        message->payload_size  = length;
+        message->payload       = ctx->sei_user_data_payload;
+        ctx->sei_nal.message_count = 1;
+    }
+
+    return ff_cbs_bsf_generic_init(bsf, &evc_metadata_type);
+}
+
+static void evc_metadata_close(AVBSFContext *bsf)
+{
+    EVCMetadataContext *ctx = bsf->priv_data;
+
+    av_freep(&ctx->sei_user_data_payload);
+    ff_cbs_bsf_generic_close(bsf);
+}
+
+#define OFFSET(x) offsetof(EVCMetadataContext, x)
+#define FLAGS (AV_OPT_FLAG_VIDEO_PARAM|AV_OPT_FLAG_BSF_PARAM)
+static const AVOption evc_metadata_options[] = {
+    { "sample_aspect_ratio", "Set sample aspect ratio (table E-1)",
+        OFFSET(sample_aspect_ratio), AV_OPT_TYPE_RATIONAL,
+        { .dbl = 0.0 }, 0, 65535, FLAGS },
+
+    { "video_format", "Set video format (table E-2)",
+        OFFSET(video_format), AV_OPT_TYPE_INT,
+        { .i64 = -1 }, -1, 7, FLAGS },
+    { "video_full_range_flag", "Set video full range flag",
+        OFFSET(video_full_range_flag), AV_OPT_TYPE_INT,
+        { .i64 = -1 }, -1, 1, FLAGS },
+    { "colour_primaries", "Set colour primaries (table E-3)",
+        OFFSET(colour_primaries), AV_OPT_TYPE_INT,
+        { .i64 = -1 }, -1, 255, FLAGS },
+    { "transfer_characteristics", "Set transfer characteristics (table E-4)",
+        OFFSET(transfer_characteristics), AV_OPT_TYPE_INT,
+        { .i64 = -1 }, -1, 255, FLAGS },
+    { "matrix_coefficients", "Set matrix coefficients (table E-5)",
+        OFFSET(matrix_coefficients), AV_OPT_TYPE_INT,
+        { .i64 = -1 }, -1, 255, FLAGS },
+
+    { "chroma_sample_loc_type", "Set chroma sample location type (figure E-1)",
+        OFFSET(chroma_sample_loc_type), AV_OPT_TYPE_INT,
+        { .i64 = -1 }, -1, 5, FLAGS },
+
+    { "tick_rate",
+        "Set VUI tick rate (time_scale / num_units_in_tick)",
+        OFFSET(tick_rate), AV_OPT_TYPE_RATIONAL,
+        { .dbl = 0.0 }, 0, UINT_MAX, FLAGS },
+    { "fixed_pic_rate_flag",
+        "Set VUI fixed picture rate flag",
+        OFFSET(fixed_pic_rate_flag), AV_OPT_TYPE_INT,
+        { .i64 = -1 }, -1, 1, FLAGS },
+
+    { "level", "Set level (table A.1)",
+        OFFSET(level), AV_OPT_TYPE_INT,
+        { .i64 = LEVEL_UNSET }, LEVEL_UNSET, 0xff, FLAGS, "level" },
+#define LEVEL(name, value) name, NULL, 0, AV_OPT_TYPE_CONST, \
+        { .i64 = value },      .flags = FLAGS, .unit = "level"
+    { LEVEL("1",    30) },
+    { LEVEL("2",    60) },
+    { LEVEL("2.1",  63) },
+    { LEVEL("3",    90) },
+    { LEVEL("3.1",  93) },
+    { LEVEL("4",   120) },
+    { LEVEL("4.1", 123) },
+    { LEVEL("5",   150) },
+    { LEVEL("5.1", 153) },
+    { LEVEL("5.2", 156) },
+    { LEVEL("6",   180) },
+    { LEVEL("6.1", 183) },
+    { LEVEL("6.2", 186) },
+#undef LEVEL
+
+    { "sei_user_data", "Insert SEI user data (UUID+string)",
+        OFFSET(sei_user_data), AV_OPT_TYPE_STRING, { .str = NULL }, .flags = FLAGS },
+
+    { "delete_sei", "Delete all SEI NAL units",
+        OFFSET(delete_sei), AV_OPT_TYPE_BOOL, { .i64 = 0 }, 0, 1, FLAGS },
+
+    { NULL }
+};
+
+static const AVClass evc_metadata_class = {
+    .class_name = "evc_metadata_bsf",
+    .item_name  = av_default_item_name,
+    .option     = evc_metadata_options,
+    .version    = LIBAVUTIL_VERSION_INT,
+};
+
+static const enum AVCodecID evc_metadata_codec_ids[] = {
+    AV_CODEC_ID_EVC, AV_CODEC_ID_NONE,
+};
+
+const FFBitStreamFilter ff_evc_metadata_bsf = {
+    .p.name         = "evc_metadata",
+    .p.codec_ids    = evc_metadata_codec_ids,
+    .p.priv_class   = &evc_metadata_class,
+    .priv_data_size = sizeof(EVCMetadataContext),
+    .init           = &evc_metadata_init,
+    .close          = &evc_metadata_close,
+    .filter         = &ff_cbs_bsf_generic_filter,
+};
@@ -0,0 +1,706 @@
+/*
+ * This file is part of FFmpeg.
+ *
+ * FFmpeg is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * FFmpeg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with FFmpeg; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/**
+ * @file
+ * Merge several EVC streams into a mosaic, each stream becoming a
+ * rectangle of tiles of a larger picture.
+ *
+ * The input packets are the access units of the sources in turn, one
+ * access unit of every source in raster order making one access unit of
+ * the mosaic. The sources must share their parameter sets: those of the
+ * first source are rewritten for the mosaic picture size and tile grid,
+ * those of the other sources are only checked and dropped. The tile ids of
+ * the slice headers are renumbered for the position of their source and
+ * the slice data is copied as is, so the sources must be coded with
+ * motion vectors constrained to the picture.
+ */
+
+#include <string.h>
+
+#include "libavutil/common.h"
+#include "libavutil/mem.h"
+#include "libavutil/opt.h"
+
+#include "bsf.h"
+#include "bsf_internal.h"
+#include "cbs.h"
+#include "cbs_bsf.h"
+#include "cbs_evc.h"
+#include "evc.h"
+
+typedef struct EVCTileGrid {
+    int ctb_log2_size;
+    int nb_columns;
+    int nb_rows;
+    // first CTB of each tile column and row, followed by the picture size in CTBs
+    int column_start[EVC_MAX_TILE_COLUMNS + 1];
+    int row_start[EVC_MAX_TILE_ROWS + 1];
+} EVCTileGrid;
+
+// Copy of a parameter set NAL unit of the sources, as last read
+typedef struct EVCMosaicParamSet {
+    uint8_t *data;
+    size_t   size;
+} EVCMosaicParamSet;
+
+typedef struct EVCMosaicContext {
+    CBSBSFContext common;
+
+    int columns;
+    int rows;
+    int nb_sources;
+
+    // access units of the current mosaic picture, one per source
+    CodedBitstreamFragment *au;
+    int nb_pending;
+    // packet of the first source, giving its properties to the mosaic
+    AVPacket *first;
+    AVPacket *in;
+
+    // first mosaic tile of each unit of the first access unit, -1 for non-VCL units
+    int     *unit_tile;
+    unsigned unit_tile_size;
+
+    EVCMosaicParamSet sps[EVC_MAX_SPS_COUNT];
+    EVCMosaicParamSet pps[EVC_MAX_PPS_COUNT];
+    // indexed by aps_params_type, then by id
+    EVCMosaicParamSet aps[8][EVC_MAX_APS_COUNT];
+
+    // cropped size of the last SPS rewritten
+    int out_width;
+    int out_height;
+} EVCMosaicContext;
+
+static int evc_mosaic_grid(AVBSFContext *bsf, const EVCRawSPS *sps,
+                           const EVCRawPPS *pps, EVCTileGrid *grid)
+{
+    int width_ctbs, height_ctbs;
+
+    grid->ctb_log2_size = sps->sps_btt_flag ? sps->log2_ctu_size_minus5 + 5 : 6;
+    width_ctbs  = AV_CEIL_RSHIFT(sps->pic_width_in_luma_samples,  grid->ctb_log2_size);
+    height_ctbs = AV_CEIL_RSHIFT(sps->pic_height_in_luma_samples, grid->ctb_log2_size);
+
+    if (pps->single_tile_in_pic_flag) {
+        grid->nb_columns = grid->nb_rows = 1;
+    } else {
+        grid->nb_columns = pps->num_tile_columns_minus1 + 1;
+        grid->nb_rows    = pps->num_tile_rows_minus1    + 1;
+    }
+
+    grid->column_start[0] = grid->row_start[0] = 0;
+    for (int i = 0; i < grid->nb_columns; i++) {
+        if (pps->single_tile_in_pic_flag || i == grid->nb_columns - 1)
+            grid->column_start[i + 1] = width_ctbs;
+        else if (pps->uniform_tile_spacing_flag)
+            grid->column_start[i + 1] = (i + 1) * width_ctbs / grid->nb_columns;
+        else
+            grid->column_start[i + 1] = grid->column_start[i] + pps->tile_column_width_minus1[i] + 1;
+    }
+    for (int i = 0; i < grid->nb_rows; i++) {
+        if (pps->single_tile_in_pic_flag || i == grid->nb_rows - 1)
+            grid->row_start[i + 1] = height_ctbs;
+        else if (pps->uniform_tile_spacing_flag)
+            grid->row_start[i + 1] = (i + 1) * height_ctbs / grid->nb_rows;
+        else
+            grid->row_start[i + 1] = grid->row_start[i] + pps->tile_row_height_minus1[i] + 1;
+    }
+
+    if (grid->column_start[grid->nb_columns - 1] >= width_ctbs ||
+        grid->row_start[grid->nb_rows - 1] >= height_ctbs) {
+        av_log(bsf, AV_LOG_ERROR, "Tile grid of PPS %d exceeds the picture.\n",
+               pps->pps_pic_parameter_set_id);
+        return AVERROR_INVALIDDATA;
+    }
+
+    return 0;
+}
+
+static EVCMosaicParamSet *evc_mosaic_param_set(EVCMosaicContext *ctx,
+                                               const CodedBitstreamUnit *unit)
+{
+    switch (unit->type) {
+    case EVC_SPS_NUT: {
+        const EVCRawSPS *sps = unit->content;
+        return &ctx->sps[sps->sps_seq_parameter_set_id];
+    }
+    case EVC_PPS_NUT: {
+        const EVCRawPPS *pps = unit->content;
+        return &ctx->pps[pps->pps_pic_parameter_set_id];
+    }
+    case EVC_APS_NUT: {
+        const EVCRawAPS *aps = unit->content;
+        return &ctx->aps[aps->aps_params_type][aps->adaptation_parameter_set_id];
+    }
+    }
+    return NULL;
+}
+
+// Keep the parameter sets of the first source, and check that the other
+// sources use the same ones before dropping them.
+static int evc_mosaic_check_param_sets(AVBSFContext *bsf,
+                                       CodedBitstreamFragment *au, int source)
+{
+    EVCMosaicContext *ctx = bsf->priv_data;
+
+    for (int i = 0; i < au->nb_units; i++) {
+        const CodedBitstreamUnit *unit = &au->units[i];
+        EVCMosaicParamSet *ps;
+        int same;
+
+        if (!unit->content)
+            continue;
+        ps = evc_mosaic_param_set(ctx, unit);
+        if (!ps)
+            continue;
+
+        same = ps->data && ps->size == unit->data_size &&
+               !memcmp(ps->data, unit->data, unit->data_size);
+
+        if (!source) {
+            if (!same) {
+                av_freep(&ps->data);
+                ps->size = 0;
+                ps->data = av_memdup(unit->data, unit->data_size);
+                if (!ps->data)
+                    return AVERROR(ENOMEM);
+                ps->size = unit->data_size;
+            }
+            continue;
+        }
+
+        if (!same) {
+            av_log(bsf, AV_LOG_ERROR, "Source %d has a parameter set (NAL unit "
+                   "type %d) which differs from those of source 0.\n",
+                   source, (int)unit->type);
+            return AVERROR_PATCHWELCOME;
+        }
+        ff_cbs_delete_unit(au, i--);
+    }
+
+    return 0;
+}
+
+static int evc_mosaic_update_pps(AVBSFContext *bsf, EVCRawPPS *pps,
+                                 const EVCRawSPS *sps)
+{
+    EVCMosaicContext *ctx = bsf->priv_data;
+    EVCTileGrid grid;
+    int nb_columns, nb_rows, err;
+
+    err = evc_mosaic_grid(bsf, sps, pps, &grid);
+    if (err < 0)
+        return err;
+
+    if (!pps->single_tile_in_pic_flag && pps->explicit_tile_id_flag) {
+        av_log(bsf, AV_LOG_ERROR, "Explicit tile ids are not supported.\n");
+        return AVERROR_PATCHWELCOME;
+    }
+    if (!pps->single_tile_in_pic_flag && pps->loop_filter_across_tiles_enabled_flag) {
+        av_log(bsf, AV_LOG_ERROR, "PPS %d filters across tile boundaries, "
+               "the sources cannot be merged.\n", pps->pps_pic_parameter_set_id);
+        return AVERROR_INVALIDDATA;
+    }
+
+    nb_columns = ctx->columns * grid.nb_columns;
+    nb_rows    = ctx->rows    * grid.nb_rows;
+    if (nb_columns > EVC_MAX_TILE_COLUMNS || nb_rows > EVC_MAX_TILE_ROWS) {
+        av_log(bsf, AV_LOG_ERROR, "The %dx%d tile grid of the mosaic exceeds "
+               "the maximum of %dx%d tiles.\n", nb_columns, nb_rows,
+               EVC_MAX_TILE_COLUMNS, EVC_MAX_TILE_ROWS);
+        return AVERROR(EINVAL);
+    }
+    if (nb_columns == 1 && nb_rows == 1)
+        return 0;
+
+    pps->single_tile_in_pic_flag   = 0;
+    pps->num_tile_columns_minus1   = nb_columns - 1;
+    pps->num_tile_rows_minus1      = nb_rows    - 1;
+    pps->uniform_tile_spacing_flag = 0;
+    for (int i = 0; i < nb_columns - 1; i++) {
+        int j = i % grid.nb_columns;
+        pps->tile_column_width_minus1[i] = grid.column_start[j + 1] - grid.column_start[j] - 1;
+    }
+    for (int i = 0; i < nb_rows - 1; i++) {
+        int j = i % grid.nb_rows;
+        pps->tile_row_height_minus1[i] = grid.row_start[j + 1] - grid.row_start[j] - 1;
+    }
+    pps->loop_filter_across_tiles_enabled_flag = 0;
+    pps->tile_id_len_minus1 = FFMAX(pps->tile_id_len_minus1,
+                                    av_log2(nb_columns * nb_rows - 1));
+
+    return 0;
+}
+
+static int evc_mosaic_update_sps(AVBSFContext *bsf, EVCRawSPS *sps)
+{
+    EVCMosaicContext *ctx = bsf->priv_data;
+    int ctb_size = 1 << (sps->sps_btt_flag ? sps->log2_ctu_size_minus5 + 5 : 6);
+    int width  = sps->pic_width_in_luma_samples;
+    int height = sps->pic_height_in_luma_samples;
+
+    // the pictures of the sources become tiles, made of whole CTBs
+    if ((ctx->columns > 1 && width  % ctb_size) ||
+        (ctx->rows    > 1 && height % ctb_size)) {
+        av_log(bsf, AV_LOG_ERROR, "The %dx%d pictures of the sources are not "
+               "made of whole %dx%d CTBs.\n", width, height, ctb_size, ctb_size);
+        return AVERROR_PATCHWELCOME;
+    }
+    if (sps->picture_cropping_flag &&
+        ((ctx->columns > 1 && (sps->picture_crop_left_offset || sps->picture_crop_right_offset)) ||
+         (ctx->rows    > 1 && (sps->picture_crop_top_offset  || sps->picture_crop_bottom_offset)))) {
+        av_log(bsf, AV_LOG_ERROR, "The pictures of the sources are cropped "
+               "along the mosaic.\n");
+        return AVERROR_PATCHWELCOME;
+    }
+    if (width * ctx->columns > EVC_MAX_WIDTH || height * ctx->rows > EVC_MAX_HEIGHT) {
+        av_log(bsf, AV_LOG_ERROR, "The %dx%d mosaic exceeds the maximum "
+               "picture size.\n", width * ctx->columns, height * ctx->rows);
+        return AVERROR(EINVAL);
+    }
+
+    sps->pic_width_in_luma_samples  = width  * ctx->columns;
+    sps->pic_height_in_luma_samples = height * ctx->rows;
+
+    ctx->out_width  = sps->pic_width_in_luma_samples -
+                      sps->picture_crop_left_offset - sps->picture_crop_right_offset;
+    ctx->out_height = sps->pic_height_in_luma_samples -
+                      sps->picture_crop_top_offset  - sps->picture_crop_bottom_offset;
+
+    return 0;
+}
+
+// Rewrite the parameter sets for the mosaic, called for the first source
+// and for the extradata.
+static int evc_mosaic_update_fragment(AVBSFContext *bsf, AVPacket *pkt,
+                                      CodedBitstreamFragment *au)
+{
+    EVCMosaicContext *ctx = bsf->priv_data;
+    CodedBitstreamEVCContext *evc = ctx->common.input->priv_data;
+    int err;
+
+    err = evc_mosaic_check_param_sets(bsf, au, 0);
+    if (err < 0)
+        return err;
+
+    // the parameter sets are copied before being rewritten, the input
+    // context keeps referencing the original ones to parse the slices
+    for (int i = 0; i < au->nb_units; i++) {
+        CodedBitstreamUnit *unit = &au->units[i];
+        EVCRawPPS *pps = unit->content;
+        const EVCRawSPS *sps;
+
+        if (unit->type != EVC_PPS_NUT)
+            continue;
+
+        sps = evc->sps[pps->pps_seq_parameter_set_id];
+        if (!sps) {
+            av_log(bsf, AV_LOG_ERROR, "SPS id %d not available.\n",
+                   pps->pps_seq_parameter_set_id);
+            return AVERROR_INVALIDDATA;
+        }
+
+        err = ff_cbs_make_unit_writable(ctx->common.input, unit);
+        if (err < 0)
+            return err;
+        err = evc_mosaic_update_pps(bsf, unit->content, sps);
+        if (err < 0)
+            return err;
+    }
+
+    for (int i = 0; i < au->nb_units; i++) {
+        CodedBitstreamUnit *unit = &au->units[i];
+
+        if (unit->type != EVC_SPS_NUT)
+            continue;
+
+        err = ff_cbs_make_unit_writable(ctx->common.input, unit);
+        if (err < 0)
+            return err;
+        err = evc_mosaic_update_sps(bsf, unit->content);
+        if (err < 0)
+            return err;
+    }
+
+    return 0;
+}
+
+/**
+ * Renumber the tile ids of a slice for the position of its source.
+ *
+ * @return the first tile of the slice in the mosaic, negative error code on failure
+ */
+static int evc_mosaic_update_slice(AVBSFContext *bsf, EVCRawSliceHeader *sh,
+                                   int source)
+{
+    EVCMosaicContext *ctx = bsf->priv_data;
+    CodedBitstreamEVCContext *evc = ctx->common.input->priv_data;
+    const EVCRawPPS *pps = evc->pps[sh->slice_pic_parameter_set_id];
+    const EVCRawSPS *sps = pps ? evc->sps[pps->pps_seq_parameter_set_id] : NULL;
+    int first_tile = 0, last_tile = 0, nb_columns, column, row;
+    EVCTileGrid grid;
+    int err;
+
+    if (!sps)
+        return AVERROR_INVALIDDATA;
+
+    err = evc_mosaic_grid(bsf, sps, pps, &grid);
+    if (err < 0)
+        return err;
+
+    if (!pps->single_tile_in_pic_flag) {
+        if (!sh->single_tile_in_slice_flag && sh->arbitrary_slice_flag) {
+            av_log(bsf, AV_LOG_ERROR, "Arbitrary slices are not supported.\n");
+            return AVERROR_PATCHWELCOME;
+        }
+        first_tile = sh->first_tile_id;
+        last_tile  = sh->single_tile_in_slice_flag ? first_tile : sh->last_tile_id;
+        if (first_tile >= grid.nb_columns * grid.nb_rows ||
+            last_tile  >= grid.nb_columns * grid.nb_rows) {
+            av_log(bsf, AV_LOG_ERROR, "Invalid tile id in slice header.\n");
+            return AVERROR_INVALIDDATA;
+        }
+    }
+
+    nb_columns = ctx->columns * grid.nb_columns;
+    if (nb_columns == 1 && ctx->rows * grid.nb_rows == 1)
+        return 0;
+
+    // tile ids in raster order, from the tile grid of the source to the mosaic
+    column = source % ctx->columns * grid.nb_columns;
+    row    = source / ctx->columns * grid.nb_rows;
+#define MOSAIC_TILE(t) ((row    + (t) / grid.nb_columns) * nb_columns + \
+                         column + (t) % grid.nb_columns)
+    sh->first_tile_id = MOSAIC_TILE(first_tile);
+    sh->last_tile_id  = MOSAIC_TILE(last_tile);
+#undef MOSAIC_TILE
+    if (pps->single_tile_in_pic_flag)
+        sh->single_tile_in_slice_flag = 1;
+
+    return sh->first_tile_id;
+}
+
+// Move the slices of all the sources into the first access unit, in the
+// order of their first tile.
+static int evc_mosaic_merge(AVBSFContext *bsf)
+{
+    EVCMosaicContext *ctx = bsf->priv_data;
+    CodedBitstreamFragment *out = &ctx->au[0];
+    const EVCRawSliceHeader *ref = NULL;
+    size_t nb_units = 0;
+    int err;
+
+    for (int i = 0; i < ctx->nb_sources; i++)
+        nb_units += ctx->au[i].nb_units;
+    if (nb_units > INT_MAX / sizeof(*ctx->unit_tile))
+        return AVERROR(ERANGE);
+    ctx->unit_tile = av_fast_realloc(ctx->unit_tile, &ctx->unit_tile_size,
+                                     nb_units * sizeof(*ctx->unit_tile));
+    if (!ctx->unit_tile)
+        return AVERROR(ENOMEM);
+
+    for (int s = 0; s < ctx->nb_sources; s++) {
+        CodedBitstreamFragment *au = &ctx->au[s];
+        int nb_slices = 0;
+
+        for (int i = 0; i < au->nb_units; i++) {
+            CodedBitstreamUnit *unit = &au->units[i];
+            EVCRawSlice *slice = unit->content;
+            int tile, pos;
+
+            if (unit->type != EVC_IDR_NUT && unit->type != EVC_NOIDR_NUT) {
+                if (!s)
+                    ctx->unit_tile[i] = -1;
+                continue;
+            }
+
+            // the tiles of a picture must belong to the same kind of picture
+            if (!ref) {
+                ref = &slice->header;
+            } else if (slice->header.nal_unit_header.nal_unit_type_plus1 !=
+                       ref->nal_unit_header.nal_unit_type_plus1 ||
+                       slice->header.nal_unit_header.nuh_temporal_id !=
+                       ref->nal_unit_header.nuh_temporal_id ||
+                       slice->header.slice_pic_order_cnt_lsb != ref->slice_pic_order_cnt_lsb) {
+                av_log(bsf, AV_LOG_ERROR, "A slice of source %d does not "
+                       "belong to the picture of the first slice.\n", s);
+                return AVERROR_INVALIDDATA;
+            }
+
+            tile = evc_mosaic_update_slice(bsf, &slice->header, s);
+            if (tile < 0)
+                return tile;
+            nb_slices++;
+
+            if (!s) {
+                ctx->unit_tile[i] = tile;
+                continue;
+            }
+
+            // after the last slice of a lower tile, or before the first slice
+            for (pos = out->nb_units; pos > 0; pos--) {
+                if (ctx->unit_tile[pos - 1] >= 0 && ctx->unit_tile[pos - 1] < tile)
+                    break;
+            }
+            if (!pos) {
+                while (pos < out->nb_units && ctx->unit_tile[pos] < 0)
+                    pos++;
+            }
+
+            err = ff_cbs_insert_unit_content(out, pos, unit->type,
+                                             unit->content, unit->content_ref);
+            if (err < 0)
+                return err;
+            memmove(&ctx->unit_tile[pos + 1], &ctx->unit_tile[pos],
+                    (out->nb_units - 1 - pos) * sizeof(*ctx->unit_tile));
+            ctx->unit_tile[pos] = tile;
+        }
+
+        if (!nb_slices) {
+            av_log(bsf, AV_LOG_ERROR, "No slice in the access unit of source %d.\n", s);
+            return AVERROR_INVALIDDATA;
+        }
+    }
+
+    return 0;
+}
+
+static void evc_mosaic_reset(EVCMosaicContext *ctx)
+{
+    for (int i = 0; i < ctx->nb_pending; i++)
+        ff_cbs_fragment_reset(&ctx->au[i]);
+    ctx->nb_pending = 0;
+    av_packet_unref(ctx->first);
+}
+
+// New extradata of the first source is rewritten for the mosaic, the one
+// of the other sources must carry the same parameter sets.
+static int evc_mosaic_side_data(AVBSFContext *bsf, AVPacket *pkt, int source)
+{
+    EVCMosaicContext *ctx = bsf->priv_data;
+    CodedBitstreamFragment *frag = &ctx->common.fragment;
+    uint8_t *side_data;
+    int err;
+
+    if (!av_packet_get_side_data(pkt, AV_PKT_DATA_NEW_EXTRADATA, NULL))
+        return 0;
+
+    err = ff_cbs_read_packet_side_data(ctx->common.input, frag, pkt);
+    if (err < 0) {
+        av_log(bsf, AV_LOG_ERROR,
+               "Failed to read extradata from packet side data.\n");
+        goto fail;
+    }
+
+    if (source) {
+        err = evc_mosaic_check_param_sets(bsf, frag, source);
+        goto fail;
+    }
+
+    err = evc_mosaic_update_fragment(bsf, NULL, frag);
+    if (err < 0)
+        goto fail;
+
+    err = ff_cbs_write_fragment_data(ctx->common.output, frag);
+    if (err < 0) {
+        av_log(bsf, AV_LOG_ERROR,
+               "Failed to write extradata into packet side data.\n");
+        goto fail;
+    }
+
+    side_data = av_packet_new_side_data(pkt, AV_PKT_DATA_NEW_EXTRADATA,
+                                        frag->data_size);
+    if (!side_data) {
+        err = AVERROR(ENOMEM);
+        goto fail;
+    }
+    memcpy(side_data, frag->data, frag->data_size);
+
+fail:
+    ff_cbs_fragment_reset(frag);
+    return err;
+}
+
+static int evc_mosaic_read(AVBSFContext *bsf, AVPacket *pkt)
+{
+    EVCMosaicContext *ctx = bsf->priv_data;
+    CodedBitstreamFragment *au = &ctx->au[ctx->nb_pending];
+    int source = ctx->nb_pending;
+    int err;
+
+    err = evc_mosaic_side_data(bsf, pkt, source);
+    if (err < 0)
+        return err;
+
+    err = ff_cbs_read_packet(ctx->common.input, au, pkt);
+    if (err < 0) {
+        av_log(bsf, AV_LOG_ERROR, "Failed to read access unit of source %d.\n",
+               source);
+        return err;
+    }
+    ctx->nb_pending++;
+
+    if (source)
+        return evc_mosaic_check_param_sets(bsf, au, source);
+    return evc_mosaic_update_fragment(bsf, pkt, au);
+}
+
+static int evc_mosaic_filter(AVBSFContext *bsf, AVPacket *pkt)
+{
+    EVCMosaicContext *ctx = bsf->priv_data;
+    int err;
+
+    while (ctx->nb_pending < ctx->nb_sources) {
+        int source = ctx->nb_pending;
+
+        err = ff_bsf_get_packet_ref(bsf, ctx->in);
+        if (err == AVERROR_EOF && ctx->nb_pending) {
+            av_log(bsf, AV_LOG_WARNING, "Dropping the last picture, only "
+                   "%d of the %d sources sent it.\n", ctx->nb_pending,
+                   ctx->nb_sources);
+            evc_mosaic_reset(ctx);
+        }
+        if (err < 0)
+            return err;
+
+        err = evc_mosaic_read(bsf, ctx->in);
+        if (!source)
+            av_packet_move_ref(ctx->first, ctx->in);
+        else
+            av_packet_unref(ctx->in);
+        if (err < 0)
+            goto fail;
+    }
+
+    err = evc_mosaic_merge(bsf);
+    if (err < 0)
+        goto fail;
+
+    av_packet_move_ref(pkt, ctx->first);
+    err = ff_cbs_write_packet(ctx->common.output, pkt, &ctx->au[0]);
+    if (err < 0) {
+        av_log(bsf, AV_LOG_ERROR, "Failed to write access unit into packet.\n");
+        av_packet_unref(pkt);
+    }
+
+fail:
+    evc_mosaic_reset(ctx);
+    return err;
+}
+
+static const CBSBSFType evc_mosaic_type = {
+    .codec_id        = AV_CODEC_ID_EVC,
+    .fragment_name   = "access unit",
+    .unit_name       = "NAL unit",
+    .update_fragment = &evc_mosaic_update_fragment,
+};
+
+static int evc_mosaic_init(AVBSFContext *bsf)
+{
+    EVCMosaicContext *ctx = bsf->priv_data;
+    int err;
+
+    ctx->nb_sources = ctx->columns * ctx->rows;
+    ctx->au    = av_calloc(ctx->nb_sources, sizeof(*ctx->au));
+    ctx->first = av_packet_alloc();
+    ctx->in    = av_packet_alloc();
+    if (!ctx->au || !ctx->first || !ctx->in)
+        return AVERROR(ENOMEM);
+
+    err = ff_cbs_bsf_generic_init(bsf, &evc_mosaic_type);
+    if (err < 0)
+        return err;
+
+    // the output size is known when the parameter sets are in the extradata
+    if (ctx->out_width) {
+        bsf->par_out->width  = ctx->out_width;
+        bsf->par_out->height = ctx->out_height;
+    } else if (bsf->par_in->width) {
+        bsf->par_out->width  = bsf->par_in->width  * ctx->columns;
+        bsf->par_out->height = bsf->par_in->height * ctx->rows;
+    }
+
+    return 0;
+}
+
+static void evc_mosaic_flush(AVBSFContext *bsf)
+{
+    EVCMosaicContext *ctx = bsf->priv_data;
+
+    evc_mosaic_reset(ctx);
+    av_packet_unref(ctx->in);
+}
+
+static void evc_mosaic_close(AVBSFContext *bsf)
+{
+    EVCMosaicContext *ctx = bsf->priv_data;
+
+    if (ctx->au) {
+        for (int i = 0; i < ctx->nb_sources; i++)
+            ff_cbs_fragment_free(&ctx->au[i]);
+        av_freep(&ctx->au);
+    }
+    av_packet_free(&ctx->first);
+    av_packet_free(&ctx->in);
+    av_freep(&ctx->unit_tile);
+
+    for (int i = 0; i < EVC_MAX_SPS_COUNT; i++)
+        av_freep(&ctx->sps[i].data);
+    for (int i = 0; i < EVC_MAX_PPS_COUNT; i++)
+        av_freep(&ctx->pps[i].data);
+    for (int i = 0; i < FF_ARRAY_ELEMS(ctx->aps); i++)
+        for (int j = 0; j < EVC_MAX_APS_COUNT; j++)
+            av_freep(&ctx->aps[i][j].data);
+
+    ff_cbs_bsf_generic_close(bsf);
+}
+
+#define OFFSET(x) offsetof(EVCMosaicContext, x)
+#define FLAGS (AV_OPT_FLAG_VIDEO_PARAM|AV_OPT_FLAG_BSF_PARAM)
+static const AVOption evc_mosaic_options[] = {
+    { "columns", "Number of sources side by side",
+        OFFSET(columns), AV_OPT_TYPE_INT,
+        { .i64 = 2 }, 1, EVC_MAX_TILE_COLUMNS, FLAGS },
+    { "rows", "Number of sources on top of each other",
+        OFFSET(rows), AV_OPT_TYPE_INT,
+        { .i64 = 1 }, 1, EVC_MAX_TILE_ROWS, FLAGS },
+
+    { NULL }
+};
+
+static const AVClass evc_mosaic_class = {
+    .class_name = "evc_mosaic_bsf",
+    .item_name  = av_default_item_name,
+    .option     = evc_mosaic_options,
+    .version    = LIBAVUTIL_VERSION_INT,
+};
+
+static const enum AVCodecID evc_mosaic_codec_ids[] = {
+    AV_CODEC_ID_EVC, AV_CODEC_ID_NONE,
+};
+
+const FFBitStreamFilter ff_evc_mosaic_bsf = {
+    .p.name         = "evc_mosaic",
+    .p.codec_ids    = evc_mosaic_codec_ids,
+    .p.priv_class   = &evc_mosaic_class,
+    .priv_data_size = sizeof(EVCMosaicContext),
+    .init           = &evc_mosaic_init,
+    .flush          = &evc_mosaic_flush,
+    .close          = &evc_mosaic_close,
+    .filter         = &evc_mosaic_filter,
+};
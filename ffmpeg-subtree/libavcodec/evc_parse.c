@@ -16,8 +16,14 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
  */
 
+#include "libavutil/thread.h"
+
+#include "atsc_a53.h"
+#include "bytestream.h"
 #include "golomb.h"
+#include "h2645data.h"
 #include "parser.h"
+#include "sei.h"
 #include "evc.h"
 #include "evc_parse.h"
 
@@ -52,23 +58,12 @@ static const enum AVPixelFormat pix_fmts_16bit[NUM_CHROMA_FORMATS] = {
 // nuh_temporal_id specifies a temporal identifier for the NAL unit
 int ff_evc_get_temporal_id(const uint8_t *bits, int bits_size, void *logctx)
 {
-    int temporal_id = 0;
-    uint16_t t = 0;
-
     if (bits_size < EVC_NALU_HEADER_SIZE) {
         av_log(logctx, AV_LOG_ERROR, "Can't read NAL unit header\n");
         return 0;
     }
 
-    // forbidden_zero_bit
-    if ((bits[0] & 0x80) != 0)
-        return -1;
-
-    t = AV_RB16(bits);
-
-    temporal_id = (t >> 6) & 0x0007;
-
-    return temporal_id;
+    return ff_evc_nal_unit_temporal_id(bits, bits_size);
 }
 
 // @see ISO_IEC_23094-1 (7.3.7 Reference picture list structure syntax)
@@ -179,6 +174,175 @@ static int vui_parameters(GetBitContext *gb, VUIParameters *vui)
     return 0;
 }
 
+// Get the buffer a parameter set is parsed into. The current one is reused unless another
+// consumer still references it or it is too small, so repeated parameter sets are parsed without allocating.
+static void *get_ps_buffer(AVBufferRef **ref, size_t size)
+{
+    if (!*ref || !av_buffer_is_writable(*ref) || (*ref)->size < size) {
+        AVBufferRef *buf = av_buffer_allocz(size);
+        if (!buf)
+            return NULL;
+        av_buffer_unref(ref);
+        *ref = buf;
+    }
+
+    return (*ref)->data;
+}
+
+// Parameter sets are commonly repeated before every IDR picture,
+// an unchanged one does not need to be parsed again.
+static int raw_ps_unchanged(const EVCParserRawPS *raw, const uint8_t *bs, int bs_size)
+{
+    return raw->size == bs_size && !memcmp(raw->data, bs, bs_size);
+}
+
+static void raw_ps_store(EVCParserRawPS *raw, const uint8_t *bs, int bs_size)
+{
+    av_fast_malloc(&raw->data, &raw->alloc_size, bs_size);
+    if (!raw->data) {
+        raw->size = 0;
+        return;
+    }
+    memcpy(raw->data, bs, bs_size);
+    raw->size = bs_size;
+}
+
+/*
+ * Parameter sets are shared by all the EVCParserContexts of the process, i.e. the parser,
+ * the bitstream filters and the decoders of a pipeline, so that a set read by one of them
+ * is not parsed again by the next ones and all of them see the same values. A shared set
+ * is immutable, identified by its NAL unit type and raw payload, and it is dropped from
+ * the list when the last context referencing it lets it go.
+ */
+typedef struct SharedPS {
+    struct SharedPS *next;
+    int nb_refs;            // AVBuffers wrapping the set, protected by shared_ps_lock
+    int nalu_type;
+    uint8_t *data;          // parsed set, in the same allocation
+    size_t size;
+    const uint8_t *raw;     // raw payload, in the same allocation
+    int raw_size;
+} SharedPS;
+
+static SharedPS *shared_ps_list;
+static AVMutex shared_ps_lock = AV_MUTEX_INITIALIZER;
+
+static void shared_ps_free(void *opaque, uint8_t *data)
+{
+    SharedPS *ps = opaque;
+
+    ff_mutex_lock(&shared_ps_lock);
+    if (!--ps->nb_refs) {
+        SharedPS **p = &shared_ps_list;
+
+        while (*p != ps)
+            p = &(*p)->next;
+        *p = ps->next;
+        av_free(ps);
+    }
+    ff_mutex_unlock(&shared_ps_lock);
+}
+
+// Called with shared_ps_lock held
+static AVBufferRef *shared_ps_find(int nalu_type, const uint8_t *bs, int bs_size)
+{
+    for (SharedPS *ps = shared_ps_list; ps; ps = ps->next) {
+        if (ps->nalu_type == nalu_type && ps->raw_size == bs_size &&
+            !memcmp(ps->raw, bs, bs_size)) {
+            AVBufferRef *ref = av_buffer_create(ps->data, ps->size, shared_ps_free, ps,
+                                                AV_BUFFER_FLAG_READONLY);
+            if (ref)
+                ps->nb_refs++;
+            return ref;
+        }
+    }
+
+    return NULL;
+}
+
+// Make *ref reference the shared set with this payload, if another context parsed it already
+static void *shared_ps_get(AVBufferRef **ref, int nalu_type, const uint8_t *bs, int bs_size)
+{
+    AVBufferRef *shared;
+
+    ff_mutex_lock(&shared_ps_lock);
+    shared = shared_ps_find(nalu_type, bs, bs_size);
+    ff_mutex_unlock(&shared_ps_lock);
+    if (!shared)
+        return NULL;
+
+    av_buffer_unref(ref);
+    *ref = shared;
+    return shared->data;
+}
+
+// Share the set just parsed into *ref, which then references the shared copy.
+// Failing to share it is not an error, the context keeps its own copy then.
+static void *shared_ps_add(AVBufferRef **ref, size_t size, int nalu_type,
+                           const uint8_t *bs, int bs_size)
+{
+    SharedPS *ps = av_malloc(sizeof(*ps) + size + bs_size);
+    AVBufferRef *shared;
+
+    if (!ps)
+        return (*ref)->data;
+    ps->nb_refs   = 0;
+    ps->nalu_type = nalu_type;
+    ps->data      = (uint8_t *)(ps + 1);
+    ps->size      = size;
+    ps->raw       = ps->data + size;
+    ps->raw_size  = bs_size;
+    memcpy(ps->data, (*ref)->data, size);
+    memcpy(ps->data + size, bs, bs_size);
+
+    ff_mutex_lock(&shared_ps_lock);
+    // another context may have parsed the same set meanwhile
+    shared = shared_ps_find(nalu_type, bs, bs_size);
+    if (!shared) {
+        shared = av_buffer_create(ps->data, size, shared_ps_free, ps, AV_BUFFER_FLAG_READONLY);
+        if (shared) {
+            ps->nb_refs    = 1;
+            ps->next       = shared_ps_list;
+            shared_ps_list = ps;
+            ps = NULL;
+        }
+    }
+    ff_mutex_unlock(&shared_ps_lock);
+    av_free(ps);
+    if (!shared)
+        return (*ref)->data;
+
+    av_buffer_unref(ref);
+    *ref = shared;
+    return shared->data;
+}
+
+void ff_evc_ps_uninit(EVCParserContext *ctx)
+{
+    for (int i = 0; i < EVC_MAX_SPS_COUNT; i++) {
+        av_buffer_unref(&ctx->sps_ref[i]);
+        ctx->sps[i] = NULL;
+        av_freep(&ctx->sps_raw[i].data);
+        ctx->sps_raw[i].size = ctx->sps_raw[i].alloc_size = 0;
+    }
+
+    for (int i = 0; i < EVC_MAX_PPS_COUNT; i++) {
+        av_buffer_unref(&ctx->pps_ref[i]);
+        ctx->pps[i] = NULL;
+        av_freep(&ctx->pps_raw[i].data);
+        ctx->pps_raw[i].size = ctx->pps_raw[i].alloc_size = 0;
+    }
+
+    for (int i = 0; i < EVC_NB_APS_TYPES; i++) {
+        for (int j = 0; j < EVC_MAX_APS_COUNT; j++) {
+            av_buffer_unref(&ctx->aps_ref[i][j]);
+            ctx->aps[i][j] = NULL;
+            av_freep(&ctx->aps_raw[i][j].data);
+            ctx->aps_raw[i][j].size = ctx->aps_raw[i][j].alloc_size = 0;
+        }
+    }
+}
+
 // @see ISO_IEC_23094-1 (7.3.2.1 SPS RBSP syntax)
 EVCParserSPS *ff_evc_parse_sps(EVCParserContext *ctx, const uint8_t *bs, int bs_size)
 {
@@ -194,12 +358,22 @@ EVCParserSPS *ff_evc_parse_sps(EVCParserContext *ctx, const uint8_t *bs, int bs_
     if (sps_seq_parameter_set_id >= EVC_MAX_SPS_COUNT)
         return NULL;
 
-    if(!ctx->sps[sps_seq_parameter_set_id]) {
-        if((ctx->sps[sps_seq_parameter_set_id] = av_malloc(sizeof(EVCParserSPS))) == NULL)
-            return NULL;
+    if (ctx->sps[sps_seq_parameter_set_id] &&
+        raw_ps_unchanged(&ctx->sps_raw[sps_seq_parameter_set_id], bs, bs_size))
+        return ctx->sps[sps_seq_parameter_set_id];
+    ctx->sps_raw[sps_seq_parameter_set_id].size = 0;
+
+    sps = shared_ps_get(&ctx->sps_ref[sps_seq_parameter_set_id], EVC_SPS_NUT, bs, bs_size);
+    if (sps) {
+        ctx->sps[sps_seq_parameter_set_id] = sps;
+        raw_ps_store(&ctx->sps_raw[sps_seq_parameter_set_id], bs, bs_size);
+        return sps;
     }
 
-    sps = ctx->sps[sps_seq_parameter_set_id];
+    sps = ctx->sps[sps_seq_parameter_set_id] = get_ps_buffer(&ctx->sps_ref[sps_seq_parameter_set_id],
+                                                             sizeof(EVCParserSPS));
+    if (!sps)
+        return NULL;
     sps->sps_seq_parameter_set_id = sps_seq_parameter_set_id;
 
     // the Baseline profile is indicated by profile_idc eqal to 0
@@ -270,11 +444,16 @@ EVCParserSPS *ff_evc_parse_sps(EVCParserContext *ctx, const uint8_t *bs, int bs_
     sps->sps_dquant_flag = get_bits(&gb, 1);
     sps->sps_dra_flag = get_bits(&gb, 1);
 
-    if (sps->sps_pocs_flag)
+    if (sps->sps_pocs_flag) {
         sps->log2_max_pic_order_cnt_lsb_minus4 = get_ue_golomb(&gb);
+        if (sps->log2_max_pic_order_cnt_lsb_minus4 > 12U)
+            return NULL;
+    }
 
     if (!sps->sps_pocs_flag || !sps->sps_rpl_flag) {
         sps->log2_sub_gop_length = get_ue_golomb(&gb);
+        if (sps->log2_sub_gop_length > 5U)
+            return NULL;
         if (sps->log2_sub_gop_length == 0)
             sps->log2_ref_pic_gap_length = get_ue_golomb(&gb);
     }
@@ -330,6 +509,15 @@ EVCParserSPS *ff_evc_parse_sps(EVCParserContext *ctx, const uint8_t *bs, int bs_
     // If necessary, add the missing fields to the EVCParserSPS structure
     // and then extend parser implementation
 
+    sps->MaxPicOrderCntLsb = 1 << (sps->log2_max_pic_order_cnt_lsb_minus4 + 4);
+    sps->SubGopLength      = 1 << sps->log2_sub_gop_length;
+    sps->delay = sps->sps_max_dec_pic_buffering_minus1 ? sps->sps_max_dec_pic_buffering_minus1 - 1 :
+                                                         sps->SubGopLength + sps->max_num_tid0_ref_pics - 1;
+
+    sps = ctx->sps[sps_seq_parameter_set_id] = shared_ps_add(&ctx->sps_ref[sps_seq_parameter_set_id],
+                                                             sizeof(*sps), EVC_SPS_NUT, bs, bs_size);
+    raw_ps_store(&ctx->sps_raw[sps_seq_parameter_set_id], bs, bs_size);
+
     return sps;
 }
 
@@ -351,15 +539,25 @@ EVCParserPPS *ff_evc_parse_pps(EVCParserContext *ctx, const uint8_t *bs, int bs_
         return NULL;
 
     pps_pic_parameter_set_id = get_ue_golomb(&gb);
-    if (pps_pic_parameter_set_id > EVC_MAX_PPS_COUNT)
+    if (pps_pic_parameter_set_id >= EVC_MAX_PPS_COUNT)
         return NULL;
 
-    if(!ctx->pps[pps_pic_parameter_set_id]) {
-        if((ctx->pps[pps_pic_parameter_set_id] = av_malloc(sizeof(EVCParserSPS))) == NULL)
-            return NULL;
+    if (ctx->pps[pps_pic_parameter_set_id] &&
+        raw_ps_unchanged(&ctx->pps_raw[pps_pic_parameter_set_id], bs, bs_size))
+        return ctx->pps[pps_pic_parameter_set_id];
+    ctx->pps_raw[pps_pic_parameter_set_id].size = 0;
+
+    pps = shared_ps_get(&ctx->pps_ref[pps_pic_parameter_set_id], EVC_PPS_NUT, bs, bs_size);
+    if (pps) {
+        ctx->pps[pps_pic_parameter_set_id] = pps;
+        raw_ps_store(&ctx->pps_raw[pps_pic_parameter_set_id], bs, bs_size);
+        return pps;
     }
 
-    pps = ctx->pps[pps_pic_parameter_set_id];
+    pps = ctx->pps[pps_pic_parameter_set_id] = get_ps_buffer(&ctx->pps_ref[pps_pic_parameter_set_id],
+                                                             sizeof(EVCParserPPS));
+    if (!pps)
+        return NULL;
 
     pps->pps_pic_parameter_set_id = pps_pic_parameter_set_id;
 
@@ -412,9 +610,53 @@ EVCParserPPS *ff_evc_parse_pps(EVCParserContext *ctx, const uint8_t *bs, int bs_
     if (pps->cu_qp_delta_enabled_flag)
         pps->log2_cu_qp_delta_area_minus6 = get_ue_golomb(&gb);
 
+    pps = ctx->pps[pps_pic_parameter_set_id] = shared_ps_add(&ctx->pps_ref[pps_pic_parameter_set_id],
+                                                             sizeof(*pps), EVC_PPS_NUT, bs, bs_size);
+    raw_ps_store(&ctx->pps_raw[pps_pic_parameter_set_id], bs, bs_size);
+
     return pps;
 }
 
+// @see ISO_IEC_23094-1 (7.3.2.3 APS RBSP syntax)
+int ff_evc_parse_aps(EVCParserContext *ctx, const uint8_t *bs, int bs_size)
+{
+    EVCParserAPS *aps;
+    int aps_adaptation_parameter_set_id, aps_params_type;
+    int payload_size = bs_size - 1;
+
+    if (bs_size < 1)
+        return AVERROR_INVALIDDATA;
+
+    // aps_adaptation_parameter_set_id u(5), aps_params_type u(3)
+    aps_adaptation_parameter_set_id = bs[0] >> 3;
+    aps_params_type                 = bs[0] & 7;
+    if (aps_params_type >= EVC_NB_APS_TYPES)
+        return 0;
+
+    if (ctx->aps[aps_params_type][aps_adaptation_parameter_set_id] &&
+        raw_ps_unchanged(&ctx->aps_raw[aps_params_type][aps_adaptation_parameter_set_id], bs, bs_size))
+        return 0;
+    ctx->aps_raw[aps_params_type][aps_adaptation_parameter_set_id].size = 0;
+
+    // the payload is stored right after the structure, in the same buffer
+    aps = ctx->aps[aps_params_type][aps_adaptation_parameter_set_id] =
+        get_ps_buffer(&ctx->aps_ref[aps_params_type][aps_adaptation_parameter_set_id],
+                      sizeof(EVCParserAPS) + payload_size + AV_INPUT_BUFFER_PADDING_SIZE);
+    if (!aps)
+        return AVERROR(ENOMEM);
+
+    aps->aps_adaptation_parameter_set_id = aps_adaptation_parameter_set_id;
+    aps->aps_params_type                 = aps_params_type;
+    aps->payload      = (uint8_t *)(aps + 1);
+    aps->payload_size = payload_size;
+    memcpy(aps + 1, bs + 1, payload_size);
+    memset((uint8_t *)(aps + 1) + payload_size, 0, AV_INPUT_BUFFER_PADDING_SIZE);
+
+    raw_ps_store(&ctx->aps_raw[aps_params_type][aps_adaptation_parameter_set_id], bs, bs_size);
+
+    return 0;
+}
+
 // @see ISO_IEC_23094-1 (7.3.2.6 Slice layer RBSP syntax)
 EVCParserSliceHeader *ff_evc_parse_slice_header(EVCParserContext *ctx, const uint8_t *bs, int bs_size)
 {
@@ -434,18 +676,13 @@ EVCParserSliceHeader *ff_evc_parse_slice_header(EVCParserContext *ctx, const uin
     if (slice_pic_parameter_set_id < 0 || slice_pic_parameter_set_id >= EVC_MAX_PPS_COUNT)
         return NULL;
 
-    if(!ctx->slice_header[slice_pic_parameter_set_id]) {
-        if((ctx->slice_header[slice_pic_parameter_set_id] = av_malloc(sizeof(EVCParserSliceHeader))) == NULL)
-            return NULL;
-    }
-
-    sh = ctx->slice_header[slice_pic_parameter_set_id];
+    sh = &ctx->slice_header;
 
     pps = ctx->pps[slice_pic_parameter_set_id];
     if(!pps)
         return NULL;
 
-    sps = ctx->sps[slice_pic_parameter_set_id];
+    sps = ctx->sps[pps->pps_seq_parameter_set_id];
     if(!sps)
         return NULL;
 
@@ -539,10 +776,230 @@ EVCParserSliceHeader *ff_evc_parse_slice_header(EVCParserContext *ctx, const uin
     return sh;
 }
 
-int ff_evc_parse_nal_unit(EVCParserContext *ctx, const uint8_t *buf, int buf_size, void *logctx)
+int ff_evc_derive_poc(EVCParserPoc *poc, const EVCParserSPS *sps,
+                      int slice_pic_order_cnt_lsb, int nalu_type, int tid,
+                      void *logctx)
+{
+    // POC (picture order count of the current picture) derivation
+    // @see ISO/IEC 23094-1:2020(E) 8.3.1 Decoding process for picture order count
+
+    if (sps && sps->sps_pocs_flag) {
+
+        int PicOrderCntMsb = 0;
+        poc->prevPicOrderCntVal = poc->PicOrderCntVal;
+
+        if (nalu_type == EVC_IDR_NUT)
+            PicOrderCntMsb = 0;
+        else {
+            int MaxPicOrderCntLsb = sps->MaxPicOrderCntLsb;
+
+            int prevPicOrderCntLsb = poc->PicOrderCntVal & (MaxPicOrderCntLsb - 1);
+            int prevPicOrderCntMsb = poc->PicOrderCntVal - prevPicOrderCntLsb;
+
+
+            if ((slice_pic_order_cnt_lsb < prevPicOrderCntLsb) &&
+                ((prevPicOrderCntLsb - slice_pic_order_cnt_lsb) >= (MaxPicOrderCntLsb / 2)))
+
+                PicOrderCntMsb = prevPicOrderCntMsb + MaxPicOrderCntLsb;
+
+            else if ((slice_pic_order_cnt_lsb > prevPicOrderCntLsb) &&
+                     ((slice_pic_order_cnt_lsb - prevPicOrderCntLsb) > (MaxPicOrderCntLsb / 2)))
+
+                PicOrderCntMsb = prevPicOrderCntMsb - MaxPicOrderCntLsb;
+
+            else
+                PicOrderCntMsb = prevPicOrderCntMsb;
+        }
+        poc->PicOrderCntVal = PicOrderCntMsb + slice_pic_order_cnt_lsb;
+
+    } else {
+        if (nalu_type == EVC_IDR_NUT) {
+            poc->PicOrderCntVal = 0;
+            poc->prevPicOrderCntVal = 0;
+            poc->DocOffset = -1;
+        } else if (!sps) {
+            return AVERROR_INVALIDDATA;
+        } else {
+            int SubGopLength = sps->SubGopLength;
+            if (tid == 0) {
+                poc->PicOrderCntVal = poc->prevPicOrderCntVal + SubGopLength;
+                poc->DocOffset = 0;
+                poc->prevPicOrderCntVal = poc->PicOrderCntVal;
+            } else {
+                int ExpectedTemporalId;
+                int PocOffset;
+                int prevDocOffset = poc->DocOffset;
+
+                // TemporalId cycles through 0..log2_sub_gop_length within a sub-GOP
+                if (tid > sps->log2_sub_gop_length) {
+                    av_log(logctx, AV_LOG_ERROR, "Invalid temporal id %d for sub-GOP length %d\n",
+                           tid, SubGopLength);
+                    return AVERROR_INVALIDDATA;
+                }
+
+                poc->DocOffset = (prevDocOffset + 1) % SubGopLength;
+                if (poc->DocOffset == 0) {
+                    poc->prevPicOrderCntVal += SubGopLength;
+                    ExpectedTemporalId = 0;
+                } else
+                    ExpectedTemporalId = 1 + av_log2(poc->DocOffset);
+                while (tid != ExpectedTemporalId) {
+                    poc->DocOffset = (poc->DocOffset + 1) % SubGopLength;
+                    if (poc->DocOffset == 0)
+                        ExpectedTemporalId = 0;
+                    else
+                        ExpectedTemporalId = 1 + av_log2(poc->DocOffset);
+                }
+                PocOffset = ((SubGopLength * (2 * poc->DocOffset + 1)) >> tid) - 2 * SubGopLength;
+                poc->PicOrderCntVal = poc->prevPicOrderCntVal + PocOffset;
+            }
+        }
+    }
+
+    return 0;
+}
+
+void ff_evc_sei_reset(EVCParserSEI *sei)
+{
+    sei->has_mastering_display = 0;
+    sei->has_content_light     = 0;
+    sei->has_recovery_point    = 0;
+    av_buffer_unref(&sei->a53_caption);
+}
+
+// @see ITU-T H.274 (8.28 Mastering display colour volume)
+static int parse_sei_mastering_display(EVCParserSEI *sei, GetByteContext *gb)
+{
+    AVMasteringDisplayMetadata *mdm = &sei->mastering_display;
+    // the primaries are coded in G, B, R order
+    static const int mapping[3] = { 1, 2, 0 };
+    const int chroma_den = 50000;
+    const int luma_den   = 10000;
+
+    if (bytestream2_get_bytes_left(gb) < 24)
+        return AVERROR_INVALIDDATA;
+
+    for (int i = 0; i < 3; i++) {
+        const int j = mapping[i];
+        mdm->display_primaries[j][0] = av_make_q(bytestream2_get_be16u(gb), chroma_den);
+        mdm->display_primaries[j][1] = av_make_q(bytestream2_get_be16u(gb), chroma_den);
+    }
+    mdm->white_point[0] = av_make_q(bytestream2_get_be16u(gb), chroma_den);
+    mdm->white_point[1] = av_make_q(bytestream2_get_be16u(gb), chroma_den);
+    mdm->max_luminance  = av_make_q(bytestream2_get_be32u(gb), luma_den);
+    mdm->min_luminance  = av_make_q(bytestream2_get_be32u(gb), luma_den);
+    mdm->has_primaries  = 1;
+    mdm->has_luminance  = 1;
+
+    sei->has_mastering_display = 1;
+    return 0;
+}
+
+// @see ITU-T H.274 (8.29 Content light level information)
+static int parse_sei_content_light(EVCParserSEI *sei, GetByteContext *gb)
+{
+    if (bytestream2_get_bytes_left(gb) < 4)
+        return AVERROR_INVALIDDATA;
+
+    sei->content_light.MaxCLL  = bytestream2_get_be16u(gb);
+    sei->content_light.MaxFALL = bytestream2_get_be16u(gb);
+
+    sei->has_content_light = 1;
+    return 0;
+}
+
+// @see ISO_IEC_23094-1 (Annex D, recovery point SEI message)
+static int parse_sei_recovery_point(EVCParserSEI *sei, GetByteContext *gb)
+{
+    GetBitContext bits;
+    int ret = init_get_bits8(&bits, gb->buffer, bytestream2_get_bytes_left(gb));
+
+    if (ret < 0)
+        return ret;
+
+    sei->recovery_poc_cnt = get_se_golomb_long(&bits);
+    // exact_match_flag and broken_link_flag are not needed
+    if (get_bits_left(&bits) < 2)
+        return AVERROR_INVALIDDATA;
+
+    sei->has_recovery_point = 1;
+    return 0;
+}
+
+// Only the ATSC A53 Part 4 closed captions are looked for.
+static int parse_sei_registered_user_data(EVCParserSEI *sei, GetByteContext *gb)
+{
+    int country_code, provider_code;
+
+    if (bytestream2_get_bytes_left(gb) < 7)
+        return AVERROR_INVALIDDATA;
+
+    country_code = bytestream2_get_byteu(gb); // itu_t_t35_country_code
+    if (country_code == 0xFF)
+        bytestream2_skipu(gb, 1);             // itu_t_t35_country_code_extension_byte
+    provider_code = bytestream2_get_be16u(gb);
+
+    if (country_code != 0xB5 || provider_code != 0x31 ||
+        bytestream2_get_be32(gb) != MKBETAG('G', 'A', '9', '4'))
+        return 0;
+
+    return ff_parse_a53_cc(&sei->a53_caption, gb->buffer,
+                           bytestream2_get_bytes_left(gb));
+}
+
+// @see ISO_IEC_23094-1 (7.3.2.7 SEI RBSP syntax)
+static int parse_sei(EVCParserSEI *sei, const uint8_t *data, int data_size)
+{
+    GetByteContext gb;
+
+    bytestream2_init(&gb, data, data_size);
+
+    // the smallest message and the rbsp_trailing_bits take 3 bytes
+    while (bytestream2_get_bytes_left(&gb) >= 3) {
+        GetByteContext payload;
+        int payload_type = 0, payload_size = 0, byte, ret;
+
+        do {
+            byte = bytestream2_get_byte(&gb);
+            payload_type += byte;
+        } while (byte == 0xFF);
+        do {
+            byte = bytestream2_get_byte(&gb);
+            payload_size += byte;
+        } while (byte == 0xFF);
+
+        if (payload_size > bytestream2_get_bytes_left(&gb))
+            return AVERROR_INVALIDDATA;
+        bytestream2_init(&payload, gb.buffer, payload_size);
+        bytestream2_skipu(&gb, payload_size);
+
+        switch (payload_type) {
+        case SEI_TYPE_MASTERING_DISPLAY_COLOUR_VOLUME:
+            ret = parse_sei_mastering_display(sei, &payload);
+            break;
+        case SEI_TYPE_CONTENT_LIGHT_LEVEL_INFO:
+            ret = parse_sei_content_light(sei, &payload);
+            break;
+        case SEI_TYPE_USER_DATA_REGISTERED_ITU_T_T35:
+            ret = parse_sei_registered_user_data(sei, &payload);
+            break;
+        case SEI_TYPE_RECOVERY_POINT:
+            ret = parse_sei_recovery_point(sei, &payload);
+            break;
+        default:
+            ret = 0;
+        }
+        if (ret < 0)
+            return ret;
+    }
+
+    return 0;
+}
+
+static int parse_nal_unit(EVCParserContext *ctx, const uint8_t *buf, int buf_size, int au_only, void *logctx)
 {
     int nalu_type, nalu_size;
-    int tid;
+    int tid, ret;
     const uint8_t *data = buf;
     int data_size = buf_size;
 
@@ -577,10 +1034,9 @@ int ff_evc_parse_nal_unit(EVCParserContext *ctx, const uint8_t *buf, int buf_siz
     switch(nalu_type) {
     case EVC_SPS_NUT: {
         EVCParserSPS *sps;
-        int SubGopLength;
         int bit_depth;
 
-        sps = ff_evc_parse_sps(ctx, data, nalu_size);
+        sps = ff_evc_parse_sps(ctx, data, data_size);
         if (!sps) {
             av_log(logctx, AV_LOG_ERROR, "SPS parsing error\n");
             return AVERROR_INVALIDDATA;
@@ -597,10 +1053,8 @@ int ff_evc_parse_nal_unit(EVCParserContext *ctx, const uint8_t *buf, int buf_siz
             ctx->height          = sps->pic_height_in_luma_samples;
         }
 
-        SubGopLength = (int)pow(2.0, sps->log2_sub_gop_length);
-        ctx->gop_size = SubGopLength;
-
-        ctx->delay = (sps->sps_max_dec_pic_buffering_minus1) ? sps->sps_max_dec_pic_buffering_minus1 - 1 : SubGopLength + sps->max_num_tid0_ref_pics - 1;
+        ctx->gop_size = sps->SubGopLength;
+        ctx->delay    = sps->delay;
 
         if (sps->profile_idc == 1) ctx->profile = FF_PROFILE_EVC_MAIN;
         else ctx->profile = FF_PROFILE_EVC_BASELINE;
@@ -614,6 +1068,37 @@ int ff_evc_parse_nal_unit(EVCParserContext *ctx, const uint8_t *buf, int buf_siz
             }
         }
 
+        ctx->sample_aspect_ratio    = (AVRational){ 0, 1 };
+        ctx->color_primaries        = AVCOL_PRI_UNSPECIFIED;
+        ctx->color_trc              = AVCOL_TRC_UNSPECIFIED;
+        ctx->colorspace             = AVCOL_SPC_UNSPECIFIED;
+        ctx->color_range            = AVCOL_RANGE_UNSPECIFIED;
+        ctx->chroma_sample_location = AVCHROMA_LOC_UNSPECIFIED;
+
+        if (sps->vui_parameters_present_flag) {
+            const VUIParameters *vui = &sps->vui_parameters;
+
+            if (vui->aspect_ratio_info_present_flag) {
+                if (vui->aspect_ratio_idc == EXTENDED_SAR)
+                    ctx->sample_aspect_ratio = (AVRational){ vui->sar_width, vui->sar_height };
+                else if (vui->aspect_ratio_idc < FF_ARRAY_ELEMS(ff_h2645_pixel_aspect))
+                    ctx->sample_aspect_ratio = ff_h2645_pixel_aspect[vui->aspect_ratio_idc];
+            }
+
+            if (vui->video_signal_type_present_flag) {
+                ctx->color_range = vui->video_full_range_flag ? AVCOL_RANGE_JPEG : AVCOL_RANGE_MPEG;
+
+                if (vui->colour_description_present_flag) {
+                    ctx->color_primaries = vui->colour_primaries;
+                    ctx->color_trc       = vui->transfer_characteristics;
+                    ctx->colorspace      = vui->matrix_coefficients;
+                }
+            }
+
+            if (vui->chroma_loc_info_present_flag && vui->chroma_sample_loc_type_top_field <= AVCHROMA_LOC_BOTTOM - 1)
+                ctx->chroma_sample_location = vui->chroma_sample_loc_type_top_field + 1;
+        }
+
         bit_depth = sps->bit_depth_chroma_minus8 + 8;
         ctx->format = AV_PIX_FMT_NONE;
 
@@ -644,7 +1129,7 @@ int ff_evc_parse_nal_unit(EVCParserContext *ctx, const uint8_t *buf, int buf_siz
     case EVC_PPS_NUT: {
         EVCParserPPS *pps;
 
-        pps = ff_evc_parse_pps(ctx, data, nalu_size);
+        pps = ff_evc_parse_pps(ctx, data, data_size);
         if (!pps) {
             av_log(logctx, AV_LOG_ERROR, "PPS parsing error\n");
             return AVERROR_INVALIDDATA;
@@ -652,116 +1137,172 @@ int ff_evc_parse_nal_unit(EVCParserContext *ctx, const uint8_t *buf, int buf_siz
         break;
     }
     case EVC_SEI_NUT:   // Supplemental Enhancement Information
+        // the SEI messages are not needed to parse the rest of the stream, a broken one is skipped
+        ret = parse_sei(&ctx->sei, data, data_size);
+        if (ret == AVERROR(ENOMEM))
+            return ret;
+        if (ret < 0)
+            av_log(logctx, AV_LOG_WARNING, "SEI parsing error\n");
+        break;
     case EVC_APS_NUT:   // Adaptation parameter set
+        ret = ff_evc_parse_aps(ctx, data, data_size);
+        if (ret < 0) {
+            av_log(logctx, AV_LOG_ERROR, "APS parsing error\n");
+            return ret;
+        }
+        break;
     case EVC_FD_NUT:    // Filler data
         break;
     case EVC_IDR_NUT:   // Coded slice of a IDR or non-IDR picture
     case EVC_NOIDR_NUT: {
-        EVCParserSliceHeader *sh;
-        EVCParserSPS *sps;
+        EVCParserSliceHeader *sh = NULL;
+        EVCParserSPS *sps = NULL;
         int slice_pic_parameter_set_id;
 
-        sh = ff_evc_parse_slice_header(ctx, data, nalu_size);
-        if (!sh) {
-            av_log(logctx, AV_LOG_ERROR, "Slice header parsing error\n");
-            return AVERROR_INVALIDDATA;
-        }
+        // Without POC LSBs in the slice headers, the POC is derived from the NAL unit header alone
+        if (au_only) {
+            GetBitContext gb;
 
-        switch (sh->slice_type) {
-        case EVC_SLICE_TYPE_B: {
-            ctx->pict_type =  AV_PICTURE_TYPE_B;
-            break;
-        }
-        case EVC_SLICE_TYPE_P: {
-            ctx->pict_type =  AV_PICTURE_TYPE_P;
-            break;
-        }
-        case EVC_SLICE_TYPE_I: {
-            ctx->pict_type =  AV_PICTURE_TYPE_I;
-            break;
-        }
-        default: {
-            ctx->pict_type =  AV_PICTURE_TYPE_NONE;
-        }
+            if (init_get_bits8(&gb, data, data_size) < 0)
+                return AVERROR_INVALIDDATA;
+            slice_pic_parameter_set_id = get_ue_golomb(&gb);
+            if (slice_pic_parameter_set_id >= 0 && slice_pic_parameter_set_id < EVC_MAX_PPS_COUNT &&
+                ctx->pps[slice_pic_parameter_set_id])
+                sps = ctx->sps[ctx->pps[slice_pic_parameter_set_id]->pps_seq_parameter_set_id];
         }
 
-        ctx->key_frame = (nalu_type == EVC_IDR_NUT) ? 1 : 0;
+        if (!sps || sps->sps_pocs_flag) {
+            sh = ff_evc_parse_slice_header(ctx, data, data_size);
+            if (!sh) {
+                av_log(logctx, AV_LOG_ERROR, "Slice header parsing error\n");
+                return AVERROR_INVALIDDATA;
+            }
 
-        // POC (picture order count of the current picture) derivation
-        // @see ISO/IEC 23094-1:2020(E) 8.3.1 Decoding process for picture order count
-        slice_pic_parameter_set_id = sh->slice_pic_parameter_set_id;
-        sps = ctx->sps[slice_pic_parameter_set_id];
+            switch (sh->slice_type) {
+            case EVC_SLICE_TYPE_B: {
+                ctx->pict_type =  AV_PICTURE_TYPE_B;
+                break;
+            }
+            case EVC_SLICE_TYPE_P: {
+                ctx->pict_type =  AV_PICTURE_TYPE_P;
+                break;
+            }
+            case EVC_SLICE_TYPE_I: {
+                ctx->pict_type =  AV_PICTURE_TYPE_I;
+                break;
+            }
+            default: {
+                ctx->pict_type =  AV_PICTURE_TYPE_NONE;
+            }
+            }
 
-        if (sps && sps->sps_pocs_flag) {
+            slice_pic_parameter_set_id = sh->slice_pic_parameter_set_id;
+            sps = ctx->sps[ctx->pps[slice_pic_parameter_set_id]->pps_seq_parameter_set_id];
+        } else
+            ctx->pict_type = AV_PICTURE_TYPE_NONE;
 
-            int PicOrderCntMsb = 0;
-            ctx->poc.prevPicOrderCntVal = ctx->poc.PicOrderCntVal;
+        ret = ff_evc_derive_poc(&ctx->poc, sps, sh ? sh->slice_pic_order_cnt_lsb : 0,
+                                nalu_type, tid, logctx);
+        if (ret < 0)
+            return ret;
 
-            if (nalu_type == EVC_IDR_NUT)
-                PicOrderCntMsb = 0;
-            else {
-                int MaxPicOrderCntLsb = 1 << (sps->log2_max_pic_order_cnt_lsb_minus4 + 4);
+        ctx->output_picture_number = ctx->poc.PicOrderCntVal;
+        // decoding can also start at a picture with a recovery point SEI, such as an intra
+        // picture of an open GOP or the start of a gradual decoding refresh
+        ctx->key_frame = nalu_type == EVC_IDR_NUT || ctx->sei.has_recovery_point;
+        ctx->discardable = sps && !sps->sps_rpl_flag && tid && tid == sps->log2_sub_gop_length;
 
-                int prevPicOrderCntLsb = ctx->poc.PicOrderCntVal & (MaxPicOrderCntLsb - 1);
-                int prevPicOrderCntMsb = ctx->poc.PicOrderCntVal - prevPicOrderCntLsb;
+        break;
+    }
+    }
 
+    return 0;
+}
 
-                if ((sh->slice_pic_order_cnt_lsb < prevPicOrderCntLsb) &&
-                    ((prevPicOrderCntLsb - sh->slice_pic_order_cnt_lsb) >= (MaxPicOrderCntLsb / 2)))
+int ff_evc_parse_nal_unit(EVCParserContext *ctx, const uint8_t *buf, int buf_size, void *logctx)
+{
+    return parse_nal_unit(ctx, buf, buf_size, 0, logctx);
+}
 
-                    PicOrderCntMsb = prevPicOrderCntMsb + MaxPicOrderCntLsb;
+int ff_evc_parse_nal_unit_au(EVCParserContext *ctx, const uint8_t *buf, int buf_size, void *logctx)
+{
+    return parse_nal_unit(ctx, buf, buf_size, 1, logctx);
+}
 
-                else if ((sh->slice_pic_order_cnt_lsb > prevPicOrderCntLsb) &&
-                         ((sh->slice_pic_order_cnt_lsb - prevPicOrderCntLsb) > (MaxPicOrderCntLsb / 2)))
+// Walking nal units from evcC (EVCDecoderConfigurationRecord)
+// @see @see ISO/IEC 14496-15:2021 Coding of audio-visual objects - Part 15: section 12.3.3.2
+int ff_evc_walk_extradata(const uint8_t *data, int size,
+                          int (*cb)(void *opaque, int nal_unit_type, const uint8_t *nalu, int nalu_size, void *logctx),
+                          void *opaque, void *logctx)
+{
+    int ret = 0;
+    GetByteContext gb;
 
-                    PicOrderCntMsb = prevPicOrderCntMsb - MaxPicOrderCntLsb;
+    bytestream2_init(&gb, data, size);
 
-                else
-                    PicOrderCntMsb = prevPicOrderCntMsb;
-            }
-            ctx->poc.PicOrderCntVal = PicOrderCntMsb + sh->slice_pic_order_cnt_lsb;
+    if (!data || size <= 0)
+        return AVERROR_INVALIDDATA;
 
-        } else {
-            if (nalu_type == EVC_IDR_NUT) {
-                ctx->poc.PicOrderCntVal = 0;
-                ctx->poc.DocOffset = -1;
-            } else {
-                int SubGopLength = (int)pow(2.0, sps->log2_sub_gop_length);
-                if (tid == 0) {
-                    ctx->poc.PicOrderCntVal = ctx->poc.prevPicOrderCntVal + SubGopLength;
-                    ctx->poc.DocOffset = 0;
-                    ctx->poc.prevPicOrderCntVal = ctx->poc.PicOrderCntVal;
-                } else {
-                    int ExpectedTemporalId;
-                    int PocOffset;
-                    int prevDocOffset = ctx->poc.DocOffset;
-
-                    ctx->poc.DocOffset = (prevDocOffset + 1) % SubGopLength;
-                    if (ctx->poc.DocOffset == 0) {
-                        ctx->poc.prevPicOrderCntVal += SubGopLength;
-                        ExpectedTemporalId = 0;
-                    } else
-                        ExpectedTemporalId = 1 + (int)log2(ctx->poc.DocOffset);
-                    while (tid != ExpectedTemporalId) {
-                        ctx->poc.DocOffset = (ctx->poc.DocOffset + 1) % SubGopLength;
-                        if (ctx->poc.DocOffset == 0)
-                            ExpectedTemporalId = 0;
-                        else
-                            ExpectedTemporalId = 1 + (int)log2(ctx->poc.DocOffset);
-                    }
-                    PocOffset = (int)(SubGopLength * ((2.0 * ctx->poc.DocOffset + 1) / (int)pow(2.0, tid) - 2));
-                    ctx->poc.PicOrderCntVal = ctx->poc.prevPicOrderCntVal + PocOffset;
-                }
-            }
+    // extradata is encoded as evcC format.
+    if (data[0] == 1) {
+        int num_of_arrays;  // indicates the number of arrays of NAL units of the indicated type(s)
+
+        int nalu_length_field_size; // indicates the length in bytes of the NALUnitLenght field in EVC video stream sample in the stream
+        // The value of this field shall be one of 0, 1, or 3 corresponding to a length encoded with 1, 2, or 4 bytes, respectively.
+
+        if (bytestream2_get_bytes_left(&gb) < 18) {
+            av_log(logctx, AV_LOG_ERROR, "evcC %d too short\n", size);
+            return AVERROR_INVALIDDATA;
         }
 
-        ctx->output_picture_number = ctx->poc.PicOrderCntVal;
-        ctx->key_frame = (nalu_type == EVC_IDR_NUT) ? 1 : 0;
+        bytestream2_skip(&gb, 16);
 
-        break;
-    }
-    }
+        // @see ISO/IEC 14496-15:2021 Coding of audio-visual objects - Part 15: section 12.3.3.3
+        // LengthSizeMinusOne plus 1 indicates the length in bytes of the NALUnitLength field in a EVC video stream sample in the stream to which this configuration record applies. For example, a size of one byte is indicated with a value of 0.
+        // The value of this field shall be one of 0, 1, or 3 corresponding to a length encoded with 1, 2, or 4 bytes, respectively.
+        nalu_length_field_size = (bytestream2_get_byte(&gb) & 3) + 1;
+        if( nalu_length_field_size != 1 &&
+            nalu_length_field_size != 2 &&
+            nalu_length_field_size != 4 ) {
+            av_log(logctx, AV_LOG_ERROR, "The length in bytes of the NALUnitLenght field in a EVC video stream has unsupported value of %d\n", nalu_length_field_size);
+            return AVERROR_INVALIDDATA;
+        }
 
-    return 0;
-}
+        num_of_arrays = bytestream2_get_byte(&gb);
 
+        /* Decode nal units from evcC. */
+        for (int i = 0; i < num_of_arrays; i++) {
+
+            // @see ISO/IEC 14496-15:2021 Coding of audio-visual objects - Part 15: section 12.3.3.3
+            // NAL_unit_type indicates the type of the NAL units in the following array (which shall be all of that type);
+            // - it takes a value as defined in ISO/IEC 23094-1;
+            // - it is restricted to take one of the values indicating a SPS, PPS, APS, or SEI NAL unit.
+            int nal_unit_type = bytestream2_get_byte(&gb) & 0x3f;
+            int num_nalus  = bytestream2_get_be16(&gb);
+
+            for (int j = 0; j < num_nalus; j++) {
+
+                int nal_unit_length = bytestream2_get_be16(&gb);
+
+                if (bytestream2_get_bytes_left(&gb) < nal_unit_length) {
+                    av_log(logctx, AV_LOG_ERROR, "Invalid NAL unit size in extradata.\n");
+                    return AVERROR_INVALIDDATA;
+                }
+
+                if( nal_unit_type == EVC_SPS_NUT ||
+                    nal_unit_type == EVC_PPS_NUT ||
+                    nal_unit_type == EVC_APS_NUT ||
+                    nal_unit_type == EVC_SEI_NUT ) {
+                    ret = cb(opaque, nal_unit_type, gb.buffer, nal_unit_length, logctx);
+                    if (ret < 0)
+                        return ret;
+                }
+
+                bytestream2_skip(&gb, nal_unit_length);
+            }
+        }
+    } else
+        return AVERROR_INVALIDDATA;
+
+    return ret;
+}
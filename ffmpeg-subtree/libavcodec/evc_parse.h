@@ -24,7 +24,17 @@
 #ifndef AVCODEC_EVC_PARSE_H
 #define AVCODEC_EVC_PARSE_H
 
-#define EVC_MAX_QP_TABLE_SIZE   58
+#include <stdint.h>
+
+#include "libavutil/buffer.h"
+#include "libavutil/intreadwrite.h"
+#include "libavutil/log.h"
+#include "libavutil/mastering_display_metadata.h"
+#include "libavutil/pixfmt.h"
+#include "libavutil/rational.h"
+
+#include "evc.h"
+
 #define NUM_CPB                 32
 
 // rpl structure
@@ -180,6 +190,10 @@ typedef struct EVCParserSPS {
 
     struct VUIParameters vui_parameters;
 
+    // Values derived from the syntax elements above, computed once per SPS
+    int MaxPicOrderCntLsb;
+    int SubGopLength;
+    int delay;                          // number of frames of reordering delay
 } EVCParserSPS;
 
 typedef struct EVCParserPPS {
@@ -208,6 +222,21 @@ typedef struct EVCParserPPS {
 
 } EVCParserPPS;
 
+// The structure reflects the header of the APS RBSP(raw byte sequence payload) layout
+// @see ISO_IEC_23094-1 section 7.3.2.3
+//
+// alf_data() and dra_data() are kept as they are, for the ALF and DRA implementations to parse.
+// A repeated APS is not stored again, so an unchanged payload keeps its address.
+typedef struct EVCParserAPS {
+    int aps_adaptation_parameter_set_id;    // u(5)
+    int aps_params_type;                    // u(3)
+
+    // alf_data() or dra_data() and the rest of the RBSP, starting at the byte following
+    // aps_params_type, followed by AV_INPUT_BUFFER_PADDING_SIZE zeroed bytes
+    const uint8_t *payload;
+    int payload_size;
+} EVCParserAPS;
+
 // The sturcture reflects Slice Header RBSP(raw byte sequence payload) layout
 // @see ISO_IEC_23094-1 section 7.3.2.6
 //
@@ -250,6 +279,22 @@ typedef struct EVCParserSliceHeader {
 
 } EVCParserSliceHeader;
 
+// SEI messages found since the last call to ff_evc_sei_reset(), normally those of an access unit
+typedef struct EVCParserSEI {
+    int has_mastering_display;
+    AVMasteringDisplayMetadata mastering_display;
+
+    int has_content_light;
+    AVContentLightMetadata content_light;
+
+    // ATSC A53 Part 4 closed captions (cc_data), NULL if none
+    AVBufferRef *a53_caption;
+
+    // the pictures are correct in output order from the POC of the picture plus recovery_poc_cnt
+    int has_recovery_point;
+    int recovery_poc_cnt;
+} EVCParserSEI;
+
 // picture order count of the current picture
 typedef struct EVCParserPoc {
     int PicOrderCntVal;     // current picture order count value
@@ -257,14 +302,36 @@ typedef struct EVCParserPoc {
     int DocOffset;          // the decoding order count of the previous picture
 } EVCParserPoc;
 
+// raw payload of the last parameter set parsed for a given id
+typedef struct EVCParserRawPS {
+    uint8_t *data;
+    int size;               // 0 if the parameter set has to be parsed again
+    unsigned int alloc_size;
+} EVCParserRawPS;
+
 typedef struct EVCParserContext {
     //ParseContext pc;
+    // Parameter sets are refcounted, so other consumers can keep a reference to them.
+    // sps[i] and pps[i] point to the data of the corresponding buffer, or are NULL.
+    // The SPS and PPS are shared with the other contexts that parsed the same payload
+    // and are read-only.
+    AVBufferRef *sps_ref[EVC_MAX_SPS_COUNT];
+    AVBufferRef *pps_ref[EVC_MAX_PPS_COUNT];
     EVCParserSPS *sps[EVC_MAX_SPS_COUNT];
     EVCParserPPS *pps[EVC_MAX_PPS_COUNT];
-    EVCParserSliceHeader *slice_header[EVC_MAX_PPS_COUNT];
+    EVCParserRawPS sps_raw[EVC_MAX_SPS_COUNT];
+    EVCParserRawPS pps_raw[EVC_MAX_PPS_COUNT];
+    // APS table indexed by aps_params_type, then aps_adaptation_parameter_set_id,
+    // the latest APS of each id, referenced by the slice headers and PPS
+    AVBufferRef *aps_ref[EVC_NB_APS_TYPES][EVC_MAX_APS_COUNT];
+    EVCParserAPS *aps[EVC_NB_APS_TYPES][EVC_MAX_APS_COUNT];
+    EVCParserRawPS aps_raw[EVC_NB_APS_TYPES][EVC_MAX_APS_COUNT];
+    EVCParserSliceHeader slice_header; // header of the last parsed slice
 
     EVCParserPoc poc;
 
+    EVCParserSEI sei;
+
     int nuh_temporal_id;            // the value of TemporalId (shall be the same for all VCL NAL units of an Access Unit)
     int nalu_type;                  // the current NALU type
 
@@ -282,9 +349,14 @@ typedef struct EVCParserContext {
     // AV_PICTURE_TYPE_I, EVC_SLICE_TYPE_P, AV_PICTURE_TYPE_B
     int pict_type;
 
-    // Set by parser to 1 for key frames and 0 for non-key frames
+    // Set by parser to 1 for random access points, IDR pictures and pictures with a recovery point SEI, 0 otherwise
     int key_frame;
 
+    // Set to 1 if the current picture is known not to be used for reference by any other picture.
+    // Without reference picture lists, the highest TemporalId of a hierarchical sub-GOP is never
+    // referenced; with them, this cannot be told from the picture alone and it remains 0.
+    int discardable;
+
     // Picture number incremented in presentation or output order.
     // This corresponds to EVCEVCParserPoc::PicOrderCntVal
     int output_picture_number;
@@ -297,6 +369,14 @@ typedef struct EVCParserContext {
     // Framerate value in the compressed bitstream
     AVRational framerate;
 
+    // VUI values of the last SPS, unspecified if not signaled
+    AVRational sample_aspect_ratio;
+    enum AVColorPrimaries color_primaries;
+    enum AVColorTransferCharacteristic color_trc;
+    enum AVColorSpace colorspace;
+    enum AVColorRange color_range;
+    enum AVChromaLocation chroma_sample_location;
+
     // Number of pictures in a group of pictures
     int gop_size;
 
@@ -309,35 +389,22 @@ typedef struct EVCParserContext {
 
 static inline int av_evc_get_nalu_type(const uint8_t *bits, int bits_size, void *logctx)
 {
-    int unit_type_plus1 = 0;
-
-    if (bits_size >= EVC_NALU_HEADER_SIZE) {
-        unsigned char *p = (unsigned char *)bits;
-        // forbidden_zero_bit
-        if ((p[0] & 0x80) != 0) {
-            av_log(logctx, AV_LOG_ERROR, "Invalid NAL unit header\n");
-            return -1;
-        }
-
-        // nal_unit_type
-        unit_type_plus1 = (p[0] >> 1) & 0x3F;
+    if (bits_size >= EVC_NALU_HEADER_SIZE && bits[0] & 0x80) {
+        av_log(logctx, AV_LOG_ERROR, "Invalid NAL unit header\n");
+        return -1;
     }
 
-    return unit_type_plus1 - 1;
+    return ff_evc_nal_unit_type(bits, bits_size);
 }
 
 static inline uint32_t av_evc_read_nal_unit_length(const uint8_t *bits, int bits_size, void *logctx)
 {
-    uint32_t nalu_len = 0;
-
     if (bits_size < EVC_NALU_LENGTH_PREFIX_SIZE) {
         av_log(logctx, AV_LOG_ERROR, "Can't read NAL unit length\n");
         return 0;
     }
 
-    nalu_len = AV_RB32(bits);
-
-    return nalu_len;
+    return ff_evc_nal_unit_length(bits, bits_size);
 }
 
 // nuh_temporal_id specifies a temporal identifier for the NAL unit
@@ -349,9 +416,43 @@ EVCParserSPS *ff_evc_parse_sps(EVCParserContext *ctx, const uint8_t *bs, int bs_
 // @see ISO_IEC_23094-1 (7.3.2.2 SPS RBSP syntax)
 EVCParserPPS *ff_evc_parse_pps(EVCParserContext *ctx, const uint8_t *bs, int bs_size);
 
+// @see ISO_IEC_23094-1 (7.3.2.3 APS RBSP syntax)
+// Stores the APS in the table, the reserved aps_params_type values are ignored; returns 0 or an AVERROR code
+int ff_evc_parse_aps(EVCParserContext *ctx, const uint8_t *bs, int bs_size);
+
 // @see ISO_IEC_23094-1 (7.3.2.6 Slice layer RBSP syntax)
 EVCParserSliceHeader *ff_evc_parse_slice_header(EVCParserContext *ctx, const uint8_t *bs, int bs_size);
 
 int ff_evc_parse_nal_unit(EVCParserContext *ctx, const uint8_t *buf, int buf_size, void *logctx);
 
+// @see ISO/IEC 23094-1:2020(E) 8.3.1 Decoding process for picture order count
+// Updates poc for a slice of the given NAL unit type and TemporalId; sps may only be NULL for IDR pictures.
+int ff_evc_derive_poc(EVCParserPoc *poc, const EVCParserSPS *sps,
+                      int slice_pic_order_cnt_lsb, int nalu_type, int tid,
+                      void *logctx);
+
+/**
+ * Parse a NAL unit only as far as needed to find access unit boundaries and key frames
+ *
+ * The NAL unit type, TemporalId, POC and SPS/PPS derived fields are updated as with ff_evc_parse_nal_unit().
+ * Slice headers are only parsed if they carry POC LSBs, pict_type is AV_PICTURE_TYPE_NONE otherwise.
+ */
+int ff_evc_parse_nal_unit_au(EVCParserContext *ctx, const uint8_t *buf, int buf_size, void *logctx);
+
+// release the parameter sets held by the context
+void ff_evc_ps_uninit(EVCParserContext *ctx);
+
+// forget the SEI messages parsed so far, after they were exported
+void ff_evc_sei_reset(EVCParserSEI *sei);
+
+/**
+ * Walk the NAL units stored in evcC (EVCDecoderConfigurationRecord) extradata
+ *
+ * @param cb called for every SPS, PPS, APS and SEI NAL unit found, the walk stops if it returns a negative value
+ * @return 0 on success, negative value on failure or if the extradata is not in evcC format
+ */
+int ff_evc_walk_extradata(const uint8_t *data, int size,
+                          int (*cb)(void *opaque, int nal_unit_type, const uint8_t *nalu, int nalu_size, void *logctx),
+                          void *opaque, void *logctx);
+
 #endif /* AVCODEC_EVC_PARSE_H */
@@ -20,11 +20,130 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
  */
 
+#include "libavutil/mem.h"
+
 #include "parser.h"
 #include "bytestream.h"
 #include "evc.h"
 #include "evc_parse.h"
 
+// Bytes of a slice NAL unit read to find the picture it belongs to, enough for any slice header up to the POC
+#define EVC_PARSER_SLICE_HEADER_SIZE  256
+// Bytes of a non-VCL NAL unit read, parameter sets are much smaller
+#define EVC_PARSER_NVCL_SIZE          (1 << 16)
+
+// Picture properties of an access unit
+typedef struct EVCParserAU {
+    int pict_type;
+    int key_frame;
+    int output_picture_number;
+} EVCParserAU;
+
+typedef struct EVCParserPrivContext {
+    ParseContext pc;        // must be the first member, used by ff_parse_close()
+    EVCParserContext ctx;
+
+    // Access unit splitting, the positions are offsets from the beginning of the stream
+    int64_t in_pos;         // position of the input buffer
+    int64_t scan_pos;       // position of the first byte not scanned yet
+    int64_t nalu_pos;       // position of the length prefix of the current NAL unit
+    int prefix_len;         // number of length prefix bytes read
+    uint32_t nalu_size;     // size of the current NAL unit
+    uint32_t nalu_left;     // bytes of the current NAL unit not scanned yet
+    uint8_t *nalu_buf;      // beginning of the current NAL unit
+    unsigned int nalu_buf_size;
+    int nalu_len;           // bytes stored in nalu_buf
+    int nalu_needed;        // bytes to store before the NAL unit is parsed, 0 once it is parsed
+
+    int au_has_vcl;         // a slice of the current access unit was found
+    int au_poc;             // PicOrderCntVal of the current access unit
+    EVCParserAU au;
+
+    int nalu_length_size;   // size of the length prefixes of complete frames, from the evcC
+} EVCParserPrivContext;
+
+static void export_sps_props(AVCodecParserContext *s, AVCodecContext *avctx, const EVCParserContext *ctx)
+{
+    s->coded_width         = ctx->coded_width;
+    s->coded_height        = ctx->coded_height;
+    s->width               = ctx->width;
+    s->height              = ctx->height;
+
+    s->format              = ctx->format;
+
+    avctx->gop_size        = ctx->gop_size;
+    avctx->delay           = ctx->delay;
+    // lets lavf derive the dts of containers storing only the pts, such as Matroska
+    avctx->has_b_frames    = FFMAX(avctx->has_b_frames, ctx->delay);
+    avctx->profile         = ctx->profile;
+
+    // fill in the VUI values, so that no decoder has to be opened to find them
+    if (ctx->sample_aspect_ratio.num)
+        avctx->sample_aspect_ratio = ctx->sample_aspect_ratio;
+    if (ctx->color_range != AVCOL_RANGE_UNSPECIFIED)
+        avctx->color_range = ctx->color_range;
+    if (ctx->color_primaries != AVCOL_PRI_UNSPECIFIED)
+        avctx->color_primaries = ctx->color_primaries;
+    if (ctx->color_trc != AVCOL_TRC_UNSPECIFIED)
+        avctx->color_trc = ctx->color_trc;
+    if (ctx->colorspace != AVCOL_SPC_UNSPECIFIED)
+        avctx->colorspace = ctx->colorspace;
+    if (ctx->chroma_sample_location != AVCHROMA_LOC_UNSPECIFIED)
+        avctx->chroma_sample_location = ctx->chroma_sample_location;
+    if (ctx->framerate.num && ctx->framerate.den)
+        avctx->framerate = ctx->framerate;
+}
+
+// Entry of the coded side data of the given type, added if there is none yet
+static uint8_t *get_coded_side_data(AVCodecContext *avctx, enum AVPacketSideDataType type, size_t size)
+{
+    AVPacketSideData *sd;
+    uint8_t *data;
+
+    for (int i = 0; i < avctx->nb_coded_side_data; i++) {
+        if (avctx->coded_side_data[i].type == type)
+            return avctx->coded_side_data[i].size == size ? avctx->coded_side_data[i].data : NULL;
+    }
+
+    data = av_mallocz(size);
+    if (!data)
+        return NULL;
+    sd = av_realloc_array(avctx->coded_side_data, avctx->nb_coded_side_data + 1, sizeof(*sd));
+    if (!sd) {
+        av_free(data);
+        return NULL;
+    }
+    avctx->coded_side_data = sd;
+    sd[avctx->nb_coded_side_data++] = (AVPacketSideData) { .data = data, .size = size, .type = type };
+
+    return data;
+}
+
+/*
+ * The HDR static metadata is exported as coded side data, which lavf turns into stream side data
+ * without any decoder being opened. Closed captions can only be carried by packets, which a parser
+ * cannot give side data to, they are exported by evc_frame_merge and dropped here.
+ */
+static void export_sei(AVCodecContext *avctx, EVCParserContext *ctx)
+{
+    EVCParserSEI *sei = &ctx->sei;
+
+    if (sei->has_mastering_display) {
+        uint8_t *data = get_coded_side_data(avctx, AV_PKT_DATA_MASTERING_DISPLAY_METADATA,
+                                            sizeof(sei->mastering_display));
+        if (data)
+            memcpy(data, &sei->mastering_display, sizeof(sei->mastering_display));
+    }
+    if (sei->has_content_light) {
+        uint8_t *data = get_coded_side_data(avctx, AV_PKT_DATA_CONTENT_LIGHT_LEVEL,
+                                            sizeof(sei->content_light));
+        if (data)
+            memcpy(data, &sei->content_light, sizeof(sei->content_light));
+    }
+
+    ff_evc_sei_reset(sei);
+}
+
 /**
  * Parse NAL units of found picture and decode some basic information.
  *
@@ -35,7 +154,8 @@
  */
 static int parse_nal_units(AVCodecParserContext *s, AVCodecContext *avctx, const uint8_t *buf, int buf_size)
 {
-    EVCParserContext *ctx = s->priv_data;
+    EVCParserPrivContext *priv = s->priv_data;
+    EVCParserContext *ctx = &priv->ctx;
     const uint8_t *data = buf;
     int data_size = buf_size;
     int bytes_read = 0;
@@ -43,16 +163,16 @@ static int parse_nal_units(AVCodecParserContext *s, AVCodecContext *avctx, const
 
     while (data_size > 0) {
 
-        // Buffer size is not enough for buffer to store NAL unit 4-bytes prefix (length)
-        if (data_size < EVC_NALU_LENGTH_PREFIX_SIZE)
+        // Buffer size is not enough for buffer to store NAL unit prefix (length)
+        if (data_size < priv->nalu_length_size)
             return AVERROR_INVALIDDATA;
 
-        nalu_size = av_evc_read_nal_unit_length(data, data_size, avctx);
+        nalu_size = ff_evc_nal_unit_length_n(data, data_size, priv->nalu_length_size);
 
-        bytes_read += EVC_NALU_LENGTH_PREFIX_SIZE;
+        bytes_read += priv->nalu_length_size;
 
-        data += EVC_NALU_LENGTH_PREFIX_SIZE;
-        data_size -= EVC_NALU_LENGTH_PREFIX_SIZE;
+        data += priv->nalu_length_size;
+        data_size -= priv->nalu_length_size;
 
         if (data_size < nalu_size)
             return AVERROR_INVALIDDATA;
@@ -64,16 +184,7 @@ static int parse_nal_units(AVCodecParserContext *s, AVCodecContext *avctx, const
 
         if(ctx->nalu_type == EVC_SPS_NUT) {
 
-            s->coded_width         = ctx->coded_width;
-            s->coded_height        = ctx->coded_height;
-            s->width               = ctx->width;
-            s->height              = ctx->height;
-
-            s->format              = ctx->format;
-
-            avctx->gop_size        = ctx->gop_size;
-            avctx->delay           = ctx->delay;
-            avctx->profile         = ctx->profile;
+            export_sps_props(s, avctx, ctx);
 
         } else if(ctx->nalu_type == EVC_NOIDR_NUT || ctx->nalu_type == EVC_IDR_NUT) {
 
@@ -86,84 +197,176 @@ static int parse_nal_units(AVCodecParserContext *s, AVCodecContext *avctx, const
         data += nalu_size;
         data_size -= nalu_size;
     }
+    export_sei(avctx, ctx);
+
     return 0;
 }
 
-// Decoding nal units from evcC (EVCDecoderConfigurationRecord)
-// @see @see ISO/IEC 14496-15:2021 Coding of audio-visual objects - Part 15: section 12.3.3.2
-static int decode_extradata(EVCParserContext *ctx, const uint8_t *data, int size, void *logctx)
+// Export the properties of the access unit being completed
+static void export_au(AVCodecParserContext *s, AVCodecContext *avctx)
 {
-    int ret = 0;
-    GetByteContext gb;
+    EVCParserPrivContext *priv = s->priv_data;
 
-    bytestream2_init(&gb, data, size);
+    export_sps_props(s, avctx, &priv->ctx);
+    export_sei(avctx, &priv->ctx);
 
-    if (!data || size <= 0)
-        return -1;
+    s->pict_type             = priv->au.pict_type;
+    s->key_frame             = priv->au.key_frame;
+    s->output_picture_number = priv->au.output_picture_number;
 
-    // extradata is encoded as evcC format.
-    if (data[0] == 1) {
-        int num_of_arrays;  // indicates the number of arrays of NAL units of the indicated type(s)
-
-        int nalu_length_field_size; // indicates the length in bytes of the NALUnitLenght field in EVC video stream sample in the stream
-        // The value of this field shall be one of 0, 1, or 3 corresponding to a length encoded with 1, 2, or 4 bytes, respectively.
+    priv->au_has_vcl = 0;
+}
 
-        if (bytestream2_get_bytes_left(&gb) < 18) {
-            av_log(logctx, AV_LOG_ERROR, "evcC %d too short\n", size);
-            return AVERROR_INVALIDDATA;
+/**
+ * Parse the beginning of the current NAL unit and tell whether it starts a new access unit
+ *
+ * An access unit ends before the first non-VCL NAL unit following a slice, or before the first slice
+ * of the next picture. As assumed by evc_frame_merge, every slice is a picture of its own in the
+ * Baseline profile, a new picture starts when the POC changes in the Main profile.
+ *
+ * @return 1 if the NAL unit starts a new access unit, 0 otherwise
+ */
+static int evaluate_nal_unit(AVCodecParserContext *s, AVCodecContext *avctx)
+{
+    EVCParserPrivContext *priv = s->priv_data;
+    EVCParserContext *ctx = &priv->ctx;
+    int nalu_type = av_evc_get_nalu_type(priv->nalu_buf, priv->nalu_len, avctx);
+    int new_au = 0;
+
+    if (nalu_type != EVC_NOIDR_NUT && nalu_type != EVC_IDR_NUT) {
+        // the properties are exported before a new SPS is parsed
+        if (priv->au_has_vcl) {
+            export_au(s, avctx);
+            new_au = 1;
         }
+        if (ff_evc_parse_nal_unit(ctx, priv->nalu_buf, priv->nalu_len, avctx) < 0)
+            av_log(avctx, AV_LOG_DEBUG, "Parsing of NAL unit failed\n");
+        return new_au;
+    }
 
-        bytestream2_skip(&gb, 16);
-
-        // @see ISO/IEC 14496-15:2021 Coding of audio-visual objects - Part 15: section 12.3.3.3
-        // LengthSizeMinusOne plus 1 indicates the length in bytes of the NALUnitLength field in a EVC video stream sample in the stream to which this configuration record applies. For example, a size of one byte is indicated with a value of 0.
-        // The value of this field shall be one of 0, 1, or 3 corresponding to a length encoded with 1, 2, or 4 bytes, respectively.
-        nalu_length_field_size = (bytestream2_get_byte(&gb) & 3) + 1;
-        if( nalu_length_field_size != 1 &&
-            nalu_length_field_size != 2 &&
-            nalu_length_field_size != 4 ) {
-            av_log(logctx, AV_LOG_ERROR, "The length in bytes of the NALUnitLenght field in a EVC video stream has unsupported value of %d\n", nalu_length_field_size);
-            return AVERROR_INVALIDDATA;
-        }
+    if (ff_evc_parse_nal_unit(ctx, priv->nalu_buf, priv->nalu_len, avctx) < 0) {
+        av_log(avctx, AV_LOG_DEBUG, "Parsing of slice header failed\n");
+        return 0;
+    }
 
-        num_of_arrays = bytestream2_get_byte(&gb);
+    if (priv->au_has_vcl &&
+        (ctx->profile == FF_PROFILE_EVC_BASELINE || ctx->poc.PicOrderCntVal != priv->au_poc)) {
+        export_au(s, avctx);
+        new_au = 1;
+    }
 
-        /* Decode nal units from evcC. */
-        for (int i = 0; i < num_of_arrays; i++) {
+    priv->au_has_vcl = 1;
+    priv->au_poc = ctx->poc.PicOrderCntVal;
+    priv->au.pict_type             = ctx->pict_type;
+    priv->au.key_frame             = ctx->key_frame;
+    priv->au.output_picture_number = ctx->output_picture_number;
 
-            // @see ISO/IEC 14496-15:2021 Coding of audio-visual objects - Part 15: section 12.3.3.3
-            // NAL_unit_type indicates the type of the NAL units in the following array (which shall be all of that type);
-            // - it takes a value as defined in ISO/IEC 23094-1;
-            // - it is restricted to take one of the values indicating a SPS, PPS, APS, or SEI NAL unit.
-            int nal_unit_type = bytestream2_get_byte(&gb) & 0x3f;
-            int num_nalus  = bytestream2_get_be16(&gb);
+    return new_au;
+}
 
-            for (int j = 0; j < num_nalus; j++) {
+/**
+ * Scan the input for the end of the current access unit
+ *
+ * The scanning state is kept across calls, the bytes returned to the caller after the end of an
+ * access unit have already been scanned and are skipped when they are passed again.
+ *
+ * @return offset of the end of the access unit relative to buf, possibly negative, or END_NOT_FOUND
+ */
+static int find_frame_end(AVCodecParserContext *s, AVCodecContext *avctx, const uint8_t *buf, int buf_size)
+{
+    EVCParserPrivContext *priv = s->priv_data;
+    int i = priv->scan_pos - priv->in_pos;
 
-                int nal_unit_length = bytestream2_get_be16(&gb);
+    while (i < buf_size) {
+        int n;
 
-                if (bytestream2_get_bytes_left(&gb) < nal_unit_length) {
-                    av_log(logctx, AV_LOG_ERROR, "Invalid NAL unit size in extradata.\n");
-                    return AVERROR_INVALIDDATA;
-                }
+        if (priv->prefix_len < EVC_NALU_LENGTH_PREFIX_SIZE) {
+            if (!priv->prefix_len) {
+                priv->nalu_pos  = priv->in_pos + i;
+                priv->nalu_size = 0;
+            }
+            priv->nalu_size = (priv->nalu_size << 8) | buf[i++];
+            if (++priv->prefix_len < EVC_NALU_LENGTH_PREFIX_SIZE)
+                continue;
+
+            if (priv->nalu_size < EVC_NALU_HEADER_SIZE) {
+                av_log(avctx, AV_LOG_ERROR, "Invalid NAL unit size: (%u)\n", priv->nalu_size);
+                priv->prefix_len = 0;
+                continue;
+            }
+            priv->nalu_left   = priv->nalu_size;
+            priv->nalu_len    = 0;
+            priv->nalu_needed = EVC_NALU_HEADER_SIZE;
+            continue;
+        }
 
-                if( nal_unit_type == EVC_SPS_NUT ||
-                    nal_unit_type == EVC_PPS_NUT ||
-                    nal_unit_type == EVC_APS_NUT ||
-                    nal_unit_type == EVC_SEI_NUT ) {
-                    if (ff_evc_parse_nal_unit(ctx, gb.buffer, nal_unit_length, logctx) != 0) {
-                        av_log(logctx, AV_LOG_ERROR, "Parsing of NAL unit failed\n");
-                        return AVERROR_INVALIDDATA;
+        n = FFMIN(priv->nalu_left, buf_size - i);
+        if (priv->nalu_needed) {
+            n = FFMIN(n, priv->nalu_needed - priv->nalu_len);
+            memcpy(priv->nalu_buf + priv->nalu_len, buf + i, n);
+            priv->nalu_len += n;
+        }
+        i += n;
+        priv->nalu_left -= n;
+
+        if (priv->nalu_needed && priv->nalu_len == priv->nalu_needed) {
+            if (priv->nalu_len == EVC_NALU_HEADER_SIZE && priv->nalu_left) {
+                // the NAL unit type tells how much of it has to be read
+                int nalu_type = av_evc_get_nalu_type(priv->nalu_buf, priv->nalu_len, avctx);
+                int max_size  = nalu_type == EVC_NOIDR_NUT || nalu_type == EVC_IDR_NUT ?
+                                EVC_PARSER_SLICE_HEADER_SIZE : EVC_PARSER_NVCL_SIZE;
+
+                priv->nalu_needed = FFMIN(priv->nalu_size, max_size);
+                if (priv->nalu_needed > EVC_NALU_HEADER_SIZE) {
+                    uint8_t *nalu_buf = av_fast_realloc(priv->nalu_buf, &priv->nalu_buf_size,
+                                                        priv->nalu_needed + AV_INPUT_BUFFER_PADDING_SIZE);
+                    if (!nalu_buf) {
+                        priv->nalu_needed = priv->nalu_len;
+                    } else {
+                        priv->nalu_buf = nalu_buf;
+                        continue;
                     }
                 }
+            }
 
-                bytestream2_skip(&gb, nal_unit_length);
+            priv->nalu_needed = 0;
+            memset(priv->nalu_buf + priv->nalu_len, 0, AV_INPUT_BUFFER_PADDING_SIZE);
+            if (evaluate_nal_unit(s, avctx)) {
+                if (!priv->nalu_left)
+                    priv->prefix_len = 0;
+                priv->scan_pos = priv->in_pos + i;
+                return priv->nalu_pos - priv->in_pos;
             }
         }
-    } else
-        return -1;
 
-    return ret;
+        if (!priv->nalu_left)
+            priv->prefix_len = 0;
+    }
+
+    priv->scan_pos = priv->in_pos + i;
+
+    if (!buf_size && priv->au_has_vcl) // flush the last access unit
+        export_au(s, avctx);
+
+    return END_NOT_FOUND;
+}
+
+static int decode_extradata_nal_unit(void *opaque, int nal_unit_type, const uint8_t *nalu, int nalu_size, void *logctx)
+{
+    EVCParserContext *ctx = opaque;
+
+    if (ff_evc_parse_nal_unit(ctx, nalu, nalu_size, logctx) != 0) {
+        av_log(logctx, AV_LOG_ERROR, "Parsing of NAL unit failed\n");
+        return AVERROR_INVALIDDATA;
+    }
+
+    return 0;
+}
+
+// Decoding nal units from evcC (EVCDecoderConfigurationRecord)
+static int decode_extradata(EVCParserContext *ctx, const uint8_t *data, int size, void *logctx)
+{
+    return ff_evc_walk_extradata(data, size, decode_extradata_nal_unit, ctx, logctx);
 }
 
 static int evc_parse(AVCodecParserContext *s, AVCodecContext *avctx,
@@ -172,13 +375,43 @@ static int evc_parse(AVCodecParserContext *s, AVCodecContext *avctx,
 {
     int next;
     int ret;
-    EVCParserContext *ctx = s->priv_data;
+    EVCParserPrivContext *priv = s->priv_data;
+    EVCParserContext *ctx = &priv->ctx;
 
     if (avctx->extradata && !ctx->parsed_extradata) {
+        // the length prefixes of raw streams, which are split here, are always 4 bytes
+        ret = ff_evc_nal_length_size(avctx->extradata, avctx->extradata_size);
+        if (ret < 0)
+            av_log(avctx, AV_LOG_ERROR, "Unsupported NAL unit length size in extradata\n");
+        else
+            priv->nalu_length_size = ret;
         decode_extradata(ctx, avctx->extradata, avctx->extradata_size, avctx);
+        export_sei(avctx, ctx);
         ctx->parsed_extradata = 1;
     }
 
+    s->picture_structure = AV_PICTURE_STRUCTURE_FRAME;
+
+    if (!(s->flags & PARSER_FLAG_COMPLETE_FRAMES)) {
+        // the access unit properties are exported once its end is found
+        next = find_frame_end(s, avctx, buf, buf_size);
+
+        if (ff_combine_frame(&priv->pc, next, &buf, &buf_size) < 0) {
+            priv->in_pos += buf_size;
+            *poutbuf      = NULL;
+            *poutbuf_size = 0;
+            return buf_size;
+        }
+
+        // the bytes of the next access unit within buf are passed again
+        priv->in_pos += FFMAX(next, 0);
+
+        *poutbuf      = buf;
+        *poutbuf_size = buf_size;
+
+        return next;
+    }
+
     next = buf_size;
 
     ret = parse_nal_units(s, avctx, buf, buf_size);
@@ -188,8 +421,6 @@ static int evc_parse(AVCodecParserContext *s, AVCodecContext *avctx,
         return buf_size;
     }
 
-    s->picture_structure = AV_PICTURE_STRUCTURE_FRAME;
-
     // poutbuf contains just one Access Unit
     *poutbuf      = buf;
     *poutbuf_size = buf_size;
@@ -199,36 +430,31 @@ static int evc_parse(AVCodecParserContext *s, AVCodecContext *avctx,
 
 static int evc_parser_init(AVCodecParserContext *s)
 {
-    EVCParserContext *ctx = s->priv_data;
+    EVCParserPrivContext *priv = s->priv_data;
 
-    memset(ctx->sps, 0, sizeof(EVCParserSPS *)*EVC_MAX_SPS_COUNT);
-    memset(ctx->pps, 0, sizeof(EVCParserPPS *)*EVC_MAX_PPS_COUNT);
-    memset(ctx->slice_header, 0, sizeof(EVCParserSliceHeader *)*EVC_MAX_PPS_COUNT);
+    priv->nalu_length_size = EVC_NALU_LENGTH_PREFIX_SIZE;
+    priv->nalu_buf = av_fast_realloc(NULL, &priv->nalu_buf_size,
+                                     EVC_NALU_HEADER_SIZE + AV_INPUT_BUFFER_PADDING_SIZE);
+    if (!priv->nalu_buf)
+        return AVERROR(ENOMEM);
 
     return 0;
 }
 
 static void evc_parser_close(AVCodecParserContext *s)
 {
-    EVCParserContext *ctx = s->priv_data;
+    EVCParserPrivContext *priv = s->priv_data;
 
-    for(int i = 0; i < EVC_MAX_SPS_COUNT; i++) {
-        EVCParserSPS *sps = ctx->sps[i];
-        av_freep(&sps);
-    }
+    ff_evc_ps_uninit(&priv->ctx);
+    ff_evc_sei_reset(&priv->ctx.sei);
+    av_freep(&priv->nalu_buf);
 
-    for(int i = 0; i < EVC_MAX_PPS_COUNT; i++) {
-        EVCParserPPS *pps = ctx->pps[i];
-        EVCParserSliceHeader *sh = ctx->slice_header[i];
-
-        av_freep(&pps);
-        av_freep(&sh);
-    }
+    ff_parse_close(s);
 }
 
 const AVCodecParser ff_evc_parser = {
     .codec_ids      = { AV_CODEC_ID_EVC },
-    .priv_data_size = sizeof(EVCParserContext),
+    .priv_data_size = sizeof(EVCParserPrivContext),
     .parser_init    = evc_parser_init,
     .parser_parse   = evc_parse,
     .parser_close   = evc_parser_close,
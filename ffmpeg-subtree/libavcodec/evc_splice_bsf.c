@@ -0,0 +1,391 @@
+/*
+ * This file is part of FFmpeg.
+ *
+ * FFmpeg is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * FFmpeg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with FFmpeg; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/**
+ * @file
+ * Renumber the SPS and PPS ids of spliced EVC streams.
+ *
+ * When streams are concatenated, parameter sets with the same id but a
+ * different content may follow each other, and a parameter set announced
+ * through new extradata only may never reach the decoder. Every parameter
+ * set is given an output id shared by all the parameter sets with the same
+ * content, reusing the least recently used id when all are taken, and the
+ * slice headers are renumbered accordingly. A parameter set which is not
+ * in band yet is inserted before the first slice referencing it.
+ */
+
+#include <string.h>
+
+#include "libavutil/common.h"
+
+#include "bsf.h"
+#include "bsf_internal.h"
+#include "cbs.h"
+#include "cbs_bsf.h"
+#include "cbs_evc.h"
+#include "evc.h"
+
+typedef struct EVCSpliceParamSet {
+    AVBufferRef *ref;
+    void        *content;
+    // the current content was sent in band or in the output extradata
+    int          sent;
+    // access unit which last used the parameter set
+    int64_t      last_use;
+    // output SPS id referenced by a PPS
+    int          sps_id;
+} EVCSpliceParamSet;
+
+typedef struct EVCSpliceContext {
+    CBSBSFContext common;
+
+    EVCSpliceParamSet sps[EVC_MAX_SPS_COUNT];
+    EVCSpliceParamSet pps[EVC_MAX_PPS_COUNT];
+
+    // output ids of the input parameter sets, -1 when not mapped
+    int sps_map[EVC_MAX_SPS_COUNT];
+    int pps_map[EVC_MAX_PPS_COUNT];
+    // input SPS id referenced by each input PPS
+    int pps_sps[EVC_MAX_PPS_COUNT];
+
+    int64_t nb_au;
+    int     initialized;
+} EVCSpliceContext;
+
+// Compare two parameter sets, except for the id byte at id_offset.
+static int evc_splice_equal(const void *a, const void *b,
+                            size_t size, size_t id_offset)
+{
+    const uint8_t *pa = a, *pb = b;
+
+    return !memcmp(pa, pb, id_offset) &&
+           !memcmp(pa + id_offset + 1, pb + id_offset + 1,
+                   size - id_offset - 1);
+}
+
+static int evc_splice_alloc(EVCSpliceContext *ctx, EVCSpliceParamSet *ps,
+                            int nb_ps, int id)
+{
+    int lru = -1;
+
+    if (!ps[id].ref)
+        return id;
+    for (int i = 0; i < nb_ps; i++) {
+        if (!ps[i].ref)
+            return i;
+    }
+
+    // parameter sets used by the current access unit are kept
+    for (int i = 0; i < nb_ps; i++) {
+        if (ps[i].last_use < ctx->nb_au &&
+            (lru < 0 || ps[i].last_use < ps[lru].last_use))
+            lru = i;
+    }
+    return lru;
+}
+
+static void evc_splice_unmap_pps(EVCSpliceContext *ctx, int in_sps_id)
+{
+    for (int i = 0; i < EVC_MAX_PPS_COUNT; i++) {
+        if (ctx->pps_sps[i] == in_sps_id)
+            ctx->pps_map[i] = -1;
+    }
+}
+
+static int evc_splice_sps(AVBSFContext *bsf, CodedBitstreamUnit *unit,
+                          int sent)
+{
+    EVCSpliceContext *ctx = bsf->priv_data;
+    EVCSpliceParamSet *ps;
+    EVCRawSPS *sps;
+    int in_id, out_id = -1, err;
+
+    err = ff_cbs_make_unit_writable(ctx->common.input, unit);
+    if (err < 0)
+        return err;
+    sps   = unit->content;
+    in_id = sps->sps_seq_parameter_set_id;
+
+    for (int i = 0; i < EVC_MAX_SPS_COUNT; i++) {
+        if (ctx->sps[i].ref &&
+            evc_splice_equal(ctx->sps[i].content, sps, sizeof(*sps),
+                             offsetof(EVCRawSPS, sps_seq_parameter_set_id))) {
+            out_id = i;
+            break;
+        }
+    }
+
+    if (out_id < 0) {
+        out_id = evc_splice_alloc(ctx, ctx->sps, EVC_MAX_SPS_COUNT, in_id);
+        if (out_id < 0) {
+            av_log(bsf, AV_LOG_ERROR, "No SPS id left for SPS %d.\n", in_id);
+            return AVERROR_INVALIDDATA;
+        }
+        ps = &ctx->sps[out_id];
+
+        // the input parameter sets mapped to the replaced SPS are lost,
+        // and the PPSs referencing it are parsed again by the decoder
+        for (int i = 0; i < EVC_MAX_SPS_COUNT; i++) {
+            if (ctx->sps_map[i] == out_id) {
+                ctx->sps_map[i] = -1;
+                evc_splice_unmap_pps(ctx, i);
+            }
+        }
+        for (int i = 0; i < EVC_MAX_PPS_COUNT; i++) {
+            if (ctx->pps[i].ref && ctx->pps[i].sps_id == out_id)
+                ctx->pps[i].sent = 0;
+        }
+
+        err = av_buffer_replace(&ps->ref, unit->content_ref);
+        if (err < 0)
+            return err;
+        ps->content = sps;
+        ps->sent    = 0;
+    }
+    ps = &ctx->sps[out_id];
+
+    sps->sps_seq_parameter_set_id = out_id;
+    ps->sent    |= sent;
+    ps->last_use = ctx->nb_au;
+
+    if (ctx->sps_map[in_id] != out_id) {
+        av_log(bsf, AV_LOG_DEBUG, "SPS %d -> %d.\n", in_id, out_id);
+        evc_splice_unmap_pps(ctx, in_id);
+        ctx->sps_map[in_id] = out_id;
+    }
+
+    return 0;
+}
+
+static int evc_splice_pps(AVBSFContext *bsf, CodedBitstreamUnit *unit,
+                          int sent)
+{
+    EVCSpliceContext *ctx = bsf->priv_data;
+    EVCSpliceParamSet *ps;
+    EVCRawPPS *pps;
+    int in_id, in_sps_id, sps_id, out_id = -1, err;
+
+    err = ff_cbs_make_unit_writable(ctx->common.input, unit);
+    if (err < 0)
+        return err;
+    pps       = unit->content;
+    in_id     = pps->pps_pic_parameter_set_id;
+    in_sps_id = pps->pps_seq_parameter_set_id;
+
+    sps_id = ctx->sps_map[in_sps_id];
+    if (sps_id < 0) {
+        av_log(bsf, AV_LOG_ERROR, "SPS id %d not available.\n", in_sps_id);
+        return AVERROR_INVALIDDATA;
+    }
+    pps->pps_seq_parameter_set_id = sps_id;
+
+    for (int i = 0; i < EVC_MAX_PPS_COUNT; i++) {
+        if (ctx->pps[i].ref &&
+            evc_splice_equal(ctx->pps[i].content, pps, sizeof(*pps),
+                             offsetof(EVCRawPPS, pps_pic_parameter_set_id))) {
+            out_id = i;
+            break;
+        }
+    }
+
+    if (out_id < 0) {
+        out_id = evc_splice_alloc(ctx, ctx->pps, EVC_MAX_PPS_COUNT, in_id);
+        if (out_id < 0) {
+            av_log(bsf, AV_LOG_ERROR, "No PPS id left for PPS %d.\n", in_id);
+            return AVERROR_INVALIDDATA;
+        }
+        ps = &ctx->pps[out_id];
+
+        for (int i = 0; i < EVC_MAX_PPS_COUNT; i++) {
+            if (ctx->pps_map[i] == out_id)
+                ctx->pps_map[i] = -1;
+        }
+
+        err = av_buffer_replace(&ps->ref, unit->content_ref);
+        if (err < 0)
+            return err;
+        ps->content = pps;
+        ps->sent    = 0;
+        ps->sps_id  = sps_id;
+    }
+    ps = &ctx->pps[out_id];
+
+    pps->pps_pic_parameter_set_id = out_id;
+    ps->sent    |= sent;
+    ps->last_use = ctx->nb_au;
+
+    if (ctx->pps_map[in_id] != out_id)
+        av_log(bsf, AV_LOG_DEBUG, "PPS %d -> %d.\n", in_id, out_id);
+    ctx->pps_map[in_id] = out_id;
+    ctx->pps_sps[in_id] = in_sps_id;
+
+    return 0;
+}
+
+// Renumber the slice at *pos, inserting the parameter sets it needs
+// before it. *pos is updated to the new position of the slice.
+static int evc_splice_slice(AVBSFContext *bsf, CodedBitstreamFragment *au,
+                            int *pos)
+{
+    EVCSpliceContext *ctx = bsf->priv_data;
+    CodedBitstreamEVCContext *evc = ctx->common.input->priv_data;
+    EVCRawSlice *slice = au->units[*pos].content;
+    int in_id = slice->header.slice_pic_parameter_set_id;
+    int start = *pos, err;
+    EVCSpliceParamSet *pps, *sps;
+
+    // the SPS of the PPS was replaced without the PPS being sent again
+    if (ctx->pps_map[in_id] < 0) {
+        if (!evc->pps[in_id]) {
+            av_log(bsf, AV_LOG_ERROR, "PPS id %d not available.\n", in_id);
+            return AVERROR_INVALIDDATA;
+        }
+        err = ff_cbs_insert_unit_content(au, *pos, EVC_PPS_NUT,
+                                         evc->pps[in_id], evc->pps_ref[in_id]);
+        if (err < 0)
+            return err;
+        err = evc_splice_pps(bsf, &au->units[*pos], 1);
+        if (err < 0)
+            return err;
+        (*pos)++;
+    }
+
+    pps = &ctx->pps[ctx->pps_map[in_id]];
+    sps = &ctx->sps[pps->sps_id];
+
+    if (!pps->sent) {
+        err = ff_cbs_insert_unit_content(au, *pos, EVC_PPS_NUT,
+                                         pps->content, pps->ref);
+        if (err < 0)
+            return err;
+        pps->sent = 1;
+        (*pos)++;
+    }
+    if (!sps->sent) {
+        err = ff_cbs_insert_unit_content(au, start, EVC_SPS_NUT,
+                                         sps->content, sps->ref);
+        if (err < 0)
+            return err;
+        sps->sent = 1;
+        (*pos)++;
+    }
+
+    pps->last_use = sps->last_use = ctx->nb_au;
+    slice->header.slice_pic_parameter_set_id = ctx->pps_map[in_id];
+
+    return 0;
+}
+
+static int evc_splice_update_fragment(AVBSFContext *bsf, AVPacket *pkt,
+                                      CodedBitstreamFragment *au)
+{
+    EVCSpliceContext *ctx = bsf->priv_data;
+    // the parameter sets of the initial extradata are in the output
+    // extradata, while the decoder may never see later extradata
+    int sent = pkt || !ctx->initialized;
+    int err;
+
+    for (int i = 0; i < au->nb_units; i++) {
+        CodedBitstreamUnit *unit = &au->units[i];
+
+        switch (unit->type) {
+        case EVC_SPS_NUT:
+            err = evc_splice_sps(bsf, unit, sent);
+            break;
+        case EVC_PPS_NUT:
+            err = evc_splice_pps(bsf, unit, sent);
+            break;
+        case EVC_IDR_NUT:
+        case EVC_NOIDR_NUT:
+            err = pkt ? evc_splice_slice(bsf, au, &i) : 0;
+            break;
+        default:
+            err = 0;
+        }
+        if (err < 0)
+            return err;
+    }
+
+    if (pkt)
+        ctx->nb_au++;
+
+    return 0;
+}
+
+static const CBSBSFType evc_splice_type = {
+    .codec_id        = AV_CODEC_ID_EVC,
+    .fragment_name   = "access unit",
+    .unit_name       = "NAL unit",
+    .update_fragment = &evc_splice_update_fragment,
+};
+
+static int evc_splice_init(AVBSFContext *bsf)
+{
+    EVCSpliceContext *ctx = bsf->priv_data;
+    int err;
+
+    for (int i = 0; i < EVC_MAX_SPS_COUNT; i++)
+        ctx->sps_map[i] = -1;
+    for (int i = 0; i < EVC_MAX_PPS_COUNT; i++)
+        ctx->pps_map[i] = ctx->pps_sps[i] = -1;
+
+    err = ff_cbs_bsf_generic_init(bsf, &evc_splice_type);
+    if (err < 0)
+        return err;
+
+    ctx->initialized = 1;
+
+    return 0;
+}
+
+static void evc_splice_flush(AVBSFContext *bsf)
+{
+    EVCSpliceContext *ctx = bsf->priv_data;
+
+    // the decoder may restart from any point, send everything again
+    for (int i = 0; i < EVC_MAX_SPS_COUNT; i++)
+        ctx->sps[i].sent = 0;
+    for (int i = 0; i < EVC_MAX_PPS_COUNT; i++)
+        ctx->pps[i].sent = 0;
+}
+
+static void evc_splice_close(AVBSFContext *bsf)
+{
+    EVCSpliceContext *ctx = bsf->priv_data;
+
+    for (int i = 0; i < EVC_MAX_SPS_COUNT; i++)
+        av_buffer_unref(&ctx->sps[i].ref);
+    for (int i = 0; i < EVC_MAX_PPS_COUNT; i++)
+        av_buffer_unref(&ctx->pps[i].ref);
+
+    ff_cbs_bsf_generic_close(bsf);
+}
+
+static const enum AVCodecID evc_splice_codec_ids[] = {
+    AV_CODEC_ID_EVC, AV_CODEC_ID_NONE,
+};
+
+const FFBitStreamFilter ff_evc_splice_bsf = {
+    .p.name         = "evc_splice",
+    .p.codec_ids    = evc_splice_codec_ids,
+    .priv_data_size = sizeof(EVCSpliceContext),
+    .init           = &evc_splice_init,
+    .flush          = &evc_splice_flush,
+    .close          = &evc_splice_close,
+    .filter         = &ff_cbs_bsf_generic_filter,
+};
@@ -0,0 +1,159 @@
+/*
+ * This file is part of FFmpeg.
+ *
+ * FFmpeg is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * FFmpeg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with FFmpeg; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/**
+ * @file
+ * This bitstream filter drops the NAL units of an EVC stream whose
+ * TemporalId is above a given value, keeping a lower frame rate sub-stream.
+ *
+ * Pictures never reference pictures of a higher temporal sub-layer, so the
+ * remaining pictures can still be decoded and keep their timestamps.
+ */
+
+#include "libavutil/opt.h"
+
+#include "bsf.h"
+#include "bsf_internal.h"
+#include "defs.h"
+#include "evc.h"
+
+typedef struct EVCTemporalFilterContext {
+    const AVClass *class;
+
+    int max_temporal_id;
+    int nalu_length_size;   // size of the length prefixes, set by the evcC of the input
+} EVCTemporalFilterContext;
+
+static int evc_temporal_filter_filter(AVBSFContext *bsf, AVPacket *pkt)
+{
+    EVCTemporalFilterContext *ctx = bsf->priv_data;
+    const int length_size = ctx->nalu_length_size;
+    const uint8_t *ptr, *end;
+    AVBufferRef *filtered_buf;
+    uint8_t *dst;
+    int kept_size = 0, nb_nalus = 0, nb_kept = 0;
+    int err;
+
+    err = ff_bsf_get_packet_ref(bsf, pkt);
+    if (err < 0)
+        return err;
+
+    ptr = pkt->data;
+    end = pkt->data + pkt->size;
+    while (end - ptr > length_size) {
+        uint32_t nalu_size = ff_evc_nal_unit_length_n(ptr, end - ptr, length_size);
+
+        if (nalu_size > end - ptr - length_size) {
+            av_log(bsf, AV_LOG_ERROR, "Invalid NAL unit size: (%"PRIu32")\n", nalu_size);
+            err = AVERROR_INVALIDDATA;
+            goto fail;
+        }
+        nalu_size += length_size;
+
+        if (ff_evc_nal_unit_temporal_id(ptr + length_size,
+                                        nalu_size - length_size) <= ctx->max_temporal_id) {
+            kept_size += nalu_size;
+            nb_kept++;
+        }
+        nb_nalus++;
+        ptr += nalu_size;
+    }
+
+    if (nb_kept == nb_nalus)
+        return 0;
+
+    if (!nb_kept) {
+        av_packet_unref(pkt);
+        return AVERROR(EAGAIN);
+    }
+
+    // Only some NAL units of the access unit are dropped, copy the others
+    filtered_buf = av_buffer_alloc(kept_size + AV_INPUT_BUFFER_PADDING_SIZE);
+    if (!filtered_buf) {
+        err = AVERROR(ENOMEM);
+        goto fail;
+    }
+    memset(filtered_buf->data + kept_size, 0, AV_INPUT_BUFFER_PADDING_SIZE);
+
+    dst = filtered_buf->data;
+    for (ptr = pkt->data; end - ptr > length_size;) {
+        uint32_t nalu_size = ff_evc_nal_unit_length_n(ptr, end - ptr, length_size) + length_size;
+
+        if (ff_evc_nal_unit_temporal_id(ptr + length_size,
+                                        nalu_size - length_size) <= ctx->max_temporal_id) {
+            memcpy(dst, ptr, nalu_size);
+            dst += nalu_size;
+        }
+        ptr += nalu_size;
+    }
+
+    av_buffer_unref(&pkt->buf);
+    pkt->buf  = filtered_buf;
+    pkt->data = filtered_buf->data;
+    pkt->size = kept_size;
+
+    return 0;
+
+fail:
+    av_packet_unref(pkt);
+    return err;
+}
+
+static int evc_temporal_filter_init(AVBSFContext *bsf)
+{
+    EVCTemporalFilterContext *ctx = bsf->priv_data;
+
+    // raw streams come without extradata, their length prefixes are 4 bytes
+    ctx->nalu_length_size = ff_evc_nal_length_size(bsf->par_in->extradata, bsf->par_in->extradata_size);
+    if (ctx->nalu_length_size < 0) {
+        av_log(bsf, AV_LOG_ERROR, "Unsupported NAL unit length size in extradata\n");
+        return ctx->nalu_length_size;
+    }
+
+    return 0;
+}
+
+#define OFFSET(x) offsetof(EVCTemporalFilterContext, x)
+#define FLAGS (AV_OPT_FLAG_VIDEO_PARAM|AV_OPT_FLAG_BSF_PARAM|AV_OPT_FLAG_RUNTIME_PARAM)
+static const AVOption evc_temporal_filter_options[] = {
+    { "max_temporal_id", "Drop NAL units with a higher TemporalId",
+        OFFSET(max_temporal_id), AV_OPT_TYPE_INT,
+        { .i64 = 7 }, 0, 7, FLAGS },
+
+    { NULL }
+};
+
+static const AVClass evc_temporal_filter_class = {
+    .class_name = "evc_temporal_filter",
+    .item_name  = av_default_item_name,
+    .option     = evc_temporal_filter_options,
+    .version    = LIBAVUTIL_VERSION_INT,
+};
+
+static const enum AVCodecID evc_temporal_filter_codec_ids[] = {
+    AV_CODEC_ID_EVC, AV_CODEC_ID_NONE,
+};
+
+const FFBitStreamFilter ff_evc_temporal_filter_bsf = {
+    .p.name         = "evc_temporal_filter",
+    .p.codec_ids    = evc_temporal_filter_codec_ids,
+    .p.priv_class   = &evc_temporal_filter_class,
+    .priv_data_size = sizeof(EVCTemporalFilterContext),
+    .init           = evc_temporal_filter_init,
+    .filter         = evc_temporal_filter_filter,
+};
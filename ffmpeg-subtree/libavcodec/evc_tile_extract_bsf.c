@@ -0,0 +1,466 @@
+/*
+ * This file is part of FFmpeg.
+ *
+ * FFmpeg is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * FFmpeg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with FFmpeg; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/**
+ * @file
+ * Extract a rectangle of tiles of an EVC stream into a stream of its own.
+ *
+ * The SPS picture size and cropping and the PPS tile grid are rewritten for
+ * the rectangle, the slices covering other tiles are dropped and the tile
+ * ids of the remaining slice headers are renumbered. Slice data is copied
+ * as is, so the stream must be coded with independent tiles.
+ */
+
+#include "libavutil/common.h"
+#include "libavutil/opt.h"
+
+#include "bsf.h"
+#include "bsf_internal.h"
+#include "cbs.h"
+#include "cbs_bsf.h"
+#include "cbs_evc.h"
+#include "evc.h"
+
+typedef struct EVCTileGrid {
+    int ctb_log2_size;
+    int nb_columns;
+    int nb_rows;
+    // first CTB of each tile column and row, followed by the picture size in CTBs
+    int column_start[EVC_MAX_TILE_COLUMNS + 1];
+    int row_start[EVC_MAX_TILE_ROWS + 1];
+} EVCTileGrid;
+
+// Size of the extracted pictures of an SPS, set from the PPS referencing it
+typedef struct EVCTileExtractSize {
+    int width;
+    int height;
+    // the extracted tiles reach the right and bottom edges of the picture
+    int right_edge;
+    int bottom_edge;
+} EVCTileExtractSize;
+
+typedef struct EVCTileExtractContext {
+    CBSBSFContext common;
+
+    int column;
+    int row;
+    int columns;
+    int rows;
+
+    EVCTileExtractSize sps_size[EVC_MAX_SPS_COUNT];
+
+    // cropped size of the last SPS rewritten
+    int out_width;
+    int out_height;
+} EVCTileExtractContext;
+
+static int evc_tile_extract_grid(AVBSFContext *bsf, const EVCRawSPS *sps,
+                                 const EVCRawPPS *pps, EVCTileGrid *grid)
+{
+    EVCTileExtractContext *ctx = bsf->priv_data;
+    int width_ctbs, height_ctbs;
+
+    grid->ctb_log2_size = sps->sps_btt_flag ? sps->log2_ctu_size_minus5 + 5 : 6;
+    width_ctbs  = AV_CEIL_RSHIFT(sps->pic_width_in_luma_samples,  grid->ctb_log2_size);
+    height_ctbs = AV_CEIL_RSHIFT(sps->pic_height_in_luma_samples, grid->ctb_log2_size);
+
+    if (pps->single_tile_in_pic_flag) {
+        grid->nb_columns = grid->nb_rows = 1;
+    } else {
+        grid->nb_columns = pps->num_tile_columns_minus1 + 1;
+        grid->nb_rows    = pps->num_tile_rows_minus1    + 1;
+    }
+
+    grid->column_start[0] = grid->row_start[0] = 0;
+    for (int i = 0; i < grid->nb_columns; i++) {
+        if (pps->single_tile_in_pic_flag || i == grid->nb_columns - 1)
+            grid->column_start[i + 1] = width_ctbs;
+        else if (pps->uniform_tile_spacing_flag)
+            grid->column_start[i + 1] = (i + 1) * width_ctbs / grid->nb_columns;
+        else
+            grid->column_start[i + 1] = grid->column_start[i] + pps->tile_column_width_minus1[i] + 1;
+    }
+    for (int i = 0; i < grid->nb_rows; i++) {
+        if (pps->single_tile_in_pic_flag || i == grid->nb_rows - 1)
+            grid->row_start[i + 1] = height_ctbs;
+        else if (pps->uniform_tile_spacing_flag)
+            grid->row_start[i + 1] = (i + 1) * height_ctbs / grid->nb_rows;
+        else
+            grid->row_start[i + 1] = grid->row_start[i] + pps->tile_row_height_minus1[i] + 1;
+    }
+
+    if (grid->column_start[grid->nb_columns - 1] >= width_ctbs ||
+        grid->row_start[grid->nb_rows - 1] >= height_ctbs) {
+        av_log(bsf, AV_LOG_ERROR, "Tile grid of PPS %d exceeds the picture.\n",
+               pps->pps_pic_parameter_set_id);
+        return AVERROR_INVALIDDATA;
+    }
+
+    if (ctx->column + ctx->columns > grid->nb_columns ||
+        ctx->row    + ctx->rows    > grid->nb_rows) {
+        av_log(bsf, AV_LOG_ERROR, "Tiles %dx%d at %d,%d are outside the "
+               "%dx%d tile grid of PPS %d.\n", ctx->columns, ctx->rows,
+               ctx->column, ctx->row, grid->nb_columns, grid->nb_rows,
+               pps->pps_pic_parameter_set_id);
+        return AVERROR(EINVAL);
+    }
+
+    return 0;
+}
+
+static int evc_tile_extract_update_pps(AVBSFContext *bsf, EVCRawPPS *pps,
+                                       const EVCRawSPS *sps)
+{
+    EVCTileExtractContext *ctx = bsf->priv_data;
+    EVCTileExtractSize *size = &ctx->sps_size[sps->sps_seq_parameter_set_id];
+    EVCTileGrid grid;
+    int last_column = ctx->column + ctx->columns;
+    int last_row    = ctx->row    + ctx->rows;
+    int width, height, err;
+    EVCRawPPS in = *pps;
+
+    err = evc_tile_extract_grid(bsf, sps, pps, &grid);
+    if (err < 0)
+        return err;
+
+    if (!pps->single_tile_in_pic_flag && pps->loop_filter_across_tiles_enabled_flag) {
+        av_log(bsf, AV_LOG_ERROR, "PPS %d filters across tile boundaries, "
+               "the tiles cannot be extracted.\n", pps->pps_pic_parameter_set_id);
+        return AVERROR_INVALIDDATA;
+    }
+
+    // tiles at the right and bottom picture edges keep their partial CTBs
+    if (last_column == grid.nb_columns)
+        width  = sps->pic_width_in_luma_samples -
+                 (grid.column_start[ctx->column] << grid.ctb_log2_size);
+    else
+        width  = (grid.column_start[last_column] - grid.column_start[ctx->column]) << grid.ctb_log2_size;
+    if (last_row == grid.nb_rows)
+        height = sps->pic_height_in_luma_samples -
+                 (grid.row_start[ctx->row] << grid.ctb_log2_size);
+    else
+        height = (grid.row_start[last_row] - grid.row_start[ctx->row]) << grid.ctb_log2_size;
+
+    if (size->width && (size->width != width || size->height != height)) {
+        av_log(bsf, AV_LOG_ERROR, "PPS referencing SPS %d define different "
+               "tile grids.\n", sps->sps_seq_parameter_set_id);
+        return AVERROR_PATCHWELCOME;
+    }
+    size->width       = width;
+    size->height      = height;
+    size->right_edge  = last_column == grid.nb_columns;
+    size->bottom_edge = last_row    == grid.nb_rows;
+
+    if (ctx->columns == 1 && ctx->rows == 1) {
+        pps->single_tile_in_pic_flag = 1;
+        pps->num_tile_columns_minus1 = 0;
+        pps->num_tile_rows_minus1    = 0;
+    } else {
+        pps->single_tile_in_pic_flag   = 0;
+        pps->num_tile_columns_minus1   = ctx->columns - 1;
+        pps->num_tile_rows_minus1      = ctx->rows    - 1;
+        pps->uniform_tile_spacing_flag = 0;
+        for (int i = 0; i < ctx->columns - 1; i++)
+            pps->tile_column_width_minus1[i] = grid.column_start[ctx->column + i + 1] -
+                                               grid.column_start[ctx->column + i] - 1;
+        for (int i = 0; i < ctx->rows - 1; i++)
+            pps->tile_row_height_minus1[i] = grid.row_start[ctx->row + i + 1] -
+                                             grid.row_start[ctx->row + i] - 1;
+        pps->loop_filter_across_tiles_enabled_flag = 0;
+    }
+
+    // explicit tile ids are kept, so the slice headers referring to them stay valid
+    if (in.explicit_tile_id_flag) {
+        for (int i = 0; i < ctx->rows; i++)
+            for (int j = 0; j < ctx->columns; j++)
+                pps->tile_id_val[i][j] = in.tile_id_val[ctx->row + i][ctx->column + j];
+    }
+
+    return 0;
+}
+
+static int evc_tile_extract_update_sps(AVBSFContext *bsf, EVCRawSPS *sps)
+{
+    EVCTileExtractContext *ctx = bsf->priv_data;
+    const EVCTileExtractSize *size = &ctx->sps_size[sps->sps_seq_parameter_set_id];
+
+    if (!size->width) {
+        av_log(bsf, AV_LOG_ERROR, "No PPS references SPS %d, the tile grid "
+               "is unknown.\n", sps->sps_seq_parameter_set_id);
+        return AVERROR_INVALIDDATA;
+    }
+
+    // the cropping only applies to the picture edges that are kept
+    if (sps->picture_cropping_flag) {
+        if (ctx->column)
+            sps->picture_crop_left_offset = 0;
+        if (ctx->row)
+            sps->picture_crop_top_offset = 0;
+        if (!size->right_edge)
+            sps->picture_crop_right_offset = 0;
+        if (!size->bottom_edge)
+            sps->picture_crop_bottom_offset = 0;
+
+        if (sps->picture_crop_left_offset + sps->picture_crop_right_offset >= size->width ||
+            sps->picture_crop_top_offset + sps->picture_crop_bottom_offset >= size->height) {
+            av_log(bsf, AV_LOG_ERROR, "The extracted tiles are cropped out.\n");
+            return AVERROR_INVALIDDATA;
+        }
+        sps->picture_cropping_flag = sps->picture_crop_left_offset || sps->picture_crop_right_offset ||
+                                     sps->picture_crop_top_offset  || sps->picture_crop_bottom_offset;
+    }
+
+    sps->pic_width_in_luma_samples  = size->width;
+    sps->pic_height_in_luma_samples = size->height;
+
+    ctx->out_width  = size->width  - sps->picture_crop_left_offset - sps->picture_crop_right_offset;
+    ctx->out_height = size->height - sps->picture_crop_top_offset  - sps->picture_crop_bottom_offset;
+
+    return 0;
+}
+
+static int evc_tile_extract_tile_position(const EVCRawPPS *pps, const EVCTileGrid *grid,
+                                          int tile_id, int *column, int *row)
+{
+    if (!pps->explicit_tile_id_flag) {
+        *column = tile_id % grid->nb_columns;
+        *row    = tile_id / grid->nb_columns;
+        return *row < grid->nb_rows ? 0 : AVERROR_INVALIDDATA;
+    }
+
+    for (int i = 0; i < grid->nb_rows; i++) {
+        for (int j = 0; j < grid->nb_columns; j++) {
+            if (pps->tile_id_val[i][j] == tile_id) {
+                *column = j;
+                *row    = i;
+                return 0;
+            }
+        }
+    }
+
+    return AVERROR_INVALIDDATA;
+}
+
+/**
+ * @return 1 if the slice is kept, 0 if it is dropped, negative error code on failure
+ */
+static int evc_tile_extract_update_slice(AVBSFContext *bsf, EVCRawSliceHeader *sh)
+{
+    EVCTileExtractContext *ctx = bsf->priv_data;
+    CodedBitstreamEVCContext *evc = ctx->common.input->priv_data;
+    // the input context holds the parameter sets as they were read
+    const EVCRawPPS *pps = evc->pps[sh->slice_pic_parameter_set_id];
+    const EVCRawSPS *sps = pps ? evc->sps[pps->pps_seq_parameter_set_id] : NULL;
+    int first_column, first_row, last_column, last_row;
+    int inside_first, inside_last;
+    EVCTileGrid grid;
+    int err;
+
+    if (!sps)
+        return AVERROR_INVALIDDATA;
+
+    err = evc_tile_extract_grid(bsf, sps, pps, &grid);
+    if (err < 0)
+        return err;
+
+    if (pps->single_tile_in_pic_flag)
+        return 1;
+
+    if (!sh->single_tile_in_slice_flag && sh->arbitrary_slice_flag) {
+        av_log(bsf, AV_LOG_ERROR, "Arbitrary slices are not supported.\n");
+        return AVERROR_PATCHWELCOME;
+    }
+
+    err = evc_tile_extract_tile_position(pps, &grid, sh->first_tile_id,
+                                         &first_column, &first_row);
+    if (err >= 0) {
+        if (sh->single_tile_in_slice_flag) {
+            last_column = first_column;
+            last_row    = first_row;
+        } else
+            err = evc_tile_extract_tile_position(pps, &grid, sh->last_tile_id,
+                                                 &last_column, &last_row);
+    }
+    if (err < 0) {
+        av_log(bsf, AV_LOG_ERROR, "Invalid tile id in slice header.\n");
+        return err;
+    }
+
+#define INSIDE(c, r) ((c) >= ctx->column && (c) < ctx->column + ctx->columns && \
+                      (r) >= ctx->row    && (r) < ctx->row    + ctx->rows)
+    inside_first = INSIDE(first_column, first_row);
+    inside_last  = INSIDE(last_column,  last_row);
+#undef INSIDE
+
+    if (!inside_first && !inside_last &&
+        (last_column < ctx->column || first_column >= ctx->column + ctx->columns ||
+         last_row    < ctx->row    || first_row    >= ctx->row    + ctx->rows))
+        return 0;
+
+    if (!inside_first || !inside_last) {
+        av_log(bsf, AV_LOG_ERROR, "Slice covering tiles %d to %d crosses the "
+               "boundary of the extracted tiles.\n", sh->first_tile_id,
+               sh->single_tile_in_slice_flag ? sh->first_tile_id : sh->last_tile_id);
+        return AVERROR_PATCHWELCOME;
+    }
+
+    if (!pps->explicit_tile_id_flag) {
+        sh->first_tile_id = (first_row - ctx->row) * ctx->columns + first_column - ctx->column;
+        sh->last_tile_id  = (last_row  - ctx->row) * ctx->columns + last_column  - ctx->column;
+    }
+    if (ctx->columns == 1 && ctx->rows == 1)
+        sh->single_tile_in_slice_flag = 1;
+
+    return 1;
+}
+
+static int evc_tile_extract_update_fragment(AVBSFContext *bsf, AVPacket *pkt,
+                                            CodedBitstreamFragment *au)
+{
+    EVCTileExtractContext *ctx = bsf->priv_data;
+    CodedBitstreamEVCContext *evc = ctx->common.input->priv_data;
+    int err;
+
+    // a new SPS takes the size given by the PPS following it
+    for (int i = 0; i < au->nb_units; i++) {
+        if (au->units[i].type == EVC_SPS_NUT) {
+            const EVCRawSPS *sps = au->units[i].content;
+            ctx->sps_size[sps->sps_seq_parameter_set_id] = (EVCTileExtractSize) { 0 };
+        }
+    }
+
+    // the parameter sets are copied before being rewritten, the input
+    // context keeps referencing the original ones to parse the slices
+    for (int i = 0; i < au->nb_units; i++) {
+        CodedBitstreamUnit *unit = &au->units[i];
+        EVCRawPPS *pps = unit->content;
+        const EVCRawSPS *sps;
+
+        if (unit->type != EVC_PPS_NUT)
+            continue;
+
+        sps = evc->sps[pps->pps_seq_parameter_set_id];
+        if (!sps) {
+            av_log(bsf, AV_LOG_ERROR, "SPS id %d not available.\n",
+                   pps->pps_seq_parameter_set_id);
+            return AVERROR_INVALIDDATA;
+        }
+
+        err = ff_cbs_make_unit_writable(ctx->common.input, unit);
+        if (err < 0)
+            return err;
+        err = evc_tile_extract_update_pps(bsf, unit->content, sps);
+        if (err < 0)
+            return err;
+    }
+
+    for (int i = 0; i < au->nb_units; i++) {
+        CodedBitstreamUnit *unit = &au->units[i];
+
+        if (unit->type != EVC_SPS_NUT)
+            continue;
+
+        err = ff_cbs_make_unit_writable(ctx->common.input, unit);
+        if (err < 0)
+            return err;
+        err = evc_tile_extract_update_sps(bsf, unit->content);
+        if (err < 0)
+            return err;
+    }
+
+    for (int i = au->nb_units - 1; i >= 0; i--) {
+        CodedBitstreamUnit *unit = &au->units[i];
+        EVCRawSlice *slice = unit->content;
+
+        if (unit->type != EVC_IDR_NUT && unit->type != EVC_NOIDR_NUT)
+            continue;
+
+        err = evc_tile_extract_update_slice(bsf, &slice->header);
+        if (err < 0)
+            return err;
+        if (!err)
+            ff_cbs_delete_unit(au, i);
+    }
+
+    return 0;
+}
+
+static const CBSBSFType evc_tile_extract_type = {
+    .codec_id        = AV_CODEC_ID_EVC,
+    .fragment_name   = "access unit",
+    .unit_name       = "NAL unit",
+    .update_fragment = &evc_tile_extract_update_fragment,
+};
+
+static int evc_tile_extract_init(AVBSFContext *bsf)
+{
+    EVCTileExtractContext *ctx = bsf->priv_data;
+    int err;
+
+    err = ff_cbs_bsf_generic_init(bsf, &evc_tile_extract_type);
+    if (err < 0)
+        return err;
+
+    // the output size is known when the parameter sets are in the extradata
+    if (ctx->out_width) {
+        bsf->par_out->width  = ctx->out_width;
+        bsf->par_out->height = ctx->out_height;
+    }
+
+    return 0;
+}
+
+#define OFFSET(x) offsetof(EVCTileExtractContext, x)
+#define FLAGS (AV_OPT_FLAG_VIDEO_PARAM|AV_OPT_FLAG_BSF_PARAM)
+static const AVOption evc_tile_extract_options[] = {
+    { "column", "First tile column to extract",
+        OFFSET(column), AV_OPT_TYPE_INT,
+        { .i64 = 0 }, 0, EVC_MAX_TILE_COLUMNS - 1, FLAGS },
+    { "row", "First tile row to extract",
+        OFFSET(row), AV_OPT_TYPE_INT,
+        { .i64 = 0 }, 0, EVC_MAX_TILE_ROWS - 1, FLAGS },
+    { "columns", "Number of tile columns to extract",
+        OFFSET(columns), AV_OPT_TYPE_INT,
+        { .i64 = 1 }, 1, EVC_MAX_TILE_COLUMNS, FLAGS },
+    { "rows", "Number of tile rows to extract",
+        OFFSET(rows), AV_OPT_TYPE_INT,
+        { .i64 = 1 }, 1, EVC_MAX_TILE_ROWS, FLAGS },
+
+    { NULL }
+};
+
+static const AVClass evc_tile_extract_class = {
+    .class_name = "evc_tile_extract_bsf",
+    .item_name  = av_default_item_name,
+    .option     = evc_tile_extract_options,
+    .version    = LIBAVUTIL_VERSION_INT,
+};
+
+static const enum AVCodecID evc_tile_extract_codec_ids[] = {
+    AV_CODEC_ID_EVC, AV_CODEC_ID_NONE,
+};
+
+const FFBitStreamFilter ff_evc_tile_extract_bsf = {
+    .p.name         = "evc_tile_extract",
+    .p.codec_ids    = evc_tile_extract_codec_ids,
+    .p.priv_class   = &evc_tile_extract_class,
+    .priv_data_size = sizeof(EVCTileExtractContext),
+    .init           = &evc_tile_extract_init,
+    .close          = &ff_cbs_bsf_generic_close,
+    .filter         = &ff_cbs_bsf_generic_filter,
+};
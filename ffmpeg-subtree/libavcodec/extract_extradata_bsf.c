@@ -26,6 +26,7 @@
 #include "bsf.h"
 #include "bsf_internal.h"
 #include "bytestream.h"
+#include "evc.h"
 #include "h2645_parse.h"
 #include "h264.h"
 #include "hevc.h"
@@ -44,6 +45,9 @@ typedef struct ExtractExtradataContext {
     /* H264/HEVC specific fields */
     H2645Packet h2645_pkt;
 
+    /* EVC specific fields */
+    int evc_length_size;    // size of the length prefixes of the packets, set by the evcC
+
     /* AVOptions */
     int remove;
 } ExtractExtradataContext;
@@ -227,6 +231,89 @@ static int extract_extradata_h2645(AVBSFContext *ctx, AVPacket *pkt,
     return 0;
 }
 
+static int extract_extradata_evc(AVBSFContext *ctx, AVPacket *pkt,
+                                 uint8_t **data, int *size)
+{
+    static const int extradata_nal_types[] = {
+        EVC_SPS_NUT, EVC_PPS_NUT, EVC_APS_NUT,
+    };
+
+    ExtractExtradataContext *s = ctx->priv_data;
+    const int length_size = s->evc_length_size;
+
+    int extradata_size = 0, filtered_size = 0;
+    int nb_extradata_nal_types = FF_ARRAY_ELEMS(extradata_nal_types);
+    int has_sps = 0;
+    const uint8_t *ptr = pkt->data, *end = pkt->data + pkt->size;
+
+    // NAL units are stored with a 4 byte length prefix, whatever the size of those of the packets
+    while (end - ptr > length_size) {
+        uint32_t nalu_size = ff_evc_nal_unit_length_n(ptr, end - ptr, length_size);
+        int nalu_type;
+
+        if (nalu_size > end - ptr - length_size)
+            return AVERROR_INVALIDDATA;
+
+        nalu_type = ff_evc_nal_unit_type(ptr + length_size, nalu_size);
+        if (val_in_array(extradata_nal_types, nb_extradata_nal_types, nalu_type)) {
+            extradata_size += EVC_NALU_LENGTH_PREFIX_SIZE + nalu_size;
+            if (nalu_type == EVC_SPS_NUT) has_sps = 1;
+        } else if (s->remove) {
+            filtered_size += length_size + nalu_size;
+        }
+        ptr += length_size + nalu_size;
+    }
+
+    if (extradata_size && has_sps) {
+        AVBufferRef *filtered_buf = NULL;
+        PutByteContext pb_filtered_data, pb_extradata;
+        uint8_t *extradata;
+
+        if (s->remove) {
+            filtered_buf = av_buffer_alloc(filtered_size + AV_INPUT_BUFFER_PADDING_SIZE);
+            if (!filtered_buf) {
+                return AVERROR(ENOMEM);
+            }
+            memset(filtered_buf->data + filtered_size, 0, AV_INPUT_BUFFER_PADDING_SIZE);
+        }
+
+        extradata = av_malloc(extradata_size + AV_INPUT_BUFFER_PADDING_SIZE);
+        if (!extradata) {
+            av_buffer_unref(&filtered_buf);
+            return AVERROR(ENOMEM);
+        }
+
+        *data = extradata;
+        *size = extradata_size;
+
+        bytestream2_init_writer(&pb_extradata, extradata, extradata_size);
+        if (s->remove)
+            bytestream2_init_writer(&pb_filtered_data, filtered_buf->data, filtered_size);
+
+        for (ptr = pkt->data; end - ptr > length_size;) {
+            uint32_t nalu_size = ff_evc_nal_unit_length_n(ptr, end - ptr, length_size);
+            int nalu_type = ff_evc_nal_unit_type(ptr + length_size, nalu_size);
+
+            if (val_in_array(extradata_nal_types, nb_extradata_nal_types, nalu_type)) {
+                bytestream2_put_be32u(&pb_extradata, nalu_size);
+                bytestream2_put_bufferu(&pb_extradata, ptr + length_size, nalu_size);
+            } else if (s->remove) {
+                bytestream2_put_bufferu(&pb_filtered_data, ptr, length_size + nalu_size);
+            }
+            ptr += length_size + nalu_size;
+        }
+
+        if (s->remove) {
+            av_buffer_unref(&pkt->buf);
+            pkt->buf  = filtered_buf;
+            pkt->data = filtered_buf->data;
+            pkt->size = filtered_size;
+        }
+    }
+
+    return 0;
+}
+
 static int extract_extradata_vc1(AVBSFContext *ctx, AVPacket *pkt,
                                  uint8_t **data, int *size)
 {
@@ -329,6 +416,7 @@ static const struct {
     { AV_CODEC_ID_AVS2,       extract_extradata_mpeg4   },
     { AV_CODEC_ID_AVS3,       extract_extradata_mpeg4   },
     { AV_CODEC_ID_CAVS,       extract_extradata_mpeg4   },
+    { AV_CODEC_ID_EVC,        extract_extradata_evc     },
     { AV_CODEC_ID_H264,       extract_extradata_h2645   },
     { AV_CODEC_ID_HEVC,       extract_extradata_h2645   },
     { AV_CODEC_ID_MPEG1VIDEO, extract_extradata_mpeg12  },
@@ -351,6 +439,14 @@ static int extract_extradata_init(AVBSFContext *ctx)
     if (!s->extract)
         return AVERROR_BUG;
 
+    if (ctx->par_in->codec_id == AV_CODEC_ID_EVC) {
+        s->evc_length_size = ff_evc_nal_length_size(ctx->par_in->extradata, ctx->par_in->extradata_size);
+        if (s->evc_length_size < 0) {
+            av_log(ctx, AV_LOG_ERROR, "Unsupported NAL unit length size in extradata\n");
+            return s->evc_length_size;
+        }
+    }
+
     return 0;
 }
 
@@ -398,6 +494,7 @@ static const enum AVCodecID codec_ids[] = {
     AV_CODEC_ID_AVS2,
     AV_CODEC_ID_AVS3,
     AV_CODEC_ID_CAVS,
+    AV_CODEC_ID_EVC,
     AV_CODEC_ID_H264,
     AV_CODEC_ID_HEVC,
     AV_CODEC_ID_MPEG1VIDEO,
@@ -52,6 +52,11 @@ typedef struct FramePool {
     int samples;
 } FramePool;
 
+static AVBufferRef *frame_pool_alloc_zeroed(void *opaque, size_t size)
+{
+    return av_buffer_allocz(size);
+}
+
 static void frame_pool_free(void *opaque, uint8_t *data)
 {
     FramePool *pool = (FramePool*)data;
@@ -152,10 +157,12 @@ FF_ENABLE_DEPRECATION_WARNINGS
                     ret = AVERROR(EINVAL);
                     goto fail;
                 }
-                pool->pools[i] = av_buffer_pool_init(size[i] + 16 + STRIDE_ALIGN - 1,
-                                                     CONFIG_MEMORY_POISONING ?
-                                                        NULL :
-                                                        av_buffer_allocz);
+                // the frames are often released by other threads than the decoding ones
+                pool->pools[i] = av_buffer_pool_init3(size[i] + 16 + STRIDE_ALIGN - 1, NULL,
+                                                      CONFIG_MEMORY_POISONING ?
+                                                         NULL :
+                                                         frame_pool_alloc_zeroed,
+                                                      NULL, AV_BUFFER_POOL_FLAG_LOCKLESS);
                 if (!pool->pools[i]) {
                     ret = AVERROR(ENOMEM);
                     goto fail;
@@ -174,7 +181,8 @@ FF_ENABLE_DEPRECATION_WARNINGS
         if (ret < 0)
             goto fail;
 
-        pool->pools[0] = av_buffer_pool_init(pool->linesize[0], NULL);
+        pool->pools[0] = av_buffer_pool_init3(pool->linesize[0], NULL, NULL, NULL,
+                                              AV_BUFFER_POOL_FLAG_LOCKLESS);
         if (!pool->pools[0]) {
             ret = AVERROR(ENOMEM);
             goto fail;
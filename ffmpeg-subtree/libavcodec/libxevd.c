@@ -22,6 +22,7 @@
  */
 
 #include <float.h>
+#include <stdatomic.h>
 #include <stdlib.h>
 
 #include <xevd.h>
@@ -33,6 +34,10 @@
 #include "libavutil/pixfmt.h"
 #include "libavutil/imgutils.h"
 #include "libavutil/cpu.h"
+#include "libavutil/fifo.h"
+#include "libavutil/thread.h"
+#include "libavutil/time.h"
+#include "libavutil/trace.h"
 
 #include "avcodec.h"
 #include "internal.h"
@@ -40,12 +45,180 @@
 #include "codec_internal.h"
 #include "profiles.h"
 #include "decode.h"
+#include "evc.h"
+#include "evc_parse.h"
+#include "golomb.h"
+#include "thread_affinity.h"
 
 #define XEVD_PARAM_BAD_NAME -1
 #define XEVD_PARAM_BAD_VALUE -2
 
 #define EVC_NAL_HEADER_SIZE 2 /* byte */
 
+// The size of the pool of XEVD_IMGB objects used by xevd_pull (MAX_PB_SIZE in xevd)
+#define XEVD_MAX_PB_SIZE 26
+
+// The maximum number of XEVD_IMGB objects that may be exported without copying at the same time.
+// XEVD takes its reference pictures from the same pool, so beyond this limit decoded images
+// are copied to keep the decoder from running out of pictures.
+#define XEVD_MAX_IMGB_IN_FLIGHT (XEVD_MAX_PB_SIZE / 2)
+
+// The number of access units whose properties are tracked while XEVD holds their pictures.
+// It must exceed the number of pictures that may be buffered by the decoder at a time.
+#define XEVD_AU_PROPS_RING_SIZE 64
+
+/**
+ * Reference counted XEVD instance.
+ * Frames exported without copying keep a reference to it, so the decoder
+ * and its picture pool outlive every frame still in use downstream.
+ */
+typedef struct XevdInstance {
+    XEVD id;                    // XEVD instance identifier @see xevd.h
+    atomic_int imgb_in_flight;  // number of XEVD_IMGB objects currently owned by AVFrames
+} XevdInstance;
+
+/**
+ * The data of the AVBufferRef wrapping the planes of a decoded XEVD_IMGB
+ */
+typedef struct XevdImgbRef {
+    XEVD_IMGB *imgb;
+    AVBufferRef *instance_ref;
+} XevdImgbRef;
+
+/**
+ * Properties of an access unit passed to XEVD, needed to fill the decoded frame.
+ * The packet is allocated once and only ever holds properties, never data.
+ */
+typedef struct XevdAuProps {
+    AVPacket *pkt;      // pts, dts, flags, side data and opaque_ref of the AU
+    uintptr_t seq;      // sequence number of the AU the properties belong to
+
+    // decoding statistics of the AU, exported as frame metadata if requested
+    int64_t decode_time; // time spent in xevd_decode(), in microseconds
+    int nb_nalus;       // number of NAL units passed to xevd_decode()
+    int bytes_read;     // number of bytes consumed by xevd_decode()
+    int slice_type;     // XEVD_ST_* of the last slice
+} XevdAuProps;
+
+/**
+ * Parameters of the active SPS, as reported by XEVD
+ */
+typedef struct XevdStreamParams {
+    int coded_width;
+    int coded_height;
+    int width;
+    int height;
+    int color_space;
+    int max_coding_delay; // sps->num_reorder_pics
+} XevdStreamParams;
+
+#if HAVE_THREADS
+/**
+ * A frame decoded by a GOP thread
+ */
+typedef struct XevdGopFrame {
+    AVFrame *frame;
+    int au;             // index of the access unit in the segment, needed to fill frame properties
+    int64_t pts;
+    int64_t dts;
+} XevdGopFrame;
+
+/**
+ * A closed GOP segment, starting at an IDR picture and decoded on its own with a separate XEVD instance
+ */
+typedef struct XevdGopSegment {
+    AVPacket **aus;     // access units in decoding order
+    int nb_aus;
+
+    uint8_t *ps;        // parameter sets to decode first, if the IDR access unit does not carry them
+    int ps_size;
+
+    AVFifo *frames;     // XevdGopFrame in output order, filled by the thread decoding the segment
+
+    // set under XevdGop.mutex once the segment is decoded
+    int done;
+    int err;
+} XevdGopSegment;
+
+/**
+ * The state of the GOP-parallel decoding mode
+ */
+typedef struct XevdGop {
+    pthread_t *threads;
+    int nb_threads;
+
+    pthread_mutex_t mutex;
+    pthread_cond_t job_cond;    // signaled when a segment is queued or when the threads have to quit
+    pthread_cond_t done_cond;   // signaled when a segment is decoded
+    int sync_init;
+
+    AVFifo *jobs;               // segments waiting for a thread, protected by mutex
+    int quit;
+    atomic_int abort;           // the segments in flight are dropped
+
+    // only accessed by the decoding thread
+    AVFifo *segments;           // segments handed to the threads, in decoding order
+    XevdGopSegment *cur;        // segment being collected
+    uint8_t *ps;                // the last parameter sets seen in the stream
+    int ps_size;
+    int eof;
+} XevdGop;
+
+enum XevdAsyncEventType {
+    XEVD_ASYNC_IMAGE,   // a picture was pulled
+    XEVD_ASYNC_PARAMS,  // an SPS was decoded
+    XEVD_ASYNC_ERROR,   // decoding an access unit failed
+    XEVD_ASYNC_EOF,     // every picture was pulled after the end of the stream
+};
+
+/**
+ * Output of the asynchronous decoding thread, handled by the thread calling the decoder
+ */
+typedef struct XevdAsyncEvent {
+    enum XevdAsyncEventType type;
+    XEVD_IMGB *imgb;
+    int64_t pull_time;
+    XevdStreamParams params;
+    int err;
+} XevdAsyncEvent;
+
+/**
+ * An access unit waiting for the asynchronous decoding thread, a NULL packet marks the end of the stream
+ */
+typedef struct XevdAsyncPacket {
+    AVPacket *pkt;
+    XevdAuProps *props;
+    enum AVDiscard skip_frame;  // avctx->skip_frame when the packet was queued
+} XevdAsyncPacket;
+
+/**
+ * The state of the asynchronous decoding mode
+ *
+ * XEVD runs in a thread of its own, so the calling thread only queues access units
+ * and exports the pulled pictures. Everything touching the codec context is done
+ * by the calling thread.
+ */
+typedef struct XevdAsync {
+    pthread_t thread;
+    int thread_init;
+
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;        // signaled when a packet is queued or taken, an event is posted or the thread has to quit
+    int sync_init;
+
+    // protected by mutex
+    AVFifo *packets;            // XevdAsyncPacket, bounded by the async option
+    AVFifo *events;             // XevdAsyncEvent in output order
+    int busy;                   // the thread is decoding a packet
+    int quit;
+
+    // only accessed by the calling thread
+    int eof_pending;            // the end of the stream has to be queued
+    int eof_sent;
+    int eof;
+} XevdAsync;
+#endif
+
 /**
  * The structure stores all the states associated with the instance of Xeve MPEG-5 EVC decoder
  */
@@ -55,11 +228,47 @@ typedef struct XevdContext {
     XEVD id;            // XEVD instance identifier @see xevd.h
     XEVD_CDSC cdsc;     // decoding parameters @see xevd.h
 
+    AVBufferRef *instance_ref;  // reference to XevdInstance owning id
+
+    int zero_copy;      // export decoded images without copying them out of XEVD_IMGB
+    int max_exported;   // maximum number of images exported without copying at the same time
+    int exported_peak;  // highest number of images exported without copying at the same time so far
+    int queued_peak;    // highest number of decoded frames waiting to be returned so far
+    enum AVPixelFormat output_pix_fmt; // requested output pixel format, AV_PIX_FMT_NONE for the XEVD native one
+    int dither;         // ordered dithering instead of rounding for 8-bit output
+    int stats;          // export per-frame decoding statistics as frame metadata
+    int nalu_length_size; // size of the NAL unit length prefixes, set by the evcC
+
     // If end of stream occurs it is required "flushing" (aka draining) the codec,
     // as the codec might buffer multiple frames or packets internally.
     int draining_mode; // The flag is set if codec enters draining mode.
 
     AVPacket *pkt;     // access unit (a set of NAL units that are consecutive in decoding order and containing exactly one encoded image)
+
+    AVFifo *frames;    // decoded frames pulled from XEVD and not yet returned to the caller
+
+    // Ring of AU properties, indexed by the AU sequence number carried through XEVD_BITB.pdata[0]
+    XevdAuProps au_props[XEVD_AU_PROPS_RING_SIZE];
+    uintptr_t au_seq;  // sequence number of the last AU sent to XEVD
+
+    uintptr_t flush_seq; // pictures of the AUs up to this sequence number were flushed
+    int wait_idr;      // non-IDR slices are skipped until the next IDR picture after a flush
+    EVCParserContext ps; // SPS and PPS of the stream, telling the slices of the unreferenced sub-layer
+    int low_delay;     // the active SPS allows no reordering, pictures are pulled as soon as they are decoded
+    int has_stream_params; // the picture size and format of a first SPS were exported
+
+    int gop_threads;   // number of closed GOP segments decoded in parallel by separate XEVD instances
+    int async;         // number of access units queued for the asynchronous decoding thread
+
+    int nal_input;     // packets may hold a part of an AU, an AU starts with new timestamps
+    XevdAuProps *nal_props; // properties of the AU the last NAL units belong to, NULL if none
+    int nal_fnum;      // frame number of that AU, negative if no picture was decoded yet
+#if HAVE_THREADS
+    XevdGop *gop;
+    XevdAsync *async_ctx;
+#endif
+
+    char *cpus;        // CPUs the XEVD and GOP threads are restricted to
 } XevdContext;
 
 /**
@@ -72,7 +281,7 @@ typedef struct XevdContext {
  */
 static void get_conf(AVCodecContext *avctx, XEVD_CDSC *cdsc)
 {
-    int cpu_count = av_cpu_count();
+    int cpu_count = ff_thread_available_cpus(avctx);
 
     /* clear XEVS_CDSC structure */
     memset(cdsc, 0, sizeof(XEVD_CDSC));
@@ -89,6 +298,7 @@ static void get_conf(AVCodecContext *avctx, XEVD_CDSC *cdsc)
 /**
  * Read NAL unit length
  * @param bs input data (bitstream)
+ * @param bs_size size of the length prefix, XEVD only reads 4 byte ones
  * @return the length of NAL unit on success, 0 value on failure
  */
 static uint32_t read_nal_unit_length(const uint8_t *bs, int bs_size, AVCodecContext *avctx)
@@ -97,7 +307,11 @@ static uint32_t read_nal_unit_length(const uint8_t *bs, int bs_size, AVCodecCont
     XEVD_INFO info;
     int ret;
 
-    if (bs_size == XEVD_NAL_UNIT_LENGTH_BYTE) {
+    if (bs_size != XEVD_NAL_UNIT_LENGTH_BYTE) {
+        len = ff_evc_nal_unit_length_n(bs, bs_size, bs_size);
+        if (len == 0)
+            av_log(avctx, AV_LOG_ERROR, "Invalid bitstream size! [%d]\n", bs_size);
+    } else {
         ret = xevd_info((void *)bs, XEVD_NAL_UNIT_LENGTH_BYTE, 1, &info);
         if (XEVD_FAILED(ret)) {
             av_log(avctx, AV_LOG_ERROR, "Cannot get bitstream information\n");
@@ -114,386 +328,2324 @@ static uint32_t read_nal_unit_length(const uint8_t *bs, int bs_size, AVCodecCont
 }
 
 /**
+ * @param[in] cs XEVD color space
+ * @return the pixel format XEVD outputs pictures of color space cs in, AV_PIX_FMT_NONE if unknown
+ */
+static enum AVPixelFormat libxevd_cs_to_pix_fmt(int cs)
+{
+    switch (cs) {
+    case XEVD_CS_YCBCR400_10LE: return AV_PIX_FMT_GRAY10LE;
+    case XEVD_CS_YCBCR420_10LE: return AV_PIX_FMT_YUV420P10LE;
+    case XEVD_CS_YCBCR422_10LE: return AV_PIX_FMT_YUV422P10LE;
+    case XEVD_CS_YCBCR444_10LE: return AV_PIX_FMT_YUV444P10LE;
+    default:                    return AV_PIX_FMT_NONE;
+    }
+}
+
+/**
+ * @param[in] xectx
+ * @param[in] cs XEVD color space
+ * @return the pixel format of the frames output for pictures of color space cs, AV_PIX_FMT_NONE if unknown
+ */
+static enum AVPixelFormat libxevd_output_pix_fmt(const XevdContext *xectx, int cs)
+{
+    enum AVPixelFormat pix_fmt = libxevd_cs_to_pix_fmt(cs);
+
+    // the conversions are only done for 4:2:0, the image is converted while it is copied out of XEVD_IMGB
+    if (xectx->output_pix_fmt != AV_PIX_FMT_NONE && pix_fmt == AV_PIX_FMT_YUV420P10LE)
+        pix_fmt = xectx->output_pix_fmt;
+
+    return pix_fmt;
+}
+
+/**
+ * Query the parameters of the active SPS from XEVD
+ *
+ * Called from the thread decoding with the XEVD instance, which also updates
+ * the low delay state used while pulling pictures.
+ *
  * @param[in] xectx the structure that stores all the state associated with the instance of Xeve MPEG-5 EVC decoder
- * @param[out] avctx codec context
+ * @param[in] logctx context for logging
+ * @param[out] params stream parameters
  * @return 0 on success, negative value on failure
  */
-static int export_stream_params(const XevdContext *xectx, AVCodecContext *avctx)
+static int get_stream_params(XevdContext *xectx, void *logctx, XevdStreamParams *params)
 {
     int ret;
     int size;
-    int color_space;
-
-    avctx->pix_fmt = AV_PIX_FMT_YUV420P10;
 
     size = 4;
-    ret = xevd_config(xectx->id, XEVD_CFG_GET_CODED_WIDTH, &avctx->coded_width, &size);
+    ret = xevd_config(xectx->id, XEVD_CFG_GET_CODED_WIDTH, &params->coded_width, &size);
     if (XEVD_FAILED(ret)) {
-        av_log(avctx, AV_LOG_ERROR, "Failed to get coded_width\n");
+        av_log(logctx, AV_LOG_ERROR, "Failed to get coded_width\n");
         return AVERROR_EXTERNAL;
     }
 
-    ret = xevd_config(xectx->id, XEVD_CFG_GET_CODED_HEIGHT, &avctx->coded_height, &size);
+    ret = xevd_config(xectx->id, XEVD_CFG_GET_CODED_HEIGHT, &params->coded_height, &size);
     if (XEVD_FAILED(ret)) {
-        av_log(avctx, AV_LOG_ERROR, "Failed to get coded_height\n");
+        av_log(logctx, AV_LOG_ERROR, "Failed to get coded_height\n");
         return AVERROR_EXTERNAL;
     }
 
-    ret = xevd_config(xectx->id, XEVD_CFG_GET_WIDTH, &avctx->width, &size);
+    ret = xevd_config(xectx->id, XEVD_CFG_GET_WIDTH, &params->width, &size);
     if (XEVD_FAILED(ret)) {
-        av_log(avctx, AV_LOG_ERROR, "Failed to get width\n");
+        av_log(logctx, AV_LOG_ERROR, "Failed to get width\n");
         return AVERROR_EXTERNAL;
     }
 
-    ret = xevd_config(xectx->id, XEVD_CFG_GET_HEIGHT, &avctx->height, &size);
+    ret = xevd_config(xectx->id, XEVD_CFG_GET_HEIGHT, &params->height, &size);
     if (XEVD_FAILED(ret)) {
-        av_log(avctx, AV_LOG_ERROR, "Failed to get height\n");
+        av_log(logctx, AV_LOG_ERROR, "Failed to get height\n");
         return AVERROR_EXTERNAL;
     }
 
-    ret = xevd_config(xectx->id, XEVD_CFG_GET_COLOR_SPACE, &color_space, &size);
+    ret = xevd_config(xectx->id, XEVD_CFG_GET_COLOR_SPACE, &params->color_space, &size);
     if (XEVD_FAILED(ret)) {
-        av_log(avctx, AV_LOG_ERROR, "Failed to get color_space\n");
+        av_log(logctx, AV_LOG_ERROR, "Failed to get color_space\n");
         return AVERROR_EXTERNAL;
     }
-    switch(color_space) {
-    case XEVD_CS_YCBCR400_10LE:
-        avctx->pix_fmt = AV_PIX_FMT_GRAY10LE;
-        break;
-    case XEVD_CS_YCBCR420_10LE:
-        avctx->pix_fmt = AV_PIX_FMT_YUV420P10LE;
-        break;
-    case XEVD_CS_YCBCR422_10LE:
-        avctx->pix_fmt = AV_PIX_FMT_YUV422P10LE;
-        break;
-    case XEVD_CS_YCBCR444_10LE:
-        avctx->pix_fmt = AV_PIX_FMT_YUV444P10LE;
-        break;
-    default:
-        av_log(avctx, AV_LOG_ERROR, "Unknown color space\n");
-        avctx->pix_fmt = AV_PIX_FMT_NONE;
-        return AVERROR_INVALIDDATA;
-    }
 
     // the function returns sps->num_reorder_pics
-    ret = xevd_config(xectx->id, XEVD_CFG_GET_MAX_CODING_DELAY, &avctx->max_b_frames, &size);
+    ret = xevd_config(xectx->id, XEVD_CFG_GET_MAX_CODING_DELAY, &params->max_coding_delay, &size);
     if (XEVD_FAILED(ret)) {
-        av_log(avctx, AV_LOG_ERROR, "Failed to get max_coding_delay\n");
+        av_log(logctx, AV_LOG_ERROR, "Failed to get max_coding_delay\n");
         return AVERROR_EXTERNAL;
     }
 
-    avctx->has_b_frames = (avctx->max_b_frames) ? 1 : 0;
+    // without reordering, every picture can be output as soon as it is decoded
+    xectx->low_delay = !params->max_coding_delay;
 
     return 0;
 }
 
 /**
- * @brief Copy image in imgb to frame.
+ * Export the stream parameters to the codec context
  *
- * @param avctx codec context
- * @param[in] imgb
- * @param[out] frame
+ * Only the first SPS sets the picture size and format. After a change of
+ * resolution the pictures of the previous SPS still waiting in the DPB keep
+ * their size, so the context is switched when the first picture of the new
+ * SPS is exported. The XEVD instance is kept and the frame pools are resized
+ * once, instead of back and forth.
+ *
+ * @param[in] xectx the structure that stores all the state associated with the instance of Xeve MPEG-5 EVC decoder
+ * @param[out] avctx codec context
+ * @param[in] params stream parameters
  * @return 0 on success, negative value on failure
  */
-static int libxevd_image_copy(struct AVCodecContext *avctx, XEVD_IMGB *imgb, struct AVFrame *frame)
+static int set_stream_params(XevdContext *xectx, AVCodecContext *avctx, const XevdStreamParams *params)
 {
-    int ret;
-    if (imgb->cs != XEVD_CS_YCBCR420_10LE) {
-        av_log(avctx, AV_LOG_ERROR, "Not supported pixel format: %s\n", av_get_pix_fmt_name(avctx->pix_fmt));
+    enum AVPixelFormat pix_fmt = libxevd_output_pix_fmt(xectx, params->color_space);
+
+    if (pix_fmt == AV_PIX_FMT_NONE) {
+        av_log(avctx, AV_LOG_ERROR, "Unknown color space\n");
         return AVERROR_INVALIDDATA;
     }
 
-    if (imgb->w[0] != avctx->width || imgb->h[0] != avctx->height) { // stream resolution changed
-        if (ff_set_dimensions(avctx, imgb->w[0], imgb->h[0]) < 0) {
-            av_log(avctx, AV_LOG_ERROR, "Cannot set new dimension\n");
-            return AVERROR_INVALIDDATA;
-        }
+    if (!xectx->has_stream_params) {
+        avctx->coded_width  = params->coded_width;
+        avctx->coded_height = params->coded_height;
+        avctx->width        = params->width;
+        avctx->height       = params->height;
+        avctx->pix_fmt      = pix_fmt;
+        xectx->has_stream_params = 1;
+    } else if (params->coded_width != avctx->coded_width || params->coded_height != avctx->coded_height) {
+        av_log(avctx, AV_LOG_VERBOSE, "New SPS of %dx%d, switching from %dx%d at its first picture\n",
+               params->width, params->height, avctx->width, avctx->height);
     }
 
-    if (ret = ff_get_buffer(avctx, frame, 0) < 0)
-        return ret;
+    avctx->max_b_frames = params->max_coding_delay;
+    avctx->has_b_frames = (avctx->max_b_frames) ? 1 : 0;
 
-    av_image_copy(frame->data, frame->linesize, (const uint8_t **)imgb->a,
-                  imgb->s, avctx->pix_fmt,
-                  imgb->w[0], imgb->h[0]);
+    if ((avctx->flags & AV_CODEC_FLAG_LOW_DELAY) && avctx->max_b_frames)
+        av_log(avctx, AV_LOG_WARNING, "The stream reorders pictures, low delay output is not possible\n");
 
     return 0;
 }
 
 /**
- * Initialize decoder
- * Create a decoder instance and allocate all the needed resources
- *
- * @param avctx codec context
- * @return 0 on success, negative error code on failure
+ * @param[in] xectx the structure that stores all the state associated with the instance of Xeve MPEG-5 EVC decoder
+ * @param[out] avctx codec context
+ * @return 0 on success, negative value on failure
  */
-static av_cold int libxevd_init(AVCodecContext *avctx)
+static int export_stream_params(XevdContext *xectx, AVCodecContext *avctx)
 {
-    XevdContext *xectx = avctx->priv_data;
-    XEVD_CDSC *cdsc = &(xectx->cdsc);
+    XevdStreamParams params;
+    int ret;
 
-    /* read configurations and set values for created descriptor (XEVD_CDSC) */
-    get_conf(avctx, cdsc);
+    ret = get_stream_params(xectx, avctx, &params);
+    if (ret < 0)
+        return ret;
 
-    /* create decoder */
-    xectx->id = xevd_create(&(xectx->cdsc), NULL);
-    if (xectx->id == NULL) {
-        av_log(avctx, AV_LOG_ERROR, "Cannot create XEVD encoder\n");
-        return AVERROR_EXTERNAL;
-    }
+    return set_stream_params(xectx, avctx, &params);
+}
 
-    xectx->draining_mode = 0;
-    xectx->pkt = av_packet_alloc();
-    if (!xectx->pkt) {
-        av_log(avctx, AV_LOG_ERROR, "Cannot allocate memory for AVPacket\n");
-        return AVERROR(ENOMEM);
-    }
+static void libxevd_instance_free(void *opaque, uint8_t *data)
+{
+    XevdInstance *instance = (XevdInstance *)data;
 
-    return 0;
+    if (instance->id)
+        xevd_delete(instance->id);
+
+    av_free(instance);
+}
+
+static void libxevd_imgb_free(void *opaque, uint8_t *data)
+{
+    XevdImgbRef *ref = (XevdImgbRef *)data;
+    XevdInstance *instance = (XevdInstance *)ref->instance_ref->data;
+
+    ref->imgb->release(ref->imgb);
+    atomic_fetch_sub_explicit(&instance->imgb_in_flight, 1, memory_order_relaxed);
+
+    av_buffer_unref(&ref->instance_ref);
+    av_free(ref);
 }
 
 /**
-  * Decode frame with decoupled packet/frame dataflow
-  *
-  * @param avctx codec context
-  * @param[out] frame decoded frame
-  *
-  * @return 0 on success, negative error code on failure
-  */
-static int libxevd_receive_frame(AVCodecContext *avctx, AVFrame *frame)
+ * @brief Export the SPS picture cropping of image in imgb through the frame cropping fields.
+ *
+ * The offsets are coded in units of chroma samples.
+ *
+ * @param[in] imgb
+ * @param[in] pix_fmt pixel format of the picture
+ * @param[out] frame
+ */
+static void libxevd_image_cropping(const XEVD_IMGB *imgb, enum AVPixelFormat pix_fmt, AVFrame *frame)
 {
-    XevdContext *xectx = avctx->priv_data;
-    AVPacket *pkt = xectx->pkt;
-    XEVD_IMGB *imgb = NULL;
+    const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(pix_fmt);
 
-    int xevd_ret = 0;
-    int ret = 0;
+    if (!imgb->crop_idx || !desc)
+        return;
 
-    // obtain access unit (input data) - a set of NAL units that are consecutive in decoding order and containing exactly one encoded image
-    ret = ff_decode_get_packet(avctx, pkt);
-    if (ret < 0 && ret != AVERROR_EOF) {
-        av_packet_unref(pkt);
+    frame->crop_left   = (size_t)imgb->crop_l << desc->log2_chroma_w;
+    frame->crop_right  = (size_t)imgb->crop_r << desc->log2_chroma_w;
+    frame->crop_top    = (size_t)imgb->crop_t << desc->log2_chroma_h;
+    frame->crop_bottom = (size_t)imgb->crop_b << desc->log2_chroma_h;
+}
 
-        return ret;
-    } else if(ret == AVERROR_EOF && xectx->draining_mode == 0) { // End of stream situations. Enter draining mode
+/**
+ * @brief Copy 4:2:0 10-bit image in imgb to P010 planes.
+ *
+ * Samples are moved to the most significant bits and chroma is interleaved in the same pass.
+ *
+ * @param[in] imgb
+ * @param[out] dst destination planes
+ * @param[in] dst_linesize destination linesizes
+ */
+static void libxevd_image_copy_p010(const XEVD_IMGB *imgb, uint8_t *const dst[4], const int dst_linesize[4])
+{
+    for (int y = 0; y < imgb->h[0]; y++) {
+        const uint16_t *src = (const uint16_t *)((const uint8_t *)imgb->a[0] + y * imgb->s[0]);
+        uint16_t *d = (uint16_t *)(dst[0] + y * dst_linesize[0]);
 
-        xectx->draining_mode = 1;
-        av_packet_unref(pkt);
+        for (int x = 0; x < imgb->w[0]; x++)
+            d[x] = src[x] << 6;
     }
 
-    if (pkt->size > 0) {
-        int bs_read_pos = 0;
-        XEVD_STAT stat;
-        XEVD_BITB bitb;
-        int nalu_size;
-        AVPacket* pkt_au;
-        imgb = NULL;
+    for (int y = 0; y < imgb->h[1]; y++) {
+        const uint16_t *u = (const uint16_t *)((const uint8_t *)imgb->a[1] + y * imgb->s[1]);
+        const uint16_t *v = (const uint16_t *)((const uint8_t *)imgb->a[2] + y * imgb->s[2]);
+        uint16_t *d = (uint16_t *)(dst[1] + y * dst_linesize[1]);
 
-        pkt_au = av_packet_clone(pkt);
-        if (!pkt_au) {
-            av_log(avctx, AV_LOG_ERROR, "Cannot clone AVPacket\n");
-            av_packet_unref(pkt);
-            return AVERROR(ENOMEM);
+        for (int x = 0; x < imgb->w[1]; x++) {
+            d[2 * x]     = u[x] << 6;
+            d[2 * x + 1] = v[x] << 6;
         }
+    }
+}
 
-        av_packet_unref(pkt);
-
-        // get all nal units from AU
-        while(pkt_au->size > (bs_read_pos + XEVD_NAL_UNIT_LENGTH_BYTE)) {
-            memset(&stat, 0, sizeof(XEVD_STAT));
+/**
+ * @brief Convert a plane of 10-bit samples in imgb to 8 bits.
+ *
+ * Samples are rounded to nearest, or ordered dithered with a 4x4 Bayer matrix.
+ * With step 2, every other destination sample is written, for interleaved chroma.
+ */
+static void libxevd_plane_to_8bit(const XEVD_IMGB *imgb, int plane, uint8_t *dst, int dst_linesize,
+                                  int step, int dither)
+{
+    static const uint8_t bayer[4][4] = {
+        {  0,  8,  2, 10 },
+        { 12,  4, 14,  6 },
+        {  3, 11,  1,  9 },
+        { 15,  7, 13,  5 },
+    };
+
+    for (int y = 0; y < imgb->h[plane]; y++) {
+        const uint16_t *src = (const uint16_t *)((const uint8_t *)imgb->a[plane] + y * imgb->s[plane]);
+        uint8_t *d = dst + y * dst_linesize;
+
+        if (dither) {
+            const uint8_t *row = bayer[y & 3];
+            for (int x = 0; x < imgb->w[plane]; x++)
+                d[x * step] = FFMIN((src[x] * 4 + row[x & 3]) >> 4, 255);
+        } else {
+            for (int x = 0; x < imgb->w[plane]; x++)
+                d[x * step] = FFMIN((src[x] + 2) >> 2, 255);
+        }
+    }
+}
 
-            nalu_size = read_nal_unit_length(pkt_au->data + bs_read_pos, XEVD_NAL_UNIT_LENGTH_BYTE, avctx);
-            if (nalu_size == 0) {
-                av_log(avctx, AV_LOG_ERROR, "Invalid bitstream\n");
-                av_packet_free(&pkt_au);
-                ret = AVERROR_INVALIDDATA;
+/**
+ * @brief Copy image in imgb to planes of the given pixel format.
+ *
+ * Conversions to the formats other than the XEVD one are done in the same pass as the copy.
+ *
+ * @param[in] imgb
+ * @param[out] dst destination planes
+ * @param[in] dst_linesize destination linesizes
+ * @param[in] pix_fmt pixel format of the destination planes
+ * @param[in] dither use ordered dithering instead of rounding when reducing the bit depth
+ */
+static void libxevd_image_convert(const XEVD_IMGB *imgb, uint8_t *dst[4], int dst_linesize[4],
+                                  enum AVPixelFormat pix_fmt, int dither)
+{
+    switch (pix_fmt) {
+    case AV_PIX_FMT_P010LE:
+        libxevd_image_copy_p010(imgb, dst, dst_linesize);
+        break;
+    case AV_PIX_FMT_YUV420P:
+        for (int i = 0; i < 3; i++)
+            libxevd_plane_to_8bit(imgb, i, dst[i], dst_linesize[i], 1, dither);
+        break;
+    case AV_PIX_FMT_NV12:
+        libxevd_plane_to_8bit(imgb, 0, dst[0], dst_linesize[0], 1, dither);
+        libxevd_plane_to_8bit(imgb, 1, dst[1],     dst_linesize[1], 2, dither);
+        libxevd_plane_to_8bit(imgb, 2, dst[1] + 1, dst_linesize[1], 2, dither);
+        break;
+    default:
+        av_image_copy(dst, dst_linesize, (const uint8_t **)imgb->a,
+                      imgb->s, pix_fmt,
+                      imgb->w[0], imgb->h[0]);
+    }
+}
 
-                return ret;
-            }
-            bs_read_pos += XEVD_NAL_UNIT_LENGTH_BYTE;
+/**
+ * @brief Copy image in imgb to frame.
+ *
+ * @param avctx codec context
+ * @param[in] imgb
+ * @param[out] frame
+ * @return 0 on success, negative value on failure
+ */
+static int libxevd_image_copy(struct AVCodecContext *avctx, XEVD_IMGB *imgb, struct AVFrame *frame)
+{
+    XevdContext *xectx = avctx->priv_data;
+    int ret;
 
-            bitb.addr = pkt_au->data + bs_read_pos;
-            bitb.ssize = nalu_size;
-            bitb.pdata[0] = pkt_au;
-            bitb.ts[XEVD_TS_DTS] = pkt_au->dts;
+    if ((ret = ff_get_buffer(avctx, frame, 0)) < 0)
+        return ret;
 
-            /* main decoding block */
-            xevd_ret = xevd_decode(xectx->id, &bitb, &stat);
-            if (XEVD_FAILED(xevd_ret)) {
-                av_log(avctx, AV_LOG_ERROR, "Failed to decode bitstream\n");
+    FF_TRACE_BEGIN("libxevd_image_copy", -1, -1, -1);
+    libxevd_image_convert(imgb, frame->data, frame->linesize, avctx->pix_fmt, xectx->dither);
+    FF_TRACE_END("libxevd_image_copy", -1, -1, -1);
 
-                av_packet_free(&pkt_au);
+    return 0;
+}
 
-                return AVERROR_EXTERNAL;
-            }
+/**
+ * xevd_decode() tagged with the NAL unit type and size of bitb for tracing,
+ * and with the POC of the slice once decoded
+ */
+static int libxevd_decode_nalu(XEVD id, XEVD_BITB *bitb, XEVD_STAT *stat)
+{
+    int ret;
 
-            bs_read_pos += nalu_size;
+    FF_TRACE_BEGIN("xevd_decode", -1, ff_evc_nal_unit_type(bitb->addr, bitb->ssize), bitb->ssize);
+    ret = xevd_decode(id, bitb, stat);
+    FF_TRACE_END("xevd_decode", stat->fnum >= 0 ? stat->poc : -1, -1, stat->read);
 
-            if (stat.nalu_type == XEVD_NUT_SPS) { // EVC stream parameters changed
-                if ((ret = export_stream_params(xectx, avctx)) != 0) {
-                    av_log(avctx, AV_LOG_ERROR, "Failed to export stream params\n");
+    return ret;
+}
 
-                    av_packet_free(&pkt_au);
+/**
+ * xevd_pull() inside a tracing slice
+ */
+static int libxevd_pull(XEVD id, XEVD_IMGB **imgb)
+{
+    int ret;
 
-                    return ret;
-                }
-            }
+    FF_TRACE_BEGIN("xevd_pull", -1, -1, -1);
+    ret = xevd_pull(id, imgb);
+    FF_TRACE_END("xevd_pull", -1, -1, -1);
 
-            if (stat.read != nalu_size)
-                av_log(avctx, AV_LOG_INFO, "Different reading of bitstream (in:%d, read:%d)\n,", nalu_size, stat.read);
+    return ret;
+}
 
-            // stat.fnum - has negative value if the decoded data is not frame
-            if (stat.fnum >= 0) {
+/**
+ * @brief Wrap the planes of image in imgb into frame without copying.
+ *
+ * The frame takes its own reference to imgb, so the caller still has to release it.
+ * The frame buffers are read-only, as XEVD may keep using the picture for reference.
+ *
+ * @param avctx codec context
+ * @param[in] imgb
+ * @param[out] frame
+ * @return 0 on success, negative value on failure
+ */
+static int libxevd_image_wrap(struct AVCodecContext *avctx, XEVD_IMGB *imgb, struct AVFrame *frame)
+{
+    XevdContext *xectx = avctx->priv_data;
+    XevdInstance *instance = (XevdInstance *)xectx->instance_ref->data;
+    XevdImgbRef *ref;
+    int in_flight, ret;
 
-                xevd_ret = xevd_pull(xectx->id, &imgb); // The function returns a valid image only if the return code is XEVD_OK
+    frame->width  = imgb->w[0];
+    frame->height = imgb->h[0];
 
-                if (XEVD_FAILED(xevd_ret)) {
-                    av_log(avctx, AV_LOG_ERROR, "Failed to pull the decoded image (xevd error code: %d, frame#=%d)\n", xevd_ret, stat.fnum);
+    ret = ff_decode_frame_props(avctx, frame);
+    if (ret < 0)
+        return ret;
 
-                    av_packet_free(&pkt_au);
+    // done by ff_get_buffer() for the frames allocated through get_buffer2()
+    ret = ff_attach_decode_data(frame);
+    if (ret < 0)
+        return ret;
 
-                    return AVERROR_EXTERNAL;
-                } else if (xevd_ret == XEVD_OK_FRM_DELAYED) {
-                    if(bs_read_pos == pkt_au->size) {
-                        return AVERROR(EAGAIN);
-                    }
-                } else { // XEVD_OK
-                    if (!imgb) {
-                        if(bs_read_pos == pkt_au->size) {
-                            av_log(avctx, AV_LOG_ERROR, "Invalid decoded image data\n");
+    ref = av_mallocz(sizeof(*ref));
+    if (!ref)
+        return AVERROR(ENOMEM);
 
-                            av_packet_free(&pkt_au);
+    ref->instance_ref = av_buffer_ref(xectx->instance_ref);
+    if (!ref->instance_ref) {
+        av_free(ref);
+        return AVERROR(ENOMEM);
+    }
+    ref->imgb = imgb;
 
-                            return  AVERROR(EAGAIN);
-                        }
-                    } else {
-                        // got frame
-                        AVPacket* pkt_au_imgb = (AVPacket*)imgb->pdata[0];
+    frame->buf[0] = av_buffer_create((uint8_t *)ref, sizeof(*ref), libxevd_imgb_free,
+                                     NULL, AV_BUFFER_FLAG_READONLY);
+    if (!frame->buf[0]) {
+        av_buffer_unref(&ref->instance_ref);
+        av_free(ref);
+        return AVERROR(ENOMEM);
+    }
 
-                        if(!pkt_au_imgb) {
-                            av_log(avctx, AV_LOG_ERROR, "Invalid data needed to fill frame properties\n");
+    imgb->addref(imgb);
+    in_flight = atomic_fetch_add_explicit(&instance->imgb_in_flight, 1, memory_order_relaxed) + 1;
+    xectx->exported_peak = FFMAX(xectx->exported_peak, in_flight);
 
-                            av_packet_free(&pkt_au);
-                            av_frame_unref(frame);
+    for (int i = 0; i < imgb->np; i++) {
+        frame->data[i]     = imgb->a[i];
+        frame->linesize[i] = imgb->s[i];
+    }
 
-                            imgb->release(imgb);
-                            imgb = NULL;
+    return 0;
+}
 
-                            return AVERROR_INVALIDDATA;
-                        }
+/**
+ * @brief Export image in imgb to frame.
+ *
+ * The image is wrapped without copying if zero-copy output is enabled,
+ * the caller did not install its own get_buffer2() callback,
+ * no conversion to another pixel format is requested
+ * and fewer than max_exported_pictures images are still held downstream,
+ * so that the XEVD picture pool does not grow or run out.
+ * Otherwise it is copied into a buffer obtained through get_buffer2().
+ *
+ * @param avctx codec context
+ * @param[in] imgb
+ * @param[out] frame
+ * @return 0 on success, negative value on failure
+ */
+static int libxevd_image_export(struct AVCodecContext *avctx, XEVD_IMGB *imgb, struct AVFrame *frame)
+{
+    XevdContext *xectx = avctx->priv_data;
+    XevdInstance *instance = (XevdInstance *)xectx->instance_ref->data;
+    enum AVPixelFormat pix_fmt = libxevd_output_pix_fmt(xectx, imgb->cs);
+    int ret;
 
-                        ret = libxevd_image_copy(avctx, imgb, frame);
-                        if(ret < 0) {
-                            av_log(avctx, AV_LOG_ERROR, "Image copying error\n");
+    if (pix_fmt == AV_PIX_FMT_NONE) {
+        av_log(avctx, AV_LOG_ERROR, "Not supported color space: 0x%x\n", imgb->cs);
+        return AVERROR_INVALIDDATA;
+    }
+    avctx->pix_fmt = pix_fmt;
 
-                            av_packet_free(&pkt_au_imgb);
-                            av_frame_unref(frame);
+    if (imgb->w[0] != avctx->coded_width || imgb->h[0] != avctx->coded_height) { // stream resolution changed
+        av_log(avctx, AV_LOG_VERBOSE, "Resolution changed to %dx%d\n", imgb->w[0], imgb->h[0]);
+        if (ff_set_dimensions(avctx, imgb->w[0], imgb->h[0]) < 0) {
+            av_log(avctx, AV_LOG_ERROR, "Cannot set new dimension\n");
+            return AVERROR_INVALIDDATA;
+        }
+    }
 
-                            imgb->release(imgb);
-                            imgb = NULL;
+    // A custom get_buffer2() means the caller wants the pictures in its own memory
+    if (xectx->zero_copy && avctx->get_buffer2 == avcodec_default_get_buffer2 &&
+        pix_fmt == libxevd_cs_to_pix_fmt(imgb->cs) &&
+        atomic_load_explicit(&instance->imgb_in_flight, memory_order_relaxed) < xectx->max_exported)
+        ret = libxevd_image_wrap(avctx, imgb, frame);
+    else
+        ret = libxevd_image_copy(avctx, imgb, frame);
+    if (ret < 0)
+        return ret;
 
-                            return ret;
-                        }
+    // the whole picture is output, cropping is left to the generic code
+    libxevd_image_cropping(imgb, avctx->pix_fmt, frame);
+    avctx->width  = frame->width  - frame->crop_left - frame->crop_right;
+    avctx->height = frame->height - frame->crop_top  - frame->crop_bottom;
 
-                        // use ff_decode_frame_props_from_pkt() to fill frame properties
-                        ret = ff_decode_frame_props_from_pkt(avctx, frame, pkt_au_imgb);
-                        if (ret < 0) {
-                            av_log(avctx, AV_LOG_ERROR, "ff_decode_frame_props_from_pkt error\n");
+    return 0;
+}
 
-                            av_packet_free(&pkt_au_imgb);
-                            av_frame_unref(frame);
+/**
+ * Parameter sets of new evcC extradata, gathered as in-band NAL units
+ */
+typedef struct XevdNewExtradata {
+    uint8_t *data;
+    int size;
+    int length_size;
+} XevdNewExtradata;
 
-                            imgb->release(imgb);
-                            imgb = NULL;
+static int libxevd_add_extradata_nalu(void *opaque, int nal_unit_type,
+                                      const uint8_t *nalu, int nalu_size, void *logctx)
+{
+    XevdNewExtradata *ps = opaque;
+    int ret;
 
-                            return ret;
-                        }
+    if (nal_unit_type == EVC_SEI_NUT)
+        return 0;
+    if (ps->length_size < 4 && nalu_size >> (8 * ps->length_size)) {
+        av_log(logctx, AV_LOG_ERROR, "Parameter set too large for the NAL unit length size\n");
+        return AVERROR_INVALIDDATA;
+    }
+
+    ret = av_reallocp(&ps->data, ps->size + ps->length_size + nalu_size);
+    if (ret < 0)
+        return ret;
+    for (int i = 0; i < ps->length_size; i++)
+        ps->data[ps->size + i] = nalu_size >> (8 * (ps->length_size - 1 - i));
+    memcpy(ps->data + ps->size + ps->length_size, nalu, nalu_size);
+    ps->size += ps->length_size + nalu_size;
+
+    return 0;
+}
+
+/**
+ * Prepend the parameter sets of the new extradata carried by pkt to the access unit
+ *
+ * This lets an open decoder be reused for another stream after avcodec_flush_buffers(),
+ * without paying for a new XEVD instance and its threads. The parameter sets are
+ * decoded as in-band ones, in order with the access units, by every decoding mode.
+ */
+static int libxevd_new_extradata(AVCodecContext *avctx, AVPacket *pkt,
+                                 const uint8_t *extradata, size_t extradata_size)
+{
+    XevdContext *xectx = avctx->priv_data;
+    XevdNewExtradata ps = { 0 };
+    AVBufferRef *buf;
+    int length_size = ff_evc_nal_length_size(extradata, extradata_size);
+    int ret;
+
+    // evc_frame_merge exports the bare parameter sets of the access unit, which has them in band already
+    if (extradata[0] != 1)
+        return 0;
+
+    if (length_size < 0) {
+        av_log(avctx, AV_LOG_ERROR, "Unsupported NAL unit length size in new extradata\n");
+        return length_size;
+    }
+    if (length_size != xectx->nalu_length_size) {
+        // access units using the previous size may still be queued for decoding
+        if (xectx->au_seq != xectx->flush_seq) {
+            avpriv_report_missing_feature(avctx, "NAL unit length size change without a flush");
+            return AVERROR_PATCHWELCOME;
+        }
+        xectx->nalu_length_size = length_size;
+    }
+
+    ps.length_size = length_size;
+    ret = ff_evc_walk_extradata(extradata, extradata_size, libxevd_add_extradata_nalu, &ps, avctx);
+    if (ret < 0 || !ps.size)
+        goto end;
+
+    buf = av_buffer_alloc(ps.size + pkt->size + AV_INPUT_BUFFER_PADDING_SIZE);
+    if (!buf) {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+    memcpy(buf->data, ps.data, ps.size);
+    memcpy(buf->data + ps.size, pkt->data, pkt->size);
+    memset(buf->data + ps.size + pkt->size, 0, AV_INPUT_BUFFER_PADDING_SIZE);
+
+    av_buffer_unref(&pkt->buf);
+    pkt->buf   = buf;
+    pkt->data  = buf->data;
+    pkt->size += ps.size;
+
+end:
+    if (ret < 0)
+        av_log(avctx, AV_LOG_WARNING, "Cannot use the parameter sets of the new extradata\n");
+    av_free(ps.data);
+    return ret == AVERROR(ENOMEM) ? ret : 0;
+}
+
+/**
+ * ff_decode_get_packet(), with the parameter sets of new extradata put in band
+ */
+static int libxevd_get_packet(AVCodecContext *avctx, AVPacket *pkt)
+{
+    const uint8_t *extradata;
+    size_t extradata_size;
+    int ret;
+
+    ret = ff_decode_get_packet(avctx, pkt);
+    if (ret < 0)
+        return ret;
+
+    extradata = av_packet_get_side_data(pkt, AV_PKT_DATA_NEW_EXTRADATA, &extradata_size);
+    if (extradata && extradata_size) {
+        ret = libxevd_new_extradata(avctx, pkt, extradata, extradata_size);
+        if (ret < 0) {
+            av_packet_unref(pkt);
+            return ret;
+        }
+    }
+
+    return 0;
+}
+
+#if HAVE_THREADS
+/**
+ * @brief Copy image in imgb to a frame allocated outside of get_buffer2().
+ *
+ * Used by the GOP threads, which must not call back into the user. The frame is moved to
+ * a buffer of get_buffer2() by libxevd_gop_frame_to_user() when a custom one is set.
+ *
+ * @param[in] xectx
+ * @param[in] imgb
+ * @param[out] frame
+ * @return 0 on success, negative value on failure
+ */
+static int libxevd_gop_image_copy(const XevdContext *xectx, XEVD_IMGB *imgb, AVFrame *frame)
+{
+    int ret;
+
+    frame->format = libxevd_output_pix_fmt(xectx, imgb->cs);
+    if (frame->format == AV_PIX_FMT_NONE)
+        return AVERROR_INVALIDDATA;
+
+    frame->width  = imgb->w[0];
+    frame->height = imgb->h[0];
+
+    if ((ret = av_frame_get_buffer(frame, 0)) < 0)
+        return ret;
+
+    libxevd_image_convert(imgb, frame->data, frame->linesize, frame->format, xectx->dither);
+
+    libxevd_image_cropping(imgb, frame->format, frame);
+
+    return 0;
+}
+
+/**
+ * Enable the picture signature (MD5 SEI) check of an XEVD instance if requested
+ * with -err_detect crccheck
+ *
+ * @return 0 on success, negative value on failure
+ */
+static int libxevd_set_signature_check(AVCodecContext *avctx, XEVD id)
+{
+    int use_pic_sign = 1;
+    int size = sizeof(use_pic_sign);
+    int ret;
+
+    if (!(avctx->err_recognition & AV_EF_CRCCHECK))
+        return 0;
+
+    ret = xevd_config(id, XEVD_CFG_SET_USE_PIC_SIGNATURE, &use_pic_sign, &size);
+    if (XEVD_FAILED(ret)) {
+        av_log(avctx, AV_LOG_ERROR, "Failed to enable the picture signature check\n");
+        return AVERROR_EXTERNAL;
+    }
+
+    return 0;
+}
+
+/**
+ * Handle a picture whose decoded samples do not match its signature SEI
+ *
+ * @param pkt the access unit containing the picture, marked as corrupt
+ * @return 0 if decoding can go on, negative value if errors are explosive
+ */
+static int libxevd_bad_signature(AVCodecContext *avctx, AVPacket *pkt)
+{
+    av_log(avctx, AV_LOG_ERROR, "Picture signature mismatch\n");
+    if (avctx->err_recognition & AV_EF_EXPLODE)
+        return AVERROR_INVALIDDATA;
+
+    if (pkt)
+        pkt->flags |= AV_PKT_FLAG_CORRUPT;
+
+    return 0;
+}
+
+static void libxevd_signature_flags(AVFrame *frame, const AVPacket *pkt)
+{
+    if (pkt->flags & AV_PKT_FLAG_CORRUPT) {
+        frame->flags              |= AV_FRAME_FLAG_CORRUPT;
+        frame->decode_error_flags |= FF_DECODE_ERROR_INVALID_BITSTREAM;
+    }
+}
+
+/**
+ * Pull one image from a GOP thread instance and append it to the segment output
+ *
+ * @return 0 if an image was stored, 1 if there is no image available, negative value on failure
+ */
+static int libxevd_gop_pull(AVCodecContext *avctx, XEVD id, XevdGopSegment *seg)
+{
+    XevdContext *xectx = avctx->priv_data;
+    XevdGopFrame out = { 0 };
+    XEVD_IMGB *imgb = NULL;
+    int xevd_ret;
+    int ret;
+
+    xevd_ret = libxevd_pull(id, &imgb);
+    if (xevd_ret == XEVD_ERR_UNEXPECTED || xevd_ret == XEVD_OK_FRM_DELAYED)
+        return 1;
+    if (XEVD_FAILED(xevd_ret)) {
+        av_log(avctx, AV_LOG_ERROR, "Failed to pull the decoded image (xevd error code: %d)\n", xevd_ret);
+        return AVERROR_EXTERNAL;
+    }
+    if (!imgb)
+        return 1;
+
+    out.au  = (intptr_t)imgb->pdata[0] - 1;
+    out.pts = imgb->ts[XEVD_TS_PTS];
+    out.dts = imgb->ts[XEVD_TS_DTS];
+
+    out.frame = av_frame_alloc();
+    if (!out.frame) {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+
+    ret = libxevd_gop_image_copy(xectx, imgb, out.frame);
+    if (ret < 0) {
+        av_log(avctx, AV_LOG_ERROR, "Image exporting error\n");
+        goto end;
+    }
+
+    ret = av_fifo_write(seg->frames, &out, 1);
+    if (ret < 0)
+        goto end;
+    out.frame = NULL;
+
+end:
+    av_frame_free(&out.frame);
+    imgb->release(imgb);
+
+    return ret;
+}
+
+/**
+ * Decode all NAL units of a buffer with a GOP thread instance
+ *
+ * @param au index of the access unit in the segment, -1 for the parameter sets preceding it,
+ *           which are stored with 4 byte length prefixes
+ */
+static int libxevd_gop_decode_nalus(AVCodecContext *avctx, XEVD id, XevdGopSegment *seg,
+                                    const uint8_t *buf, int size, int au, int64_t dts)
+{
+    const XevdContext *xectx = avctx->priv_data;
+    const int length_size = au < 0 ? XEVD_NAL_UNIT_LENGTH_BYTE : xectx->nalu_length_size;
+    XEVD_STAT stat;
+    XEVD_BITB bitb;
+    int bs_read_pos = 0;
+    uint32_t nalu_size;
+    int got_picture = 0;
+    int xevd_ret;
+    int ret;
+
+    memset(&bitb, 0, sizeof(bitb));
+    bitb.pdata[0] = (void *)(intptr_t)(au + 1);
+    bitb.ts[XEVD_TS_DTS] = dts;
+
+    while (size > (bs_read_pos + length_size)) {
+        memset(&stat, 0, sizeof(XEVD_STAT));
+
+        nalu_size = read_nal_unit_length(buf + bs_read_pos, length_size, avctx);
+        if (nalu_size == 0 || nalu_size > size - bs_read_pos - length_size) {
+            av_log(avctx, AV_LOG_ERROR, "Invalid bitstream\n");
+            return AVERROR_INVALIDDATA;
+        }
+        bs_read_pos += length_size;
+
+        bitb.addr = (void *)(buf + bs_read_pos);
+        bitb.ssize = nalu_size;
+
+        xevd_ret = libxevd_decode_nalu(id, &bitb, &stat);
+        if (xevd_ret == XEVD_ERR_BAD_CRC && au >= 0) {
+            ret = libxevd_bad_signature(avctx, seg->aus[au]);
+            if (ret < 0)
+                return ret;
+        } else if (XEVD_FAILED(xevd_ret)) {
+            av_log(avctx, AV_LOG_ERROR, "Failed to decode bitstream\n");
+            return AVERROR_EXTERNAL;
+        }
+
+        bs_read_pos += nalu_size;
+
+        if (stat.fnum >= 0)
+            got_picture = 1;
+    }
+
+    // pulled after the picture signature SEI has been checked
+    if (got_picture) {
+        ret = libxevd_gop_pull(avctx, id, seg);
+        if (ret < 0)
+            return ret;
+    }
+
+    return 0;
+}
+
+/**
+ * Decode a closed GOP segment from its first IDR picture to the end with a fresh XEVD instance
+ */
+static int libxevd_gop_decode_segment(AVCodecContext *avctx, XevdGopSegment *seg)
+{
+    XevdContext *xectx = avctx->priv_data;
+    XevdGop *gop = xectx->gop;
+    XEVD id;
+    int ret = 0;
+
+    id = xevd_create(&xectx->cdsc, NULL);
+    if (!id) {
+        av_log(avctx, AV_LOG_ERROR, "Cannot create XEVD decoder\n");
+        return AVERROR_EXTERNAL;
+    }
+
+    ret = libxevd_set_signature_check(avctx, id);
+    if (ret < 0)
+        goto end;
+
+    if (seg->ps_size)
+        ret = libxevd_gop_decode_nalus(avctx, id, seg, seg->ps, seg->ps_size, -1, AV_NOPTS_VALUE);
+
+    for (int i = 0; ret >= 0 && i < seg->nb_aus; i++) {
+        if (atomic_load_explicit(&gop->abort, memory_order_relaxed))
+            goto end;
+        ret = libxevd_gop_decode_nalus(avctx, id, seg, seg->aus[i]->data, seg->aus[i]->size,
+                                       i, seg->aus[i]->dts);
+    }
+
+    // the segment is closed, so every picture it holds can be output now
+    while (ret == 0)
+        ret = libxevd_gop_pull(avctx, id, seg);
+    if (ret > 0)
+        ret = 0;
+
+end:
+    xevd_delete(id);
+
+    return ret;
+}
+
+static void *libxevd_gop_worker(void *arg)
+{
+    AVCodecContext *avctx = arg;
+    XevdContext *xectx = avctx->priv_data;
+    XevdGop *gop = xectx->gop;
+    XevdGopSegment *seg;
+
+    pthread_mutex_lock(&gop->mutex);
+    for (;;) {
+        while (!gop->quit && av_fifo_read(gop->jobs, &seg, 1) < 0)
+            pthread_cond_wait(&gop->job_cond, &gop->mutex);
+        if (gop->quit)
+            break;
+        pthread_mutex_unlock(&gop->mutex);
+
+        seg->err = libxevd_gop_decode_segment(avctx, seg);
+
+        pthread_mutex_lock(&gop->mutex);
+        seg->done = 1;
+        pthread_cond_broadcast(&gop->done_cond);
+    }
+    pthread_mutex_unlock(&gop->mutex);
+
+    return NULL;
+}
+
+static void libxevd_gop_segment_free(XevdGopSegment **pseg)
+{
+    XevdGopSegment *seg = *pseg;
+    XevdGopFrame out;
+
+    if (!seg)
+        return;
+
+    for (int i = 0; i < seg->nb_aus; i++)
+        av_packet_free(&seg->aus[i]);
+    av_freep(&seg->aus);
+    av_freep(&seg->ps);
+
+    if (seg->frames) {
+        while (av_fifo_read(seg->frames, &out, 1) >= 0)
+            av_frame_free(&out.frame);
+        av_fifo_freep2(&seg->frames);
+    }
+
+    av_freep(pseg);
+}
+
+/**
+ * Hand the segment being collected over to the GOP threads
+ */
+static int libxevd_gop_dispatch(XevdGop *gop)
+{
+    XevdGopSegment *seg = gop->cur;
+    int ret;
+
+    if (!seg)
+        return 0;
+
+    ret = av_fifo_write(gop->segments, &seg, 1);
+    if (ret < 0)
+        return ret;
+    gop->cur = NULL;
+
+    pthread_mutex_lock(&gop->mutex);
+    ret = av_fifo_write(gop->jobs, &seg, 1);
+    pthread_cond_signal(&gop->job_cond);
+    pthread_mutex_unlock(&gop->mutex);
+
+    if (ret < 0) { // never picked up by a thread, so no one else references it
+        seg->err  = ret;
+        seg->done = 1;
+    }
+
+    return 0;
+}
+
+/**
+ * Append an access unit to the segment being collected
+ *
+ * A new segment is started at every IDR picture. Access units preceding the first IDR picture are dropped.
+ * The last parameter sets are remembered, so segments whose IDR access unit does not carry them can still
+ * be decoded on their own.
+ */
+static int libxevd_gop_add_au(AVCodecContext *avctx, AVPacket *pkt)
+{
+    XevdContext *xectx = avctx->priv_data;
+    XevdGop *gop = xectx->gop;
+    XevdGopSegment *seg;
+    int bs_read_pos = 0;
+    const int length_size = xectx->nalu_length_size;
+    int idr = 0, has_sps = 0;
+    int ret;
+
+    while (pkt->size > (bs_read_pos + length_size)) {
+        const uint8_t *nalu = pkt->data + bs_read_pos + length_size;
+        uint32_t nalu_size = read_nal_unit_length(pkt->data + bs_read_pos, length_size, avctx);
+        int nalu_type;
+
+        if (!nalu_size || nalu_size > pkt->size - bs_read_pos - length_size) {
+            av_log(avctx, AV_LOG_ERROR, "Invalid bitstream\n");
+            return AVERROR_INVALIDDATA;
+        }
+
+        nalu_type = av_evc_get_nalu_type(nalu, nalu_size, avctx);
+        if (nalu_type == EVC_IDR_NUT)
+            idr = 1;
+
+        if (nalu_type == EVC_SPS_NUT || nalu_type == EVC_PPS_NUT || nalu_type == EVC_APS_NUT) {
+            // a new SPS invalidates all previously stored parameter sets
+            if (nalu_type == EVC_SPS_NUT && !has_sps) {
+                gop->ps_size = 0;
+                has_sps = 1;
+            }
+            ret = av_reallocp(&gop->ps, gop->ps_size + EVC_NALU_LENGTH_PREFIX_SIZE + nalu_size);
+            if (ret < 0) {
+                gop->ps_size = 0;
+                return ret;
+            }
+            AV_WB32(gop->ps + gop->ps_size, nalu_size);
+            memcpy(gop->ps + gop->ps_size + EVC_NALU_LENGTH_PREFIX_SIZE, nalu, nalu_size);
+            gop->ps_size += EVC_NALU_LENGTH_PREFIX_SIZE + nalu_size;
+        }
+
+        bs_read_pos += length_size + nalu_size;
+    }
+
+    if (idr) {
+        ret = libxevd_gop_dispatch(gop);
+        if (ret < 0)
+            return ret;
+
+        seg = av_mallocz(sizeof(*seg));
+        if (!seg)
+            return AVERROR(ENOMEM);
+        gop->cur = seg;
+
+        seg->frames = av_fifo_alloc2(XEVD_MAX_PB_SIZE, sizeof(XevdGopFrame), AV_FIFO_FLAG_AUTO_GROW);
+        if (!seg->frames)
+            return AVERROR(ENOMEM);
+
+        if (!has_sps && gop->ps_size) {
+            seg->ps = av_memdup(gop->ps, gop->ps_size);
+            if (!seg->ps)
+                return AVERROR(ENOMEM);
+            seg->ps_size = gop->ps_size;
+        }
+    }
+
+    seg = gop->cur;
+    if (!seg)
+        return 0;
+
+    ret = av_reallocp_array(&seg->aus, seg->nb_aus + 1, sizeof(*seg->aus));
+    if (ret < 0) {
+        seg->nb_aus = 0;
+        return ret;
+    }
+    seg->aus[seg->nb_aus] = av_packet_alloc();
+    if (!seg->aus[seg->nb_aus])
+        return AVERROR(ENOMEM);
+    av_packet_move_ref(seg->aus[seg->nb_aus++], pkt);
+
+    return 0;
+}
+
+/**
+ * Move a frame decoded by a GOP thread into a buffer obtained from get_buffer2()
+ *
+ * The GOP threads cannot call a custom get_buffer2(), which is not required to allow
+ * concurrent calls, so the callers providing one get the picture copied once more
+ * from the thread calling receive_frame(), after the dimensions of avctx were updated.
+ */
+static int libxevd_gop_frame_to_user(AVCodecContext *avctx, AVFrame *frame)
+{
+    AVFrame *user = av_frame_alloc();
+    int ret;
+
+    if (!user)
+        return AVERROR(ENOMEM);
+
+    ret = ff_get_buffer(avctx, user, 0);
+    if (ret >= 0)
+        ret = av_frame_copy(user, frame);
+    if (ret >= 0)
+        ret = av_frame_copy_props(user, frame);
+    if (ret >= 0) {
+        av_frame_unref(frame);
+        av_frame_move_ref(frame, user);
+    }
+    av_frame_free(&user);
+
+    return ret;
+}
+
+/**
+ * Return the next frame of the oldest segment, waiting for the GOP threads when they are behind
+ */
+static int libxevd_gop_receive_frame(AVCodecContext *avctx, AVFrame *frame)
+{
+    XevdContext *xectx = avctx->priv_data;
+    XevdGop *gop = xectx->gop;
+    AVPacket *pkt = xectx->pkt;
+    XevdGopSegment *seg;
+    XevdGopFrame out;
+    int ret;
+
+    for (;;) {
+        if (av_fifo_peek(gop->segments, &seg, 1, 0) >= 0) {
+            int done;
+
+            pthread_mutex_lock(&gop->mutex);
+            // keep up to gop_threads segments in flight, one more may be collected meanwhile
+            while (!(done = seg->done) &&
+                   (gop->eof || av_fifo_can_read(gop->segments) >= xectx->gop_threads))
+                pthread_cond_wait(&gop->done_cond, &gop->mutex);
+            pthread_mutex_unlock(&gop->mutex);
+
+            if (done) {
+                if (seg->err < 0)
+                    return seg->err;
+
+                if (av_fifo_read(seg->frames, &out, 1) >= 0)
+                    break;
+
+                av_fifo_drain2(gop->segments, 1);
+                libxevd_gop_segment_free(&seg);
+                continue;
+            }
+        } else if (gop->eof) {
+            return AVERROR_EOF;
+        }
+
+        ret = libxevd_get_packet(avctx, pkt);
+        if (ret == AVERROR_EOF) {
+            gop->eof = 1;
+            ret = libxevd_gop_dispatch(gop);
+            if (ret < 0)
+                return ret;
+            continue;
+        } else if (ret < 0) {
+            return ret;
+        }
+
+        ret = libxevd_gop_add_au(avctx, pkt);
+        av_packet_unref(pkt);
+        if (ret < 0)
+            return ret;
+    }
+
+    av_frame_move_ref(frame, out.frame);
+    av_frame_free(&out.frame);
+
+    // the frame was not allocated through ff_get_buffer()
+    ret = ff_attach_decode_data(frame);
+    if (ret < 0)
+        goto fail;
+
+    if (frame->width != avctx->coded_width || frame->height != avctx->coded_height) { // stream resolution changed
+        av_log(avctx, AV_LOG_VERBOSE, "Resolution changed to %dx%d\n", frame->width, frame->height);
+        if ((ret = ff_set_dimensions(avctx, frame->width, frame->height)) < 0)
+            goto fail;
+    }
+    avctx->width  = frame->width  - frame->crop_left - frame->crop_right;
+    avctx->height = frame->height - frame->crop_top  - frame->crop_bottom;
+    avctx->pix_fmt = frame->format;
+
+    if (avctx->get_buffer2 != avcodec_default_get_buffer2) {
+        ret = libxevd_gop_frame_to_user(avctx, frame);
+        if (ret < 0)
+            goto fail;
+    }
+
+    if (out.au >= 0 && out.au < seg->nb_aus) {
+        ret = ff_decode_frame_props_from_pkt(avctx, frame, seg->aus[out.au]);
+        if (ret < 0)
+            goto fail;
+        libxevd_signature_flags(frame, seg->aus[out.au]);
+    }
+
+    frame->pkt_dts = out.dts;
+    frame->pts = out.pts;
+
+    return 0;
+
+fail:
+    av_frame_unref(frame);
+    return ret;
+}
+
+/**
+ * Stop the GOP threads working on the segments in flight and drop all of them
+ */
+static void libxevd_gop_reset(XevdGop *gop)
+{
+    XevdGopSegment *seg;
+
+    atomic_store_explicit(&gop->abort, 1, memory_order_relaxed);
+
+    pthread_mutex_lock(&gop->mutex);
+    // segments no thread picked up yet are finished right away
+    while (av_fifo_read(gop->jobs, &seg, 1) >= 0)
+        seg->done = 1;
+    while (av_fifo_read(gop->segments, &seg, 1) >= 0) {
+        while (!seg->done)
+            pthread_cond_wait(&gop->done_cond, &gop->mutex);
+        libxevd_gop_segment_free(&seg);
+    }
+    pthread_mutex_unlock(&gop->mutex);
+
+    atomic_store_explicit(&gop->abort, 0, memory_order_relaxed);
+
+    libxevd_gop_segment_free(&gop->cur);
+    gop->eof = 0;
+}
+
+static av_cold int libxevd_gop_init(AVCodecContext *avctx)
+{
+    XevdContext *xectx = avctx->priv_data;
+    XevdGop *gop;
+
+    gop = xectx->gop = av_mallocz(sizeof(*gop));
+    if (!gop)
+        return AVERROR(ENOMEM);
+
+    gop->segments = av_fifo_alloc2(xectx->gop_threads, sizeof(XevdGopSegment *), AV_FIFO_FLAG_AUTO_GROW);
+    gop->jobs     = av_fifo_alloc2(xectx->gop_threads, sizeof(XevdGopSegment *), AV_FIFO_FLAG_AUTO_GROW);
+    gop->threads  = av_calloc(xectx->gop_threads, sizeof(*gop->threads));
+    if (!gop->segments || !gop->jobs || !gop->threads)
+        return AVERROR(ENOMEM);
+
+    pthread_mutex_init(&gop->mutex, NULL);
+    pthread_cond_init(&gop->job_cond, NULL);
+    pthread_cond_init(&gop->done_cond, NULL);
+    gop->sync_init = 1;
+
+    for (int i = 0; i < xectx->gop_threads; i++) {
+        int ret = pthread_create(&gop->threads[i], NULL, libxevd_gop_worker, avctx);
+        if (ret) {
+            av_log(avctx, AV_LOG_ERROR, "Cannot create GOP thread\n");
+            return AVERROR(ret);
+        }
+        gop->nb_threads++;
+    }
+
+    return 0;
+}
+
+static av_cold void libxevd_gop_uninit(AVCodecContext *avctx)
+{
+    XevdContext *xectx = avctx->priv_data;
+    XevdGop *gop = xectx->gop;
+
+    if (!gop)
+        return;
+
+    if (gop->sync_init) {
+        libxevd_gop_reset(gop);
+
+        pthread_mutex_lock(&gop->mutex);
+        gop->quit = 1;
+        pthread_cond_broadcast(&gop->job_cond);
+        pthread_mutex_unlock(&gop->mutex);
+
+        for (int i = 0; i < gop->nb_threads; i++)
+            pthread_join(gop->threads[i], NULL);
+
+        pthread_cond_destroy(&gop->done_cond);
+        pthread_cond_destroy(&gop->job_cond);
+        pthread_mutex_destroy(&gop->mutex);
+    }
+
+    av_freep(&gop->threads);
+    av_fifo_freep2(&gop->segments);
+    av_fifo_freep2(&gop->jobs);
+    av_freep(&gop->ps);
+    av_freep(&xectx->gop);
+}
+
+static void *libxevd_async_worker(void *arg);
+
+/**
+ * Drop the queued packets and the pending events, once the decoding thread is idle
+ */
+static void libxevd_async_reset(XevdAsync *async)
+{
+    XevdAsyncPacket in;
+    XevdAsyncEvent ev;
+
+    pthread_mutex_lock(&async->mutex);
+    while (av_fifo_read(async->packets, &in, 1) >= 0)
+        av_packet_free(&in.pkt);
+    while (async->busy)
+        pthread_cond_wait(&async->cond, &async->mutex);
+    while (av_fifo_read(async->events, &ev, 1) >= 0) {
+        if (ev.type == XEVD_ASYNC_IMAGE)
+            ev.imgb->release(ev.imgb);
+    }
+    pthread_mutex_unlock(&async->mutex);
+
+    async->eof_pending = 0;
+    async->eof_sent    = 0;
+    async->eof         = 0;
+}
+
+static av_cold int libxevd_async_init(AVCodecContext *avctx)
+{
+    XevdContext *xectx = avctx->priv_data;
+    XevdAsync *async;
+    int ret;
+
+    async = xectx->async_ctx = av_mallocz(sizeof(*async));
+    if (!async)
+        return AVERROR(ENOMEM);
+
+    async->packets = av_fifo_alloc2(xectx->async, sizeof(XevdAsyncPacket), 0);
+    async->events  = av_fifo_alloc2(XEVD_MAX_PB_SIZE, sizeof(XevdAsyncEvent), AV_FIFO_FLAG_AUTO_GROW);
+    if (!async->packets || !async->events)
+        return AVERROR(ENOMEM);
+
+    pthread_mutex_init(&async->mutex, NULL);
+    pthread_cond_init(&async->cond, NULL);
+    async->sync_init = 1;
+
+    ret = pthread_create(&async->thread, NULL, libxevd_async_worker, avctx);
+    if (ret) {
+        av_log(avctx, AV_LOG_ERROR, "Cannot create decoding thread\n");
+        return AVERROR(ret);
+    }
+    async->thread_init = 1;
+
+    return 0;
+}
+
+static av_cold void libxevd_async_uninit(AVCodecContext *avctx)
+{
+    XevdContext *xectx = avctx->priv_data;
+    XevdAsync *async = xectx->async_ctx;
+
+    if (!async)
+        return;
+
+    if (async->sync_init) {
+        libxevd_async_reset(async);
+
+        if (async->thread_init) {
+            pthread_mutex_lock(&async->mutex);
+            async->quit = 1;
+            pthread_cond_broadcast(&async->cond);
+            pthread_mutex_unlock(&async->mutex);
+
+            pthread_join(async->thread, NULL);
+        }
+
+        pthread_cond_destroy(&async->cond);
+        pthread_mutex_destroy(&async->mutex);
+    }
+
+    av_fifo_freep2(&async->packets);
+    av_fifo_freep2(&async->events);
+    av_freep(&xectx->async_ctx);
+}
+#endif
+
+/**
+ * Keep track of the parameter sets the slices refer to
+ *
+ * @param xectx decoder context
+ * @param[in] nalu_type type of the NAL unit, other types than SPS and PPS are ignored
+ * @param[in] nalu NAL unit, starting with its header
+ * @param[in] nalu_size size of the NAL unit
+ */
+static void libxevd_parse_ps(XevdContext *xectx, int nalu_type, const uint8_t *nalu, int nalu_size)
+{
+    // a broken parameter set is reported by XEVD, the slices referring to it are then kept
+    if (nalu_type == EVC_SPS_NUT)
+        ff_evc_parse_sps(&xectx->ps, nalu + EVC_NALU_HEADER_SIZE, nalu_size - EVC_NALU_HEADER_SIZE);
+    else if (nalu_type == EVC_PPS_NUT)
+        ff_evc_parse_pps(&xectx->ps, nalu + EVC_NALU_HEADER_SIZE, nalu_size - EVC_NALU_HEADER_SIZE);
+}
+
+/**
+ * Decode a parameter set or SEI NAL unit stored in evcC extradata
+ * Called for every NAL unit found by ff_evc_walk_extradata()
+ */
+static int libxevd_decode_extradata_nalu(void *opaque, int nal_unit_type,
+                                         const uint8_t *nalu, int nalu_size, void *logctx)
+{
+    AVCodecContext *avctx = opaque;
+    XevdContext *xectx = avctx->priv_data;
+    XEVD_STAT stat;
+    XEVD_BITB bitb;
+    int xevd_ret;
+    int ret;
+
+    memset(&stat, 0, sizeof(stat));
+    memset(&bitb, 0, sizeof(bitb));
+    bitb.addr = (void *)nalu;
+    bitb.ssize = nalu_size;
+
+    libxevd_parse_ps(xectx, nal_unit_type, nalu, nalu_size);
+    xevd_ret = libxevd_decode_nalu(xectx->id, &bitb, &stat);
+    if (XEVD_FAILED(xevd_ret)) {
+        av_log(avctx, AV_LOG_ERROR, "Failed to decode extradata NAL unit (type %d)\n", nal_unit_type);
+        return AVERROR_EXTERNAL;
+    }
+
+    if (stat.nalu_type == XEVD_NUT_SPS) {
+        if ((ret = export_stream_params(xectx, avctx)) != 0) {
+            av_log(avctx, AV_LOG_ERROR, "Failed to export stream params\n");
+            return ret;
+        }
+    }
+
+#if HAVE_THREADS
+    // the GOP threads use their own instances, which get the parameter sets with their first IDR access unit
+    if (xectx->gop && nal_unit_type != EVC_SEI_NUT) {
+        XevdGop *gop = xectx->gop;
+
+        ret = av_reallocp(&gop->ps, gop->ps_size + EVC_NALU_LENGTH_PREFIX_SIZE + nalu_size);
+        if (ret < 0) {
+            gop->ps_size = 0;
+            return ret;
+        }
+        AV_WB32(gop->ps + gop->ps_size, nalu_size);
+        memcpy(gop->ps + gop->ps_size + EVC_NALU_LENGTH_PREFIX_SIZE, nalu, nalu_size);
+        gop->ps_size += EVC_NALU_LENGTH_PREFIX_SIZE + nalu_size;
+    }
+#endif
+
+    return 0;
+}
+
+/**
+ * Initialize decoder
+ * Create a decoder instance and allocate all the needed resources
+ *
+ * @param avctx codec context
+ * @return 0 on success, negative error code on failure
+ */
+static av_cold int libxevd_init_decoder(AVCodecContext *avctx)
+{
+    XevdContext *xectx = avctx->priv_data;
+    XEVD_CDSC *cdsc = &(xectx->cdsc);
+    XevdInstance *instance;
+    int ret;
+
+    /* read configurations and set values for created descriptor (XEVD_CDSC) */
+    get_conf(avctx, cdsc);
+
+    // samples described by an evcC may use 1 or 2 byte length prefixes, XEVD is given the NAL units alone
+    xectx->nalu_length_size = ff_evc_nal_length_size(avctx->extradata, avctx->extradata_size);
+    if (xectx->nalu_length_size < 0) {
+        av_log(avctx, AV_LOG_ERROR, "Unsupported NAL unit length size in extradata\n");
+        return xectx->nalu_length_size;
+    }
+
+    if (xectx->output_pix_fmt != AV_PIX_FMT_NONE &&
+        xectx->output_pix_fmt != AV_PIX_FMT_YUV420P10LE &&
+        xectx->output_pix_fmt != AV_PIX_FMT_P010LE &&
+        xectx->output_pix_fmt != AV_PIX_FMT_YUV420P &&
+        xectx->output_pix_fmt != AV_PIX_FMT_NV12) {
+        av_log(avctx, AV_LOG_ERROR, "Unsupported output pixel format: %s\n",
+               av_get_pix_fmt_name(xectx->output_pix_fmt));
+        return AVERROR(EINVAL);
+    }
+
+    if (xectx->async > 0 && xectx->gop_threads > 0) {
+        av_log(avctx, AV_LOG_ERROR, "async and gop_threads cannot be used together\n");
+        return AVERROR(EINVAL);
+    }
+    // both take whole AUs to other threads
+    if (xectx->nal_input && (xectx->async > 0 || xectx->gop_threads > 0)) {
+        av_log(avctx, AV_LOG_ERROR, "nal_input cannot be used with async or gop_threads\n");
+        return AVERROR(EINVAL);
+    }
+    xectx->nal_fnum = -1;
+
+    instance = av_mallocz(sizeof(*instance));
+    if (!instance)
+        return AVERROR(ENOMEM);
+
+    xectx->instance_ref = av_buffer_create((uint8_t *)instance, sizeof(*instance),
+                                           libxevd_instance_free, NULL, 0);
+    if (!xectx->instance_ref) {
+        av_free(instance);
+        return AVERROR(ENOMEM);
+    }
+
+    /* create decoder */
+    instance->id = xevd_create(&(xectx->cdsc), NULL);
+    if (instance->id == NULL) {
+        av_log(avctx, AV_LOG_ERROR, "Cannot create XEVD encoder\n");
+        return AVERROR_EXTERNAL;
+    }
+    xectx->id = instance->id;
+
+    ret = libxevd_set_signature_check(avctx, xectx->id);
+    if (ret < 0)
+        return ret;
+
+    xectx->draining_mode = 0;
+    xectx->pkt = av_packet_alloc();
+    if (!xectx->pkt) {
+        av_log(avctx, AV_LOG_ERROR, "Cannot allocate memory for AVPacket\n");
+        return AVERROR(ENOMEM);
+    }
+
+    xectx->frames = av_fifo_alloc2(XEVD_MAX_PB_SIZE, sizeof(AVFrame *), AV_FIFO_FLAG_AUTO_GROW);
+    if (!xectx->frames)
+        return AVERROR(ENOMEM);
+
+    for (int i = 0; i < XEVD_AU_PROPS_RING_SIZE; i++) {
+        xectx->au_props[i].pkt = av_packet_alloc();
+        if (!xectx->au_props[i].pkt)
+            return AVERROR(ENOMEM);
+    }
+
+    if (xectx->gop_threads > 0) {
+#if HAVE_THREADS
+        ret = libxevd_gop_init(avctx);
+        if (ret < 0)
+            return ret;
+#else
+        av_log(avctx, AV_LOG_WARNING, "GOP-parallel decoding requires threading support, ignoring gop_threads\n");
+#endif
+    }
+
+    if (xectx->async > 0) {
+#if HAVE_THREADS
+        ret = libxevd_async_init(avctx);
+        if (ret < 0)
+            return ret;
+#else
+        av_log(avctx, AV_LOG_WARNING, "Asynchronous decoding requires threading support, ignoring async\n");
+#endif
+    }
+
+    // With evcC extradata the stream parameters are known before the first packet.
+    // In-band parameter sets still take precedence, so a broken record is not fatal.
+    if (avctx->extradata && avctx->extradata_size > 0) {
+        ret = ff_evc_walk_extradata(avctx->extradata, avctx->extradata_size,
+                                    libxevd_decode_extradata_nalu, avctx, avctx);
+        if (ret < 0)
+            av_log(avctx, AV_LOG_WARNING, "Cannot decode parameter sets from extradata\n");
+    }
+
+    return 0;
+}
+
+/**
+ * Initialize the decoder, with the affinity of the calling thread set to the
+ * cpus option while the XEVD and GOP threads are created so that they inherit it
+ */
+static av_cold int libxevd_init(AVCodecContext *avctx)
+{
+    XevdContext *xectx = avctx->priv_data;
+    void *affinity = NULL;
+    int ret;
+
+    if (xectx->cpus) {
+        ret = ff_thread_affinity_set(avctx, xectx->cpus, &affinity);
+        if (ret < 0)
+            return ret;
+    }
+
+    ret = libxevd_init_decoder(avctx);
+
+    ff_thread_affinity_restore(&affinity);
+
+    return ret;
+}
+
+/**
+ * Attach the decoding statistics of a picture to its frame as metadata
+ *
+ * @param[out] frame
+ * @param[in] props properties of the AU the picture was decoded from
+ * @param[in] pull_time time spent in xevd_pull(), in microseconds
+ * @param[in] copy_time time spent exporting the image, in microseconds
+ * @return 0 on success, negative value on failure
+ */
+static int libxevd_export_stats(AVFrame *frame, const XevdAuProps *props,
+                                int64_t pull_time, int64_t copy_time)
+{
+    static const char slice_types[] = { [XEVD_ST_I] = 'I', [XEVD_ST_P] = 'P', [XEVD_ST_B] = 'B' };
+    char type[2] = { '?', 0 };
+    int ret = 0;
+
+    if (props->slice_type >= 0 && props->slice_type < FF_ARRAY_ELEMS(slice_types) &&
+        slice_types[props->slice_type])
+        type[0] = slice_types[props->slice_type];
+
+    ret |= av_dict_set_int(&frame->metadata, "libxevd.decode_time", props->decode_time, 0);
+    ret |= av_dict_set_int(&frame->metadata, "libxevd.pull_time", pull_time, 0);
+    ret |= av_dict_set_int(&frame->metadata, "libxevd.copy_time", copy_time, 0);
+    ret |= av_dict_set_int(&frame->metadata, "libxevd.nal_count", props->nb_nalus, 0);
+    ret |= av_dict_set_int(&frame->metadata, "libxevd.bytes_read", props->bytes_read, 0);
+    ret |= av_dict_set(&frame->metadata, "libxevd.slice_type", type, 0);
+
+    return ret < 0 ? AVERROR(ENOMEM) : 0;
+}
+
+/**
+ * @brief Queue decoded image for output.
+ *
+ * Export image in imgb to a newly allocated frame and queue it for output.
+ * The imgb object is always released.
+ *
+ * @param avctx codec context
+ * @param[in] imgb decoded image returned by xevd_pull()
+ * @param[in] pull_time time spent in xevd_pull() to get imgb, in microseconds
+ * @return 0 on success, negative value on failure
+ */
+static int libxevd_queue_frame(AVCodecContext *avctx, XEVD_IMGB *imgb, int64_t pull_time)
+{
+    XevdContext *xectx = avctx->priv_data;
+    uintptr_t seq = (uintptr_t)imgb->pdata[0];
+    XevdAuProps *props = &xectx->au_props[seq % XEVD_AU_PROPS_RING_SIZE];
+    AVFrame *frame = NULL;
+    int64_t copy_time = 0;
+    int ret;
+
+    // the picture belongs to an AU sent before the decoder was flushed
+    if (seq && seq <= xectx->flush_seq) {
+        imgb->release(imgb);
+        return 0;
+    }
+
+    // the slot may have been reused if XEVD held the picture for too long
+    if (!seq || props->seq != seq) {
+        av_log(avctx, AV_LOG_ERROR, "Invalid data needed to fill frame properties\n");
+        ret = AVERROR_INVALIDDATA;
+        goto end;
+    }
+
+    frame = av_frame_alloc();
+    if (!frame) {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+
+    if (xectx->stats)
+        copy_time = av_gettime_relative();
+    ret = libxevd_image_export(avctx, imgb, frame);
+    if (ret < 0) {
+        av_log(avctx, AV_LOG_ERROR, "Image exporting error\n");
+        goto end;
+    }
+    if (xectx->stats)
+        copy_time = av_gettime_relative() - copy_time;
+
+    // use ff_decode_frame_props_from_pkt() to fill frame properties
+    ret = ff_decode_frame_props_from_pkt(avctx, frame, props->pkt);
+    if (ret < 0) {
+        av_log(avctx, AV_LOG_ERROR, "ff_decode_frame_props_from_pkt error\n");
+        goto end;
+    }
+    libxevd_signature_flags(frame, props->pkt);
+
+    if (xectx->stats) {
+        ret = libxevd_export_stats(frame, props, pull_time, copy_time);
+        if (ret < 0)
+            goto end;
+    }
+
+    frame->pkt_dts = imgb->ts[XEVD_TS_DTS];
+    frame->pts = imgb->ts[XEVD_TS_PTS];
+
+    ret = av_fifo_write(xectx->frames, &frame, 1);
+    if (ret < 0)
+        goto end;
+    frame = NULL;
+    xectx->queued_peak = FFMAX(xectx->queued_peak, av_fifo_can_read(xectx->frames));
+
+end:
+    av_frame_free(&frame);
+    if (seq && props->seq == seq) {
+        av_packet_unref(props->pkt);
+        props->seq = 0;
+    }
+
+    // xevd_pull uses pool of objects of type XEVD_IMGB.
+    // The pool size is equal MAX_PB_SIZE (26), so release object when it is no more needed
+    imgb->release(imgb);
+
+    return ret;
+}
+
+/**
+ * Check whether a slice belongs to the highest temporal sub-layer, which no picture references
+ *
+ * Without reference picture lists in the SPS, the pictures with TemporalId equal to
+ * log2_sub_gop_length are the unreferenced B pictures of the hierarchical sub-GOPs.
+ *
+ * @param xectx decoder context
+ * @param[in] nalu slice NAL unit, starting with its header
+ * @param[in] nalu_size size of the NAL unit
+ * @return 1 if the slice is not referenced, 0 otherwise or if this is unknown
+ */
+static int libxevd_nalu_discardable(XevdContext *xectx, const uint8_t *nalu, int nalu_size)
+{
+    const EVCParserSPS *sps = NULL;
+    GetBitContext gb;
+    unsigned pps_id;
+    int tid = ff_evc_nal_unit_temporal_id(nalu, nalu_size);
+
+    if (tid <= 0 ||
+        init_get_bits8(&gb, nalu + EVC_NALU_HEADER_SIZE, nalu_size - EVC_NALU_HEADER_SIZE) < 0)
+        return 0;
+
+    pps_id = get_ue_golomb_long(&gb);
+    if (pps_id < EVC_MAX_PPS_COUNT && xectx->ps.pps[pps_id])
+        sps = xectx->ps.sps[xectx->ps.pps[pps_id]->pps_seq_parameter_set_id];
+
+    return sps && !sps->sps_rpl_flag && tid == sps->log2_sub_gop_length;
+}
+
+/**
+ * Check whether a NAL unit has to be dropped before it reaches the decoder
+ *
+ * Slices are dropped while waiting for an IDR picture after a flush
+ * and according to skip_frame. Non-IDR pictures with nuh_temporal_id 0
+ * may be referenced by any later picture, so nokey and nointra keep IDR pictures only.
+ * Pictures of a temporal sub-layer are referenced by pictures of the higher sub-layers,
+ * so nonref and bidir only drop the slices of the highest one, if no picture references it.
+ *
+ * @param avctx codec context
+ * @param[in] nalu NAL unit, starting with its header
+ * @param[in] nalu_size size of the NAL unit
+ * @param[in] skip_frame discard level, avctx->skip_frame as the access unit was submitted
+ * @return 1 if the NAL unit must not be decoded, 0 otherwise
+ */
+static int libxevd_skip_nalu(AVCodecContext *avctx, const uint8_t *nalu, int nalu_size,
+                             enum AVDiscard skip_frame)
+{
+    XevdContext *xectx = avctx->priv_data;
+    int nalu_type = av_evc_get_nalu_type(nalu, nalu_size, avctx);
+
+    // parameter sets, SEI and other non-VCL NAL units are always decoded
+    if (nalu_type != EVC_NOIDR_NUT && nalu_type != EVC_IDR_NUT) {
+        libxevd_parse_ps(xectx, nalu_type, nalu, nalu_size);
+        return 0;
+    }
+
+    // after a flush the pictures preceding the next IDR picture reference data XEVD no longer has
+    if (xectx->wait_idr) {
+        if (nalu_type == EVC_NOIDR_NUT)
+            return 1;
+        xectx->wait_idr = 0;
+    }
+
+    if (skip_frame >= AVDISCARD_ALL)
+        return 1;
+
+    if (skip_frame >= AVDISCARD_NONINTRA)
+        return nalu_type != EVC_IDR_NUT;
+
+    if (skip_frame >= AVDISCARD_NONREF)
+        return libxevd_nalu_discardable(xectx, nalu, nalu_size);
+
+    return 0;
+}
+
+#if HAVE_THREADS
+/**
+ * Post an event to the calling thread
+ *
+ * @return 0 on success, negative error code on failure
+ */
+static int libxevd_async_post(XevdAsync *async, const XevdAsyncEvent *ev)
+{
+    int ret;
+
+    pthread_mutex_lock(&async->mutex);
+    ret = av_fifo_write(async->events, ev, 1);
+    pthread_cond_broadcast(&async->cond);
+    pthread_mutex_unlock(&async->mutex);
+
+    return ret;
+}
+#endif
 
-                        frame->pkt_dts = imgb->ts[XEVD_TS_DTS];
-                        frame->pts = imgb->ts[XEVD_TS_PTS];
+/**
+ * Export the stream parameters after an SPS was decoded
+ *
+ * In asynchronous mode they are posted to the calling thread.
+ *
+ * @return 0 on success, negative error code on failure
+ */
+static int libxevd_output_stream_params(AVCodecContext *avctx)
+{
+    XevdContext *xectx = avctx->priv_data;
+
+#if HAVE_THREADS
+    if (xectx->async_ctx) {
+        XevdAsyncEvent ev = { .type = XEVD_ASYNC_PARAMS };
+        int ret = get_stream_params(xectx, avctx, &ev.params);
+        if (ret < 0)
+            return ret;
+        return libxevd_async_post(xectx->async_ctx, &ev);
+    }
+#endif
 
-                        av_packet_free(&pkt_au_imgb);
+    return export_stream_params(xectx, avctx);
+}
 
-                        // xevd_pull uses pool of objects of type XEVD_IMGB.
-                        // The pool size is equal MAX_PB_SIZE (26), so release object when it is no more needed
-                        imgb->release(imgb);
-                        imgb = NULL;
-                    }
-                }
+/**
+ * Output an image pulled from the decoder
+ *
+ * In asynchronous mode the image is posted to the calling thread, which exports it.
+ * The imgb object is always released eventually.
+ *
+ * @return 0 on success, negative error code on failure
+ */
+static int libxevd_output_image(AVCodecContext *avctx, XEVD_IMGB *imgb, int64_t pull_time)
+{
+#if HAVE_THREADS
+    XevdContext *xectx = avctx->priv_data;
+
+    if (xectx->async_ctx) {
+        XevdAsyncEvent ev = { .type = XEVD_ASYNC_IMAGE, .imgb = imgb, .pull_time = pull_time };
+        int ret = libxevd_async_post(xectx->async_ctx, &ev);
+        if (ret < 0)
+            imgb->release(imgb);
+        return ret;
+    }
+#endif
+
+    return libxevd_queue_frame(avctx, imgb, pull_time);
+}
+
+/**
+ * Assign the next sequence number to an access unit and keep its properties
+ *
+ * @param xectx
+ * @param[in] pkt access unit
+ * @return the properties slot of the access unit, NULL on allocation failure
+ */
+static XevdAuProps *libxevd_au_props_init(XevdContext *xectx, const AVPacket *pkt)
+{
+    XevdAuProps *props;
+
+    // 0 is never used as a sequence number, so an unset pdata[0] is detected on output
+    if (!++xectx->au_seq)
+        xectx->au_seq++;
+
+    // only the properties of the AU are kept, its data is not needed once decoded
+    props = &xectx->au_props[xectx->au_seq % XEVD_AU_PROPS_RING_SIZE];
+    av_packet_unref(props->pkt);
+    if (av_packet_copy_props(props->pkt, pkt) < 0)
+        return NULL;
+    props->pkt->size = pkt->size;
+    props->seq = xectx->au_seq;
+    props->decode_time = 0;
+    props->nb_nalus = 0;
+    props->bytes_read = 0;
+    props->slice_type = XEVD_ST_UNKNOWN;
+
+    return props;
+}
+
+/**
+ * Feed the NAL units of a packet to the decoder
+ *
+ * @param avctx codec context
+ * @param[in] pkt access unit, or a part of it
+ * @param props properties of the access unit, updated with its decoding statistics
+ * @param[in] skip_frame discard level of the access unit
+ * @param[in,out] fnum set to the frame number of the decoded picture, if any
+ * @return 0 on success, negative error code on failure
+ */
+static int libxevd_decode_nalus(AVCodecContext *avctx, const AVPacket *pkt, XevdAuProps *props,
+                                enum AVDiscard skip_frame, int *fnum)
+{
+    XevdContext *xectx = avctx->priv_data;
+    XEVD_STAT stat;
+    XEVD_BITB bitb;
+    int64_t time = 0;
+    int bs_read_pos = 0;
+    uint32_t nalu_size;
+    int xevd_ret;
+    int ret;
+
+    memset(&bitb, 0, sizeof(bitb));
+    bitb.pdata[0] = (void *)props->seq;
+    bitb.ts[XEVD_TS_DTS] = props->pkt->dts;
+
+    // get all nal units from AU
+    while (pkt->size > (bs_read_pos + xectx->nalu_length_size)) {
+        memset(&stat, 0, sizeof(XEVD_STAT));
+
+        nalu_size = read_nal_unit_length(pkt->data + bs_read_pos, xectx->nalu_length_size, avctx);
+        if (nalu_size == 0 || nalu_size > pkt->size - bs_read_pos - xectx->nalu_length_size) {
+            av_log(avctx, AV_LOG_ERROR, "Invalid bitstream\n");
+            return AVERROR_INVALIDDATA;
+        }
+        bs_read_pos += xectx->nalu_length_size;
+
+        bitb.addr = pkt->data + bs_read_pos;
+        bitb.ssize = nalu_size;
+
+        if (libxevd_skip_nalu(avctx, bitb.addr, nalu_size, skip_frame)) {
+            bs_read_pos += nalu_size;
+            continue;
+        }
+
+        /* main decoding block */
+        if (xectx->stats)
+            time = av_gettime_relative();
+        xevd_ret = libxevd_decode_nalu(xectx->id, &bitb, &stat);
+        if (xevd_ret == XEVD_ERR_BAD_CRC) {
+            ret = libxevd_bad_signature(avctx, props->pkt);
+            if (ret < 0)
+                return ret;
+        } else if (XEVD_FAILED(xevd_ret)) {
+            av_log(avctx, AV_LOG_ERROR, "Failed to decode bitstream\n");
+            return AVERROR_EXTERNAL;
+        }
+        if (xectx->stats) {
+            props->decode_time += av_gettime_relative() - time;
+            props->nb_nalus++;
+            props->bytes_read += stat.read;
+            if (stat.nalu_type == XEVD_NUT_IDR || stat.nalu_type == XEVD_NUT_NONIDR)
+                props->slice_type = stat.stype;
+        }
+
+        bs_read_pos += nalu_size;
+
+        if (stat.nalu_type == XEVD_NUT_SPS) { // EVC stream parameters changed
+            if ((ret = libxevd_output_stream_params(avctx)) != 0) {
+                av_log(avctx, AV_LOG_ERROR, "Failed to export stream params\n");
+                return ret;
             }
         }
-    } else { // decoder draining mode handling
 
-        xevd_ret = xevd_pull(xectx->id, &imgb);
+        if (stat.read != nalu_size)
+            av_log(avctx, AV_LOG_INFO, "Different reading of bitstream (in:%u, read:%d)\n,", nalu_size, stat.read);
 
-        if (xevd_ret == XEVD_ERR_UNEXPECTED) { // draining process completed
-            av_log(avctx, AV_LOG_DEBUG, "Draining process completed\n");
+        // stat.fnum - has negative value if the decoded data is not frame
+        if (stat.fnum >= 0)
+            *fnum = stat.fnum;
+    }
 
-            return AVERROR_EOF;
-        } else if (XEVD_FAILED(xevd_ret)) { // handle all other errors
-            av_log(avctx, AV_LOG_ERROR, "Failed to pull the decoded image (xevd error code: %d)\n", xevd_ret);
+    return 0;
+}
 
-            return AVERROR_EXTERNAL;
-        } else { // XEVD_OK
-            AVPacket* pkt_au_imgb;
-            if (!imgb) {
-                av_log(avctx, AV_LOG_ERROR, "Invalid decoded image data\n");
+/**
+ * Output every image the decoder releases once an access unit is decoded
+ *
+ * The image is pulled once the whole AU is decoded, so that the picture
+ * signature SEI following the slices has been checked.
+ *
+ * @param avctx codec context
+ * @param fnum frame number of the picture of the access unit, negative if it had none
+ * @return 0 on success, negative error code on failure
+ */
+static int libxevd_pull_images(AVCodecContext *avctx, int fnum)
+{
+    XevdContext *xectx = avctx->priv_data;
+    XEVD_IMGB *imgb = NULL;
+    int64_t time = 0;
+    int xevd_ret;
+    int ret;
 
+    if (fnum >= 0) {
+        int nb_pulled = 0;
+
+        // In low delay mode every image XEVD holds is pulled right away,
+        // so no picture waits for the next AU to be output.
+        do {
+            imgb = NULL;
+            if (xectx->stats)
+                time = av_gettime_relative();
+            xevd_ret = libxevd_pull(xectx->id, &imgb); // The function returns a valid image only if the return code is XEVD_OK
+            if (xectx->stats)
+                time = av_gettime_relative() - time;
+
+            if (XEVD_FAILED(xevd_ret)) {
+                if (nb_pulled && xevd_ret == XEVD_ERR_UNEXPECTED) // no image left
+                    break;
+                av_log(avctx, AV_LOG_ERROR, "Failed to pull the decoded image (xevd error code: %d, frame#=%d)\n", xevd_ret, fnum);
                 return AVERROR_EXTERNAL;
+            } else if (xevd_ret == XEVD_OK && imgb) { // got frame
+                // Several images may be released by a single AU when reordering catches up,
+                // so each of them is queued rather than returned directly.
+                ret = libxevd_output_image(avctx, imgb, time);
+                if (ret < 0)
+                    return ret;
+                nb_pulled++;
             }
+        } while (xectx->low_delay && xevd_ret == XEVD_OK && imgb);
+    }
+
+    return 0;
+}
 
-            pkt_au_imgb = (AVPacket*)imgb->pdata[0];
-            if(!pkt_au_imgb) {
-                av_log(avctx, AV_LOG_ERROR, "Invalid data needed to fill frame properties\n");
+/**
+ * Feed all NAL units of an access unit to the decoder and output every image it releases
+ *
+ * In asynchronous mode this runs in the decoding thread, the stream parameters
+ * and the images are then posted to the calling thread instead of being exported.
+ *
+ * @param avctx codec context
+ * @param[in] pkt access unit
+ * @param props properties of the access unit, updated with its decoding statistics
+ * @param[in] skip_frame discard level of the access unit
+ * @return 0 on success, negative error code on failure
+ */
+static int libxevd_decode_au_nalus(AVCodecContext *avctx, const AVPacket *pkt, XevdAuProps *props,
+                                   enum AVDiscard skip_frame)
+{
+    int fnum = -1;
+    int ret;
 
-                imgb->release(imgb);
-                imgb = NULL;
+    ret = libxevd_decode_nalus(avctx, pkt, props, skip_frame, &fnum);
+    if (ret < 0)
+        return ret;
 
-                av_frame_unref(frame);
+    return libxevd_pull_images(avctx, fnum);
+}
 
-                return AVERROR_INVALIDDATA;
-            }
+/**
+ * Feed all NAL units of an access unit to the decoder and queue every image it releases
+ *
+ * @param avctx codec context
+ * @param[in] pkt access unit
+ * @return 0 on success, negative error code on failure
+ */
+static int libxevd_decode_au(AVCodecContext *avctx, const AVPacket *pkt)
+{
+    XevdContext *xectx = avctx->priv_data;
+    XevdAuProps *props = libxevd_au_props_init(xectx, pkt);
+
+    if (!props)
+        return AVERROR(ENOMEM);
+
+    return libxevd_decode_au_nalus(avctx, pkt, props, avctx->skip_frame);
+}
+
+/**
+ * End the access unit the last NAL units fed with nal_input belong to and queue the images it releases
+ *
+ * @param avctx codec context
+ * @return 0 on success, negative error code on failure
+ */
+static int libxevd_nal_au_end(AVCodecContext *avctx)
+{
+    XevdContext *xectx = avctx->priv_data;
+    int fnum = xectx->nal_fnum;
+
+    if (!xectx->nal_props)
+        return 0;
+    xectx->nal_props = NULL;
+    xectx->nal_fnum  = -1;
+
+    return libxevd_pull_images(avctx, fnum);
+}
+
+/**
+ * Feed the NAL units of a packet holding a part of an access unit to the decoder
+ *
+ * An access unit starts with a packet with timestamps other than the ones of the
+ * previous packet. evc_frame_split leaves the NAL units following the first one
+ * of an AU without timestamps, RTP gives all of them the timestamp of the AU.
+ * The image of an AU is pulled when the next one starts.
+ *
+ * @param avctx codec context
+ * @param[in] pkt one or more NAL units
+ * @return 0 on success, negative error code on failure
+ */
+static int libxevd_decode_nal_packet(AVCodecContext *avctx, const AVPacket *pkt)
+{
+    XevdContext *xectx = avctx->priv_data;
+    XevdAuProps *props = xectx->nal_props;
+    int ret;
 
-            // got frame
-            ret = libxevd_image_copy(avctx, imgb, frame);
-            if(ret < 0) {
-                av_packet_free(&pkt_au_imgb);
-                av_frame_unref(frame);
+    if (!props || (pkt->pts != AV_NOPTS_VALUE && pkt->pts != props->pkt->pts) ||
+                  (pkt->dts != AV_NOPTS_VALUE && pkt->dts != props->pkt->dts)) {
+        ret = libxevd_nal_au_end(avctx);
+        if (ret < 0)
+            return ret;
 
-                imgb->release(imgb);
-                imgb = NULL;
+        props = xectx->nal_props = libxevd_au_props_init(xectx, pkt);
+        if (!props)
+            return AVERROR(ENOMEM);
+    } else {
+        props->pkt->size += pkt->size;
+    }
+
+    return libxevd_decode_nalus(avctx, pkt, props, avctx->skip_frame, &xectx->nal_fnum);
+}
+
+#if HAVE_THREADS
+/**
+ * Pull every image left in the decoder at the end of the stream, in the asynchronous decoding thread
+ *
+ * @return 0 on success, negative error code on failure
+ */
+static int libxevd_async_drain(AVCodecContext *avctx)
+{
+    XevdContext *xectx = avctx->priv_data;
+
+    for (;;) {
+        XEVD_IMGB *imgb = NULL;
+        int64_t time = xectx->stats ? av_gettime_relative() : 0;
+        int xevd_ret, ret;
+
+        xevd_ret = libxevd_pull(xectx->id, &imgb);
+        if (xectx->stats)
+            time = av_gettime_relative() - time;
+
+        if (xevd_ret == XEVD_ERR_UNEXPECTED) { // draining process completed
+            return 0;
+        } else if (XEVD_FAILED(xevd_ret)) {
+            av_log(avctx, AV_LOG_ERROR, "Failed to pull the decoded image (xevd error code: %d)\n", xevd_ret);
+            return AVERROR_EXTERNAL;
+        } else if (!imgb) {
+            av_log(avctx, AV_LOG_ERROR, "Invalid decoded image data\n");
+            return AVERROR_EXTERNAL;
+        }
+
+        ret = libxevd_output_image(avctx, imgb, time);
+        if (ret < 0)
+            return ret;
+    }
+}
+
+static void *libxevd_async_worker(void *arg)
+{
+    AVCodecContext *avctx = arg;
+    XevdContext *xectx = avctx->priv_data;
+    XevdAsync *async = xectx->async_ctx;
+    XevdAsyncPacket in;
+    XevdAsyncEvent ev = { 0 };
+    int eof, ret;
+
+    pthread_mutex_lock(&async->mutex);
+    for (;;) {
+        while (!async->quit && av_fifo_read(async->packets, &in, 1) < 0)
+            pthread_cond_wait(&async->cond, &async->mutex);
+        if (async->quit)
+            break;
+        async->busy = 1;
+        pthread_cond_broadcast(&async->cond);
+        pthread_mutex_unlock(&async->mutex);
+
+        eof = !in.pkt;
+        if (!eof) {
+            ret = libxevd_decode_au_nalus(avctx, in.pkt, in.props, in.skip_frame);
+            av_packet_free(&in.pkt);
+        } else {
+            ret = libxevd_async_drain(avctx);
+        }
+
+        pthread_mutex_lock(&async->mutex);
+        if (ret < 0) {
+            ev.type = XEVD_ASYNC_ERROR;
+            ev.err  = ret;
+            av_fifo_write(async->events, &ev, 1);
+        }
+        if (eof) { // the end of the stream is always reported, even after an error
+            ev.type = XEVD_ASYNC_EOF;
+            av_fifo_write(async->events, &ev, 1);
+        }
+        async->busy = 0;
+        pthread_cond_broadcast(&async->cond);
+    }
+    pthread_mutex_unlock(&async->mutex);
+
+    return NULL;
+}
+
+/**
+ * Handle an event posted by the decoding thread
+ *
+ * @return 0 on success, negative error code on failure
+ */
+static int libxevd_async_handle_event(AVCodecContext *avctx, const XevdAsyncEvent *ev)
+{
+    XevdContext *xectx = avctx->priv_data;
+
+    switch (ev->type) {
+    case XEVD_ASYNC_IMAGE:
+        return libxevd_queue_frame(avctx, ev->imgb, ev->pull_time);
+    case XEVD_ASYNC_PARAMS:
+        return set_stream_params(xectx, avctx, &ev->params);
+    case XEVD_ASYNC_ERROR:
+        return ev->err;
+    case XEVD_ASYNC_EOF:
+        av_log(avctx, AV_LOG_DEBUG, "Draining process completed\n");
+        xectx->async_ctx->eof = 1;
+        return 0;
+    }
+
+    return AVERROR_BUG;
+}
+
+/**
+ * Decode frame with the asynchronous decoding thread
+ *
+ * Access units are queued without waiting for them to be decoded, the calling
+ * thread only blocks when the queue is full and no picture is ready.
+ *
+ * @param avctx codec context
+ * @param[out] frame decoded frame
+ *
+ * @return 0 on success, negative error code on failure
+ */
+static int libxevd_async_receive_frame(AVCodecContext *avctx, AVFrame *frame)
+{
+    XevdContext *xectx = avctx->priv_data;
+    XevdAsync *async = xectx->async_ctx;
+    AVPacket *pkt = xectx->pkt;
+    XevdAsyncPacket in = { 0 };
+    XevdAsyncEvent ev;
+    AVFrame *queued;
+    int ret;
+
+    for (;;) {
+        if (av_fifo_read(xectx->frames, &queued, 1) >= 0) {
+            av_frame_move_ref(frame, queued);
+            av_frame_free(&queued);
+            return 0;
+        }
+
+        pthread_mutex_lock(&async->mutex);
+        ret = av_fifo_read(async->events, &ev, 1);
+        pthread_mutex_unlock(&async->mutex);
+        if (ret >= 0) {
+            ret = libxevd_async_handle_event(avctx, &ev);
+            if (ret < 0)
+                return ret;
+            continue;
+        }
+
+        if (async->eof)
+            return AVERROR_EOF;
 
+        if (!async->eof_sent && !async->eof_pending && !pkt->data) {
+            ret = libxevd_get_packet(avctx, pkt);
+            if (ret == AVERROR_EOF)
+                async->eof_pending = 1;
+            else if (ret < 0) // the decoding thread keeps working while the caller gets more data
                 return ret;
+        }
+
+        pthread_mutex_lock(&async->mutex);
+        if (!async->eof_sent && av_fifo_can_write(async->packets)) {
+            if (pkt->data) {
+                in.props = libxevd_au_props_init(xectx, pkt);
+                in.pkt   = av_packet_alloc();
+                if (!in.props || !in.pkt) {
+                    pthread_mutex_unlock(&async->mutex);
+                    av_packet_free(&in.pkt);
+                    av_packet_unref(pkt);
+                    return AVERROR(ENOMEM);
+                }
+                av_packet_move_ref(in.pkt, pkt);
+                in.skip_frame = avctx->skip_frame;
+            } else {
+                async->eof_pending = 0;
+                async->eof_sent    = 1;
             }
-            // use ff_decode_frame_props_from_pkt() to fill frame properties
-            ret = ff_decode_frame_props_from_pkt(avctx, frame, pkt_au_imgb);
-            if (ret < 0) {
-                av_log(avctx, AV_LOG_ERROR, "ff_decode_frame_props_from_pkt error\n");
+            av_fifo_write(async->packets, &in, 1);
+            pthread_cond_broadcast(&async->cond);
+        } else {
+            while (!av_fifo_can_read(async->events) &&
+                   (async->eof_sent || !av_fifo_can_write(async->packets)))
+                pthread_cond_wait(&async->cond, &async->mutex);
+        }
+        pthread_mutex_unlock(&async->mutex);
+    }
+}
+#endif
+
+/**
+ * Decode frame with decoupled packet/frame dataflow
+ *
+ * @param avctx codec context
+ * @param[out] frame decoded frame
+ *
+ * @return 0 on success, negative error code on failure
+ */
+static int libxevd_receive_frame(AVCodecContext *avctx, AVFrame *frame)
+{
+    XevdContext *xectx = avctx->priv_data;
+    AVPacket *pkt = xectx->pkt;
+    AVFrame *queued;
+    int xevd_ret;
+    int ret;
 
-                av_packet_free(&pkt_au_imgb);
-                av_frame_unref(frame);
+#if HAVE_THREADS
+    if (xectx->gop)
+        return libxevd_gop_receive_frame(avctx, frame);
+    if (xectx->async_ctx)
+        return libxevd_async_receive_frame(avctx, frame);
+#endif
+
+    // return the pictures already pulled from the decoder before feeding it any more data
+    if (av_fifo_read(xectx->frames, &queued, 1) >= 0) {
+        av_frame_move_ref(frame, queued);
+        av_frame_free(&queued);
+        return 0;
+    }
 
-                imgb->release(imgb);
-                imgb = NULL;
+    if (!xectx->draining_mode) {
+        // obtain access unit (input data) - a set of NAL units that are consecutive in decoding order and containing exactly one encoded image
+        ret = libxevd_get_packet(avctx, pkt);
+        if (ret == AVERROR_EOF) { // End of stream situations. Enter draining mode
+            xectx->draining_mode = 1;
 
+            // the last AU fed NAL by NAL ends with the stream
+            ret = libxevd_nal_au_end(avctx);
+            if (ret < 0)
                 return ret;
-            }
+            if (av_fifo_can_read(xectx->frames))
+                goto output;
+        } else if (ret < 0) {
+            return ret;
+        }
+    }
 
-            frame->pkt_dts = imgb->ts[XEVD_TS_DTS];
-            frame->pts = imgb->ts[XEVD_TS_PTS];
+    if (!xectx->draining_mode) {
+        ret = xectx->nal_input ? libxevd_decode_nal_packet(avctx, pkt) :
+                                 libxevd_decode_au(avctx, pkt);
+        av_packet_unref(pkt);
+        if (ret < 0)
+            return ret;
+    } else { // decoder draining mode handling
+        XEVD_IMGB *imgb = NULL;
+        int64_t time = xectx->stats ? av_gettime_relative() : 0;
 
-            av_packet_free(&pkt_au_imgb);
+        xevd_ret = libxevd_pull(xectx->id, &imgb);
+        if (xectx->stats)
+            time = av_gettime_relative() - time;
 
-            // xevd_pull uses pool of objects of type XEVD_IMGB.
-            // The pool size is equal MAX_PB_SIZE (26), so release object when it is no more needed
-            imgb->release(imgb);
-            imgb = NULL;
+        if (xevd_ret == XEVD_ERR_UNEXPECTED) { // draining process completed
+            av_log(avctx, AV_LOG_DEBUG, "Draining process completed\n");
 
-            return 0;
+            return AVERROR_EOF;
+        } else if (XEVD_FAILED(xevd_ret)) { // handle all other errors
+            av_log(avctx, AV_LOG_ERROR, "Failed to pull the decoded image (xevd error code: %d)\n", xevd_ret);
+
+            return AVERROR_EXTERNAL;
+        } else if (!imgb) { // XEVD_OK
+            av_log(avctx, AV_LOG_ERROR, "Invalid decoded image data\n");
+
+            return AVERROR_EXTERNAL;
         }
+
+        ret = libxevd_queue_frame(avctx, imgb, time);
+        if (ret < 0)
+            return ret;
     }
 
-    return ret;
+output:
+    if (av_fifo_read(xectx->frames, &queued, 1) < 0)
+        return AVERROR(EAGAIN);
+
+    av_frame_move_ref(frame, queued);
+    av_frame_free(&queued);
+
+    return 0;
+}
+
+/**
+ * Flush decoder
+ * Drop queued and buffered pictures while keeping the XEVD instance and its resources alive
+ *
+ * @param avctx codec context
+ */
+static av_cold void libxevd_flush(AVCodecContext *avctx)
+{
+    XevdContext *xectx = avctx->priv_data;
+    AVFrame *frame;
+
+#if HAVE_THREADS
+    // the decoding thread must be idle before the decoder state is reset
+    if (xectx->async_ctx)
+        libxevd_async_reset(xectx->async_ctx);
+#endif
+
+    while (av_fifo_read(xectx->frames, &frame, 1) >= 0)
+        av_frame_free(&frame);
+
+    for (int i = 0; i < XEVD_AU_PROPS_RING_SIZE; i++) {
+        av_packet_unref(xectx->au_props[i].pkt);
+        xectx->au_props[i].seq = 0;
+    }
+
+    // pictures XEVD still holds are discarded as soon as they are pulled
+    xectx->flush_seq = xectx->au_seq;
+    xectx->wait_idr = 1;
+    xectx->nal_props = NULL;
+    xectx->nal_fnum  = -1;
+
+    xectx->draining_mode = 0;
+    av_packet_unref(xectx->pkt);
+
+#if HAVE_THREADS
+    // GOP segments always start at an IDR picture
+    if (xectx->gop)
+        libxevd_gop_reset(xectx->gop);
+#endif
 }
 
 /**
@@ -505,13 +2657,29 @@ static int libxevd_receive_frame(AVCodecContext *avctx, AVFrame *frame)
 static av_cold int libxevd_close(AVCodecContext *avctx)
 {
     XevdContext *xectx = avctx->priv_data;
-    if (xectx->id) {
-        xevd_delete(xectx->id);
-        xectx->id = NULL;
+    AVFrame *frame;
+
+#if HAVE_THREADS
+    libxevd_gop_uninit(avctx);
+    libxevd_async_uninit(avctx);
+#endif
+
+    for (int i = 0; i < XEVD_AU_PROPS_RING_SIZE; i++)
+        av_packet_free(&xectx->au_props[i].pkt);
+
+    if (xectx->frames) {
+        while (av_fifo_read(xectx->frames, &frame, 1) >= 0)
+            av_frame_free(&frame);
+        av_fifo_freep2(&xectx->frames);
     }
 
+    // the XEVD instance is deleted once the last frame referencing its pictures is released
+    av_buffer_unref(&xectx->instance_ref);
+    xectx->id = NULL;
+
     xectx->draining_mode = 0;
     av_packet_free(&xectx->pkt);
+    ff_evc_ps_uninit(&xectx->ps);
 
     return 0;
 }
@@ -519,9 +2687,25 @@ static av_cold int libxevd_close(AVCodecContext *avctx)
 #define OFFSET(x) offsetof(XevdContext, x)
 #define VD AV_OPT_FLAG_VIDEO_PARAM | AV_OPT_FLAG_DECODING_PARAM
 
+static const AVOption libxevd_options[] = {
+    { "async", "Number of access units queued for a thread running XEVD in the background (0 disables)", OFFSET(async), AV_OPT_TYPE_INT, { .i64 = 0 }, 0, 16, VD },
+    { "cpus", "Restrict the decoder threads to a list of CPUs, e.g. 0-7,16-23", OFFSET(cpus), AV_OPT_TYPE_STRING, { .str = NULL }, 0, 0, VD },
+    { "nal_input", "Accept packets holding a part of an access unit, e.g. single NAL units, an access unit starting with new timestamps", OFFSET(nal_input), AV_OPT_TYPE_BOOL, { .i64 = 0 }, 0, 1, VD },
+    { "gop_threads", "Number of closed GOPs decoded in parallel by separate XEVD instances (0 disables)", OFFSET(gop_threads), AV_OPT_TYPE_INT, { .i64 = 0 }, 0, 64, VD },
+    { "dither", "Use ordered dithering instead of rounding for 8-bit output pixel formats", OFFSET(dither), AV_OPT_TYPE_BOOL, { .i64 = 0 }, 0, 1, VD },
+    { "output_pix_fmt", "Output pixel format, yuv420p10le, p010le, yuv420p or nv12, converted while the picture is copied out of XEVD", OFFSET(output_pix_fmt), AV_OPT_TYPE_PIXEL_FMT, { .i64 = AV_PIX_FMT_NONE }, -1, INT_MAX, VD },
+    { "stats", "Export per-frame decoding statistics as frame metadata", OFFSET(stats), AV_OPT_TYPE_BOOL, { .i64 = 0 }, 0, 1, VD },
+    { "max_exported_pictures", "Maximum number of decoded pictures exported without copying at the same time", OFFSET(max_exported), AV_OPT_TYPE_INT, { .i64 = XEVD_MAX_IMGB_IN_FLIGHT }, 1, XEVD_MAX_IMGB_IN_FLIGHT, VD },
+    { "exported_pictures_peak", "Highest number of decoded pictures exported without copying at the same time", OFFSET(exported_peak), AV_OPT_TYPE_INT, { .i64 = 0 }, 0, INT_MAX, VD | AV_OPT_FLAG_EXPORT | AV_OPT_FLAG_READONLY },
+    { "queued_frames_peak", "Highest number of decoded frames waiting to be returned at the same time", OFFSET(queued_peak), AV_OPT_TYPE_INT, { .i64 = 0 }, 0, INT_MAX, VD | AV_OPT_FLAG_EXPORT | AV_OPT_FLAG_READONLY },
+    { "zero_copy", "Export decoded pictures without copying them out of the XEVD picture pool", OFFSET(zero_copy), AV_OPT_TYPE_BOOL, { .i64 = 0 }, 0, 1, VD },
+    { NULL }
+};
+
 static const AVClass libxevd_class = {
     .class_name = "libxevd",
     .item_name  = av_default_item_name,
+    .option     = libxevd_options,
     .version    = LIBAVUTIL_VERSION_INT,
 };
 
@@ -532,11 +2716,13 @@ const FFCodec ff_libxevd_decoder = {
     .p.id               = AV_CODEC_ID_EVC,
     .init               = libxevd_init,
     FF_CODEC_RECEIVE_FRAME_CB(libxevd_receive_frame),
+    .flush              = libxevd_flush,
     .close              = libxevd_close,
     .priv_data_size     = sizeof(XevdContext),
     .p.priv_class       = &libxevd_class,
-    .p.capabilities     = AV_CODEC_CAP_DELAY | AV_CODEC_CAP_OTHER_THREADS | AV_CODEC_CAP_AVOID_PROBING,
+    .p.capabilities     = AV_CODEC_CAP_DELAY | AV_CODEC_CAP_OTHER_THREADS | AV_CODEC_CAP_AVOID_PROBING | AV_CODEC_CAP_DR1,
     .p.profiles         = NULL_IF_CONFIG_SMALL(ff_evc_profiles),
     .p.wrapper_name     = "libxevd",
-    .caps_internal      = FF_CODEC_CAP_INIT_CLEANUP | FF_CODEC_CAP_NOT_INIT_THREADSAFE | FF_CODEC_CAP_SETS_PKT_DTS | FF_CODEC_CAP_SETS_FRAME_PROPS
+    .caps_internal      = FF_CODEC_CAP_INIT_CLEANUP | FF_CODEC_CAP_NOT_INIT_THREADSAFE | FF_CODEC_CAP_SETS_PKT_DTS | FF_CODEC_CAP_SETS_FRAME_PROPS |
+                          FF_CODEC_CAP_EXPORTS_CROPPING
 };
@@ -22,6 +22,7 @@
  */
 
 #include <float.h>
+#include <stdatomic.h>
 #include <stdlib.h>
 
 #include <xeve.h>
@@ -34,15 +35,41 @@
 #include "libavutil/time.h"
 #include "libavutil/cpu.h"
 #include "libavutil/avstring.h"
+#include "libavutil/buffer.h"
+#include "libavutil/fifo.h"
+#include "libavutil/file_open.h"
+#include "libavutil/imgutils.h"
+#include "libavutil/thread.h"
+#include "libavutil/trace.h"
 
 #include "avcodec.h"
 #include "internal.h"
 #include "packet_internal.h"
 #include "codec_internal.h"
 #include "profiles.h"
+#include "sei.h"
 #include "encode.h"
+#include "evc.h"
+#include "evc_parse.h"
+#include "thread_affinity.h"
 
-#define MAX_BS_BUF (16*1024*1024)
+// Room for the parameter sets and SEI messages written along with a picture
+#define BS_BUF_HEADER_SIZE (64*1024)
+
+// Rate control mode of the wrapper: XEVE ABR with the VBV buffer kept full with filler data
+#define RC_CBR (XEVE_RC_CRF + 1)
+
+// Tune of the wrapper: XEVE without tune, with intra block copy for screen content
+#define TUNE_SCREEN (XEVE_TUNE_PSNR + 1)
+
+// Presets of the wrapper: the XEVE fast preset with a smaller search and fewer tools
+#define PRESET_SUPERFAST (XEVE_PRESET_PLACEBO + 1)
+#define PRESET_ULTRAFAST (XEVE_PRESET_PLACEBO + 2)
+
+// Deadline mode: minimum number of frames the encoding time is averaged over, and number of
+// consecutive windows encoded in less than half the frame interval before a slower preset is tried
+#define DEADLINE_WINDOW 8
+#define DEADLINE_CALM_WINDOWS 8
 
 /**
  * Error codes
@@ -53,14 +80,69 @@
 /**
  * Encoder states
  *
- * STATE_ENCODING - the encoder receives and processes input frames
- * STATE_BUMPING  - there are no more input frames, however the encoder still processes previously received data
+ * STATE_ENCODING  - the encoder receives and processes input frames
+ * STATE_BUMPING   - there are no more input frames, however the encoder still processes previously received data
+ * STATE_SWITCHING - the instance is bumped out before an instance with another preset takes over the input
  */
 typedef enum State {
     STATE_ENCODING,
     STATE_BUMPING,
+    STATE_SWITCHING,
 } State;
 
+/**
+ * Input image descriptor referencing the planes of the frame it was made from.
+ * XEVE takes references to the descriptors it still reads from after xeve_push() returns,
+ * the frame is released once the last one is dropped.
+ */
+typedef struct XeveInputImgb {
+    XEVE_IMGB imgb;     // must be the first member, XEVE only knows about the image buffer
+    AVFrame *frame;     // frame owning the planes the image points to
+    AVBufferRef *planes; // planar copy of semi-planar input, XEVE only reads planar images
+    atomic_int refcnt;
+} XeveInputImgb;
+
+#if HAVE_THREADS
+/**
+ * A run of consecutive input frames encoded as a closed GOP sequence by a separate XEVE instance
+ */
+typedef struct XeveChunk {
+    XeveInputImgb *inputs;  // input frames in presentation order
+    int nb_frames;
+
+    AVFifo *pkts;           // AVPacket * in decoding order, filled by the thread encoding the chunk
+
+    // set under XeveChunks.mutex once the chunk is encoded
+    int done;
+    int err;
+} XeveChunk;
+
+/**
+ * The state of the chunked GOP-parallel encoding mode
+ */
+typedef struct XeveChunks {
+    pthread_t *threads;
+    int nb_threads;
+
+    pthread_mutex_t mutex;
+    pthread_cond_t job_cond;    // signaled when a chunk is queued or when the threads have to quit
+    pthread_cond_t done_cond;   // signaled when a chunk is encoded
+    int sync_init;
+
+    AVFifo *jobs;               // chunks waiting for a thread, protected by mutex
+    int quit;
+    atomic_int abort;           // the chunks in flight are dropped
+
+    // only accessed by the encoding thread
+    AVFifo *chunks;             // chunks handed to the threads, in presentation order
+    XeveChunk *cur;             // chunk being collected
+    int64_t last_dts;           // dts of the last returned packet
+    int64_t dts_offset;         // added to the dts of the packets of the chunk being returned
+    int chunk_start;            // the next packet is the first one of a chunk
+    int eof;
+} XeveChunks;
+#endif
+
 /**
  * The structure stores all the states associated with the instance of Xeve MPEG-5 EVC encoder
  */
@@ -70,26 +152,91 @@ typedef struct XeveContext {
     XEVE id;            // XEVE instance identifier
     XEVE_CDSC cdsc;     // coding parameters i.e profile, width & height of input frame, num of therads, frame rate ...
     XEVE_BITB bitb;     // bitstream buffer (output)
+    AVBufferPool *bs_pool; // pool of bitstream buffers XEVE writes to, handed over to packets without copying
+    AVBufferRef *bs_buf;   // bitstream buffer passed to the next xeve_encode() call
+    int bs_buf_size;    // size of a bitstream buffer, enough for any picture with the current settings
+    atomic_int nb_bs_bufs; // bitstream buffers allocated by bs_pool, the chunk threads included
     XEVE_STAT stat;     // encoding status (output)
-    XEVE_IMGB imgb;     // image buffer (input)
+    XEVE_IMGB imgb;     // image buffer (input) template, describing the geometry of the input images
+    AVBufferPool *planes_pool; // pool of planar images semi-planar input is de-interleaved into
+    int planes_stride[3];
+
+    XeveInputImgb **inputs; // input image descriptors, reused once XEVE released them
+    int nb_inputs;
+    int input_pictures_peak; // nb_inputs, exported
+    int bs_buffers_peak;     // nb_bs_bufs, exported
+    XeveInputImgb **psnr_inputs; // pushed images kept until the error of their picture is computed
+    int nb_psnr_inputs;
+    AVFrame *frame;     // input frame obtained with ff_encode_get_frame()
 
     State state;        // encoder state (skipping, encoding, bumping)
 
     int profile_id;     // encoder profile (main, baseline)
     int preset_id;      // preset of xeve ( fast, medium, slow, placebo)
-    int tune_id;        // tune of xeve (psnr, zerolatency)
+    int tune_id;        // tune of xeve (psnr, zerolatency) or TUNE_SCREEN
+    int ibc;            // intra block copy, -1 to enable it with TUNE_SCREEN only
 
     // variables for rate control modes
-    int rc_mode;        // Rate control mode [ 0(CQP) / 1(ABR) / 2(CRF) ]
+    int rc_mode;        // Rate control mode [ 0(CQP) / 1(ABR) / 2(CRF) / 3(CBR) ]
     int qp;             // quantization parameter (QP) [0,51]
     int crf;            // constant rate factor (CRF) [10,49]
 
+    int roi_warned;     // the missing support for regions of interest was reported
+
+    int scenecut;       // scene cut threshold in percent of the sample range, 0 to disable
+    uint16_t *scenecut_blocks; // luma 8x8 block averages of the previous frame
+    int scenecut_valid; // scenecut_blocks holds a frame
+
     int hash;           // embed picture signature (HASH) for conformance checking in decoding
     int sei_info;       // embed Supplemental enhancement information while encoding
+    int recovery_point_sei; // mark the non-IDR intra pictures as recovery points
 
-    int color_format;   // input data color format: currently only XEVE_CF_YCBCR420 is supported
+    int color_format;   // input data color format: XEVE_CF_YCBCR400, 420, 422 or 444
+    int codec_bit_depth; // bit depth of the coded samples, 0 for the XEVE default
+    int lookahead;      // pictures analyzed ahead by the rate control, -1 for the XEVE default
+    int delay_frames;   // frames pushed before the first packet, -1 once it was returned
 
     AVDictionary *xeve_params;
+
+    int chunk_threads;  // number of chunks encoded in parallel by separate XEVE instances
+    int chunk_size;     // number of frames per chunk
+    int b_adapt;        // choose the B picture pyramid depth of every chunk, up to bf
+
+    int tile_columns;   // number of tile columns, 0 for a single one
+    int tile_rows;      // number of tile rows, 0 for a single one
+    int uniform_tiles;  // tiles of the same size, otherwise set by tile_widths and tile_heights
+    char *tile_widths;  // comma separated tile column widths in CTUs
+    char *tile_heights; // comma separated tile row heights in CTUs
+    int tile_loop_filter; // filter across the tile boundaries, -1 for the XEVE default
+#if HAVE_THREADS
+    XeveChunks *chunks;
+#endif
+
+    char *cpus;         // CPUs the XEVE and chunk threads are restricted to
+
+    // deadline mode, stepping the preset to keep the encoding time within the frame interval
+    int deadline;
+    int64_t deadline_budget; // frame interval in microseconds
+    int deadline_preset;    // preset of the running instance
+    int deadline_next;      // preset of the instance to switch to, -1 if none
+    int64_t deadline_time;  // encoding time of the frames of the current window, in microseconds
+    int deadline_frames;    // number of frames of the current window
+    int deadline_calm;      // consecutive windows encoded in less than half the budget
+    AVFrame *switch_frame;  // first frame of the next instance
+    int new_extradata;      // the next packet is the first one of a new instance
+    int64_t last_dts;       // dts of the last returned packet
+    int64_t dts_offset;     // added to the dts of the packets of the running instance
+    int instance_start;     // the next packet is the first one of an instance
+
+    // frames later than max_latency behind real time are dropped before reaching XEVE
+    int64_t max_latency;    // in microseconds, 0 to never drop frames
+    int64_t latency_origin; // wall clock time of pts 0 of a source in real time, in microseconds
+    int dropped_frames;
+
+    char *stats_log;        // path of the per-packet statistics CSV file
+    FILE *stats_file;
+
+    int shard;              // one shard of a distributed encode, joined with the other ones afterwards
 } XeveContext;
 
 /**
@@ -109,6 +256,23 @@ static int libxeve_color_fmt(enum AVPixelFormat av_pix_fmt, int *xeve_col_fmt)
     case AV_PIX_FMT_YUV420P10:
         *xeve_col_fmt = XEVE_CF_YCBCR420;
         break;
+    case AV_PIX_FMT_NV12:
+    case AV_PIX_FMT_P010:
+        // the chroma planes are de-interleaved before the image is pushed
+        *xeve_col_fmt = XEVE_CF_YCBCR420;
+        break;
+    case AV_PIX_FMT_YUV422P:
+    case AV_PIX_FMT_YUV422P10:
+        *xeve_col_fmt = XEVE_CF_YCBCR422;
+        break;
+    case AV_PIX_FMT_YUV444P:
+    case AV_PIX_FMT_YUV444P10:
+        *xeve_col_fmt = XEVE_CF_YCBCR444;
+        break;
+    case AV_PIX_FMT_GRAY8:
+    case AV_PIX_FMT_GRAY10:
+        *xeve_col_fmt = XEVE_CF_YCBCR400;
+        break;
     default:
         *xeve_col_fmt = XEVE_CF_UNKNOWN;
         return AVERROR_INVALIDDATA;
@@ -126,27 +290,291 @@ static int libxeve_color_fmt(enum AVPixelFormat av_pix_fmt, int *xeve_col_fmt)
  */
 static int libxeve_color_space(enum AVPixelFormat av_pix_fmt)
 {
-    /* color space of input image */
-    int cs = XEVE_CF_UNKNOWN;
+    const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(av_pix_fmt);
+    int color_format, depth;
 
-    switch (av_pix_fmt) {
-    case AV_PIX_FMT_YUV420P:
-        cs = XEVE_CS_YCBCR420;
-        break;
-    case AV_PIX_FMT_YUV420P10:
-#if AV_HAVE_BIGENDIAN
-        cs = XEVE_CS_SET(XEVE_CF_YCBCR420, 10, 1);
-#else
-        cs = XEVE_CS_YCBCR420_10LE;
-#endif
+    if (!desc || libxeve_color_fmt(av_pix_fmt, &color_format) < 0)
+        return XEVE_CF_UNKNOWN;
 
-        break;
+    // P010 samples are converted to native endian planar ones
+    depth = desc->comp[0].depth;
+    return XEVE_CS_SET(color_format, depth, depth > 8 && AV_HAVE_BIGENDIAN);
+}
+
+/**
+ * Get the pixel format of the reconstructed pictures
+ *
+ * @param[in] color_format XEVE pre-defined color format of the input
+ * @param[in] depth coded bit depth
+ * @return planar pixel format with the chroma subsampling of the input
+ */
+static enum AVPixelFormat libxeve_recon_format(int color_format, int depth)
+{
+    switch (color_format) {
+    case XEVE_CF_YCBCR400:
+        return depth > 8 ? AV_PIX_FMT_GRAY10 : AV_PIX_FMT_GRAY8;
+    case XEVE_CF_YCBCR422:
+        return depth > 8 ? AV_PIX_FMT_YUV422P10 : AV_PIX_FMT_YUV422P;
+    case XEVE_CF_YCBCR444:
+        return depth > 8 ? AV_PIX_FMT_YUV444P10 : AV_PIX_FMT_YUV444P;
     default:
-        cs = XEVE_CF_UNKNOWN;
-        break;
+        return depth > 8 ? AV_PIX_FMT_YUV420P10 : AV_PIX_FMT_YUV420P;
+    }
+}
+
+/**
+ * Get the tune XEVE is configured with for the tune of the wrapper
+ */
+static int xeve_tune(const XeveContext *xectx)
+{
+    return xectx->tune_id == TUNE_SCREEN ? XEVE_TUNE_NONE : xectx->tune_id;
+}
+
+typedef struct XevePresetParam {
+    const char *key;
+    const char *value;
+} XevePresetParam;
+
+// set on top of the XEVE fast preset, before xeve_params
+static const XevePresetParam superfast_params[] = {
+    { "me_range",     "16" },
+    { "rdoq",         "0"  },
+    { "cabac_refine", "0"  },
+    { NULL },
+};
+
+// the Baseline toolset and a quadtree partitioning for the Main profile as well
+static const XevePresetParam ultrafast_params[] = {
+    { "me_range",     "8"  },
+    { "me_ref_num",   "1"  },
+    { "rdoq",         "0"  },
+    { "cabac_refine", "0"  },
+    { "btt",          "0"  },
+    { "suco",         "0"  },
+    { "tool_amvr",    "0"  },
+    { "tool_mmvd",    "0"  },
+    { "tool_affine",  "0"  },
+    { "tool_dmvr",    "0"  },
+    { "tool_ats",     "0"  },
+    { "tool_alf",     "0"  },
+    { "tool_adcc",    "0"  },
+    { NULL },
+};
+
+/**
+ * Set the parameters of a preset of XEVE or of the wrapper
+ *
+ * @param[in] logctx logging context
+ * @param[out] param XEVE parameters
+ * @param[in] profile XEVE profile
+ * @param[in] preset preset of XEVE or of the wrapper
+ * @param[in] tune XEVE tune
+ * @return XEVE_OK on success, XEVE error code on failure
+ */
+static int xeve_preset(void *logctx, XEVE_PARAM *param, int profile, int preset, int tune)
+{
+    const XevePresetParam *p = preset == PRESET_ULTRAFAST ? ultrafast_params :
+                               preset == PRESET_SUPERFAST ? superfast_params : NULL;
+    int ret;
+
+    ret = xeve_param_ppt(param, profile, p ? XEVE_PRESET_FAST : preset, tune);
+    if (XEVE_FAILED(ret) || !p)
+        return ret;
+
+    for (; p->key; p++) {
+        ret = xeve_param_parse(param, p->key, p->value);
+        if (XEVE_FAILED(ret)) {
+            av_log(logctx, AV_LOG_ERROR, "XEVE does not take the %s parameter of the preset\n", p->key);
+            return ret;
+        }
+    }
+
+    return XEVE_OK;
+}
+
+/**
+ * Set the coding tools that the wrapper controls, after the preset set its own
+ *
+ * @param[in] avctx codec context
+ * @param[out] param XEVE parameters
+ * @return 0 on success, negative error code on failure
+ */
+static int set_tools(AVCodecContext *avctx, XEVE_PARAM *param)
+{
+    XeveContext *xectx = avctx->priv_data;
+    int ibc = xectx->ibc >= 0 ? xectx->ibc : xectx->tune_id == TUNE_SCREEN;
+
+    // intra block copy is a tool of the Main profile, static regions of screen content become
+    // cheap copies of already coded blocks of the same picture
+    if (ibc && xectx->profile_id != XEVE_PROFILE_MAIN) {
+        if (xectx->ibc > 0) {
+            av_log(avctx, AV_LOG_ERROR, "Intra block copy requires the main profile\n");
+            return AVERROR(EINVAL);
+        }
+        av_log(avctx, AV_LOG_WARNING, "Intra block copy requires the main profile, tune=screen does not use it\n");
+        ibc = 0;
+    }
+    if (xectx->ibc >= 0 || ibc)
+        param->ibc_flag = ibc;
+
+    return 0;
+}
+
+// A.4.1 table A.1: maximum number of slices per picture, tile rows and tile columns of the levels,
+// level_idc being 10 times the level number as XEVE takes it
+static const struct {
+    int level_idc;
+    int max_slices;
+    int max_tile_rows;
+    int max_tile_cols;
+} level_limits[] = {
+    { 10,  16,  1,  1 },
+    { 20,  16,  1,  1 },
+    { 21,  20,  1,  1 },
+    { 30,  30,  2,  2 },
+    { 31,  40,  3,  3 },
+    { 40,  75,  5,  5 },
+    { 41,  75,  5,  5 },
+    { 50, 200, 11, 10 },
+    { 51, 200, 11, 10 },
+    { 52, 200, 11, 10 },
+    { 60, 600, 22, 20 },
+    { 61, 600, 22, 20 },
+    { 62, 600, 22, 20 },
+};
+
+/**
+ * Parse a comma separated list of tile sizes in CTUs
+ *
+ * @return 0 on success, negative error code if the list does not hold exactly nb_sizes sizes
+ */
+static int parse_tile_sizes(AVCodecContext *avctx, const char *str, int *sizes, int nb_sizes)
+{
+    const char *p = str;
+    int n = 0;
+
+    while (*p) {
+        char *end;
+        long size = strtol(p, &end, 10);
+
+        if (end == p || size <= 0 || size > INT_MAX || n == nb_sizes || (*end && *end != ','))
+            break;
+        sizes[n++] = size;
+        p = *end ? end + 1 : end;
+    }
+
+    if (*p || n != nb_sizes) {
+        av_log(avctx, AV_LOG_ERROR, "Invalid tile sizes '%s', %d positive sizes are expected\n", str, nb_sizes);
+        return AVERROR(EINVAL);
+    }
+
+    return 0;
+}
+
+/**
+ * Set the tile and slice layout of the pictures, checked against the limits of the level
+ *
+ * Slices are rectangular groups of tiles: one slice per tile, or slices made of whole rows of tiles.
+ *
+ * @param[in] avctx codec context
+ * @param[out] param XEVE parameters
+ * @return 0 on success, negative error code on failure
+ */
+static int set_tiles(AVCodecContext *avctx, XEVE_PARAM *param)
+{
+    XeveContext *xectx = avctx->priv_data;
+    int cols = FFMAX(xectx->tile_columns, 1);
+    int rows = FFMAX(xectx->tile_rows, 1);
+    int slices = FFMAX(avctx->slices, 1);
+    int max_cols = EVC_MAX_TILE_COLUMNS, max_rows = EVC_MAX_TILE_ROWS, max_slices = EVC_MAX_SLICE_SEGMENTS;
+    int ret;
+
+    if (cols == 1 && rows == 1 && slices == 1 && xectx->tile_loop_filter < 0)
+        return 0;
+
+    for (int i = 0; i < FF_ARRAY_ELEMS(level_limits); i++) {
+        if (level_limits[i].level_idc == avctx->level) {
+            max_cols   = level_limits[i].max_tile_cols;
+            max_rows   = level_limits[i].max_tile_rows;
+            max_slices = level_limits[i].max_slices;
+        }
+    }
+    if (cols > max_cols || rows > max_rows || slices > max_slices) {
+        av_log(avctx, AV_LOG_ERROR, "%dx%d tiles and %d slices exceed the limits of the level: "
+               "%dx%d tiles and %d slices\n", cols, rows, slices, max_cols, max_rows, max_slices);
+        return AVERROR(EINVAL);
+    }
+    if (slices > rows && slices != cols * rows) {
+        av_log(avctx, AV_LOG_ERROR, "The number of slices must be at most the number of tile rows (%d) "
+               "or equal to the number of tiles (%d)\n", rows, cols * rows);
+        return AVERROR(EINVAL);
+    }
+
+    param->tile_columns = cols;
+    param->tile_rows    = rows;
+    param->tile_uniform_spacing_flag = xectx->uniform_tiles;
+    if (!xectx->uniform_tiles) {
+        if (!xectx->tile_widths || !xectx->tile_heights) {
+            av_log(avctx, AV_LOG_ERROR, "Non uniform tiles require tile_widths and tile_heights\n");
+            return AVERROR(EINVAL);
+        }
+        if ((ret = parse_tile_sizes(avctx, xectx->tile_widths, param->tile_column_width_array, cols)) < 0 ||
+            (ret = parse_tile_sizes(avctx, xectx->tile_heights, param->tile_row_height_array, rows)) < 0)
+            return ret;
+    }
+
+    // each slice is given by the indices of its top-left and bottom-right tiles
+    param->arbitrary_slice_flag = 0;
+    param->num_slice_in_pic     = slices;
+    for (int i = 0; i < slices; i++) {
+        if (slices == cols * rows) {
+            param->tile_array_in_slice[2 * i]     = i;
+            param->tile_array_in_slice[2 * i + 1] = i;
+        } else {
+            param->tile_array_in_slice[2 * i]     = i * rows / slices * cols;
+            param->tile_array_in_slice[2 * i + 1] = (i + 1) * rows / slices * cols - 1;
+        }
+    }
+
+    if (xectx->tile_loop_filter >= 0)
+        param->loop_filter_across_tiles_enabled_flag = xectx->tile_loop_filter;
+
+    return 0;
+}
+
+/**
+ * Apply a preset, then the settings of the wrapper that the preset must not override
+ *
+ * The overrides given with xeve-params are not applied here.
+ *
+ * @param[in] avctx codec context
+ * @param[in,out] param XEVE parameters
+ * @param[in] preset preset of XEVE or of the wrapper
+ * @return 0 on success, negative error code on failure
+ */
+static int set_preset(AVCodecContext *avctx, XEVE_PARAM *param, int preset)
+{
+    XeveContext *xectx = avctx->priv_data;
+    int ret;
+
+    ret = xeve_preset(avctx, param, xectx->profile_id, preset, xeve_tune(xectx));
+    if (XEVE_FAILED(ret)) {
+        av_log(avctx, AV_LOG_ERROR, "Cannot set profile(%d), preset(%d), tune(%d)\n", xectx->profile_id, preset, xectx->tune_id);
+        return AVERROR_EXTERNAL;
     }
 
-    return cs;
+    if (xectx->lookahead >= 0)
+        param->lookahead = xectx->lookahead;
+
+    ret = set_tools(avctx, param);
+    if (ret < 0)
+        return ret;
+
+    // a shard is decoded from its first picture on, its GOPs must not reference the previous shard
+    if (xectx->shard)
+        param->closed_gop = 1;
+
+    return set_tiles(avctx, param);
 }
 
 /**
@@ -211,21 +639,51 @@ static int get_conf(AVCodecContext *avctx, XEVE_CDSC *cdsc)
         return AVERROR_INVALIDDATA;
     }
 
+    // a pyramid of bf B pictures keeps log2(bf + 1) + 1 reference pictures
+    if (avctx->refs > 0) {
+        int bframes = cdsc->param.bframes;
+
+        while (bframes && av_log2(bframes + 1) + 1 > avctx->refs)
+            bframes >>= 1;
+        if (bframes != cdsc->param.bframes) {
+            av_log(avctx, AV_LOG_VERBOSE, "%d B frames instead of %d to keep %d reference pictures\n",
+                   bframes, cdsc->param.bframes, avctx->refs);
+            cdsc->param.bframes = bframes;
+        }
+    }
+
     cdsc->param.level_idc = avctx->level;
 
     if (avctx->rc_buffer_size)   // VBV buf size
         cdsc->param.vbv_bufsize = (int)(avctx->rc_buffer_size / 1000);
 
-    cdsc->param.rc_type = xectx->rc_mode;
+    cdsc->param.rc_type = xectx->rc_mode == RC_CBR ? XEVE_RC_ABR : xectx->rc_mode;
 
     if (xectx->rc_mode == XEVE_RC_CQP)
         cdsc->param.qp = xectx->qp;
-    else if (xectx->rc_mode == XEVE_RC_ABR) {
+    else if (xectx->rc_mode == XEVE_RC_ABR || xectx->rc_mode == RC_CBR) {
         if (avctx->bit_rate / 1000 > INT_MAX || avctx->rc_max_rate / 1000 > INT_MAX) {
             av_log(avctx, AV_LOG_ERROR, "Not supported bitrate bit_rate and rc_max_rate > %d000\n", INT_MAX);
             return AVERROR_INVALIDDATA;
         }
         cdsc->param.bitrate = (int)(avctx->bit_rate / 1000);
+
+        // XEVE has no peak rate, the only constraint it honors is the VBV buffer
+        if (xectx->rc_mode == RC_CBR) {
+            if (!cdsc->param.bitrate) {
+                av_log(avctx, AV_LOG_ERROR, "CBR requires a bitrate\n");
+                return AVERROR(EINVAL);
+            }
+            if ((avctx->rc_max_rate && avctx->rc_max_rate != avctx->bit_rate) ||
+                (avctx->rc_min_rate && avctx->rc_min_rate != avctx->bit_rate)) {
+                av_log(avctx, AV_LOG_ERROR, "CBR requires maxrate and minrate to be unset or equal to the bitrate\n");
+                return AVERROR(EINVAL);
+            }
+            if (!cdsc->param.vbv_bufsize)
+                cdsc->param.vbv_bufsize = cdsc->param.bitrate; // one second
+            cdsc->param.use_filler = 1;
+        } else if (avctx->rc_max_rate)
+            av_log(avctx, AV_LOG_WARNING, "maxrate is not supported by XEVE, use bufsize to constrain the rate\n");
     } else if (xectx->rc_mode == XEVE_RC_CRF)
         cdsc->param.crf = xectx->crf;
     else {
@@ -234,7 +692,7 @@ static int get_conf(AVCodecContext *avctx, XEVE_CDSC *cdsc)
     }
 
     if (avctx->thread_count <= 0) {
-        int cpu_count = av_cpu_count();
+        int cpu_count = ff_thread_available_cpus(avctx);
         cdsc->param.threads = (cpu_count < XEVE_MAX_THREADS) ? cpu_count : XEVE_MAX_THREADS;
     } else if (avctx->thread_count > XEVE_MAX_THREADS)
         cdsc->param.threads = XEVE_MAX_THREADS;
@@ -244,17 +702,61 @@ static int get_conf(AVCodecContext *avctx, XEVE_CDSC *cdsc)
 
     libxeve_color_fmt(avctx->pix_fmt, &xectx->color_format);
 
-    cdsc->param.cs = XEVE_CS_SET(xectx->color_format, cdsc->param.codec_bit_depth, AV_HAVE_BIGENDIAN);
+    // the Baseline profile only codes 4:0:0 and 4:2:0
+    if ((xectx->color_format == XEVE_CF_YCBCR422 || xectx->color_format == XEVE_CF_YCBCR444) &&
+        xectx->profile_id != XEVE_PROFILE_MAIN) {
+        av_log(avctx, AV_LOG_ERROR, "%s input requires the main profile\n",
+               av_get_pix_fmt_name(avctx->pix_fmt));
+        return AVERROR(EINVAL);
+    }
 
-    cdsc->max_bs_buf_size = MAX_BS_BUF;
+    // XEVE converts the input samples to the coded bit depth while reading the pushed image
+    if (xectx->codec_bit_depth) {
+        const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(avctx->pix_fmt);
 
-    ret = xeve_param_ppt(&cdsc->param, xectx->profile_id, xectx->preset_id, xectx->tune_id);
-    if (XEVE_FAILED(ret)) {
-        av_log(avctx, AV_LOG_ERROR, "Cannot set profile(%d), preset(%d), tune(%d)\n", xectx->profile_id, xectx->preset_id, xectx->tune_id);
-        return AVERROR_EXTERNAL;
+        if (xectx->codec_bit_depth != 8 && xectx->codec_bit_depth != 10) {
+            av_log(avctx, AV_LOG_ERROR, "Unsupported coded bit depth: %d\n", xectx->codec_bit_depth);
+            return AVERROR(EINVAL);
+        }
+        if (desc && xectx->codec_bit_depth < desc->comp[0].depth) {
+            av_log(avctx, AV_LOG_ERROR, "Coded bit depth %d is lower than the %d-bit input\n",
+                   xectx->codec_bit_depth, desc->comp[0].depth);
+            return AVERROR(EINVAL);
+        }
+        cdsc->param.codec_bit_depth = xectx->codec_bit_depth;
     }
 
-    return 0;
+    cdsc->param.cs = XEVE_CS_SET(xectx->color_format, cdsc->param.codec_bit_depth, AV_HAVE_BIGENDIAN);
+
+    cdsc->max_bs_buf_size = xectx->bs_buf_size;
+
+    return set_preset(avctx, &cdsc->param, xectx->preset_id);
+}
+
+/**
+ * Compute the size of the bitstream buffer large enough to hold any coded picture
+ *
+ * A coded picture does not exceed the size of the uncompressed one.
+ * With a VBV buffer set, it also never exceeds the VBV buffer size.
+ *
+ * @param[in] avctx codec context
+ * @return the bitstream buffer size in bytes, negative error code on failure
+ */
+static int libxeve_bs_buf_size(AVCodecContext *avctx)
+{
+    int64_t size = av_image_get_buffer_size(avctx->pix_fmt, avctx->width, avctx->height, 1);
+
+    if (size < 0)
+        return size;
+
+    if (avctx->rc_buffer_size > 0)
+        size = FFMIN(size, (avctx->rc_buffer_size + 7) / 8);
+
+    size += BS_BUF_HEADER_SIZE;
+    if (size > INT_MAX - AV_INPUT_BUFFER_PADDING_SIZE)
+        return AVERROR(EINVAL);
+
+    return size;
 }
 
 /**
@@ -296,87 +798,1612 @@ static int set_extra_config(AVCodecContext *avctx, XEVE id, XeveContext *ctx)
     return 0;
 }
 
+static int libxeve_imgb_addref(XEVE_IMGB *imgb)
+{
+    XeveInputImgb *in = (XeveInputImgb *)imgb;
+
+    return atomic_fetch_add_explicit(&in->refcnt, 1, memory_order_relaxed) + 1;
+}
+
+static int libxeve_imgb_getref(XEVE_IMGB *imgb)
+{
+    XeveInputImgb *in = (XeveInputImgb *)imgb;
+
+    return atomic_load_explicit(&in->refcnt, memory_order_acquire);
+}
+
+static int libxeve_imgb_release(XEVE_IMGB *imgb)
+{
+    XeveInputImgb *in = (XeveInputImgb *)imgb;
+    int refcnt = atomic_fetch_sub_explicit(&in->refcnt, 1, memory_order_acq_rel) - 1;
+
+    // the descriptor becomes available for reuse only after its frame is gone
+    if (!refcnt) {
+        av_frame_unref(in->frame);
+        av_buffer_unref(&in->planes);
+    }
+
+    return refcnt;
+}
+
 /**
- * @brief Switch encoder to bumping mode
+ * Get an input image descriptor XEVE does not reference anymore
  *
- * @param id XEVE encodec instance identifier
- * @return 0 on success, negative error code on failure
+ * @param[in] avctx codec context
+ * @return the descriptor on success, NULL on allocation failure
  */
-static int setup_bumping(XEVE id)
+static XeveInputImgb *libxeve_get_input(AVCodecContext *avctx)
 {
-    int val = 1;
-    int size = sizeof(int);
-    if (XEVE_FAILED(xeve_config(id, XEVE_CFG_SET_FORCE_OUT, (void *)(&val), &size)))
-        return AVERROR_EXTERNAL;
+    XeveContext *xectx = avctx->priv_data;
+    XeveInputImgb *in;
+    int ret;
 
-    return 0;
+    for (int i = 0; i < xectx->nb_inputs; i++) {
+        if (!atomic_load_explicit(&xectx->inputs[i]->refcnt, memory_order_acquire))
+            return xectx->inputs[i];
+    }
+
+    ret = av_reallocp_array(&xectx->inputs, xectx->nb_inputs + 1, sizeof(*xectx->inputs));
+    if (ret < 0) {
+        xectx->nb_inputs = 0;
+        return NULL;
+    }
+
+    in = av_mallocz(sizeof(*in));
+    if (!in)
+        return NULL;
+
+    in->frame = av_frame_alloc();
+    if (!in->frame) {
+        av_free(in);
+        return NULL;
+    }
+    atomic_init(&in->refcnt, 0);
+
+    xectx->inputs[xectx->nb_inputs++] = in;
+
+    return in;
 }
 
 /**
- * @brief Initialize eXtra-fast Essential Video Encoder codec
- * Create an encoder instance and allocate all the needed resources
+ * De-interleave the chroma of a NV12 or P010 frame into a planar image
  *
- * @param avctx codec context
+ * P010 samples are stored in the most significant bits, so the luma plane is copied as well
+ * and all the samples are shifted down to the range XEVE expects.
+ *
+ * @param[in] avctx codec context
+ * @param[in,out] in input image descriptor, its planes are allocated from the planes pool
  * @return 0 on success, negative error code on failure
  */
-static av_cold int libxeve_init(AVCodecContext *avctx)
+static int libxeve_deinterleave(AVCodecContext *avctx, XeveInputImgb *in)
 {
     XeveContext *xectx = avctx->priv_data;
-    unsigned char *bs_buf = NULL;
-    int i;
-    int shift_h = 0;
-    int shift_v = 0;
-    int width_chroma = 0;
-    int height_chroma = 0;
-    XEVE_IMGB *imgb = NULL;
-    int ret = 0;
+    XEVE_IMGB *imgb = &in->imgb;
+    const AVFrame *frame = in->frame;
+    uint8_t *dst;
 
-    XEVE_CDSC *cdsc = &(xectx->cdsc);
-
-    /* allocate bitstream buffer */
-    bs_buf = av_malloc(MAX_BS_BUF);
-    if (bs_buf == NULL) {
-        av_log(avctx, AV_LOG_ERROR, "Cannot allocate bitstream buffer\n");
+    in->planes = av_buffer_pool_get(xectx->planes_pool);
+    if (!in->planes)
         return AVERROR(ENOMEM);
-    }
-    xectx->bitb.addr = bs_buf;
-    xectx->bitb.bsize = MAX_BS_BUF;
+    dst = in->planes->data;
 
-    /* read configurations and set values for created descriptor (XEVE_CDSC) */
-    if ((ret = get_conf(avctx, cdsc)) != 0) {
-        av_log(avctx, AV_LOG_ERROR, "Cannot get configuration\n");
-        return AVERROR(EINVAL);
-    }
+    if (avctx->pix_fmt == AV_PIX_FMT_P010) {
+        imgb->a[0] = dst;
+        imgb->s[0] = xectx->planes_stride[0];
+        for (int y = 0; y < imgb->h[0]; y++) {
+            const uint16_t *src = (const uint16_t *)(frame->data[0] + y * frame->linesize[0]);
+            uint16_t *d = (uint16_t *)(dst + y * imgb->s[0]);
 
-    if ((ret = xeve_param_check(&cdsc->param)) != 0) {
-        av_log(avctx, AV_LOG_ERROR, "Invalid configuration\n");
-        return AVERROR(EINVAL);
+            for (int x = 0; x < imgb->w[0]; x++)
+                d[x] = src[x] >> 6;
+        }
+        dst += imgb->s[0] * imgb->h[0];
+    } else {
+        imgb->a[0] = frame->data[0];
+        imgb->s[0] = frame->linesize[0];
     }
 
-    {
-        AVDictionaryEntry *en = NULL;
-        while (en = av_dict_get(xectx->xeve_params, "", en, AV_DICT_IGNORE_SUFFIX)) {
-            if ((ret = xeve_param_parse(&cdsc->param, en->key, en->value)) < 0) {
-                av_log(avctx, AV_LOG_WARNING,
-                       "Error parsing option '%s = %s'.\n",
-                       en->key, en->value);
+    imgb->a[1] = dst;
+    imgb->a[2] = dst + xectx->planes_stride[1] * imgb->h[1];
+    imgb->s[1] = imgb->s[2] = xectx->planes_stride[1];
+
+    for (int y = 0; y < imgb->h[1]; y++) {
+        const uint8_t *src = frame->data[1] + y * frame->linesize[1];
+
+        if (avctx->pix_fmt == AV_PIX_FMT_P010) {
+            const uint16_t *src16 = (const uint16_t *)src;
+            uint16_t *u = (uint16_t *)((uint8_t *)imgb->a[1] + y * imgb->s[1]);
+            uint16_t *v = (uint16_t *)((uint8_t *)imgb->a[2] + y * imgb->s[2]);
+
+            for (int x = 0; x < imgb->w[1]; x++) {
+                u[x] = src16[2 * x]     >> 6;
+                v[x] = src16[2 * x + 1] >> 6;
+            }
+        } else {
+            uint8_t *u = (uint8_t *)imgb->a[1] + y * imgb->s[1];
+            uint8_t *v = (uint8_t *)imgb->a[2] + y * imgb->s[2];
+
+            for (int x = 0; x < imgb->w[1]; x++) {
+                u[x] = src[2 * x];
+                v[x] = src[2 * x + 1];
             }
         }
     }
 
-    /* create encoder */
-    xectx->id = xeve_create(cdsc, NULL);
-    if (xectx->id == NULL) {
-        av_log(avctx, AV_LOG_ERROR, "Cannot create XEVE encoder\n");
-        return AVERROR_EXTERNAL;
-    }
+    return 0;
+}
 
-    if ((ret = set_extra_config(avctx, xectx->id, xectx)) != 0) {
-        av_log(avctx, AV_LOG_ERROR, "Cannot set extra configuration\n");
-        return AVERROR(EINVAL);
+/**
+ * Point an input image descriptor at the planes of its frame and take the reference held while pushing it
+ *
+ * @param[in] avctx codec context
+ * @param[in,out] in input image descriptor holding the frame to encode
+ * @return 0 on success, negative error code on failure
+ */
+static int libxeve_setup_input(AVCodecContext *avctx, XeveInputImgb *in)
+{
+    XeveContext *xectx = avctx->priv_data;
+    XEVE_IMGB *imgb = &in->imgb;
+
+    *imgb = xectx->imgb;
+    if (xectx->planes_pool) {
+        int ret = libxeve_deinterleave(avctx, in);
+        if (ret < 0)
+            return ret;
+    } else {
+        for (int i = 0; i < imgb->np; i++) {
+            imgb->a[i] = in->frame->data[i];
+            imgb->s[i] = in->frame->linesize[i];
+        }
     }
 
-    if ((ret = av_pix_fmt_get_chroma_sub_sample(avctx->pix_fmt, &shift_h, &shift_v)) != 0) {
+    imgb->ts[XEVE_TS_PTS] = in->frame->pts;
+
+    imgb->addref  = libxeve_imgb_addref;
+    imgb->getref  = libxeve_imgb_getref;
+    imgb->release = libxeve_imgb_release;
+    atomic_store_explicit(&in->refcnt, 1, memory_order_relaxed);
+
+    return 0;
+}
+
+/**
+ * Compute the luma averages of the 8x8 blocks of a frame
+ *
+ * The averages are cheap next to the encoding and are not sensitive to noise.
+ *
+ * @param[in] avctx codec context
+ * @param[in] frame input frame
+ * @param[in,out] blocks averages of a previous frame, replaced with the ones of this frame
+ * @return the sum of the absolute differences between the previous and the new averages
+ */
+static uint64_t libxeve_block_averages(AVCodecContext *avctx, const AVFrame *frame, uint16_t *blocks)
+{
+    const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(avctx->pix_fmt);
+    int depth = desc->comp[0].depth;
+    int shift = desc->comp[0].shift; // P010 samples are stored in the most significant bits
+    int bw = avctx->width >> 3;
+    int bh = avctx->height >> 3;
+    uint64_t diff = 0;
+
+    for (int by = 0; by < bh; by++) {
+        for (int bx = 0; bx < bw; bx++) {
+            uint16_t *prev = &blocks[by * bw + bx];
+            unsigned sum = 0;
+            int avg;
+
+            for (int y = 0; y < 8; y++) {
+                const uint8_t *line = frame->data[0] + (by * 8 + y) * frame->linesize[0];
+
+                if (depth > 8) {
+                    const uint16_t *line16 = (const uint16_t *)line + bx * 8;
+                    for (int x = 0; x < 8; x++)
+                        sum += line16[x] >> shift;
+                } else {
+                    line += bx * 8;
+                    for (int x = 0; x < 8; x++)
+                        sum += line[x];
+                }
+            }
+
+            avg   = (sum + 32) >> 6;
+            diff += FFABS(avg - *prev);
+            *prev = avg;
+        }
+    }
+
+    return diff;
+}
+
+/**
+ * Detect a scene cut from the luma 8x8 block averages of the frame and of the previous frame
+ *
+ * XEVE only places intra pictures at the intra period, so the wrapper forces one at the cuts.
+ *
+ * @param[in] avctx codec context
+ * @param[in] frame frame about to be pushed
+ * @return 1 if the frame starts a new scene, 0 otherwise
+ */
+static int libxeve_scene_cut(AVCodecContext *avctx, const AVFrame *frame)
+{
+    XeveContext *xectx = avctx->priv_data;
+    const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(avctx->pix_fmt);
+    int depth = desc->comp[0].depth;
+    int bw = avctx->width >> 3;
+    int bh = avctx->height >> 3;
+    uint64_t diff = libxeve_block_averages(avctx, frame, xectx->scenecut_blocks);
+    int cut;
+
+    cut = xectx->scenecut_valid &&
+          diff * 100 >= (uint64_t)xectx->scenecut * bw * bh * ((1 << depth) - 1);
+    xectx->scenecut_valid = 1;
+
+    return cut;
+}
+
+/**
+ * Apply the rate control settings changed since the last frame without re-creating the encoder
+ *
+ * The qp and crf private options, bit_rate and rc_buffer_size may be updated between frames.
+ * Settings XEVE cannot change on the fly are reported and kept as they were.
+ *
+ * @param[in] avctx codec context
+ */
+static void libxeve_reconfig(AVCodecContext *avctx)
+{
+    XeveContext *xectx = avctx->priv_data;
+    XEVE_PARAM *param = &xectx->cdsc.param;
+    int size = sizeof(int);
+    int val;
+
+    if (xectx->rc_mode == XEVE_RC_CQP && xectx->qp != param->qp) {
+        val = xectx->qp;
+        if (XEVE_FAILED(xeve_config(xectx->id, XEVE_CFG_SET_QP, &val, &size)))
+            av_log(avctx, AV_LOG_WARNING, "Failed to change qp to %d\n", xectx->qp);
+        else
+            av_log(avctx, AV_LOG_VERBOSE, "qp changed to %d\n", xectx->qp);
+        param->qp = xectx->qp;
+    }
+
+    if ((xectx->rc_mode == XEVE_RC_ABR || xectx->rc_mode == RC_CBR) && avctx->bit_rate / 1000 != param->bitrate &&
+        avctx->bit_rate / 1000 <= INT_MAX) {
+        val = (int)(avctx->bit_rate / 1000);
+        if (XEVE_FAILED(xeve_config(xectx->id, XEVE_CFG_SET_BPS, &val, &size)))
+            av_log(avctx, AV_LOG_WARNING, "Failed to change bitrate to %d kbps\n", val);
+        else
+            av_log(avctx, AV_LOG_VERBOSE, "Bitrate changed to %d kbps\n", val);
+        param->bitrate = val;
+    }
+
+    if (avctx->rc_buffer_size && avctx->rc_buffer_size / 1000 != param->vbv_bufsize) {
+        val = (int)(avctx->rc_buffer_size / 1000);
+        if (XEVE_FAILED(xeve_config(xectx->id, XEVE_CFG_SET_VBV_SIZE, &val, &size)))
+            av_log(avctx, AV_LOG_WARNING, "Failed to change VBV buffer size to %d kbits\n", val);
+        else
+            av_log(avctx, AV_LOG_VERBOSE, "VBV buffer size changed to %d kbits\n", val);
+        param->vbv_bufsize = val;
+    }
+
+    if (xectx->rc_mode == XEVE_RC_CRF && xectx->crf != param->crf) {
+        av_log(avctx, AV_LOG_WARNING, "crf cannot be changed while encoding, keeping %d\n", param->crf);
+        xectx->crf = param->crf;
+    }
+}
+
+/**
+ * @brief Switch encoder to bumping mode
+ *
+ * @param id XEVE encodec instance identifier
+ * @return 0 on success, negative error code on failure
+ */
+static int setup_bumping(XEVE id)
+{
+    int val = 1;
+    int size = sizeof(int);
+    if (XEVE_FAILED(xeve_config(id, XEVE_CFG_SET_FORCE_OUT, (void *)(&val), &size)))
+        return AVERROR_EXTERNAL;
+
+    return 0;
+}
+
+static const char *const preset_names[] = { "default", "fast", "medium", "slow", "placebo", "superfast", "ultrafast" };
+
+// the presets from the fastest to the slowest one, the default preset is not ordered among them
+static const int preset_order[] = {
+    PRESET_ULTRAFAST, PRESET_SUPERFAST, XEVE_PRESET_FAST, XEVE_PRESET_MEDIUM, XEVE_PRESET_SLOW, XEVE_PRESET_PLACEBO,
+};
+
+static int preset_rank(int preset)
+{
+    for (int i = 0; i < FF_ARRAY_ELEMS(preset_order); i++) {
+        if (preset_order[i] == preset)
+            return i;
+    }
+    return -1;
+}
+
+/**
+ * Tell whether an input frame waited longer than max_latency and is to be skipped
+ *
+ * The input is expected in real time: the age of a frame is how late it is fetched compared
+ * with the wall clock time its pts stands for, the earliest frame setting the origin. XEVE
+ * builds its GOP from the frames it is given, so a frame never pushed is not referenced by
+ * any picture and the pts of the other frames are left untouched.
+ *
+ * @param[in] avctx codec context
+ * @param[in] frame input frame
+ * @return 1 if the frame is to be dropped, 0 otherwise
+ */
+static int libxeve_frame_late(AVCodecContext *avctx, const AVFrame *frame)
+{
+    XeveContext *xectx = avctx->priv_data;
+    int64_t now = av_gettime_relative();
+    int64_t pts;
+
+    // forced key frames are pushed whatever their age
+    if (frame->pts == AV_NOPTS_VALUE || frame->pict_type == AV_PICTURE_TYPE_I)
+        return 0;
+
+    pts = av_rescale_q(frame->pts, avctx->time_base, AV_TIME_BASE_Q);
+    if (xectx->latency_origin == AV_NOPTS_VALUE || now - pts < xectx->latency_origin)
+        xectx->latency_origin = now - pts;
+
+    return now - pts - xectx->latency_origin > xectx->max_latency;
+}
+
+/**
+ * Account the encoding time of a frame in deadline mode and decide on a preset change
+ *
+ * The time is averaged over whole sub-GOPs. A window over the frame interval steps down to
+ * a faster preset right away, DEADLINE_CALM_WINDOWS windows in less than half of it step back
+ * up, never beyond the configured preset.
+ *
+ * @param[in] avctx codec context
+ * @param[in] time time spent in xeve_push() and xeve_encode() for the frame, in microseconds
+ */
+static void libxeve_deadline_update(AVCodecContext *avctx, int64_t time)
+{
+    XeveContext *xectx = avctx->priv_data;
+    int window = FFMAX(xectx->cdsc.param.bframes + 1, DEADLINE_WINDOW);
+    int preset = xectx->deadline_preset;
+    int64_t mean;
+
+    xectx->deadline_time += time;
+    if (++xectx->deadline_frames < window)
+        return;
+
+    mean = xectx->deadline_time / xectx->deadline_frames;
+    xectx->deadline_time   = 0;
+    xectx->deadline_frames = 0;
+
+    if (mean > xectx->deadline_budget) {
+        xectx->deadline_calm = 0;
+        // the default preset steps down to fast
+        if (preset == XEVE_PRESET_DEFAULT)
+            xectx->deadline_next = XEVE_PRESET_FAST;
+        else if (preset_rank(preset) > 0)
+            xectx->deadline_next = preset_order[preset_rank(preset) - 1];
+    } else if (2 * mean < xectx->deadline_budget && preset != xectx->preset_id) {
+        if (++xectx->deadline_calm >= DEADLINE_CALM_WINDOWS) {
+            xectx->deadline_calm = 0;
+            xectx->deadline_next = xectx->preset_id == XEVE_PRESET_DEFAULT ? XEVE_PRESET_DEFAULT :
+                                   preset_order[preset_rank(preset) + 1];
+        }
+    } else
+        xectx->deadline_calm = 0;
+
+    if (xectx->deadline_next >= 0)
+        av_log(avctx, AV_LOG_VERBOSE, "Encoding takes %"PRId64" us per frame for a %"PRId64" us interval, "
+               "switching from preset %s to %s\n", mean, xectx->deadline_budget,
+               preset_names[preset], preset_names[xectx->deadline_next]);
+}
+
+/**
+ * Shift the dts of a packet so that the decoding timeline of an instance follows that of the previous one
+ *
+ * Every XEVE instance starts its own decoding timeline. The first packet of an instance sets a
+ * single offset applied to all its packets, which keeps the dts deltas and dts <= pts within it.
+ *
+ * @param[in] avctx codec context
+ * @param[in,out] avpkt packet returned to the user
+ * @param[in,out] last_dts dts of the last returned packet, AV_NOPTS_VALUE before the first one
+ * @param[in,out] dts_offset offset of the running instance
+ * @param[in,out] instance_start set if avpkt is the first packet of an instance, cleared here
+ */
+static void libxeve_join_dts(AVCodecContext *avctx, AVPacket *avpkt,
+                             int64_t *last_dts, int64_t *dts_offset, int *instance_start)
+{
+    if (*instance_start) {
+        int64_t duration = 1;
+
+        if (avctx->framerate.num > 0 && avctx->framerate.den > 0)
+            duration = FFMAX(av_rescale_q(1, av_inv_q(avctx->framerate), avctx->time_base), 1);
+        *dts_offset = 0;
+        if (*last_dts != AV_NOPTS_VALUE)
+            *dts_offset = FFMAX(*last_dts + duration - avpkt->dts, 0);
+        *instance_start = 0;
+    }
+
+    avpkt->dts += *dts_offset;
+    *last_dts   = avpkt->dts;
+}
+
+/**
+ * Create a XEVE instance with the given configuration and make it replace the current one
+ *
+ * @param[in] avctx codec context
+ * @param[in] cdsc configuration of the new instance, stored in the context on success
+ * @return 0 on success, negative error code on failure, the current instance being kept
+ */
+static int libxeve_replace_instance(AVCodecContext *avctx, const XEVE_CDSC *cdsc)
+{
+    XeveContext *xectx = avctx->priv_data;
+    XEVE_CDSC new_cdsc = *cdsc;
+    void *affinity = NULL;
+    XEVE id;
+    int ret;
+
+    if (xectx->cpus) {
+        ret = ff_thread_affinity_set(avctx, xectx->cpus, &affinity);
+        if (ret < 0)
+            return ret;
+    }
+    id = xeve_create(&new_cdsc, NULL);
+    ff_thread_affinity_restore(&affinity);
+    if (!id) {
+        av_log(avctx, AV_LOG_ERROR, "Cannot create XEVE encoder\n");
+        return AVERROR_EXTERNAL;
+    }
+
+    if ((ret = set_extra_config(avctx, id, xectx)) != 0) {
+        av_log(avctx, AV_LOG_ERROR, "Cannot set extra configuration\n");
+        xeve_delete(id);
+        return AVERROR(EINVAL);
+    }
+
+    if (xectx->id)
+        xeve_delete(xectx->id);
+    xectx->id   = id;
+    xectx->cdsc = new_cdsc;
+
+    return 0;
+}
+
+/**
+ * Replace the bumped out XEVE instance with one using the preset chosen by the deadline mode
+ *
+ * XEVE cannot change its preset through xeve_config(), so a new instance is created. It
+ * starts with an IDR picture and parameter sets of its own.
+ *
+ * @param[in] avctx codec context
+ * @return 0 on success, negative error code on failure
+ */
+static int libxeve_deadline_switch(AVCodecContext *avctx)
+{
+    XeveContext *xectx = avctx->priv_data;
+    XEVE_CDSC cdsc = xectx->cdsc;
+    const AVDictionaryEntry *en = NULL;
+    int ret;
+
+    ret = set_preset(avctx, &cdsc.param, xectx->deadline_next);
+    if (ret < 0)
+        return ret;
+    // the overrides were reported when opening the encoder already
+    while ((en = av_dict_get(xectx->xeve_params, "", en, AV_DICT_IGNORE_SUFFIX)))
+        xeve_param_parse(&cdsc.param, en->key, en->value);
+    if (XEVE_FAILED(xeve_param_check(&cdsc.param))) {
+        av_log(avctx, AV_LOG_ERROR, "Invalid configuration with preset %s\n", preset_names[xectx->deadline_next]);
+        return AVERROR(EINVAL);
+    }
+
+    ret = libxeve_replace_instance(avctx, &cdsc);
+    if (ret < 0)
+        return ret;
+
+    xectx->deadline_preset = xectx->deadline_next;
+    xectx->deadline_next   = -1;
+    xectx->deadline_time   = 0;
+    xectx->deadline_frames = 0;
+    xectx->new_extradata   = !!(avctx->flags & AV_CODEC_FLAG_GLOBAL_HEADER);
+    xectx->instance_start  = 1;
+    xectx->state = STATE_ENCODING;
+
+    return 0;
+}
+
+/**
+ * Announce the parameter sets of the first packet of a new instance as new extradata
+ *
+ * @param[in] avctx codec context
+ * @param[in,out] avpkt packet starting with the parameter sets
+ * @return 0 on success, negative error code on failure
+ */
+static int libxeve_export_new_extradata(AVCodecContext *avctx, AVPacket *avpkt)
+{
+    int size = 0, pos;
+    uint8_t *side;
+
+    for (int pass = 0; pass < 2; pass++) {
+        for (pos = 0, size = 0; avpkt->size - pos > EVC_NALU_LENGTH_PREFIX_SIZE;) {
+            const uint8_t *data = avpkt->data + pos;
+            uint32_t nalu_size = av_evc_read_nal_unit_length(data, EVC_NALU_LENGTH_PREFIX_SIZE, avctx);
+            int nalu_type;
+
+            if (!nalu_size || nalu_size > avpkt->size - pos - EVC_NALU_LENGTH_PREFIX_SIZE)
+                break;
+
+            nalu_type = av_evc_get_nalu_type(data + EVC_NALU_LENGTH_PREFIX_SIZE, nalu_size, avctx);
+            if (nalu_type == EVC_SPS_NUT || nalu_type == EVC_PPS_NUT || nalu_type == EVC_APS_NUT) {
+                if (pass)
+                    memcpy(side + size, data, EVC_NALU_LENGTH_PREFIX_SIZE + nalu_size);
+                size += EVC_NALU_LENGTH_PREFIX_SIZE + nalu_size;
+            }
+            pos += EVC_NALU_LENGTH_PREFIX_SIZE + nalu_size;
+        }
+
+        if (!size)
+            return 0;
+        if (!pass) {
+            side = av_packet_new_side_data(avpkt, AV_PKT_DATA_NEW_EXTRADATA, size);
+            if (!side)
+                return AVERROR(ENOMEM);
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * xeve_push() inside a tracing slice
+ */
+static int libxeve_push(XEVE id, XEVE_IMGB *imgb)
+{
+    int ret;
+
+    FF_TRACE_BEGIN("xeve_push", -1, -1, -1);
+    ret = xeve_push(id, imgb);
+    FF_TRACE_END("xeve_push", -1, -1, -1);
+
+    return ret;
+}
+
+/**
+ * xeve_encode() tagged with the POC, NAL unit type and size of the coded picture for tracing
+ */
+static int libxeve_encode_au(XEVE id, XEVE_BITB *bitb, XEVE_STAT *stat)
+{
+    int ret;
+
+    FF_TRACE_BEGIN("xeve_encode", -1, -1, -1);
+    ret = xeve_encode(id, bitb, stat);
+    FF_TRACE_END("xeve_encode", ret == XEVE_OK && stat->write > 0 ? stat->poc : -1,
+                 ret == XEVE_OK && stat->write > 0 ? stat->nalu_type : -1,
+                 ret == XEVE_OK ? stat->write : -1);
+
+    return ret;
+}
+
+/**
+ * Export the parameter sets as extradata for containers using global headers
+ *
+ * XEVE writes the parameter sets along with the first coded picture only. They don't depend on the picture content,
+ * so a blank picture is encoded with a separate instance sharing the configuration and its parameter sets are kept
+ * as a sequence of length-prefixed NAL units, ready to be turned into evcC by the muxer.
+ *
+ * @param[in] avctx codec context
+ * @return 0 on success, negative error code on failure
+ */
+static av_cold int libxeve_export_headers(AVCodecContext *avctx)
+{
+    XeveContext *xectx = avctx->priv_data;
+    XeveInputImgb *in = NULL;
+    XEVE_BITB bitb = { 0 };
+    XEVE_STAT stat = { 0 };
+    XEVE id;
+    int pos = 0;
+    int ret;
+
+    id = xeve_create(&xectx->cdsc, NULL);
+    if (!id) {
+        av_log(avctx, AV_LOG_ERROR, "Cannot create XEVE encoder\n");
+        return AVERROR_EXTERNAL;
+    }
+
+    if ((ret = set_extra_config(avctx, id, xectx)) != 0)
+        goto end;
+
+    bitb.addr = av_malloc(xectx->bs_buf_size);
+    in = av_mallocz(sizeof(*in));
+    if (!bitb.addr || !in || !(in->frame = av_frame_alloc())) {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+    bitb.bsize = xectx->bs_buf_size;
+
+    in->frame->format = avctx->pix_fmt;
+    in->frame->width  = avctx->width;
+    in->frame->height = avctx->height;
+    if ((ret = av_frame_get_buffer(in->frame, 0)) < 0)
+        goto end;
+    for (int i = 0; i < FF_ARRAY_ELEMS(in->frame->buf) && in->frame->buf[i]; i++)
+        memset(in->frame->buf[i]->data, 0, in->frame->buf[i]->size);
+
+    if ((ret = libxeve_setup_input(avctx, in)) < 0)
+        goto end;
+
+    ret = libxeve_push(id, &in->imgb);
+    if (XEVE_FAILED(ret) || setup_bumping(id) < 0) {
+        ret = AVERROR_EXTERNAL;
+        goto end;
+    }
+
+    do {
+        ret = libxeve_encode_au(id, &bitb, &stat);
+    } while (ret == XEVE_OK_OUT_NOT_AVAILABLE);
+    if (XEVE_FAILED(ret) || ret != XEVE_OK || stat.write <= 0) {
+        av_log(avctx, AV_LOG_ERROR, "Cannot encode the parameter sets\n");
+        ret = AVERROR_EXTERNAL;
+        goto end;
+    }
+
+    ret = 0;
+    while (stat.write - pos > EVC_NALU_LENGTH_PREFIX_SIZE) {
+        const uint8_t *data = (const uint8_t *)bitb.addr + pos;
+        uint32_t nalu_size = av_evc_read_nal_unit_length(data, EVC_NALU_LENGTH_PREFIX_SIZE, avctx);
+        int nalu_type;
+
+        if (!nalu_size || nalu_size > stat.write - pos - EVC_NALU_LENGTH_PREFIX_SIZE)
+            break;
+
+        nalu_type = av_evc_get_nalu_type(data + EVC_NALU_LENGTH_PREFIX_SIZE, nalu_size, avctx);
+        if (nalu_type == EVC_SPS_NUT || nalu_type == EVC_PPS_NUT || nalu_type == EVC_APS_NUT) {
+            int size = EVC_NALU_LENGTH_PREFIX_SIZE + nalu_size;
+
+            ret = av_reallocp(&avctx->extradata, avctx->extradata_size + size + AV_INPUT_BUFFER_PADDING_SIZE);
+            if (ret < 0) {
+                avctx->extradata_size = 0;
+                goto end;
+            }
+            memcpy(avctx->extradata + avctx->extradata_size, data, size);
+            avctx->extradata_size += size;
+            memset(avctx->extradata + avctx->extradata_size, 0, AV_INPUT_BUFFER_PADDING_SIZE);
+        }
+
+        pos += EVC_NALU_LENGTH_PREFIX_SIZE + nalu_size;
+    }
+
+    if (!avctx->extradata_size) {
+        av_log(avctx, AV_LOG_ERROR, "No parameter sets found in the bitstream\n");
+        ret = AVERROR_EXTERNAL;
+    }
+
+end:
+    xeve_delete(id);
+    if (in) {
+        av_frame_free(&in->frame);
+        av_buffer_unref(&in->planes);
+        av_free(in);
+    }
+    av_free(bitb.addr);
+
+    return ret;
+}
+
+/**
+ * Get the picture XEVE reconstructed while coding the access unit output by the last xeve_encode() call
+ *
+ * @param[in] id XEVE instance
+ * @return the picture, to be released by the caller, or NULL if XEVE does not provide it
+ */
+static XEVE_IMGB *libxeve_get_recon(XEVE id)
+{
+    XEVE_IMGB *rec = NULL;
+    int size = sizeof(rec);
+
+    if (XEVE_FAILED(xeve_config(id, XEVE_CFG_GET_RECON, &rec, &size)))
+        return NULL;
+
+    return rec;
+}
+
+/**
+ * Compute the sum of squared errors of a plane at the bit depth of the source image
+ *
+ * XEVE stores the reconstructed pictures with 16-bit samples whatever the coded bit depth.
+ *
+ * @param[in] src source image, with 8-bit samples if src_depth is 8 and 16-bit samples otherwise
+ * @param[in] src_depth bit depth of the source samples
+ * @param[in] rec reconstructed picture
+ * @param[in] rec_depth coded bit depth
+ * @param[in] plane index of the plane
+ * @return the sum of squared errors
+ */
+static uint64_t libxeve_plane_sse(const XEVE_IMGB *src, int src_depth,
+                                  const XEVE_IMGB *rec, int rec_depth, int plane)
+{
+    int w = FFMIN(src->w[plane], rec->w[plane]);
+    int h = FFMIN(src->h[plane], rec->h[plane]);
+    int down = FFMAX(rec_depth - src_depth, 0);
+    int up   = FFMAX(src_depth - rec_depth, 0);
+    int round = down ? 1 << (down - 1) : 0;
+    uint64_t sse = 0;
+
+    for (int y = 0; y < h; y++) {
+        const uint8_t  *s8  = (const uint8_t *)src->a[plane] + y * src->s[plane];
+        const uint16_t *s16 = (const uint16_t *)s8;
+        const uint16_t *r   = (const uint16_t *)((const uint8_t *)rec->a[plane] + y * rec->s[plane]);
+
+        for (int x = 0; x < w; x++) {
+            int d = (src_depth > 8 ? s16[x] : s8[x]) - (((r[x] + round) >> down) << up);
+            sse += d * d;
+        }
+    }
+
+    return sse;
+}
+
+/**
+ * Copy a reconstructed picture to the frame returned by avcodec_receive_frame() with the packet
+ *
+ * @param[in] avctx codec context
+ * @param[in] rec reconstructed picture
+ * @param[in] rec_depth coded bit depth, the frame is 10-bit for 10-bit and 8-bit for 8-bit coding
+ * @return 0 on success, negative error code on failure
+ */
+static int libxeve_export_recon(AVCodecContext *avctx, const XEVE_IMGB *rec, int rec_depth)
+{
+    XeveContext *xectx = avctx->priv_data;
+    AVFrame *frame = avctx->internal->recon_frame;
+    int ret;
+
+    av_frame_unref(frame);
+    frame->format = libxeve_recon_format(xectx->color_format, rec_depth);
+    frame->width  = avctx->width;
+    frame->height = avctx->height;
+
+    ret = av_frame_get_buffer(frame, 0);
+    if (ret < 0)
+        return ret;
+
+    for (int i = 0; i < xectx->imgb.np; i++) {
+        int w = FFMIN(xectx->imgb.w[i], rec->w[i]);
+        int h = FFMIN(xectx->imgb.h[i], rec->h[i]);
+
+        for (int y = 0; y < h; y++) {
+            const uint16_t *src = (const uint16_t *)((const uint8_t *)rec->a[i] + y * rec->s[i]);
+            uint8_t *dst = frame->data[i] + y * frame->linesize[i];
+
+            if (rec_depth > 8)
+                memcpy(dst, src, w * sizeof(*src));
+            else
+                for (int x = 0; x < w; x++)
+                    dst[x] = src[x];
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Compute the encoding error and export the reconstructed picture of the access unit just output
+ *
+ * @param[in]  avctx codec context
+ * @param[in]  id XEVE instance that output the access unit
+ * @param[in]  src image the access unit was coded from, NULL if the error is not needed
+ * @param[out] error sum of squared errors per plane, set for the planes of src if it is not NULL
+ * @return 0 on success, negative error code on failure
+ */
+static int libxeve_get_quality(AVCodecContext *avctx, XEVE id, const XEVE_IMGB *src, int64_t error[3])
+{
+    XeveContext *xectx = avctx->priv_data;
+    int rec_depth = xectx->cdsc.param.codec_bit_depth;
+    XEVE_IMGB *rec;
+    int ret = 0;
+
+    rec = libxeve_get_recon(id);
+    if (!rec) {
+        av_log(avctx, AV_LOG_ERROR, "Cannot get the reconstructed picture\n");
+        return AVERROR_EXTERNAL;
+    }
+
+    if (src) {
+        int src_depth = av_pix_fmt_desc_get(avctx->pix_fmt)->comp[0].depth;
+
+        for (int i = 0; i < src->np; i++)
+            error[i] = libxeve_plane_sse(src, src_depth, rec, rec_depth, i);
+    }
+
+    if (avctx->flags & AV_CODEC_FLAG_RECON_FRAME)
+        ret = libxeve_export_recon(avctx, rec, rec_depth);
+
+    rec->release(rec);
+
+    return ret;
+}
+
+/**
+ * Insert a recovery point SEI message before the slices of a non-IDR intra picture
+ *
+ * Without it, the intra pictures XEVE codes in an open GOP are not random access points for
+ * demuxers and parsers, only the IDR pictures are.
+ *
+ * @param[in]  avctx codec context
+ * @param[in,out] avpkt packet of an intra picture
+ * @return 0 on success, negative error code on failure
+ */
+static int libxeve_insert_recovery_point(AVCodecContext *avctx, AVPacket *avpkt)
+{
+    // NAL unit header of an SEI with TemporalId 0, then the message with recovery_poc_cnt 0,
+    // exact_match_flag 1 and broken_link_flag 0 and the rbsp_trailing_bits
+    static const uint8_t sei[] = {
+        0, 0, 0, 6,
+        (EVC_SEI_NUT + 1) << 1, 0x00, SEI_TYPE_RECOVERY_POINT, 1, 0xD0, 0x80,
+    };
+    int pos = 0, ret;
+
+    while (avpkt->size - pos > EVC_NALU_LENGTH_PREFIX_SIZE) {
+        const uint8_t *data = avpkt->data + pos;
+        uint32_t nalu_size = av_evc_read_nal_unit_length(data, EVC_NALU_LENGTH_PREFIX_SIZE, avctx);
+        int nalu_type;
+
+        if (!nalu_size || nalu_size > avpkt->size - pos - EVC_NALU_LENGTH_PREFIX_SIZE)
+            return 0;
+
+        nalu_type = av_evc_get_nalu_type(data + EVC_NALU_LENGTH_PREFIX_SIZE, nalu_size, avctx);
+        if (nalu_type == EVC_IDR_NUT)
+            return 0;
+        if (nalu_type == EVC_NOIDR_NUT)
+            break;
+        pos += EVC_NALU_LENGTH_PREFIX_SIZE + nalu_size;
+    }
+    if (avpkt->size - pos <= EVC_NALU_LENGTH_PREFIX_SIZE)
+        return 0;
+
+    ret = av_grow_packet(avpkt, sizeof(sei));
+    if (ret < 0)
+        return ret;
+    memmove(avpkt->data + pos + sizeof(sei), avpkt->data + pos, avpkt->size - sizeof(sei) - pos);
+    memcpy(avpkt->data + pos, sei, sizeof(sei));
+
+    return 0;
+}
+
+/**
+ * Turn the bitstream XEVE just wrote into a packet
+ *
+ * The packet takes over the bitstream buffer, which is left NULL.
+ *
+ * @param[in]  avctx codec context
+ * @param[out] avpkt output AVPacket containing encoded data
+ * @param[in]  id XEVE instance the access unit was output by
+ * @param[in]  param configuration of the instance
+ * @param[in]  src image the access unit was coded from, for AV_CODEC_FLAG_PSNR; NULL otherwise
+ * @param[in,out] bs_buf the bitstream buffer that bitb points to
+ * @param[in]  bitb the bitstream buffer descriptor passed to xeve_encode()
+ * @param[in]  stat the encoding status returned by xeve_encode()
+ * @param[in]  encode_time time spent in the xeve_encode() call, in microseconds
+ *
+ * @return 0 on success, negative error code on failure
+ */
+static int libxeve_fill_packet(AVCodecContext *avctx, AVPacket *avpkt, XEVE id, const XEVE_PARAM *param,
+                               const XEVE_IMGB *src, AVBufferRef **bs_buf, const XEVE_BITB *bitb,
+                               const XEVE_STAT *stat, int64_t encode_time)
+{
+    XeveContext *xectx = avctx->priv_data;
+    AVEncoderStats *stats;
+    int64_t error[3] = { 0 };
+    int av_pic_type;
+
+    switch(stat->stype) {
+    case XEVE_ST_I:
+        av_pic_type = AV_PICTURE_TYPE_I;
+        avpkt->flags |= AV_PKT_FLAG_KEY;
+        break;
+    case XEVE_ST_P:
+        av_pic_type = AV_PICTURE_TYPE_P;
+        break;
+    case XEVE_ST_B:
+        av_pic_type = AV_PICTURE_TYPE_B;
+        break;
+    default:
+        av_log(avctx, AV_LOG_ERROR, "Unknown slice type\n");
+        return AVERROR_INVALIDDATA;
+    }
+
+    memset((*bs_buf)->data + stat->write, 0, AV_INPUT_BUFFER_PADDING_SIZE);
+    avpkt->buf  = *bs_buf;
+    avpkt->data = (*bs_buf)->data;
+    avpkt->size = stat->write;
+    *bs_buf = NULL;
+
+    if (xectx->recovery_point_sei && av_pic_type == AV_PICTURE_TYPE_I) {
+        int ret = libxeve_insert_recovery_point(avctx, avpkt);
+        if (ret < 0)
+            return ret;
+    }
+
+    stats = ff_side_data_new_encoder_stats(avpkt);
+    if (!stats)
+        return AVERROR(ENOMEM);
+    stats->encode_time = encode_time;
+    stats->bits        = 8LL * avpkt->size;
+    stats->qp_avg      = stat->qp;
+    // adaptive quantization and cutree offset the QP of the blocks, XEVE only reports that of the slice
+    if (!param->aq_mode && !param->cutree)
+        stats->qp_min = stats->qp_max = stat->qp;
+    stats->temporal_id = stat->tid;
+    stats->pict_type   = av_pic_type;
+    // the pictures of the highest temporal layer of a hierarchical GOP are not referenced
+    if (!param->bframes)
+        stats->reference = 1;
+    else if (!param->disable_hgop)
+        stats->reference = stat->tid < av_log2(param->bframes + 1);
+    if (!stats->reference)
+        avpkt->flags |= AV_PKT_FLAG_DISPOSABLE;
+
+    avpkt->time_base.num = 1;
+    avpkt->time_base.den = xectx->cdsc.param.fps;
+
+    avpkt->pts = bitb->ts[XEVE_TS_PTS];
+    avpkt->dts = bitb->ts[XEVE_TS_DTS];
+
+    // the reconstructed picture is only available until the next xeve_encode() call
+    if (src || avctx->flags & AV_CODEC_FLAG_RECON_FRAME) {
+        int ret = libxeve_get_quality(avctx, id, src, error);
+        if (ret < 0)
+            return ret;
+    }
+
+    return ff_side_data_set_encoder_stats(avpkt, stat->qp * FF_QP2LAMBDA, error, src ? src->np : 0, av_pic_type);
+}
+
+/**
+ * Append the statistics of a packet to the stats_log file, if there is one
+ */
+static void libxeve_log_stats(AVCodecContext *avctx, const AVPacket *avpkt)
+{
+    XeveContext *xectx = avctx->priv_data;
+    const AVEncoderStats *stats;
+
+    if (!xectx->stats_file)
+        return;
+
+    stats = (const AVEncoderStats *)av_packet_get_side_data(avpkt, AV_PKT_DATA_ENCODER_STATS, NULL);
+    if (!stats)
+        return;
+
+    fprintf(xectx->stats_file, "%"PRId64",%"PRId64",%c,%d,%d,%"PRId64",%.2f,%"PRId64"\n",
+            avpkt->pts, avpkt->dts, av_get_picture_type_char(stats->pict_type), stats->temporal_id,
+            stats->reference, stats->bits, stats->qp_avg, stats->encode_time);
+}
+
+/**
+ * Move the packet payload into a buffer returned by the user get_encode_buffer() callback, if there is one
+ *
+ * @param[in]  avctx codec context
+ * @param[in,out] avpkt packet holding a bitstream buffer
+ *
+ * @return 0 on success, negative error code on failure
+ */
+static int libxeve_copy_to_user_buffer(AVCodecContext *avctx, AVPacket *avpkt)
+{
+    AVBufferRef *buf = avpkt->buf;
+    int size = avpkt->size;
+    int ret;
+
+    if (avctx->get_encode_buffer == avcodec_default_get_encode_buffer)
+        return 0;
+
+    avpkt->buf  = NULL;
+    avpkt->data = NULL;
+    avpkt->size = 0;
+
+    ret = ff_get_encode_buffer(avctx, avpkt, size, 0);
+    if (ret >= 0)
+        memcpy(avpkt->data, buf->data, size);
+    av_buffer_unref(&buf);
+
+    return ret;
+}
+
+#if HAVE_THREADS
+/**
+ * Choose the depth of the B picture pyramid of a chunk from a fast estimate of its motion
+ *
+ * The cost of predicting a picture from another one d pictures away is estimated with the
+ * luma 8x8 block averages of the chunk. A pyramid of N B pictures predicts its anchor
+ * pictures N + 1 pictures apart, the deepest one whose anchor distance costs no more than
+ * twice the cost of neighbouring pictures is chosen. Static content ends up with the
+ * maximum depth, high motion with a single B picture.
+ *
+ * @return the number of B pictures between the anchor pictures, at most the bf option
+ */
+static int libxeve_chunk_bframes(AVCodecContext *avctx, const XeveChunk *chunk)
+{
+    static const int depths[] = { 15, 7, 3, 1 };
+    XeveContext *xectx = avctx->priv_data;
+    int max_bframes = xectx->cdsc.param.bframes;
+    int nb_blocks = (avctx->width >> 3) * (avctx->height >> 3);
+    uint16_t *blocks;
+    double cost1 = 0;
+    int bframes = max_bframes;
+
+    if (max_bframes <= 1 || !nb_blocks || chunk->nb_frames < 3)
+        return max_bframes;
+
+    blocks = av_calloc(chunk->nb_frames, nb_blocks * sizeof(*blocks));
+    if (!blocks)
+        return max_bframes;
+
+    for (int i = 0; i < chunk->nb_frames; i++)
+        libxeve_block_averages(avctx, chunk->inputs[i].frame, blocks + i * nb_blocks);
+
+    for (int d = 1; d < chunk->nb_frames; d = d == 1 ? 2 : 2 * d) {
+        uint64_t sad = 0;
+        double cost;
+
+        for (int i = 0; i + d < chunk->nb_frames; i++) {
+            const uint16_t *a = blocks + i * nb_blocks, *b = a + d * nb_blocks;
+            for (int j = 0; j < nb_blocks; j++)
+                sad += FFABS(a[j] - b[j]);
+        }
+        // average difference per block, one level more tolerates noise on static content
+        cost = (double)sad / ((chunk->nb_frames - d) * (uint64_t)nb_blocks);
+        if (d == 1) {
+            cost1   = cost;
+            bframes = 0;
+            continue;
+        }
+        if (d - 1 > max_bframes || cost > 2 * cost1 + 1)
+            break;
+        bframes = d - 1;
+    }
+    av_free(blocks);
+
+    for (int i = 0; i < FF_ARRAY_ELEMS(depths); i++) {
+        if (depths[i] <= bframes)
+            return depths[i];
+    }
+    return 1;
+}
+
+/**
+ * Encode a chunk from its first frame to the end with a fresh XEVE instance
+ *
+ * The instance starts with an IDR picture and is bumped out after the last frame, so every chunk is
+ * a closed sequence carrying its own parameter sets.
+ */
+static int libxeve_chunk_encode(AVCodecContext *avctx, XeveChunk *chunk)
+{
+    XeveContext *xectx = avctx->priv_data;
+    XeveChunks *chunks = xectx->chunks;
+    AVBufferRef *bs_buf = NULL;
+    XEVE_BITB bitb = { 0 };
+    XEVE_STAT stat = { 0 };
+    int pushed = 0, bumping = 0;
+    int held = 0;
+    XEVE_CDSC cdsc = xectx->cdsc;
+    XEVE id;
+    int ret = 0;
+
+    if (xectx->b_adapt) {
+        cdsc.param.bframes = libxeve_chunk_bframes(avctx, chunk);
+        if (XEVE_FAILED(xeve_param_check(&cdsc.param))) {
+            av_log(avctx, AV_LOG_ERROR, "Invalid configuration with %d B frames\n", cdsc.param.bframes);
+            return AVERROR(EINVAL);
+        }
+        av_log(avctx, AV_LOG_DEBUG, "Chunk of %d frames encoded with %d B frames\n",
+               chunk->nb_frames, cdsc.param.bframes);
+    }
+
+    id = xeve_create(&cdsc, NULL);
+    if (!id) {
+        av_log(avctx, AV_LOG_ERROR, "Cannot create XEVE encoder\n");
+        return AVERROR_EXTERNAL;
+    }
+
+    if ((ret = set_extra_config(avctx, id, xectx)) != 0) {
+        av_log(avctx, AV_LOG_ERROR, "Cannot set extra configuration\n");
+        ret = AVERROR(EINVAL);
+        goto end;
+    }
+
+    bitb.bsize = xectx->bs_buf_size;
+
+    while (!atomic_load_explicit(&chunks->abort, memory_order_relaxed)) {
+        const XEVE_IMGB *src;
+        int64_t encode_time;
+        AVPacket *pkt;
+
+        if (pushed < chunk->nb_frames) {
+            XeveInputImgb *in = &chunk->inputs[pushed++];
+            XEVE_IMGB *imgb = &in->imgb;
+
+            ret = libxeve_setup_input(avctx, in);
+            if (ret < 0)
+                goto end;
+            ret = libxeve_push(id, imgb);
+            // the images stay referenced until the chunk is encoded when their error is computed
+            if (XEVE_FAILED(ret) || !(avctx->flags & AV_CODEC_FLAG_PSNR))
+                imgb->release(imgb);
+            else
+                held++;
+            if (XEVE_FAILED(ret)) {
+                av_log(avctx, AV_LOG_ERROR, "xeve_push() failed\n");
+                ret = AVERROR_EXTERNAL;
+                goto end;
+            }
+        } else if (!bumping) {
+            if (setup_bumping(id) < 0) {
+                av_log(avctx, AV_LOG_ERROR, "Failed to setup bumping\n");
+                ret = AVERROR_EXTERNAL;
+                goto end;
+            }
+            bumping = 1;
+        }
+
+        if (!bs_buf) {
+            bs_buf = av_buffer_pool_get(xectx->bs_pool);
+            if (!bs_buf) {
+                ret = AVERROR(ENOMEM);
+                goto end;
+            }
+        }
+        bitb.addr = bs_buf->data;
+
+        encode_time = av_gettime_relative();
+        ret = libxeve_encode_au(id, &bitb, &stat);
+        encode_time = av_gettime_relative() - encode_time;
+        if (XEVE_FAILED(ret)) {
+            av_log(avctx, AV_LOG_ERROR, "xeve_encode() failed\n");
+            ret = AVERROR_EXTERNAL;
+            goto end;
+        }
+
+        if (ret == XEVE_OK_NO_MORE_FRM) {
+            ret = 0;
+            break;
+        }
+        if (ret != XEVE_OK || stat.write <= 0) {
+            ret = 0;
+            continue;
+        }
+
+        pkt = av_packet_alloc();
+        if (!pkt) {
+            ret = AVERROR(ENOMEM);
+            goto end;
+        }
+        src = NULL;
+        for (int i = 0; i < held; i++) {
+            if (chunk->inputs[i].imgb.ts[XEVE_TS_PTS] == bitb.ts[XEVE_TS_PTS])
+                src = &chunk->inputs[i].imgb;
+        }
+        ret = libxeve_fill_packet(avctx, pkt, id, &cdsc.param, src, &bs_buf, &bitb, &stat, encode_time);
+        if (ret >= 0)
+            ret = av_fifo_write(chunk->pkts, &pkt, 1);
+        if (ret < 0) {
+            av_packet_free(&pkt);
+            goto end;
+        }
+    }
+
+end:
+    av_buffer_unref(&bs_buf);
+    xeve_delete(id);
+    for (int i = 0; i < held; i++)
+        chunk->inputs[i].imgb.release(&chunk->inputs[i].imgb);
+
+    return ret;
+}
+
+static void *libxeve_chunk_worker(void *arg)
+{
+    AVCodecContext *avctx = arg;
+    XeveContext *xectx = avctx->priv_data;
+    XeveChunks *chunks = xectx->chunks;
+    XeveChunk *chunk;
+
+    pthread_mutex_lock(&chunks->mutex);
+    for (;;) {
+        while (!chunks->quit && av_fifo_read(chunks->jobs, &chunk, 1) < 0)
+            pthread_cond_wait(&chunks->job_cond, &chunks->mutex);
+        if (chunks->quit)
+            break;
+        pthread_mutex_unlock(&chunks->mutex);
+
+        chunk->err = libxeve_chunk_encode(avctx, chunk);
+
+        pthread_mutex_lock(&chunks->mutex);
+        chunk->done = 1;
+        pthread_cond_broadcast(&chunks->done_cond);
+    }
+    pthread_mutex_unlock(&chunks->mutex);
+
+    return NULL;
+}
+
+static void libxeve_chunk_free(XeveChunk **pchunk)
+{
+    XeveChunk *chunk = *pchunk;
+    AVPacket *pkt;
+
+    if (!chunk)
+        return;
+
+    for (int i = 0; i < chunk->nb_frames; i++) {
+        av_frame_free(&chunk->inputs[i].frame);
+        av_buffer_unref(&chunk->inputs[i].planes);
+    }
+    av_freep(&chunk->inputs);
+
+    if (chunk->pkts) {
+        while (av_fifo_read(chunk->pkts, &pkt, 1) >= 0)
+            av_packet_free(&pkt);
+        av_fifo_freep2(&chunk->pkts);
+    }
+
+    av_freep(pchunk);
+}
+
+/**
+ * Hand the chunk being collected over to the chunk threads
+ */
+static int libxeve_chunk_dispatch(XeveChunks *chunks)
+{
+    XeveChunk *chunk = chunks->cur;
+    int ret;
+
+    if (!chunk)
+        return 0;
+
+    ret = av_fifo_write(chunks->chunks, &chunk, 1);
+    if (ret < 0)
+        return ret;
+    chunks->cur = NULL;
+
+    pthread_mutex_lock(&chunks->mutex);
+    ret = av_fifo_write(chunks->jobs, &chunk, 1);
+    pthread_cond_signal(&chunks->job_cond);
+    pthread_mutex_unlock(&chunks->mutex);
+
+    if (ret < 0) { // never picked up by a thread, so no one else references it
+        chunk->err  = ret;
+        chunk->done = 1;
+    }
+
+    return 0;
+}
+
+/**
+ * Append an input frame to the chunk being collected, taking over its reference
+ */
+static int libxeve_chunk_add_frame(AVCodecContext *avctx, AVFrame *frame)
+{
+    XeveContext *xectx = avctx->priv_data;
+    XeveChunks *chunks = xectx->chunks;
+    XeveChunk *chunk = chunks->cur;
+    XeveInputImgb *in;
+
+    if (!chunk) {
+        chunk = chunks->cur = av_mallocz(sizeof(*chunk));
+        if (!chunk)
+            return AVERROR(ENOMEM);
+
+        chunk->inputs = av_calloc(xectx->chunk_size, sizeof(*chunk->inputs));
+        chunk->pkts   = av_fifo_alloc2(xectx->chunk_size, sizeof(AVPacket *), AV_FIFO_FLAG_AUTO_GROW);
+        if (!chunk->inputs || !chunk->pkts)
+            return AVERROR(ENOMEM);
+    }
+
+    in = &chunk->inputs[chunk->nb_frames];
+    in->frame = av_frame_alloc();
+    if (!in->frame)
+        return AVERROR(ENOMEM);
+    av_frame_move_ref(in->frame, frame);
+    atomic_init(&in->refcnt, 0);
+    chunk->nb_frames++;
+
+    if (chunk->nb_frames == xectx->chunk_size)
+        return libxeve_chunk_dispatch(chunks);
+
+    return 0;
+}
+
+/**
+ * Return the next packet of the oldest chunk, waiting for the chunk threads when they are behind
+ */
+static int libxeve_chunk_receive_packet(AVCodecContext *avctx, AVPacket *avpkt)
+{
+    XeveContext *xectx = avctx->priv_data;
+    XeveChunks *chunks = xectx->chunks;
+    AVFrame *frame = xectx->frame;
+    XeveChunk *chunk;
+    AVPacket *pkt;
+    int ret;
+
+    for (;;) {
+        if (av_fifo_peek(chunks->chunks, &chunk, 1, 0) >= 0) {
+            int done;
+
+            pthread_mutex_lock(&chunks->mutex);
+            // keep up to chunk_threads chunks in flight, one more may be collected meanwhile
+            while (!(done = chunk->done) &&
+                   (chunks->eof || av_fifo_can_read(chunks->chunks) >= xectx->chunk_threads))
+                pthread_cond_wait(&chunks->done_cond, &chunks->mutex);
+            pthread_mutex_unlock(&chunks->mutex);
+
+            if (done) {
+                if (chunk->err < 0)
+                    return chunk->err;
+
+                if (av_fifo_read(chunk->pkts, &pkt, 1) >= 0)
+                    break;
+
+                av_fifo_drain2(chunks->chunks, 1);
+                libxeve_chunk_free(&chunk);
+                chunks->chunk_start = 1;
+                continue;
+            }
+        } else if (chunks->eof) {
+            return AVERROR_EOF;
+        }
+
+        ret = ff_encode_get_frame(avctx, frame);
+        if (ret == AVERROR_EOF) {
+            chunks->eof = 1;
+            ret = libxeve_chunk_dispatch(chunks);
+            if (ret < 0)
+                return ret;
+            continue;
+        } else if (ret < 0) {
+            return ret;
+        }
+
+        ret = libxeve_chunk_add_frame(avctx, frame);
+        av_frame_unref(frame);
+        if (ret < 0)
+            return ret;
+    }
+
+    av_packet_move_ref(avpkt, pkt);
+    av_packet_free(&pkt);
+
+    libxeve_join_dts(avctx, avpkt, &chunks->last_dts, &chunks->dts_offset, &chunks->chunk_start);
+
+    libxeve_log_stats(avctx, avpkt);
+    ret = libxeve_copy_to_user_buffer(avctx, avpkt);
+    if (ret < 0)
+        av_packet_unref(avpkt);
+
+    return ret;
+}
+
+/**
+ * Stop the chunk threads working on the chunks in flight and drop all of them
+ */
+static void libxeve_chunks_reset(XeveChunks *chunks)
+{
+    XeveChunk *chunk;
+
+    atomic_store_explicit(&chunks->abort, 1, memory_order_relaxed);
+
+    pthread_mutex_lock(&chunks->mutex);
+    // chunks no thread picked up yet are finished right away
+    while (av_fifo_read(chunks->jobs, &chunk, 1) >= 0)
+        chunk->done = 1;
+    while (av_fifo_read(chunks->chunks, &chunk, 1) >= 0) {
+        while (!chunk->done)
+            pthread_cond_wait(&chunks->done_cond, &chunks->mutex);
+        libxeve_chunk_free(&chunk);
+    }
+    pthread_mutex_unlock(&chunks->mutex);
+
+    atomic_store_explicit(&chunks->abort, 0, memory_order_relaxed);
+
+    libxeve_chunk_free(&chunks->cur);
+    chunks->chunk_start = 1;
+    chunks->eof = 0;
+}
+
+static av_cold int libxeve_chunks_init(AVCodecContext *avctx)
+{
+    XeveContext *xectx = avctx->priv_data;
+    XeveChunks *chunks;
+
+    chunks = xectx->chunks = av_mallocz(sizeof(*chunks));
+    if (!chunks)
+        return AVERROR(ENOMEM);
+
+    chunks->last_dts    = AV_NOPTS_VALUE;
+    chunks->chunk_start = 1;
+    atomic_init(&chunks->abort, 0);
+
+    chunks->chunks  = av_fifo_alloc2(xectx->chunk_threads, sizeof(XeveChunk *), AV_FIFO_FLAG_AUTO_GROW);
+    chunks->jobs    = av_fifo_alloc2(xectx->chunk_threads, sizeof(XeveChunk *), AV_FIFO_FLAG_AUTO_GROW);
+    chunks->threads = av_calloc(xectx->chunk_threads, sizeof(*chunks->threads));
+    if (!chunks->chunks || !chunks->jobs || !chunks->threads)
+        return AVERROR(ENOMEM);
+
+    pthread_mutex_init(&chunks->mutex, NULL);
+    pthread_cond_init(&chunks->job_cond, NULL);
+    pthread_cond_init(&chunks->done_cond, NULL);
+    chunks->sync_init = 1;
+
+    for (int i = 0; i < xectx->chunk_threads; i++) {
+        int ret = pthread_create(&chunks->threads[i], NULL, libxeve_chunk_worker, avctx);
+        if (ret) {
+            av_log(avctx, AV_LOG_ERROR, "Cannot create chunk thread\n");
+            return AVERROR(ret);
+        }
+        chunks->nb_threads++;
+    }
+
+    return 0;
+}
+
+static av_cold void libxeve_chunks_uninit(AVCodecContext *avctx)
+{
+    XeveContext *xectx = avctx->priv_data;
+    XeveChunks *chunks = xectx->chunks;
+
+    if (!chunks)
+        return;
+
+    if (chunks->sync_init) {
+        libxeve_chunks_reset(chunks);
+
+        pthread_mutex_lock(&chunks->mutex);
+        chunks->quit = 1;
+        pthread_cond_broadcast(&chunks->job_cond);
+        pthread_mutex_unlock(&chunks->mutex);
+
+        for (int i = 0; i < chunks->nb_threads; i++)
+            pthread_join(chunks->threads[i], NULL);
+
+        pthread_cond_destroy(&chunks->done_cond);
+        pthread_cond_destroy(&chunks->job_cond);
+        pthread_mutex_destroy(&chunks->mutex);
+    }
+
+    av_freep(&chunks->threads);
+    av_fifo_freep2(&chunks->chunks);
+    av_fifo_freep2(&chunks->jobs);
+    av_freep(&xectx->chunks);
+}
+#endif
+
+/**
+ * Allocate a bitstream buffer for bs_pool, keeping count of them
+ *
+ * @param opaque encoder private context
+ * @param size size of the buffer
+ * @return the buffer on success, NULL on allocation failure
+ */
+static AVBufferRef *libxeve_bs_buf_alloc(void *opaque, size_t size)
+{
+    XeveContext *xectx = opaque;
+    AVBufferRef *buf = av_buffer_alloc(size);
+
+    if (buf)
+        atomic_fetch_add_explicit(&xectx->nb_bs_bufs, 1, memory_order_relaxed);
+    return buf;
+}
+
+/**
+ * @brief Initialize eXtra-fast Essential Video Encoder codec
+ * Create an encoder instance and allocate all the needed resources
+ *
+ * @param avctx codec context
+ * @return 0 on success, negative error code on failure
+ */
+static av_cold int libxeve_init_encoder(AVCodecContext *avctx)
+{
+    XeveContext *xectx = avctx->priv_data;
+    int i;
+    int shift_h = 0;
+    int shift_v = 0;
+    int width_chroma = 0;
+    int height_chroma = 0;
+    XEVE_IMGB *imgb = NULL;
+    int ret = 0;
+
+    XEVE_CDSC *cdsc = &(xectx->cdsc);
+
+    /* allocate bitstream buffers */
+    ret = libxeve_bs_buf_size(avctx);
+    if (ret < 0) {
+        av_log(avctx, AV_LOG_ERROR, "Invalid bitstream buffer size\n");
+        return ret;
+    }
+    xectx->bs_buf_size = ret;
+
+    // the chunk threads take buffers while the packets of earlier chunks are released
+    atomic_init(&xectx->nb_bs_bufs, 0);
+    xectx->bs_pool = av_buffer_pool_init3(xectx->bs_buf_size + AV_INPUT_BUFFER_PADDING_SIZE, xectx,
+                                          libxeve_bs_buf_alloc, NULL,
+                                          AV_BUFFER_POOL_FLAG_LOCKLESS);
+    if (!xectx->bs_pool) {
+        av_log(avctx, AV_LOG_ERROR, "Cannot allocate bitstream buffer\n");
+        return AVERROR(ENOMEM);
+    }
+    xectx->bitb.bsize = xectx->bs_buf_size;
+
+    // XEVE has no multi-pass rate control and no statistics to write or read back
+    if (avctx->flags & (AV_CODEC_FLAG_PASS1 | AV_CODEC_FLAG_PASS2)) {
+        av_log(avctx, AV_LOG_ERROR, "Multi-pass encoding is not supported by XEVE, "
+               "use rc_mode CRF or ABR with bufsize instead\n");
+        return AVERROR(ENOSYS);
+    }
+
+    /* read configurations and set values for created descriptor (XEVE_CDSC) */
+    if ((ret = get_conf(avctx, cdsc)) != 0) {
+        av_log(avctx, AV_LOG_ERROR, "Cannot get configuration\n");
+        return AVERROR(EINVAL);
+    }
+
+    if ((ret = xeve_param_check(&cdsc->param)) != 0) {
+        av_log(avctx, AV_LOG_ERROR, "Invalid configuration\n");
+        return AVERROR(EINVAL);
+    }
+
+    {
+        AVDictionaryEntry *en = NULL;
+        while (en = av_dict_get(xectx->xeve_params, "", en, AV_DICT_IGNORE_SUFFIX)) {
+            if ((ret = xeve_param_parse(&cdsc->param, en->key, en->value)) < 0) {
+                av_log(avctx, AV_LOG_WARNING,
+                       "Error parsing option '%s = %s'.\n",
+                       en->key, en->value);
+            }
+        }
+    }
+
+    if (xectx->chunk_threads > 0) {
+#if HAVE_THREADS
+        if (!xectx->chunk_size)
+            xectx->chunk_size = avctx->gop_size;
+        if (xectx->chunk_size <= 0) {
+            av_log(avctx, AV_LOG_ERROR, "Chunked encoding requires chunk_size or a positive GOP size\n");
+            return AVERROR(EINVAL);
+        }
+        if (avctx->flags & AV_CODEC_FLAG_RECON_FRAME) {
+            av_log(avctx, AV_LOG_ERROR, "Reconstructed frames are not available with chunked encoding\n");
+            return AVERROR(ENOSYS);
+        }
+        if (avctx->gop_size > 0 && xectx->chunk_size % avctx->gop_size)
+            av_log(avctx, AV_LOG_WARNING, "chunk_size is not a multiple of the GOP size, "
+                   "every chunk still starts with an IDR picture\n");
+
+        if ((ret = libxeve_chunks_init(avctx)) < 0)
+            return ret;
+#else
+        av_log(avctx, AV_LOG_WARNING, "Chunked encoding requires threading support, ignoring chunk_threads\n");
+        xectx->chunk_threads = 0;
+#endif
+    }
+
+    /* create encoder, chunks are encoded by instances of their own */
+    if (!xectx->chunk_threads) {
+        xectx->id = xeve_create(cdsc, NULL);
+        if (xectx->id == NULL) {
+            av_log(avctx, AV_LOG_ERROR, "Cannot create XEVE encoder\n");
+            return AVERROR_EXTERNAL;
+        }
+
+        if ((ret = set_extra_config(avctx, xectx->id, xectx)) != 0) {
+            av_log(avctx, AV_LOG_ERROR, "Cannot set extra configuration\n");
+            return AVERROR(EINVAL);
+        }
+
+        // XEVE holds the pictures of a B pyramid and of the lookahead before coding the first one
+        avctx->delay = cdsc->param.bframes + FFMAX(cdsc->param.lookahead, 0);
+    } else {
+        // the first packet waits for the first chunk, at most until all the threads are busy
+        avctx->delay = xectx->chunk_threads * xectx->chunk_size - 1;
+    }
+    xectx->delay_frames = 0;
+
+    if ((ret = av_pix_fmt_get_chroma_sub_sample(avctx->pix_fmt, &shift_h, &shift_v)) != 0) {
         av_log(avctx, AV_LOG_ERROR, "Failed to get  chroma shift\n");
         return AVERROR(EINVAL);
     }
@@ -394,7 +2421,7 @@ static av_cold int libxeve_init(AVCodecContext *avctx)
     /* set default values for input image buffer */
     imgb = &xectx->imgb;
     imgb->cs = libxeve_color_space(avctx->pix_fmt);
-    imgb->np = 3; /* only for yuv420p, yuv420ple */
+    imgb->np = xectx->color_format == XEVE_CF_YCBCR400 ? 1 : 3;
 
     for (i = 0; i < imgb->np; i++)
         imgb->x[i] = imgb->y[i] = 0;
@@ -404,28 +2431,135 @@ static av_cold int libxeve_init(AVCodecContext *avctx)
     imgb->h[0] = imgb->ah[0] = avctx->height; // height luma
     imgb->h[1] = imgb->h[2] = imgb->ah[1] = imgb->ah[2] = height_chroma;
 
+    if (avctx->pix_fmt == AV_PIX_FMT_NV12 || avctx->pix_fmt == AV_PIX_FMT_P010) {
+        int bps = avctx->pix_fmt == AV_PIX_FMT_P010 ? 2 : 1;
+        int size;
+
+        xectx->planes_stride[0] = bps == 2 ? FFALIGN(avctx->width * bps, 32) : 0;
+        xectx->planes_stride[1] = xectx->planes_stride[2] = FFALIGN(width_chroma * bps, 32);
+        size = xectx->planes_stride[0] * avctx->height + 2 * xectx->planes_stride[1] * height_chroma;
+
+        xectx->planes_pool = av_buffer_pool_init(size, NULL);
+        if (!xectx->planes_pool)
+            return AVERROR(ENOMEM);
+    }
+
+    xectx->frame = av_frame_alloc();
+    if (!xectx->frame)
+        return AVERROR(ENOMEM);
+
+    xectx->deadline_next = -1;
+    xectx->last_dts      = AV_NOPTS_VALUE;
+    xectx->latency_origin = AV_NOPTS_VALUE;
+    if (xectx->max_latency && xectx->chunk_threads) {
+        av_log(avctx, AV_LOG_WARNING, "Frame dropping is not available with chunked encoding\n");
+        xectx->max_latency = 0;
+    }
+    if (xectx->deadline && xectx->shard) {
+        // the preset switches change the parameter sets, which must be the same in all the shards
+        av_log(avctx, AV_LOG_ERROR, "The deadline mode is not available for shards\n");
+        return AVERROR(EINVAL);
+    }
+    if (xectx->deadline) {
+        if (xectx->chunk_threads) {
+            av_log(avctx, AV_LOG_WARNING, "The deadline mode is not available with chunked encoding\n");
+            xectx->deadline = 0;
+        } else if (avctx->framerate.num <= 0 || avctx->framerate.den <= 0) {
+            av_log(avctx, AV_LOG_ERROR, "The deadline mode requires a frame rate\n");
+            return AVERROR(EINVAL);
+        } else {
+            xectx->deadline_budget = av_rescale(AV_TIME_BASE, avctx->framerate.den, avctx->framerate.num);
+            xectx->deadline_preset = xectx->preset_id;
+            xectx->switch_frame    = av_frame_alloc();
+            if (!xectx->switch_frame)
+                return AVERROR(ENOMEM);
+        }
+    }
+
+    if (xectx->b_adapt && !xectx->chunk_threads) {
+        av_log(avctx, AV_LOG_WARNING, "b_adapt requires chunk_threads, XEVE cannot change "
+               "the GOP structure of a running instance\n");
+        xectx->b_adapt = 0;
+    }
+
+    if (xectx->scenecut) {
+        if (xectx->chunk_threads)
+            av_log(avctx, AV_LOG_WARNING, "Scene cut detection is not available with chunked encoding\n");
+        else if (avctx->width < 8 || avctx->height < 8)
+            xectx->scenecut = 0;
+        else {
+            xectx->scenecut_blocks = av_calloc((avctx->width >> 3) * (avctx->height >> 3),
+                                               sizeof(*xectx->scenecut_blocks));
+            if (!xectx->scenecut_blocks)
+                return AVERROR(ENOMEM);
+        }
+    }
+
+    if (xectx->stats_log) {
+        xectx->stats_file = avpriv_fopen_utf8(xectx->stats_log, "w");
+        if (!xectx->stats_file) {
+            ret = AVERROR(errno);
+            av_log(avctx, AV_LOG_ERROR, "Cannot open %s: %s\n", xectx->stats_log, av_err2str(ret));
+            return ret;
+        }
+        fprintf(xectx->stats_file, "pts,dts,type,temporal_id,reference,bits,qp,encode_time_us\n");
+    }
+
+    if (avctx->flags & AV_CODEC_FLAG_GLOBAL_HEADER) {
+        if ((ret = libxeve_export_headers(avctx)) < 0)
+            return ret;
+    }
+
     xectx->state = STATE_ENCODING;
 
     return 0;
 }
 
+/**
+ * Initialize the encoder, with the affinity of the calling thread set to the
+ * cpus option while the XEVE and chunk threads are created so that they inherit it
+ */
+static av_cold int libxeve_init(AVCodecContext *avctx)
+{
+    XeveContext *xectx = avctx->priv_data;
+    void *affinity = NULL;
+    int ret;
+
+    if (xectx->cpus) {
+        ret = ff_thread_affinity_set(avctx, xectx->cpus, &affinity);
+        if (ret < 0)
+            return ret;
+    }
+
+    ret = libxeve_init_encoder(avctx);
+
+    ff_thread_affinity_restore(&affinity);
+
+    return ret;
+}
+
 /**
   * Encode raw data frame into EVC packet
   *
   * @param[in]  avctx codec context
   * @param[out] avpkt output AVPacket containing encoded data
-  * @param[in]  frame AVFrame containing the raw data to be encoded
+  * @param[in]  frame AVFrame containing the raw data to be encoded, its reference is taken over
   * @param[out] got_packet encoder sets to 0 or 1 to indicate that a
   *                         non-empty packet was returned in pkt
   *
-  * @return 0 on success, negative error code on failure
+  * @return 0 on success, AVERROR_EOF once all the frames are bumped out, negative error code on failure
   */
 static int libxeve_encode(AVCodecContext *avctx, AVPacket *avpkt,
-                          const AVFrame *frame, int *got_packet)
+                          AVFrame *frame, int *got_packet)
 {
     XeveContext *xectx =  avctx->priv_data;
+    int64_t start = AV_NOPTS_VALUE;
+    int64_t encode_time;
     int  ret = -1;
 
+    if (!xectx->id)
+        return AVERROR_EXTERNAL;
+
     // No more input frames are available but encoder still can have some data in its internal buffer to process
     // and some frames to dump.
     if (xectx->state == STATE_ENCODING && frame == NULL) {
@@ -433,82 +2567,139 @@ static int libxeve_encode(AVCodecContext *avctx, AVPacket *avpkt,
             xectx->state = STATE_BUMPING;  // Entering bumping process
         else {
             av_log(avctx, AV_LOG_ERROR, "Failed to setup bumping\n");
-            return 0;
+            return AVERROR_EXTERNAL;
         }
     }
 
     if (xectx->state == STATE_ENCODING) {
-        int i;
+        XeveInputImgb *in;
         XEVE_IMGB *imgb = NULL;
+        int scene_cut;
+
+        libxeve_reconfig(avctx);
+
+        // forced key frames (i.e. -force_key_frames) and scene cuts start a new intra period at this frame
+        scene_cut = xectx->scenecut_blocks && libxeve_scene_cut(avctx, frame);
+        if (scene_cut || frame->pict_type == AV_PICTURE_TYPE_I) {
+            int val = 1;
+            int size = sizeof(int);
+
+            if (frame->pict_type != AV_PICTURE_TYPE_I)
+                av_log(avctx, AV_LOG_DEBUG, "Scene cut at pts %"PRId64"\n", frame->pts);
+
+            if (XEVE_FAILED(xeve_config(xectx->id, XEVE_CFG_SET_FINTRA, &val, &size)))
+                av_log(avctx, AV_LOG_WARNING, "Failed to force an intra picture\n");
+        }
 
-        imgb = &xectx->imgb;
+        // XEVE has no interface for block level QP offsets, the regions are coded like the rest of the picture
+        if (!xectx->roi_warned && av_frame_get_side_data(frame, AV_FRAME_DATA_REGIONS_OF_INTEREST)) {
+            av_log(avctx, AV_LOG_WARNING, "Regions of interest are not supported by XEVE, ignoring them\n");
+            xectx->roi_warned = 1;
+        }
+
+        in = libxeve_get_input(avctx);
+        if (!in)
+            return AVERROR(ENOMEM);
 
-        for (i = 0; i < imgb->np; i++) {
-            imgb->a[i] = frame->data[i];
-            imgb->s[i] = frame->linesize[i];
+        // the image points to the frame planes, which stay valid until XEVE releases the image
+        av_frame_move_ref(in->frame, frame);
+        ret = libxeve_setup_input(avctx, in);
+        if (ret < 0) {
+            av_frame_unref(in->frame);
+            return ret;
         }
+        imgb = &in->imgb;
 
-        imgb->ts[XEVE_TS_PTS] = frame->pts;
+        if (xectx->deadline)
+            start = av_gettime_relative();
 
         /* push image to encoder */
-        ret = xeve_push(xectx->id, imgb);
+        ret = libxeve_push(xectx->id, imgb);
         if (XEVE_FAILED(ret)) {
+            imgb->release(imgb);
             av_log(avctx, AV_LOG_ERROR, "xeve_push() failed\n");
             return AVERROR_EXTERNAL;
         }
+
+        // drop the reference held while pushing, XEVE took its own if it keeps the image,
+        // unless the image is needed to compute the error of its picture
+        if (avctx->flags & AV_CODEC_FLAG_PSNR) {
+            ret = av_dynarray_add_nofree(&xectx->psnr_inputs, &xectx->nb_psnr_inputs, in);
+            if (ret < 0) {
+                imgb->release(imgb);
+                return ret;
+            }
+        } else
+            imgb->release(imgb);
     }
-    if (xectx->state == STATE_ENCODING || xectx->state == STATE_BUMPING) {
+    if (xectx->state == STATE_ENCODING || xectx->state == STATE_BUMPING || xectx->state == STATE_SWITCHING) {
+        // a buffer XEVE wrote nothing to is kept for the next call
+        if (!xectx->bs_buf) {
+            xectx->bs_buf = av_buffer_pool_get(xectx->bs_pool);
+            if (!xectx->bs_buf)
+                return AVERROR(ENOMEM);
+        }
+        xectx->bitb.addr = xectx->bs_buf->data;
+
         /* encoding */
-        ret = xeve_encode(xectx->id, &(xectx->bitb), &(xectx->stat));
+        encode_time = av_gettime_relative();
+        ret = libxeve_encode_au(xectx->id, &(xectx->bitb), &(xectx->stat));
+        encode_time = av_gettime_relative() - encode_time;
         if (XEVE_FAILED(ret)) {
             av_log(avctx, AV_LOG_ERROR, "xeve_encode() failed\n");
             return AVERROR_EXTERNAL;
         }
+        if (start != AV_NOPTS_VALUE)
+            libxeve_deadline_update(avctx, av_gettime_relative() - start);
 
         /* store bitstream */
         if (ret == XEVE_OK_OUT_NOT_AVAILABLE) { // Return OK but picture is not available yet
             *got_packet = 0;
             return 0;
         } else if (ret == XEVE_OK) {
-            int av_pic_type;
-
             if (xectx->stat.write > 0) {
+                XeveInputImgb *src = NULL;
+                int idx;
 
-                ret = ff_get_encode_buffer(avctx, avpkt, xectx->stat.write, 0);
+                for (idx = 0; idx < xectx->nb_psnr_inputs; idx++) {
+                    src = xectx->psnr_inputs[idx];
+                    if (src->imgb.ts[XEVE_TS_PTS] == xectx->bitb.ts[XEVE_TS_PTS])
+                        break;
+                }
+                if (idx == xectx->nb_psnr_inputs)
+                    src = NULL;
+
+                ret = libxeve_fill_packet(avctx, avpkt, xectx->id, &xectx->cdsc.param,
+                                          src ? &src->imgb : NULL, &xectx->bs_buf, &xectx->bitb,
+                                          &xectx->stat, encode_time);
+                if (src) {
+                    src->imgb.release(&src->imgb);
+                    xectx->psnr_inputs[idx] = xectx->psnr_inputs[--xectx->nb_psnr_inputs];
+                }
                 if (ret < 0)
                     return ret;
 
-                memcpy(avpkt->data, xectx->bitb.addr, xectx->stat.write);
-
-                avpkt->time_base.num = 1;
-                avpkt->time_base.den = xectx->cdsc.param.fps;
-
-                avpkt->pts = xectx->bitb.ts[XEVE_TS_PTS];
-                avpkt->dts = xectx->bitb.ts[XEVE_TS_DTS];
-
-                switch(xectx->stat.stype) {
-                case XEVE_ST_I:
-                    av_pic_type = AV_PICTURE_TYPE_I;
-                    avpkt->flags |= AV_PKT_FLAG_KEY;
-                    break;
-                case XEVE_ST_P:
-                    av_pic_type = AV_PICTURE_TYPE_P;
-                    break;
-                case XEVE_ST_B:
-                    av_pic_type = AV_PICTURE_TYPE_B;
-                    break;
-                case XEVE_ST_UNKNOWN:
-                    av_log(avctx, AV_LOG_ERROR, "Unknown slice type\n");
-                    return AVERROR_INVALIDDATA;
+                if (xectx->new_extradata) {
+                    ret = libxeve_export_new_extradata(avctx, avpkt);
+                    if (ret < 0)
+                        return ret;
+                    xectx->new_extradata = 0;
                 }
+                if (xectx->deadline)
+                    libxeve_join_dts(avctx, avpkt, &xectx->last_dts, &xectx->dts_offset, &xectx->instance_start);
 
-                ff_side_data_set_encoder_stats(avpkt, xectx->stat.qp * FF_QP2LAMBDA, NULL, 0, av_pic_type);
+                libxeve_log_stats(avctx, avpkt);
+                ret = libxeve_copy_to_user_buffer(avctx, avpkt);
+                if (ret < 0)
+                    return ret;
 
                 *got_packet = 1;
             }
         } else if (ret == XEVE_OK_NO_MORE_FRM) {
+            if (xectx->state == STATE_SWITCHING)
+                return libxeve_deadline_switch(avctx);
             // Return OK but no more frames
-            return 0;
+            return AVERROR_EOF;
         } else {
             av_log(avctx, AV_LOG_ERROR, "Invalid return value: %d\n", ret);
             return AVERROR_EXTERNAL;
@@ -521,6 +2712,141 @@ static int libxeve_encode(AVCodecContext *avctx, AVPacket *avpkt,
     return 0;
 }
 
+/**
+  * Push input frames to the encoder until it outputs an access unit
+  *
+  * XEVE outputs at most one access unit per xeve_encode() call, which is made once for every pushed frame,
+  * and once per call while bumping, so no packet ever needs to be queued.
+  *
+  * @param[in]  avctx codec context
+  * @param[out] avpkt output AVPacket containing encoded data
+  *
+  * @return 0 on success, AVERROR(EAGAIN) if more input is needed, AVERROR_EOF at the end of the stream,
+  *         another negative error code on failure
+  */
+static int libxeve_receive_packet(AVCodecContext *avctx, AVPacket *avpkt)
+{
+    XeveContext *xectx = avctx->priv_data;
+    AVFrame *frame = xectx->frame;
+    int got_packet = 0;
+    int ret;
+
+#if HAVE_THREADS
+    if (xectx->chunks) {
+        ret = libxeve_chunk_receive_packet(avctx, avpkt);
+        xectx->bs_buffers_peak = atomic_load(&xectx->nb_bs_bufs);
+        return ret;
+    }
+#endif
+
+    while (!got_packet) {
+        int eof = 0;
+
+        if (xectx->state == STATE_ENCODING) {
+            if (xectx->switch_frame && xectx->switch_frame->buf[0])
+                av_frame_move_ref(frame, xectx->switch_frame);
+            else {
+                ret = ff_encode_get_frame(avctx, frame);
+                if (ret == AVERROR_EOF)
+                    eof = 1;
+                else if (ret < 0)
+                    return ret;
+
+                if (!eof && xectx->max_latency && libxeve_frame_late(avctx, frame)) {
+                    if (!xectx->dropped_frames++)
+                        av_log(avctx, AV_LOG_WARNING, "Encoding fell behind real time by more than "
+                               "max_latency, dropping frames\n");
+                    av_log(avctx, AV_LOG_DEBUG, "Dropping the frame at pts %"PRId64"\n", frame->pts);
+                    av_frame_unref(frame);
+                    continue;
+                }
+            }
+
+            // the frame is held until the instance is bumped out
+            if (!eof && xectx->deadline_next >= 0) {
+                if (setup_bumping(xectx->id) < 0) {
+                    av_log(avctx, AV_LOG_ERROR, "Failed to setup bumping\n");
+                    av_frame_unref(frame);
+                    return AVERROR_EXTERNAL;
+                }
+                av_frame_move_ref(xectx->switch_frame, frame);
+                xectx->state = STATE_SWITCHING;
+            }
+        }
+
+        ret = libxeve_encode(avctx, avpkt, xectx->state == STATE_ENCODING && !eof ? frame : NULL, &got_packet);
+        av_frame_unref(frame);
+        if (ret < 0)
+            return ret;
+
+        if (xectx->delay_frames >= 0) {
+            xectx->delay_frames += xectx->state == STATE_ENCODING && !eof;
+            if (got_packet) {
+                if (xectx->delay_frames - 1 != avctx->delay)
+                    av_log(avctx, AV_LOG_VERBOSE, "The first packet came after %d frames, %d were expected\n",
+                           xectx->delay_frames, avctx->delay + 1);
+                xectx->delay_frames = -1;
+            }
+        }
+    }
+
+    // neither the input descriptors nor the bitstream buffers are ever freed before
+    // the encoder is closed, so their current counts are the peak ones
+    xectx->input_pictures_peak = xectx->nb_inputs;
+    xectx->bs_buffers_peak     = atomic_load(&xectx->nb_bs_bufs);
+
+    return 0;
+}
+
+/**
+ * Drop the frames and packets in flight and start a new closed GOP, e.g. for a new segment
+ *
+ * A bumped out XEVE instance cannot take further input, so it is replaced with one using the
+ * current configuration, which starts with an IDR picture and the same parameter sets.
+ * In chunked mode every chunk has an instance of its own already.
+ *
+ * @param avctx codec context
+ */
+static av_cold void libxeve_flush(AVCodecContext *avctx)
+{
+    XeveContext *xectx = avctx->priv_data;
+    int ret;
+
+#if HAVE_THREADS
+    if (xectx->chunks) {
+        libxeve_chunks_reset(xectx->chunks);
+        xectx->chunks->last_dts = AV_NOPTS_VALUE;
+        return;
+    }
+#endif
+
+    for (int i = 0; i < xectx->nb_psnr_inputs; i++)
+        xectx->psnr_inputs[i]->imgb.release(&xectx->psnr_inputs[i]->imgb);
+    xectx->nb_psnr_inputs = 0;
+
+    av_frame_unref(xectx->frame);
+    if (xectx->switch_frame)
+        av_frame_unref(xectx->switch_frame);
+
+    ret = libxeve_replace_instance(avctx, &xectx->cdsc);
+    if (ret < 0) {
+        // the encoding fails from now on rather than feeding a bumped out instance
+        av_log(avctx, AV_LOG_ERROR, "Cannot restart the encoder\n");
+        xeve_delete(xectx->id);
+        xectx->id = NULL;
+    }
+
+    xectx->state           = STATE_ENCODING;
+    xectx->deadline_next   = -1;
+    xectx->deadline_time   = 0;
+    xectx->deadline_frames = 0;
+    xectx->deadline_calm   = 0;
+    xectx->scenecut_valid  = 0;
+    xectx->last_dts        = AV_NOPTS_VALUE;
+    xectx->instance_start  = 1;
+    xectx->latency_origin  = AV_NOPTS_VALUE;
+}
+
 /**
  * Destroy the encoder and release all the allocated resources
  *
@@ -531,12 +2857,53 @@ static av_cold int libxeve_close(AVCodecContext *avctx)
 {
     XeveContext *xectx = avctx->priv_data;
 
+#if HAVE_THREADS
+    libxeve_chunks_uninit(avctx);
+#endif
+
     if (xectx->id) {
         xeve_delete(xectx->id);
         xectx->id = NULL;
     }
 
-    av_free(xectx->bitb.addr); /* release bitstream buffer */
+    av_buffer_unref(&xectx->bs_buf);
+    av_frame_free(&xectx->frame);
+    av_frame_free(&xectx->switch_frame);
+    av_freep(&xectx->scenecut_blocks);
+
+    if (xectx->dropped_frames)
+        av_log(avctx, AV_LOG_INFO, "%d frames dropped to hold max_latency\n", xectx->dropped_frames);
+
+    if (xectx->stats_file) {
+        fclose(xectx->stats_file);
+        xectx->stats_file = NULL;
+    }
+
+    for (int i = 0; i < xectx->nb_psnr_inputs; i++)
+        xectx->psnr_inputs[i]->imgb.release(&xectx->psnr_inputs[i]->imgb);
+    av_freep(&xectx->psnr_inputs);
+    xectx->nb_psnr_inputs = 0;
+
+    // the descriptors are only added when all of them are in use, so they are the peak count
+    if (xectx->nb_inputs) {
+        int64_t picture_size = av_image_get_buffer_size(avctx->pix_fmt, avctx->width, avctx->height, 1);
+        int nb_bs_bufs = atomic_load(&xectx->nb_bs_bufs);
+
+        av_log(avctx, AV_LOG_VERBOSE, "peak memory held besides XEVE: %d input pictures (%"PRId64" KiB), "
+               "%d bitstream buffers (%"PRId64" KiB)\n", xectx->nb_inputs,
+               xectx->nb_inputs * FFMAX(picture_size, 0) >> 10, nb_bs_bufs,
+               (int64_t)nb_bs_bufs * (xectx->bs_buf_size + AV_INPUT_BUFFER_PADDING_SIZE) >> 10);
+    }
+
+    for (int i = 0; i < xectx->nb_inputs; i++) {
+        av_frame_free(&xectx->inputs[i]->frame);
+        av_buffer_unref(&xectx->inputs[i]->planes);
+        av_freep(&xectx->inputs[i]);
+    }
+    av_freep(&xectx->inputs);
+    xectx->nb_inputs = 0;
+    av_buffer_pool_uninit(&xectx->bs_pool); /* release bitstream buffers */
+    av_buffer_pool_uninit(&xectx->planes_pool);
 
     return 0;
 }
@@ -547,33 +2914,67 @@ static av_cold int libxeve_close(AVCodecContext *avctx)
 static const enum AVPixelFormat supported_pixel_formats[] = {
     AV_PIX_FMT_YUV420P,
     AV_PIX_FMT_YUV420P10,
+    AV_PIX_FMT_NV12,
+    AV_PIX_FMT_P010,
+    AV_PIX_FMT_YUV422P,
+    AV_PIX_FMT_YUV422P10,
+    AV_PIX_FMT_YUV444P,
+    AV_PIX_FMT_YUV444P10,
+    AV_PIX_FMT_GRAY8,
+    AV_PIX_FMT_GRAY10,
     AV_PIX_FMT_NONE
 };
 
 // Consider using following options (./ffmpeg --help encoder=libxeve)
 //
 static const AVOption libxeve_options[] = {
-    { "preset", "Encoding preset for setting encoding speed", OFFSET(preset_id), AV_OPT_TYPE_INT, { .i64 = XEVE_PRESET_MEDIUM }, XEVE_PRESET_DEFAULT,  XEVE_PRESET_PLACEBO, VE, "preset" },
+    { "preset", "Encoding preset for setting encoding speed", OFFSET(preset_id), AV_OPT_TYPE_INT, { .i64 = XEVE_PRESET_MEDIUM }, XEVE_PRESET_DEFAULT,  PRESET_ULTRAFAST, VE, "preset" },
     { "default", NULL, 0, AV_OPT_TYPE_CONST, { .i64 = XEVE_PRESET_DEFAULT }, INT_MIN, INT_MAX, VE, "preset" },
+    { "ultrafast", "fast with a smaller motion search, the Baseline toolset and no binary and ternary splits", 0, AV_OPT_TYPE_CONST, { .i64 = PRESET_ULTRAFAST }, INT_MIN, INT_MAX, VE, "preset" },
+    { "superfast", "fast with a smaller motion search and no RDOQ", 0, AV_OPT_TYPE_CONST, { .i64 = PRESET_SUPERFAST }, INT_MIN, INT_MAX, VE, "preset" },
     { "fast",    NULL, 0, AV_OPT_TYPE_CONST, { .i64 = XEVE_PRESET_FAST },    INT_MIN, INT_MAX, VE, "preset" },
     { "medium",  NULL, 0, AV_OPT_TYPE_CONST, { .i64 = XEVE_PRESET_MEDIUM },  INT_MIN, INT_MAX, VE, "preset" },
     { "slow",    NULL, 0, AV_OPT_TYPE_CONST, { .i64 = XEVE_PRESET_SLOW },    INT_MIN, INT_MAX, VE, "preset" },
     { "placebo", NULL, 0, AV_OPT_TYPE_CONST, { .i64 = XEVE_PRESET_PLACEBO }, INT_MIN, INT_MAX, VE, "preset" },
-    { "tune", "Tuning parameter for special purpose operation", OFFSET(tune_id), AV_OPT_TYPE_INT, { .i64 = XEVE_TUNE_NONE }, XEVE_TUNE_NONE, XEVE_TUNE_PSNR, VE, "tune"},
+    { "tune", "Tuning parameter for special purpose operation", OFFSET(tune_id), AV_OPT_TYPE_INT, { .i64 = XEVE_TUNE_NONE }, XEVE_TUNE_NONE, TUNE_SCREEN, VE, "tune"},
     { "none",        NULL, 0, AV_OPT_TYPE_CONST, { .i64 = XEVE_TUNE_NONE },        INT_MIN, INT_MAX, VE, "tune" },
     { "zerolatency", NULL, 0, AV_OPT_TYPE_CONST, { .i64 = XEVE_TUNE_ZEROLATENCY }, INT_MIN, INT_MAX, VE, "tune" },
     { "psnr",        NULL, 0, AV_OPT_TYPE_CONST, { .i64 = XEVE_TUNE_PSNR },        INT_MIN, INT_MAX, VE, "tune" },
+    { "screen",      NULL, 0, AV_OPT_TYPE_CONST, { .i64 = TUNE_SCREEN },           INT_MIN, INT_MAX, VE, "tune" },
     { "profile", "Encoding profile", OFFSET(profile_id), AV_OPT_TYPE_INT, { .i64 = XEVE_PROFILE_BASELINE }, XEVE_PROFILE_BASELINE,  XEVE_PROFILE_MAIN, VE, "profile" },
     { "baseline", NULL, 0, AV_OPT_TYPE_CONST, { .i64 = XEVE_PROFILE_BASELINE }, INT_MIN, INT_MAX, VE, "profile" },
     { "main",     NULL, 0, AV_OPT_TYPE_CONST, { .i64 = XEVE_PROFILE_MAIN },     INT_MIN, INT_MAX, VE, "profile" },
-    { "rc_mode", "Rate control mode", OFFSET(rc_mode), AV_OPT_TYPE_INT, { .i64 = XEVE_RC_CQP }, XEVE_RC_CQP,  XEVE_RC_CRF, VE, "rc_mode" },
+    { "ibc", "Intra block copy, for screen content (-1: with tune=screen)", OFFSET(ibc), AV_OPT_TYPE_BOOL, { .i64 = -1 }, -1, 1, VE },
+    { "rc_mode", "Rate control mode", OFFSET(rc_mode), AV_OPT_TYPE_INT, { .i64 = XEVE_RC_CQP }, XEVE_RC_CQP,  RC_CBR, VE, "rc_mode" },
     { "CQP", NULL, 0, AV_OPT_TYPE_CONST, { .i64 = XEVE_RC_CQP }, INT_MIN, INT_MAX, VE, "rc_mode" },
     { "ABR", NULL, 0, AV_OPT_TYPE_CONST, { .i64 = XEVE_RC_ABR }, INT_MIN, INT_MAX, VE, "rc_mode" },
     { "CRF", NULL, 0, AV_OPT_TYPE_CONST, { .i64 = XEVE_RC_CRF }, INT_MIN, INT_MAX, VE, "rc_mode" },
+    { "CBR", "ABR with filler data keeping the VBV buffer full", 0, AV_OPT_TYPE_CONST, { .i64 = RC_CBR }, INT_MIN, INT_MAX, VE, "rc_mode" },
     { "qp", "Quantization parameter value for CQP rate control mode", OFFSET(qp), AV_OPT_TYPE_INT, { .i64 = 32 }, 0, 51, VE },
     { "crf", "Constant rate factor value for CRF rate control mode", OFFSET(crf), AV_OPT_TYPE_INT, { .i64 = 32 }, 10, 49, VE },
     { "hash", "Embed picture signature (HASH) for conformance checking in decoding", OFFSET(hash), AV_OPT_TYPE_INT, { .i64 = 0 }, 0, 1, VE },
     { "sei_info", "Embed SEI messages identifying encoder parameters and command line arguments", OFFSET(sei_info), AV_OPT_TYPE_INT, { .i64 = 0 }, 0, 1, VE },
+    { "recovery_point_sei", "Mark the non-IDR intra pictures of open GOPs as recovery points", OFFSET(recovery_point_sei), AV_OPT_TYPE_BOOL, { .i64 = 0 }, 0, 1, VE },
+    { "lookahead", "Number of pictures analyzed ahead by the rate control (-1: XEVE default)", OFFSET(lookahead), AV_OPT_TYPE_INT, { .i64 = -1 }, -1, INT_MAX, VE },
+    { "codec_bit_depth", "Bit depth of the coded samples, 8-bit input may be coded at 10 bit (0: XEVE default)", OFFSET(codec_bit_depth), AV_OPT_TYPE_INT, { .i64 = 0 }, 0, 10, VE },
+    { "scenecut", "Force an intra picture when the luma changes by this percentage of the sample range, 0 to disable", OFFSET(scenecut), AV_OPT_TYPE_INT, { .i64 = 0 }, 0, 100, VE },
+    { "cpus", "Restrict the encoder threads to a list of CPUs, e.g. 0-7,16-23", OFFSET(cpus), AV_OPT_TYPE_STRING, { .str = NULL }, 0, 0, VE },
+    { "chunk_threads", "Number of chunks encoded in parallel by separate XEVE instances (0 disables)", OFFSET(chunk_threads), AV_OPT_TYPE_INT, { .i64 = 0 }, 0, 64, VE },
+    { "chunk_size", "Number of frames per chunk, defaults to the GOP size", OFFSET(chunk_size), AV_OPT_TYPE_INT, { .i64 = 0 }, 0, INT_MAX, VE },
+    { "b_adapt", "Choose the number of B frames of every chunk from its motion, up to bf", OFFSET(b_adapt), AV_OPT_TYPE_BOOL, { .i64 = 0 }, 0, 1, VE },
+    { "tile_columns", "Number of tile columns (0: a single one)", OFFSET(tile_columns), AV_OPT_TYPE_INT, { .i64 = 0 }, 0, EVC_MAX_TILE_COLUMNS, VE },
+    { "tile_rows", "Number of tile rows (0: a single one)", OFFSET(tile_rows), AV_OPT_TYPE_INT, { .i64 = 0 }, 0, EVC_MAX_TILE_ROWS, VE },
+    { "uniform_tiles", "Split the picture into tiles of the same size", OFFSET(uniform_tiles), AV_OPT_TYPE_BOOL, { .i64 = 1 }, 0, 1, VE },
+    { "tile_widths", "Comma separated widths of the tile columns in CTUs, for non uniform tiles", OFFSET(tile_widths), AV_OPT_TYPE_STRING, { .str = NULL }, 0, 0, VE },
+    { "tile_heights", "Comma separated heights of the tile rows in CTUs, for non uniform tiles", OFFSET(tile_heights), AV_OPT_TYPE_STRING, { .str = NULL }, 0, 0, VE },
+    { "tile_loop_filter", "Apply the loop filters across the tile boundaries", OFFSET(tile_loop_filter), AV_OPT_TYPE_BOOL, { .i64 = -1 }, -1, 1, VE },
+    { "max_latency", "Drop the input frames fetched later than this behind real time (0: never)", OFFSET(max_latency), AV_OPT_TYPE_DURATION, { .i64 = 0 }, 0, INT64_MAX, VE },
+    { "deadline", "Step the preset down and back up to keep the encoding time of a frame within the frame interval", OFFSET(deadline), AV_OPT_TYPE_BOOL, { .i64 = 0 }, 0, 1, VE },
+    { "stats_log", "Write the statistics of every packet to this CSV file", OFFSET(stats_log), AV_OPT_TYPE_STRING, { .str = NULL }, 0, 0, VE },
+    { "shard", "Encode one shard of a distributed encode, in closed GOPs with the same parameter sets as the other shards", OFFSET(shard), AV_OPT_TYPE_BOOL, { .i64 = 0 }, 0, 1, VE },
+    { "bs_buffer_size", "Size of a bitstream buffer, enough for any picture with the current settings", OFFSET(bs_buf_size), AV_OPT_TYPE_INT, { .i64 = 0 }, 0, INT_MAX, VE | AV_OPT_FLAG_EXPORT | AV_OPT_FLAG_READONLY },
+    { "bs_buffers_peak", "Highest number of bitstream buffers allocated at the same time", OFFSET(bs_buffers_peak), AV_OPT_TYPE_INT, { .i64 = 0 }, 0, INT_MAX, VE | AV_OPT_FLAG_EXPORT | AV_OPT_FLAG_READONLY },
+    { "input_pictures_peak", "Highest number of input pictures held by XEVE at the same time", OFFSET(input_pictures_peak), AV_OPT_TYPE_INT, { .i64 = 0 }, 0, INT_MAX, VE | AV_OPT_FLAG_EXPORT | AV_OPT_FLAG_READONLY },
     { "xeve-params",  "Override the xeve configuration using a :-separated list of key=value parameters", OFFSET(xeve_params), AV_OPT_TYPE_DICT, { 0 }, 0, 0, VE },
     { NULL }
 };
@@ -593,6 +2994,7 @@ static const FFCodecDefault libxeve_defaults[] = {
     { "b", "0" },       // bitrate in terms of kilo-bits per second
     { "g", "0" },       // gop_size (key-frame interval 0: only one I-frame at the first time; 1: every frame is coded in I-frame)
     { "bf", "15"},      // maximum number of B frames (0: no B-frames, 1,3,7,15)
+    { "refs", "-1"},    // maximum number of reference pictures, limiting the B pyramid depth
     { "threads", "0"},  // number of threads to be used (0: automatically select the number of threads to set)
     { NULL },
 };
@@ -603,12 +3005,14 @@ const FFCodec ff_libxeve_encoder = {
     .p.type             = AVMEDIA_TYPE_VIDEO,
     .p.id               = AV_CODEC_ID_EVC,
     .init               = libxeve_init,
-    FF_CODEC_ENCODE_CB(libxeve_encode),
+    FF_CODEC_RECEIVE_PACKET_CB(libxeve_receive_packet),
+    .flush              = libxeve_flush,
     .close              = libxeve_close,
     .priv_data_size     = sizeof(XeveContext),
     .p.priv_class       = &libxeve_class,
     .defaults           = libxeve_defaults,
-    .p.capabilities     = AV_CODEC_CAP_DELAY | AV_CODEC_CAP_OTHER_THREADS | AV_CODEC_CAP_DR1,
+    .p.capabilities     = AV_CODEC_CAP_DELAY | AV_CODEC_CAP_OTHER_THREADS | AV_CODEC_CAP_DR1 |
+                          AV_CODEC_CAP_ENCODER_RECON_FRAME | AV_CODEC_CAP_ENCODER_FLUSH,
     .p.profiles         = NULL_IF_CONFIG_SMALL(ff_evc_profiles),
     .p.wrapper_name     = "libxeve",
     .p.pix_fmts         = supported_pixel_formats,
@@ -299,6 +299,12 @@ enum AVPacketSideDataType {
      */
     AV_PKT_DATA_DYNAMIC_HDR10_PLUS,
 
+    /**
+     * Statistics of the coding of the frame by the encoder, in the form of
+     * the AVEncoderStats struct.
+     */
+    AV_PKT_DATA_ENCODER_STATS,
+
     /**
      * The number of side data types.
      * This is not part of the public API/ABI in the sense that it may
@@ -21,6 +21,7 @@
 
 #include <stdint.h>
 
+#include "defs.h"
 #include "packet.h"
 
 typedef struct PacketListEntry {
@@ -70,4 +71,11 @@ int ff_side_data_set_encoder_stats(AVPacket *pkt, int quality, int64_t *error, i
 
 int ff_side_data_set_prft(AVPacket *pkt, int64_t timestamp);
 
+/**
+ * Add AV_PKT_DATA_ENCODER_STATS side data to a packet, with all the fields unknown
+ *
+ * @return the statistics to fill in, NULL on allocation failure
+ */
+AVEncoderStats *ff_side_data_new_encoder_stats(AVPacket *pkt);
+
 #endif // AVCODEC_PACKET_INTERNAL_H
@@ -0,0 +1,253 @@
+/*
+ * This file is part of FFmpeg.
+ *
+ * FFmpeg is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * FFmpeg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with FFmpeg; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include "config.h"
+
+#if HAVE_SCHED_GETAFFINITY && HAVE_SCHED_SETAFFINITY
+#ifndef _GNU_SOURCE
+# define _GNU_SOURCE
+#endif
+#include <sched.h>
+#endif
+
+#include <errno.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "libavutil/common.h"
+#include "libavutil/cpu.h"
+#include "libavutil/error.h"
+#include "libavutil/log.h"
+#include "libavutil/mem.h"
+
+#include "thread_affinity.h"
+
+#if HAVE_SCHED_GETAFFINITY && HAVE_SCHED_SETAFFINITY && defined(CPU_SET)
+static int parse_cpus(void *logctx, const char *cpus, cpu_set_t *set)
+{
+    const char *p = cpus;
+
+    CPU_ZERO(set);
+
+    while (*p) {
+        char *end;
+        long first, last;
+
+        first = last = strtol(p, &end, 10);
+        if (end == p)
+            goto fail;
+        if (*end == '-') {
+            p    = end + 1;
+            last = strtol(p, &end, 10);
+            if (end == p)
+                goto fail;
+        }
+        if (first < 0 || last < first || last >= CPU_SETSIZE)
+            goto fail;
+
+        for (long cpu = first; cpu <= last; cpu++)
+            CPU_SET(cpu, set);
+
+        p = end;
+        if (*p == ',')
+            p++;
+        else if (*p)
+            goto fail;
+    }
+
+    if (!CPU_COUNT(set))
+        goto fail;
+
+    return 0;
+fail:
+    av_log(logctx, AV_LOG_ERROR, "Invalid CPU list: '%s'\n", cpus);
+    return AVERROR(EINVAL);
+}
+
+int ff_thread_affinity_set(void *logctx, const char *cpus, void **saved)
+{
+    cpu_set_t set, *prev;
+    int ret;
+
+    *saved = NULL;
+
+    ret = parse_cpus(logctx, cpus, &set);
+    if (ret < 0)
+        return ret;
+
+    prev = av_malloc(sizeof(*prev));
+    if (!prev)
+        return AVERROR(ENOMEM);
+
+    if (sched_getaffinity(0, sizeof(*prev), prev) ||
+        sched_setaffinity(0, sizeof(set), &set)) {
+        ret = AVERROR(errno);
+        av_log(logctx, AV_LOG_ERROR, "Cannot set the CPU affinity to '%s': %s\n",
+               cpus, av_err2str(ret));
+        av_free(prev);
+        return ret;
+    }
+
+    *saved = prev;
+    return 0;
+}
+
+void ff_thread_affinity_restore(void **saved)
+{
+    cpu_set_t *prev = *saved;
+
+    if (!prev)
+        return;
+
+    sched_setaffinity(0, sizeof(*prev), prev);
+    av_freep(saved);
+}
+#else
+int ff_thread_affinity_set(void *logctx, const char *cpus, void **saved)
+{
+    *saved = NULL;
+    av_log(logctx, AV_LOG_ERROR, "Setting the CPU affinity is not supported on this system\n");
+    return AVERROR(ENOSYS);
+}
+
+void ff_thread_affinity_restore(void **saved)
+{
+}
+#endif
+
+#ifdef __linux__
+/**
+ * Read the CPU bandwidth limit of a cgroup directory
+ *
+ * @return the limit in CPUs, 0 if the cgroup is not limited or has no such files
+ */
+static double cgroup_cpu_limit(const char *dir, int v2)
+{
+    char path[4096], quota[32];
+    long long period = 0;
+    double limit = 0;
+    FILE *f;
+
+    if (v2) {
+        snprintf(path, sizeof(path), "%s/cpu.max", dir);
+        if (!(f = fopen(path, "r")))
+            return 0;
+        // "$MAX $PERIOD", MAX being "max" when unlimited
+        if (fscanf(f, "%31s %lld", quota, &period) == 2 && strcmp(quota, "max") && period > 0)
+            limit = strtoll(quota, NULL, 10) / (double)period;
+        fclose(f);
+    } else {
+        snprintf(path, sizeof(path), "%s/cpu.cfs_period_us", dir);
+        if (!(f = fopen(path, "r")))
+            return 0;
+        if (fscanf(f, "%lld", &period) != 1)
+            period = 0;
+        fclose(f);
+
+        snprintf(path, sizeof(path), "%s/cpu.cfs_quota_us", dir);
+        if (!(f = fopen(path, "r")))
+            return 0;
+        // -1 when unlimited
+        if (fscanf(f, "%31s", quota) == 1 && period > 0)
+            limit = strtoll(quota, NULL, 10) / (double)period;
+        fclose(f);
+    }
+
+    return FFMAX(limit, 0);
+}
+
+/**
+ * Find the tightest CPU bandwidth limit of the cgroup of the process and its ancestors
+ *
+ * @return the limit in CPUs, 0 if there is none
+ */
+static double cgroup_cpu_quota(void)
+{
+    char line[4096], dir[4096 + 64];
+    double quota = 0;
+    FILE *f;
+
+    if (!(f = fopen("/proc/self/cgroup", "r")))
+        return 0;
+
+    // "0::$PATH" for the cgroup v2 hierarchy, "$ID:$CONTROLLERS:$PATH" for v1
+    while (fgets(line, sizeof(line), f)) {
+        char *controllers = strchr(line, ':');
+        char *cgroup = controllers ? strchr(controllers + 1, ':') : NULL;
+        char *end;
+        int v2;
+
+        if (!cgroup)
+            continue;
+        *controllers++ = 0;
+        *cgroup++ = 0;
+        cgroup[strcspn(cgroup, "\n")] = 0;
+
+        v2 = !*controllers;
+        if (!v2) {
+            const char *p = controllers;
+            int cpu = 0;
+
+            while (*p && !cpu) {
+                size_t len = strcspn(p, ",");
+                cpu = len == 3 && !strncmp(p, "cpu", 3);
+                p += len + !!p[len];
+            }
+            if (!cpu)
+                continue;
+        }
+
+        // the limits of the parent cgroups apply as well
+        snprintf(dir, sizeof(dir), "/sys/fs/cgroup%s%s%s", v2 ? "" : "/", controllers, cgroup);
+        end = dir + strlen(dir) - strlen(cgroup);
+        for (;;) {
+            double limit = cgroup_cpu_limit(dir, v2);
+            char *slash;
+
+            if (limit > 0 && (!quota || limit < quota))
+                quota = limit;
+
+            slash = strrchr(end, '/');
+            if (!slash)
+                break;
+            *slash = 0;
+        }
+    }
+
+    fclose(f);
+
+    return quota;
+}
+#endif
+
+int ff_thread_available_cpus(void *logctx)
+{
+    int nb_cpus = av_cpu_count();
+#ifdef __linux__
+    double quota = cgroup_cpu_quota();
+
+    if (quota > 0 && quota < nb_cpus) {
+        nb_cpus = FFMAX((int)ceil(quota), 1);
+        av_log(logctx, AV_LOG_DEBUG, "CPU quota of %.2f CPUs, using %d CPUs\n", quota, nb_cpus);
+    }
+#endif
+
+    return nb_cpus;
+}
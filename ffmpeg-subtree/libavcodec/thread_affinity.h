@@ -0,0 +1,53 @@
+/*
+ * This file is part of FFmpeg.
+ *
+ * FFmpeg is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * FFmpeg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with FFmpeg; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef AVCODEC_THREAD_AFFINITY_H
+#define AVCODEC_THREAD_AFFINITY_H
+
+/**
+ * Restrict the calling thread to a set of CPUs.
+ *
+ * Threads created by the calling thread afterwards inherit the restriction,
+ * which is how the worker threads of external libraries are pinned: set the
+ * affinity, create the library instance, then restore it.
+ *
+ * @param cpus  comma separated list of CPU numbers and ranges, e.g. "0-7,16"
+ * @param saved set to the previous affinity, to be passed to
+ *              ff_thread_affinity_restore()
+ * @return 0 on success, AVERROR(ENOSYS) if not supported on this system,
+ *         another negative error code on failure
+ */
+int ff_thread_affinity_set(void *logctx, const char *cpus, void **saved);
+
+/**
+ * Restore the affinity saved by ff_thread_affinity_set() and free it.
+ * Does nothing if *saved is NULL.
+ */
+void ff_thread_affinity_restore(void **saved);
+
+/**
+ * Get the number of CPUs to size automatic thread counts by.
+ *
+ * This is av_cpu_count(), which follows the affinity of the calling thread,
+ * further limited on Linux by the CPU bandwidth quota (cpu.max or
+ * cpu.cfs_quota_us) of the cgroup of the process and of its ancestors,
+ * rounded up, as set for containers limited to a number of CPUs.
+ */
+int ff_thread_available_cpus(void *logctx);
+
+#endif /* AVCODEC_THREAD_AFFINITY_H */
@@ -442,4 +442,5 @@ M2MENC(mpeg4,"MPEG4", mpeg4_options, AV_CODEC_ID_MPEG4);
 M2MENC(h263, "H.263", options,       AV_CODEC_ID_H263);
 M2MENC(h264, "H.264", options,       AV_CODEC_ID_H264);
 M2MENC(hevc, "HEVC",  options,       AV_CODEC_ID_HEVC);
+M2MENC(evc,  "EVC",   options,       AV_CODEC_ID_EVC);
 M2MENC(vp8,  "VP8",   options,       AV_CODEC_ID_VP8);
@@ -29,13 +29,18 @@
 
 #include "libavutil/avassert.h"
 #include "libavutil/avstring.h"
+#include "libavutil/dict.h"
 #include "libavutil/error.h"
 #include "libavutil/fifo.h"
 #include "libavutil/log.h"
+#include "libavutil/mem.h"
 #include "libavutil/opt.h"
 #include "libavutil/thread.h"
 #include "url.h"
+#include <inttypes.h>
 #include <stdint.h>
+#include <stdio.h>
+#include <string.h>
 
 #if HAVE_UNISTD_H
 #include <unistd.h>
@@ -44,6 +49,7 @@
 #define BUFFER_CAPACITY         (4 * 1024 * 1024)
 #define READ_BACK_CAPACITY      (4 * 1024 * 1024)
 #define SHORT_SEEK_THRESHOLD    (256 * 1024)
+#define MAX_GOP_INDEX_SIZE      (64 * 1024 * 1024)
 
 typedef struct RingBuffer
 {
@@ -53,6 +59,12 @@ typedef struct RingBuffer
     int           read_pos;
 } RingBuffer;
 
+typedef struct CachedGOP {
+    int64_t       start;
+    int64_t       end;
+    uint8_t      *data;
+} CachedGOP;
+
 typedef struct Context {
     AVClass        *class;
     URLContext     *inner;
@@ -78,6 +90,25 @@ typedef struct Context {
 
     int             abort_request;
     AVIOInterruptCB interrupt_callback;
+
+    /* the inner protocol is only seeked once the ring has been filled from the cache */
+    int64_t         inner_seek_pos;
+
+    char           *url;
+    int             flags;
+    AVDictionary   *inner_options;
+    URLContext     *prefetch;
+    int64_t        *gop_pos;
+    int             nb_gops;
+    CachedGOP      *gops;
+    int             nb_cached_gops;
+    pthread_cond_t  cond_wakeup_prefetch;
+    pthread_t       prefetch_thread;
+    int             prefetch_thread_started;
+
+    /* options */
+    char           *gop_index;
+    int             gop_cache;
 } Context;
 
 static int ring_init(RingBuffer *ring, unsigned int capacity, int read_back_capacity)
@@ -181,6 +212,127 @@ static int async_check_interrupt(void *arg)
     return c->abort_request;
 }
 
+static const CachedGOP *find_cached_gop(Context *c, int64_t pos)
+{
+    for (int i = 0; i < c->nb_cached_gops; i++)
+        if (pos >= c->gops[i].start && pos < c->gops[i].end)
+            return &c->gops[i];
+    return NULL;
+}
+
+/* first GOP starting at or after pos */
+static int find_gop(Context *c, int64_t pos)
+{
+    int lo = 0, hi = c->nb_gops;
+
+    while (lo < hi) {
+        int mid = (lo + hi) >> 1;
+        if (c->gop_pos[mid] < pos)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+/*
+ * The GOPs to keep cached are the gop_cache ones following the data already in the
+ * ring, so that seeking forward does not have to wait for a new request.
+ */
+static int next_gop_to_prefetch(Context *c, int *window_start)
+{
+    int first = find_gop(c, c->logical_pos + ring_size(&c->ring));
+    int last  = FFMIN(first + c->gop_cache, c->nb_gops);
+
+    *window_start = first;
+    for (int i = first; i < last; i++) {
+        int64_t size = c->gop_pos[i + 1] - c->gop_pos[i];
+        if (size <= BUFFER_CAPACITY + READ_BACK_CAPACITY && !find_cached_gop(c, c->gop_pos[i]))
+            return i;
+    }
+    return -1;
+}
+
+static void add_cached_gop(Context *c, int64_t start, int64_t end, uint8_t *data)
+{
+    int window_start, victim = -1;
+
+    next_gop_to_prefetch(c, &window_start);
+    if (c->nb_cached_gops < c->gop_cache) {
+        victim = c->nb_cached_gops++;
+    } else {
+        int64_t window_first = c->gop_pos[window_start];
+        int64_t window_end   = c->gop_pos[FFMIN(window_start + c->gop_cache, c->nb_gops)];
+
+        // evict a GOP outside of the prefetch window, the lowest one first
+        for (int i = 0; i < c->nb_cached_gops; i++) {
+            const CachedGOP *gop = &c->gops[i];
+            if ((gop->start < window_first || gop->start >= window_end) &&
+                (victim < 0 || gop->start < c->gops[victim].start))
+                victim = i;
+        }
+        if (victim < 0) {
+            av_free(data);
+            return;
+        }
+        av_free(c->gops[victim].data);
+    }
+    c->gops[victim] = (CachedGOP){ .start = start, .end = end, .data = data };
+}
+
+static void *async_prefetch_task(void *arg)
+{
+    URLContext   *h    = arg;
+    Context      *c    = h->priv_data;
+    AVIOInterruptCB interrupt_callback = {.callback = async_check_interrupt, .opaque = h};
+    int           ret;
+
+    ff_thread_setname("async-prefetch");
+
+    // a second connection, so that prefetching does not hold up the linear reading
+    ret = ffurl_open_whitelist(&c->prefetch, c->url, c->flags, &interrupt_callback,
+                               &c->inner_options, h->protocol_whitelist, h->protocol_blacklist, h);
+    if (ret < 0) {
+        av_log(h, AV_LOG_WARNING, "Cannot open %s for prefetching: %s\n", c->url, av_err2str(ret));
+        return NULL;
+    }
+
+    pthread_mutex_lock(&c->mutex);
+    while (!async_check_interrupt(h)) {
+        int window_start, gop = next_gop_to_prefetch(c, &window_start);
+        int64_t start, end;
+        uint8_t *data;
+
+        if (gop < 0) {
+            pthread_cond_wait(&c->cond_wakeup_prefetch, &c->mutex);
+            continue;
+        }
+        start = c->gop_pos[gop];
+        end   = c->gop_pos[gop + 1];
+        pthread_mutex_unlock(&c->mutex);
+
+        data = av_malloc(end - start);
+        if (!data)
+            ret = AVERROR(ENOMEM);
+        else if ((ret = ffurl_seek(c->prefetch, start, SEEK_SET)) >= 0)
+            ret = ffurl_read_complete(c->prefetch, data, end - start);
+
+        pthread_mutex_lock(&c->mutex);
+        if (ret != end - start) {
+            av_free(data);
+            if (ret != AVERROR_EXIT)
+                av_log(h, AV_LOG_WARNING, "Prefetching the GOP at %"PRId64" failed, "
+                       "stopping: %s\n", start, ret < 0 ? av_err2str(ret) : "short read");
+            break;
+        }
+        add_cached_gop(c, start, end, data);
+        av_log(h, AV_LOG_TRACE, "async: prefetched GOP %"PRId64"-%"PRId64"\n", start, end);
+    }
+    pthread_mutex_unlock(&c->mutex);
+
+    return NULL;
+}
+
 static void *async_buffer_task(void *arg)
 {
     URLContext   *h    = arg;
@@ -204,11 +356,26 @@ static void *async_buffer_task(void *arg)
         }
 
         if (c->seek_request) {
-            seek_ret = ffurl_seek(c->inner, c->seek_pos, c->seek_whence);
+            const CachedGOP *gop = find_cached_gop(c, c->seek_pos);
+
+            // a pending catch up seek of the inner context is stale now
+            c->inner_seek_pos = -1;
+            if (gop) {
+                int size;
+
+                ring_reset(ring);
+                size = FFMIN(gop->end - c->seek_pos, ring_space(ring));
+                av_fifo_write(ring->fifo, gop->data + c->seek_pos - gop->start, size);
+                c->inner_seek_pos = c->seek_pos + size;
+                seek_ret          = c->seek_pos;
+            } else {
+                seek_ret = ffurl_seek(c->inner, c->seek_pos, c->seek_whence);
+                if (seek_ret >= 0)
+                    ring_reset(ring);
+            }
             if (seek_ret >= 0) {
                 c->io_eof_reached = 0;
                 c->io_error       = 0;
-                ring_reset(ring);
             }
 
             c->seek_completed = 1;
@@ -221,6 +388,22 @@ static void *async_buffer_task(void *arg)
             continue;
         }
 
+        if (c->inner_seek_pos >= 0) {
+            int64_t pos = c->inner_seek_pos;
+
+            // the reader is served from the ring in the meantime
+            c->inner_seek_pos = -1;
+            pthread_mutex_unlock(&c->mutex);
+            seek_ret = ffurl_seek(c->inner, pos, SEEK_SET);
+            pthread_mutex_lock(&c->mutex);
+            if (seek_ret < 0 && !c->seek_request) {
+                c->io_eof_reached = 1;
+                c->io_error       = seek_ret;
+            }
+            pthread_mutex_unlock(&c->mutex);
+            continue;
+        }
+
         fifo_space = ring_space(ring);
         if (c->io_eof_reached || fifo_space <= 0) {
             pthread_cond_signal(&c->cond_wakeup_main);
@@ -247,6 +430,85 @@ static void *async_buffer_task(void *arg)
     return NULL;
 }
 
+/*
+ * Read the IDR access unit positions written by tools/evc_index, each GOP runs up to
+ * the next one and the last to the end of the file.
+ */
+static int load_gop_index(URLContext *h)
+{
+    Context    *c   = h->priv_data;
+    URLContext *idx = NULL;
+    char       *buf = NULL, *p;
+    int64_t     size, file_size, pictures, pos, picture;
+    int         version, n, ret;
+
+    ret = ffurl_open_whitelist(&idx, c->gop_index, AVIO_FLAG_READ, &h->interrupt_callback,
+                               NULL, h->protocol_whitelist, h->protocol_blacklist, h);
+    if (ret < 0)
+        return ret;
+
+    size = ffurl_size(idx);
+    if (size <= 0 || size > MAX_GOP_INDEX_SIZE) {
+        ret = AVERROR_INVALIDDATA;
+        goto end;
+    }
+    buf = av_malloc(size + 1);
+    if (!buf) {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+    ret = ffurl_read_complete(idx, buf, size);
+    if (ret != size) {
+        ret = ret < 0 ? ret : AVERROR_INVALIDDATA;
+        goto end;
+    }
+    buf[size] = 0;
+
+    if (sscanf(buf, "EVCIDX %d %"SCNd64" %"SCNd64"%n", &version, &file_size, &pictures, &n) != 3 ||
+        version != 1 || file_size <= 0) {
+        ret = AVERROR_INVALIDDATA;
+        goto end;
+    }
+    if (file_size != c->logical_size) {
+        av_log(h, AV_LOG_WARNING, "GOP index %s is of a file of %"PRId64" bytes, "
+               "not of the input\n", c->gop_index, file_size);
+        ret = AVERROR_INVALIDDATA;
+        goto end;
+    }
+
+    // one entry per line, plus the end of the file
+    n = 1;
+    for (p = buf; (p = strchr(p, '\n')); p++)
+        n++;
+    c->gop_pos = av_malloc_array(n, sizeof(*c->gop_pos));
+    if (!c->gop_pos) {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+
+    for (p = strchr(buf, '\n'); p && *++p; p = strchr(p, '\n')) {
+        if (sscanf(p, "%"SCNd64" %"SCNd64, &pos, &picture) != 2 || pos >= file_size ||
+            (c->nb_gops && pos <= c->gop_pos[c->nb_gops - 1])) {
+            ret = AVERROR_INVALIDDATA;
+            goto end;
+        }
+        c->gop_pos[c->nb_gops++] = pos;
+    }
+    c->gop_pos[c->nb_gops] = file_size;
+
+    av_log(h, AV_LOG_VERBOSE, "Loaded %d GOPs from %s\n", c->nb_gops, c->gop_index);
+    ret = 0;
+
+end:
+    if (ret < 0) {
+        av_freep(&c->gop_pos);
+        c->nb_gops = 0;
+    }
+    av_free(buf);
+    ffurl_closep(&idx);
+    return ret;
+}
+
 static int async_open(URLContext *h, const char *arg, int flags, AVDictionary **options)
 {
     Context         *c = h->priv_data;
@@ -254,6 +516,14 @@ static int async_open(URLContext *h, const char *arg, int flags, AVDictionary **
     AVIOInterruptCB  interrupt_callback = {.callback = async_check_interrupt, .opaque = h};
 
     av_strstart(arg, "async:", &arg);
+    c->inner_seek_pos = -1;
+
+    if (c->gop_index && c->gop_cache > 0) {
+        c->url   = av_strdup(arg);
+        c->flags = flags;
+        if (!c->url || (options && av_dict_copy(&c->inner_options, *options, 0) < 0))
+            return AVERROR(ENOMEM);
+    }
 
     ret = ring_init(&c->ring, BUFFER_CAPACITY, READ_BACK_CAPACITY);
     if (ret < 0)
@@ -270,6 +540,16 @@ static int async_open(URLContext *h, const char *arg, int flags, AVDictionary **
     c->logical_size = ffurl_size(c->inner);
     h->is_streamed  = c->inner->is_streamed;
 
+    if (c->url) {
+        if (h->is_streamed || (ret = load_gop_index(h)) < 0) {
+            av_log(h, AV_LOG_WARNING, "Cannot use the GOP index %s, GOPs will not be "
+                   "prefetched\n", c->gop_index);
+        } else if (!(c->gops = av_calloc(c->gop_cache, sizeof(*c->gops)))) {
+            ret = AVERROR(ENOMEM);
+            goto mutex_fail;
+        }
+    }
+
     ret = pthread_mutex_init(&c->mutex, NULL);
     if (ret != 0) {
         ret = AVERROR(ret);
@@ -291,6 +571,13 @@ static int async_open(URLContext *h, const char *arg, int flags, AVDictionary **
         goto cond_wakeup_background_fail;
     }
 
+    ret = pthread_cond_init(&c->cond_wakeup_prefetch, NULL);
+    if (ret != 0) {
+        ret = AVERROR(ret);
+        av_log(h, AV_LOG_ERROR, "pthread_cond_init failed : %s\n", av_err2str(ret));
+        goto cond_wakeup_prefetch_fail;
+    }
+
     ret = pthread_create(&c->async_buffer_thread, NULL, async_buffer_task, h);
     if (ret) {
         ret = AVERROR(ret);
@@ -298,19 +585,33 @@ static int async_open(URLContext *h, const char *arg, int flags, AVDictionary **
         goto thread_fail;
     }
 
+    if (c->gops) {
+        ret = pthread_create(&c->prefetch_thread, NULL, async_prefetch_task, h);
+        if (ret)
+            av_log(h, AV_LOG_WARNING, "pthread_create failed : %s, GOPs will not be "
+                   "prefetched\n", av_err2str(AVERROR(ret)));
+        c->prefetch_thread_started = !ret;
+    }
+
     return 0;
 
 thread_fail:
+    pthread_cond_destroy(&c->cond_wakeup_prefetch);
+cond_wakeup_prefetch_fail:
     pthread_cond_destroy(&c->cond_wakeup_background);
 cond_wakeup_background_fail:
     pthread_cond_destroy(&c->cond_wakeup_main);
 cond_wakeup_main_fail:
     pthread_mutex_destroy(&c->mutex);
 mutex_fail:
+    av_freep(&c->gops);
+    av_freep(&c->gop_pos);
     ffurl_closep(&c->inner);
 url_fail:
     ring_destroy(&c->ring);
 fifo_fail:
+    av_dict_free(&c->inner_options);
+    av_freep(&c->url);
     return ret;
 }
 
@@ -322,12 +623,27 @@ static int async_close(URLContext *h)
     pthread_mutex_lock(&c->mutex);
     c->abort_request = 1;
     pthread_cond_signal(&c->cond_wakeup_background);
+    pthread_cond_signal(&c->cond_wakeup_prefetch);
     pthread_mutex_unlock(&c->mutex);
 
     ret = pthread_join(c->async_buffer_thread, NULL);
     if (ret != 0)
         av_log(h, AV_LOG_ERROR, "pthread_join(): %s\n", av_err2str(ret));
+    if (c->prefetch_thread_started) {
+        ret = pthread_join(c->prefetch_thread, NULL);
+        if (ret != 0)
+            av_log(h, AV_LOG_ERROR, "pthread_join(): %s\n", av_err2str(ret));
+    }
+
+    for (int i = 0; i < c->nb_cached_gops; i++)
+        av_free(c->gops[i].data);
+    av_freep(&c->gops);
+    av_freep(&c->gop_pos);
+    av_dict_free(&c->inner_options);
+    av_freep(&c->url);
+    ffurl_closep(&c->prefetch);
 
+    pthread_cond_destroy(&c->cond_wakeup_prefetch);
     pthread_cond_destroy(&c->cond_wakeup_background);
     pthread_cond_destroy(&c->cond_wakeup_main);
     pthread_mutex_destroy(&c->mutex);
@@ -379,6 +695,7 @@ static int async_read_internal(URLContext *h, void *dest, int size)
     }
 
     pthread_cond_signal(&c->cond_wakeup_background);
+    pthread_cond_signal(&c->cond_wakeup_prefetch);
     pthread_mutex_unlock(&c->mutex);
 
     return ret;
@@ -461,6 +778,7 @@ static int64_t async_seek(URLContext *h, int64_t pos, int whence)
             if (c->seek_ret >= 0)
                 c->logical_pos  = c->seek_ret;
             ret = c->seek_ret;
+            pthread_cond_signal(&c->cond_wakeup_prefetch);
             break;
         }
         pthread_cond_signal(&c->cond_wakeup_background);
@@ -476,6 +794,8 @@ static int64_t async_seek(URLContext *h, int64_t pos, int whence)
 #define D AV_OPT_FLAG_DECODING_PARAM
 
 static const AVOption options[] = {
+    { "gop_index", "IDR access unit index of the input, as written by tools/evc_index", OFFSET(gop_index), AV_OPT_TYPE_STRING, { .str = NULL }, 0, 0, D },
+    { "gop_cache", "number of GOPs to prefetch ahead of the buffered data", OFFSET(gop_cache), AV_OPT_TYPE_INT, { .i64 = 4 }, 0, 64, D },
     {NULL},
 };
 
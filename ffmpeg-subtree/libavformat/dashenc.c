@@ -44,6 +44,7 @@
 #include "avc.h"
 #include "avformat.h"
 #include "avio_internal.h"
+#include "evc.h"
 #include "hlsplaylist.h"
 #if CONFIG_HTTP_PROTOCOL
 #include "http.h"
@@ -429,6 +430,10 @@ static void set_codec_str(AVFormatContext *s, AVCodecParameters *par,
             av_strlcatf(str, size, ".%02x%02x%02x",
                         extradata[1], extradata[2], extradata[3]);
         av_free(tmpbuf);
+    } else if (!strcmp(str, "evc1")) {
+        if (par->extradata_size &&
+            ff_evc_get_codec_string(str, size, par->extradata, par->extradata_size) < 0)
+            av_log(s, AV_LOG_WARNING, "Could not find EVC profile and/or level\n");
     } else if (!strcmp(str, "av01")) {
         AV1SequenceParameters seq;
         if (!par->extradata_size)
@@ -753,7 +753,8 @@ static int64_t select_from_pts_buffer(AVStream *st, int64_t *pts_buffer, int64_t
 {
     FFStream *const sti = ffstream(st);
     int onein_oneout = st->codecpar->codec_id != AV_CODEC_ID_H264 &&
-                       st->codecpar->codec_id != AV_CODEC_ID_HEVC;
+                       st->codecpar->codec_id != AV_CODEC_ID_HEVC &&
+                       st->codecpar->codec_id != AV_CODEC_ID_EVC;
 
     if (!onein_oneout) {
         int delay = sti->avctx->has_b_frames;
@@ -943,7 +944,8 @@ static void compute_pkt_fields(AVFormatContext *s, AVStream *st,
     int64_t offset;
     AVRational duration;
     int onein_oneout = st->codecpar->codec_id != AV_CODEC_ID_H264 &&
-                       st->codecpar->codec_id != AV_CODEC_ID_HEVC;
+                       st->codecpar->codec_id != AV_CODEC_ID_HEVC &&
+                       st->codecpar->codec_id != AV_CODEC_ID_EVC;
 
     if (s->flags & AVFMT_FLAG_NOFILLIN)
         return;
@@ -1208,6 +1210,9 @@ static int parse_packet(AVFormatContext *s, AVPacket *pkt,
         out_pkt->dts          = sti->parser->dts;
         out_pkt->pos          = sti->parser->pos;
         out_pkt->flags       |= pkt->flags & (AV_PKT_FLAG_DISCARD | AV_PKT_FLAG_CORRUPT);
+        // with complete frames, the output packet is the input packet
+        if (sti->parser->flags & PARSER_FLAG_COMPLETE_FRAMES)
+            out_pkt->flags   |= pkt->flags & AV_PKT_FLAG_DISPOSABLE;
 
         if (sti->need_parsing == AVSTREAM_PARSE_FULL_RAW)
             out_pkt->pos = sti->parser->frame_offset;
@@ -19,7 +19,9 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
  */
 
+#include "libavutil/avassert.h"
 #include "libavutil/intreadwrite.h"
+#include "libavcodec/bytestream.h"
 #include "libavcodec/get_bits.h"
 #include "libavcodec/golomb.h"
 #include "libavcodec/evc.h"
@@ -76,8 +78,6 @@ typedef struct EVCNALUnitArray {
     uint8_t  array_completeness; // when equal to 1 indicates that all NAL units of the given type are in the following array
     uint8_t  NAL_unit_type;      // indicates the type of the NAL units in the following array
     uint16_t numNalus;           // indicates the number of NAL units of the indicated type
-    uint16_t *nalUnitLength;     // indicates the length in bytes of the NAL unit
-    uint8_t  **nalUnit;          // contains an SPS, PPS, APS or a SEI NAL unit, as specified in ISO/IEC 23094-1
 } EVCNALUnitArray;
 
 /**
@@ -117,15 +117,16 @@ typedef struct NALUList {
 static int evcc_parse_sps(const uint8_t *bs, int bs_size, EVCDecoderConfigurationRecord *evcc)
 {
     GetBitContext gb;
-    int sps_seq_parameter_set_id;
     EVCSPS sps;
 
-    if (init_get_bits8(&gb, bs, bs_size) < 0)
+    // skip the NAL unit header
+    if (bs_size <= EVC_NALU_HEADER_SIZE ||
+        init_get_bits8(&gb, bs + EVC_NALU_HEADER_SIZE, bs_size - EVC_NALU_HEADER_SIZE) < 0)
         return 0;
 
     sps.sps_seq_parameter_set_id = get_ue_golomb(&gb);
 
-    if (sps_seq_parameter_set_id >= EVC_MAX_SPS_COUNT)
+    if (sps.sps_seq_parameter_set_id >= EVC_MAX_SPS_COUNT)
         return 0;
 
     // the Baseline profile is indicated by profile_idc eqal to 0
@@ -162,36 +163,24 @@ static int evcc_parse_sps(const uint8_t *bs, int bs_size, EVCDecoderConfiguratio
     return 0;
 }
 
-// @see ISO/IEC 14496-15:2021 Coding of audio-visual objects - Part 15: section 12.3.3.3
-static int evcc_array_add_nal_unit(const uint8_t *nal_buf, uint32_t nal_size,
-                                   uint8_t nal_type, int ps_array_completeness,
-                                   EVCNALUnitArray *array)
+static int evcc_array_index(int nalu_type)
 {
-    int ret;
-    uint16_t numNalus = array->numNalus;
-
-    ret = av_reallocp_array(&array->nalUnit, numNalus + 1, sizeof(uint8_t *));
-    if (ret < 0)
-        return ret;
-
-    ret = av_reallocp_array(&array->nalUnitLength, numNalus + 1, sizeof(uint16_t));
-    if (ret < 0)
-        return ret;
-
-    array->nalUnit      [numNalus] = (uint8_t *)nal_buf;
-    array->nalUnitLength[numNalus] = nal_size;
-    array->NAL_unit_type           = nal_type;
-    array->numNalus++;
-
-    /*
-     * When the sample entry name is 'evc1', the default and mandatory value of
-     * array_completeness is 1 for arrays of all types of parameter sets, and 0
-     * for all other arrays.
-     */
-    if (nal_type == EVC_SPS_NUT || nal_type == EVC_PPS_NUT || nal_type == EVC_APS_NUT)
-        array->array_completeness = ps_array_completeness;
-
-    return 0;
+    // @see ISO/IEC 14496-15:2021 Coding of audio-visual objects - Part 15: section 12.3.3.3
+    // NAL_unit_type indicates the type of the NAL units in the following array (which shall be all of that type);
+    // - it takes a value as defined in ISO/IEC 23094-1;
+    // - it is restricted to take one of the values indicating a SPS, PPS, APS, or SEI NAL unit.
+    switch (nalu_type) {
+    case EVC_SPS_NUT:
+        return SPS_INDEX;
+    case EVC_PPS_NUT:
+        return PPS_INDEX;
+    case EVC_APS_NUT:
+        return APS_INDEX;
+    case EVC_SEI_NUT:
+        return SEI_INDEX;
+    default:
+        return -1;
+    }
 }
 
 static void evcc_init(EVCDecoderConfigurationRecord *evcc)
@@ -201,20 +190,75 @@ static void evcc_init(EVCDecoderConfigurationRecord *evcc)
     evcc->lengthSizeMinusOne   = 3; // 4 bytes
 }
 
-static void evcc_close(EVCDecoderConfigurationRecord *evcc)
+/**
+ * First pass: count the NAL units of every array and read the SPS fields.
+ *
+ * @return the size in bytes of the evcC record, a negative error code on failure
+ */
+static int evcc_scan(EVCDecoderConfigurationRecord *evcc, const uint8_t *data,
+                     int size, int ps_array_completeness)
 {
-    for (unsigned i = 0; i < FF_ARRAY_ELEMS(evcc->arrays); i++) {
-        EVCNALUnitArray *const array = &evcc->arrays[i];
-        array->numNalus = 0;
-        av_freep(&array->nalUnit);
-        av_freep(&array->nalUnitLength);
+    const uint8_t *end = data + size;
+    int evcc_size = 18;
+    int sps_count;
+
+    evcc_init(evcc);
+
+    while (end - data > EVC_NALU_LENGTH_PREFIX_SIZE) {
+        uint32_t nalu_size = ff_evc_nal_unit_length(data, end - data);
+        int nalu_type, array_index;
+
+        data += EVC_NALU_LENGTH_PREFIX_SIZE;
+        if (!nalu_size || nalu_size > end - data)
+            break;
+
+        nalu_type   = ff_evc_nal_unit_type(data, nalu_size);
+        array_index = evcc_array_index(nalu_type);
+        if (array_index >= 0) {
+            EVCNALUnitArray *const array = &evcc->arrays[array_index];
+
+            // unsigned int(16) numNalus and nalUnitLength
+            if (nalu_size > UINT16_MAX || array->numNalus == UINT16_MAX)
+                return AVERROR_INVALIDDATA;
+
+            if (!array->numNalus++) {
+                array->NAL_unit_type = nalu_type;
+                /*
+                 * When the sample entry name is 'evc1', the default and mandatory value of
+                 * array_completeness is 1 for arrays of all types of parameter sets, and 0
+                 * for all other arrays.
+                 */
+                if (array_index != SEI_INDEX)
+                    array->array_completeness = ps_array_completeness;
+                evcc->num_of_arrays++;
+                evcc_size += 3;
+            }
+            evcc_size += 2 + nalu_size;
+
+            if (nalu_type == EVC_SPS_NUT)
+                evcc_parse_sps(data, nalu_size, evcc);
+        }
+
+        data += nalu_size;
     }
+
+    /*
+     * We need at least one SPS.
+     */
+    sps_count = evcc->arrays[SPS_INDEX].numNalus;
+    if (!sps_count || sps_count > EVC_MAX_SPS_COUNT)
+        return AVERROR_INVALIDDATA;
+
+    return evcc_size;
 }
 
-static int evcc_write(AVIOContext *pb, EVCDecoderConfigurationRecord *evcc)
+/**
+ * Second pass: write the record, copying the NAL units of each array
+ * straight from the input.
+ */
+static void evcc_write(PutByteContext *pb, const EVCDecoderConfigurationRecord *evcc,
+                       const uint8_t *data, int size)
 {
-    uint16_t sps_count;
-
     av_log(NULL, AV_LOG_TRACE,  "configurationVersion:                %"PRIu8"\n",
            evcc->configurationVersion);
     av_log(NULL, AV_LOG_TRACE,  "profile_idc:                         %"PRIu8"\n",
@@ -239,184 +283,363 @@ static int evcc_write(AVIOContext *pb, EVCDecoderConfigurationRecord *evcc)
            evcc->lengthSizeMinusOne);
     av_log(NULL, AV_LOG_TRACE,  "num_of_arrays:                       %"PRIu8"\n",
            evcc->num_of_arrays);
-    for (unsigned i = 0; i < FF_ARRAY_ELEMS(evcc->arrays); i++) {
-        const EVCNALUnitArray *const array = &evcc->arrays[i];
-
-        if(array->numNalus == 0)
-            continue;
-
-        av_log(NULL, AV_LOG_TRACE, "array_completeness[%"PRIu8"]:               %"PRIu8"\n",
-               i, array->array_completeness);
-        av_log(NULL, AV_LOG_TRACE, "NAL_unit_type[%"PRIu8"]:                    %"PRIu8"\n",
-               i, array->NAL_unit_type);
-        av_log(NULL, AV_LOG_TRACE, "numNalus[%"PRIu8"]:                         %"PRIu16"\n",
-               i, array->numNalus);
-        for ( unsigned j = 0; j < array->numNalus; j++)
-            av_log(NULL, AV_LOG_TRACE,
-                   "nalUnitLength[%"PRIu8"][%"PRIu16"]:                 %"PRIu16"\n",
-                   i, j, array->nalUnitLength[j]);
-    }
-
-    /*
-     * We need at least one SPS.
-     */
-    sps_count = evcc->arrays[SPS_INDEX].numNalus;
-    if (!sps_count || sps_count > EVC_MAX_SPS_COUNT)
-        return AVERROR_INVALIDDATA;
-
-    if (!sps_count || sps_count > EVC_MAX_SPS_COUNT)
-        return AVERROR_INVALIDDATA;
 
     /* unsigned int(8) configurationVersion = 1; */
-    avio_w8(pb, evcc->configurationVersion);
+    bytestream2_put_byte(pb, evcc->configurationVersion);
 
     /* unsigned int(8) profile_idc */
-    avio_w8(pb, evcc->profile_idc);
+    bytestream2_put_byte(pb, evcc->profile_idc);
 
     /* unsigned int(8) profile_idc */
-    avio_w8(pb, evcc->level_idc);
+    bytestream2_put_byte(pb, evcc->level_idc);
 
     /* unsigned int(32) toolset_idc_h */
-    avio_wb32(pb, evcc->toolset_idc_h);
+    bytestream2_put_be32(pb, evcc->toolset_idc_h);
 
     /* unsigned int(32) toolset_idc_l */
-    avio_wb32(pb, evcc->toolset_idc_l);
+    bytestream2_put_be32(pb, evcc->toolset_idc_l);
 
     /*
      * unsigned int(2) chroma_format_idc;
      * unsigned int(3) bit_depth_luma_minus8;
      * unsigned int(3) bit_depth_chroma_minus8;
      */
-    avio_w8(pb, evcc->chroma_format_idc << 6 |
-            evcc->bit_depth_luma_minus8  << 3 |
-            evcc->bit_depth_chroma_minus8);
+    bytestream2_put_byte(pb, evcc->chroma_format_idc << 6 |
+                         evcc->bit_depth_luma_minus8  << 3 |
+                         evcc->bit_depth_chroma_minus8);
 
     /* unsigned int(16) pic_width_in_luma_samples; */
-    avio_wb16(pb, evcc->pic_width_in_luma_samples);
+    bytestream2_put_be16(pb, evcc->pic_width_in_luma_samples);
 
     /* unsigned int(16) pic_width_in_luma_samples; */
-    avio_wb16(pb, evcc->pic_height_in_luma_samples);
+    bytestream2_put_be16(pb, evcc->pic_height_in_luma_samples);
 
     /*
      * bit(6) reserved = '111111'b;
      * unsigned int(2) chromaFormat;
      */
-    avio_w8(pb, evcc->lengthSizeMinusOne | 0xfc);
+    bytestream2_put_byte(pb, evcc->lengthSizeMinusOne | 0xfc);
 
     /* unsigned int(8) numOfArrays; */
-    avio_w8(pb, evcc->num_of_arrays);
+    bytestream2_put_byte(pb, evcc->num_of_arrays);
 
     for (unsigned i = 0; i < FF_ARRAY_ELEMS(evcc->arrays); i++) {
         const EVCNALUnitArray *const array = &evcc->arrays[i];
+        const uint8_t *ptr = data, *end = data + size;
 
         if (!array->numNalus)
             continue;
 
+        av_log(NULL, AV_LOG_TRACE, "array_completeness[%u]:               %"PRIu8"\n",
+               i, array->array_completeness);
+        av_log(NULL, AV_LOG_TRACE, "NAL_unit_type[%u]:                    %"PRIu8"\n",
+               i, array->NAL_unit_type);
+        av_log(NULL, AV_LOG_TRACE, "numNalus[%u]:                         %"PRIu16"\n",
+               i, array->numNalus);
+
         /*
          * bit(1) array_completeness;
          * unsigned int(1) reserved = 0;
          * unsigned int(6) NAL_unit_type;
          */
-        avio_w8(pb, array->array_completeness << 7 |
-                array->NAL_unit_type & 0x3f);
+        bytestream2_put_byte(pb, array->array_completeness << 7 |
+                             array->NAL_unit_type & 0x3f);
 
         /* unsigned int(16) numNalus; */
-        avio_wb16(pb, array->numNalus);
+        bytestream2_put_be16(pb, array->numNalus);
+
+        // the input was validated by evcc_scan()
+        while (end - ptr > EVC_NALU_LENGTH_PREFIX_SIZE) {
+            uint32_t nalu_size = ff_evc_nal_unit_length(ptr, end - ptr);
+
+            ptr += EVC_NALU_LENGTH_PREFIX_SIZE;
+            if (!nalu_size || nalu_size > end - ptr)
+                break;
 
-        for (unsigned j = 0; j < array->numNalus; j++) {
-            /* unsigned int(16) nalUnitLength; */
-            avio_wb16(pb, array->nalUnitLength[j]);
+            if (evcc_array_index(ff_evc_nal_unit_type(ptr, nalu_size)) == i) {
+                /* unsigned int(16) nalUnitLength; */
+                bytestream2_put_be16(pb, nalu_size);
 
-            /* bit(8*nalUnitLength) nalUnit; */
-            avio_write(pb, array->nalUnit[j],
-                       array->nalUnitLength[j]);
+                /* bit(8*nalUnitLength) nalUnit; */
+                bytestream2_put_buffer(pb, ptr, nalu_size);
+            }
+            ptr += nalu_size;
         }
     }
-
-    return 0;
 }
 
-int ff_isom_write_evcc(AVIOContext *pb, const uint8_t *data,
-                       int size, int ps_array_completeness)
+int ff_evc_build_evcc(uint8_t **out, int *out_size, const uint8_t *data,
+                      int size, int ps_array_completeness)
 {
     EVCDecoderConfigurationRecord evcc;
-    int nalu_type;
-    size_t nalu_size;
-    int bytes_to_read = size;
-    unsigned array_index;
+    PutByteContext pb;
+    uint8_t *buf;
+    int evcc_size;
 
-    int ret = 0;
+    *out      = NULL;
+    *out_size = 0;
 
     if (size < 8) {
         /* We can't write a valid evcC from the provided data */
         return AVERROR_INVALIDDATA;
     } else if (*data == 1) {
         /* Data is already evcC-formatted */
-        avio_write(pb, data, size);
+        evcc_size = size;
+        buf = av_malloc(evcc_size + AV_INPUT_BUFFER_PADDING_SIZE);
+        if (!buf)
+            return AVERROR(ENOMEM);
+        memcpy(buf, data, size);
+    } else {
+        evcc_size = evcc_scan(&evcc, data, size, ps_array_completeness);
+        if (evcc_size < 0)
+            return evcc_size;
+
+        buf = av_malloc(evcc_size + AV_INPUT_BUFFER_PADDING_SIZE);
+        if (!buf)
+            return AVERROR(ENOMEM);
+        bytestream2_init_writer(&pb, buf, evcc_size);
+        evcc_write(&pb, &evcc, data, size);
+        av_assert1(bytestream2_tell_p(&pb) == evcc_size);
+    }
+    memset(buf + evcc_size, 0, AV_INPUT_BUFFER_PADDING_SIZE);
+
+    *out      = buf;
+    *out_size = evcc_size;
+    return 0;
+}
+
+int ff_isom_write_evcc(AVIOContext *pb, const uint8_t *data,
+                       int size, int ps_array_completeness)
+{
+    uint8_t *evcc;
+    int evcc_size, ret;
+
+    ret = ff_evc_build_evcc(&evcc, &evcc_size, data, size, ps_array_completeness);
+    if (ret < 0)
+        return ret;
+
+    avio_write(pb, evcc, evcc_size);
+    av_free(evcc);
+
+    return 0;
+}
+
+int ff_evc_get_codec_string(char *str, int size,
+                            const uint8_t *extradata, int extradata_size)
+{
+    uint8_t *evcc;
+    int evcc_size, ret;
+
+    ret = ff_evc_build_evcc(&evcc, &evcc_size, extradata, extradata_size, 0);
+    if (ret < 0)
+        return ret;
+
+    // profile_idc, level_idc, toolset_idc_h and bit_depth_luma_minus8
+    if (evcc_size < 12) {
+        ret = AVERROR_INVALIDDATA;
+        goto end;
+    }
+    snprintf(str, size, "evc1.vprf%d.vlev%d.vtoo%08"PRIx32".vbit%d",
+             evcc[1], evcc[2], AV_RB32(evcc + 3), ((evcc[11] >> 3) & 0x07) + 8);
+
+end:
+    av_free(evcc);
+    return ret;
+}
+
+static int evc_param_sets_add(FFEVCParamSets *ps, const uint8_t *nalu, int nalu_size)
+{
+    FFEVCParamSet *set;
+    GetBitContext gb;
+    int nalu_type, id, ret;
+
+    nalu_type = ff_evc_nal_unit_type(nalu, nalu_size);
+    if (nalu_type != EVC_SPS_NUT && nalu_type != EVC_PPS_NUT && nalu_type != EVC_APS_NUT)
         return 0;
+
+    ret = init_get_bits8(&gb, nalu + EVC_NALU_HEADER_SIZE, nalu_size - EVC_NALU_HEADER_SIZE);
+    if (ret < 0)
+        return ret;
+
+    switch (nalu_type) {
+    case EVC_SPS_NUT:
+        id = get_ue_golomb_long(&gb);
+        if (id >= EVC_MAX_SPS_COUNT)
+            return AVERROR_INVALIDDATA;
+        set = &ps->sps[id];
+        break;
+    case EVC_PPS_NUT:
+        id = get_ue_golomb_long(&gb);
+        if (id >= EVC_MAX_PPS_COUNT)
+            return AVERROR_INVALIDDATA;
+        set = &ps->pps[id];
+        break;
+    default: {
+        // aps_adaptation_parameter_set_id u(5), aps_params_type u(3)
+        int type;
+
+        id   = get_bits(&gb, 5);
+        type = get_bits(&gb, 3);
+        if (type >= FF_ARRAY_ELEMS(ps->aps))
+            return 0;
+        set = &ps->aps[type][id];
+        break;
+    }
     }
 
-    evcc_init(&evcc);
+    if (set->size != nalu_size) {
+        ret = av_reallocp(&set->data, nalu_size);
+        if (ret < 0) {
+            set->size = 0;
+            return ret;
+        }
+    }
+    memcpy(set->data, nalu, nalu_size);
+    set->size = nalu_size;
+
+    return 0;
+}
+
+int ff_evc_param_sets_update(FFEVCParamSets *ps, const uint8_t *data, int size)
+{
+    int ret;
+
+    if (size > 0 && *data == 1) {
+        GetByteContext gb;
+        int num_arrays;
+
+        // skip the evcC fields up to numOfArrays
+        bytestream2_init(&gb, data, size);
+        bytestream2_skip(&gb, 17);
+        num_arrays = bytestream2_get_byte(&gb);
+        for (int i = 0; i < num_arrays; i++) {
+            int num_nalus;
+
+            bytestream2_skip(&gb, 1);
+            num_nalus = bytestream2_get_be16(&gb);
+            for (int j = 0; j < num_nalus; j++) {
+                int nalu_size = bytestream2_get_be16(&gb);
+
+                if (bytestream2_get_bytes_left(&gb) < nalu_size)
+                    return AVERROR_INVALIDDATA;
+                ret = evc_param_sets_add(ps, gb.buffer, nalu_size);
+                if (ret < 0)
+                    return ret;
+                bytestream2_skip(&gb, nalu_size);
+            }
+        }
+        return 0;
+    }
 
-    while (bytes_to_read > EVC_NALU_LENGTH_PREFIX_SIZE) {
-        nalu_size = av_evc_read_nal_unit_length(data, EVC_NALU_LENGTH_PREFIX_SIZE, pb);
-        if (nalu_size == 0) break;
+    while (size > EVC_NALU_LENGTH_PREFIX_SIZE) {
+        uint32_t nalu_size = ff_evc_nal_unit_length(data, size);
 
         data += EVC_NALU_LENGTH_PREFIX_SIZE;
-        bytes_to_read -= EVC_NALU_LENGTH_PREFIX_SIZE;
+        size -= EVC_NALU_LENGTH_PREFIX_SIZE;
+        if (nalu_size > size)
+            return AVERROR_INVALIDDATA;
 
-        if (bytes_to_read < nalu_size) break;
+        ret = evc_param_sets_add(ps, data, nalu_size);
+        if (ret < 0)
+            return ret;
+        data += nalu_size;
+        size -= nalu_size;
+    }
 
-        nalu_type = av_evc_get_nalu_type(data, bytes_to_read, pb);
+    return 0;
+}
 
-        // @see ISO/IEC 14496-15:2021 Coding of audio-visual objects - Part 15: section 12.3.3.3
-        // NAL_unit_type indicates the type of the NAL units in the following array (which shall be all of that type);
-        // - it takes a value as defined in ISO/IEC 23094-1;
-        // - it is restricted to take one of the values indicating a SPS, PPS, APS, or SEI NAL unit.
-        switch (nalu_type) {
-        case EVC_SPS_NUT:
-            array_index = SPS_INDEX;
-            break;
-        case EVC_PPS_NUT:
-            array_index = PPS_INDEX;
-            break;
-        case EVC_APS_NUT:
-            array_index = APS_INDEX;
-            break;
-        case EVC_SEI_NUT:
-            array_index = SEI_INDEX;
-            break;
-        default:
-            array_index = -1;
-            break;
+static int evc_param_sets_write_array(const FFEVCParamSet *sets, int nb_sets, uint8_t *dst)
+{
+    int size = 0;
+
+    for (int i = 0; i < nb_sets; i++) {
+        if (!sets[i].size)
+            continue;
+        if (dst) {
+            AV_WB32(dst + size, sets[i].size);
+            memcpy(dst + size + EVC_NALU_LENGTH_PREFIX_SIZE, sets[i].data, sets[i].size);
         }
+        size += EVC_NALU_LENGTH_PREFIX_SIZE + sets[i].size;
+    }
+
+    return size;
+}
 
-        if( (array_index == SPS_INDEX) ||
-            (array_index == PPS_INDEX) ||
-            (array_index == APS_INDEX) ||
-            (array_index == SEI_INDEX) ) {
+int ff_evc_param_sets_write(const FFEVCParamSets *ps, uint8_t *dst)
+{
+    int size = 0;
 
-            ret = evcc_array_add_nal_unit(data, nalu_size, nalu_type, ps_array_completeness, &(evcc.arrays[array_index]));
+    size += evc_param_sets_write_array(ps->sps, EVC_MAX_SPS_COUNT, dst);
+    size += evc_param_sets_write_array(ps->pps, EVC_MAX_PPS_COUNT, dst ? dst + size : NULL);
+    for (int i = 0; i < FF_ARRAY_ELEMS(ps->aps); i++)
+        size += evc_param_sets_write_array(ps->aps[i], EVC_MAX_APS_COUNT, dst ? dst + size : NULL);
 
-            if (ret < 0)
-                goto end;
-            if (evcc.arrays[array_index].numNalus == 1)
-                evcc.num_of_arrays++;
+    return size;
+}
 
-            if(nalu_type == EVC_SPS_NUT) {
-                ret = evcc_parse_sps(data, nalu_size, &evcc);
-                if (ret < 0)
-                    goto end;
+void ff_evc_param_sets_uninit(FFEVCParamSets *ps)
+{
+    for (int i = 0; i < EVC_MAX_SPS_COUNT; i++)
+        av_freep(&ps->sps[i].data);
+    for (int i = 0; i < EVC_MAX_PPS_COUNT; i++)
+        av_freep(&ps->pps[i].data);
+    for (int i = 0; i < FF_ARRAY_ELEMS(ps->aps); i++)
+        for (int j = 0; j < EVC_MAX_APS_COUNT; j++)
+            av_freep(&ps->aps[i][j].data);
+    memset(ps, 0, sizeof(*ps));
+}
+
+int ff_evc_write_nal_units(AVIOContext *pb, const uint8_t *data, int size,
+                           int src_length_size, int dst_length_size)
+{
+    int64_t out_size = 0;
+
+    for (int pass = 0; pass < 2; pass++) {
+        const uint8_t *ptr = data, *end = data + size;
+
+        while (end - ptr > 0) {
+            uint32_t nalu_size = ff_evc_nal_unit_length_n(ptr, end - ptr, src_length_size);
+
+            ptr += src_length_size;
+            if (nalu_size > end - ptr)
+                return AVERROR_INVALIDDATA;
+
+            if (pass) {
+                switch (dst_length_size) {
+                case 1:  avio_w8(pb, nalu_size);   break;
+                case 2:  avio_wb16(pb, nalu_size); break;
+                default: avio_wb32(pb, nalu_size); break;
+                }
+                avio_write(pb, ptr, nalu_size);
+            } else {
+                if (dst_length_size < 4 && nalu_size >> (8 * dst_length_size))
+                    return AVERROR(ERANGE);
+                out_size += dst_length_size + nalu_size;
             }
+            ptr += nalu_size;
         }
+        if (out_size > INT_MAX)
+            return AVERROR(ERANGE);
+    }
 
+    return out_size;
+}
+
+int ff_evc_has_nal_unit(const uint8_t *data, int size, int nalu_type)
+{
+    while (size > EVC_NALU_LENGTH_PREFIX_SIZE) {
+        uint32_t nalu_size = ff_evc_nal_unit_length(data, size);
+
+        data += EVC_NALU_LENGTH_PREFIX_SIZE;
+        size -= EVC_NALU_LENGTH_PREFIX_SIZE;
+        if (nalu_size > size)
+            break;
+        if (ff_evc_nal_unit_type(data, nalu_size) == nalu_type)
+            return 1;
         data += nalu_size;
-        bytes_to_read -= nalu_size;
+        size -= nalu_size;
     }
 
-    ret = evcc_write(pb, &evcc);
-
-end:
-    evcc_close(&evcc);
-    return ret;
+    return 0;
 }
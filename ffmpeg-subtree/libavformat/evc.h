@@ -24,6 +24,7 @@
 
 #include <stdint.h>
 #include "libavutil/rational.h"
+#include "libavcodec/evc.h"
 #include "avio.h"
 
 
@@ -41,4 +42,91 @@
 int ff_isom_write_evcc(AVIOContext *pb, const uint8_t *data,
                        int size, int ps_array_completeness);
 
+/**
+ * Build an EVCDecoderConfigurationRecord (evcC) in a newly allocated buffer.
+ *
+ * The NAL units are counted in a first pass and copied straight from data
+ * into a buffer of the exact size in a second one.
+ *
+ * @param out set to the padded evcC buffer, to be freed with av_free()
+ * @param out_size set to the size in bytes of the evcC
+ * @param data either an evcC, which is copied, or length prefixed NAL units
+ * @param size size in bytes of data
+ * @param ps_array_completeness @see ff_isom_write_evcc()
+ *
+ * @return 0 in case of success, a negative error code in case of failure
+ */
+int ff_evc_build_evcc(uint8_t **out, int *out_size, const uint8_t *data,
+                      int size, int ps_array_completeness);
+
+/**
+ * Write the RFC 6381 codecs parameter of an EVC stream, built from the fields
+ * of its EVCDecoderConfigurationRecord.
+ *
+ * @param str buffer the codec string is written to, left untouched on failure
+ * @param size size in bytes of str
+ * @param extradata either an evcC or length prefixed parameter sets
+ * @param extradata_size size in bytes of extradata
+ *
+ * @return 0 in case of success, a negative error code in case of failure
+ */
+int ff_evc_get_codec_string(char *str, int size,
+                            const uint8_t *extradata, int extradata_size);
+
+typedef struct FFEVCParamSet {
+    uint8_t *data;              ///< the NAL unit, without length prefix
+    int size;                   ///< 0 if no parameter set was seen for this id
+} FFEVCParamSet;
+
+/**
+ * The last SPS, PPS and APS seen for each id, so that they can be repeated
+ * in front of pictures which do not carry them in band.
+ */
+typedef struct FFEVCParamSets {
+    FFEVCParamSet sps[EVC_MAX_SPS_COUNT];
+    FFEVCParamSet pps[EVC_MAX_PPS_COUNT];
+    FFEVCParamSet aps[2][EVC_MAX_APS_COUNT]; ///< indexed by aps_params_type, then id
+} FFEVCParamSets;
+
+/**
+ * Store the parameter sets found in data, replacing the ones with the same id.
+ *
+ * @param data either an evcC or length prefixed NAL units
+ *
+ * @return 0 in case of success, a negative error code in case of failure
+ */
+int ff_evc_param_sets_update(FFEVCParamSets *ps, const uint8_t *data, int size);
+
+/**
+ * Write all stored parameter sets as length prefixed NAL units, SPS first.
+ *
+ * @param dst buffer to write to, or NULL to only compute the size
+ *
+ * @return the number of bytes that are (or would be) written
+ */
+int ff_evc_param_sets_write(const FFEVCParamSets *ps, uint8_t *dst);
+
+void ff_evc_param_sets_uninit(FFEVCParamSets *ps);
+
+/**
+ * Check length prefixed NAL units for a NAL unit of the given type.
+ *
+ * @return 1 if data contains a NAL unit of type nalu_type, 0 otherwise
+ */
+int ff_evc_has_nal_unit(const uint8_t *data, int size, int nalu_type);
+
+/**
+ * Write length prefixed NAL units with length prefixes of another size.
+ *
+ * Nothing is written if a NAL unit is truncated or too large for the new
+ * length prefixes.
+ *
+ * @param src_length_size size in bytes of the length prefixes of data: 1, 2 or 4
+ * @param dst_length_size size in bytes of the length prefixes written: 1, 2 or 4
+ *
+ * @return the number of bytes written, a negative error code on failure
+ */
+int ff_evc_write_nal_units(AVIOContext *pb, const uint8_t *data, int size,
+                           int src_length_size, int dst_length_size);
+
 #endif // AVFORMAT_EVC_H
@@ -26,8 +26,19 @@
 #include "libavcodec/evc.h"
 #include "libavcodec/bsf.h"
 
+#include "libavutil/avstring.h"
+#include "libavutil/file.h"
 #include "libavutil/opt.h"
+#include "libavutil/trace.h"
 
+#include "config.h"
+#if HAVE_POSIX_MADVISE
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#include "avio_internal.h"
+#include "demux.h"
 #include "rawdec.h"
 #include "avformat.h"
 #include "internal.h"
@@ -35,11 +46,15 @@
 
 #define RAW_PACKET_SIZE 1024
 
+// amount of the mapped file the kernel is asked to read ahead of the next NAL unit
+#define MMAP_READ_AHEAD (8 << 20)
+
 typedef struct EVCParserContext {
     int got_sps;
     int got_pps;
     int got_idr;
     int got_nonidr;
+    int nb_nalus;   // number of complete NAL units with a valid header
 
 } EVCParserContext;
 
@@ -49,89 +64,108 @@ typedef struct EVCDemuxContext {
 
     AVBSFContext *bsf;
 
+    // IDR index built by scanning the NAL unit headers when seeking
+    int64_t scan_pos;       // position of the first NAL unit not scanned yet
+    int64_t scan_pictures;  // number of pictures before scan_pos
+    int64_t scan_au_pos;    // position of the first NAL unit of the next access unit
+    int scan_prev_vcl;      // the last NAL unit scanned is a slice
+    int scan_done;          // the whole file has been scanned
+    char *index_file;       // sidecar IDR index written by tools/evc_index
+
+    int64_t ts_offset;      // timestamp of the access unit the bsf restarted from
+
+    // Memory-mapped input, the NAL unit packets reference the mapping instead of a copy
+    int use_mmap;
+    AVBufferRef *map_buf;   // the whole input file, NULL if not mapped
+    int64_t map_pos;        // position of the next NAL unit in map_buf
+    int64_t map_advised;    // end of the range the kernel was asked to read ahead
+    long page_size;
+
+    // NAL unit partially read from a non-blocking input, completed by the next calls
+    AVPacket *nal_pkt;      // allocated for the whole NAL unit once its length prefix is read
+    uint8_t nal_prefix[EVC_NALU_LENGTH_PREFIX_SIZE];
+    int nal_read;           // bytes of the NAL unit read so far, length prefix included
+    int64_t nal_pos;        // position of the NAL unit
+
+    int64_t packet_buffer_peak; // largest NAL unit buffer allocated so far, exported
 } EVCDemuxContext;
 
 #define DEC AV_OPT_FLAG_DECODING_PARAM
 #define OFFSET(x) offsetof(EVCDemuxContext, x)
 static const AVOption evc_options[] = {
     { "framerate", "", OFFSET(framerate), AV_OPT_TYPE_VIDEO_RATE, {.str = "25"}, 0, INT_MAX, DEC},
+    { "mmap", "Map local input files in memory and read NAL units without copying them",
+        OFFSET(use_mmap), AV_OPT_TYPE_BOOL, {.i64 = 0}, 0, 1, DEC},
+    { "index_file", "Load the IDR index of the input from this file instead of scanning the input when seeking",
+        OFFSET(index_file), AV_OPT_TYPE_STRING, {.str = NULL}, 0, 0, DEC},
+    { "packet_buffer_peak", "Largest NAL unit buffer allocated so far, zero-copy mapped NAL units excluded",
+        OFFSET(packet_buffer_peak), AV_OPT_TYPE_INT64, {.i64 = 0}, 0, INT64_MAX,
+        DEC | AV_OPT_FLAG_EXPORT | AV_OPT_FLAG_READONLY},
     { NULL },
 };
 #undef OFFSET
 
+// the evc_frame_merge filter exports the size of the access unit being merged
+static void *evc_child_next(void *obj, void *prev)
+{
+    EVCDemuxContext *c = obj;
+    return prev ? NULL : c->bsf;
+}
+
+static const AVClass *evc_child_class_iterate(void **iter)
+{
+    const AVClass *c = *iter ? NULL : av_bsf_get_class();
+    *iter = (void *)(uintptr_t)c;
+    return c;
+}
+
 static const AVClass evc_demuxer_class = {
     .class_name = "EVC Annex B demuxer",
     .item_name  = av_default_item_name,
     .option     = evc_options,
     .version    = LIBAVUTIL_VERSION_INT,
+    .child_next = evc_child_next,
+    .child_class_iterate = evc_child_class_iterate,
 };
 
-static int get_nalu_type(const uint8_t *bits, int bits_size)
-{
-    int unit_type_plus1 = 0;
-
-    if (bits_size >= EVC_NALU_HEADER_SIZE) {
-        unsigned char *p = (unsigned char *)bits;
-        // forbidden_zero_bit
-        if ((p[0] & 0x80) != 0)   // Cannot get bitstream information. Malformed bitstream.
-            return -1;
-
-        // nal_unit_type
-        unit_type_plus1 = (p[0] >> 1) & 0x3F;
-    }
-
-    return unit_type_plus1 - 1;
-}
-
-static uint32_t read_nal_unit_length(const uint8_t *bits, int bits_size)
-{
-    uint32_t nalu_len = 0;
-
-    if (bits_size >= EVC_NALU_LENGTH_PREFIX_SIZE) {
-
-        int t = 0;
-        unsigned char *p = (unsigned char *)bits;
-
-        for (int i = 0; i < EVC_NALU_LENGTH_PREFIX_SIZE; i++)
-            t = (t << 8) | p[i];
-
-        nalu_len = t;
-        if (nalu_len == 0)   // Invalid bitstream size
-            return 0;
-    }
-
-    return nalu_len;
-}
-
+/*
+ * Validate the NAL units of the probe buffer, stopping at the first IDR picture following
+ * an SPS and a PPS, in that order. Returns AVERROR_INVALIDDATA on a NAL unit with an
+ * impossible length or header.
+ */
 static int parse_nal_units(const AVProbeData *p, EVCParserContext *ev)
 {
-    int nalu_type;
-    size_t nalu_size;
-    unsigned char *bits = (unsigned char *)p->buf;
+    const uint8_t *bits = p->buf;
     int bytes_to_read = p->buf_size;
 
-    while (bytes_to_read > EVC_NALU_LENGTH_PREFIX_SIZE) {
-
-        nalu_size = read_nal_unit_length(bits, EVC_NALU_LENGTH_PREFIX_SIZE);
-        if (nalu_size == 0) break;
+    while (bytes_to_read >= EVC_NALU_LENGTH_PREFIX_SIZE + EVC_NALU_HEADER_SIZE) {
+        uint32_t nalu_size = ff_evc_nal_unit_length(bits, bytes_to_read);
+        const uint8_t *nalu = bits + EVC_NALU_LENGTH_PREFIX_SIZE;
+        int nalu_type;
 
-        bits += EVC_NALU_LENGTH_PREFIX_SIZE;
         bytes_to_read -= EVC_NALU_LENGTH_PREFIX_SIZE;
 
-        if(bytes_to_read < nalu_size) break;
+        // forbidden_zero_bit, nuh_reserved_zero_5bits and nuh_extension_flag are 0
+        nalu_type = ff_evc_nal_unit_type(nalu, bytes_to_read);
+        if (nalu_size < EVC_NALU_HEADER_SIZE || nalu_type < 0 || nalu[1] & 0x3F)
+            return AVERROR_INVALIDDATA;
 
-        nalu_type = get_nalu_type(bits, bytes_to_read);
+        // the NAL unit is cut by the end of the probe buffer
+        if (nalu_size > bytes_to_read)
+            break;
+        ev->nb_nalus++;
 
         if (nalu_type == EVC_SPS_NUT)
             ev->got_sps++;
-        else if (nalu_type == EVC_PPS_NUT)
+        else if (nalu_type == EVC_PPS_NUT && ev->got_sps)
             ev->got_pps++;
-        else if (nalu_type == EVC_IDR_NUT )
+        else if (nalu_type == EVC_IDR_NUT && ev->got_pps) {
             ev->got_idr++;
-        else if (nalu_type == EVC_NOIDR_NUT)
+            break;
+        } else if (nalu_type == EVC_NOIDR_NUT)
             ev->got_nonidr++;
 
-        bits += nalu_size;
+        bits += EVC_NALU_LENGTH_PREFIX_SIZE + nalu_size;
         bytes_to_read -= nalu_size;
     }
 
@@ -143,12 +177,148 @@ static int annexb_probe(const AVProbeData *p)
     EVCParserContext ev = {0};
     int ret = parse_nal_units(p, &ev);
 
-    if (ret == 0 && ev.got_sps && ev.got_pps && (ev.got_idr || ev.got_nonidr > 3))
-        return AVPROBE_SCORE_EXTENSION + 1;  // 1 more than .mpg
+    if (ret < 0)
+        return 0;
+
+    // more than .mpg, growing with the number of NAL units up to the first IDR picture
+    if (ev.got_idr)
+        return AVPROBE_SCORE_EXTENSION + FFMIN(ev.nb_nalus - 1, AVPROBE_SCORE_MAX / 10);
+    if (ev.got_sps && ev.got_pps && ev.got_nonidr > 3)
+        return AVPROBE_SCORE_EXTENSION + 1;
 
     return 0;
 }
 
+static void unmap_file(void *opaque, uint8_t *data)
+{
+    av_file_unmap(data, (uintptr_t)opaque);
+}
+
+static void advise_read_ahead(EVCDemuxContext *c, int64_t pos)
+{
+#if HAVE_POSIX_MADVISE
+    int64_t start = pos & ~(int64_t)(c->page_size - 1);
+    int64_t end   = FFMIN(pos + MMAP_READ_AHEAD, c->map_buf->size);
+
+    if (end > start)
+        posix_madvise(c->map_buf->data + start, end - start, POSIX_MADV_WILLNEED);
+    c->map_advised = end;
+#endif
+}
+
+/*
+ * Map the input file in memory when it is a local file, it falls back to reading it through
+ * the AVIOContext otherwise.
+ */
+static int map_input_file(AVFormatContext *s)
+{
+    EVCDemuxContext *const c = s->priv_data;
+    const char *path = s->url;
+    const char *proto = avio_find_protocol_name(s->url);
+    uint8_t *map;
+    size_t map_size;
+    int ret;
+
+    if (!proto || strcmp(proto, "file")) {
+        av_log(s, AV_LOG_WARNING, "Input is not a local file, mmap disabled\n");
+        return 0;
+    }
+    av_strstart(s->url, "file:", &path);
+
+    ret = av_file_map(path, &map, &map_size, 0, s);
+    if (ret < 0) {
+        av_log(s, AV_LOG_WARNING, "Cannot map the input file, mmap disabled\n");
+        return 0;
+    }
+    if (!map_size)
+        return 0;
+
+    c->map_buf = av_buffer_create(map, map_size, unmap_file, (void *)(uintptr_t)map_size,
+                                  AV_BUFFER_FLAG_READONLY);
+    if (!c->map_buf) {
+        av_file_unmap(map, map_size);
+        return AVERROR(ENOMEM);
+    }
+
+#if HAVE_POSIX_MADVISE
+    c->page_size = sysconf(_SC_PAGESIZE);
+    if (c->page_size <= 0)
+        c->page_size = 4096;
+    posix_madvise(map, map_size, POSIX_MADV_SEQUENTIAL);
+#endif
+    advise_read_ahead(c, 0);
+
+    return 0;
+}
+
+/*
+ * Load the IDR index written by tools/evc_index. The first line holds the format
+ * version, the size of the indexed file and its number of pictures, each following line
+ * the position of an IDR access unit and its picture number. The index replaces the
+ * scanning of the input only if it matches the input size.
+ */
+static int load_idr_index(AVFormatContext *s)
+{
+    EVCDemuxContext *const c = s->priv_data;
+    AVStream *st = s->streams[0];
+    AVIOContext *pb = NULL;
+    int64_t file_size = avio_size(s->pb), size, pictures, frame_duration;
+    int64_t pos, picture, prev_pos = -1, prev_picture = -1;
+    char line[128];
+    int version, ret;
+
+    if (file_size < 0 || c->framerate.num <= 0 || c->framerate.den <= 0)
+        return AVERROR(ENOSYS);
+    frame_duration = av_rescale_q(1, av_inv_q(c->framerate), st->time_base);
+    if (frame_duration <= 0)
+        return AVERROR(EINVAL);
+
+    ret = s->io_open(s, &pb, c->index_file, AVIO_FLAG_READ, NULL);
+    if (ret < 0)
+        return ret;
+
+    ff_get_line(pb, line, sizeof(line));
+    if (sscanf(line, "EVCIDX %d %"SCNd64" %"SCNd64, &version, &size, &pictures) != 3 ||
+        version != 1 || pictures < 0) {
+        ret = AVERROR_INVALIDDATA;
+        goto end;
+    }
+    if (size != file_size) {
+        av_log(s, AV_LOG_WARNING, "Index %s is of a file of %"PRId64" bytes, "
+               "not of the input\n", c->index_file, size);
+        ret = AVERROR_INVALIDDATA;
+        goto end;
+    }
+
+    while (ff_get_line(pb, line, sizeof(line)) > 0) {
+        if (sscanf(line, "%"SCNd64" %"SCNd64, &pos, &picture) != 2 ||
+            pos <= prev_pos || pos >= size || picture <= prev_picture || picture >= pictures) {
+            ret = AVERROR_INVALIDDATA;
+            goto end;
+        }
+        ret = av_add_index_entry(st, pos, picture * frame_duration, 0, 0, AVINDEX_KEYFRAME);
+        if (ret < 0)
+            goto end;
+        prev_pos     = pos;
+        prev_picture = picture;
+    }
+
+    c->scan_pos      = size;
+    c->scan_pictures = pictures;
+    c->scan_done     = 1;
+    av_log(s, AV_LOG_VERBOSE, "Loaded %d IDR access units from %s\n",
+           ffstream(st)->nb_index_entries, c->index_file);
+    ret = 0;
+
+end:
+    if (ret < 0) {
+        av_freep(&ffstream(st)->index_entries);
+        ffstream(st)->nb_index_entries = 0;
+    }
+    ff_format_io_close(s, &pb);
+    return ret;
+}
+
 static int evc_read_header(AVFormatContext *s)
 {
     AVStream *st;
@@ -184,79 +354,336 @@ static int evc_read_header(AVFormatContext *s)
     ret = avcodec_parameters_copy(c->bsf->par_in, st->codecpar);
     if (ret < 0)
         return ret;
+    // the bsf derives the timestamps from the POC, in the stream time base
+    c->bsf->time_base_in = st->time_base;
 
     ret = av_bsf_init(c->bsf);
     if (ret < 0)
         return ret;
 
+    c->nal_pkt = av_packet_alloc();
+    if (!c->nal_pkt)
+        return AVERROR(ENOMEM);
+
+    if (c->index_file && (s->pb->seekable & AVIO_SEEKABLE_NORMAL) &&
+        load_idr_index(s) < 0)
+        av_log(s, AV_LOG_WARNING, "Cannot load the index %s, the input will be "
+               "scanned when seeking\n", c->index_file);
+
+    if (c->use_mmap)
+        ret = map_input_file(s);
+
 fail:
     return ret;
 }
 
-static int evc_read_packet(AVFormatContext *s, AVPacket *pkt)
+/*
+ * Return the next NAL unit of the mapped file as a view into the mapping. The padding
+ * after the data is the following bytes of the file, only the NAL units too close to the
+ * end of the file for the padding to be readable are copied.
+ */
+static int read_nal_unit_mmap(AVFormatContext *s, AVPacket *pkt)
 {
-    int ret;
-    int32_t nalu_size;
-    int au_end_found;
+    EVCDemuxContext *const c = s->priv_data;
+    int64_t left = c->map_buf->size - c->map_pos;
+    uint32_t nalu_size;
+    int size, ret;
 
+    if (left < EVC_NALU_LENGTH_PREFIX_SIZE)
+        return AVERROR_EOF;
+
+    nalu_size = ff_evc_nal_unit_length(c->map_buf->data + c->map_pos, left);
+    if (!nalu_size || nalu_size > INT_MAX - EVC_NALU_LENGTH_PREFIX_SIZE - AV_INPUT_BUFFER_PADDING_SIZE ||
+        nalu_size > left - EVC_NALU_LENGTH_PREFIX_SIZE) {
+        av_log(s, AV_LOG_ERROR, "Invalid NAL unit size: (%"PRIu32")\n", nalu_size);
+        return AVERROR_INVALIDDATA;
+    }
+    size = nalu_size + EVC_NALU_LENGTH_PREFIX_SIZE;
+
+    if (c->map_pos + size > c->map_advised - MMAP_READ_AHEAD / 2)
+        advise_read_ahead(c, c->map_pos);
+
+    if (size + AV_INPUT_BUFFER_PADDING_SIZE <= left) {
+        pkt->buf = av_buffer_ref(c->map_buf);
+        if (!pkt->buf)
+            return AVERROR(ENOMEM);
+        pkt->data = c->map_buf->data + c->map_pos;
+        pkt->size = size;
+    } else {
+        ret = av_new_packet(pkt, size);
+        if (ret < 0)
+            return ret;
+        memcpy(pkt->data, c->map_buf->data + c->map_pos, size);
+        c->packet_buffer_peak = FFMAX(c->packet_buffer_peak, size);
+    }
+    pkt->pos = c->map_pos;
+    c->map_pos += size;
+
+    return 0;
+}
+
+static int read_nal_unit(AVFormatContext *s, AVPacket *pkt)
+{
     EVCDemuxContext *const c = s->priv_data;
+    uint8_t buf[EVC_NALU_LENGTH_PREFIX_SIZE];
+    int64_t pos = avio_tell(s->pb);
+    uint32_t nalu_size;
+    int ret;
+
+    ret = avio_read(s->pb, buf, EVC_NALU_LENGTH_PREFIX_SIZE);
+    if (ret < EVC_NALU_LENGTH_PREFIX_SIZE)
+        return ret < 0 ? ret : AVERROR_EOF;
+
+    nalu_size = ff_evc_nal_unit_length(buf, EVC_NALU_LENGTH_PREFIX_SIZE);
+    if (!nalu_size || nalu_size > INT_MAX - EVC_NALU_LENGTH_PREFIX_SIZE - AV_INPUT_BUFFER_PADDING_SIZE) {
+        av_log(s, AV_LOG_ERROR, "Invalid NAL unit size: (%"PRIu32")\n", nalu_size);
+        return AVERROR_INVALIDDATA;
+    }
 
-    int eof = avio_feof (s->pb);
-    if(eof) {
+    // the length prefix is read only once, it is copied in front of the payload
+    ret = av_new_packet(pkt, nalu_size + EVC_NALU_LENGTH_PREFIX_SIZE);
+    if (ret < 0)
+        return ret;
+    memcpy(pkt->data, buf, EVC_NALU_LENGTH_PREFIX_SIZE);
+    c->packet_buffer_peak = FFMAX(c->packet_buffer_peak, pkt->size);
+
+    ret = ffio_read_size(s->pb, pkt->data + EVC_NALU_LENGTH_PREFIX_SIZE, nalu_size);
+    if (ret < 0) {
         av_packet_unref(pkt);
-        return AVERROR_EOF;
+        return ret;
+    }
+    pkt->pos = pos;
+
+    return 0;
+}
+
+/*
+ * Read the next NAL unit from a non-blocking input. What is available is read and kept
+ * in the demuxer context, AVERROR(EAGAIN) is returned until the NAL unit is complete.
+ */
+static int read_nal_unit_nonblock(AVFormatContext *s, AVPacket *pkt)
+{
+    EVCDemuxContext *const c = s->priv_data;
+    AVIOContext *pb = s->pb;
+    uint32_t nalu_size;
+    int ret;
+
+    // a read that would block leaves the context at EOF with the error set
+    if (pb->eof_reached && pb->error == AVERROR(EAGAIN)) {
+        pb->eof_reached = 0;
+        pb->error       = 0;
     }
 
-    au_end_found = 0;
+    if (!c->nal_read)
+        c->nal_pos = avio_tell(pb);
 
-    while(!au_end_found) {
+    while (c->nal_read < EVC_NALU_LENGTH_PREFIX_SIZE) {
+        ret = avio_read_partial(pb, c->nal_prefix + c->nal_read,
+                                EVC_NALU_LENGTH_PREFIX_SIZE - c->nal_read);
+        if (ret <= 0)
+            goto fail;
+        c->nal_read += ret;
+    }
 
-        uint8_t buf[EVC_NALU_LENGTH_PREFIX_SIZE];
-        ret = avio_read(s->pb, (unsigned char *)&buf, EVC_NALU_LENGTH_PREFIX_SIZE);
+    if (!c->nal_pkt->data) {
+        nalu_size = ff_evc_nal_unit_length(c->nal_prefix, EVC_NALU_LENGTH_PREFIX_SIZE);
+        if (!nalu_size || nalu_size > INT_MAX - EVC_NALU_LENGTH_PREFIX_SIZE - AV_INPUT_BUFFER_PADDING_SIZE) {
+            av_log(s, AV_LOG_ERROR, "Invalid NAL unit size: (%"PRIu32")\n", nalu_size);
+            c->nal_read = 0;
+            return AVERROR_INVALIDDATA;
+        }
+
+        ret = av_new_packet(c->nal_pkt, nalu_size + EVC_NALU_LENGTH_PREFIX_SIZE);
         if (ret < 0) {
-            av_packet_unref(pkt);
+            c->nal_read = 0;
             return ret;
         }
+        memcpy(c->nal_pkt->data, c->nal_prefix, EVC_NALU_LENGTH_PREFIX_SIZE);
+        c->packet_buffer_peak = FFMAX(c->packet_buffer_peak, c->nal_pkt->size);
+    }
 
-        nalu_size = read_nal_unit_length((const uint8_t *)&buf, EVC_NALU_LENGTH_PREFIX_SIZE);
-        if(nalu_size <= 0) {
-            av_packet_unref(pkt);
-            return -1;
-        }
+    while (c->nal_read < c->nal_pkt->size) {
+        ret = avio_read_partial(pb, c->nal_pkt->data + c->nal_read, c->nal_pkt->size - c->nal_read);
+        if (ret <= 0)
+            goto fail;
+        c->nal_read += ret;
+    }
 
-        avio_seek(s->pb, -EVC_NALU_LENGTH_PREFIX_SIZE, SEEK_CUR);
+    av_packet_move_ref(pkt, c->nal_pkt);
+    pkt->pos    = c->nal_pos;
+    c->nal_read = 0;
 
-        ret = av_get_packet(s->pb, pkt, nalu_size + EVC_NALU_LENGTH_PREFIX_SIZE);
+    return 0;
+
+fail:
+    if (ret == AVERROR(EAGAIN) || !ret)
+        return AVERROR(EAGAIN);
+
+    // the end of the stream in the middle of a NAL unit
+    if (ret == AVERROR_EOF && c->nal_read) {
+        av_log(s, AV_LOG_ERROR, "Truncated NAL unit at the end of the stream\n");
+        ret = AVERROR_INVALIDDATA;
+    }
+    av_packet_unref(c->nal_pkt);
+    c->nal_read = 0;
+
+    return ret;
+}
+
+static int evc_read_au(AVFormatContext *s, AVPacket *pkt)
+{
+    EVCDemuxContext *const c = s->priv_data;
+    int ret;
+
+    // NAL units are read one at a time and merged into access units by the bsf
+    while ((ret = av_bsf_receive_packet(c->bsf, pkt)) == AVERROR(EAGAIN)) {
+        // on AVERROR(EAGAIN) the bsf keeps the NAL units of the access unit read so far
+        if (c->map_buf)
+            ret = read_nal_unit_mmap(s, pkt);
+        else if (s->flags & AVFMT_FLAG_NONBLOCK)
+            ret = read_nal_unit_nonblock(s, pkt);
+        else
+            ret = read_nal_unit(s, pkt);
         if (ret < 0)
             return ret;
-        if (ret != (nalu_size + EVC_NALU_LENGTH_PREFIX_SIZE))
-            return AVERROR(EIO);
 
         ret = av_bsf_send_packet(c->bsf, pkt);
         if (ret < 0) {
             av_log(s, AV_LOG_ERROR, "Failed to send packet to "
                    "evc_frame_merge filter\n");
+            av_packet_unref(pkt);
             return ret;
         }
+    }
 
-        ret = av_bsf_receive_packet(c->bsf, pkt);
-        if (ret < 0 && ret != AVERROR(EAGAIN) && ret != AVERROR_EOF)
+    if (ret < 0) {
+        if (ret != AVERROR_EOF)
             av_log(s, AV_LOG_ERROR, "evc_frame_merge filter failed to "
                    "send output packet\n");
-
-        au_end_found = 1;
-        if (ret == AVERROR(EAGAIN))
-            au_end_found = 0;
+        return ret;
     }
 
+    if (pkt->pts != AV_NOPTS_VALUE)
+        pkt->pts += c->ts_offset;
+    if (pkt->dts != AV_NOPTS_VALUE)
+        pkt->dts += c->ts_offset;
+
+    return ret;
+}
+
+static int evc_read_packet(AVFormatContext *s, AVPacket *pkt)
+{
+    int ret;
+
+    FF_TRACE_BEGIN("evc_read_packet", -1, -1, -1);
+    ret = evc_read_au(s, pkt);
+    FF_TRACE_END("evc_read_packet", -1, -1, ret < 0 ? -1 : pkt->size);
+
     return ret;
 }
 
+/*
+ * Extend the index of IDR access units up to the given picture, reading only the NAL unit
+ * headers and skipping their payload. Every slice is counted as a picture.
+ */
+static int scan_idr_index(AVFormatContext *s, int64_t frame_duration, int64_t timestamp)
+{
+    EVCDemuxContext *const c = s->priv_data;
+    AVStream *st = s->streams[0];
+    AVIOContext *pb = s->pb;
+    int64_t pos = c->scan_pos;
+
+    if (avio_seek(pb, pos, SEEK_SET) < 0)
+        return AVERROR(EIO);
+
+    while (!c->scan_done && c->scan_pictures * frame_duration <= timestamp) {
+        uint8_t buf[EVC_NALU_LENGTH_PREFIX_SIZE + EVC_NALU_HEADER_SIZE];
+        uint32_t nalu_size;
+        int nalu_type;
+
+        if (avio_read(pb, buf, sizeof(buf)) != sizeof(buf)) {
+            c->scan_done = 1;
+            break;
+        }
+        nalu_size = ff_evc_nal_unit_length(buf, sizeof(buf));
+        nalu_type = ff_evc_nal_unit_type(buf + EVC_NALU_LENGTH_PREFIX_SIZE, EVC_NALU_HEADER_SIZE);
+        if (nalu_size < EVC_NALU_HEADER_SIZE || nalu_type < 0) {
+            c->scan_done = 1;
+            break;
+        }
+
+        if (nalu_type == EVC_NOIDR_NUT || nalu_type == EVC_IDR_NUT) {
+            if (!c->scan_prev_vcl || nalu_type == EVC_IDR_NUT) {
+                if (c->scan_prev_vcl)
+                    c->scan_au_pos = pos;
+                if (nalu_type == EVC_IDR_NUT)
+                    av_add_index_entry(st, c->scan_au_pos, c->scan_pictures * frame_duration,
+                                       0, 0, AVINDEX_KEYFRAME);
+            }
+            c->scan_pictures++;
+            c->scan_prev_vcl = 1;
+        } else if (c->scan_prev_vcl) {
+            c->scan_au_pos   = pos;
+            c->scan_prev_vcl = 0;
+        }
+
+        pos += EVC_NALU_LENGTH_PREFIX_SIZE + nalu_size;
+        if (avio_skip(pb, nalu_size - EVC_NALU_HEADER_SIZE) < 0) {
+            c->scan_done = 1;
+            break;
+        }
+        c->scan_pos = pos;
+    }
+
+    return 0;
+}
+
+static int evc_read_seek(AVFormatContext *s, int stream_index,
+                         int64_t timestamp, int flags)
+{
+    EVCDemuxContext *const c = s->priv_data;
+    AVStream *st = s->streams[0];
+    int64_t frame_duration;
+    int index, ret;
+
+    if (!(s->pb->seekable & AVIO_SEEKABLE_NORMAL) || (flags & (AVSEEK_FLAG_BYTE | AVSEEK_FLAG_FRAME)) ||
+        c->framerate.num <= 0 || c->framerate.den <= 0)
+        return -1;
+
+    frame_duration = av_rescale_q(1, av_inv_q(c->framerate), st->time_base);
+    if (frame_duration <= 0)
+        return -1;
+
+    ret = scan_idr_index(s, frame_duration, timestamp);
+    if (ret < 0)
+        return ret;
+
+    index = av_index_search_timestamp(st, timestamp, flags);
+    if (index < 0)
+        return -1;
+
+    if (c->map_buf) {
+        c->map_pos = ffstream(st)->index_entries[index].pos;
+        advise_read_ahead(c, c->map_pos);
+    } else if (avio_seek(s->pb, ffstream(st)->index_entries[index].pos, SEEK_SET) < 0)
+        return AVERROR(EIO);
+
+    av_bsf_flush(c->bsf);
+    av_packet_unref(c->nal_pkt);
+    c->nal_read  = 0;
+    c->ts_offset = ffstream(st)->index_entries[index].timestamp;
+    avpriv_update_cur_dts(s, st, c->ts_offset);
+
+    return 0;
+}
+
 static int evc_read_close(AVFormatContext *s)
 {
     EVCDemuxContext *const c = s->priv_data;
 
     av_bsf_free(&c->bsf);
+    av_buffer_unref(&c->map_buf);
+    av_packet_free(&c->nal_pkt);
     return 0;
 }
 
@@ -266,6 +693,7 @@ const AVInputFormat ff_evc_demuxer = {
     .read_probe     = annexb_probe,
     .read_header    = evc_read_header, // annexb_read_header
     .read_packet    = evc_read_packet, // annexb_read_packet
+    .read_seek      = evc_read_seek,
     .read_close     = evc_read_close,
     .extensions     = "evc",
     .flags          = AVFMT_GENERIC_INDEX,
@@ -19,6 +19,8 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
  */
 
+#define _DEFAULT_SOURCE /* syscall() */
+
 #include "config_components.h"
 
 #include "libavutil/avstring.h"
@@ -38,6 +40,12 @@
 #endif
 #include <sys/stat.h>
 #include <stdlib.h>
+#if HAVE_LINUX_IO_URING_H
+#include <linux/io_uring.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
 #include "os_support.h"
 #include "url.h"
 
@@ -88,6 +96,8 @@
 
 /* standard file protocol */
 
+typedef struct FileUring FileUring;
+
 typedef struct FileContext {
     const AVClass *class;
     int fd;
@@ -95,6 +105,10 @@ typedef struct FileContext {
     int blocksize;
     int follow;
     int seekable;
+    int io_uring;
+    int io_depth;
+    int io_block_size;
+    FileUring *uring;
 #if HAVE_DIRENT_H
     DIR *dir;
 #endif
@@ -105,6 +119,9 @@ static const AVOption file_options[] = {
     { "blocksize", "set I/O operation maximum block size", offsetof(FileContext, blocksize), AV_OPT_TYPE_INT, { .i64 = INT_MAX }, 1, INT_MAX, AV_OPT_FLAG_ENCODING_PARAM },
     { "follow", "Follow a file as it is being written", offsetof(FileContext, follow), AV_OPT_TYPE_INT, { .i64 = 0 }, 0, 1, AV_OPT_FLAG_DECODING_PARAM },
     { "seekable", "Sets if the file is seekable", offsetof(FileContext, seekable), AV_OPT_TYPE_INT, { .i64 = -1 }, -1, 0, AV_OPT_FLAG_DECODING_PARAM | AV_OPT_FLAG_ENCODING_PARAM },
+    { "io_uring", "Use io_uring to queue reads ahead of the position or writes behind it", offsetof(FileContext, io_uring), AV_OPT_TYPE_BOOL, { .i64 = 0 }, 0, 1, AV_OPT_FLAG_DECODING_PARAM | AV_OPT_FLAG_ENCODING_PARAM },
+    { "io_depth", "Number of io_uring requests in flight", offsetof(FileContext, io_depth), AV_OPT_TYPE_INT, { .i64 = 8 }, 1, 64, AV_OPT_FLAG_DECODING_PARAM | AV_OPT_FLAG_ENCODING_PARAM },
+    { "io_block_size", "Size of the io_uring requests", offsetof(FileContext, io_block_size), AV_OPT_TYPE_INT, { .i64 = 1 << 20 }, 4096, 1 << 28, AV_OPT_FLAG_DECODING_PARAM | AV_OPT_FLAG_ENCODING_PARAM },
     { NULL }
 };
 
@@ -135,10 +152,401 @@ static const AVClass fd_class = {
     .version    = LIBAVUTIL_VERSION_INT,
 };
 
+#if HAVE_LINUX_IO_URING_H
+/*
+ * io_uring back-end of the file protocol, for regular files opened either for reading
+ * or for writing. The file is accessed in blocks of io_block_size bytes, up to io_depth
+ * of them being in flight at once:
+ * - reads are queued ahead of the read position, and served from the completed blocks;
+ * - writes are copied into blocks, queued once full, and only waited for when their
+ *   block is reused, on seeks and on close.
+ * The kernel interface is used directly, through the rings shared with it.
+ */
+
+typedef struct FileUringBlock {
+    uint8_t *buf;
+    int64_t  offset;    ///< position of buf in the file
+    int      size;      ///< bytes requested from the kernel, or buffered for writing
+    int      pos;       ///< bytes of a completed read already returned
+    int      result;    ///< bytes transferred, or a negative error code
+    int      pending;   ///< queued and not completed yet
+} FileUringBlock;
+
+struct FileUring {
+    int ring_fd;
+    int file_fd;
+    int write;
+    void  *ring;
+    size_t ring_size;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+    atomic_uint *sq_tail;
+    unsigned *sq_mask, *sq_array;
+    atomic_uint *cq_head, *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+    unsigned to_submit;
+
+    FileUringBlock *blocks;
+    int nb_blocks;
+    int block_size;
+    int cur;                ///< block the next bytes are read from or written to
+    int64_t pos;            ///< position in the file
+    int64_t next_offset;    ///< position of the next block to read
+    int error;              ///< first write error
+};
+
+static void uring_queue(FileUring *u, int idx, int op)
+{
+    FileUringBlock *b = &u->blocks[idx];
+    unsigned tail = atomic_load_explicit(u->sq_tail, memory_order_relaxed);
+    unsigned sq_idx = tail & *u->sq_mask;
+    struct io_uring_sqe *sqe = &u->sqes[sq_idx];
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode    = op;
+    sqe->fd        = u->file_fd;
+    sqe->addr      = (uintptr_t)b->buf;
+    sqe->len       = b->size;
+    sqe->off       = b->offset;
+    sqe->user_data = idx;
+    u->sq_array[sq_idx] = sq_idx;
+    atomic_store_explicit(u->sq_tail, tail + 1, memory_order_release);
+
+    b->pending = 1;
+    u->to_submit++;
+}
+
+static void uring_reap(FileUring *u)
+{
+    unsigned head = atomic_load_explicit(u->cq_head, memory_order_relaxed);
+    unsigned tail = atomic_load_explicit(u->cq_tail, memory_order_acquire);
+
+    for (; head != tail; head++) {
+        const struct io_uring_cqe *cqe = &u->cqes[head & *u->cq_mask];
+        FileUringBlock *b = &u->blocks[cqe->user_data];
+
+        b->result  = cqe->res;
+        b->pending = 0;
+        if (!u->write)
+            continue;
+
+        // short writes are completed synchronously, they are not expected on regular files
+        while (b->result >= 0 && b->result < b->size) {
+            ssize_t ret = pwrite(u->file_fd, b->buf + b->result, b->size - b->result,
+                                 b->offset + b->result);
+            if (ret <= 0)
+                b->result = ret < 0 ? AVERROR(errno) : AVERROR(EIO);
+            else
+                b->result += ret;
+        }
+        if (b->result < 0 && !u->error)
+            u->error = b->result;
+        b->size = 0;
+    }
+    atomic_store_explicit(u->cq_head, head, memory_order_release);
+}
+
+/* submit the queued requests, and wait for min_complete completions */
+static int uring_enter(FileUring *u, unsigned min_complete)
+{
+    while (u->to_submit || min_complete) {
+        int ret = syscall(__NR_io_uring_enter, u->ring_fd, u->to_submit, min_complete,
+                          min_complete ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            return AVERROR(errno);
+        }
+        u->to_submit -= FFMIN(ret, u->to_submit);
+        if (min_complete)
+            break;
+    }
+    uring_reap(u);
+    return 0;
+}
+
+static int uring_wait(FileUring *u, int idx)
+{
+    while (u->blocks[idx].pending) {
+        int ret = uring_enter(u, 1);
+        if (ret < 0)
+            return ret;
+    }
+    return 0;
+}
+
+static int uring_drain(FileUring *u)
+{
+    for (int i = 0; i < u->nb_blocks; i++) {
+        int ret = uring_wait(u, i);
+        if (ret < 0)
+            return ret;
+    }
+    return 0;
+}
+
+/* queue the reads of all the blocks from pos */
+static int uring_read_from(FileUring *u, int64_t pos)
+{
+    u->pos = u->next_offset = pos;
+    u->cur = 0;
+    for (int i = 0; i < u->nb_blocks; i++) {
+        FileUringBlock *b = &u->blocks[i];
+
+        b->offset = u->next_offset;
+        b->size   = u->block_size;
+        b->pos    = 0;
+        uring_queue(u, i, IORING_OP_READ);
+        u->next_offset += u->block_size;
+    }
+    return uring_enter(u, 0);
+}
+
+static int uring_read(FileUring *u, unsigned char *buf, int size)
+{
+    FileUringBlock *b;
+    int ret;
+
+    for (;;) {
+        b = &u->blocks[u->cur];
+        if ((ret = uring_wait(u, u->cur)) < 0)
+            return ret;
+        if (b->result < 0)
+            return b->result;
+        if (b->pos < b->result)
+            break;
+        // a short block is the end of the file, the following ones are after it
+        if (b->result < b->size)
+            return AVERROR_EOF;
+
+        b->offset = u->next_offset;
+        b->pos    = 0;
+        uring_queue(u, u->cur, IORING_OP_READ);
+        u->next_offset += u->block_size;
+        if ((ret = uring_enter(u, 0)) < 0)
+            return ret;
+        u->cur = (u->cur + 1) % u->nb_blocks;
+    }
+
+    size = FFMIN(size, b->result - b->pos);
+    memcpy(buf, b->buf + b->pos, size);
+    b->pos += size;
+    u->pos += size;
+    return size;
+}
+
+static int uring_write(FileUring *u, const unsigned char *buf, int size)
+{
+    FileUringBlock *b = &u->blocks[u->cur];
+    int ret;
+
+    if ((ret = uring_wait(u, u->cur)) < 0)
+        return ret;
+    if (u->error)
+        return u->error;
+
+    if (!b->size)
+        b->offset = u->pos;
+    size = FFMIN(size, u->block_size - b->size);
+    memcpy(b->buf + b->size, buf, size);
+    b->size += size;
+    u->pos  += size;
+
+    if (b->size == u->block_size) {
+        uring_queue(u, u->cur, IORING_OP_WRITE);
+        if ((ret = uring_enter(u, 0)) < 0)
+            return ret;
+        u->cur = (u->cur + 1) % u->nb_blocks;
+    }
+    return size;
+}
+
+/* write out the partial block and wait for all the writes */
+static int uring_flush(FileUring *u)
+{
+    int ret;
+
+    if (u->blocks[u->cur].size && !u->blocks[u->cur].pending) {
+        uring_queue(u, u->cur, IORING_OP_WRITE);
+        u->cur = (u->cur + 1) % u->nb_blocks;
+    }
+    if ((ret = uring_drain(u)) < 0)
+        return ret;
+    return u->error;
+}
+
+static int64_t uring_seek(FileUring *u, int64_t pos, int whence)
+{
+    FileUringBlock *b = &u->blocks[u->cur];
+    struct stat st;
+    int ret;
+
+    if (u->write && (ret = uring_flush(u)) < 0)
+        return ret;
+
+    if (whence == AVSEEK_SIZE || whence == SEEK_END) {
+        if (fstat(u->file_fd, &st) < 0)
+            return AVERROR(errno);
+        if (whence == AVSEEK_SIZE)
+            return st.st_size;
+        pos += st.st_size;
+    } else if (whence == SEEK_CUR) {
+        pos += u->pos;
+    } else if (whence != SEEK_SET) {
+        return AVERROR(EINVAL);
+    }
+    if (pos < 0)
+        return AVERROR(EINVAL);
+
+    if (u->write) {
+        u->pos = pos;
+        return pos;
+    }
+
+    // seeks inside the block being read keep the read-ahead
+    if (!b->pending && b->result >= 0 && pos >= b->offset && pos < b->offset + b->result) {
+        b->pos = pos - b->offset;
+        u->pos = pos;
+        return pos;
+    }
+    if ((ret = uring_drain(u)) < 0 || (ret = uring_read_from(u, pos)) < 0)
+        return ret;
+    return pos;
+}
+
+static int uring_close(FileUring **pu)
+{
+    FileUring *u = *pu;
+    int ret = 0;
+
+    if (!u)
+        return 0;
+
+    // the kernel may still access the buffers of the requests in flight
+    if (u->blocks)
+        ret = u->write ? uring_flush(u) : uring_drain(u);
+    if (u->sqes)
+        munmap(u->sqes, u->sqes_size);
+    if (u->ring)
+        munmap(u->ring, u->ring_size);
+    if (u->ring_fd >= 0)
+        close(u->ring_fd);
+    for (int i = 0; u->blocks && i < u->nb_blocks; i++)
+        av_free(u->blocks[i].buf);
+    av_free(u->blocks);
+    av_freep(pu);
+
+    return ret;
+}
+
+/**
+ * Tell whether the kernel supports an io_uring opcode. The probe itself is only
+ * available since Linux 5.6 like IORING_OP_READ and IORING_OP_WRITE, so it fails
+ * on the older kernels, which do get the rings set up but refuse these requests.
+ */
+static int uring_op_supported(int ring_fd, int op)
+{
+    struct io_uring_probe *probe;
+    int ret;
+
+    probe = av_mallocz(sizeof(*probe) + (op + 1) * sizeof(probe->ops[0]));
+    if (!probe)
+        return 0;
+    ret = syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_PROBE, probe, op + 1);
+    ret = ret >= 0 && op <= probe->last_op && probe->ops[op].flags & IO_URING_OP_SUPPORTED;
+    av_free(probe);
+
+    return ret;
+}
+
+static int uring_open(URLContext *h, int write)
+{
+    FileContext *c = h->priv_data;
+    struct io_uring_params p = { 0 };
+    FileUring *u;
+    int ret;
+
+    u = c->uring = av_mallocz(sizeof(*u));
+    if (!u)
+        return AVERROR(ENOMEM);
+    u->file_fd    = c->fd;
+    u->write      = write;
+    u->nb_blocks  = c->io_depth;
+    u->block_size = c->io_block_size;
+
+    u->ring_fd = syscall(__NR_io_uring_setup, u->nb_blocks, &p);
+    if (u->ring_fd < 0) {
+        ret = AVERROR(errno);
+        goto fail;
+    }
+    // the SQ and CQ rings are mapped at once, which is the case since Linux 5.4
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+        ret = AVERROR(ENOSYS);
+        goto fail;
+    }
+    if (!uring_op_supported(u->ring_fd, write ? IORING_OP_WRITE : IORING_OP_READ)) {
+        ret = AVERROR(ENOSYS);
+        goto fail;
+    }
+
+    u->ring_size = FFMAX(p.sq_off.array + p.sq_entries * sizeof(unsigned),
+                         p.cq_off.cqes  + p.cq_entries * sizeof(struct io_uring_cqe));
+    u->ring = mmap(NULL, u->ring_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                   u->ring_fd, IORING_OFF_SQ_RING);
+    if (u->ring == MAP_FAILED) {
+        u->ring = NULL;
+        ret = AVERROR(errno);
+        goto fail;
+    }
+    u->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    u->sqes = mmap(NULL, u->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                   u->ring_fd, IORING_OFF_SQES);
+    if (u->sqes == MAP_FAILED) {
+        u->sqes = NULL;
+        ret = AVERROR(errno);
+        goto fail;
+    }
+    u->sq_tail  = (atomic_uint *)((uint8_t *)u->ring + p.sq_off.tail);
+    u->sq_mask  = (unsigned *)((uint8_t *)u->ring + p.sq_off.ring_mask);
+    u->sq_array = (unsigned *)((uint8_t *)u->ring + p.sq_off.array);
+    u->cq_head  = (atomic_uint *)((uint8_t *)u->ring + p.cq_off.head);
+    u->cq_tail  = (atomic_uint *)((uint8_t *)u->ring + p.cq_off.tail);
+    u->cq_mask  = (unsigned *)((uint8_t *)u->ring + p.cq_off.ring_mask);
+    u->cqes     = (struct io_uring_cqe *)((uint8_t *)u->ring + p.cq_off.cqes);
+
+    u->blocks = av_calloc(u->nb_blocks, sizeof(*u->blocks));
+    if (!u->blocks) {
+        ret = AVERROR(ENOMEM);
+        goto fail;
+    }
+    for (int i = 0; i < u->nb_blocks; i++) {
+        u->blocks[i].buf = av_malloc(u->block_size);
+        if (!u->blocks[i].buf) {
+            ret = AVERROR(ENOMEM);
+            goto fail;
+        }
+    }
+
+    if (!write && (ret = uring_read_from(u, 0)) < 0)
+        goto fail;
+
+    return 0;
+
+fail:
+    uring_close(&c->uring);
+    return ret;
+}
+#endif /* HAVE_LINUX_IO_URING_H */
+
 static int file_read(URLContext *h, unsigned char *buf, int size)
 {
     FileContext *c = h->priv_data;
     int ret;
+#if HAVE_LINUX_IO_URING_H
+    if (c->uring)
+        return uring_read(c->uring, buf, size);
+#endif
     size = FFMIN(size, c->blocksize);
     ret = read(c->fd, buf, size);
     if (ret == 0 && c->follow)
@@ -152,6 +560,10 @@ static int file_write(URLContext *h, const unsigned char *buf, int size)
 {
     FileContext *c = h->priv_data;
     int ret;
+#if HAVE_LINUX_IO_URING_H
+    if (c->uring)
+        return uring_write(c->uring, buf, size);
+#endif
     size = FFMIN(size, c->blocksize);
     ret = write(c->fd, buf, size);
     return (ret == -1) ? AVERROR(errno) : ret;
@@ -218,7 +630,15 @@ static int fd_dup(URLContext *h, int oldfd)
 static int file_close(URLContext *h)
 {
     FileContext *c = h->priv_data;
-    int ret = close(c->fd);
+    int ret;
+#if HAVE_LINUX_IO_URING_H
+    int uring_ret = uring_close(&c->uring);
+#endif
+    ret = close(c->fd);
+#if HAVE_LINUX_IO_URING_H
+    if (uring_ret < 0)
+        return uring_ret;
+#endif
     return (ret == -1) ? AVERROR(errno) : 0;
 }
 
@@ -228,6 +648,11 @@ static int64_t file_seek(URLContext *h, int64_t pos, int whence)
     FileContext *c = h->priv_data;
     int64_t ret;
 
+#if HAVE_LINUX_IO_URING_H
+    if (c->uring)
+        return uring_seek(c->uring, pos, whence);
+#endif
+
     if (whence == AVSEEK_SIZE) {
         struct stat st;
         ret = fstat(c->fd, &st);
@@ -282,7 +707,7 @@ static int file_open(URLContext *h, const char *filename, int flags)
     FileContext *c = h->priv_data;
     int access;
     int fd;
-    struct stat st;
+    struct stat st = { 0 };
 
     av_strstart(filename, "file:", &filename);
 
@@ -315,6 +740,22 @@ static int file_open(URLContext *h, const char *filename, int flags)
     if (c->seekable >= 0)
         h->is_streamed = !c->seekable;
 
+    if (c->io_uring) {
+#if HAVE_LINUX_IO_URING_H
+        int ret = AVERROR(EINVAL);
+
+        // the position is tracked by the back-end, which only handles one direction
+        if (!h->is_streamed && !c->follow && S_ISREG(st.st_mode) &&
+            (flags & AVIO_FLAG_READ_WRITE) != AVIO_FLAG_READ_WRITE)
+            ret = uring_open(h, flags & AVIO_FLAG_WRITE);
+        if (ret < 0)
+            av_log(h, AV_LOG_WARNING, "Cannot use io_uring for %s: %s\n",
+                   filename, av_err2str(ret));
+#else
+        av_log(h, AV_LOG_WARNING, "io_uring is not supported\n");
+#endif
+    }
+
     return 0;
 }
 
@@ -42,7 +42,11 @@
 #define FLV_AUDIO_CODECID_MASK    0xf0
 
 #define FLV_VIDEO_CODECID_MASK    0x0f
-#define FLV_VIDEO_FRAMETYPE_MASK  0xf0
+#define FLV_VIDEO_FRAMETYPE_MASK  0x70
+#define FLV_VIDEO_PACKETTYPE_MASK 0x0f
+
+/* the video tag header is an ExVideoTagHeader (enhanced RTMP), with a FourCC codec id */
+#define FLV_IS_EX_HEADER          0x80
 
 #define AMF_END_OF_OBJECT         0x09
 
@@ -120,6 +124,15 @@ enum {
     FLV_FRAME_VIDEO_INFO_CMD = 5 << FLV_VIDEO_FRAMETYPE_OFFSET, ///< video info/command frame
 };
 
+/* packet types of an ExVideoTagHeader, they replace the AVC packet type */
+enum {
+    PacketTypeSequenceStart = 0,
+    PacketTypeCodedFrames   = 1, ///< coded frames with a composition time offset
+    PacketTypeSequenceEnd   = 2,
+    PacketTypeCodedFramesX  = 3, ///< coded frames with a composition time offset of 0
+    PacketTypeMetadata      = 4,
+};
+
 typedef enum {
     AMF_DATA_TYPE_NUMBER      = 0x00,
     AMF_DATA_TYPE_BOOL        = 0x01,
@@ -302,10 +302,8 @@ static void flv_set_audio_codec(AVFormatContext *s, AVStream *astream,
     }
 }
 
-static int flv_same_video_codec(AVCodecParameters *vpar, int flags)
+static int flv_same_video_codec(AVCodecParameters *vpar, int flv_codecid)
 {
-    int flv_codecid = flags & FLV_VIDEO_CODECID_MASK;
-
     if (!vpar->codec_id && !vpar->codec_tag)
         return 1;
 
@@ -322,6 +320,8 @@ static int flv_same_video_codec(AVCodecParameters *vpar, int flags)
         return vpar->codec_id == AV_CODEC_ID_VP6A;
     case FLV_CODECID_H264:
         return vpar->codec_id == AV_CODEC_ID_H264;
+    case MKBETAG('e', 'v', 'c', '1'):
+        return vpar->codec_id == AV_CODEC_ID_EVC;
     default:
         return vpar->codec_tag == flv_codecid;
     }
@@ -372,6 +372,10 @@ static int flv_set_video_codec(AVFormatContext *s, AVStream *vstream,
         par->codec_id = AV_CODEC_ID_MPEG4;
         ret = 3;
         break;
+    case MKBETAG('e', 'v', 'c', '1'):
+        par->codec_id = AV_CODEC_ID_EVC;
+        vstreami->need_parsing = AVSTREAM_PARSE_HEADERS;
+        break;      // the composition time is only present for PacketTypeCodedFrames
     default:
         avpriv_request_sample(s, "Video codec (%x)", flv_codecid);
         par->codec_tag = flv_codecid;
@@ -1016,6 +1020,7 @@ static int flv_read_packet(AVFormatContext *s, AVPacket *pkt)
 {
     FLVContext *flv = s->priv_data;
     int ret, i, size, flags;
+    int enhanced_flv = 0, video_codec_id = 0;
     enum FlvTagType type;
     int stream_type=-1;
     int64_t next, pos, meta_pos;
@@ -1072,8 +1077,22 @@ retry:
         stream_type = FLV_STREAM_TYPE_VIDEO;
         flags    = avio_r8(s->pb);
         size--;
+        video_codec_id = flags & FLV_VIDEO_CODECID_MASK;
+        // ExVideoTagHeader from enhanced RTMP, the codec is given by a FourCC
+        enhanced_flv = !!(flags & FLV_IS_EX_HEADER);
+        if (enhanced_flv) {
+            if (size < 4)
+                goto skip;
+            video_codec_id = avio_rb32(s->pb);
+            size -= 4;
+        }
         if ((flags & FLV_VIDEO_FRAMETYPE_MASK) == FLV_FRAME_VIDEO_INFO_CMD)
             goto skip;
+        if (enhanced_flv &&
+            (flags & FLV_VIDEO_PACKETTYPE_MASK) != PacketTypeSequenceStart &&
+            (flags & FLV_VIDEO_PACKETTYPE_MASK) != PacketTypeCodedFrames &&
+            (flags & FLV_VIDEO_PACKETTYPE_MASK) != PacketTypeCodedFramesX)
+            goto skip;
     } else if (type == FLV_TAG_TYPE_META) {
         stream_type=FLV_STREAM_TYPE_SUBTITLE;
         if (size > 13 + 1 + 4) { // Header-type metadata stuff
@@ -1129,7 +1148,7 @@ skip:
                 break;
         } else if (stream_type == FLV_STREAM_TYPE_VIDEO) {
             if (st->codecpar->codec_type == AVMEDIA_TYPE_VIDEO &&
-                (s->video_codec_id || flv_same_video_codec(st->codecpar, flags)))
+                (s->video_codec_id || flv_same_video_codec(st->codecpar, video_codec_id)))
                 break;
         } else if (stream_type == FLV_STREAM_TYPE_SUBTITLE) {
             if (st->codecpar->codec_type == AVMEDIA_TYPE_SUBTITLE)
@@ -1230,7 +1249,7 @@ retry_duration:
             avcodec_parameters_free(&par);
         }
     } else if (stream_type == FLV_STREAM_TYPE_VIDEO) {
-        int ret = flv_set_video_codec(s, st, flags & FLV_VIDEO_CODECID_MASK, 1);
+        int ret = flv_set_video_codec(s, st, video_codec_id, 1);
         if (ret < 0)
             return ret;
         size -= ret;
@@ -1242,16 +1261,27 @@ retry_duration:
 
     if (st->codecpar->codec_id == AV_CODEC_ID_AAC ||
         st->codecpar->codec_id == AV_CODEC_ID_H264 ||
-        st->codecpar->codec_id == AV_CODEC_ID_MPEG4) {
-        int type = avio_r8(s->pb);
-        size--;
+        st->codecpar->codec_id == AV_CODEC_ID_MPEG4 ||
+        st->codecpar->codec_id == AV_CODEC_ID_EVC) {
+        int type;
+
+        // the packet type of an ExVideoTagHeader is part of the flags
+        if (enhanced_flv && stream_type == FLV_STREAM_TYPE_VIDEO) {
+            type = flags & FLV_VIDEO_PACKETTYPE_MASK;
+            if (type == PacketTypeCodedFrames)
+                size -= 3;
+        } else {
+            type = avio_r8(s->pb);
+            size--;
+        }
 
         if (size < 0) {
             ret = AVERROR_INVALIDDATA;
             goto leave;
         }
 
-        if (st->codecpar->codec_id == AV_CODEC_ID_H264 || st->codecpar->codec_id == AV_CODEC_ID_MPEG4) {
+        if (st->codecpar->codec_id == AV_CODEC_ID_H264 || st->codecpar->codec_id == AV_CODEC_ID_MPEG4 ||
+            (enhanced_flv && type == PacketTypeCodedFrames)) {
             // sign extension
             int32_t cts = (avio_rb24(s->pb) + 0xff800000) ^ 0xff800000;
             pts = av_sat_add64(dts, cts);
@@ -1267,7 +1297,7 @@ retry_duration:
             }
         }
         if (type == 0 && (!st->codecpar->extradata || st->codecpar->codec_id == AV_CODEC_ID_AAC ||
-            st->codecpar->codec_id == AV_CODEC_ID_H264)) {
+            st->codecpar->codec_id == AV_CODEC_ID_H264 || st->codecpar->codec_id == AV_CODEC_ID_EVC)) {
             AVDictionaryEntry *t;
 
             if (st->codecpar->extradata) {
@@ -29,6 +29,7 @@
 #include "avio.h"
 #include "avc.h"
 #include "avformat.h"
+#include "evc.h"
 #include "flv.h"
 #include "internal.h"
 #include "mux.h"
@@ -46,6 +47,7 @@ static const AVCodecTag flv_video_codec_ids[] = {
     { AV_CODEC_ID_VP6,      FLV_CODECID_VP6 },
     { AV_CODEC_ID_VP6A,     FLV_CODECID_VP6A },
     { AV_CODEC_ID_H264,     FLV_CODECID_H264 },
+    { AV_CODEC_ID_EVC,      MKBETAG('e', 'v', 'c', '1') },
     { AV_CODEC_ID_NONE,     0 }
 };
 
@@ -235,15 +237,20 @@ static void put_timestamp(AVIOContext *pb, int64_t ts) {
 static void put_eos_tag(AVIOContext *pb, unsigned ts, enum AVCodecID codec_id)
 {
     uint32_t tag = ff_codec_get_tag(flv_video_codec_ids, codec_id);
-    /* ub[4] FrameType = 1, ub[4] CodecId */
-    tag |= 1 << 4;
     avio_w8(pb, FLV_TAG_TYPE_VIDEO);
     avio_wb24(pb, 5);               /* Tag Data Size */
     put_timestamp(pb, ts);
     avio_wb24(pb, 0);               /* StreamId = 0 */
-    avio_w8(pb, tag);
-    avio_w8(pb, 2);                 /* AVC end of sequence */
-    avio_wb24(pb, 0);               /* Always 0 for AVC EOS. */
+    if (codec_id == AV_CODEC_ID_EVC) {
+        /* ub[1] IsExHeader = 1, ub[3] FrameType = 1, ub[4] PacketType */
+        avio_w8(pb, FLV_IS_EX_HEADER | FLV_FRAME_KEY | PacketTypeSequenceEnd);
+        avio_wb32(pb, tag);         /* FourCC */
+    } else {
+        /* ub[4] FrameType = 1, ub[4] CodecId */
+        avio_w8(pb, tag | FLV_FRAME_KEY);
+        avio_w8(pb, 2);             /* AVC end of sequence */
+        avio_wb24(pb, 0);           /* Always 0 for AVC EOS. */
+    }
     avio_wb32(pb, 16);              /* Size of FLV tag */
 }
 
@@ -488,8 +495,12 @@ static void flv_write_codec_header(AVFormatContext* s, AVCodecParameters* par, i
     AVIOContext *pb = s->pb;
     FLVContext *flv = s->priv_data;
 
+    /* without extradata, the EVC sequence header is written with the first key frame */
+    if (par->codec_id == AV_CODEC_ID_EVC && !par->extradata_size)
+        return;
+
     if (par->codec_id == AV_CODEC_ID_AAC || par->codec_id == AV_CODEC_ID_H264
-            || par->codec_id == AV_CODEC_ID_MPEG4) {
+            || par->codec_id == AV_CODEC_ID_MPEG4 || par->codec_id == AV_CODEC_ID_EVC) {
         int64_t pos;
         avio_w8(pb,
                 par->codec_type == AVMEDIA_TYPE_VIDEO ?
@@ -531,6 +542,10 @@ static void flv_write_codec_header(AVFormatContext* s, AVCodecParameters* par, i
                         data[0], data[1]);
             }
             avio_write(pb, par->extradata, par->extradata_size);
+        } else if (par->codec_id == AV_CODEC_ID_EVC) {
+            avio_w8(pb, FLV_IS_EX_HEADER | FLV_FRAME_KEY | PacketTypeSequenceStart); // flags
+            avio_wb32(pb, par->codec_tag); // FourCC
+            ff_isom_write_evcc(pb, par->extradata, par->extradata_size, 0);
         } else {
             avio_w8(pb, par->codec_tag | FLV_FRAME_KEY); // flags
             avio_w8(pb, 0); // AVC sequence header
@@ -631,7 +646,8 @@ static int flv_init(struct AVFormatContext *s)
                 return unsupported_codec(s, "Video", par->codec_id);
 
             if (par->codec_id == AV_CODEC_ID_MPEG4 ||
-                par->codec_id == AV_CODEC_ID_H263) {
+                par->codec_id == AV_CODEC_ID_H263  ||
+                par->codec_id == AV_CODEC_ID_EVC) {
                 int error = s->strict_std_compliance > FF_COMPLIANCE_UNOFFICIAL;
                 av_log(s, error ? AV_LOG_ERROR : AV_LOG_WARNING,
                        "Codec %s is not supported in the official FLV specification,\n", avcodec_get_name(par->codec_id));
@@ -782,7 +798,8 @@ end:
         for (i = 0; i < s->nb_streams; i++) {
             AVCodecParameters *par = s->streams[i]->codecpar;
             if (par->codec_type == AVMEDIA_TYPE_VIDEO &&
-                    (par->codec_id == AV_CODEC_ID_H264 || par->codec_id == AV_CODEC_ID_MPEG4))
+                    (par->codec_id == AV_CODEC_ID_H264 || par->codec_id == AV_CODEC_ID_MPEG4 ||
+                     par->codec_id == AV_CODEC_ID_EVC))
                 put_eos_tag(pb, flv->last_ts[i], par->codec_id);
         }
     }
@@ -834,11 +851,13 @@ static int flv_write_packet(AVFormatContext *s, AVPacket *pkt)
         flags_size = 2;
     else if (par->codec_id == AV_CODEC_ID_H264 || par->codec_id == AV_CODEC_ID_MPEG4)
         flags_size = 5;
+    else if (par->codec_id == AV_CODEC_ID_EVC)
+        flags_size = pkt->pts != pkt->dts ? 8 : 5;
     else
         flags_size = 1;
 
     if (par->codec_id == AV_CODEC_ID_AAC || par->codec_id == AV_CODEC_ID_H264
-            || par->codec_id == AV_CODEC_ID_MPEG4) {
+            || par->codec_id == AV_CODEC_ID_MPEG4 || par->codec_id == AV_CODEC_ID_EVC) {
         size_t side_size;
         uint8_t *side = av_packet_get_side_data(pkt, AV_PKT_DATA_NEW_EXTRADATA, &side_size);
         if (side && side_size > 0 && (side_size != par->extradata_size || memcmp(side, par->extradata, side_size))) {
@@ -850,6 +869,16 @@ static int flv_write_packet(AVFormatContext *s, AVPacket *pkt)
         }
     }
 
+    // Raw EVC carries its parameter sets in band, take them from the first key frame
+    if (par->codec_id == AV_CODEC_ID_EVC && !par->extradata_size &&
+        pkt->flags & AV_PKT_FLAG_KEY) {
+        ret = ff_evc_build_evcc(&par->extradata, &par->extradata_size,
+                                pkt->data, pkt->size, 0);
+        if (ret < 0)
+            return ret;
+        flv_write_codec_header(s, par, pkt->dts);
+    }
+
     if (flv->delay == AV_NOPTS_VALUE)
         flv->delay = -pkt->dts;
 
@@ -858,7 +887,8 @@ static int flv_write_packet(AVFormatContext *s, AVPacket *pkt)
                "Packets are not in the proper order with respect to DTS\n");
         return AVERROR(EINVAL);
     }
-    if (par->codec_id == AV_CODEC_ID_H264 || par->codec_id == AV_CODEC_ID_MPEG4) {
+    if (par->codec_id == AV_CODEC_ID_H264 || par->codec_id == AV_CODEC_ID_MPEG4 ||
+        par->codec_id == AV_CODEC_ID_EVC) {
         if (pkt->pts == AV_NOPTS_VALUE) {
             av_log(s, AV_LOG_ERROR, "Packet is missing PTS\n");
             return AVERROR(EINVAL);
@@ -879,7 +909,11 @@ static int flv_write_packet(AVFormatContext *s, AVPacket *pkt)
     case AVMEDIA_TYPE_VIDEO:
         avio_w8(pb, FLV_TAG_TYPE_VIDEO);
 
-        flags = ff_codec_get_tag(flv_video_codec_ids, par->codec_id);
+        if (par->codec_id == AV_CODEC_ID_EVC)
+            flags = FLV_IS_EX_HEADER | (pkt->pts != pkt->dts ? PacketTypeCodedFrames :
+                                                               PacketTypeCodedFramesX);
+        else
+            flags = ff_codec_get_tag(flv_video_codec_ids, par->codec_id);
 
         flags |= pkt->flags & AV_PKT_FLAG_KEY ? FLV_FRAME_KEY : FLV_FRAME_INTER;
         break;
@@ -978,6 +1012,10 @@ static int flv_write_packet(AVFormatContext *s, AVPacket *pkt)
         else if (par->codec_id == AV_CODEC_ID_H264 || par->codec_id == AV_CODEC_ID_MPEG4) {
             avio_w8(pb, 1); // AVC NALU
             avio_wb24(pb, pkt->pts - pkt->dts);
+        } else if (par->codec_id == AV_CODEC_ID_EVC) {
+            avio_wb32(pb, par->codec_tag); // FourCC
+            if (pkt->pts != pkt->dts)
+                avio_wb24(pb, pkt->pts - pkt->dts);
         }
 
         avio_write(pb, data ? data : pkt->data, size);
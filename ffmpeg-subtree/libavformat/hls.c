@@ -37,6 +37,7 @@
 #include "libavutil/mathematics.h"
 #include "libavutil/opt.h"
 #include "libavutil/dict.h"
+#include "libavutil/thread.h"
 #include "libavutil/time.h"
 #include "avformat.h"
 #include "demux.h"
@@ -50,6 +51,7 @@
 
 #define MAX_FIELD_LEN 64
 #define MAX_CHARACTERISTICS_LEN 512
+#define MAX_SEG_PREFETCH 16
 
 #define MPEG_TIME_BASE 90000
 #define MPEG_TIME_BASE_Q (AVRational){1, MPEG_TIME_BASE}
@@ -92,6 +94,24 @@ enum PlaylistType {
     PLS_TYPE_VOD
 };
 
+/*
+ * A following segment opened in advance. With seg_prefetch above 1 it is
+ * opened in the background, so that the requests for several segments are in
+ * flight at the same time.
+ */
+struct segment_request {
+    AVFormatContext *s;
+    int64_t seq_no;
+    char *url;
+    AVDictionary *opts;
+    AVIOContext *pb;
+    int ret;
+#if HAVE_THREADS
+    pthread_t thread;
+    int threaded;       /* opened by thread, which has to be joined */
+#endif
+};
+
 /*
  * Each playlist has its own demuxer. If it currently is active,
  * it has an open AVIOContext too, and potentially an AVPacket
@@ -103,8 +123,9 @@ struct playlist {
     uint8_t* read_buffer;
     AVIOContext *input;
     int input_read_done;
-    AVIOContext *input_next;
-    int input_next_requested;
+    /* the following segments already requested, in order, with http_multiple */
+    struct segment_request *next_requests[MAX_SEG_PREFETCH];
+    int n_next_requests;
     AVFormatContext *parent;
     int index;
     AVFormatContext *ctx;
@@ -226,6 +247,7 @@ typedef struct HLSContext {
     int http_multiple;
     int http_seekable;
     int seg_max_retry;
+    int seg_prefetch;
     AVIOContext *playlist_pb;
     HLSCryptoContext  crypto_ctx;
 } HLSContext;
@@ -259,6 +281,40 @@ static void free_init_section_list(struct playlist *pls)
     pls->n_init_sections = 0;
 }
 
+static void *segment_request_task(void *arg)
+{
+    struct segment_request *req = arg;
+
+    req->ret = req->s->io_open(req->s, &req->pb, req->url, AVIO_FLAG_READ, &req->opts);
+    return NULL;
+}
+
+/* Wait for the request to be sent, and return its result and input if pb is not NULL. */
+static int finish_segment_request(struct segment_request *req, AVIOContext **pb)
+{
+    int ret;
+
+#if HAVE_THREADS
+    if (req->threaded)
+        pthread_join(req->thread, NULL);
+#endif
+    ret = req->ret;
+    if (pb && ret >= 0)
+        FFSWAP(AVIOContext *, *pb, req->pb);
+    ff_format_io_close(req->s, &req->pb);
+    av_dict_free(&req->opts);
+    av_free(req->url);
+    av_free(req);
+    return ret;
+}
+
+static void close_next_requests(struct playlist *pls)
+{
+    for (int i = 0; i < pls->n_next_requests; i++)
+        finish_segment_request(pls->next_requests[i], NULL);
+    pls->n_next_requests = 0;
+}
+
 static void free_playlist_list(HLSContext *c)
 {
     int i;
@@ -276,8 +332,7 @@ static void free_playlist_list(HLSContext *c)
         av_freep(&pls->pb.pub.buffer);
         ff_format_io_close(c->ctx, &pls->input);
         pls->input_read_done = 0;
-        ff_format_io_close(c->ctx, &pls->input_next);
-        pls->input_next_requested = 0;
+        close_next_requests(pls);
         if (pls->ctx) {
             pls->ctx->pb = NULL;
             avformat_close_input(&pls->ctx);
@@ -637,6 +692,18 @@ static int open_url_keepalive(AVFormatContext *s, AVIOContext **pb,
 #endif
 }
 
+// update cookies on http response with setcookies.
+static void update_cookies(AVFormatContext *s, AVIOContext *pb, AVDictionary **opts)
+{
+    char *new_cookies = NULL;
+
+    if (!(s->flags & AVFMT_FLAG_CUSTOM_IO))
+        av_opt_get(pb, "cookies", AV_OPT_SEARCH_CHILDREN, (uint8_t**)&new_cookies);
+
+    if (new_cookies)
+        av_dict_set(opts, "cookies", new_cookies, AV_DICT_DONT_STRDUP_VAL);
+}
+
 static int open_url(AVFormatContext *s, AVIOContext **pb, const char *url,
                     AVDictionary **opts, AVDictionary *opts2, int *is_http_out)
 {
@@ -705,16 +772,8 @@ static int open_url(AVFormatContext *s, AVIOContext **pb, const char *url,
     } else {
         ret = s->io_open(s, pb, url, AVIO_FLAG_READ, &tmp);
     }
-    if (ret >= 0) {
-        // update cookies on http response with setcookies.
-        char *new_cookies = NULL;
-
-        if (!(s->flags & AVFMT_FLAG_CUSTOM_IO))
-            av_opt_get(*pb, "cookies", AV_OPT_SEARCH_CHILDREN, (uint8_t**)&new_cookies);
-
-        if (new_cookies)
-            av_dict_set(opts, "cookies", new_cookies, AV_DICT_DONT_STRDUP_VAL);
-    }
+    if (ret >= 0)
+        update_cookies(s, *pb, opts);
 
     av_dict_free(&tmp);
 
@@ -1048,10 +1107,10 @@ static struct segment *current_segment(struct playlist *pls)
     return pls->segments[n];
 }
 
-static struct segment *next_segment(struct playlist *pls)
+static struct segment *segment_after(struct playlist *pls, int offset)
 {
-    int64_t n = pls->cur_seq_no - pls->start_seq_no + 1;
-    if (n >= pls->n_segments)
+    int64_t n = pls->cur_seq_no - pls->start_seq_no + offset;
+    if (n < 0 || n >= pls->n_segments)
         return NULL;
     return pls->segments[n];
 }
@@ -1356,6 +1415,57 @@ cleanup:
     return ret;
 }
 
+static int start_segment_request(HLSContext *c, struct playlist *pls,
+                                 struct segment *seg, int64_t seq_no)
+{
+    struct segment_request *req = av_mallocz(sizeof(*req));
+    int ret = AVERROR(ENOMEM);
+
+    if (!req)
+        return ret;
+    req->s      = pls->parent;
+    req->seq_no = seq_no;
+    req->url    = av_strdup(seg->url);
+    if (!req->url || av_dict_copy(&req->opts, c->avio_opts, 0) < 0)
+        goto fail;
+    if (c->http_persistent)
+        av_dict_set(&req->opts, "multiple_requests", "1", 0);
+    if (seg->size >= 0) {
+        av_dict_set_int(&req->opts, "offset", seg->url_offset, 0);
+        av_dict_set_int(&req->opts, "end_offset", seg->url_offset + seg->size, 0);
+    }
+
+    av_log(pls->parent, AV_LOG_VERBOSE, "HLS request for url '%s', offset %"PRId64", playlist %d, in advance\n",
+           seg->url, seg->url_offset, pls->index);
+
+#if HAVE_THREADS
+    /* a single segment ahead is opened right away, so that io_open is only
+     * called from other threads when the user asked for more */
+    if (c->seg_prefetch > 1) {
+        ret = pthread_create(&req->thread, NULL, segment_request_task, req);
+        if (ret) {
+            ret = AVERROR(ret);
+            goto fail;
+        }
+        req->threaded = 1;
+    } else
+#endif
+    {
+        segment_request_task(req);
+        if ((ret = req->ret) < 0)
+            goto fail;
+    }
+
+    pls->next_requests[pls->n_next_requests++] = req;
+    return 0;
+
+fail:
+    av_dict_free(&req->opts);
+    av_free(req->url);
+    av_free(req);
+    return ret;
+}
+
 static int update_init_section(struct playlist *pls, struct segment *seg)
 {
     static const int max_init_section_size = 1024*1024;
@@ -1551,14 +1661,24 @@ reload:
         if (ret)
             return ret;
 
-        if (c->http_multiple == 1 && v->input_next_requested) {
-            FFSWAP(AVIOContext *, v->input, v->input_next);
-            v->cur_seg_offset = 0;
-            v->input_next_requested = 0;
-            ret = 0;
+        ret = -1;
+        if (v->n_next_requests && v->next_requests[0]->seq_no == v->cur_seq_no) {
+            struct segment_request *req = v->next_requests[0];
+
+            memmove(v->next_requests, v->next_requests + 1,
+                    --v->n_next_requests * sizeof(*v->next_requests));
+            ff_format_io_close(v->parent, &v->input);
+            ret = finish_segment_request(req, &v->input);
+            if (ret >= 0) {
+                update_cookies(v->parent, v->input, &c->avio_opts);
+                v->cur_seg_offset = 0;
+            }
         } else {
-            ret = open_input(c, v, seg, &v->input);
+            /* the segments were skipped or the playlist reloaded differently */
+            close_next_requests(v);
         }
+        if (ret < 0)
+            ret = open_input(c, v, seg, &v->input);
         if (ret < 0) {
             if (ff_check_interrupt(c->interrupt_callback))
                 return AVERROR_EXIT;
@@ -1589,18 +1709,22 @@ reload:
         }
     }
 
-    seg = next_segment(v);
-    if (c->http_multiple == 1 && !v->input_next_requested &&
-        seg && seg->key_type == KEY_NONE && av_strstart(seg->url, "http", NULL)) {
-        ret = open_input(c, v, seg, &v->input_next);
+    /* The following segments are requested in advance, so that they are
+     * downloaded on their own connections while this one is read. */
+    while (c->http_multiple == 1 && v->n_next_requests < c->seg_prefetch) {
+        int n = v->n_next_requests;
+
+        seg = segment_after(v, n + 1);
+        if (!seg || seg->key_type != KEY_NONE || !av_strstart(seg->url, "http", NULL))
+            break;
+        ret = start_segment_request(c, v, seg, v->cur_seq_no + n + 1);
         if (ret < 0) {
             if (ff_check_interrupt(c->interrupt_callback))
                 return AVERROR_EXIT;
-            av_log(v->parent, AV_LOG_WARNING, "Failed to open segment %"PRId64" of playlist %d\n",
-                   v->cur_seq_no + 1,
+            av_log(v->parent, AV_LOG_WARNING, "Failed to request segment %"PRId64" of playlist %d\n",
+                   v->cur_seq_no + n + 1,
                    v->index);
-        } else {
-            v->input_next_requested = 1;
+            break;
         }
     }
 
@@ -1860,6 +1984,11 @@ static int set_stream_info_from_input_stream(AVStream *st, struct playlist *pls,
         memcpy(dst_data, sd_src->data, sd_src->size);
     }
 
+    /* There is no native EVC decoder to find the stream parameters with, so let
+     * avformat_find_stream_info() get them from the parser instead. */
+    if (ist->codecpar->codec_id == AV_CODEC_ID_EVC)
+        ffstream(st)->need_parsing = AVSTREAM_PARSE_HEADERS;
+
     ffstream(st)->need_context_update = 1;
 
     return 0;
@@ -2084,9 +2213,7 @@ static int hls_read_header(AVFormatContext *s)
             ff_format_io_close(pls->parent, &pls->input);
             pls->input = NULL;
             pls->input_read_done = 0;
-            ff_format_io_close(pls->parent, &pls->input_next);
-            pls->input_next = NULL;
-            pls->input_next_requested = 0;
+            close_next_requests(pls);
             pls->cur_seg_offset = 0;
             pls->cur_init_section = NULL;
             /* Reset EOF flag */
@@ -2207,6 +2334,14 @@ static int hls_read_header(AVFormatContext *s)
     return 0;
 }
 
+static int playlist_is_evc_only(struct playlist *pls)
+{
+    for (int i = 0; i < pls->n_main_streams; i++)
+        if (pls->main_streams[i]->codecpar->codec_id != AV_CODEC_ID_EVC)
+            return 0;
+    return pls->n_main_streams > 0;
+}
+
 static int recheck_discard_flags(AVFormatContext *s, int first)
 {
     HLSContext *c = s->priv_data;
@@ -2228,17 +2363,17 @@ static int recheck_discard_flags(AVFormatContext *s, int first)
             pls->cur_seq_no = select_cur_seq_no(c, pls);
             pls->pb.pub.eof_reached = 0;
             if (c->cur_timestamp != AV_NOPTS_VALUE) {
-                /* catch up */
+                /* catch up, EVC renditions from their next key frame as
+                 * libxevd fails on the pictures before it */
                 pls->seek_timestamp = c->cur_timestamp;
-                pls->seek_flags = AVSEEK_FLAG_ANY;
+                pls->seek_flags = playlist_is_evc_only(pls) ? 0 : AVSEEK_FLAG_ANY;
                 pls->seek_stream_index = -1;
             }
             av_log(s, AV_LOG_INFO, "Now receiving playlist %d, segment %"PRId64"\n", i, pls->cur_seq_no);
         } else if (first && !cur_needed && pls->needed) {
             ff_format_io_close(pls->parent, &pls->input);
             pls->input_read_done = 0;
-            ff_format_io_close(pls->parent, &pls->input_next);
-            pls->input_next_requested = 0;
+            close_next_requests(pls);
             pls->needed = 0;
             changed = 1;
             av_log(s, AV_LOG_INFO, "No longer receiving playlist %d\n", i);
@@ -2493,8 +2628,7 @@ static int hls_read_seek(AVFormatContext *s, int stream_index,
         AVIOContext *const pb = &pls->pb.pub;
         ff_format_io_close(pls->parent, &pls->input);
         pls->input_read_done = 0;
-        ff_format_io_close(pls->parent, &pls->input_next);
-        pls->input_next_requested = 0;
+        close_next_requests(pls);
         av_packet_unref(pls->pkt);
         pb->eof_reached = 0;
         /* Clear any buffered data */
@@ -2568,7 +2702,7 @@ static const AVOption hls_options[] = {
         OFFSET(prefer_x_start), AV_OPT_TYPE_BOOL, { .i64 = 0 }, 0, 1, FLAGS},
     {"allowed_extensions", "List of file extensions that hls is allowed to access",
         OFFSET(allowed_extensions), AV_OPT_TYPE_STRING,
-        {.str = "3gp,aac,avi,ac3,eac3,flac,mkv,m3u8,m4a,m4s,m4v,mpg,mov,mp2,mp3,mp4,mpeg,mpegts,ogg,ogv,oga,ts,vob,wav"},
+        {.str = "3gp,aac,avi,ac3,eac3,evc,flac,mkv,m3u8,m4a,m4s,m4v,mpg,mov,mp2,mp3,mp4,mpeg,mpegts,ogg,ogv,oga,ts,vob,wav"},
         INT_MIN, INT_MAX, FLAGS},
     {"max_reload", "Maximum number of times a insufficient list is attempted to be reloaded",
         OFFSET(max_reload), AV_OPT_TYPE_INT, {.i64 = 1000}, 0, INT_MAX, FLAGS},
@@ -2584,6 +2718,8 @@ static const AVOption hls_options[] = {
         OFFSET(seg_format_opts), AV_OPT_TYPE_DICT, {.str = NULL}, 0, 0, FLAGS},
     {"seg_max_retry", "Maximum number of times to reload a segment on error.",
      OFFSET(seg_max_retry), AV_OPT_TYPE_INT, {.i64 = 0}, 0, INT_MAX, FLAGS},
+    {"seg_prefetch", "Number of following segments requested in advance with http_multiple",
+     OFFSET(seg_prefetch), AV_OPT_TYPE_INT, {.i64 = 1}, 1, MAX_SEG_PREFETCH, FLAGS},
     {NULL}
 };
 
@@ -48,6 +48,7 @@
 #include "avformat.h"
 #include "avio_internal.h"
 #include "avc.h"
+#include "evc.h"
 #if CONFIG_HTTP_PROTOCOL
 #include "http.h"
 #endif
@@ -346,7 +347,7 @@ static void set_http_options(AVFormatContext *s, AVDictionary **options, HLSCont
 static void write_codec_attr(AVStream *st, VariantStream *vs)
 {
     int codec_strlen = strlen(vs->codec_attr);
-    char attr[32];
+    char attr[64];
 
     if (st->codecpar->codec_type == AVMEDIA_TYPE_SUBTITLE)
         return;
@@ -416,6 +417,10 @@ static void write_codec_attr(AVStream *st, VariantStream *vs)
             snprintf(attr, sizeof(attr), "%s.%d.4.L%d.B01", av_fourcc2str(st->codecpar->codec_tag), profile, level);
         } else
             goto fail;
+    } else if (st->codecpar->codec_id == AV_CODEC_ID_EVC) {
+        if (ff_evc_get_codec_string(attr, sizeof(attr), st->codecpar->extradata,
+                                    st->codecpar->extradata_size) < 0)
+            goto fail;
     } else if (st->codecpar->codec_id == AV_CODEC_ID_MP2) {
         snprintf(attr, sizeof(attr), "mp4a.40.33");
     } else if (st->codecpar->codec_id == AV_CODEC_ID_MP3) {
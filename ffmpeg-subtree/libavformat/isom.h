@@ -327,6 +327,7 @@ typedef struct MOVContext {
         int64_t extent_offset;
     } *avif_info;
     int avif_info_size;
+    int parse_evc;
 } MOVContext;
 
 int ff_mp4_read_descr_len(AVIOContext *pb);
@@ -363,6 +364,8 @@ void ff_mp4_parse_es_descr(AVIOContext *pb, int *es_id);
 #define MOV_FRAG_SAMPLE_FLAG_DEPENDED_MASK             0x00c00000
 #define MOV_FRAG_SAMPLE_FLAG_DEPENDS_MASK              0x03000000
 
+#define MOV_FRAG_SAMPLE_FLAG_DEPENDED_NO               0x00800000
+
 #define MOV_FRAG_SAMPLE_FLAG_DEPENDS_NO                0x02000000
 #define MOV_FRAG_SAMPLE_FLAG_DEPENDS_YES               0x01000000
 
@@ -25,6 +25,7 @@
 
 #include "av1.h"
 #include "avc.h"
+#include "evc.h"
 #include "hevc.h"
 #include "avformat.h"
 #include "avio_internal.h"
@@ -1131,6 +1132,11 @@ static int mkv_assemble_native_codecprivate(AVFormatContext *s, AVIOContext *dyn
     case AV_CODEC_ID_HEVC:
         return ff_isom_write_hvcc(dyn_cp, extradata,
                                   extradata_size, 0);
+    case AV_CODEC_ID_EVC:
+        if (extradata_size)
+            return ff_isom_write_evcc(dyn_cp, extradata,
+                                      extradata_size, 0);
+        break;
     case AV_CODEC_ID_ALAC:
         if (extradata_size < 36) {
             av_log(s, AV_LOG_ERROR,
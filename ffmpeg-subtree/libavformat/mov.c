@@ -2558,6 +2558,43 @@ static int mov_parse_stsd_data(MOVContext *c, AVIOContext *pb,
     return 0;
 }
 
+/*
+ * Export the stream properties stored in evcC, so that EVC tracks can be
+ * demuxed without parsing every packet: keyframes and timestamps already
+ * come from the sample tables.
+ */
+static int mov_parse_evcc(AVStream *st)
+{
+    static const enum AVPixelFormat pix_fmts[3][4] = {
+        { AV_PIX_FMT_GRAY8,  AV_PIX_FMT_YUV420P,   AV_PIX_FMT_YUV422P,   AV_PIX_FMT_YUV444P   },
+        { AV_PIX_FMT_GRAY10, AV_PIX_FMT_YUV420P10, AV_PIX_FMT_YUV422P10, AV_PIX_FMT_YUV444P10 },
+        { AV_PIX_FMT_GRAY12, AV_PIX_FMT_YUV420P12, AV_PIX_FMT_YUV422P12, AV_PIX_FMT_YUV444P12 },
+    };
+    AVCodecParameters *par = st->codecpar;
+    const uint8_t *evcc = par->extradata;
+    int chroma_format_idc, bit_depth;
+
+    // configurationVersion, profile_idc, level_idc, toolset_idc_h/l, chroma/bit depth,
+    // pic_width/height_in_luma_samples
+    if (par->extradata_size < 16 || evcc[0] != 1)
+        return AVERROR_INVALIDDATA;
+
+    par->profile = evcc[1];
+    par->level   = evcc[2];
+
+    chroma_format_idc = evcc[11] >> 6;
+    bit_depth         = ((evcc[11] >> 3) & 7) + 8;
+    if (!(bit_depth & 1) && bit_depth <= 12)
+        par->format = pix_fmts[(bit_depth - 8) >> 1][chroma_format_idc];
+
+    if (!par->width || !par->height) {
+        par->width  = AV_RB16(evcc + 12);
+        par->height = AV_RB16(evcc + 14);
+    }
+
+    return 0;
+}
+
 static int mov_finalize_stsd_codec(MOVContext *c, AVIOContext *pb,
                                    AVStream *st, MOVStreamContext *sc)
 {
@@ -2647,6 +2684,8 @@ static int mov_finalize_stsd_codec(MOVContext *c, AVIOContext *pb,
         sti->need_parsing = AVSTREAM_PARSE_FULL;
         break;
     case AV_CODEC_ID_EVC:
+        if (!c->parse_evc && mov_parse_evcc(st) >= 0)
+            break;
     case AV_CODEC_ID_AV1:
         /* field_order detection of H264 requires parsing */
     case AV_CODEC_ID_H264:
@@ -3697,7 +3736,8 @@ static void mov_estimate_video_delay(MOVContext *c, AVStream* st)
         pts_buf[j] = INT64_MIN;
 
     if (st->codecpar->video_delay <= 0 && msc->ctts_data &&
-        st->codecpar->codec_id == AV_CODEC_ID_H264) {
+        (st->codecpar->codec_id == AV_CODEC_ID_H264 ||
+         st->codecpar->codec_id == AV_CODEC_ID_EVC)) {
         st->codecpar->video_delay = 0;
         for (int ind = 0; ind < sti->nb_index_entries && ctts_ind < msc->ctts_count; ++ind) {
             // Point j to the last elem of the buffer and insert the current pts there.
@@ -9270,6 +9310,8 @@ static const AVOption mov_options[] = {
         FLAGS, "use_mfra_for" },
     {"use_tfdt", "use tfdt for fragment timestamps", OFFSET(use_tfdt), AV_OPT_TYPE_BOOL, {.i64 = 1},
         0, 1, FLAGS},
+    {"parse_evc", "parse EVC packets, instead of trusting evcC and the sample tables",
+        OFFSET(parse_evc), AV_OPT_TYPE_BOOL, {.i64 = 1}, 0, 1, FLAGS},
     { "export_all", "Export unrecognized metadata entries", OFFSET(export_all),
         AV_OPT_TYPE_BOOL, { .i64 = 0 }, 0, 1, .flags = FLAGS },
     { "export_xmp", "Export full XMP metadata", OFFSET(export_xmp),
@@ -38,6 +38,7 @@
 #include "evc.h"
 #include "libavcodec/ac3_parser_internal.h"
 #include "libavcodec/dnxhddata.h"
+#include "libavcodec/evc.h"
 #include "libavcodec/flac.h"
 #include "libavcodec/get_bits.h"
 
@@ -120,6 +121,7 @@ static const AVOption options[] = {
     { "pts", NULL, 0, AV_OPT_TYPE_CONST, {.i64 = MOV_PRFT_SRC_PTS}, 0, 0, AV_OPT_FLAG_ENCODING_PARAM, "prft"},
     { "empty_hdlr_name", "write zero-length name string in hdlr atoms within mdia and minf atoms", offsetof(MOVMuxContext, empty_hdlr_name), AV_OPT_TYPE_BOOL, {.i64 = 0}, 0, 1, AV_OPT_FLAG_ENCODING_PARAM},
     { "movie_timescale", "set movie timescale", offsetof(MOVMuxContext, movie_timescale), AV_OPT_TYPE_INT, {.i64 = MOV_TIMESCALE}, 1, INT_MAX, AV_OPT_FLAG_ENCODING_PARAM},
+    { "evc_length_size", "Size in bytes of the NAL unit length fields of EVC samples (1, 2 or 4)", offsetof(MOVMuxContext, evc_length_size), AV_OPT_TYPE_INT, {.i64 = 4}, 1, 4, AV_OPT_FLAG_ENCODING_PARAM},
     { NULL },
 };
 
@@ -241,7 +243,7 @@ static int mov_write_stsz_tag(AVIOContext *pb, MOVTrack *track)
 /* Sample to chunk atom */
 static int mov_write_stsc_tag(AVIOContext *pb, MOVTrack *track)
 {
-    int index = 0, oldval = -1, i;
+    int index = 0, oldval = -1, old_stsd = -1, i;
     int64_t entryPos, curpos;
 
     int64_t pos = avio_tell(pb);
@@ -251,11 +253,13 @@ static int mov_write_stsc_tag(AVIOContext *pb, MOVTrack *track)
     entryPos = avio_tell(pb);
     avio_wb32(pb, track->chunkCount); // entry count
     for (i = 0; i < track->entry; i++) {
-        if (oldval != track->cluster[i].samples_in_chunk && track->cluster[i].chunkNum) {
+        if ((oldval != track->cluster[i].samples_in_chunk ||
+             old_stsd != track->cluster[i].stsd_index) && track->cluster[i].chunkNum) {
             avio_wb32(pb, track->cluster[i].chunkNum); // first chunk
             avio_wb32(pb, track->cluster[i].samples_in_chunk); // samples per chunk
-            avio_wb32(pb, 0x1); // sample description index
-            oldval = track->cluster[i].samples_in_chunk;
+            avio_wb32(pb, track->cluster[i].stsd_index + 1); // sample description index
+            oldval   = track->cluster[i].samples_in_chunk;
+            old_stsd = track->cluster[i].stsd_index;
             index++;
         }
     }
@@ -1456,17 +1460,49 @@ static int mov_write_hvcc_tag(AVIOContext *pb, MOVTrack *track)
     return update_size(pb, pos);
 }
 
+/* lengthSizeMinusOne of an evcC built or copied from the input */
+static void mov_evcc_set_length_size(MOVTrack *track, uint8_t *evcc, int evcc_len)
+{
+    if (evcc_len > 16)
+        evcc[16] = 0xfc | (track->evc_dst_length_size - 1);
+}
+
+static int mov_build_evcc(MOVTrack *track)
+{
+    /* vos_data is not replaced once set, so the record is built only once
+     * for all the moov boxes and init segments of the track */
+    if (!track->evcc_data) {
+        int ret = ff_evc_build_evcc(&track->evcc_data, &track->evcc_len,
+                                    track->vos_data, track->vos_len,
+                                    track->tag == MKTAG('e','v','c','1'));
+        if (ret == AVERROR(ENOMEM))
+            return ret;
+        mov_evcc_set_length_size(track, track->evcc_data, track->evcc_len);
+    }
+
+    return 0;
+}
+
 static int mov_write_evcc_tag(AVIOContext *pb, MOVTrack *track)
 {
     int64_t pos = avio_tell(pb);
+    const uint8_t *evcc;
+    int evcc_len, ret;
+
+    if (track->write_stsd) {
+        evcc     = track->evc_stsd[track->write_stsd - 1].evcc_data;
+        evcc_len = track->evc_stsd[track->write_stsd - 1].evcc_len;
+    } else {
+        ret = mov_build_evcc(track);
+        if (ret < 0)
+            return ret;
+        evcc     = track->evcc_data;
+        evcc_len = track->evcc_len;
+    }
 
     avio_wb32(pb, 0);
     ffio_wfourcc(pb, "evcC");
-
-    if (track->tag == MKTAG('e','v','c','1'))
-        ff_isom_write_evcc(pb, track->vos_data, track->vos_len, 1);
-    else
-        ff_isom_write_evcc(pb, track->vos_data, track->vos_len, 0);
+    avio_write(pb, evcc, evcc_len);
 
     return update_size(pb, pos);
 }
@@ -2285,6 +2321,7 @@ static int mov_write_video_tag(AVFormatContext *s, AVIOContext *pb, MOVMuxContex
     int64_t pos = avio_tell(pb);
     char compressor_name[32] = { 0 };
     int avid = 0;
+    int width = track->par->width, height = track->height;
 
     int uncompressed_ycbcr = ((track->par->codec_id == AV_CODEC_ID_RAWVIDEO && track->par->format == AV_PIX_FMT_UYVY422)
                            || (track->par->codec_id == AV_CODEC_ID_RAWVIDEO && track->par->format == AV_PIX_FMT_YUYV422)
@@ -2321,8 +2358,12 @@ static int mov_write_video_tag(AVFormatContext *s, AVIOContext *pb, MOVMuxContex
     } else {
         ffio_fill(pb, 0, 3 * 4); /* Reserved */
     }
-    avio_wb16(pb, track->par->width); /* Video width */
-    avio_wb16(pb, track->height); /* Video height */
+    if (track->write_stsd) {
+        width  = track->evc_stsd[track->write_stsd - 1].width;
+        height = track->evc_stsd[track->write_stsd - 1].height;
+    }
+    avio_wb16(pb, width); /* Video width */
+    avio_wb16(pb, height); /* Video height */
     avio_wb32(pb, 0x00480000); /* Horizontal resolution 72dpi */
     avio_wb32(pb, 0x00480000); /* Vertical resolution 72dpi */
     avio_wb32(pb, 0); /* Data size (= 0) */
@@ -2583,10 +2624,14 @@ static int mov_write_stsd_tag(AVFormatContext *s, AVIOContext *pb, MOVMuxContext
     avio_wb32(pb, 0); /* size */
     ffio_wfourcc(pb, "stsd");
     avio_wb32(pb, 0); /* version & flags */
-    avio_wb32(pb, 1); /* entry count */
-    if (track->par->codec_type == AVMEDIA_TYPE_VIDEO)
-        ret = mov_write_video_tag(s, pb, mov, track);
-    else if (track->par->codec_type == AVMEDIA_TYPE_AUDIO)
+    avio_wb32(pb, 1 + track->nb_evc_stsd); /* entry count */
+    if (track->par->codec_type == AVMEDIA_TYPE_VIDEO) {
+        for (int i = 0; ret >= 0 && i <= track->nb_evc_stsd; i++) {
+            track->write_stsd = i;
+            ret = mov_write_video_tag(s, pb, mov, track);
+        }
+        track->write_stsd = 0;
+    } else if (track->par->codec_type == AVMEDIA_TYPE_AUDIO)
         ret = mov_write_audio_tag(s, pb, mov, track);
     else if (track->par->codec_type == AVMEDIA_TYPE_SUBTITLE)
         ret = mov_write_subtitle_tag(s, pb, track);
@@ -2799,6 +2844,47 @@ static int mov_preroll_write_stbl_atoms(AVIOContext *pb, MOVTrack *track)
     return 0;
 }
 
+/* Temporal level sample grouping, the group description index of a sample
+ * is its temporal sub-layer plus 1. */
+static int mov_write_tele_stbl_atoms(AVIOContext *pb, MOVTrack *track)
+{
+    int entries = 0;
+    int i, count;
+
+    for (i = 0; i < track->entry; i++)
+        if (!i || track->cluster[i].temporal_id != track->cluster[i - 1].temporal_id)
+            entries++;
+
+    /* Write sgpd tag */
+    avio_wb32(pb, 24 + track->max_temporal_id + 1); /* size */
+    ffio_wfourcc(pb, "sgpd");
+    avio_wb32(pb, 1 << 24); /* fullbox */
+    ffio_wfourcc(pb, "tele");
+    avio_wb32(pb, 1); /* default_length */
+    avio_wb32(pb, track->max_temporal_id + 1); /* entry_count */
+    for (i = 0; i <= track->max_temporal_id; i++) {
+        /* only the base layer can be decoded without the samples of other layers */
+        avio_w8(pb, !i << 7); /* level_independently_decodable */
+    }
+
+    /* Write sbgp tag */
+    avio_wb32(pb, 20 + (entries * 8)); /* size */
+    ffio_wfourcc(pb, "sbgp");
+    avio_wb32(pb, 0); /* fullbox */
+    ffio_wfourcc(pb, "tele");
+    avio_wb32(pb, entries); /* entry_count */
+    for (i = 0, count = 1; i < track->entry; i++, count++) {
+        if (i + 1 < track->entry &&
+            track->cluster[i + 1].temporal_id == track->cluster[i].temporal_id)
+            continue;
+        avio_wb32(pb, count); /* sample_count */
+        avio_wb32(pb, track->cluster[i].temporal_id + 1); /* group_description_index */
+        count = 0;
+    }
+
+    return 0;
+}
+
 static int mov_write_stbl_tag(AVFormatContext *s, AVIOContext *pb, MOVMuxContext *mov, MOVTrack *track)
 {
     int64_t pos = avio_tell(pb);
@@ -2834,6 +2920,8 @@ static int mov_write_stbl_tag(AVFormatContext *s, AVIOContext *pb, MOVMuxContext
     if (track->par->codec_id == AV_CODEC_ID_OPUS || track->par->codec_id == AV_CODEC_ID_AAC) {
         mov_preroll_write_stbl_atoms(pb, track);
     }
+    if (track->par->codec_id == AV_CODEC_ID_EVC && track->max_temporal_id && track->entry)
+        mov_write_tele_stbl_atoms(pb, track);
     return update_size(pb, pos);
 }
 
@@ -4517,7 +4605,8 @@ static void build_chunks(MOVTrack *trk)
     trk->chunkCount = 1;
     for (i = 1; i<trk->entry; i++){
         if (chunk->pos + chunkSize == trk->cluster[i].pos &&
-            chunkSize + trk->cluster[i].size < (1<<20)){
+            chunkSize + trk->cluster[i].size < (1<<20) &&
+            chunk->stsd_index == trk->cluster[i].stsd_index){
             chunkSize             += trk->cluster[i].size;
             chunk->samples_in_chunk += trk->cluster[i].entries;
         } else {
@@ -4806,8 +4895,14 @@ static int mov_write_mfhd_tag(AVIOContext *pb, MOVMuxContext *mov)
 
 static uint32_t get_sample_flags(MOVTrack *track, MOVIentry *entry)
 {
-    return entry->flags & MOV_SYNC_SAMPLE ? MOV_FRAG_SAMPLE_FLAG_DEPENDS_NO :
-           (MOV_FRAG_SAMPLE_FLAG_DEPENDS_YES | MOV_FRAG_SAMPLE_FLAG_IS_NON_SYNC);
+    uint32_t flags = entry->flags & MOV_SYNC_SAMPLE ? MOV_FRAG_SAMPLE_FLAG_DEPENDS_NO :
+                     (MOV_FRAG_SAMPLE_FLAG_DEPENDS_YES | MOV_FRAG_SAMPLE_FLAG_IS_NON_SYNC);
+
+    /* the fragment equivalent of sdtp */
+    if (entry->flags & MOV_DISPOSABLE_SAMPLE)
+        flags |= MOV_FRAG_SAMPLE_FLAG_DEPENDED_NO;
+
+    return flags;
 }
 
 static int mov_write_tfhd_tag(AVIOContext *pb, MOVMuxContext *mov,
@@ -5726,6 +5821,147 @@ static void mov_parse_truehd_frame(AVPacket *pkt, MOVTrack *trk)
     return;
 }
 
+/* TemporalId of the first VCL NAL unit of an EVC access unit */
+static int mov_evc_get_temporal_id(const uint8_t *buf, int size, int length_size)
+{
+    const uint8_t *end = buf + size;
+
+    while (end - buf > length_size) {
+        uint32_t nalu_size = ff_evc_nal_unit_length_n(buf, end - buf, length_size);
+        int nalu_type;
+
+        buf += length_size;
+        if (nalu_size > end - buf)
+            break;
+        nalu_type = ff_evc_nal_unit_type(buf, nalu_size);
+        if (nalu_type == EVC_NOIDR_NUT || nalu_type == EVC_IDR_NUT)
+            return ff_evc_nal_unit_temporal_id(buf, nalu_size);
+        buf += nalu_size;
+    }
+
+    return 0;
+}
+
+static int mov_evc_ps_changed(const FFEVCParamSets *cur, const FFEVCParamSets *ps)
+{
+    for (int i = 0; i < FF_ARRAY_ELEMS(ps->sps); i++)
+        if (ps->sps[i].size && (ps->sps[i].size != cur->sps[i].size ||
+                                memcmp(ps->sps[i].data, cur->sps[i].data, ps->sps[i].size)))
+            return 1;
+    for (int i = 0; i < FF_ARRAY_ELEMS(ps->pps); i++)
+        if (ps->pps[i].size && (ps->pps[i].size != cur->pps[i].size ||
+                                memcmp(ps->pps[i].data, cur->pps[i].data, ps->pps[i].size)))
+            return 1;
+    return 0;
+}
+
+/*
+ * Select the sample description of an EVC packet announcing new parameter sets
+ * with AV_PKT_DATA_NEW_EXTRADATA, adding one if they match none of the previous
+ * descriptions. Fragments can only reference the descriptions of the moov written
+ * before them, so they keep relying on the parameter sets sent in band.
+ */
+static int mov_evc_update_stsd(AVFormatContext *s, MOVTrack *trk, const AVPacket *pkt)
+{
+    MOVMuxContext *mov = s->priv_data;
+    FFEVCParamSets ps = { 0 };
+    MOVEvcSampleDesc *desc, *stsd;
+    uint8_t *side, *data = NULL, *evcc = NULL;
+    size_t side_size;
+    int evcc_len, size, ret;
+
+    side = av_packet_get_side_data(pkt, AV_PKT_DATA_NEW_EXTRADATA, &side_size);
+    if (!side || !side_size || side_size > INT_MAX || !trk->vos_len)
+        return 0;
+
+    if (!trk->evc_ps_valid) {
+        ret = ff_evc_param_sets_update(&trk->evc_ps, trk->vos_data, trk->vos_len);
+        if (ret == AVERROR(ENOMEM))
+            return ret;
+        trk->evc_ps_valid = 1;
+    }
+
+    ret = ff_evc_param_sets_update(&ps, side, side_size);
+    if (ret < 0) {
+        // broken side data does not prevent muxing the packet itself
+        if (ret != AVERROR(ENOMEM))
+            ret = 0;
+        goto end;
+    }
+    if (!mov_evc_ps_changed(&trk->evc_ps, &ps))
+        goto end;
+
+    ret = ff_evc_param_sets_update(&trk->evc_ps, side, side_size);
+    if (ret < 0)
+        goto end;
+
+    if (mov->flags & FF_MOV_FLAG_FRAGMENT) {
+        av_log(s, AV_LOG_VERBOSE, "Parameter sets of stream %d changed, "
+               "they are only available in band\n", pkt->stream_index);
+        goto end;
+    }
+
+    size = ff_evc_param_sets_write(&trk->evc_ps, NULL);
+    data = av_malloc(size);
+    if (!data) {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+    ff_evc_param_sets_write(&trk->evc_ps, data);
+
+    ret = ff_evc_build_evcc(&evcc, &evcc_len, data, size,
+                            trk->tag == MKTAG('e','v','c','1'));
+    if (ret < 0)
+        goto end;
+    mov_evcc_set_length_size(trk, evcc, evcc_len);
+    ret = mov_build_evcc(trk);
+    if (ret < 0)
+        goto end;
+
+    // switching back to earlier parameter sets reuses their description
+    if (evcc_len == trk->evcc_len && !memcmp(evcc, trk->evcc_data, evcc_len)) {
+        trk->cur_stsd = 0;
+        goto end;
+    }
+    for (int i = 0; i < trk->nb_evc_stsd; i++) {
+        desc = &trk->evc_stsd[i];
+        if (evcc_len == desc->evcc_len && !memcmp(evcc, desc->evcc_data, evcc_len)) {
+            trk->cur_stsd = i + 1;
+            goto end;
+        }
+    }
+
+    if (trk->nb_evc_stsd + 1 >= MOV_MAX_STSD_ENTRIES || evcc_len < 16) {
+        av_log(s, AV_LOG_WARNING, "Cannot add a sample description for the new "
+               "parameter sets of stream %d\n", pkt->stream_index);
+        goto end;
+    }
+
+    // the earlier descriptions are kept on failure, they are referenced by muxed samples
+    stsd = av_realloc_array(trk->evc_stsd, trk->nb_evc_stsd + 1, sizeof(*trk->evc_stsd));
+    if (!stsd) {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+    trk->evc_stsd = stsd;
+    desc = &trk->evc_stsd[trk->nb_evc_stsd++];
+    desc->evcc_data = evcc;
+    desc->evcc_len  = evcc_len;
+    desc->width     = AV_RB16(evcc + 12); // pic_width_in_luma_samples
+    desc->height    = AV_RB16(evcc + 14); // pic_height_in_luma_samples
+    evcc = NULL;
+    trk->cur_stsd = trk->nb_evc_stsd;
+
+    av_log(s, AV_LOG_VERBOSE, "Added sample description %d (%dx%d) to stream %d\n",
+           trk->cur_stsd + 1, desc->width, desc->height, pkt->stream_index);
+
+end:
+    ff_evc_param_sets_uninit(&ps);
+    av_free(data);
+    av_free(evcc);
+    return ret;
+}
+
 static int mov_flush_fragment_interleaving(AVFormatContext *s, MOVTrack *track)
 {
     MOVMuxContext *mov = s->priv_data;
@@ -6171,6 +6407,12 @@ int ff_mov_write_packet(AVFormatContext *s, AVPacket *pkt)
         memset(trk->vos_data + size, 0, AV_INPUT_BUFFER_PADDING_SIZE);
     }
 
+    if (par->codec_id == AV_CODEC_ID_EVC) {
+        ret = mov_evc_update_stsd(s, trk, pkt);
+        if (ret < 0)
+            goto err;
+    }
+
     if (par->codec_id == AV_CODEC_ID_AAC && pkt->size > 2 &&
         (AV_RB16(pkt->data) & 0xfff0) == 0xfff0) {
         if (!s->streams[pkt->stream_index]->nb_frames) {
@@ -6221,6 +6463,21 @@ int ff_mov_write_packet(AVFormatContext *s, AVPacket *pkt)
                 size = ff_hevc_annexb2mp4(pb, pkt->data, pkt->size, 0, NULL);
             }
         }
+    } else if (par->codec_id == AV_CODEC_ID_EVC &&
+               (trk->cenc.aes_ctr || trk->evc_src_length_size != trk->evc_dst_length_size)) {
+        if (trk->cenc.aes_ctr)
+            size = ff_mov_cenc_evc_write_nal_units(s, &trk->cenc, trk->evc_src_length_size,
+                                                   trk->evc_dst_length_size, pb, pkt->data, pkt->size);
+        else
+            size = ff_evc_write_nal_units(pb, pkt->data, pkt->size,
+                                          trk->evc_src_length_size, trk->evc_dst_length_size);
+        if (size < 0) {
+            av_log(s, AV_LOG_ERROR, "Cannot write the NAL units of stream %d "
+                   "with %d byte length fields\n", pkt->stream_index,
+                   trk->evc_dst_length_size);
+            ret = size;
+            goto err;
+        }
     } else if (par->codec_id == AV_CODEC_ID_AV1) {
         if (trk->hint_track >= 0 && trk->hint_track < mov->nb_streams) {
             ret = ff_av1_filter_obus_buf(pkt->data, &reformatted_data,
@@ -6394,6 +6651,13 @@ int ff_mov_write_packet(AVFormatContext *s, AVPacket *pkt)
         trk->cluster[trk->entry].flags |= MOV_DISPOSABLE_SAMPLE;
         trk->has_disposable++;
     }
+    trk->cluster[trk->entry].temporal_id = 0;
+    trk->cluster[trk->entry].stsd_index  = trk->cur_stsd;
+    if (par->codec_id == AV_CODEC_ID_EVC) {
+        int tid = mov_evc_get_temporal_id(pkt->data, pkt->size, trk->evc_src_length_size);
+        trk->cluster[trk->entry].temporal_id = tid;
+        trk->max_temporal_id = FFMAX(trk->max_temporal_id, tid);
+    }
 
     prft = (AVProducerReferenceTime *)av_packet_get_side_data(pkt, AV_PKT_DATA_PRFT, &prft_size);
     if (prft && prft_size == sizeof(AVProducerReferenceTime))
@@ -6873,6 +7137,11 @@ static void mov_free(AVFormatContext *s)
         }
         if (track->vos_len)
             av_freep(&track->vos_data);
+        av_freep(&track->evcc_data);
+        for (int j = 0; j < track->nb_evc_stsd; j++)
+            av_freep(&track->evc_stsd[j].evcc_data);
+        av_freep(&track->evc_stsd);
+        ff_evc_param_sets_uninit(&track->evc_ps);
 
         ff_mov_cenc_free(&track->cenc);
         ffio_free_dyn_buf(&track->mdat_buf);
@@ -7349,7 +7618,8 @@ static int mov_init(AVFormatContext *s)
 
         if (mov->encryption_scheme == MOV_ENC_CENC_AES_CTR) {
             ret = ff_mov_cenc_init(&track->cenc, mov->encryption_key,
-                (track->par->codec_id == AV_CODEC_ID_H264 || track->par->codec_id == AV_CODEC_ID_HEVC),
+                (track->par->codec_id == AV_CODEC_ID_H264 || track->par->codec_id == AV_CODEC_ID_HEVC ||
+                 track->par->codec_id == AV_CODEC_ID_EVC),
                 s->flags & AVFMT_FLAG_BITEXACT);
             if (ret)
                 return ret;
@@ -7399,6 +7669,24 @@ static int mov_write_header(AVFormatContext *s)
             }
         }
 
+        if (st->codecpar->codec_id == AV_CODEC_ID_EVC) {
+            track->evc_src_length_size = ff_evc_nal_length_size(st->codecpar->extradata,
+                                                                st->codecpar->extradata_size);
+            track->evc_dst_length_size = mov->evc_length_size;
+            if (track->evc_src_length_size < 0 || mov->evc_length_size == 3) {
+                av_log(s, AV_LOG_ERROR, "EVC NAL unit length fields must be 1, 2 or 4 bytes\n");
+                return AVERROR(EINVAL);
+            }
+        }
+
+        /* the evcC of an empty moov can only be built from extradata */
+        if (st->codecpar->codec_id == AV_CODEC_ID_EVC && !track->vos_len &&
+            mov->flags & FF_MOV_FLAG_EMPTY_MOOV && !(mov->flags & FF_MOV_FLAG_DELAY_MOOV)) {
+            av_log(s, AV_LOG_ERROR, "EVC stream %d has no extradata to write an empty moov, "
+                   "use the delay_moov flag or global header parameter sets\n", i);
+            return AVERROR(EINVAL);
+        }
+
         if (st->codecpar->codec_type != AVMEDIA_TYPE_AUDIO ||
             av_channel_layout_compare(&track->par->ch_layout,
                                       &(AVChannelLayout)AV_CHANNEL_LAYOUT_MONO))
@@ -25,6 +25,7 @@
 #define AVFORMAT_MOVENC_H
 
 #include "avformat.h"
+#include "evc.h"
 #include "movenccenc.h"
 #include "libavcodec/packet_internal.h"
 
@@ -58,6 +59,8 @@ typedef struct MOVIentry {
 #define MOV_PARTIAL_SYNC_SAMPLE 0x0002
 #define MOV_DISPOSABLE_SAMPLE   0x0004
     uint32_t     flags;
+    uint8_t      temporal_id;           ///< temporal sub-layer of EVC samples
+    uint8_t      stsd_index;            ///< sample description of the sample, 0 for the first one
     AVProducerReferenceTime prft;
 } MOVIentry;
 
@@ -83,6 +86,18 @@ typedef struct MOVFragmentInfo {
     int size;
 } MOVFragmentInfo;
 
+/**
+ * Sample description added when the parameter sets of an EVC stream change
+ */
+typedef struct MOVEvcSampleDesc {
+    uint8_t     *evcc_data;
+    int         evcc_len;
+    int         width;
+    int         height;
+} MOVEvcSampleDesc;
+
+#define MOV_MAX_STSD_ENTRIES 255
+
 typedef struct MOVTrack {
     int         mode;
     int         entry;
@@ -95,6 +110,7 @@ typedef struct MOVTrack {
     long        chunkCount;
     int         has_keyframes;
     int         has_disposable;
+    int         max_temporal_id;
 #define MOV_TRACK_CTTS         0x0001
 #define MOV_TRACK_STPS         0x0002
 #define MOV_TRACK_ENABLED      0x0004
@@ -113,6 +129,16 @@ typedef struct MOVTrack {
 
     int         vos_len;
     uint8_t     *vos_data;
+    int         evcc_len;
+    uint8_t     *evcc_data;     ///< evcC record built once from vos_data
+    FFEVCParamSets evc_ps;      ///< EVC parameter sets the current sample description was built from
+    int         evc_ps_valid;
+    int         evc_src_length_size; ///< size of the NAL unit length prefixes of the input samples
+    int         evc_dst_length_size; ///< size of the NAL unit length prefixes written
+    MOVEvcSampleDesc *evc_stsd; ///< sample descriptions following the first one
+    int         nb_evc_stsd;
+    int         cur_stsd;       ///< sample description of the next sample
+    int         write_stsd;     ///< sample description being written in stsd
     MOVIentry   *cluster;
     unsigned    cluster_capacity;
     int         audio_vbr;
@@ -245,6 +271,7 @@ typedef struct MOVMuxContext {
     MOVPrftBox write_prft;
     int empty_hdlr_name;
     int movie_timescale;
+    int evc_length_size;
 
     int64_t avif_extent_pos[2];  // index 0 is YUV and 1 is Alpha.
     int avif_extent_length[2];   // index 0 is YUV and 1 is Alpha.
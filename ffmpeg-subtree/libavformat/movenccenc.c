@@ -23,6 +23,7 @@
 #include "avio_internal.h"
 #include "movenc.h"
 #include "avc.h"
+#include "libavcodec/evc.h"
 
 static int auxiliary_info_alloc_size(MOVMuxCencContext* ctx, int size)
 {
@@ -278,6 +279,79 @@ int ff_mov_cenc_avc_write_nal_units(AVFormatContext *s, MOVMuxCencContext* ctx,
     return 0;
 }
 
+int ff_mov_cenc_evc_write_nal_units(AVFormatContext *s, MOVMuxCencContext* ctx,
+    int src_length_size, int dst_length_size, AVIOContext *pb, const uint8_t *buf_in, int size)
+{
+    const uint8_t *ptr = buf_in, *end = buf_in + size;
+    int64_t out_size = 0;
+    int clear = 0;
+    int ret;
+
+    /* check the NAL unit lengths before anything is written or encrypted */
+    while (end - ptr > 0) {
+        uint32_t nalsize = ff_evc_nal_unit_length_n(ptr, end - ptr, src_length_size);
+
+        ptr += src_length_size;
+        if (nalsize < EVC_NALU_HEADER_SIZE || nalsize > end - ptr) {
+            av_log(s, AV_LOG_ERROR, "CENC-EVC: nal size %"PRIu32" remaining %td\n", nalsize, end - ptr);
+            return AVERROR_INVALIDDATA;
+        }
+        if (dst_length_size < 4 && nalsize >> (8 * dst_length_size))
+            return AVERROR(ERANGE);
+        out_size += dst_length_size + nalsize;
+        ptr += nalsize;
+    }
+    if (out_size > INT_MAX)
+        return AVERROR(ERANGE);
+
+    ret = mov_cenc_start_packet(ctx);
+    if (ret) {
+        return ret;
+    }
+
+    for (ptr = buf_in; end - ptr > 0;) {
+        uint32_t nalsize = ff_evc_nal_unit_length_n(ptr, end - ptr, src_length_size);
+        int nalu_type;
+
+        ptr += src_length_size;
+        nalu_type = ff_evc_nal_unit_type(ptr, nalsize);
+
+        switch (dst_length_size) {
+        case 1:  avio_w8(pb, nalsize);   break;
+        case 2:  avio_wb16(pb, nalsize); break;
+        default: avio_wb32(pb, nalsize); break;
+        }
+        clear += dst_length_size;
+
+        /* only the slice data is encrypted, the parameter sets and SEI stay readable */
+        if (nalu_type >= EVC_NOIDR_NUT && nalu_type <= EVC_RSV_VCL_NUT23) {
+            avio_write(pb, ptr, EVC_NALU_HEADER_SIZE);
+            clear += EVC_NALU_HEADER_SIZE;
+            for (; clear > UINT16_MAX; clear -= UINT16_MAX)
+                auxiliary_info_add_subsample(ctx, UINT16_MAX, 0);
+
+            mov_cenc_write_encrypted(ctx, pb, ptr + EVC_NALU_HEADER_SIZE, nalsize - EVC_NALU_HEADER_SIZE);
+            auxiliary_info_add_subsample(ctx, clear, nalsize - EVC_NALU_HEADER_SIZE);
+            clear = 0;
+        } else {
+            avio_write(pb, ptr, nalsize);
+            clear += nalsize;
+        }
+        ptr += nalsize;
+    }
+
+    /* trailing non-VCL NAL units */
+    for (; clear > 0; clear -= FFMIN(clear, UINT16_MAX))
+        auxiliary_info_add_subsample(ctx, FFMIN(clear, UINT16_MAX), 0);
+
+    ret = mov_cenc_end_packet(ctx);
+    if (ret) {
+        return ret;
+    }
+
+    return out_size;
+}
+
 /* TODO: reuse this function from movenc.c */
 static int64_t update_size(AVIOContext *pb, int64_t pos)
 {
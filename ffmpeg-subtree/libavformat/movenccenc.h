@@ -73,6 +73,16 @@ int ff_mov_cenc_avc_parse_nal_units(MOVMuxCencContext* ctx, AVIOContext *pb, con
 int ff_mov_cenc_avc_write_nal_units(AVFormatContext *s, MOVMuxCencContext* ctx, int nal_length_size,
     AVIOContext *pb, const uint8_t *buf_in, int size);
 
+/**
+ * Write EVC NAL units that are in MP4 format, converting their length fields from src_length_size
+ * to dst_length_size bytes. The length fields, the NAL unit headers and the non-VCL NAL units are
+ * written in the clear while the slice data is encrypted
+ *
+ * @return the number of bytes written, negative error code on failure
+ */
+int ff_mov_cenc_evc_write_nal_units(AVFormatContext *s, MOVMuxCencContext* ctx,
+    int src_length_size, int dst_length_size, AVIOContext *pb, const uint8_t *buf_in, int size);
+
 /**
  * Write the cenc atoms that should reside inside stbl
  */
@@ -30,6 +30,7 @@
 #include "libavcodec/ac3_parser_internal.h"
 #include "libavcodec/avcodec.h"
 #include "libavcodec/bytestream.h"
+#include "libavcodec/evc.h"
 #include "libavcodec/h264.h"
 #include "libavcodec/startcode.h"
 
@@ -368,6 +369,9 @@ static int get_dvb_stream_type(AVFormatContext *s, AVStream *st)
     case AV_CODEC_ID_HEVC:
         stream_type = STREAM_TYPE_VIDEO_HEVC;
         break;
+    case AV_CODEC_ID_EVC:
+        stream_type = STREAM_TYPE_VIDEO_EVC;
+        break;
     case AV_CODEC_ID_CAVS:
         stream_type = STREAM_TYPE_VIDEO_CAVS;
         break;
@@ -1776,6 +1780,48 @@ int ff_check_h264_startcode(AVFormatContext *s, const AVStream *st, const AVPack
     return 0;
 }
 
+/*
+ * Write the parameter sets of the EVC extradata into dst as length-prefixed NAL units. The
+ * extradata is either an evcC record or NAL units already in that form. Returns the size
+ * written, or the size needed if dst is NULL.
+ */
+static int evc_extradata_to_nal_units(uint8_t *dst, const uint8_t *extradata, int extradata_size)
+{
+    GetByteContext gb;
+    int num_arrays, size = 0;
+
+    if (extradata[0] != 1) {
+        if (dst)
+            memcpy(dst, extradata, extradata_size);
+        return extradata_size;
+    }
+
+    // skip the evcC fields up to numOfArrays
+    bytestream2_init(&gb, extradata, extradata_size);
+    bytestream2_skip(&gb, 17);
+    num_arrays = bytestream2_get_byte(&gb);
+    for (int i = 0; i < num_arrays; i++) {
+        int num_nalus;
+
+        bytestream2_skip(&gb, 1);
+        num_nalus = bytestream2_get_be16(&gb);
+        for (int j = 0; j < num_nalus; j++) {
+            int nalu_size = bytestream2_get_be16(&gb);
+
+            if (bytestream2_get_bytes_left(&gb) < nalu_size)
+                return AVERROR_INVALIDDATA;
+            if (dst) {
+                AV_WB32(dst + size, nalu_size);
+                bytestream2_get_buffer(&gb, dst + size + EVC_NALU_LENGTH_PREFIX_SIZE, nalu_size);
+            } else
+                bytestream2_skip(&gb, nalu_size);
+            size += EVC_NALU_LENGTH_PREFIX_SIZE + nalu_size;
+        }
+    }
+
+    return size;
+}
+
 static int check_hevc_startcode(AVFormatContext *s, const AVStream *st, const AVPacket *pkt)
 {
     if (pkt->size < 5 || AV_RB32(pkt->data) != 0x0000001 && AV_RB24(pkt->data) != 0x000001) {
@@ -2015,6 +2061,39 @@ static int mpegts_write_packet_internal(AVFormatContext *s, AVPacket *pkt)
             buf     = data;
             size    = pkt->size + 7 + extradd;
         }
+    } else if (st->codecpar->codec_id == AV_CODEC_ID_EVC) {
+        int extradd = (pkt->flags & AV_PKT_FLAG_KEY) && st->codecpar->extradata_size;
+        int offset = 0;
+
+        /* IDR pictures are prefixed with the SPS and PPS, which are assumed
+         * to be available in 'extradata' if not found in-band. */
+        while (extradd && size - offset > EVC_NALU_LENGTH_PREFIX_SIZE) {
+            uint32_t nalu_size = ff_evc_nal_unit_length(buf + offset, size - offset);
+            int nalu_type = ff_evc_nal_unit_type(buf + offset + EVC_NALU_LENGTH_PREFIX_SIZE,
+                                                 size - offset - EVC_NALU_LENGTH_PREFIX_SIZE);
+
+            if (nalu_type == EVC_SPS_NUT)
+                extradd = 0;
+            if (nalu_type == EVC_SPS_NUT || nalu_type == EVC_NOIDR_NUT || nalu_type == EVC_IDR_NUT ||
+                nalu_size > size - offset - EVC_NALU_LENGTH_PREFIX_SIZE)
+                break;
+            offset += EVC_NALU_LENGTH_PREFIX_SIZE + nalu_size;
+        }
+
+        if (extradd) {
+            int ps_size = evc_extradata_to_nal_units(NULL, st->codecpar->extradata,
+                                                     st->codecpar->extradata_size);
+            if (ps_size < 0)
+                return ps_size;
+
+            data = av_malloc(ps_size + pkt->size);
+            if (!data)
+                return AVERROR(ENOMEM);
+            evc_extradata_to_nal_units(data, st->codecpar->extradata, st->codecpar->extradata_size);
+            memcpy(data + ps_size, pkt->data, pkt->size);
+            buf     = data;
+            size    = ps_size + pkt->size;
+        }
     } else if (st->codecpar->codec_id == AV_CODEC_ID_OPUS) {
         if (pkt->size < 2) {
             av_log(s, AV_LOG_ERROR, "Opus packet too short\n");
@@ -23,8 +23,14 @@
 #include "config_components.h"
 
 #include "libavutil/intreadwrite.h"
+#include "libavutil/mathematics.h"
+#include "libavutil/opt.h"
+
+#include "libavcodec/evc.h"
 
 #include "avformat.h"
+#include "avio_internal.h"
+#include "evc.h"
 #include "rawenc.h"
 #include "mux.h"
 
@@ -402,14 +408,164 @@ const FFOutputFormat ff_hevc_muxer = {
 #endif
 
 #if CONFIG_EVC_MUXER
+typedef struct EVCMuxContext {
+    const AVClass *class;
+    int      batch_size;
+    int64_t  batch_duration;
+    int      flush_on_idr;
+
+    int      length_size;       ///< size of the NAL unit length prefixes of the packets
+
+    uint8_t *buf;
+    unsigned buf_size;
+    int      buf_len;
+    int64_t  batch_start;       ///< dts of the first packet in buf
+} EVCMuxContext;
+
+static void evc_write_batch(AVFormatContext *s)
+{
+    EVCMuxContext *evc = s->priv_data;
+
+    if (evc->buf_len)
+        avio_write(s->pb, evc->buf, evc->buf_len);
+    evc->buf_len     = 0;
+    evc->batch_start = AV_NOPTS_VALUE;
+}
+
+static int evc_write_packet(AVFormatContext *s, AVPacket *pkt)
+{
+    EVCMuxContext *evc = s->priv_data;
+    AVStream *st = s->streams[0];
+    const uint8_t *data = pkt->data;
+    uint8_t *converted = NULL;
+    int size = pkt->size, ret = 0;
+
+    // the raw format only has 4 byte length prefixes
+    if (evc->length_size != EVC_NALU_LENGTH_PREFIX_SIZE) {
+        AVIOContext *pb;
+
+        if ((ret = avio_open_dyn_buf(&pb)) < 0)
+            return ret;
+        ret  = ff_evc_write_nal_units(pb, pkt->data, pkt->size,
+                                      evc->length_size, EVC_NALU_LENGTH_PREFIX_SIZE);
+        size = avio_close_dyn_buf(pb, &converted);
+        if (ret < 0) {
+            av_log(s, AV_LOG_ERROR, "Invalid NAL units in packet\n");
+            goto end;
+        }
+        data = converted;
+    }
+
+    if (!evc->batch_size) {
+        avio_write(s->pb, data, size);
+        goto end;
+    }
+
+    // let every write start with the IDR access unit
+    if (evc->flush_on_idr && pkt->flags & AV_PKT_FLAG_KEY)
+        evc_write_batch(s);
+
+    if (size >= evc->batch_size) {
+        evc_write_batch(s);
+        avio_write(s->pb, data, size);
+        goto end;
+    }
+
+    if (evc->buf_len + size > evc->batch_size)
+        evc_write_batch(s);
+
+    if (evc->buf_len + size > evc->buf_size) {
+        uint8_t *buf = av_fast_realloc(evc->buf, &evc->buf_size, evc->batch_size);
+        if (!buf) {
+            ret = AVERROR(ENOMEM);
+            goto end;
+        }
+        evc->buf = buf;
+    }
+    memcpy(evc->buf + evc->buf_len, data, size);
+    evc->buf_len += size;
+
+    if (evc->batch_start == AV_NOPTS_VALUE)
+        evc->batch_start = pkt->dts;
+
+    if (evc->buf_len >= evc->batch_size ||
+        evc->batch_duration && pkt->dts != AV_NOPTS_VALUE &&
+        evc->batch_start != AV_NOPTS_VALUE &&
+        av_rescale_q(pkt->dts + pkt->duration - evc->batch_start, st->time_base,
+                     AV_TIME_BASE_Q) >= evc->batch_duration)
+        evc_write_batch(s);
+
+end:
+    av_free(converted);
+    return ret;
+}
+
+static int evc_init(AVFormatContext *s)
+{
+    EVCMuxContext *evc = s->priv_data;
+    AVCodecParameters *par;
+    int ret;
+
+    if ((ret = force_one_stream(s)) < 0)
+        return ret;
+
+    evc->batch_start = AV_NOPTS_VALUE;
+
+    par = s->streams[0]->codecpar;
+    evc->length_size = ff_evc_nal_length_size(par->extradata, par->extradata_size);
+    if (evc->length_size < 0) {
+        av_log(s, AV_LOG_ERROR, "Invalid evcC NAL unit length size\n");
+        return evc->length_size;
+    }
+
+    return 0;
+}
+
+static int evc_write_trailer(AVFormatContext *s)
+{
+    evc_write_batch(s);
+
+    return 0;
+}
+
+static void evc_deinit(AVFormatContext *s)
+{
+    EVCMuxContext *evc = s->priv_data;
+
+    av_freep(&evc->buf);
+}
+
+#define OFFSET(x) offsetof(EVCMuxContext, x)
+#define ENC AV_OPT_FLAG_ENCODING_PARAM
+static const AVOption evc_options[] = {
+    { "batch_size", "Gather access units into writes of up to this many bytes, 0 to write each one",
+      OFFSET(batch_size), AV_OPT_TYPE_INT, { .i64 = 0 }, 0, INT_MAX, ENC },
+    { "batch_duration", "Maximum duration of the access units gathered into one write",
+      OFFSET(batch_duration), AV_OPT_TYPE_DURATION, { .i64 = 0 }, 0, INT64_MAX, ENC },
+    { "flush_on_idr", "Write out the gathered access units before each IDR",
+      OFFSET(flush_on_idr), AV_OPT_TYPE_BOOL, { .i64 = 0 }, 0, 1, ENC },
+    { NULL },
+};
+
+static const AVClass evc_muxer_class = {
+    .class_name = "evc muxer",
+    .item_name  = av_default_item_name,
+    .option     = evc_options,
+    .version    = LIBAVUTIL_VERSION_INT,
+};
+
 const FFOutputFormat ff_evc_muxer = {
     .p.name            = "evc",
     .p.long_name       = NULL_IF_CONFIG_SMALL("raw EVC video"),
     .p.extensions      = "evc",
     .p.audio_codec     = AV_CODEC_ID_NONE,
     .p.video_codec     = AV_CODEC_ID_EVC,
-    .init              = force_one_stream,
-    .write_packet      = ff_raw_write_packet,
+    .p.priv_class      = &evc_muxer_class,
+    .priv_data_size    = sizeof(EVCMuxContext),
+    .init              = evc_init,
+    .write_packet      = evc_write_packet,
+    .write_trailer     = evc_write_trailer,
+    .deinit            = evc_deinit,
     .p.flags           = AVFMT_NOTIMESTAMPS,
 };
 #endif
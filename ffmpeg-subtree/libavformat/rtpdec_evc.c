@@ -0,0 +1,361 @@
+/*
+ * RTP parser for EVC/MPEG-5 payload format (RFC 9584)
+ *
+ * This file is part of FFmpeg.
+ *
+ * FFmpeg is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * FFmpeg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with FFmpeg; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/**
+ * @file
+ * @brief RTP support for the EVC payload
+ *
+ * The NAL units are output with the 4 byte length prefix used for EVC
+ * everywhere else in libavformat, which is why fragmented NAL units are
+ * buffered until their last fragment arrives.
+ */
+
+#include "libavutil/avstring.h"
+#include "libavutil/base64.h"
+#include "libavutil/intreadwrite.h"
+#include "libavcodec/evc.h"
+
+#include "avformat.h"
+#include "avio_internal.h"
+#include "internal.h"
+#include "rtpdec.h"
+#include "rtpdec_formats.h"
+
+#define RTP_EVC_FU_HEADER_SIZE            1
+#define RTP_EVC_DONL_FIELD_SIZE           2
+#define RTP_EVC_DOND_FIELD_SIZE           1
+#define RTP_EVC_AP_NALU_LENGTH_FIELD_SIZE 2
+#define RTP_EVC_AP_NAL_TYPE               56
+#define RTP_EVC_FU_NAL_TYPE               57
+
+struct PayloadContext {
+    int using_donl_field;
+    /* length prefixed parameter sets from the SDP */
+    uint8_t *sprop;
+    int sprop_size;
+    /* fragmented NAL unit being reassembled */
+    AVIOContext *fu_buf;
+    uint16_t fu_seq;
+};
+
+static int evc_add_sprop(AVFormatContext *s, PayloadContext *evc_data,
+                         const char *value)
+{
+    char base64packet[1024];
+
+    while (*value) {
+        char *dst = base64packet;
+        uint8_t *ptr;
+        int size;
+
+        while (*value && *value != ',' &&
+               (dst - base64packet) < sizeof(base64packet) - 1)
+            *dst++ = *value++;
+        *dst++ = '\0';
+        if (*value == ',')
+            value++;
+
+        size = AV_BASE64_DECODE_SIZE(strlen(base64packet));
+        ptr  = av_realloc(evc_data->sprop, evc_data->sprop_size +
+                          EVC_NALU_LENGTH_PREFIX_SIZE + size);
+        if (!ptr)
+            return AVERROR(ENOMEM);
+        evc_data->sprop = ptr;
+
+        size = av_base64_decode(ptr + evc_data->sprop_size + EVC_NALU_LENGTH_PREFIX_SIZE,
+                                base64packet, size);
+        if (size < EVC_NALU_HEADER_SIZE) {
+            av_log(s, AV_LOG_ERROR, "Invalid parameter set in SDP\n");
+            continue;
+        }
+        AV_WB32(ptr + evc_data->sprop_size, size);
+        evc_data->sprop_size += EVC_NALU_LENGTH_PREFIX_SIZE + size;
+    }
+
+    return 0;
+}
+
+static av_cold int evc_sdp_parse_fmtp_config(AVFormatContext *s,
+                                             AVStream *stream,
+                                             PayloadContext *evc_data,
+                                             const char *attr, const char *value)
+{
+    /* sprop-sps: [base64] */
+    /* sprop-pps: [base64] */
+    /* sprop-sei: [base64] */
+    if (!strcmp(attr, "sprop-sps") || !strcmp(attr, "sprop-pps") ||
+        !strcmp(attr, "sprop-sei"))
+        return evc_add_sprop(s, evc_data, value);
+
+    /* sprop-max-don-diff: 0-32767 */
+    /* sprop-depack-buf-nalus: 0-32767 */
+    if (!strcmp(attr, "sprop-max-don-diff") ||
+        !strcmp(attr, "sprop-depack-buf-nalus")) {
+        if (atoi(value) > 0)
+            evc_data->using_donl_field = 1;
+        av_log(s, AV_LOG_TRACE, "Found %s in SDP, DON field usage is: %d\n",
+               attr, evc_data->using_donl_field);
+    }
+
+    return 0;
+}
+
+static av_cold int evc_parse_sdp_line(AVFormatContext *ctx, int st_index,
+                                      PayloadContext *evc_data, const char *line)
+{
+    AVStream *current_stream;
+    AVCodecParameters *par;
+    const char *sdp_line_ptr = line;
+    int ret;
+
+    if (st_index < 0)
+        return 0;
+
+    current_stream = ctx->streams[st_index];
+    par  = current_stream->codecpar;
+
+    if (av_strstart(sdp_line_ptr, "framesize:", &sdp_line_ptr)) {
+        ff_h264_parse_framesize(par, sdp_line_ptr);
+    } else if (av_strstart(sdp_line_ptr, "fmtp:", &sdp_line_ptr)) {
+        ret = ff_parse_fmtp(ctx, current_stream, evc_data, sdp_line_ptr,
+                            evc_sdp_parse_fmtp_config);
+        if (ret >= 0 && evc_data->sprop_size) {
+            if ((ret = ff_alloc_extradata(par, evc_data->sprop_size)) >= 0)
+                memcpy(par->extradata, evc_data->sprop, evc_data->sprop_size);
+        }
+        av_freep(&evc_data->sprop);
+        evc_data->sprop_size = 0;
+        return ret;
+    }
+
+    return 0;
+}
+
+static int evc_handle_aggregated_packet(AVFormatContext *ctx, AVPacket *pkt,
+                                        const uint8_t *buf, int len, int skip_between)
+{
+    const uint8_t *src = buf;
+    int src_len = len, total_length = 0;
+    uint8_t *dst;
+    int pass, ret;
+
+    // first we are going to figure out the total size
+    for (pass = 0; pass < 2; pass++) {
+        buf = src;
+        len = src_len;
+        while (len > RTP_EVC_AP_NALU_LENGTH_FIELD_SIZE) {
+            uint16_t nal_size = AV_RB16(buf);
+
+            buf += RTP_EVC_AP_NALU_LENGTH_FIELD_SIZE;
+            len -= RTP_EVC_AP_NALU_LENGTH_FIELD_SIZE;
+            if (nal_size > len) {
+                av_log(ctx, AV_LOG_ERROR, "nal size exceeds length: %d %d\n",
+                       nal_size, len);
+                return AVERROR_INVALIDDATA;
+            }
+
+            if (pass == 0) {
+                total_length += EVC_NALU_LENGTH_PREFIX_SIZE + nal_size;
+            } else {
+                AV_WB32(dst, nal_size);
+                memcpy(dst + EVC_NALU_LENGTH_PREFIX_SIZE, buf, nal_size);
+                dst += EVC_NALU_LENGTH_PREFIX_SIZE + nal_size;
+            }
+
+            buf += nal_size + skip_between;
+            len -= nal_size + skip_between;
+        }
+
+        if (pass == 0) {
+            if (!total_length)
+                return AVERROR_INVALIDDATA;
+            if ((ret = av_new_packet(pkt, total_length)) < 0)
+                return ret;
+            dst = pkt->data;
+        }
+    }
+
+    return 0;
+}
+
+static int evc_handle_frag_packet(AVFormatContext *ctx, PayloadContext *evc_data,
+                                  AVStream *st, AVPacket *pkt,
+                                  const uint8_t *rtp_pl, const uint8_t *buf, int len,
+                                  uint16_t seq)
+{
+    int first_fragment, last_fragment, fu_type;
+    int ret;
+
+    /*
+     *    decode the FU header
+     *
+     *     0 1 2 3 4 5 6 7
+     *    +-+-+-+-+-+-+-+-+
+     *    |S|E|  FuType   |
+     *    +---------------+
+     *
+     *       Start fragment (S): 1 bit
+     *       End fragment (E): 1 bit
+     *       FuType: 6 bits, NAL unit type plus 1
+     */
+    first_fragment = buf[0] & 0x80;
+    last_fragment  = buf[0] & 0x40;
+    fu_type        = buf[0] & 0x3f;
+
+    /* pass the EVC FU header */
+    buf += RTP_EVC_FU_HEADER_SIZE;
+    len -= RTP_EVC_FU_HEADER_SIZE;
+
+    /* pass the EVC DONL field */
+    if (evc_data->using_donl_field) {
+        buf += RTP_EVC_DONL_FIELD_SIZE;
+        len -= RTP_EVC_DONL_FIELD_SIZE;
+    }
+
+    av_log(ctx, AV_LOG_TRACE, " FU type %d with %d bytes\n", fu_type, len);
+
+    if (len < 0) {
+        av_log(ctx, AV_LOG_ERROR, "Too short RTP/EVC FU packet, got %d bytes\n", len);
+        return AVERROR_INVALIDDATA;
+    }
+
+    if (first_fragment && last_fragment) {
+        av_log(ctx, AV_LOG_ERROR, "Illegal combination of S and E bit in RTP/EVC packet\n");
+        return AVERROR_INVALIDDATA;
+    }
+
+    if (first_fragment) {
+        ffio_free_dyn_buf(&evc_data->fu_buf);
+        if ((ret = avio_open_dyn_buf(&evc_data->fu_buf)) < 0)
+            return ret;
+        /* the length prefix is written once the NAL unit is complete */
+        avio_wb32(evc_data->fu_buf, 0);
+        /* rebuild the NAL unit header from the payload header */
+        avio_w8(evc_data->fu_buf, (rtp_pl[0] & 0x81) | (fu_type << 1));
+        avio_w8(evc_data->fu_buf, rtp_pl[1]);
+    } else if (!evc_data->fu_buf || seq != (uint16_t)(evc_data->fu_seq + 1)) {
+        /* the start of this NAL unit or some fragment of it was lost */
+        if (evc_data->fu_buf)
+            av_log(ctx, AV_LOG_WARNING,
+                   "Missed fragments of an RTP/EVC NAL unit, dropping it\n");
+        ffio_free_dyn_buf(&evc_data->fu_buf);
+        return AVERROR(EAGAIN);
+    }
+    evc_data->fu_seq = seq;
+
+    avio_write(evc_data->fu_buf, buf, len);
+    if (!last_fragment)
+        return AVERROR(EAGAIN);
+
+    if ((ret = ff_rtp_finalize_packet(pkt, &evc_data->fu_buf, st->index)) < 0)
+        return ret;
+    AV_WB32(pkt->data, pkt->size - EVC_NALU_LENGTH_PREFIX_SIZE);
+
+    return 0;
+}
+
+static int evc_handle_packet(AVFormatContext *ctx, PayloadContext *evc_data,
+                             AVStream *st, AVPacket *pkt, uint32_t *timestamp,
+                             const uint8_t *buf, int len, uint16_t seq,
+                             int flags)
+{
+    int nal_type;
+    int res;
+
+    if (!buf)
+        return AVERROR_INVALIDDATA;
+
+    /* sanity check for size of input packet: 1 byte payload at least */
+    if (len < EVC_NALU_HEADER_SIZE + 1) {
+        av_log(ctx, AV_LOG_ERROR, "Too short RTP/EVC packet, got %d bytes\n", len);
+        return AVERROR_INVALIDDATA;
+    }
+
+    /*
+     * decode the EVC payload header, which is laid out as a NAL unit header:
+     *
+     *    0                   1
+     *    0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5
+     *   +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+     *   |F|   Type    | TID |  Reserve  |E|
+     *   +-------------+-----------------+
+     */
+    nal_type = ff_evc_nal_unit_type(buf, len);
+    if (nal_type < 0) {
+        av_log(ctx, AV_LOG_ERROR, "Invalid RTP/EVC payload header\n");
+        return AVERROR_INVALIDDATA;
+    }
+
+    switch (nal_type) {
+    /* single NAL unit packet */
+    default:
+        if ((res = av_new_packet(pkt, EVC_NALU_LENGTH_PREFIX_SIZE + len)) < 0)
+            return res;
+        AV_WB32(pkt->data, len);
+        memcpy(pkt->data + EVC_NALU_LENGTH_PREFIX_SIZE, buf, len);
+        break;
+    /* aggregation packet (AP) - with two or more NAL units */
+    case RTP_EVC_AP_NAL_TYPE:
+        buf += EVC_NALU_HEADER_SIZE;
+        len -= EVC_NALU_HEADER_SIZE;
+
+        /* pass the EVC DONL field */
+        if (evc_data->using_donl_field) {
+            buf += RTP_EVC_DONL_FIELD_SIZE;
+            len -= RTP_EVC_DONL_FIELD_SIZE;
+        }
+
+        res = evc_handle_aggregated_packet(ctx, pkt, buf, len,
+                                           evc_data->using_donl_field ?
+                                           RTP_EVC_DOND_FIELD_SIZE : 0);
+        if (res < 0)
+            return res;
+        break;
+    /* fragmentation unit (FU) */
+    case RTP_EVC_FU_NAL_TYPE:
+        res = evc_handle_frag_packet(ctx, evc_data, st, pkt, buf,
+                                     buf + EVC_NALU_HEADER_SIZE,
+                                     len - EVC_NALU_HEADER_SIZE, seq);
+        if (res < 0)
+            return res;
+        break;
+    }
+
+    pkt->stream_index = st->index;
+
+    return 0;
+}
+
+static void evc_close_context(PayloadContext *evc_data)
+{
+    ffio_free_dyn_buf(&evc_data->fu_buf);
+    av_freep(&evc_data->sprop);
+}
+
+const RTPDynamicProtocolHandler ff_evc_dynamic_handler = {
+    .enc_name         = "evc",
+    .codec_type       = AVMEDIA_TYPE_VIDEO,
+    .codec_id         = AV_CODEC_ID_EVC,
+    .need_parsing     = AVSTREAM_PARSE_FULL,
+    .priv_data_size   = sizeof(PayloadContext),
+    .parse_sdp_a_line = evc_parse_sdp_line,
+    .close            = evc_close_context,
+    .parse_packet     = evc_handle_packet,
+};
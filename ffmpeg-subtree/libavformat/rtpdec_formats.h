@@ -51,6 +51,7 @@ extern const RTPDynamicProtocolHandler ff_ac3_dynamic_handler;
 extern const RTPDynamicProtocolHandler ff_amr_nb_dynamic_handler;
 extern const RTPDynamicProtocolHandler ff_amr_wb_dynamic_handler;
 extern const RTPDynamicProtocolHandler ff_dv_dynamic_handler;
+extern const RTPDynamicProtocolHandler ff_evc_dynamic_handler;
 extern const RTPDynamicProtocolHandler ff_g726_16_dynamic_handler;
 extern const RTPDynamicProtocolHandler ff_g726_24_dynamic_handler;
 extern const RTPDynamicProtocolHandler ff_g726_32_dynamic_handler;
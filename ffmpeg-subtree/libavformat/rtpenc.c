@@ -26,6 +26,7 @@
 #include "libavutil/mathematics.h"
 #include "libavutil/random_seed.h"
 #include "libavutil/opt.h"
+#include "libavcodec/evc.h"
 
 #include "rtpenc.h"
 
@@ -51,6 +52,7 @@ static int is_supported(enum AVCodecID id)
 {
     switch(id) {
     case AV_CODEC_ID_DIRAC:
+    case AV_CODEC_ID_EVC:
     case AV_CODEC_ID_H261:
     case AV_CODEC_ID_H263:
     case AV_CODEC_ID_H263P:
@@ -217,6 +219,16 @@ static int rtp_write_header(AVFormatContext *s1)
             s->nal_length_size = (st->codecpar->extradata[21] & 0x03) + 1;
         }
         break;
+    case AV_CODEC_ID_EVC:
+        /* Raw EVC streams have no evcC and 4 byte length prefixes. */
+        s->nal_length_size = ff_evc_nal_length_size(st->codecpar->extradata,
+                                                    st->codecpar->extradata_size);
+        if (s->nal_length_size < 0) {
+            av_log(s, AV_LOG_ERROR, "Unsupported NAL unit length size in extradata\n");
+            ret = s->nal_length_size;
+            goto fail;
+        }
+        break;
     case AV_CODEC_ID_VP9:
         if (s1->strict_std_compliance > FF_COMPLIANCE_EXPERIMENTAL) {
             av_log(s, AV_LOG_ERROR,
@@ -606,6 +618,9 @@ static int rtp_write_packet(AVFormatContext *s1, AVPacket *pkt)
     case AV_CODEC_ID_HEVC:
         ff_rtp_send_h264_hevc(s1, pkt->data, size);
         break;
+    case AV_CODEC_ID_EVC:
+        ff_rtp_send_evc(s1, pkt->data, size);
+        break;
     case AV_CODEC_ID_VORBIS:
     case AV_CODEC_ID_THEORA:
         ff_rtp_send_xiph(s1, pkt->data, size);
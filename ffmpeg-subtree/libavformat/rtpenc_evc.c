@@ -0,0 +1,174 @@
+/*
+ * RTP packetizer for EVC/MPEG-5 payload format (RFC 9584)
+ *
+ * This file is part of FFmpeg.
+ *
+ * FFmpeg is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * FFmpeg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with FFmpeg; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/**
+ * @file
+ * @brief EVC packetization
+ *
+ * NAL units are sent as single NAL unit packets, small ones are gathered
+ * into aggregation packets (AP) and the ones larger than the payload size
+ * are split into fragmentation units (FU).
+ */
+
+#include "libavutil/intreadwrite.h"
+#include "libavcodec/evc.h"
+
+#include "avformat.h"
+#include "rtpenc.h"
+
+#define RTP_EVC_AP_NAL_TYPE 56
+#define RTP_EVC_FU_NAL_TYPE 57
+
+/*
+ * Write an EVC payload header, laid out as a NAL unit header:
+ *
+ *    0                   1
+ *    0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5
+ *   +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+ *   |F|   Type    | TID |  Reserve  |E|
+ *   +-------------+-----------------+
+ *
+ *      F       = 0
+ *      Type    = NAL unit type plus 1
+ *      TID     = temporal ID
+ *      Reserve = 0
+ *      E       = 0 (no extension)
+ */
+static void write_payload_header(uint8_t *buf, int type, int tid)
+{
+    buf[0] = ((type + 1) << 1) | (tid >> 2);
+    buf[1] = (tid & 0x03) << 6;
+}
+
+static void flush_buffered(AVFormatContext *s1, int last)
+{
+    RTPMuxContext *s = s1->priv_data;
+    if (s->buf_ptr != s->buf) {
+        // If we're only sending one single NAL unit, send it as such, skip
+        // the AP framing
+        if (s->buffered_nals == 1)
+            ff_rtp_send_data(s1, s->buf + EVC_NALU_HEADER_SIZE + 2,
+                             s->buf_ptr - s->buf - EVC_NALU_HEADER_SIZE - 2, last);
+        else
+            ff_rtp_send_data(s1, s->buf, s->buf_ptr - s->buf, last);
+    }
+    s->buf_ptr = s->buf;
+    s->buffered_nals = 0;
+}
+
+static void nal_send(AVFormatContext *s1, const uint8_t *buf, int size, int last)
+{
+    RTPMuxContext *s = s1->priv_data;
+    int nal_type = ff_evc_nal_unit_type(buf, size);
+    int tid      = ff_evc_nal_unit_temporal_id(buf, size);
+
+    av_log(s1, AV_LOG_DEBUG, "Sending NAL %d of len %d M=%d\n", nal_type, size, last);
+    if (size <= s->max_payload_size) {
+        int buffered_size = s->buf_ptr - s->buf;
+
+        // Flush buffered NAL units if the current unit doesn't fit
+        if (buffered_size + 2 + size > s->max_payload_size) {
+            flush_buffered(s1, 0);
+            buffered_size = 0;
+        }
+        // If the NAL unit fits including the framing (2 bytes length, plus
+        // 2 bytes for the AP payload header), write the unit to the buffer
+        // as an AP packet, otherwise flush and send as single NAL.
+        if (buffered_size + 2 + EVC_NALU_HEADER_SIZE + size <= s->max_payload_size) {
+            if (buffered_size == 0) {
+                write_payload_header(s->buf_ptr, RTP_EVC_AP_NAL_TYPE, tid);
+                s->buf_ptr += EVC_NALU_HEADER_SIZE;
+            } else if (tid < ff_evc_nal_unit_temporal_id(s->buf, EVC_NALU_HEADER_SIZE)) {
+                // The TID of an AP is the lowest TID of the aggregated units
+                write_payload_header(s->buf, RTP_EVC_AP_NAL_TYPE, tid);
+            }
+            AV_WB16(s->buf_ptr, size);
+            s->buf_ptr += 2;
+            memcpy(s->buf_ptr, buf, size);
+            s->buf_ptr += size;
+            s->buffered_nals++;
+        } else {
+            flush_buffered(s1, 0);
+            ff_rtp_send_data(s1, buf, size, last);
+        }
+    } else {
+        const int flag_byte = EVC_NALU_HEADER_SIZE, header_size = EVC_NALU_HEADER_SIZE + 1;
+
+        flush_buffered(s1, 0);
+        av_log(s1, AV_LOG_DEBUG, "NAL size %d > %d\n", size, s->max_payload_size);
+
+        write_payload_header(s->buf, RTP_EVC_FU_NAL_TYPE, tid);
+        /*
+         *     create the FU header
+         *
+         *     0 1 2 3 4 5 6 7
+         *    +-+-+-+-+-+-+-+-+
+         *    |S|E|  FuType   |
+         *    +---------------+
+         *
+         *       S       = variable
+         *       E       = variable
+         *       FuType  = NAL unit type plus 1
+         */
+        s->buf[flag_byte]  = nal_type + 1;
+        /* set the S bit: mark as start fragment */
+        s->buf[flag_byte] |= 1 << 7;
+
+        /* pass the original NAL header */
+        buf  += EVC_NALU_HEADER_SIZE;
+        size -= EVC_NALU_HEADER_SIZE;
+
+        while (size + header_size > s->max_payload_size) {
+            memcpy(&s->buf[header_size], buf, s->max_payload_size - header_size);
+            ff_rtp_send_data(s1, s->buf, s->max_payload_size, 0);
+            buf  += s->max_payload_size - header_size;
+            size -= s->max_payload_size - header_size;
+            s->buf[flag_byte] &= ~(1 << 7);
+        }
+        s->buf[flag_byte] |= 1 << 6;
+        memcpy(&s->buf[header_size], buf, size);
+        ff_rtp_send_data(s1, s->buf, size + header_size, last);
+    }
+}
+
+void ff_rtp_send_evc(AVFormatContext *s1, const uint8_t *buf, int size)
+{
+    const uint8_t *end = buf + size;
+    RTPMuxContext *s = s1->priv_data;
+
+    s->timestamp = s->cur_timestamp;
+    s->buf_ptr   = s->buf;
+    while (end - buf > s->nal_length_size) {
+        uint32_t nalu_size = ff_evc_nal_unit_length_n(buf, end - buf, s->nal_length_size);
+
+        buf += s->nal_length_size;
+        if (nalu_size < EVC_NALU_HEADER_SIZE || nalu_size > end - buf) {
+            av_log(s1, AV_LOG_ERROR, "Invalid NAL unit size: (%"PRIu32")\n", nalu_size);
+            break;
+        }
+        if (ff_evc_nal_unit_type(buf, nalu_size) < 0) {
+            av_log(s1, AV_LOG_ERROR, "Invalid NAL unit header\n");
+            break;
+        }
+        nal_send(s1, buf, nalu_size, buf + nalu_size == end);
+        buf += nalu_size;
+    }
+    flush_buffered(s1, 1);
+}
@@ -26,11 +26,13 @@
 #include "libavutil/dict.h"
 #include "libavutil/parseutils.h"
 #include "libavutil/opt.h"
+#include "libavcodec/evc.h"
 #include "libavcodec/xiph.h"
 #include "libavcodec/mpeg4audio.h"
 #include "avformat.h"
 #include "internal.h"
 #include "avc.h"
+#include "evc.h"
 #include "hevc.h"
 #include "rtp.h"
 #include "version.h"
@@ -343,6 +345,105 @@ err:
     return ret;
 }
 
+static int extradata2psets_evc(const AVCodecParameters *par, char **out)
+{
+    char *psets;
+    uint8_t *extradata = par->extradata;
+    int extradata_size = par->extradata_size;
+    uint8_t *tmpbuf = NULL;
+    int ps_pos[3] = { 0 };
+    static const char * const ps_names[3] = { "sps", "pps", "sei" };
+    int num_arrays, num_nalus;
+    int pos, i, j, ret = 0;
+
+    *out = NULL;
+
+    // Convert to evcC format, which groups the NAL units by type
+    if (par->extradata[0] != 1) {
+        ret = ff_evc_build_evcc(&tmpbuf, &extradata_size,
+                                par->extradata, par->extradata_size, 0);
+        if (ret < 0)
+            goto err;
+        extradata = tmpbuf;
+    }
+
+    if (extradata_size < 18)
+        goto err;
+
+    num_arrays = extradata[17];
+    pos = 18;
+    for (i = 0; i < num_arrays; i++) {
+        int num_nalus, nalu_type;
+        if (pos + 3 > extradata_size)
+            goto err;
+        nalu_type = extradata[pos] & 0x3f;
+        if (nalu_type == EVC_SPS_NUT)
+            ps_pos[0] = pos;
+        else if (nalu_type == EVC_PPS_NUT)
+            ps_pos[1] = pos;
+        else if (nalu_type == EVC_SEI_NUT)
+            ps_pos[2] = pos;
+        num_nalus = AV_RB16(&extradata[pos + 1]);
+        pos += 3;
+        for (j = 0; j < num_nalus; j++) {
+            int len;
+            if (pos + 2 > extradata_size)
+                goto err;
+            len = AV_RB16(&extradata[pos]);
+            pos += 2;
+            if (pos + len > extradata_size)
+                goto err;
+            pos += len;
+        }
+    }
+    if (!ps_pos[0] || !ps_pos[1])
+        goto err;
+
+    psets = av_mallocz(MAX_PSET_SIZE);
+    if (!psets) {
+        ret = AVERROR(ENOMEM);
+        goto err;
+    }
+
+    for (i = 0; i < 3; i++) {
+        pos = ps_pos[i];
+        if (!pos)
+            continue;
+
+        if (i > 0)
+            av_strlcat(psets, "; ", MAX_PSET_SIZE);
+        av_strlcatf(psets, MAX_PSET_SIZE, "sprop-%s=", ps_names[i]);
+
+        // Skipping boundary checks in the input here; we've already traversed
+        // the whole evcC structure above without issues
+        num_nalus = AV_RB16(&extradata[pos + 1]);
+        pos += 3;
+        for (j = 0; j < num_nalus; j++) {
+            int len = AV_RB16(&extradata[pos]);
+            int strpos;
+            pos += 2;
+            if (j > 0)
+                av_strlcat(psets, ",", MAX_PSET_SIZE);
+            strpos = strlen(psets);
+            if (!av_base64_encode(psets + strpos, MAX_PSET_SIZE - strpos,
+                                  &extradata[pos], len)) {
+                av_free(psets);
+                goto err;
+            }
+            pos += len;
+        }
+    }
+    av_free(tmpbuf);
+
+    *out = psets;
+    return 0;
+err:
+    if (ret >= 0)
+        ret = AVERROR_INVALIDDATA;
+    av_free(tmpbuf);
+    return ret;
+}
+
 static int extradata2config(AVFormatContext *s, const AVCodecParameters *par,
                             char **out)
 {
@@ -575,6 +676,17 @@ static int sdp_write_media_attributes(char *buff, int size, const AVStream *st,
             av_strlcatf(buff, size, "a=fmtp:%d %s\r\n",
                                      payload_type, config);
         break;
+    case AV_CODEC_ID_EVC:
+        if (p->extradata_size) {
+            ret = extradata2psets_evc(p, &config);
+            if (ret < 0)
+                return ret;
+        }
+        av_strlcatf(buff, size, "a=rtpmap:%d evc/90000\r\n", payload_type);
+        if (config)
+            av_strlcatf(buff, size, "a=fmtp:%d %s\r\n",
+                                     payload_type, config);
+        break;
     case AV_CODEC_ID_MPEG4:
         if (p->extradata_size) {
             ret = extradata2config(fmt, p, &config);
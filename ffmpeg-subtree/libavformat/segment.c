@@ -29,6 +29,7 @@
 #include <time.h>
 
 #include "avformat.h"
+#include "evc.h"
 #include "internal.h"
 #include "mux.h"
 
@@ -64,6 +65,11 @@ typedef enum {
     LIST_TYPE_NB,
 } ListType;
 
+typedef struct SegmentEVCStream {
+    FFEVCParamSets ps;     ///< last parameter sets seen in the stream
+    int segment_start;     ///< nothing of the stream was written to the current segment yet
+} SegmentEVCStream;
+
 #define SEGMENT_LIST_FLAG_CACHE 1
 #define SEGMENT_LIST_FLAG_LIVE  2
 
@@ -126,6 +132,9 @@ typedef struct SegmentContext {
     SegmentListEntry cur_entry;
     SegmentListEntry *segment_list_entries;
     SegmentListEntry *segment_list_entries_end;
+
+    SegmentEVCStream **evc; ///< per stream, NULL for streams other than EVC
+    AVPacket *evc_pkt;      ///< picture with the parameter sets prepended
 } SegmentContext;
 
 static void print_csv_escaped_str(AVIOContext *ctx, const char *str)
@@ -275,6 +284,9 @@ static int segment_start(AVFormatContext *s, int write_header)
     }
 
     seg->segment_frame_count = 0;
+    for (int i = 0; seg->evc && i < s->nb_streams; i++)
+        if (seg->evc[i])
+            seg->evc[i]->segment_start = 1;
     return 0;
 }
 
@@ -663,6 +675,13 @@ static void seg_free(AVFormatContext *s)
     av_freep(&seg->times);
     av_freep(&seg->frames);
     av_freep(&seg->cur_entry.filename);
+    for (int i = 0; seg->evc && i < s->nb_streams; i++) {
+        if (seg->evc[i])
+            ff_evc_param_sets_uninit(&seg->evc[i]->ps);
+        av_freep(&seg->evc[i]);
+    }
+    av_freep(&seg->evc);
+    av_packet_free(&seg->evc_pkt);
 
     cur = seg->segment_list_entries;
     while (cur) {
@@ -815,6 +834,26 @@ static int seg_init(AVFormatContext *s)
         avpriv_set_pts_info(outer_st, inner_st->pts_wrap_bits, inner_st->time_base.num, inner_st->time_base.den);
     }
 
+    for (i = 0; i < s->nb_streams; i++) {
+        const AVCodecParameters *par = s->streams[i]->codecpar;
+
+        if (par->codec_id != AV_CODEC_ID_EVC)
+            continue;
+        if (!seg->evc) {
+            seg->evc     = av_calloc(s->nb_streams, sizeof(*seg->evc));
+            seg->evc_pkt = av_packet_alloc();
+            if (!seg->evc || !seg->evc_pkt)
+                return AVERROR(ENOMEM);
+        }
+        seg->evc[i] = av_mallocz(sizeof(*seg->evc[i]));
+        if (!seg->evc[i])
+            return AVERROR(ENOMEM);
+        seg->evc[i]->segment_start = 1;
+        if (par->extradata_size &&
+            ff_evc_param_sets_update(&seg->evc[i]->ps, par->extradata, par->extradata_size) < 0)
+            av_log(s, AV_LOG_WARNING, "Failed to parse the parameter sets of stream %d\n", i);
+    }
+
     if (oc->avoid_negative_ts > 0 && s->avoid_negative_ts < 0)
         s->avoid_negative_ts = 1;
 
@@ -850,6 +889,45 @@ static int seg_write_header(AVFormatContext *s)
     return 0;
 }
 
+/**
+ * Make an EVC picture starting a segment decodable on its own, by prepending
+ * the last parameter sets seen when it carries none in band.
+ */
+static int segment_evc_packet(AVFormatContext *s, AVPacket **ppkt)
+{
+    SegmentContext *seg = s->priv_data;
+    AVPacket *pkt = *ppkt;
+    SegmentEVCStream *evc = seg->evc[pkt->stream_index];
+    int ret;
+
+    if (evc->segment_start && !ff_evc_has_nal_unit(pkt->data, pkt->size, EVC_SPS_NUT)) {
+        int ps_size = ff_evc_param_sets_write(&evc->ps, NULL);
+
+        if (ps_size) {
+            AVPacket *out = seg->evc_pkt;
+
+            ret = av_new_packet(out, ps_size + pkt->size);
+            if (ret < 0)
+                return ret;
+            ret = av_packet_copy_props(out, pkt);
+            if (ret < 0) {
+                av_packet_unref(out);
+                return ret;
+            }
+            ff_evc_param_sets_write(&evc->ps, out->data);
+            memcpy(out->data + ps_size, pkt->data, pkt->size);
+            *ppkt = out;
+        }
+    }
+    evc->segment_start = 0;
+
+    if (ff_evc_param_sets_update(&evc->ps, pkt->data, pkt->size) < 0)
+        av_log(s, AV_LOG_WARNING, "Failed to parse the parameter sets of stream %d\n",
+               pkt->stream_index);
+
+    return 0;
+}
+
 static int seg_write_packet(AVFormatContext *s, AVPacket *pkt)
 {
     SegmentContext *seg = s->priv_data;
@@ -860,10 +938,15 @@ static int seg_write_packet(AVFormatContext *s, AVPacket *pkt)
     struct tm ti;
     int64_t usecs;
     int64_t wrapped_val;
+    int key = pkt->flags & AV_PKT_FLAG_KEY;
 
     if (!seg->avf || !seg->avf->pb)
         return AVERROR(EINVAL);
 
+    /* only IDR pictures start an EVC segment that can be decoded on its own */
+    if (key && st->codecpar->codec_id == AV_CODEC_ID_EVC)
+        key = ff_evc_has_nal_unit(pkt->data, pkt->size, EVC_IDR_NUT);
+
     if (!st->codecpar->extradata_size) {
         size_t pkt_extradata_size;
         uint8_t *pkt_extradata = av_packet_get_side_data(pkt, AV_PKT_DATA_NEW_EXTRADATA, &pkt_extradata_size);
@@ -921,7 +1004,7 @@ calc_times:
         pkt_pts_avtb = av_rescale_q(pkt->pts, st->time_base, AV_TIME_BASE_Q);
 
     if (pkt->stream_index == seg->reference_stream_index &&
-        (pkt->flags & AV_PKT_FLAG_KEY || seg->break_non_keyframes) &&
+        (key || seg->break_non_keyframes) &&
         (seg->segment_frame_count > 0 || seg->write_empty) &&
         (seg->cut_pending || seg->frame_count >= start_frame ||
          (pkt->pts != AV_NOPTS_VALUE &&
@@ -979,9 +1062,17 @@ calc_times:
            av_ts2str(pkt->pts), av_ts2timestr(pkt->pts, &st->time_base),
            av_ts2str(pkt->dts), av_ts2timestr(pkt->dts, &st->time_base));
 
+    if (seg->evc && seg->evc[pkt->stream_index]) {
+        ret = segment_evc_packet(s, &pkt);
+        if (ret < 0)
+            goto fail;
+    }
+
     ret = ff_write_chained(seg->avf, pkt->stream_index, pkt, s,
                            seg->initial_offset || seg->reset_timestamps ||
                            ffofmt(seg->avf->oformat)->interleave_packet);
+    if (pkt == seg->evc_pkt)
+        av_packet_unref(pkt);
 
 fail:
     /* Use st->index here as the packet returned from ff_write_chained()
@@ -256,14 +256,26 @@ int av_buffer_replace(AVBufferRef **pdst, const AVBufferRef *src)
     return 0;
 }
 
-AVBufferPool *av_buffer_pool_init2(size_t size, void *opaque,
+AVBufferPool *av_buffer_pool_init3(size_t size, void *opaque,
                                    AVBufferRef* (*alloc)(void *opaque, size_t size),
-                                   void (*pool_free)(void *opaque))
+                                   void (*pool_free)(void *opaque), int flags)
 {
     AVBufferPool *pool = av_mallocz(sizeof(*pool));
     if (!pool)
         return NULL;
 
+    if (flags & AV_BUFFER_POOL_FLAG_LOCKLESS) {
+        pool->ring = av_malloc_array(BUFFER_POOL_RING_SIZE, sizeof(*pool->ring));
+        if (!pool->ring) {
+            av_freep(&pool);
+            return NULL;
+        }
+        for (size_t i = 0; i < BUFFER_POOL_RING_SIZE; i++)
+            atomic_init(&pool->ring[i].seq, i);
+        atomic_init(&pool->ring_write, 0);
+        atomic_init(&pool->ring_read, 0);
+    }
+
     ff_mutex_init(&pool->mutex, NULL);
 
     pool->size      = size;
@@ -277,6 +289,13 @@ AVBufferPool *av_buffer_pool_init2(size_t size, void *opaque,
     return pool;
 }
 
+AVBufferPool *av_buffer_pool_init2(size_t size, void *opaque,
+                                   AVBufferRef* (*alloc)(void *opaque, size_t size),
+                                   void (*pool_free)(void *opaque))
+{
+    return av_buffer_pool_init3(size, opaque, alloc, pool_free, 0);
+}
+
 AVBufferPool *av_buffer_pool_init(size_t size, AVBufferRef* (*alloc)(size_t size))
 {
     AVBufferPool *pool = av_mallocz(sizeof(*pool));
@@ -293,8 +312,71 @@ AVBufferPool *av_buffer_pool_init(size_t size, AVBufferRef* (*alloc)(size_t size
     return pool;
 }
 
+/*
+ * Add an entry to the lock-free ring, return 0 if it is full.
+ * A slot is free for the writer at position pos once its seq equals pos.
+ */
+static int buffer_pool_ring_push(AVBufferPool *pool, BufferPoolEntry *buf)
+{
+    size_t pos = atomic_load_explicit(&pool->ring_write, memory_order_relaxed);
+
+    for (;;) {
+        BufferPoolSlot *slot = &pool->ring[pos & (BUFFER_POOL_RING_SIZE - 1)];
+        size_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        intptr_t diff = (intptr_t)(seq - pos);
+
+        if (!diff) {
+            if (atomic_compare_exchange_weak_explicit(&pool->ring_write, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed)) {
+                slot->buf = buf;
+                atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+                return 1;
+            }
+        } else if (diff < 0) {
+            return 0;
+        } else {
+            pos = atomic_load_explicit(&pool->ring_write, memory_order_relaxed);
+        }
+    }
+}
+
+/*
+ * Take an entry from the lock-free ring, return NULL if it is empty.
+ * A slot holds an entry for the reader at position pos once its seq equals pos + 1.
+ */
+static BufferPoolEntry *buffer_pool_ring_pop(AVBufferPool *pool)
+{
+    size_t pos = atomic_load_explicit(&pool->ring_read, memory_order_relaxed);
+
+    for (;;) {
+        BufferPoolSlot *slot = &pool->ring[pos & (BUFFER_POOL_RING_SIZE - 1)];
+        size_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        intptr_t diff = (intptr_t)(seq - (pos + 1));
+
+        if (!diff) {
+            if (atomic_compare_exchange_weak_explicit(&pool->ring_read, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed)) {
+                BufferPoolEntry *buf = slot->buf;
+                atomic_store_explicit(&slot->seq, pos + BUFFER_POOL_RING_SIZE, memory_order_release);
+                return buf;
+            }
+        } else if (diff < 0) {
+            return NULL;
+        } else {
+            pos = atomic_load_explicit(&pool->ring_read, memory_order_relaxed);
+        }
+    }
+}
+
 static void buffer_pool_flush(AVBufferPool *pool)
 {
+    BufferPoolEntry *entry;
+
+    while (pool->ring && (entry = buffer_pool_ring_pop(pool))) {
+        entry->free(entry->opaque, entry->data);
+        av_free(entry);
+    }
+
     while (pool->pool) {
         BufferPoolEntry *buf = pool->pool;
         pool->pool = buf->next;
@@ -316,6 +398,7 @@ static void buffer_pool_free(AVBufferPool *pool)
     if (pool->pool_free)
         pool->pool_free(pool->opaque);
 
+    av_freep(&pool->ring);
     av_freep(&pool);
 }
 
@@ -341,10 +424,12 @@ static void pool_release_buffer(void *opaque, uint8_t *data)
     BufferPoolEntry *buf = opaque;
     AVBufferPool *pool = buf->pool;
 
-    ff_mutex_lock(&pool->mutex);
-    buf->next = pool->pool;
-    pool->pool = buf;
-    ff_mutex_unlock(&pool->mutex);
+    if (!pool->ring || !buffer_pool_ring_push(pool, buf)) {
+        ff_mutex_lock(&pool->mutex);
+        buf->next = pool->pool;
+        pool->pool = buf;
+        ff_mutex_unlock(&pool->mutex);
+    }
 
     if (atomic_fetch_sub_explicit(&pool->refcount, 1, memory_order_acq_rel) == 1)
         buffer_pool_free(pool);
@@ -381,11 +466,53 @@ static AVBufferRef *pool_alloc_buffer(AVBufferPool *pool)
     return ret;
 }
 
+/* av_buffer_pool_get() of AV_BUFFER_POOL_FLAG_LOCKLESS pools, allocating outside of the lock */
+static AVBufferRef *buffer_pool_get_lockless(AVBufferPool *pool)
+{
+    AVBufferRef *ret;
+    BufferPoolEntry *buf = buffer_pool_ring_pop(pool);
+
+    if (!buf) {
+        ff_mutex_lock(&pool->mutex);
+        buf = pool->pool;
+        if (buf)
+            pool->pool = buf->next;
+        ff_mutex_unlock(&pool->mutex);
+    }
+
+    if (!buf)
+        return pool_alloc_buffer(pool);
+
+    memset(&buf->buffer, 0, sizeof(buf->buffer));
+    ret = buffer_create(&buf->buffer, buf->data, pool->size,
+                        pool_release_buffer, buf, 0);
+    if (!ret) {
+        if (!buffer_pool_ring_push(pool, buf)) {
+            ff_mutex_lock(&pool->mutex);
+            buf->next = pool->pool;
+            pool->pool = buf;
+            ff_mutex_unlock(&pool->mutex);
+        }
+        return NULL;
+    }
+    buf->next = NULL;
+    buf->buffer.flags_internal |= BUFFER_FLAG_NO_FREE;
+
+    return ret;
+}
+
 AVBufferRef *av_buffer_pool_get(AVBufferPool *pool)
 {
     AVBufferRef *ret;
     BufferPoolEntry *buf;
 
+    if (pool->ring) {
+        ret = buffer_pool_get_lockless(pool);
+        if (ret)
+            atomic_fetch_add_explicit(&pool->refcount, 1, memory_order_relaxed);
+        return ret;
+    }
+
     ff_mutex_lock(&pool->mutex);
     buf = pool->pool;
     if (buf) {
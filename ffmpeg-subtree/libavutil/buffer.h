@@ -284,6 +284,36 @@ AVBufferPool *av_buffer_pool_init2(size_t size, void *opaque,
                                    AVBufferRef* (*alloc)(void *opaque, size_t size),
                                    void (*pool_free)(void *opaque));
 
+/**
+ * Keep the returned buffers in a lock-free ring in front of the locked list
+ * of the pool, so that threads getting and returning buffers at a high rate
+ * do not contend on a mutex. The list only takes the buffers the ring has no
+ * room for.
+ *
+ * av_buffer_pool_get() may allocate a new buffer while another one is being
+ * returned by a different thread, so this must not be used with allocators
+ * that cannot grow the pool, e.g. those of fixed size hardware frame pools.
+ */
+#define AV_BUFFER_POOL_FLAG_LOCKLESS (1 << 0)
+
+/**
+ * Allocate and initialize a buffer pool with a more complex allocator and
+ * flags.
+ *
+ * @param size size of each buffer in this pool
+ * @param opaque arbitrary user data used by the allocator
+ * @param alloc a function that will be used to allocate new buffers when the
+ *              pool is empty. May be NULL, then the default allocator will be
+ *              used (av_buffer_alloc()).
+ * @param pool_free a function that will be called immediately before the pool
+ *                  is freed, as with av_buffer_pool_init2(). May be NULL.
+ * @param flags a combination of AV_BUFFER_POOL_FLAG_*
+ * @return newly created buffer pool on success, NULL on error.
+ */
+AVBufferPool *av_buffer_pool_init3(size_t size, void *opaque,
+                                   AVBufferRef* (*alloc)(void *opaque, size_t size),
+                                   void (*pool_free)(void *opaque), int flags);
+
 /**
  * Mark the pool as being available for freeing. It will actually be freed only
  * once all the allocated buffers associated with the pool are released. Thus it
@@ -85,10 +85,32 @@ typedef struct BufferPoolEntry {
     AVBuffer buffer;
 } BufferPoolEntry;
 
+/**
+ * The number of entries of the lock-free ring of AV_BUFFER_POOL_FLAG_LOCKLESS pools, a power of two
+ */
+#define BUFFER_POOL_RING_SIZE 64
+
+/**
+ * A slot of the lock-free ring, seq tells whether it holds an entry for the
+ * current lap of the readers or is free for the current lap of the writers
+ */
+typedef struct BufferPoolSlot {
+    atomic_size_t seq;
+    BufferPoolEntry *buf;
+} BufferPoolSlot;
+
 struct AVBufferPool {
     AVMutex mutex;
     BufferPoolEntry *pool;
 
+    /*
+     * Bounded multi-producer multi-consumer queue of returned entries, taken
+     * before the list. NULL unless AV_BUFFER_POOL_FLAG_LOCKLESS is set.
+     */
+    BufferPoolSlot *ring;
+    atomic_size_t ring_write;
+    atomic_size_t ring_read;
+
     /*
      * This is used to track when the pool is to be freed.
      * The pointer to the pool itself held by the caller is considered to
@@ -28,6 +28,14 @@
 
 #include "config.h"
 
+#if HAVE_MADVISE
+/* for madvise() and MADV_HUGEPAGE */
+#ifndef _DEFAULT_SOURCE
+# define _DEFAULT_SOURCE
+#endif
+#include <sys/mman.h>
+#endif
+
 #include <limits.h>
 #include <stdint.h>
 #include <stdlib.h>
@@ -75,6 +83,37 @@ void av_max_alloc(size_t max){
     atomic_store_explicit(&max_alloc_size, max, memory_order_relaxed);
 }
 
+#if HAVE_POSIX_MEMALIGN && HAVE_MADVISE && defined(MADV_HUGEPAGE)
+#define HUGEPAGE_SIZE (2 << 20)
+
+static atomic_size_t hugepage_threshold = ATOMIC_VAR_INIT(0);
+
+void av_hugepage_threshold(size_t threshold)
+{
+    atomic_store_explicit(&hugepage_threshold, threshold, memory_order_relaxed);
+}
+
+/* allocate whole huge pages on a huge page boundary, so that the block may be
+ * backed by transparent huge pages, and advise the kernel to do so; the advice
+ * must not extend past the block to memory of other allocations */
+static void *hugepage_malloc(size_t size)
+{
+    size_t aligned_size = FFALIGN(size, HUGEPAGE_SIZE);
+    void *ptr;
+
+    if (aligned_size < size || posix_memalign(&ptr, HUGEPAGE_SIZE, aligned_size))
+        return NULL;
+    /* only an advice, the allocation is usable anyway */
+    madvise(ptr, aligned_size, MADV_HUGEPAGE);
+
+    return ptr;
+}
+#else
+void av_hugepage_threshold(size_t threshold)
+{
+}
+#endif
+
 static int size_mult(size_t a, size_t b, size_t *r)
 {
     size_t t;
@@ -101,6 +140,14 @@ void *av_malloc(size_t size)
         return NULL;
 
 #if HAVE_POSIX_MEMALIGN
+#ifdef HUGEPAGE_SIZE
+    {
+        size_t threshold = atomic_load_explicit(&hugepage_threshold, memory_order_relaxed);
+        if (threshold && size >= threshold)
+            ptr = hugepage_malloc(size);
+    }
+    if (!ptr)
+#endif
     if (size) //OS X on SDK 10.6 has a broken posix_memalign implementation
     if (posix_memalign(&ptr, ALIGN, size))
         ptr = NULL;
@@ -601,6 +601,23 @@ int av_size_mult(size_t a, size_t b, size_t *r);
  */
 void av_max_alloc(size_t max);
 
+/**
+ * Set the size from which av_malloc() allocates blocks on huge page
+ * boundaries and advises the kernel to back them with transparent huge pages.
+ *
+ * This reduces TLB misses when large buffers, such as the frames of high
+ * resolution video, are accessed. It applies to all functions based on
+ * av_malloc(), including buffer pools. Such blocks are rounded up to a
+ * multiple of the huge page size, so the threshold should not be set much
+ * below it.
+ *
+ * This is only an advice and does nothing on systems without transparent huge
+ * page support. The default is 0, which disables it.
+ *
+ * @param threshold minimum size of the blocks to allocate on huge pages
+ */
+void av_hugepage_threshold(size_t threshold);
+
 /**
  * @}
  * @}
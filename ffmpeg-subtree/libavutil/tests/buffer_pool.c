@@ -0,0 +1,161 @@
+/*
+ * This file is part of FFmpeg.
+ *
+ * FFmpeg is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * FFmpeg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with FFmpeg; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/*
+ * This test program checks that the buffers of a pool are never handed out
+ * twice at the same time when several threads get and release them, with
+ * and without AV_BUFFER_POOL_FLAG_LOCKLESS.
+ *
+ * With arguments, it benchmarks both modes instead:
+ * buffer_pool <threads> <iterations per thread> [<buffers held per thread>]
+ */
+
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "libavutil/buffer.h"
+#include "libavutil/common.h"
+#include "libavutil/thread.h"
+#include "libavutil/time.h"
+
+#define BUF_SIZE  64
+#define MAX_HELD  64
+
+typedef struct ThreadArg {
+    AVBufferPool *pool;
+    int id;
+    int iterations;
+    int held;
+    int errors;
+} ThreadArg;
+
+static atomic_int nb_allocs;
+
+static AVBufferRef *count_alloc(void *opaque, size_t size)
+{
+    atomic_fetch_add_explicit(&nb_allocs, 1, memory_order_relaxed);
+    return av_buffer_alloc(size);
+}
+
+static void *thread_main(void *opaque)
+{
+    ThreadArg *arg = opaque;
+    AVBufferRef *bufs[MAX_HELD];
+
+    for (int i = 0; i < arg->iterations; i++) {
+        uint8_t tag = arg->id * 31 + i;
+        int n;
+
+        for (n = 0; n < arg->held; n++) {
+            bufs[n] = av_buffer_pool_get(arg->pool);
+            if (!bufs[n])
+                break;
+            memset(bufs[n]->data, tag, BUF_SIZE);
+        }
+        if (n < arg->held)
+            arg->errors++;
+
+        // a buffer also owned by another thread would have been overwritten meanwhile
+        for (int j = 0; j < n; j++) {
+            for (int k = 0; k < BUF_SIZE; k++)
+                if (bufs[j]->data[k] != tag) {
+                    arg->errors++;
+                    break;
+                }
+            av_buffer_unref(&bufs[j]);
+        }
+    }
+
+    return NULL;
+}
+
+static int run(int flags, int nb_threads, int iterations, int held, int64_t *time)
+{
+    pthread_t threads[64];
+    ThreadArg args[64];
+    AVBufferPool *pool;
+    int errors = 0, ret;
+
+    pool = av_buffer_pool_init3(BUF_SIZE, NULL, count_alloc, NULL, flags);
+    if (!pool)
+        return -1;
+
+    *time = av_gettime_relative();
+    for (int i = 0; i < nb_threads; i++) {
+        args[i] = (ThreadArg){ .pool = pool, .id = i, .iterations = iterations, .held = held };
+        if ((ret = pthread_create(&threads[i], NULL, thread_main, &args[i]))) {
+            fprintf(stderr, "pthread_create failed: %s.\n", strerror(ret));
+            exit(1);
+        }
+    }
+    for (int i = 0; i < nb_threads; i++) {
+        pthread_join(threads[i], NULL);
+        errors += args[i].errors;
+    }
+    *time = av_gettime_relative() - *time;
+
+    av_buffer_pool_uninit(&pool);
+
+    return errors;
+}
+
+int main(int argc, char **argv)
+{
+    static const struct {
+        const char *name;
+        int flags;
+    } modes[] = {
+        { "locked",   0 },
+        { "lockless", AV_BUFFER_POOL_FLAG_LOCKLESS },
+    };
+    int bench = argc > 2;
+    int nb_threads = bench ? av_clip(atoi(argv[1]), 1, 64) : 4;
+    int iterations = bench ? FFMAX(atoi(argv[2]), 1) : 2000;
+    int held = argc > 3 ? av_clip(atoi(argv[3]), 1, MAX_HELD) : 4;
+    int64_t time;
+    int ret = 0;
+
+    for (int m = 0; m < FF_ARRAY_ELEMS(modes); m++) {
+        int errors;
+
+        // a single thread always finds the buffers it released
+        atomic_store(&nb_allocs, 0);
+        errors = run(modes[m].flags, 1, 100, held, &time);
+        if (errors || atomic_load(&nb_allocs) != held) {
+            printf("%s: %d errors and %d allocations with one thread\n",
+                   modes[m].name, errors, atomic_load(&nb_allocs));
+            ret = 1;
+        }
+
+        atomic_store(&nb_allocs, 0);
+        errors = run(modes[m].flags, nb_threads, iterations, held, &time);
+        if (errors) {
+            printf("%s: %d errors with %d threads\n", modes[m].name, errors, nb_threads);
+            ret = 1;
+        } else if (bench) {
+            printf("%s: %.1f ns per get and release, %d allocations\n", modes[m].name,
+                   1000.0 * time / ((double)nb_threads * iterations * held), atomic_load(&nb_allocs));
+        } else {
+            printf("%s: ok\n", modes[m].name);
+        }
+    }
+
+    return ret;
+}
@@ -0,0 +1,75 @@
+/*
+ * This file is part of FFmpeg.
+ *
+ * FFmpeg is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * FFmpeg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with FFmpeg; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include "file_open.h"
+#include "macros.h"
+#include "thread.h"
+#include "trace.h"
+
+static int trace_fd = -1;
+static AVOnce trace_once = AV_ONCE_INIT;
+
+static void trace_open(void)
+{
+    static const char *const paths[] = {
+        "/sys/kernel/tracing/trace_marker",
+        "/sys/kernel/debug/tracing/trace_marker",
+    };
+
+    // events are silently dropped when tracefs is not available or writable
+    for (int i = 0; i < FF_ARRAY_ELEMS(paths) && trace_fd < 0; i++)
+        trace_fd = avpriv_open(paths[i], O_WRONLY);
+}
+
+static void trace_write(char type, const char *name, int64_t poc, int nalu_type, int64_t size)
+{
+    char buf[128];
+    int len;
+
+    ff_thread_once(&trace_once, trace_open);
+    if (trace_fd < 0)
+        return;
+
+    len = snprintf(buf, sizeof(buf), "%c|%d|%s", type, (int)getpid(), name);
+    if (poc >= 0 && len < sizeof(buf))
+        len += snprintf(buf + len, sizeof(buf) - len, " poc=%"PRId64, poc);
+    if (nalu_type >= 0 && len < sizeof(buf))
+        len += snprintf(buf + len, sizeof(buf) - len, " nal=%d", nalu_type);
+    if (size >= 0 && len < sizeof(buf))
+        len += snprintf(buf + len, sizeof(buf) - len, " size=%"PRId64, size);
+
+    // a single write() so that the events of concurrent threads are not interleaved,
+    // a failed write only loses the event
+    if (write(trace_fd, buf, FFMIN(len, sizeof(buf) - 1)) < 0)
+        return;
+}
+
+void avpriv_trace_begin(const char *name, int64_t poc, int nalu_type, int64_t size)
+{
+    trace_write('B', name, poc, nalu_type, size);
+}
+
+void avpriv_trace_end(const char *name, int64_t poc, int nalu_type, int64_t size)
+{
+    trace_write('E', name, poc, nalu_type, size);
+}
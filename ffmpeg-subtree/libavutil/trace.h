@@ -0,0 +1,53 @@
+/*
+ * This file is part of FFmpeg.
+ *
+ * FFmpeg is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * FFmpeg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with FFmpeg; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/**
+ * @file
+ * Tracing markers around hot codec calls, for system tracing tools.
+ *
+ * The events are written to the Linux ftrace trace_marker file in the
+ * "B|pid|name" / "E|pid" format that Perfetto, systrace and trace-cmd
+ * show as nested slices on the calling thread. They are only compiled in
+ * with --enable-trace-marker and cost nothing otherwise.
+ *
+ * Each event is tagged with the POC, NAL unit type and size it relates to,
+ * tags with a negative value are left out. End events repeat the name and
+ * carry the tags only known once the call returned.
+ */
+
+#ifndef AVUTIL_TRACE_H
+#define AVUTIL_TRACE_H
+
+#include <stdint.h>
+
+#include "config.h"
+
+void avpriv_trace_begin(const char *name, int64_t poc, int nalu_type, int64_t size);
+void avpriv_trace_end(const char *name, int64_t poc, int nalu_type, int64_t size);
+
+// the calls are still type checked, and removed by dead code elimination when disabled
+#define FF_TRACE_BEGIN(name, poc, nalu_type, size) do {         \
+    if (CONFIG_TRACE_MARKER)                                    \
+        avpriv_trace_begin(name, poc, nalu_type, size);         \
+} while (0)
+#define FF_TRACE_END(name, poc, nalu_type, size) do {           \
+    if (CONFIG_TRACE_MARKER)                                    \
+        avpriv_trace_end(name, poc, nalu_type, size);           \
+} while (0)
+
+#endif /* AVUTIL_TRACE_H */
@@ -0,0 +1,525 @@
+/*
+ * Copyright (c) 2023
+ *
+ * This file is part of FFmpeg.
+ *
+ * FFmpeg is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * FFmpeg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with FFmpeg; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/*
+ * Throughput of the components of the EVC stack, each measured in isolation.
+ *
+ * The EVC stream of the input is demuxed once into memory, then run through
+ * the evc_frame_merge bitstream filter, the EVC parser, the libxevd decoder
+ * (copying the pictures out and exporting them without copy), the libxeve
+ * encoder for each preset and the mp4 and raw evc muxers.
+ * The stages that are not available in the build are skipped.
+ */
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "libavformat/avformat.h"
+
+#include "libavcodec/avcodec.h"
+#include "libavcodec/bsf.h"
+
+#include "libavutil/dict.h"
+#include "libavutil/error.h"
+#include "libavutil/frame.h"
+#include "libavutil/imgutils.h"
+#include "libavutil/mem.h"
+#include "libavutil/time.h"
+
+typedef struct BenchContext {
+    AVCodecParameters *par;
+    AVRational time_base;
+    AVRational frame_rate;
+
+    AVPacket **pkts;
+    int     nb_pkts;
+    size_t  pkts_size;
+
+    /* decoded pictures used as encoder input */
+    AVFrame  **frames;
+    int     nb_frames;
+    int    max_frames;
+
+    const char *threads;
+} BenchContext;
+
+static void report(const char *stage, int64_t t, size_t bytes, int64_t frames)
+{
+    double secs = FFMAX(t, 1) / 1000000.0;
+
+    printf("%-24s %10.1f MB/s %10.1f frames/s %8.3fs\n", stage,
+           bytes / secs / 1000000.0, frames / secs, secs);
+}
+
+static int bench_demux(BenchContext *bc, const char *filename)
+{
+    AVFormatContext *fmt = NULL;
+    AVPacket *pkt;
+    int64_t t;
+    int ret, idx;
+
+    ret = avformat_open_input(&fmt, filename, NULL, NULL);
+    if (ret < 0) {
+        fprintf(stderr, "Error opening input file: %s\n", av_err2str(ret));
+        return ret;
+    }
+
+    ret = avformat_find_stream_info(fmt, NULL);
+    if (ret < 0)
+        goto end;
+
+    idx = av_find_best_stream(fmt, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0);
+    if (idx < 0 || fmt->streams[idx]->codecpar->codec_id != AV_CODEC_ID_EVC) {
+        fprintf(stderr, "No EVC stream in the input\n");
+        ret = AVERROR(EINVAL);
+        goto end;
+    }
+
+    pkt = av_packet_alloc();
+    if (!pkt) {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+
+    t = av_gettime_relative();
+    while ((ret = av_read_frame(fmt, pkt)) >= 0) {
+        AVPacket **pkts;
+
+        if (pkt->stream_index != idx) {
+            av_packet_unref(pkt);
+            continue;
+        }
+
+        pkts = av_realloc_array(bc->pkts, bc->nb_pkts + 1, sizeof(*bc->pkts));
+        if (!pkts) {
+            ret = AVERROR(ENOMEM);
+            break;
+        }
+        bc->pkts = pkts;
+
+        bc->pkts_size += pkt->size;
+        bc->pkts[bc->nb_pkts++] = pkt;
+
+        pkt = av_packet_alloc();
+        if (!pkt) {
+            ret = AVERROR(ENOMEM);
+            break;
+        }
+    }
+    t = av_gettime_relative() - t;
+    av_packet_free(&pkt);
+
+    if (ret != AVERROR_EOF)
+        goto end;
+    ret = 0;
+
+    report("demux", t, bc->pkts_size, bc->nb_pkts);
+
+    bc->par = avcodec_parameters_alloc();
+    if (!bc->par) {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+    ret = avcodec_parameters_copy(bc->par, fmt->streams[idx]->codecpar);
+    bc->time_base  = fmt->streams[idx]->time_base;
+    bc->frame_rate = fmt->streams[idx]->avg_frame_rate;
+
+end:
+    avformat_close_input(&fmt);
+    return ret;
+}
+
+static int bench_bsf(BenchContext *bc)
+{
+    const AVBitStreamFilter *filter = av_bsf_get_by_name("evc_frame_merge");
+    AVBSFContext *bsf = NULL;
+    AVPacket *pkt;
+    int64_t t, nb_out = 0;
+    int ret;
+
+    if (!filter) {
+        printf("%-24s not available\n", "evc_frame_merge");
+        return 0;
+    }
+
+    pkt = av_packet_alloc();
+    if (!pkt)
+        return AVERROR(ENOMEM);
+
+    ret = av_bsf_alloc(filter, &bsf);
+    if (ret < 0)
+        goto end;
+    ret = avcodec_parameters_copy(bsf->par_in, bc->par);
+    if (ret < 0)
+        goto end;
+    bsf->time_base_in = bc->time_base;
+    ret = av_bsf_init(bsf);
+    if (ret < 0)
+        goto end;
+
+    t = av_gettime_relative();
+    for (int i = 0; i <= bc->nb_pkts; i++) {
+        if (i < bc->nb_pkts) {
+            ret = av_packet_ref(pkt, bc->pkts[i]);
+            if (ret < 0)
+                goto end;
+        }
+
+        ret = av_bsf_send_packet(bsf, i < bc->nb_pkts ? pkt : NULL);
+        if (ret < 0)
+            goto end;
+
+        while ((ret = av_bsf_receive_packet(bsf, pkt)) >= 0) {
+            av_packet_unref(pkt);
+            nb_out++;
+        }
+        if (ret != AVERROR(EAGAIN) && ret != AVERROR_EOF)
+            goto end;
+    }
+    t = av_gettime_relative() - t;
+    ret = 0;
+
+    report("evc_frame_merge", t, bc->pkts_size, nb_out);
+
+end:
+    av_bsf_free(&bsf);
+    av_packet_free(&pkt);
+    return ret;
+}
+
+static int bench_parser(BenchContext *bc)
+{
+    AVCodecParserContext *parser = av_parser_init(AV_CODEC_ID_EVC);
+    AVCodecContext *avctx = NULL;
+    int64_t t;
+    int ret;
+
+    if (!parser) {
+        printf("%-24s not available\n", "parser");
+        return 0;
+    }
+    parser->flags |= PARSER_FLAG_COMPLETE_FRAMES;
+
+    avctx = avcodec_alloc_context3(NULL);
+    if (!avctx) {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+    ret = avcodec_parameters_to_context(avctx, bc->par);
+    if (ret < 0)
+        goto end;
+
+    t = av_gettime_relative();
+    for (int i = 0; i < bc->nb_pkts; i++) {
+        const AVPacket *pkt = bc->pkts[i];
+        uint8_t *out;
+        int out_size;
+
+        av_parser_parse2(parser, avctx, &out, &out_size, pkt->data, pkt->size,
+                         pkt->pts, pkt->dts, pkt->pos);
+    }
+    t = av_gettime_relative() - t;
+
+    report("parser", t, bc->pkts_size, bc->nb_pkts);
+
+end:
+    avcodec_free_context(&avctx);
+    av_parser_close(parser);
+    return ret;
+}
+
+static int bench_decode(BenchContext *bc, int zero_copy)
+{
+    const char *stage = zero_copy ? "libxevd (zero copy)" : "libxevd";
+    const AVCodec *codec = avcodec_find_decoder_by_name("evc");
+    AVCodecContext *dec = NULL;
+    AVDictionary *opts = NULL;
+    AVFrame *frame;
+    int64_t t, nb_frames = 0;
+    int ret;
+
+    if (!codec || !codec->wrapper_name || strcmp(codec->wrapper_name, "libxevd")) {
+        printf("%-24s not available\n", stage);
+        return 0;
+    }
+
+    frame = av_frame_alloc();
+    if (!frame)
+        return AVERROR(ENOMEM);
+
+    dec = avcodec_alloc_context3(codec);
+    if (!dec) {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+    ret = avcodec_parameters_to_context(dec, bc->par);
+    if (ret < 0)
+        goto end;
+    dec->pkt_timebase = bc->time_base;
+
+    av_dict_set(&opts, "threads", bc->threads, 0);
+    av_dict_set_int(&opts, "zero_copy", zero_copy, 0);
+    ret = avcodec_open2(dec, codec, &opts);
+    if (ret < 0)
+        goto end;
+
+    t = av_gettime_relative();
+    for (int i = 0; i <= bc->nb_pkts; i++) {
+        ret = avcodec_send_packet(dec, i < bc->nb_pkts ? bc->pkts[i] : NULL);
+        if (ret < 0)
+            goto end;
+
+        while ((ret = avcodec_receive_frame(dec, frame)) >= 0) {
+            // keep the copied pictures as encoder input
+            if (!zero_copy && bc->nb_frames < bc->max_frames) {
+                AVFrame **frames = av_realloc_array(bc->frames, bc->nb_frames + 1,
+                                                    sizeof(*bc->frames));
+                if (!frames) {
+                    ret = AVERROR(ENOMEM);
+                    goto end;
+                }
+                bc->frames = frames;
+                bc->frames[bc->nb_frames] = av_frame_clone(frame);
+                if (!bc->frames[bc->nb_frames]) {
+                    ret = AVERROR(ENOMEM);
+                    goto end;
+                }
+                bc->nb_frames++;
+            }
+            av_frame_unref(frame);
+            nb_frames++;
+        }
+        if (ret != AVERROR(EAGAIN) && ret != AVERROR_EOF)
+            goto end;
+    }
+    t = av_gettime_relative() - t;
+    ret = 0;
+
+    report(stage, t, bc->pkts_size, nb_frames);
+
+end:
+    if (ret < 0)
+        fprintf(stderr, "%s: %s\n", stage, av_err2str(ret));
+    av_dict_free(&opts);
+    avcodec_free_context(&dec);
+    av_frame_free(&frame);
+    return ret;
+}
+
+static int bench_encode(BenchContext *bc, const char *preset)
+{
+    const AVCodec *codec = avcodec_find_encoder_by_name("libxeve");
+    AVCodecContext *enc = NULL;
+    AVDictionary *opts = NULL;
+    AVPacket *pkt;
+    char stage[64];
+    size_t bytes = 0;
+    int64_t t;
+    int ret;
+
+    snprintf(stage, sizeof(stage), "libxeve (%s)", preset);
+    if (!codec || !bc->nb_frames) {
+        printf("%-24s not available\n", stage);
+        return 0;
+    }
+
+    pkt = av_packet_alloc();
+    if (!pkt)
+        return AVERROR(ENOMEM);
+
+    enc = avcodec_alloc_context3(codec);
+    if (!enc) {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+    enc->width     = bc->frames[0]->width;
+    enc->height    = bc->frames[0]->height;
+    enc->pix_fmt   = bc->frames[0]->format;
+    enc->time_base = bc->time_base;
+    enc->framerate = bc->frame_rate.num ? bc->frame_rate : (AVRational){ 25, 1 };
+
+    av_dict_set(&opts, "threads", bc->threads, 0);
+    av_dict_set(&opts, "preset", preset, 0);
+    ret = avcodec_open2(enc, codec, &opts);
+    if (ret < 0)
+        goto end;
+
+    for (int i = 0; i < bc->nb_frames; i++)
+        bytes += av_image_get_buffer_size(bc->frames[i]->format, bc->frames[i]->width,
+                                          bc->frames[i]->height, 1);
+
+    t = av_gettime_relative();
+    for (int i = 0; i <= bc->nb_frames; i++) {
+        ret = avcodec_send_frame(enc, i < bc->nb_frames ? bc->frames[i] : NULL);
+        if (ret < 0)
+            goto end;
+
+        while ((ret = avcodec_receive_packet(enc, pkt)) >= 0)
+            av_packet_unref(pkt);
+        if (ret != AVERROR(EAGAIN) && ret != AVERROR_EOF)
+            goto end;
+    }
+    t = av_gettime_relative() - t;
+    ret = 0;
+
+    // MB/s of raw input pictures
+    report(stage, t, bytes, bc->nb_frames);
+
+end:
+    if (ret < 0)
+        fprintf(stderr, "%s: %s\n", stage, av_err2str(ret));
+    av_dict_free(&opts);
+    avcodec_free_context(&enc);
+    av_packet_free(&pkt);
+    return ret;
+}
+
+static int bench_mux(BenchContext *bc, const char *format)
+{
+    AVFormatContext *mux = NULL;
+    AVDictionary *opts = NULL;
+    AVPacket *pkt;
+    AVStream *st;
+    uint8_t *buf;
+    char stage[64];
+    int64_t t;
+    int ret;
+
+    snprintf(stage, sizeof(stage), "mux (%s)", format);
+    if (!av_guess_format(format, NULL, NULL)) {
+        printf("%-24s not available\n", stage);
+        return 0;
+    }
+
+    pkt = av_packet_alloc();
+    if (!pkt)
+        return AVERROR(ENOMEM);
+
+    ret = avformat_alloc_output_context2(&mux, NULL, format, NULL);
+    if (ret < 0)
+        goto end;
+
+    st = avformat_new_stream(mux, NULL);
+    if (!st) {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+    ret = avcodec_parameters_copy(st->codecpar, bc->par);
+    if (ret < 0)
+        goto end;
+    st->codecpar->codec_tag = 0;
+    st->time_base = bc->time_base;
+
+    // the output is kept in memory, which is not seekable
+    ret = avio_open_dyn_buf(&mux->pb);
+    if (ret < 0)
+        goto end;
+    av_dict_set(&opts, "movflags", "frag_keyframe+delay_moov", 0);
+
+    t = av_gettime_relative();
+    ret = avformat_write_header(mux, &opts);
+    if (ret < 0)
+        goto end;
+
+    for (int i = 0; i < bc->nb_pkts; i++) {
+        ret = av_packet_ref(pkt, bc->pkts[i]);
+        if (ret < 0)
+            goto end;
+        pkt->stream_index = 0;
+        av_packet_rescale_ts(pkt, bc->time_base, st->time_base);
+
+        ret = av_write_frame(mux, pkt);
+        av_packet_unref(pkt);
+        if (ret < 0)
+            goto end;
+    }
+
+    ret = av_write_trailer(mux);
+    if (ret < 0)
+        goto end;
+    t = av_gettime_relative() - t;
+
+    report(stage, t, bc->pkts_size, bc->nb_pkts);
+
+end:
+    if (ret < 0)
+        fprintf(stderr, "%s: %s\n", stage, av_err2str(ret));
+    if (mux && mux->pb) {
+        avio_close_dyn_buf(mux->pb, &buf);
+        av_free(buf);
+    }
+    av_dict_free(&opts);
+    avformat_free_context(mux);
+    av_packet_free(&pkt);
+    return ret;
+}
+
+int main(int argc, char **argv)
+{
+    static const char *const presets[] = { "fast", "medium", "slow" };
+    BenchContext bc = { .threads = "1", .max_frames = 100 };
+    int ret;
+
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s <input file> [<thread count> [<max encoded frames> [<preset>]]]\n",
+                argv[0]);
+        return 1;
+    }
+
+    if (argc > 2)
+        bc.threads = argv[2];
+    if (argc > 3)
+        bc.max_frames = strtol(argv[3], NULL, 0);
+
+    ret = bench_demux(&bc, argv[1]);
+    if (ret < 0)
+        goto end;
+
+    if ((ret = bench_bsf(&bc))        < 0 ||
+        (ret = bench_parser(&bc))     < 0 ||
+        (ret = bench_decode(&bc, 0))  < 0 ||
+        (ret = bench_decode(&bc, 1))  < 0)
+        goto end;
+
+    for (int i = 0; i < FF_ARRAY_ELEMS(presets); i++) {
+        if (argc > 4 && strcmp(argv[4], presets[i]))
+            continue;
+        ret = bench_encode(&bc, presets[i]);
+        if (ret < 0)
+            goto end;
+    }
+
+    if ((ret = bench_mux(&bc, "mp4")) < 0 ||
+        (ret = bench_mux(&bc, "evc")) < 0)
+        goto end;
+
+end:
+    for (int i = 0; i < bc.nb_pkts; i++)
+        av_packet_free(&bc.pkts[i]);
+    av_freep(&bc.pkts);
+    for (int i = 0; i < bc.nb_frames; i++)
+        av_frame_free(&bc.frames[i]);
+    av_freep(&bc.frames);
+    avcodec_parameters_free(&bc.par);
+
+    return ret < 0;
+}
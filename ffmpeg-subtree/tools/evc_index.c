@@ -0,0 +1,433 @@
+/*
+ * Copyright (c) 2023
+ *
+ * This file is part of FFmpeg.
+ *
+ * FFmpeg is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * FFmpeg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with FFmpeg; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/*
+ * Build the IDR index of a raw EVC file, to be loaded by the evc demuxer with
+ * its index_file option.
+ *
+ * The file is split into one chunk per thread. Each worker finds the first
+ * NAL unit of its chunk by looking for a chain of plausible length prefixes
+ * and NAL unit headers, then walks the NAL unit headers up to the end of the
+ * chunk, skipping their payload. The walks are then joined: a chunk is only
+ * used if it starts where the walk of the chunks before it ended, otherwise it
+ * is walked again from there. The IDR access units are finally found the same
+ * way as the demuxer does, every slice counting as a picture.
+ */
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "libavformat/avio.h"
+
+#include "libavcodec/evc.h"
+
+#include "libavutil/avstring.h"
+#include "libavutil/cpu.h"
+#include "libavutil/error.h"
+#include "libavutil/intreadwrite.h"
+#include "libavutil/macros.h"
+#include "libavutil/mem.h"
+#include "libavutil/thread.h"
+
+// number of chained NAL units a resynchronisation point must be followed by
+#define SYNC_NALUS 4
+// amount of a chunk read at once when looking for its first NAL unit
+#define SYNC_BUF_SIZE (64 << 10)
+// chunks are not made smaller than this
+#define MIN_CHUNK_SIZE (1 << 20)
+
+typedef struct IndexNalu {
+    int64_t pos;
+    int     type;
+} IndexNalu;
+
+typedef struct IndexChunk {
+    const char *input;
+    int64_t file_size;
+    int64_t start, end;     // byte range of the chunk
+
+    int64_t sync;           // position of the first NAL unit found, -1 if none
+    int64_t stop;           // position of the first NAL unit after the chunk
+    int     invalid;        // the walk stopped on an invalid NAL unit at stop
+
+    // the slices and the first non-VCL NAL unit following each of them
+    IndexNalu *nalus;
+    int     nb_nalus;
+    unsigned nalus_size;
+    int     ret;
+} IndexChunk;
+
+static int is_vcl(int nalu_type)
+{
+    return nalu_type == EVC_NOIDR_NUT || nalu_type == EVC_IDR_NUT;
+}
+
+/**
+ * Read the NAL unit at pos, the same checks as the demuxer probe are applied.
+ *
+ * @return the NAL unit type, -1 if the NAL unit is invalid or truncated
+ */
+static int read_nalu(AVIOContext *pb, int64_t file_size, int64_t pos, uint32_t *nalu_size)
+{
+    uint8_t buf[EVC_NALU_LENGTH_PREFIX_SIZE + EVC_NALU_HEADER_SIZE];
+    int nalu_type;
+
+    if (avio_seek(pb, pos, SEEK_SET) < 0 || avio_read(pb, buf, sizeof(buf)) != sizeof(buf))
+        return -1;
+
+    *nalu_size = ff_evc_nal_unit_length(buf, sizeof(buf));
+    nalu_type  = ff_evc_nal_unit_type(buf + EVC_NALU_LENGTH_PREFIX_SIZE, EVC_NALU_HEADER_SIZE);
+    if (*nalu_size < EVC_NALU_HEADER_SIZE || nalu_type < 0 ||
+        buf[EVC_NALU_LENGTH_PREFIX_SIZE + 1] & 0x3F ||
+        *nalu_size > file_size - pos - EVC_NALU_LENGTH_PREFIX_SIZE)
+        return -1;
+
+    return nalu_type;
+}
+
+/**
+ * @return 1 if pos starts SYNC_NALUS valid NAL units in a row, or valid NAL units up
+ *         to the end of the file
+ */
+static int is_sync_point(AVIOContext *pb, int64_t file_size, int64_t pos)
+{
+    for (int i = 0; i < SYNC_NALUS && pos < file_size; i++) {
+        uint32_t nalu_size;
+
+        if (read_nalu(pb, file_size, pos, &nalu_size) < 0)
+            return 0;
+        pos += EVC_NALU_LENGTH_PREFIX_SIZE + nalu_size;
+    }
+
+    return 1;
+}
+
+static int64_t find_sync_point(AVIOContext *pb, const IndexChunk *chunk)
+{
+    uint8_t *buf;
+    int64_t pos = chunk->start, ret = -1;
+
+    if (!pos)
+        return 0;
+
+    buf = av_malloc(SYNC_BUF_SIZE);
+    if (!buf)
+        return AVERROR(ENOMEM);
+
+    while (pos < chunk->end && ret < 0) {
+        int len;
+
+        if (avio_seek(pb, pos, SEEK_SET) < 0)
+            break;
+        len = avio_read(pb, buf, SYNC_BUF_SIZE);
+        if (len < EVC_NALU_LENGTH_PREFIX_SIZE + EVC_NALU_HEADER_SIZE)
+            break;
+
+        for (int i = 0; i + EVC_NALU_LENGTH_PREFIX_SIZE + EVC_NALU_HEADER_SIZE <= len &&
+                        pos + i < chunk->end; i++) {
+            const uint8_t *nalu = buf + i + EVC_NALU_LENGTH_PREFIX_SIZE;
+            uint32_t nalu_size = AV_RB32(buf + i);
+
+            // cheap checks on the buffer first, the chain is read from the file
+            if (nalu_size < EVC_NALU_HEADER_SIZE ||
+                nalu_size > chunk->file_size - pos - i - EVC_NALU_LENGTH_PREFIX_SIZE ||
+                ff_evc_nal_unit_type(nalu, EVC_NALU_HEADER_SIZE) < 0 || nalu[1] & 0x3F)
+                continue;
+            if (is_sync_point(pb, chunk->file_size, pos + i)) {
+                ret = pos + i;
+                break;
+            }
+        }
+        // the last bytes of the buffer are checked again at the start of the next one
+        pos += len - (EVC_NALU_LENGTH_PREFIX_SIZE + EVC_NALU_HEADER_SIZE) + 1;
+    }
+
+    av_free(buf);
+    return ret;
+}
+
+static int add_nalu(IndexChunk *chunk, int64_t pos, int type)
+{
+    IndexNalu *nalu;
+
+    // only the first non-VCL NAL unit after a slice starts an access unit, the first
+    // NAL unit of the chunk is kept as the previous chunk may end with a slice
+    if (!is_vcl(type) && chunk->nb_nalus && !is_vcl(chunk->nalus[chunk->nb_nalus - 1].type))
+        return 0;
+
+    nalu = av_fast_realloc(chunk->nalus, &chunk->nalus_size,
+                           (chunk->nb_nalus + 1) * sizeof(*chunk->nalus));
+    if (!nalu)
+        return AVERROR(ENOMEM);
+    chunk->nalus = nalu;
+    chunk->nalus[chunk->nb_nalus++] = (IndexNalu){ pos, type };
+
+    return 0;
+}
+
+/**
+ * Walk the NAL units from chunk->sync to the first one at or after the end of the chunk.
+ */
+static int walk_chunk(AVIOContext *pb, IndexChunk *chunk)
+{
+    int64_t pos = chunk->sync;
+
+    chunk->nb_nalus = 0;
+    chunk->invalid  = 0;
+
+    while (pos < chunk->end) {
+        uint32_t nalu_size;
+        int nalu_type = read_nalu(pb, chunk->file_size, pos, &nalu_size);
+        int ret;
+
+        if (nalu_type < 0) {
+            chunk->invalid = 1;
+            break;
+        }
+        if ((ret = add_nalu(chunk, pos, nalu_type)) < 0)
+            return ret;
+        pos += EVC_NALU_LENGTH_PREFIX_SIZE + nalu_size;
+    }
+    chunk->stop = pos;
+
+    return 0;
+}
+
+static void *index_worker(void *arg)
+{
+    IndexChunk *chunk = arg;
+    AVIOContext *pb;
+    int64_t sync;
+
+    chunk->ret = avio_open(&pb, chunk->input, AVIO_FLAG_READ);
+    if (chunk->ret < 0)
+        return NULL;
+
+    sync = find_sync_point(pb, chunk);
+    if (sync < -1) {
+        chunk->ret = sync;
+    } else {
+        chunk->sync = sync;
+        if (sync >= 0)
+            chunk->ret = walk_chunk(pb, chunk);
+    }
+
+    avio_closep(&pb);
+    return NULL;
+}
+
+/**
+ * Join the walks of the chunks, walking again the chunks which do not start where
+ * the walk of the previous ones ended.
+ *
+ * @return the number of NAL units of the validated chain
+ */
+static int join_chunks(IndexChunk *chunks, int nb_chunks, int *nb_rewalked)
+{
+    AVIOContext *pb = NULL;
+    int64_t expected = 0;
+    int ret = 0;
+
+    *nb_rewalked = 0;
+    for (int i = 0; i < nb_chunks; i++) {
+        IndexChunk *chunk = &chunks[i];
+
+        // a NAL unit of the previous chunks covers this one
+        if (expected >= chunk->end) {
+            chunk->nb_nalus = 0;
+            continue;
+        }
+
+        if (chunk->sync != expected) {
+            if (!pb && (ret = avio_open(&pb, chunk->input, AVIO_FLAG_READ)) < 0)
+                break;
+            chunk->sync = expected;
+            if ((ret = walk_chunk(pb, chunk)) < 0)
+                break;
+            (*nb_rewalked)++;
+        }
+        expected = chunk->stop;
+
+        if (chunk->invalid) {
+            fprintf(stderr, "Invalid NAL unit at %"PRId64", the index stops there\n", chunk->stop);
+            for (int j = i + 1; j < nb_chunks; j++)
+                chunks[j].nb_nalus = 0;
+            break;
+        }
+    }
+
+    avio_closep(&pb);
+    return ret;
+}
+
+static int write_index(const char *output, const IndexChunk *chunks, int nb_chunks,
+                       int64_t file_size, int64_t *nb_idr, int64_t *nb_pictures)
+{
+    AVIOContext *pb;
+    int64_t pictures = 0, idrs = 0, au_pos = 0;
+    int prev_vcl = 0, ret;
+
+    ret = avio_open(&pb, output, AVIO_FLAG_WRITE);
+    if (ret < 0)
+        return ret;
+
+    // the number of pictures only known at the end is written in a fixed width field
+    avio_printf(pb, "EVCIDX 1 %"PRId64" %20"PRId64"\n", file_size, (int64_t)0);
+
+    for (int i = 0; i < nb_chunks; i++) {
+        for (int j = 0; j < chunks[i].nb_nalus; j++) {
+            const IndexNalu *nalu = &chunks[i].nalus[j];
+
+            if (is_vcl(nalu->type)) {
+                if (!prev_vcl || nalu->type == EVC_IDR_NUT) {
+                    if (prev_vcl)
+                        au_pos = nalu->pos;
+                    if (nalu->type == EVC_IDR_NUT) {
+                        avio_printf(pb, "%"PRId64" %"PRId64"\n", au_pos, pictures);
+                        idrs++;
+                    }
+                }
+                pictures++;
+                prev_vcl = 1;
+            } else if (prev_vcl) {
+                au_pos   = nalu->pos;
+                prev_vcl = 0;
+            }
+        }
+    }
+
+    avio_seek(pb, 0, SEEK_SET);
+    avio_printf(pb, "EVCIDX 1 %"PRId64" %20"PRId64"\n", file_size, pictures);
+    avio_flush(pb);
+    ret = pb->error;
+    avio_closep(&pb);
+
+    *nb_idr      = idrs;
+    *nb_pictures = pictures;
+    return ret;
+}
+
+int main(int argc, char **argv)
+{
+    const char *input, *output;
+    char *default_output = NULL;
+    IndexChunk *chunks = NULL;
+    pthread_t *threads = NULL;
+    AVIOContext *pb;
+    int64_t file_size, chunk_size, nb_idr = 0, nb_pictures = 0;
+    int nb_threads = av_cpu_count(), nb_chunks, nb_rewalked, nb_started = 0;
+    int i, ret;
+
+    for (i = 1; i + 1 < argc && argv[i][0] == '-'; i += 2) {
+        if (!strcmp(argv[i], "-threads")) {
+            nb_threads = atoi(argv[i + 1]);
+            if (nb_threads <= 0) {
+                fprintf(stderr, "Invalid thread count '%s'\n", argv[i + 1]);
+                return 1;
+            }
+        } else {
+            break;
+        }
+    }
+
+    if (argc - i < 1 || argc - i > 2) {
+        fprintf(stderr, "Usage: %s [-threads <count>] <input file> [<index file>]\n"
+                "The index is written to <input file>.idx by default.\n", argv[0]);
+        return 1;
+    }
+    input = argv[i];
+    if (argc - i == 2) {
+        output = argv[i + 1];
+    } else {
+        output = default_output = av_asprintf("%s.idx", input);
+        if (!output)
+            return 1;
+    }
+
+    ret = avio_open(&pb, input, AVIO_FLAG_READ);
+    if (ret < 0)
+        goto end;
+    file_size = avio_size(pb);
+    avio_closep(&pb);
+    if (file_size <= 0) {
+        ret = file_size < 0 ? file_size : AVERROR_INVALIDDATA;
+        goto end;
+    }
+
+    chunk_size = FFMAX((file_size + nb_threads - 1) / nb_threads, MIN_CHUNK_SIZE);
+    nb_chunks  = (file_size + chunk_size - 1) / chunk_size;
+
+    chunks  = av_calloc(nb_chunks, sizeof(*chunks));
+    threads = av_calloc(nb_chunks, sizeof(*threads));
+    if (!chunks || !threads) {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+
+    for (nb_started = 0; nb_started < nb_chunks; nb_started++) {
+        IndexChunk *chunk = &chunks[nb_started];
+
+        chunk->input     = input;
+        chunk->file_size = file_size;
+        chunk->start     = nb_started * chunk_size;
+        chunk->end       = FFMIN(chunk->start + chunk_size, file_size);
+        chunk->sync      = -1;
+        ret = pthread_create(&threads[nb_started], NULL, index_worker, chunk);
+        if (ret) {
+            ret = AVERROR(ret);
+            break;
+        }
+    }
+    for (i = 0; i < nb_started; i++) {
+        pthread_join(threads[i], NULL);
+        if (chunks[i].ret < 0 && ret >= 0)
+            ret = chunks[i].ret;
+    }
+    if (ret < 0)
+        goto end;
+
+    ret = join_chunks(chunks, nb_chunks, &nb_rewalked);
+    if (ret < 0)
+        goto end;
+
+    ret = write_index(output, chunks, nb_chunks, file_size, &nb_idr, &nb_pictures);
+    if (ret < 0)
+        goto end;
+
+    printf("%s: %"PRId64" IDR access units, %"PRId64" pictures, %d chunks "
+           "(%d walked again)\n", output, nb_idr, nb_pictures, nb_chunks, nb_rewalked);
+
+end:
+    if (chunks) {
+        for (i = 0; i < nb_chunks; i++)
+            av_free(chunks[i].nalus);
+    }
+    av_free(chunks);
+    av_free(threads);
+    av_free(default_output);
+
+    if (ret < 0) {
+        fprintf(stderr, "Indexing %s failed: %s\n", input, av_err2str(ret));
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,284 @@
+/*
+ * Copyright (c) 2023
+ *
+ * This file is part of FFmpeg.
+ *
+ * FFmpeg is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * FFmpeg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with FFmpeg; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/*
+ * Merge EVC streams into a mosaic without decoding them.
+ *
+ * The EVC video stream of every input is read one packet at a time and the
+ * packets are given in turn to the evc_mosaic bitstream filter, the inputs
+ * being placed in raster order. The mosaic takes the timestamps of the first
+ * input and ends with the shortest one. The extradata of the other inputs
+ * is sent with their first packet, so that the filter checks that all the
+ * inputs use the same parameter sets.
+ *
+ * The parameter sets are written where the first input has them: an output
+ * format without global header needs them in band.
+ */
+
+#include <inttypes.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "libavformat/avformat.h"
+
+#include "libavcodec/avcodec.h"
+#include "libavcodec/bsf.h"
+
+#include "libavutil/error.h"
+#include "libavutil/mem.h"
+#include "libavutil/opt.h"
+
+typedef struct MosaicInput {
+    AVFormatContext *fmt;
+    AVStream *st;
+    // the extradata was sent with a packet
+    int sent;
+} MosaicInput;
+
+typedef struct MosaicContext {
+    MosaicInput *in;
+    int nb_inputs;
+    int columns;
+    int rows;
+
+    AVBSFContext *bsf;
+    AVFormatContext *ofmt;
+    AVStream *ost;
+
+    int64_t nb_pictures;
+} MosaicContext;
+
+static int open_input(MosaicInput *in, const char *filename)
+{
+    int ret, idx;
+
+    ret = avformat_open_input(&in->fmt, filename, NULL, NULL);
+    if (ret < 0)
+        return ret;
+    ret = avformat_find_stream_info(in->fmt, NULL);
+    if (ret < 0)
+        return ret;
+
+    idx = av_find_best_stream(in->fmt, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0);
+    if (idx < 0 || in->fmt->streams[idx]->codecpar->codec_id != AV_CODEC_ID_EVC) {
+        fprintf(stderr, "No EVC stream in %s\n", filename);
+        return AVERROR_STREAM_NOT_FOUND;
+    }
+    in->st = in->fmt->streams[idx];
+
+    return 0;
+}
+
+static int open_output(MosaicContext *mc, const char *filename)
+{
+    const AVBitStreamFilter *filter = av_bsf_get_by_name("evc_mosaic");
+    const MosaicInput *first = &mc->in[0];
+    int ret;
+
+    if (!filter) {
+        fprintf(stderr, "The evc_mosaic bitstream filter is not available\n");
+        return AVERROR_BSF_NOT_FOUND;
+    }
+
+    ret = av_bsf_alloc(filter, &mc->bsf);
+    if (ret < 0)
+        return ret;
+    ret = avcodec_parameters_copy(mc->bsf->par_in, first->st->codecpar);
+    if (ret < 0)
+        return ret;
+    mc->bsf->time_base_in = first->st->time_base;
+    av_opt_set_int(mc->bsf, "columns", mc->columns, AV_OPT_SEARCH_CHILDREN);
+    av_opt_set_int(mc->bsf, "rows",    mc->rows,    AV_OPT_SEARCH_CHILDREN);
+    ret = av_bsf_init(mc->bsf);
+    if (ret < 0)
+        return ret;
+    // the filter has the extradata of the first input
+    mc->in[0].sent = 1;
+
+    ret = avformat_alloc_output_context2(&mc->ofmt, NULL, NULL, filename);
+    if (ret < 0)
+        return ret;
+    mc->ost = avformat_new_stream(mc->ofmt, NULL);
+    if (!mc->ost)
+        return AVERROR(ENOMEM);
+    ret = avcodec_parameters_copy(mc->ost->codecpar, mc->bsf->par_out);
+    if (ret < 0)
+        return ret;
+    mc->ost->codecpar->codec_tag = 0;
+    mc->ost->time_base           = mc->bsf->time_base_out;
+    mc->ost->avg_frame_rate      = first->st->avg_frame_rate;
+
+    if (!(mc->ofmt->oformat->flags & AVFMT_NOFILE)) {
+        ret = avio_open(&mc->ofmt->pb, filename, AVIO_FLAG_WRITE);
+        if (ret < 0)
+            return ret;
+    }
+    return avformat_write_header(mc->ofmt, NULL);
+}
+
+static int write_packets(MosaicContext *mc, AVPacket *pkt)
+{
+    int ret;
+
+    while ((ret = av_bsf_receive_packet(mc->bsf, pkt)) >= 0) {
+        av_packet_rescale_ts(pkt, mc->bsf->time_base_out, mc->ost->time_base);
+        pkt->stream_index = 0;
+        ret = av_interleaved_write_frame(mc->ofmt, pkt);
+        if (ret < 0)
+            return ret;
+        mc->nb_pictures++;
+    }
+
+    return ret == AVERROR(EAGAIN) || ret == AVERROR_EOF ? 0 : ret;
+}
+
+// Read the next packet of the EVC stream of an input.
+static int read_packet(MosaicInput *in, AVPacket *pkt)
+{
+    const AVCodecParameters *par = in->st->codecpar;
+    int ret;
+
+    while ((ret = av_read_frame(in->fmt, pkt)) >= 0) {
+        if (pkt->stream_index == in->st->index)
+            break;
+        av_packet_unref(pkt);
+    }
+    if (ret < 0)
+        return ret;
+
+    if (!in->sent && par->extradata_size) {
+        uint8_t *side_data = av_packet_new_side_data(pkt, AV_PKT_DATA_NEW_EXTRADATA,
+                                                     par->extradata_size);
+        if (!side_data)
+            return AVERROR(ENOMEM);
+        memcpy(side_data, par->extradata, par->extradata_size);
+    }
+    in->sent = 1;
+
+    return 0;
+}
+
+static int mosaic(MosaicContext *mc, AVPacket *pkt)
+{
+    int ret;
+
+    for (;;) {
+        for (int i = 0; i < mc->nb_inputs; i++) {
+            ret = read_packet(&mc->in[i], pkt);
+            // the mosaic ends with the shortest input, the filter drops
+            // the incomplete picture
+            if (ret == AVERROR_EOF)
+                goto flush;
+            if (ret < 0)
+                return ret;
+
+            ret = av_bsf_send_packet(mc->bsf, pkt);
+            if (ret < 0)
+                return ret;
+            ret = write_packets(mc, pkt);
+            if (ret < 0)
+                return ret;
+        }
+    }
+
+flush:
+    ret = av_bsf_send_packet(mc->bsf, NULL);
+    if (ret < 0)
+        return ret;
+    ret = write_packets(mc, pkt);
+    if (ret < 0)
+        return ret;
+
+    return av_write_trailer(mc->ofmt);
+}
+
+int main(int argc, char **argv)
+{
+    MosaicContext mc = { 0 };
+    AVPacket *pkt = NULL;
+    int i, ret;
+
+    for (i = 1; i + 1 < argc && argv[i][0] == '-'; i += 2) {
+        if (!strcmp(argv[i], "-columns")) {
+            mc.columns = atoi(argv[i + 1]);
+        } else if (!strcmp(argv[i], "-rows")) {
+            mc.rows = atoi(argv[i + 1]);
+        } else {
+            break;
+        }
+    }
+
+    mc.nb_inputs = argc - i - 1;
+    if (mc.nb_inputs < 1 || mc.columns < 0 || mc.rows < 0) {
+        fprintf(stderr, "Usage: %s [-columns <n>] [-rows <n>] "
+                "<input file> [<input file>...] <output file>\n", argv[0]);
+        return 1;
+    }
+    // as square as possible by default
+    if (!mc.columns)
+        mc.columns = mc.rows ? (mc.nb_inputs + mc.rows - 1) / mc.rows :
+                               (int)ceil(sqrt(mc.nb_inputs));
+    if (!mc.rows)
+        mc.rows = (mc.nb_inputs + mc.columns - 1) / mc.columns;
+    if (mc.columns * mc.rows != mc.nb_inputs) {
+        fprintf(stderr, "%d inputs do not fill a %dx%d mosaic\n",
+                mc.nb_inputs, mc.columns, mc.rows);
+        return 1;
+    }
+
+    mc.in = av_calloc(mc.nb_inputs, sizeof(*mc.in));
+    pkt   = av_packet_alloc();
+    if (!mc.in || !pkt) {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+
+    for (int j = 0; j < mc.nb_inputs; j++) {
+        ret = open_input(&mc.in[j], argv[i + j]);
+        if (ret < 0)
+            goto end;
+    }
+
+    ret = open_output(&mc, argv[argc - 1]);
+    if (ret >= 0)
+        ret = mosaic(&mc, pkt);
+    if (ret >= 0)
+        printf("%"PRId64" pictures of %dx%d merged\n", mc.nb_pictures,
+               mc.ost->codecpar->width, mc.ost->codecpar->height);
+
+end:
+    if (ret < 0)
+        fprintf(stderr, "Error: %s\n", av_err2str(ret));
+
+    av_packet_free(&pkt);
+    av_bsf_free(&mc.bsf);
+    if (mc.ofmt && !(mc.ofmt->oformat->flags & AVFMT_NOFILE))
+        avio_closep(&mc.ofmt->pb);
+    avformat_free_context(mc.ofmt);
+    if (mc.in) {
+        for (int j = 0; j < mc.nb_inputs; j++)
+            avformat_close_input(&mc.in[j].fmt);
+        av_freep(&mc.in);
+    }
+
+    return ret < 0;
+}
@@ -0,0 +1,350 @@
+/*
+ * Copyright (c) 2023
+ *
+ * This file is part of FFmpeg.
+ *
+ * FFmpeg is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * FFmpeg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with FFmpeg; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/*
+ * Seek latency of EVC inputs, raw or in any container.
+ *
+ * Random seek targets are drawn over the duration of the EVC stream, then
+ * visited in random, increasing and decreasing order with every EVC decoder
+ * of the build. For each seek, the time from av_seek_frame() to the first
+ * decoded frame and the bytes read from the input are measured, reported as
+ * their 50th, 95th and 99th percentiles.
+ *
+ * The input is opened with the given demuxer options, so that e.g. an EVC
+ * index or a prefetching protocol can be compared with plain seeking.
+ */
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "libavformat/avformat.h"
+
+#include "libavcodec/avcodec.h"
+
+#include "libavutil/dict.h"
+#include "libavutil/error.h"
+#include "libavutil/frame.h"
+#include "libavutil/lfg.h"
+#include "libavutil/mathematics.h"
+#include "libavutil/mem.h"
+#include "libavutil/qsort.h"
+#include "libavutil/time.h"
+
+typedef struct SeekBenchContext {
+    const char *filename;
+    const char *threads;
+    AVDictionary *format_opts;
+
+    int64_t *targets;       // seek targets in the stream time base, in random order
+    int   nb_targets;
+    int64_t *order;         // targets in the order of the current pattern
+
+    int64_t *times;         // time to the first frame of every seek, in microseconds
+    int64_t *bytes;         // bytes read by every seek
+} SeekBenchContext;
+
+static const int percentiles[] = { 50, 95, 99 };
+
+static int cmp_int64(const void *a, const void *b)
+{
+    int64_t va = *(const int64_t *)a, vb = *(const int64_t *)b;
+    return FFDIFFSIGN(va, vb);
+}
+
+// nearest-rank percentile of sorted values
+static int64_t percentile(const int64_t *v, int nb, int p)
+{
+    return v[FFMIN((nb * p + 99) / 100, nb) - 1];
+}
+
+static int open_input(SeekBenchContext *sc, AVFormatContext **fmt, int *idx)
+{
+    AVDictionary *opts = NULL;
+    int ret;
+
+    av_dict_copy(&opts, sc->format_opts, 0);
+    ret = avformat_open_input(fmt, sc->filename, NULL, &opts);
+    av_dict_free(&opts);
+    if (ret < 0) {
+        fprintf(stderr, "Error opening input file: %s\n", av_err2str(ret));
+        return ret;
+    }
+
+    ret = avformat_find_stream_info(*fmt, NULL);
+    if (ret < 0)
+        return ret;
+
+    *idx = av_find_best_stream(*fmt, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0);
+    if (*idx < 0 || (*fmt)->streams[*idx]->codecpar->codec_id != AV_CODEC_ID_EVC) {
+        fprintf(stderr, "No EVC stream in the input\n");
+        return AVERROR(EINVAL);
+    }
+
+    return 0;
+}
+
+// the raw EVC demuxer does not know the duration, the stream is read through then
+static int stream_range(AVFormatContext *fmt, int idx, int64_t *start, int64_t *end)
+{
+    AVStream *st = fmt->streams[idx];
+    AVPacket *pkt;
+    int ret;
+
+    *start = st->start_time != AV_NOPTS_VALUE ? st->start_time : 0;
+    if (st->duration != AV_NOPTS_VALUE && st->duration > 0) {
+        *end = *start + st->duration;
+        return 0;
+    }
+
+    pkt = av_packet_alloc();
+    if (!pkt)
+        return AVERROR(ENOMEM);
+
+    *end = *start;
+    while ((ret = av_read_frame(fmt, pkt)) >= 0) {
+        if (pkt->stream_index == idx && pkt->pts != AV_NOPTS_VALUE)
+            *end = FFMAX(*end, pkt->pts + pkt->duration);
+        av_packet_unref(pkt);
+    }
+    av_packet_free(&pkt);
+    if (ret != AVERROR_EOF)
+        return ret;
+
+    return *end > *start ? 0 : AVERROR(EINVAL);
+}
+
+static int init_targets(SeekBenchContext *sc, unsigned seed)
+{
+    AVFormatContext *fmt = NULL;
+    int64_t start, end;
+    AVLFG lfg;
+    int idx, ret;
+
+    ret = open_input(sc, &fmt, &idx);
+    if (ret < 0)
+        goto end;
+
+    ret = stream_range(fmt, idx, &start, &end);
+    if (ret < 0) {
+        fprintf(stderr, "Cannot tell the duration of the EVC stream\n");
+        goto end;
+    }
+
+    sc->targets = av_calloc(sc->nb_targets, sizeof(*sc->targets));
+    sc->order   = av_calloc(sc->nb_targets, sizeof(*sc->order));
+    sc->times   = av_calloc(sc->nb_targets, sizeof(*sc->times));
+    sc->bytes   = av_calloc(sc->nb_targets, sizeof(*sc->bytes));
+    if (!sc->targets || !sc->order || !sc->times || !sc->bytes) {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+
+    av_lfg_init(&lfg, seed);
+    for (int i = 0; i < sc->nb_targets; i++)
+        sc->targets[i] = start + av_rescale(av_lfg_get(&lfg), end - start, UINT32_MAX + 1LL);
+
+end:
+    avformat_close_input(&fmt);
+    return ret;
+}
+
+// decode from the current position up to the first frame
+static int first_frame(AVFormatContext *fmt, int idx, AVCodecContext *dec,
+                       AVPacket *pkt, AVFrame *frame)
+{
+    int eof = 0, ret;
+
+    while (1) {
+        ret = avcodec_receive_frame(dec, frame);
+        if (ret >= 0) {
+            av_frame_unref(frame);
+            return 0;
+        }
+        if (ret != AVERROR(EAGAIN))
+            return ret;
+
+        if (!eof) {
+            ret = av_read_frame(fmt, pkt);
+            if (ret == AVERROR_EOF)
+                eof = 1;
+            else if (ret < 0)
+                return ret;
+            else if (pkt->stream_index != idx) {
+                av_packet_unref(pkt);
+                continue;
+            }
+        }
+
+        ret = avcodec_send_packet(dec, eof ? NULL : pkt);
+        av_packet_unref(pkt);
+        if (ret < 0)
+            return ret;
+    }
+}
+
+static int bench_pattern(SeekBenchContext *sc, const AVCodec *codec, const char *pattern)
+{
+    AVFormatContext *fmt = NULL;
+    AVCodecContext *dec = NULL;
+    AVDictionary *opts = NULL;
+    AVPacket *pkt = av_packet_alloc();
+    AVFrame *frame = av_frame_alloc();
+    int idx, ret;
+
+    if (!pkt || !frame) {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+
+    ret = open_input(sc, &fmt, &idx);
+    if (ret < 0)
+        goto end;
+
+    dec = avcodec_alloc_context3(codec);
+    if (!dec) {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+    ret = avcodec_parameters_to_context(dec, fmt->streams[idx]->codecpar);
+    if (ret < 0)
+        goto end;
+    dec->pkt_timebase = fmt->streams[idx]->time_base;
+
+    av_dict_set(&opts, "threads", sc->threads, 0);
+    ret = avcodec_open2(dec, codec, &opts);
+    if (ret < 0)
+        goto end;
+
+    memcpy(sc->order, sc->targets, sc->nb_targets * sizeof(*sc->order));
+    if (strcmp(pattern, "random"))
+        AV_QSORT(sc->order, sc->nb_targets, int64_t, cmp_int64);
+    if (!strcmp(pattern, "backward")) {
+        for (int i = 0; i < sc->nb_targets / 2; i++)
+            FFSWAP(int64_t, sc->order[i], sc->order[sc->nb_targets - 1 - i]);
+    }
+
+    for (int i = 0; i < sc->nb_targets; i++) {
+        int64_t bytes = fmt->pb ? fmt->pb->bytes_read : 0;
+        int64_t t     = av_gettime_relative();
+
+        ret = av_seek_frame(fmt, idx, sc->order[i], AVSEEK_FLAG_BACKWARD);
+        if (ret < 0) {
+            fprintf(stderr, "Seeking to %"PRId64" failed: %s\n", sc->order[i], av_err2str(ret));
+            goto end;
+        }
+        avcodec_flush_buffers(dec);
+
+        ret = first_frame(fmt, idx, dec, pkt, frame);
+        if (ret < 0) {
+            fprintf(stderr, "No frame decoded after seeking to %"PRId64": %s\n",
+                    sc->order[i], av_err2str(ret));
+            goto end;
+        }
+
+        sc->times[i] = av_gettime_relative() - t;
+        sc->bytes[i] = fmt->pb ? fmt->pb->bytes_read - bytes : 0;
+    }
+
+    AV_QSORT(sc->times, sc->nb_targets, int64_t, cmp_int64);
+    AV_QSORT(sc->bytes, sc->nb_targets, int64_t, cmp_int64);
+
+    printf("%-16s %-8s", codec->name, pattern);
+    for (int j = 0; j < FF_ARRAY_ELEMS(percentiles); j++)
+        printf(" %8.2f", percentile(sc->times, sc->nb_targets, percentiles[j]) / 1000.0);
+    for (int j = 0; j < FF_ARRAY_ELEMS(percentiles); j++)
+        printf(" %10"PRId64, percentile(sc->bytes, sc->nb_targets, percentiles[j]));
+    printf("\n");
+
+end:
+    if (ret < 0)
+        fprintf(stderr, "%s (%s): %s\n", codec->name, pattern, av_err2str(ret));
+    av_dict_free(&opts);
+    avcodec_free_context(&dec);
+    avformat_close_input(&fmt);
+    av_frame_free(&frame);
+    av_packet_free(&pkt);
+    return ret;
+}
+
+int main(int argc, char **argv)
+{
+    static const char *const patterns[] = { "random", "forward", "backward" };
+    SeekBenchContext sc = { .threads = "1", .nb_targets = 100 };
+    const AVCodec *codec;
+    void *it = NULL;
+    unsigned seed = 1;
+    int nb_decoders = 0;
+    int ret;
+
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s <input file> [<seek count> [<thread count> [<seed> [<demuxer options>]]]]\n"
+                "The demuxer options are a :-separated list of key=value pairs.\n", argv[0]);
+        return 1;
+    }
+
+    sc.filename = argv[1];
+    if (argc > 2)
+        sc.nb_targets = strtol(argv[2], NULL, 0);
+    if (argc > 3)
+        sc.threads = argv[3];
+    if (argc > 4)
+        seed = strtoul(argv[4], NULL, 0);
+    if (argc > 5 && av_dict_parse_string(&sc.format_opts, argv[5], "=", ":", 0) < 0) {
+        fprintf(stderr, "Invalid demuxer options: %s\n", argv[5]);
+        return 1;
+    }
+    if (sc.nb_targets <= 0) {
+        fprintf(stderr, "Invalid seek count\n");
+        return 1;
+    }
+
+    ret = init_targets(&sc, seed);
+    if (ret < 0)
+        goto end;
+
+    printf("%-16s %-8s %8s %8s %8s %10s %10s %10s\n", "decoder", "pattern",
+           "p50 ms", "p95 ms", "p99 ms", "p50 bytes", "p95 bytes", "p99 bytes");
+
+    // the native decoder and the wrappers of external libraries alike
+    while ((codec = av_codec_iterate(&it))) {
+        if (codec->id != AV_CODEC_ID_EVC || !av_codec_is_decoder(codec))
+            continue;
+        nb_decoders++;
+
+        for (int i = 0; i < FF_ARRAY_ELEMS(patterns); i++) {
+            ret = bench_pattern(&sc, codec, patterns[i]);
+            if (ret < 0)
+                goto end;
+        }
+    }
+    if (!nb_decoders)
+        fprintf(stderr, "No EVC decoder available\n");
+
+end:
+    av_dict_free(&sc.format_opts);
+    av_freep(&sc.targets);
+    av_freep(&sc.order);
+    av_freep(&sc.times);
+    av_freep(&sc.bytes);
+
+    return ret < 0 || !nb_decoders;
+}
@@ -0,0 +1,89 @@
+#!/bin/sh
+#
+# This file is part of FFmpeg.
+#
+# FFmpeg is free software; you can redistribute it and/or
+# modify it under the terms of the GNU Lesser General Public
+# License as published by the Free Software Foundation; either
+# version 2.1 of the License, or (at your option) any later version.
+#
+# FFmpeg is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+# Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public
+# License along with FFmpeg; if not, write to the Free Software
+# Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+
+# Share the bitrate of a distributed libxeve encode among its shards.
+#
+# Every shard is first encoded at a constant QP, or CRF, with the libxeve
+# stats_log option; the bits a shard took per frame are its complexity.
+# The shards are then given bitrates proportional to their complexity,
+# bounded by a maximum ratio to the average, so that the bits of the whole
+# title average to the target bitrate. One CSV line per shard, in the order
+# of the statistics files, is written to the standard output.
+
+set -e
+
+LC_ALL=C
+export LC_ALL
+
+RATIO=4
+
+show_help(){
+    cat <<EOF
+Usage: $0 [options] <bitrate> <stats_log> [<stats_log>...]
+
+<bitrate>       average bitrate of the title, in bits per second
+-r <ratio>      maximum ratio between the bitrate of a shard and the average (default: $RATIO)
+
+The CSV is written to the standard output.
+EOF
+    exit $1
+}
+
+while getopts r:h OPT; do
+    case $OPT in
+        r) RATIO=$OPTARG ;;
+        h) show_help 0 ;;
+        *) show_help 1 ;;
+    esac
+done
+shift $(($OPTIND - 1))
+test $# -gt 1 || show_help 1
+BITRATE=$1
+shift
+
+echo shard,frames,bits,complexity,bitrate
+
+awk -v bitrate=$BITRATE -v ratio=$RATIO '
+    FNR == 1 {
+        n++
+        name[n] = FILENAME
+        next
+    }
+    {
+        split($0, col, ",")
+        frames[n]++
+        bits[n] += col[6]
+        total_frames++
+        total_bits += col[6]
+    }
+    END {
+        if (!total_bits) {
+            print "No packets in the statistics files" > "/dev/stderr"
+            exit 1
+        }
+        # complexity relative to the average bits per frame, bounded, then scaled back to the target
+        for (i = 1; i <= n; i++) {
+            c[i] = frames[i] ? bits[i] / frames[i] / (total_bits / total_frames) : 1
+            if (c[i] > ratio)     c[i] = ratio
+            if (c[i] < 1 / ratio) c[i] = 1 / ratio
+            weighted += c[i] * frames[i]
+        }
+        for (i = 1; i <= n; i++)
+            printf "%s,%d,%d,%.4f,%d\n", name[i], frames[i], bits[i], c[i],
+                   bitrate * c[i] * total_frames / weighted
+    }' "$@"
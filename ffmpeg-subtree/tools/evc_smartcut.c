@@ -0,0 +1,600 @@
+/*
+ * Copyright (c) 2023
+ *
+ * This file is part of FFmpeg.
+ *
+ * FFmpeg is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * FFmpeg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with FFmpeg; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/*
+ * Frame accurate trimming of an EVC stream, re-encoding only the partial
+ * GOPs at the cut points.
+ *
+ * The input is read one GOP at a time, a GOP running from an IDR picture
+ * to the next one. The GOPs entirely inside the requested range are stream
+ * copied, the GOPs containing the start or the end of the range are decoded
+ * and their pictures inside the range encoded again, with the profile and
+ * level of the source. All the packets go through the evc_splice bitstream
+ * filter, which renumbers the parameter sets of the re-encoded parts and
+ * inserts the ones of the copied parts when they are not in band.
+ *
+ * Only the EVC video stream is written. The re-encoded pictures are coded
+ * without B pictures and given the decoding delay of the source, so that the
+ * timestamps stay monotonic across the joins.
+ */
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "libavformat/avformat.h"
+
+#include "libavcodec/avcodec.h"
+#include "libavcodec/bsf.h"
+
+#include "libavutil/dict.h"
+#include "libavutil/error.h"
+#include "libavutil/frame.h"
+#include "libavutil/mathematics.h"
+#include "libavutil/mem.h"
+#include "libavutil/parseutils.h"
+
+typedef struct CutContext {
+    AVFormatContext *ifmt;
+    AVFormatContext *ofmt;
+    AVStream *ist;
+    AVStream *ost;
+
+    // input parameters, with the last parameter sets found in band
+    AVCodecParameters *par;
+    AVBSFContext *extract;
+    AVPacket *extract_pkt;
+
+    AVBSFContext *bsf;
+    const char *output;
+
+    const char *encoder;
+    AVDictionary *enc_opts;
+
+    // requested range, in the input stream time base
+    int64_t start;
+    int64_t end;
+
+    // packets of the current GOP
+    AVPacket **gop;
+    int     nb_gop;
+    unsigned gop_size;
+
+    // pts - dts of the last IDR picture of the input
+    int64_t delay;
+
+    // the packets of the next GOP come from a new source
+    int new_source;
+
+    int64_t nb_copied;
+    int64_t nb_encoded;
+} CutContext;
+
+static int open_output(CutContext *cc, const AVCodecParameters *par)
+{
+    const AVBitStreamFilter *filter = av_bsf_get_by_name("evc_splice");
+    int ret;
+
+    if (!filter) {
+        fprintf(stderr, "The evc_splice bitstream filter is not available\n");
+        return AVERROR_BSF_NOT_FOUND;
+    }
+
+    ret = avformat_alloc_output_context2(&cc->ofmt, NULL, NULL, cc->output);
+    if (ret < 0)
+        return ret;
+
+    ret = av_bsf_alloc(filter, &cc->bsf);
+    if (ret < 0)
+        return ret;
+    ret = avcodec_parameters_copy(cc->bsf->par_in, par);
+    if (ret < 0)
+        return ret;
+    // without global header, the first parameter sets are sent in band
+    if (!(cc->ofmt->oformat->flags & AVFMT_GLOBALHEADER)) {
+        av_freep(&cc->bsf->par_in->extradata);
+        cc->bsf->par_in->extradata_size = 0;
+        cc->new_source = 1;
+    }
+    cc->bsf->time_base_in = cc->ist->time_base;
+    ret = av_bsf_init(cc->bsf);
+    if (ret < 0)
+        return ret;
+
+    cc->ost = avformat_new_stream(cc->ofmt, NULL);
+    if (!cc->ost)
+        return AVERROR(ENOMEM);
+    ret = avcodec_parameters_copy(cc->ost->codecpar, cc->bsf->par_out);
+    if (ret < 0)
+        return ret;
+    cc->ost->codecpar->codec_tag = 0;
+    cc->ost->time_base           = cc->bsf->time_base_out;
+    cc->ost->avg_frame_rate      = cc->ist->avg_frame_rate;
+
+    if (!(cc->ofmt->oformat->flags & AVFMT_NOFILE)) {
+        ret = avio_open(&cc->ofmt->pb, cc->output, AVIO_FLAG_WRITE);
+        if (ret < 0)
+            return ret;
+    }
+    return avformat_write_header(cc->ofmt, NULL);
+}
+
+static int write_packet(CutContext *cc, AVPacket *pkt)
+{
+    int ret;
+
+    pkt->stream_index = 0;
+    if (pkt->pts != AV_NOPTS_VALUE)
+        pkt->pts -= cc->start;
+    if (pkt->dts != AV_NOPTS_VALUE)
+        pkt->dts -= cc->start;
+
+    ret = av_bsf_send_packet(cc->bsf, pkt);
+    if (ret < 0)
+        return ret;
+
+    while ((ret = av_bsf_receive_packet(cc->bsf, pkt)) >= 0) {
+        av_packet_rescale_ts(pkt, cc->bsf->time_base_out, cc->ost->time_base);
+        ret = av_interleaved_write_frame(cc->ofmt, pkt);
+        if (ret < 0)
+            return ret;
+    }
+
+    return ret == AVERROR(EAGAIN) ? 0 : ret;
+}
+
+// The parameter sets of a new source are given as new extradata, they are
+// inserted in band by evc_splice if the source does not repeat them.
+static int write_source_packet(CutContext *cc, const AVCodecParameters *par,
+                               AVPacket *pkt)
+{
+    int ret;
+
+    if (!cc->bsf) {
+        ret = open_output(cc, par);
+        if (ret < 0)
+            return ret;
+    }
+    if (cc->new_source && par->extradata_size) {
+        uint8_t *side_data = av_packet_new_side_data(pkt, AV_PKT_DATA_NEW_EXTRADATA,
+                                                     par->extradata_size);
+        if (!side_data)
+            return AVERROR(ENOMEM);
+        memcpy(side_data, par->extradata, par->extradata_size);
+    }
+    cc->new_source = 0;
+
+    return write_packet(cc, pkt);
+}
+
+static int copy_gop(CutContext *cc)
+{
+    int ret;
+
+    for (int i = 0; i < cc->nb_gop; i++) {
+        ret = write_source_packet(cc, cc->par, cc->gop[i]);
+        if (ret < 0)
+            return ret;
+        cc->nb_copied++;
+    }
+    return 0;
+}
+
+static int open_encoder(CutContext *cc, const AVFrame *frame,
+                        AVCodecContext **penc, AVCodecParameters *par)
+{
+    const AVCodec *codec = avcodec_find_encoder_by_name(cc->encoder);
+    AVCodecContext *enc;
+    AVDictionary *opts = NULL;
+    int ret;
+
+    if (!codec) {
+        fprintf(stderr, "Encoder %s not found\n", cc->encoder);
+        return AVERROR_ENCODER_NOT_FOUND;
+    }
+
+    enc = *penc = avcodec_alloc_context3(codec);
+    if (!enc)
+        return AVERROR(ENOMEM);
+    enc->width               = frame->width;
+    enc->height              = frame->height;
+    enc->pix_fmt             = frame->format;
+    enc->sample_aspect_ratio = frame->sample_aspect_ratio;
+    enc->color_range         = frame->color_range;
+    enc->color_primaries     = frame->color_primaries;
+    enc->color_trc           = frame->color_trc;
+    enc->colorspace          = frame->colorspace;
+    enc->time_base           = cc->ist->time_base;
+    enc->framerate           = cc->ist->avg_frame_rate.num ? cc->ist->avg_frame_rate :
+                                                             (AVRational){ 25, 1 };
+    enc->level               = cc->ist->codecpar->level;
+
+    av_dict_copy(&opts, cc->enc_opts, 0);
+    if (cc->ist->codecpar->profile == FF_PROFILE_EVC_MAIN)
+        av_dict_set(&opts, "profile", "main", AV_DICT_DONT_OVERWRITE);
+    else if (cc->ist->codecpar->profile == FF_PROFILE_EVC_BASELINE)
+        av_dict_set(&opts, "profile", "baseline", AV_DICT_DONT_OVERWRITE);
+    av_dict_set(&opts, "bf", "0", AV_DICT_DONT_OVERWRITE);
+
+    ret = avcodec_open2(enc, codec, &opts);
+    av_dict_free(&opts);
+    if (ret < 0)
+        return ret;
+
+    return avcodec_parameters_from_context(par, enc);
+}
+
+static int encode(CutContext *cc, AVCodecContext *enc,
+                  const AVCodecParameters *par, AVFrame *frame, AVPacket *pkt)
+{
+    int ret = avcodec_send_frame(enc, frame);
+    if (ret < 0)
+        return ret;
+
+    while ((ret = avcodec_receive_packet(enc, pkt)) >= 0) {
+        // the source decoding delay keeps the dts before the copied pictures
+        pkt->dts = pkt->pts - cc->delay;
+        ret = write_source_packet(cc, par, pkt);
+        if (ret < 0)
+            return ret;
+        cc->nb_encoded++;
+    }
+
+    return ret == AVERROR(EAGAIN) || ret == AVERROR_EOF ? 0 : ret;
+}
+
+// Decode the current GOP and encode its pictures inside the range.
+static int transcode_gop(CutContext *cc)
+{
+    const AVCodec *codec = avcodec_find_decoder(cc->ist->codecpar->codec_id);
+    AVCodecContext *dec = NULL, *enc = NULL;
+    AVCodecParameters *par = avcodec_parameters_alloc();
+    AVFrame *frame = av_frame_alloc();
+    AVPacket *pkt = av_packet_alloc();
+    int ret;
+
+    if (!par || !frame || !pkt) {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+    if (!codec) {
+        fprintf(stderr, "No decoder for the input stream\n");
+        ret = AVERROR_DECODER_NOT_FOUND;
+        goto end;
+    }
+
+    dec = avcodec_alloc_context3(codec);
+    if (!dec) {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+    ret = avcodec_parameters_to_context(dec, cc->par);
+    if (ret < 0)
+        goto end;
+    dec->pkt_timebase = cc->ist->time_base;
+    ret = avcodec_open2(dec, codec, NULL);
+    if (ret < 0)
+        goto end;
+
+    for (int i = 0; i <= cc->nb_gop; i++) {
+        ret = avcodec_send_packet(dec, i < cc->nb_gop ? cc->gop[i] : NULL);
+        if (ret < 0)
+            goto end;
+
+        while ((ret = avcodec_receive_frame(dec, frame)) >= 0) {
+            frame->pts = frame->best_effort_timestamp;
+            if (frame->pts < cc->start || frame->pts >= cc->end) {
+                av_frame_unref(frame);
+                continue;
+            }
+
+            if (!enc) {
+                ret = open_encoder(cc, frame, &enc, par);
+                if (ret < 0)
+                    goto end;
+                cc->new_source = 1;
+            }
+
+            frame->pict_type = AV_PICTURE_TYPE_NONE;
+            ret = encode(cc, enc, par, frame, pkt);
+            av_frame_unref(frame);
+            if (ret < 0)
+                goto end;
+        }
+        if (ret != AVERROR(EAGAIN) && ret != AVERROR_EOF)
+            goto end;
+    }
+
+    ret = enc ? encode(cc, enc, par, NULL, pkt) : 0;
+    // the next copied GOP has to send its parameter sets again
+    cc->new_source = 1;
+
+end:
+    avcodec_free_context(&dec);
+    avcodec_free_context(&enc);
+    avcodec_parameters_free(&par);
+    av_frame_free(&frame);
+    av_packet_free(&pkt);
+    return ret;
+}
+
+// Process the current GOP, covering [gop_start, gop_end) of the input.
+static int flush_gop(CutContext *cc, int64_t gop_end)
+{
+    int64_t gop_start;
+    int ret = 0;
+
+    if (!cc->nb_gop)
+        return 0;
+    gop_start = cc->gop[0]->pts;
+
+    if (gop_end > cc->start && gop_start < cc->end) {
+        if (gop_start >= cc->start && gop_end <= cc->end)
+            ret = copy_gop(cc);
+        else
+            ret = transcode_gop(cc);
+    }
+
+    for (int i = 0; i < cc->nb_gop; i++)
+        av_packet_free(&cc->gop[i]);
+    cc->nb_gop = 0;
+
+    return ret;
+}
+
+// Keep the parameter sets of the input, the GOPs following the cut points
+// may not repeat them.
+static int update_extradata(CutContext *cc, const AVPacket *pkt)
+{
+    const uint8_t *side_data;
+    size_t size;
+    int ret;
+
+    ret = av_packet_ref(cc->extract_pkt, pkt);
+    if (ret < 0)
+        return ret;
+    ret = av_bsf_send_packet(cc->extract, cc->extract_pkt);
+    if (ret < 0)
+        return ret;
+    ret = av_bsf_receive_packet(cc->extract, cc->extract_pkt);
+    if (ret < 0)
+        return ret;
+
+    side_data = av_packet_get_side_data(cc->extract_pkt, AV_PKT_DATA_NEW_EXTRADATA, &size);
+    if (side_data) {
+        av_freep(&cc->par->extradata);
+        cc->par->extradata_size = 0;
+        cc->par->extradata = av_mallocz(size + AV_INPUT_BUFFER_PADDING_SIZE);
+        if (!cc->par->extradata) {
+            ret = AVERROR(ENOMEM);
+            goto end;
+        }
+        memcpy(cc->par->extradata, side_data, size);
+        cc->par->extradata_size = size;
+    }
+
+end:
+    av_packet_unref(cc->extract_pkt);
+    return ret;
+}
+
+static int add_packet(CutContext *cc, AVPacket *pkt)
+{
+    AVPacket **gop;
+
+    gop = av_fast_realloc(cc->gop, &cc->gop_size, (cc->nb_gop + 1) * sizeof(*gop));
+    if (!gop)
+        return AVERROR(ENOMEM);
+    cc->gop = gop;
+
+    cc->gop[cc->nb_gop] = av_packet_clone(pkt);
+    if (!cc->gop[cc->nb_gop])
+        return AVERROR(ENOMEM);
+    cc->nb_gop++;
+
+    return 0;
+}
+
+static int smartcut(CutContext *cc, const char *input)
+{
+    AVPacket *pkt = av_packet_alloc();
+    int ret, idx;
+
+    if (!pkt)
+        return AVERROR(ENOMEM);
+
+    ret = avformat_open_input(&cc->ifmt, input, NULL, NULL);
+    if (ret < 0)
+        goto end;
+    ret = avformat_find_stream_info(cc->ifmt, NULL);
+    if (ret < 0)
+        goto end;
+
+    idx = av_find_best_stream(cc->ifmt, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0);
+    if (idx < 0 || cc->ifmt->streams[idx]->codecpar->codec_id != AV_CODEC_ID_EVC) {
+        fprintf(stderr, "No EVC stream in %s\n", input);
+        ret = AVERROR_STREAM_NOT_FOUND;
+        goto end;
+    }
+    cc->ist = cc->ifmt->streams[idx];
+
+    cc->par         = avcodec_parameters_alloc();
+    cc->extract_pkt = av_packet_alloc();
+    if (!cc->par || !cc->extract_pkt) {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+    ret = avcodec_parameters_copy(cc->par, cc->ist->codecpar);
+    if (ret < 0)
+        goto end;
+
+    ret = av_bsf_list_parse_str("extract_extradata=remove=0", &cc->extract);
+    if (ret < 0)
+        goto end;
+    ret = avcodec_parameters_copy(cc->extract->par_in, cc->ist->codecpar);
+    if (ret < 0)
+        goto end;
+    cc->extract->time_base_in = cc->ist->time_base;
+    ret = av_bsf_init(cc->extract);
+    if (ret < 0)
+        goto end;
+
+    cc->start = av_rescale_q(cc->start, AV_TIME_BASE_Q, cc->ist->time_base);
+    if (cc->end != INT64_MAX)
+        cc->end = av_rescale_q(cc->end, AV_TIME_BASE_Q, cc->ist->time_base);
+    if (cc->ist->start_time != AV_NOPTS_VALUE) {
+        cc->start += cc->ist->start_time;
+        if (cc->end != INT64_MAX)
+            cc->end += cc->ist->start_time;
+    }
+
+    while ((ret = av_read_frame(cc->ifmt, pkt)) >= 0) {
+        if (pkt->stream_index != idx || pkt->pts == AV_NOPTS_VALUE) {
+            av_packet_unref(pkt);
+            continue;
+        }
+
+        if (pkt->flags & AV_PKT_FLAG_KEY) {
+            if (pkt->dts != AV_NOPTS_VALUE)
+                cc->delay = pkt->pts - pkt->dts;
+            ret = flush_gop(cc, pkt->pts);
+            if (ret < 0)
+                goto end;
+            if (pkt->pts >= cc->end) {
+                av_packet_unref(pkt);
+                break;
+            }
+        }
+
+        ret = update_extradata(cc, pkt);
+        if (ret >= 0)
+            ret = add_packet(cc, pkt);
+        av_packet_unref(pkt);
+        if (ret < 0)
+            goto end;
+    }
+    if (ret < 0 && ret != AVERROR_EOF)
+        goto end;
+    ret = 0;
+
+    // the last GOP ends with its last picture
+    if (cc->nb_gop) {
+        int64_t gop_end = INT64_MIN;
+
+        for (int i = 0; i < cc->nb_gop; i++)
+            gop_end = FFMAX(gop_end, cc->gop[i]->pts + FFMAX(cc->gop[i]->duration, 1));
+        ret = flush_gop(cc, gop_end);
+    }
+    if (ret < 0)
+        goto end;
+
+    if (!cc->bsf) {
+        fprintf(stderr, "Nothing in the requested range\n");
+        ret = AVERROR(EINVAL);
+        goto end;
+    }
+
+    ret = av_bsf_send_packet(cc->bsf, NULL);
+    if (ret >= 0) {
+        while ((ret = av_bsf_receive_packet(cc->bsf, pkt)) >= 0) {
+            av_packet_rescale_ts(pkt, cc->bsf->time_base_out, cc->ost->time_base);
+            ret = av_interleaved_write_frame(cc->ofmt, pkt);
+            if (ret < 0)
+                goto end;
+        }
+        if (ret == AVERROR_EOF)
+            ret = 0;
+    }
+    if (ret < 0)
+        goto end;
+
+    ret = av_write_trailer(cc->ofmt);
+    if (ret < 0)
+        goto end;
+
+    printf("%"PRId64" packets copied, %"PRId64" packets re-encoded\n",
+           cc->nb_copied, cc->nb_encoded);
+
+end:
+    av_packet_free(&pkt);
+    return ret;
+}
+
+int main(int argc, char **argv)
+{
+    CutContext cc = { .encoder = "libxeve", .end = INT64_MAX };
+    int64_t duration = AV_NOPTS_VALUE;
+    int i, ret;
+
+    for (i = 1; i + 1 < argc && argv[i][0] == '-'; i += 2) {
+        if (!strcmp(argv[i], "-ss")) {
+            ret = av_parse_time(&cc.start, argv[i + 1], 1);
+        } else if (!strcmp(argv[i], "-to")) {
+            ret = av_parse_time(&cc.end, argv[i + 1], 1);
+        } else if (!strcmp(argv[i], "-t")) {
+            ret = av_parse_time(&duration, argv[i + 1], 1);
+        } else if (!strcmp(argv[i], "-c")) {
+            cc.encoder = argv[i + 1];
+            ret = 0;
+        } else if (!strcmp(argv[i], "-opts")) {
+            ret = av_dict_parse_string(&cc.enc_opts, argv[i + 1], "=", ":", 0);
+        } else {
+            break;
+        }
+        if (ret < 0) {
+            fprintf(stderr, "Invalid value '%s' for %s\n", argv[i + 1], argv[i]);
+            return 1;
+        }
+    }
+
+    if (argc - i != 2) {
+        fprintf(stderr, "Usage: %s [-ss <start>] [-to <end> | -t <duration>] "
+                "[-c <encoder>] [-opts <key=value:...>] <input file> <output file>\n",
+                argv[0]);
+        return 1;
+    }
+    if (duration != AV_NOPTS_VALUE)
+        cc.end = cc.start + duration;
+    if (cc.end <= cc.start) {
+        fprintf(stderr, "The end of the range must be after its start\n");
+        return 1;
+    }
+    cc.output = argv[i + 1];
+
+    ret = smartcut(&cc, argv[i]);
+    if (ret < 0)
+        fprintf(stderr, "Error: %s\n", av_err2str(ret));
+
+    for (i = 0; i < cc.nb_gop; i++)
+        av_packet_free(&cc.gop[i]);
+    av_freep(&cc.gop);
+    av_bsf_free(&cc.bsf);
+    av_bsf_free(&cc.extract);
+    av_packet_free(&cc.extract_pkt);
+    avcodec_parameters_free(&cc.par);
+    if (cc.ofmt && !(cc.ofmt->oformat->flags & AVFMT_NOFILE))
+        avio_closep(&cc.ofmt->pb);
+    avformat_free_context(cc.ofmt);
+    avformat_close_input(&cc.ifmt);
+    av_dict_free(&cc.enc_opts);
+
+    return ret < 0;
+}
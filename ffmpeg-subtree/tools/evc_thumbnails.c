@@ -0,0 +1,344 @@
+/*
+ * Copyright (c) 2023
+ *
+ * This file is part of FFmpeg.
+ *
+ * FFmpeg is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * FFmpeg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with FFmpeg; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/*
+ * Decode the first keyframe of many EVC inputs on a pool of worker threads.
+ *
+ * Every input is a request, identified by its position on the command line.
+ * Each worker opens a single threaded EVC decoder once and takes the next
+ * request until none is left: it reads the parameter sets and the first
+ * keyframe access unit of the input, drains the decoder for its picture and
+ * flushes it for the next request. The extradata of the input is sent as
+ * side data with the access unit, so the same decoder serves inputs with
+ * different parameter sets. The decoder setup is thus paid once per thread
+ * instead of once per input, and the cores are kept busy with as many
+ * pictures at once as there are workers.
+ *
+ * One line is printed per request, in request order. With -o, the pictures
+ * are written as raw images to files named after a pattern containing %d,
+ * which is replaced by the request id.
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "libavformat/avformat.h"
+
+#include "libavcodec/avcodec.h"
+
+#include "libavutil/avstring.h"
+#include "libavutil/cpu.h"
+#include "libavutil/error.h"
+#include "libavutil/imgutils.h"
+#include "libavutil/mem.h"
+#include "libavutil/pixdesc.h"
+#include "libavutil/thread.h"
+#include "libavutil/time.h"
+
+typedef struct ThumbRequest {
+    const char *input;
+
+    // result
+    int ret;
+    int width, height;
+    enum AVPixelFormat pix_fmt;
+    int64_t time;           // time spent reading and decoding, in microseconds
+} ThumbRequest;
+
+typedef struct ThumbPool {
+    const AVCodec *codec;
+    const char *output;     // pattern of the picture files, NULL to not write them
+
+    ThumbRequest *requests;
+    int nb_requests;
+    atomic_int next;        // next request to be taken by a worker
+} ThumbPool;
+
+typedef struct ThumbWorker {
+    ThumbPool *pool;
+    AVCodecContext *dec;
+    AVPacket *pkt;
+    AVFrame *frame;
+    int ret;
+} ThumbWorker;
+
+// Read the first keyframe of the EVC stream of an input.
+static int read_keyframe(AVFormatContext *fmt, int stream_index, AVPacket *pkt)
+{
+    const AVCodecParameters *par = fmt->streams[stream_index]->codecpar;
+    int ret;
+
+    while ((ret = av_read_frame(fmt, pkt)) >= 0) {
+        if (pkt->stream_index == stream_index && (pkt->flags & AV_PKT_FLAG_KEY))
+            break;
+        av_packet_unref(pkt);
+    }
+    if (ret < 0)
+        return ret == AVERROR_EOF ? AVERROR_INVALIDDATA : ret;
+
+    // the parameter sets of the request replace the ones of the previous one
+    if (par->extradata_size) {
+        uint8_t *side_data = av_packet_new_side_data(pkt, AV_PKT_DATA_NEW_EXTRADATA,
+                                                     par->extradata_size);
+        if (!side_data) {
+            av_packet_unref(pkt);
+            return AVERROR(ENOMEM);
+        }
+        memcpy(side_data, par->extradata, par->extradata_size);
+    }
+
+    return 0;
+}
+
+// Decode a single access unit, leaving the decoder flushed for the next request.
+static int decode_keyframe(ThumbWorker *w, const AVPacket *pkt)
+{
+    int ret;
+
+    ret = avcodec_send_packet(w->dec, pkt);
+    if (ret >= 0)
+        ret = avcodec_send_packet(w->dec, NULL);
+    if (ret >= 0)
+        ret = avcodec_receive_frame(w->dec, w->frame);
+    avcodec_flush_buffers(w->dec);
+
+    return ret == AVERROR_EOF ? AVERROR_INVALIDDATA : ret;
+}
+
+static int write_picture(const char *pattern, int id, const AVFrame *frame)
+{
+    char filename[1024];
+    uint8_t *buf;
+    FILE *f;
+    int size, ret;
+
+    if (av_get_frame_filename(filename, sizeof(filename), pattern, id) < 0)
+        return AVERROR(EINVAL);
+
+    size = av_image_get_buffer_size(frame->format, frame->width, frame->height, 1);
+    if (size < 0)
+        return size;
+    buf = av_malloc(size);
+    if (!buf)
+        return AVERROR(ENOMEM);
+    ret = av_image_copy_to_buffer(buf, size, (const uint8_t * const *)frame->data,
+                                  frame->linesize, frame->format,
+                                  frame->width, frame->height, 1);
+    if (ret >= 0) {
+        f = fopen(filename, "wb");
+        if (!f)
+            ret = AVERROR(errno);
+        else {
+            if (fwrite(buf, 1, size, f) != size)
+                ret = AVERROR(EIO);
+            if (fclose(f))
+                ret = AVERROR(EIO);
+        }
+    }
+    av_free(buf);
+
+    return ret < 0 ? ret : 0;
+}
+
+static int run_request(ThumbWorker *w, int id)
+{
+    ThumbRequest *req = &w->pool->requests[id];
+    AVFormatContext *fmt = NULL;
+    int64_t start = av_gettime_relative();
+    int idx, ret;
+
+    // no stream probing, the parameter sets come from the extradata or in band
+    ret = avformat_open_input(&fmt, req->input, NULL, NULL);
+    if (ret < 0)
+        goto end;
+
+    idx = av_find_best_stream(fmt, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0);
+    if (idx < 0 || fmt->streams[idx]->codecpar->codec_id != AV_CODEC_ID_EVC) {
+        ret = AVERROR_STREAM_NOT_FOUND;
+        goto end;
+    }
+
+    ret = read_keyframe(fmt, idx, w->pkt);
+    if (ret < 0)
+        goto end;
+    ret = decode_keyframe(w, w->pkt);
+    av_packet_unref(w->pkt);
+    if (ret < 0)
+        goto end;
+
+    req->width   = w->frame->width;
+    req->height  = w->frame->height;
+    req->pix_fmt = w->frame->format;
+    if (w->pool->output)
+        ret = write_picture(w->pool->output, id, w->frame);
+    av_frame_unref(w->frame);
+
+end:
+    avformat_close_input(&fmt);
+    req->time = av_gettime_relative() - start;
+    req->ret  = ret;
+
+    return ret;
+}
+
+static void *thumb_worker(void *arg)
+{
+    ThumbWorker *w = arg;
+    ThumbPool *pool = w->pool;
+    int id;
+
+    w->dec = avcodec_alloc_context3(pool->codec);
+    if (!w->dec) {
+        w->ret = AVERROR(ENOMEM);
+        return NULL;
+    }
+    // the requests are decoded in parallel, not the pictures
+    w->dec->thread_count = 1;
+    w->ret = avcodec_open2(w->dec, pool->codec, NULL);
+    if (w->ret < 0)
+        return NULL;
+
+    while ((id = atomic_fetch_add(&pool->next, 1)) < pool->nb_requests)
+        run_request(w, id);
+
+    return NULL;
+}
+
+int main(int argc, char **argv)
+{
+    ThumbPool pool = { 0 };
+    ThumbWorker *workers = NULL;
+    pthread_t *threads = NULL;
+    int nb_threads = av_cpu_count(), nb_started = 0, nb_failed = 0;
+    int64_t start;
+    int i, ret = 0;
+
+    for (i = 1; i + 1 < argc && argv[i][0] == '-'; i += 2) {
+        if (!strcmp(argv[i], "-threads")) {
+            nb_threads = atoi(argv[i + 1]);
+            if (nb_threads <= 0) {
+                fprintf(stderr, "Invalid thread count '%s'\n", argv[i + 1]);
+                return 1;
+            }
+        } else if (!strcmp(argv[i], "-decoder")) {
+            pool.codec = avcodec_find_decoder_by_name(argv[i + 1]);
+            if (!pool.codec || pool.codec->id != AV_CODEC_ID_EVC) {
+                fprintf(stderr, "No EVC decoder named '%s'\n", argv[i + 1]);
+                return 1;
+            }
+        } else if (!strcmp(argv[i], "-o")) {
+            pool.output = argv[i + 1];
+        } else {
+            break;
+        }
+    }
+
+    if (i >= argc) {
+        fprintf(stderr, "Usage: %s [-threads <count>] [-decoder <name>] [-o <picture file pattern>] "
+                "<input file> [<input file>...]\n"
+                "The pattern of the raw picture files contains %%d, replaced by the request id.\n",
+                argv[0]);
+        return 1;
+    }
+    if (!pool.codec)
+        pool.codec = avcodec_find_decoder(AV_CODEC_ID_EVC);
+    if (!pool.codec) {
+        fprintf(stderr, "No EVC decoder available\n");
+        return 1;
+    }
+
+    pool.nb_requests = argc - i;
+    pool.requests    = av_calloc(pool.nb_requests, sizeof(*pool.requests));
+    nb_threads       = FFMIN(nb_threads, pool.nb_requests);
+    workers          = av_calloc(nb_threads, sizeof(*workers));
+    threads          = av_calloc(nb_threads, sizeof(*threads));
+    if (!pool.requests || !workers || !threads) {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+    for (int j = 0; j < pool.nb_requests; j++)
+        pool.requests[j].input = argv[i + j];
+    atomic_init(&pool.next, 0);
+
+    start = av_gettime_relative();
+    for (nb_started = 0; nb_started < nb_threads; nb_started++) {
+        ThumbWorker *w = &workers[nb_started];
+
+        w->pool  = &pool;
+        w->pkt   = av_packet_alloc();
+        w->frame = av_frame_alloc();
+        if (!w->pkt || !w->frame) {
+            av_packet_free(&w->pkt);
+            av_frame_free(&w->frame);
+            ret = AVERROR(ENOMEM);
+            break;
+        }
+        ret = pthread_create(&threads[nb_started], NULL, thumb_worker, w);
+        if (ret) {
+            av_packet_free(&w->pkt);
+            av_frame_free(&w->frame);
+            ret = AVERROR(ret);
+            break;
+        }
+    }
+    for (int j = 0; j < nb_started; j++) {
+        pthread_join(threads[j], NULL);
+        if (workers[j].ret < 0 && ret >= 0)
+            ret = workers[j].ret;
+    }
+    if (ret < 0)
+        goto end;
+
+    for (int j = 0; j < pool.nb_requests; j++) {
+        const ThumbRequest *req = &pool.requests[j];
+
+        if (req->ret < 0) {
+            printf("%d %s error: %s\n", j, req->input, av_err2str(req->ret));
+            nb_failed++;
+        } else {
+            printf("%d %s %dx%d %s %"PRId64" us\n", j, req->input, req->width, req->height,
+                   av_get_pix_fmt_name(req->pix_fmt), req->time);
+        }
+    }
+    printf("%d pictures, %d failed, with %d threads in %"PRId64" ms\n",
+           pool.nb_requests - nb_failed, nb_failed, nb_threads,
+           (av_gettime_relative() - start) / 1000);
+
+end:
+    if (ret < 0)
+        fprintf(stderr, "Error: %s\n", av_err2str(ret));
+
+    if (workers) {
+        for (int j = 0; j < nb_started; j++) {
+            avcodec_free_context(&workers[j].dec);
+            av_packet_free(&workers[j].pkt);
+            av_frame_free(&workers[j].frame);
+        }
+    }
+    av_freep(&workers);
+    av_freep(&threads);
+    av_freep(&pool.requests);
+
+    return ret < 0 || nb_failed;
+}
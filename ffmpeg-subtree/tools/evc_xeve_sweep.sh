@@ -0,0 +1,127 @@
+#!/bin/sh
+#
+# This file is part of FFmpeg.
+#
+# FFmpeg is free software; you can redistribute it and/or
+# modify it under the terms of the GNU Lesser General Public
+# License as published by the Free Software Foundation; either
+# version 2.1 of the License, or (at your option) any later version.
+#
+# FFmpeg is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+# Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public
+# License along with FFmpeg; if not, write to the Free Software
+# Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+
+# Speed and quality of libxeve over presets, tunes, thread counts and B frame
+# settings, one CSV line per clip and configuration.
+#
+# Every configuration is encoded by a separate ffmpeg run, so that its peak
+# RSS is its own. The CPU time and the RSS are those of the whole process,
+# decoding the clip included; fps is that of the encoder alone when ffmpeg
+# reports the time spent in each stage.
+
+set -e
+
+LC_ALL=C
+export LC_ALL
+
+FFMPEG=ffmpeg
+PRESETS=ultrafast,superfast,fast,medium,slow,placebo
+TUNES=none
+THREADS=1
+BFRAMES=15
+FRAMES=
+OPTS=
+PSNR=
+
+show_help(){
+    cat <<EOF
+Usage: $0 [options] <clip> [<clip>...]
+
+-f <ffmpeg>     ffmpeg binary to use (default: $FFMPEG)
+-p <presets>    comma separated presets (default: $PRESETS)
+-t <tunes>      comma separated tunes (default: $TUNES)
+-j <threads>    comma separated thread counts (default: $THREADS)
+-b <bf>         comma separated maximum numbers of B frames (default: $BFRAMES)
+-n <frames>     number of frames encoded from every clip (default: all)
+-o <options>    further ffmpeg output options, e.g. "-qp 27"
+-s              compute the luma PSNR of the encoded frames (8-bit input only)
+
+The CSV is written to the standard output.
+EOF
+    exit $1
+}
+
+while getopts f:p:t:j:b:n:o:sh OPT; do
+    case $OPT in
+        f) FFMPEG=$OPTARG ;;
+        p) PRESETS=$OPTARG ;;
+        t) TUNES=$OPTARG ;;
+        j) THREADS=$OPTARG ;;
+        b) BFRAMES=$OPTARG ;;
+        n) FRAMES="-frames:v $OPTARG" ;;
+        o) OPTS=$OPTARG ;;
+        s) PSNR="-flags +psnr" ;;
+        h) show_help 0 ;;
+        *) show_help 1 ;;
+    esac
+done
+shift $(($OPTIND - 1))
+test $# -gt 0 || show_help 1
+
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+
+echo clip,preset,tune,threads,bf,frames,fps,cpu_seconds,real_seconds,peak_rss_kb,bits,bits_per_frame,psnr_y
+
+for CLIP in "$@"; do
+for PRESET in $(echo $PRESETS | tr , ' '); do
+for TUNE in $(echo $TUNES | tr , ' '); do
+for THREAD in $(echo $THREADS | tr , ' '); do
+for BF in $(echo $BFRAMES | tr , ' '); do
+    if ! $FFMPEG -nostdin -hide_banner -benchmark -i "$CLIP" -map 0:v:0 $FRAMES \
+            -c:v libxeve -preset $PRESET -tune $TUNE -threads $THREAD -bf $BF $PSNR $OPTS \
+            -vstats_file "$TMP/vstats" -f null - > "$TMP/log" 2>&1; then
+        echo "Encoding $CLIP with preset=$PRESET tune=$TUNE threads=$THREAD bf=$BF failed:" >&2
+        tail -n 5 "$TMP/log" >&2
+        exit 1
+    fi
+
+    # the encoder statistics, then the per-frame sizes and PSNR, averaged over the squared errors
+    awk -v clip="$CLIP" -v preset=$PRESET -v tune=$TUNE -v threads=$THREAD -v bf=$BF '
+        !vstats && /bench: utime=/ {
+            for (i = 2; i <= NF; i++) {
+                split($i, kv, "=")
+                if (kv[1] == "utime" || kv[1] == "stime") cpu += kv[2]
+                if (kv[1] == "rtime")                     real = kv[2] + 0
+            }
+        }
+        !vstats && /bench: encode stream/ {
+            fps = substr($0, index($0, "(") + 1) + 0
+        }
+        !vstats && /bench: maxrss=/ {
+            rss = substr($0, index($0, "=") + 1) + 0
+        }
+        vstats {
+            frames++
+            for (i = 1; i < NF; i++) {
+                if ($i == "f_size=") bits += 8 * $(i + 1)
+                if ($i == "PSNR=") { err += exp(-$(i + 1) / 10 * log(10)); n++ }
+            }
+        }
+        END {
+            if (!fps && real > 0)
+                fps = frames / real
+            psnr = n ? (err > 0 ? sprintf("%.3f", -10 * log(err / n) / log(10)) : "inf") : ""
+            printf "%s,%s,%s,%s,%s,%d,%.2f,%.3f,%.3f,%d,%d,%.1f,%s\n", clip, preset, tune, threads, bf,
+                   frames, fps, cpu, real, rss, bits, frames ? bits / frames : 0, psnr
+        }' "$TMP/log" vstats=1 "$TMP/vstats"
+done
+done
+done
+done
+done